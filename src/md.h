@@ -32,6 +32,7 @@ struct md_pkey_spec_t;
 
 #define MD_PKEY_RSA_BITS_MIN       2048
 #define MD_PKEY_RSA_BITS_DEF       2048
+#define MD_PKEY_EC_CURVE_DEF       "P-256"
 
 /* Minimum age for the HSTS header (RFC 6797), considered appropriate by Mozilla Security */
 #define MD_HSTS_HEADER             "Strict-Transport-Security"
@@ -71,6 +72,12 @@ typedef enum {
     MD_SG_STAGING,
     MD_SG_ARCHIVE,
     MD_SG_TMP,
+    MD_SG_KEYPOOL,
+    MD_SG_OCSP,
+    MD_SG_LOCKS,
+    MD_SG_LEASES,
+    MD_SG_ISSUERS,
+    MD_SG_STATS,
     MD_SG_COUNT,
 } md_store_group_t;
 
@@ -92,11 +99,14 @@ struct md_t {
     
     int drive_mode;                 /* mode of obtaining credentials */
     struct md_pkey_spec_t *pkey_spec;/* specification for generating new private keys */
+    struct apr_array_header_t *alt_pkey_specs; /* md_pkey_spec_t* of additional certificates */
     int must_staple;                /* certificates should set the OCSP Must Staple extension */
     apr_interval_time_t renew_norm; /* if > 0, normalized cert lifetime */
     apr_interval_time_t renew_window;/* time before expiration that starts renewal */
     
     const char *ca_url;             /* url of CA certificate service */
+    struct apr_array_header_t *ca_urls; /* CAs to fail over to, ca_url first, or NULL */
+    const char *ca_effective;       /* url of the CA used for the certificate or NULL */
     const char *ca_proto;           /* protocol used vs CA (e.g. ACME) */
     const char *ca_account;         /* account used at CA */
     const char *ca_agreement;       /* accepted agreement uri between CA and user */ 
@@ -116,64 +126,114 @@ struct md_t {
 #define MD_KEY_ACCOUNT          "account"
 #define MD_KEY_ACME_TLS_1       "acme-tls/1"
 #define MD_KEY_AGREEMENT        "agreement"
+#define MD_KEY_ALT_PKEYS        "alt-privkeys"
+#define MD_KEY_ASPECTS          "aspects"
 #define MD_KEY_AUTHORIZATIONS   "authorizations"
 #define MD_KEY_BITS             "bits"
+#define MD_KEY_BUCKETS          "buckets"
 #define MD_KEY_CA               "ca"
 #define MD_KEY_CA_URL           "ca-url"
 #define MD_KEY_CERT             "cert"
 #define MD_KEY_CERTIFICATE      "certificate"
+#define MD_KEY_CERTS            "certs"
 #define MD_KEY_CHALLENGES       "challenges"
 #define MD_KEY_CMD_DNS01        "cmd-dns-01"
+#define MD_KEY_CMD_DNS01_BATCH  "cmd-dns-01-batch"
 #define MD_KEY_CONTACT          "contact"
 #define MD_KEY_CONTACTS         "contacts"
+#define MD_KEY_COUNT            "count"
 #define MD_KEY_CSR              "csr"
+#define MD_KEY_CURVE            "curve"
 #define MD_KEY_DETAIL           "detail"
 #define MD_KEY_DISABLED         "disabled"
 #define MD_KEY_DIR              "dir"
+#define MD_KEY_DNS01_CHECK      "dns-01-check"
+#define MD_KEY_DNS01_CHECK_TIMEOUT "dns-01-check-timeout"
 #define MD_KEY_DOMAIN           "domain"
 #define MD_KEY_DOMAINS          "domains"
 #define MD_KEY_DRIVE_MODE       "drive-mode"
+#define MD_KEY_EFFECTIVE        "effective"
+#define MD_KEY_END              "end"
+#define MD_KEY_ERROR_RUNS       "error-runs"
 #define MD_KEY_ERRORS           "errors"
+#define MD_KEY_ETAG             "etag"
 #define MD_KEY_EXPIRES          "expires"
 #define MD_KEY_FINALIZE         "finalize"
+#define MD_KEY_FINGERPRINT      "fingerprint"
+#define MD_KEY_FORMAT           "format"
+#define MD_KEY_HEARTBEAT        "heartbeat"
+#define MD_KEY_HITS             "hits"
 #define MD_KEY_HTTP             "http"
 #define MD_KEY_HTTPS            "https"
 #define MD_KEY_ID               "id"
 #define MD_KEY_IDENTIFIER       "identifier"
 #define MD_KEY_KEY              "key"
 #define MD_KEY_KEYAUTHZ         "keyAuthorization"
+#define MD_KEY_LAST_ERROR       "last-error"
+#define MD_KEY_LAST_MS          "last-ms"
+#define MD_KEY_LAST_STATUS      "last-status"
+#define MD_KEY_LE               "le"
 #define MD_KEY_LOCATION         "location"
+#define MD_KEY_MDS              "mds"
+#define MD_KEY_MISSES           "misses"
+#define MD_KEY_MODIFIED         "modified"
+#define MD_KEY_MS               "ms"
 #define MD_KEY_MUST_STAPLE      "must-staple"
 #define MD_KEY_NAME             "name"
+#define MD_KEY_NAMES            "names"
+#define MD_KEY_NEXT_CHECK       "next-check"
 #define MD_KEY_ORDERS           "orders"
+#define MD_KEY_OWNER            "owner"
 #define MD_KEY_PERMANENT        "permanent"
+#define MD_KEY_PHASES           "phases"
 #define MD_KEY_PKEY             "privkey"
 #define MD_KEY_PROCESSED        "processed"
 #define MD_KEY_PROTO            "proto"
+#define MD_KEY_RATE             "rate"
+#define MD_KEY_RECORDS          "records"
 #define MD_KEY_REGISTRATION     "registration"
 #define MD_KEY_RENEW            "renew"
+#define MD_KEY_RENEW_AT         "renew-at"
+#define MD_KEY_RENEWALS         "renewals"
+#define MD_KEY_RENEWAL_INFO     "renewal-info"
 #define MD_KEY_RENEW_WINDOW     "renew-window"
+#define MD_KEY_REQUESTS         "requests"
 #define MD_KEY_REQUIRE_HTTPS    "require-https"
 #define MD_KEY_RESOURCE         "resource"
+#define MD_KEY_RETRY_AT         "retry-at"
+#define MD_KEY_SERIAL           "serial"
+#define MD_KEY_START            "start"
 #define MD_KEY_STATE            "state"
+#define MD_KEY_RESPONSE         "response"
 #define MD_KEY_STATUS           "status"
+#define MD_KEY_SUGGESTED_WINDOW "suggestedWindow"
 #define MD_KEY_STORE            "store"
 #define MD_KEY_TEMPORARY        "temporary"
 #define MD_KEY_TOKEN            "token"
 #define MD_KEY_TRANSITIVE       "transitive"
 #define MD_KEY_TYPE             "type"
+#define MD_KEY_UP               "up"
 #define MD_KEY_URL              "url"
+#define MD_KEY_URLS             "urls"
 #define MD_KEY_URI              "uri"
 #define MD_KEY_VALID_FROM       "validFrom"
+#define MD_KEY_VALID_UNTIL      "validUntil"
 #define MD_KEY_VALUE            "value"
 #define MD_KEY_VERSION          "version"
+#define MD_KEY_WHAT             "what"
 
 #define MD_FN_MD                "md.json"
 #define MD_FN_JOB               "job.json"
 #define MD_FN_PRIVKEY           "privkey.pem"
 #define MD_FN_PUBCERT           "pubcert.pem"
+#define MD_FN_OCSP              "ocsp.json"
 #define MD_FN_CERT              "cert.pem"
+#define MD_FN_CSR               "csr.json"
 #define MD_FN_HTTPD_JSON        "httpd.json"
+#define MD_FN_SYNC_JSON         "sync.json"
+#define MD_FN_LEASE             "lease.json"
+#define MD_FN_ISSUER            "issuer.json"
+#define MD_FN_STORE_JSON        "md_store.json"
 
 #define MD_FN_FALLBACK_PKEY     "fallback-privkey.pem"
 #define MD_FN_FALLBACK_CERT     "fallback-cert.pem"
@@ -190,9 +250,11 @@ struct md_t {
 int md_contains(const md_t *md, const char *domain, int case_sensitive);
 
 /**
- * Determine if the names of the two managed domains overlap.
+ * Determine if the names of the two managed domains overlap. Long domain lists
+ * are compared with the help of a temporary sub pool of p, unless p is NULL.
+ * The same holds for all functions below that take a pool.
  */
-int md_domains_overlap(const md_t *md1, const md_t *md2);
+int md_domains_overlap(const md_t *md1, const md_t *md2, apr_pool_t *p);
 
 /**
  * Determine if the domain names are equal.
@@ -202,17 +264,17 @@ int md_equal_domains(const md_t *md1, const md_t *md2, int case_sensitive);
 /**
  * Determine if the domains in md1 contain all domains of md2.
  */
-int md_contains_domains(const md_t *md1, const md_t *md2);
+int md_contains_domains(const md_t *md1, const md_t *md2, apr_pool_t *p);
 
 /**
  * Get one common domain name of the two managed domains or NULL.
  */
-const char *md_common_name(const md_t *md1, const md_t *md2);
+const char *md_common_name(const md_t *md1, const md_t *md2, apr_pool_t *p);
 
 /**
  * Get the number of common domains.
  */
-apr_size_t md_common_name_count(const md_t *md1, const md_t *md2);
+apr_size_t md_common_name_count(const md_t *md1, const md_t *md2, apr_pool_t *p);
 
 /**
  * Look up a managed domain by its name.
@@ -228,13 +290,52 @@ md_t *md_get_by_domain(struct apr_array_header_t *mds, const char *domain);
  * Find a managed domain, different from the given one, that has overlaps
  * in the domain list.
  */
-md_t *md_get_by_dns_overlap(struct apr_array_header_t *mds, const md_t *md);
+md_t *md_get_by_dns_overlap(struct apr_array_header_t *mds, const md_t *md, 
+                            apr_pool_t *p);
 
 /**
  * Find the managed domain in the list that, for the given md, 
  * has the same name, or the most number of overlaps in domains
  */
-md_t *md_find_closest_match(apr_array_header_t *mds, const md_t *md);
+md_t *md_find_closest_match(apr_array_header_t *mds, const md_t *md, apr_pool_t *p);
+
+/**************************************************************************************************/
+/* domain index */
+
+typedef struct md_domain_index_t md_domain_index_t;
+
+/**
+ * Create an index for looking up managed domains by name and DNS name. 
+ * Lookups are case-insensitive. 
+ * @param mds   the managed domains to add, may be NULL
+ */
+md_domain_index_t *md_domain_index_make(apr_pool_t *p, struct apr_array_header_t *mds);
+
+/**
+ * Add the name and all domains of md to the index. Domains already indexed
+ * for another managed domain are not changed.
+ */
+void md_domain_index_add(md_domain_index_t *idx, md_t *md);
+
+/**
+ * Look up a managed domain in the index, same as md_get_by_name() and 
+ * md_get_by_domain() on the indexed array.
+ */
+md_t *md_domain_index_get_by_name(const md_domain_index_t *idx, const char *name);
+md_t *md_domain_index_get_by_domain(const md_domain_index_t *idx, const char *domain);
+
+/**
+ * Look up the managed domain with a DNS name matching domain. Looks for 
+ * the domain itself and, if not found, a wildcard covering it.
+ */
+md_t *md_domain_index_find_match(const md_domain_index_t *idx, const char *domain);
+
+/**
+ * Get a domain name of md that is indexed for another managed domain, or NULL.
+ * @param pother    the other managed domain, if not NULL
+ */
+const char *md_domain_index_common_name(const md_domain_index_t *idx, const md_t *md, 
+                                        md_t **pother);
 
 /**
  * Create and empty md record, structures initialized.
@@ -256,6 +357,12 @@ md_t *md_clone(apr_pool_t *p, const md_t *src);
  */
 md_t *md_copy(apr_pool_t *p, const md_t *src);
 
+/**
+ * The url of the CA the certificate of the md is staged at or was obtained from,
+ * its ca_url when that is not known.
+ */
+const char *md_ca_effective(const md_t *md);
+
 /**
  * Create a merged md with the settings of add overlaying the ones from base.
  */
@@ -274,6 +381,11 @@ md_t *md_from_json(struct md_json_t *json, apr_pool_t *p);
  */
 int md_should_renew(const md_t *md);
 
+/**
+ * Get the time when the MD should renew its cert, 0 if the expiry is not known.
+ */
+apr_time_t md_renew_at(const md_t *md);
+
 /**************************************************************************************************/
 /* domain credentials */
 
@@ -21,6 +21,7 @@
 #include <apr_strings.h>
 #include <apr_buckets.h>
 #include <apr_hash.h>
+#include <apr_thread_mutex.h>
 #include <apr_uri.h>
 
 #include "md.h"
@@ -88,12 +89,30 @@ static apr_status_t problem_status_get(const char *type) {
 /**************************************************************************************************/
 /* acme requests */
 
+/* Every response from the server carries a fresh nonce. We keep a few of them, so
+ * that a POST does not have to ask for a new one first. */
+static void nonce_push(md_acme_t *acme, const char *nonce)
+{
+    if (acme->nonces_count >= MD_ACME_NONCES_MAX) {
+        /* drop the oldest one, it is the most likely to have expired */
+        memmove(acme->nonces, acme->nonces + 1, 
+                (MD_ACME_NONCES_MAX - 1) * sizeof(acme->nonces[0]));
+        --acme->nonces_count;
+    }
+    acme->nonces[acme->nonces_count++] = apr_pstrdup(acme->p, nonce);
+}
+
+static const char *nonce_pop(md_acme_t *acme)
+{
+    return (acme->nonces_count > 0)? acme->nonces[--acme->nonces_count] : NULL;
+}
+
 static void req_update_nonce(md_acme_t *acme, apr_table_t *hdrs)
 {
     if (hdrs) {
         const char *nonce = apr_table_get(hdrs, "Replay-Nonce");
         if (nonce) {
-            acme->nonce = apr_pstrdup(acme->p, nonce);
+            nonce_push(acme, nonce);
         }
     }
 }
@@ -104,7 +123,7 @@ static apr_status_t http_update_nonce(const md_http_response_t *res)
         const char *nonce = apr_table_get(res->headers, "Replay-Nonce");
         if (nonce) {
             md_acme_t *acme = res->req->baton;
-            acme->nonce = apr_pstrdup(acme->p, nonce);
+            nonce_push(acme, nonce);
         }
     }
     return res->rv;
@@ -132,7 +151,8 @@ static md_acme_req_t *md_acme_req_create(md_acme_t *acme, const char *method, co
     req->method = method;
     req->url = url;
     req->prot_hdrs = apr_table_make(pool, 5);
-    if (!req->prot_hdrs) {
+    req->req_hdrs = apr_table_make(pool, 2);
+    if (!req->prot_hdrs || !req->req_hdrs) {
         apr_pool_destroy(pool);
         return NULL;
     }
@@ -151,10 +171,542 @@ static apr_status_t acmev2_new_nonce(md_acme_t *acme)
     return md_http_HEAD(acme->http, acme->api.v2.new_nonce, NULL, http_update_nonce, acme);
 }
 
+static apr_status_t nonces_fetch(md_acme_t *acme, int n, int wait)
+{
+    apr_status_t rv = APR_SUCCESS;
+    int i, deferred;
+    
+    if (!md_http_can_defer(acme->http)) {
+        /* one at a time, when we need it */
+        return wait? acme->new_nonce_fn(acme) : APR_SUCCESS;
+    }
+    
+    /* Submitted requests are carried out together with the next request or
+     * when we wait for them. */
+    deferred = md_http_set_deferred(acme->http, 1);
+    for (i = 0; i < n && APR_SUCCESS == rv; ++i) {
+        rv = acme->new_nonce_fn(acme);
+    }
+    md_http_set_deferred(acme->http, deferred);
+    if (APR_SUCCESS == rv && wait) {
+        rv = md_http_await_all(acme->http);
+    }
+    return rv;
+}
+
+
+/**************************************************************************************************/
+/* process wide cache of ACME server directories and accounts */
+
+#define MD_ACME_CACHE_TTL       apr_time_from_sec(30 * 60)
+
+typedef struct {
+    apr_pool_t *dir_p;
+    md_json_t *dir;
+    apr_time_t dir_expires;
+    
+    apr_pool_t *acct_p;
+    const char *acct_id;
+    md_json_t *acct;
+    md_pkey_t *acct_key;
+    apr_time_t acct_expires;
+    
+    apr_time_t rl_tat[MD_ACME_RL_COUNT]; /* of the rate limit buckets, see rl_next() */
+    apr_hash_t *rl_domains;         /* registered domain -> apr_time_t tat for certs */
+    apr_time_t rl_blocked_until;    /* the CA asked us to stay away until then */
+    
+    apr_interval_time_t ca_rtt;     /* average of directory and new order requests */
+    int ca_failures;                /* requests in a row the CA did not answer properly */
+    apr_time_t ca_failed_at;        /* of the last of those */
+} acme_cache_entry;
+
+static apr_pool_t *cache_pool;
+static apr_hash_t *cache;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *cache_mutex;
+#endif
+
+static apr_status_t cache_cleanup(void *data)
+{
+    (void)data;
+    cache_pool = NULL;
+    cache = NULL;
+#if APR_HAS_THREADS
+    cache_mutex = NULL;
+#endif
+    return APR_SUCCESS;
+}
+
+static void cache_init(apr_pool_t *p)
+{
+    if (cache_pool || APR_SUCCESS != apr_pool_create(&cache_pool, p)) {
+        return;
+    }
+    apr_pool_tag(cache_pool, "md_acme_cache");
+#if APR_HAS_THREADS
+    if (APR_SUCCESS != apr_thread_mutex_create(&cache_mutex, APR_THREAD_MUTEX_DEFAULT, 
+                                               cache_pool)) {
+        apr_pool_destroy(cache_pool);
+        cache_pool = NULL;
+        return;
+    }
+#endif
+    cache = apr_hash_make(cache_pool);
+    apr_pool_cleanup_register(cache_pool, NULL, cache_cleanup, apr_pool_cleanup_null);
+}
+
+static void cache_lock(void)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cache_mutex);
+#endif
+}
+
+static void cache_unlock(void)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cache_mutex);
+#endif
+}
+
+/* call with lock held */
+static acme_cache_entry *cache_entry_get(const char *url, int create)
+{
+    acme_cache_entry *entry;
+    
+    entry = apr_hash_get(cache, url, APR_HASH_KEY_STRING);
+    if (!entry && create) {
+        entry = apr_pcalloc(cache_pool, sizeof(*entry));
+        if (APR_SUCCESS != apr_pool_create(&entry->dir_p, cache_pool)
+            || APR_SUCCESS != apr_pool_create(&entry->acct_p, cache_pool)) {
+            return NULL;
+        }
+        apr_hash_set(cache, apr_pstrdup(cache_pool, url), APR_HASH_KEY_STRING, entry);
+    }
+    return entry;
+}
+
+static int dir_cache_get(md_acme_t *acme, md_json_t **pjson)
+{
+    acme_cache_entry *entry;
+    int found = 0;
+    
+    if (!cache) {
+        return 0;
+    }
+    cache_lock();
+    entry = cache_entry_get(acme->url, 0);
+    if (entry && entry->dir && apr_time_now() < entry->dir_expires) {
+        *pjson = md_json_clone(acme->p, entry->dir);
+        found = (*pjson != NULL);
+    }
+    cache_unlock();
+    return found;
+}
+
+static void dir_cache_set(md_acme_t *acme, md_json_t *json)
+{
+    acme_cache_entry *entry;
+    
+    if (!cache) {
+        return;
+    }
+    cache_lock();
+    if ((entry = cache_entry_get(acme->url, 1))) {
+        apr_pool_clear(entry->dir_p);
+        entry->dir = md_json_clone(entry->dir_p, json);
+        entry->dir_expires = apr_time_now() + MD_ACME_CACHE_TTL;
+    }
+    cache_unlock();
+}
+
+int md_acme_cache_acct_get(md_acme_t *acme, const char *acct_id)
+{
+    acme_cache_entry *entry;
+    md_acme_acct_t *acct;
+    int found = 0;
+    
+    if (!cache) {
+        return 0;
+    }
+    cache_lock();
+    entry = cache_entry_get(acme->url, 0);
+    if (entry && entry->acct && apr_time_now() < entry->acct_expires
+        && (!acct_id || !strcmp(acct_id, entry->acct_id))
+        && APR_SUCCESS == md_acme_acct_from_json(&acct, md_json_clone(acme->p, entry->acct), 
+                                                 acme->p)) {
+        acme->acct_id = apr_pstrdup(acme->p, entry->acct_id);
+        acme->acct = acct;
+        acme->acct_key = md_pkey_ref(entry->acct_key, acme->p);
+        found = 1;
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, acme->p, 
+                      "using cached account %s for %s", acme->acct_id, acme->url);
+    }
+    cache_unlock();
+    return found;
+}
+
+void md_acme_cache_acct_set(md_acme_t *acme)
+{
+    acme_cache_entry *entry;
+    
+    if (!cache || !acme->acct || !acme->acct_key || !acme->acct_id) {
+        return;
+    }
+    cache_lock();
+    if ((entry = cache_entry_get(acme->url, 1))) {
+        apr_pool_clear(entry->acct_p);
+        entry->acct_id = apr_pstrdup(entry->acct_p, acme->acct_id);
+        entry->acct = md_acme_acct_to_json(acme->acct, entry->acct_p);
+        entry->acct_key = md_pkey_ref(acme->acct_key, entry->acct_p);
+        entry->acct_expires = apr_time_now() + MD_ACME_CACHE_TTL;
+    }
+    cache_unlock();
+}
+
+void md_acme_cache_acct_drop(md_acme_t *acme)
+{
+    acme_cache_entry *entry;
+    
+    if (!cache) {
+        return;
+    }
+    cache_lock();
+    if ((entry = cache_entry_get(acme->url, 0)) && entry->acct) {
+        apr_pool_clear(entry->acct_p);
+        entry->acct_id = NULL;
+        entry->acct = NULL;
+        entry->acct_key = NULL;
+        entry->acct_expires = 0;
+    }
+    cache_unlock();
+}
+
+/**************************************************************************************************/
+/* rate limits */
+
+#define MD_ACME_RL_WAIT_MAX         apr_time_from_sec(10)
+#define MD_ACME_RL_BLOCK_DEFAULT    apr_time_from_sec(5 * 60)
+
+static md_acme_rl_t rl_limits[MD_ACME_RL_COUNT];
+
+void md_acme_rl_configure(const md_acme_rl_t *limits)
+{
+    int i;
+    
+    for (i = 0; i < MD_ACME_RL_COUNT; ++i) {
+        rl_limits[i].count = limits? limits[i].count : 0;
+        rl_limits[i].period = limits? limits[i].period : 0;
+    }
+}
+
+/* A token bucket kept in a single time, as in the generic cell rate algorithm: each 
+ * event moves the theoretical arrival time 'tat' by period/count, starting from now 
+ * at the latest. An event is allowed while tat is less than a period ahead of now.
+ * Returns 0 if it is, else the time when it will be. */
+static apr_time_t rl_next(apr_time_t tat, const md_acme_rl_t *limit, apr_time_t now)
+{
+    apr_interval_time_t tolerance;
+    
+    if (limit->count <= 0 || limit->period <= 0) {
+        return 0;
+    }
+    tolerance = limit->period - limit->period / limit->count;
+    return (tat - tolerance > now)? tat - tolerance : 0;
+}
+
+static void rl_add(apr_time_t *ptat, const md_acme_rl_t *limit, apr_time_t now)
+{
+    if (limit->count > 0 && limit->period > 0) {
+        *ptat = ((*ptat > now)? *ptat : now) + limit->period / limit->count;
+    }
+}
+
+/* call with lock held */
+static apr_time_t *rl_domain_tat(acme_cache_entry *entry, const char *domain, int create)
+{
+    char key[256];
+    apr_time_t *ptat;
+    
+    /* DNS names are case-insensitive, the bucket of a registered domain is kept
+     * under its lower case name */
+    apr_cpystrn(key, md_dns_suffix(domain), sizeof(key));
+    md_util_str_tolower(key);
+    ptat = entry->rl_domains? apr_hash_get(entry->rl_domains, key, APR_HASH_KEY_STRING) : NULL;
+    if (!ptat && create) {
+        if (!entry->rl_domains) {
+            entry->rl_domains = apr_hash_make(cache_pool);
+        }
+        ptat = apr_pcalloc(cache_pool, sizeof(*ptat));
+        apr_hash_set(entry->rl_domains, apr_pstrdup(cache_pool, key), APR_HASH_KEY_STRING, ptat);
+    }
+    return ptat;
+}
+
+/* call with lock held */
+static apr_time_t rl_entry_next(acme_cache_entry *entry, md_acme_rl_kind_t kind, 
+                                apr_array_header_t *domains, apr_time_t now)
+{
+    apr_time_t next, t, *ptat;
+    int i;
+    
+    next = (entry->rl_blocked_until > now)? entry->rl_blocked_until : 0;
+    if (kind == MD_ACME_RL_CERTS) {
+        for (i = 0; domains && i < domains->nelts; ++i) {
+            ptat = rl_domain_tat(entry, APR_ARRAY_IDX(domains, i, const char*), 0);
+            if (ptat && (t = rl_next(*ptat, &rl_limits[kind], now)) > next) {
+                next = t;
+            }
+        }
+        return next;
+    }
+    if (kind == MD_ACME_RL_ORDERS 
+        && (t = rl_next(entry->rl_tat[MD_ACME_RL_FAILED], 
+                        &rl_limits[MD_ACME_RL_FAILED], now)) > next) {
+        next = t;
+    }
+    if ((t = rl_next(entry->rl_tat[kind], &rl_limits[kind], now)) > next) {
+        next = t;
+    }
+    return next;
+}
+
+/* call with lock held */
+static void rl_entry_add(acme_cache_entry *entry, md_acme_rl_kind_t kind, 
+                         apr_array_header_t *domains, apr_time_t now)
+{
+    const char *domain, *reg_domain;
+    int i, j;
+    
+    if (kind != MD_ACME_RL_CERTS) {
+        rl_add(&entry->rl_tat[kind], &rl_limits[kind], now);
+        return;
+    }
+    if (rl_limits[kind].count <= 0 || !domains) {
+        return;
+    }
+    for (i = 0; i < domains->nelts; ++i) {
+        domain = APR_ARRAY_IDX(domains, i, const char*);
+        reg_domain = md_dns_suffix(domain);
+        /* a certificate counts once for each registered domain in it */
+        for (j = 0; j < i; ++j) {
+            if (!apr_strnatcasecmp(reg_domain, 
+                md_dns_suffix(APR_ARRAY_IDX(domains, j, const char*)))) break;
+        }
+        if (j == i) {
+            rl_add(rl_domain_tat(entry, domain, 1), &rl_limits[kind], now);
+        }
+    }
+}
+
+apr_status_t md_acme_rl_take(md_acme_t *acme, md_acme_rl_kind_t kind, 
+                             apr_array_header_t *domains, apr_time_t *pretry_at)
+{
+    acme_cache_entry *entry;
+    apr_time_t now = apr_time_now(), next = 0;
+    
+    if (cache) {
+        cache_lock();
+        if ((entry = cache_entry_get(acme->url, 1))) {
+            next = rl_entry_next(entry, kind, domains, now);
+            if (!next) {
+                rl_entry_add(entry, kind, domains, now);
+            }
+        }
+        cache_unlock();
+    }
+    if (pretry_at) {
+        *pretry_at = next;
+    }
+    return next? APR_BADARG : APR_SUCCESS;
+}
+
+void md_acme_rl_count(md_acme_t *acme, md_acme_rl_kind_t kind, apr_array_header_t *domains)
+{
+    acme_cache_entry *entry;
+    
+    if (!cache) {
+        return;
+    }
+    cache_lock();
+    if ((entry = cache_entry_get(acme->url, 1))) {
+        rl_entry_add(entry, kind, domains, apr_time_now());
+    }
+    cache_unlock();
+}
+
+apr_time_t md_acme_rl_retry_at(const char *ca_url)
+{
+    acme_cache_entry *entry;
+    apr_time_t next = 0;
+    
+    if (!cache || !ca_url) {
+        return 0;
+    }
+    cache_lock();
+    if ((entry = cache_entry_get(ca_url, 0))) {
+        next = rl_entry_next(entry, MD_ACME_RL_ORDERS, NULL, apr_time_now());
+    }
+    cache_unlock();
+    return next;
+}
+
+static void rl_block(md_acme_req_t *req, const md_http_response_t *res)
+{
+    acme_cache_entry *entry;
+    apr_time_t now = apr_time_now(), until;
+    
+    until = md_util_parse_retry_after(apr_table_get(res->headers, "Retry-After"), now);
+    if (until <= now) {
+        until = now + MD_ACME_RL_BLOCK_DEFAULT;
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, req->p, "%s answered %d, no requests for %s", 
+                  req->acme->url, res->status, md_print_duration(req->p, until - now));
+    if (!cache) {
+        return;
+    }
+    cache_lock();
+    if ((entry = cache_entry_get(req->acme->url, 1)) && until > entry->rl_blocked_until) {
+        entry->rl_blocked_until = until;
+    }
+    cache_unlock();
+}
+
+/* Wait for a token to send a request, unless that takes longer than a short while. */
+static apr_status_t rl_await_request(md_acme_req_t *req)
+{
+    apr_time_t retry_at;
+    apr_interval_time_t wait;
+    apr_status_t rv;
+    
+    while (APR_SUCCESS != (rv = md_acme_rl_take(req->acme, MD_ACME_RL_REQUESTS, 
+                                                 NULL, &retry_at))) {
+        wait = retry_at - apr_time_now();
+        if (wait > MD_ACME_RL_WAIT_MAX) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, req->p, 
+                          "rate limited for %s, not sending %s %s", 
+                          md_print_duration(req->p, wait), req->method, req->url);
+            return rv;
+        }
+        if (wait > 0) {
+            apr_sleep(wait);
+        }
+    }
+    return rv;
+}
+
+/**************************************************************************************************/
+/* health of CAs */
+
+#define MD_ACME_CA_SLOW         apr_time_from_sec(10)
+#define MD_ACME_CA_RETRY_MIN    apr_time_from_sec(5 * 60)
+#define MD_ACME_CA_RETRY_MAX    apr_time_from_sec(60 * 60)
+
+/* Statuses of requests that got no proper answer from the CA. A CA that answers with
+ * a problem about what we asked for is healthy. */
+static int ca_failed(apr_status_t rv)
+{
+    return (APR_STATUS_IS_ECONNREFUSED(rv) || APR_STATUS_IS_ECONNABORTED(rv)
+            || APR_STATUS_IS_ECONNRESET(rv) || APR_STATUS_IS_TIMEUP(rv)
+            || APR_STATUS_IS_EOF(rv) || rv == APR_EGENERAL);
+}
+
+void md_acme_ca_health_add(md_acme_t *acme, apr_time_t start, apr_status_t rv)
+{
+    acme_cache_entry *entry;
+    apr_time_t now = apr_time_now();
+    
+    if (!cache) {
+        return;
+    }
+    cache_lock();
+    if ((entry = cache_entry_get(acme->url, 1))) {
+        if (ca_failed(rv)) {
+            ++entry->ca_failures;
+            entry->ca_failed_at = now;
+        }
+        else {
+            entry->ca_failures = 0;
+            entry->ca_rtt = entry->ca_rtt? (3 * entry->ca_rtt + (now - start)) / 4 : now - start;
+        }
+    }
+    cache_unlock();
+}
+
+typedef struct {
+    const char *url;
+    int rank;
+    int idx;
+} ca_rank_t;
+
+/* 0 for CAs answering in time or not asked yet, 1 for slow ones and 2 for the ones
+ * failing lately or not taking orders because of rate limits. Failures are forgotten
+ * after a while, so that the CA is tried again, the longer the more failures it had.
+ * Call with lock held. */
+static int ca_rank(const char *url, apr_time_t now)
+{
+    acme_cache_entry *entry;
+    apr_interval_time_t retry = MD_ACME_CA_RETRY_MIN;
+    int i;
+    
+    if (!cache || !(entry = cache_entry_get(url, 0))) {
+        return 0;
+    }
+    if (entry->ca_failures > 0) {
+        for (i = 1; i < entry->ca_failures && retry < MD_ACME_CA_RETRY_MAX; ++i) {
+            retry *= 2;
+        }
+        if (retry > MD_ACME_CA_RETRY_MAX) {
+            retry = MD_ACME_CA_RETRY_MAX;
+        }
+        if (now < entry->ca_failed_at + retry) {
+            return 2;
+        }
+    }
+    if (rl_entry_next(entry, MD_ACME_RL_ORDERS, NULL, now) > now) {
+        return 2;
+    }
+    return (entry->ca_rtt > MD_ACME_CA_SLOW)? 1 : 0;
+}
+
+static int ca_rank_cmp(const void *v1, const void *v2)
+{
+    const ca_rank_t *r1 = v1, *r2 = v2;
+    
+    if (r1->rank != r2->rank) return r1->rank - r2->rank;
+    return r1->idx - r2->idx;
+}
+
+apr_array_header_t *md_acme_ca_order(apr_array_header_t *urls, apr_pool_t *p)
+{
+    apr_array_header_t *ordered;
+    ca_rank_t *ranks;
+    apr_time_t now = apr_time_now();
+    int i;
+    
+    ordered = apr_array_make(p, urls->nelts, sizeof(const char*));
+    if (urls->nelts <= 0) {
+        return ordered;
+    }
+    ranks = apr_pcalloc(p, (apr_size_t)urls->nelts * sizeof(*ranks));
+    if (cache) cache_lock();
+    for (i = 0; i < urls->nelts; ++i) {
+        ranks[i].url = APR_ARRAY_IDX(urls, i, const char*);
+        ranks[i].rank = ca_rank(ranks[i].url, now);
+        ranks[i].idx = i;
+    }
+    if (cache) cache_unlock();
+    qsort(ranks, (size_t)urls->nelts, sizeof(*ranks), ca_rank_cmp);
+    for (i = 0; i < urls->nelts; ++i) {
+        APR_ARRAY_PUSH(ordered, const char*) = ranks[i].url;
+    }
+    return ordered;
+}
 
 apr_status_t md_acme_init(apr_pool_t *p, const char *base,  int init_ssl)
 {
     base_product = base;
+    cache_init(p);
     return init_ssl? md_crypt_init(p) : APR_SUCCESS;
 }
 
@@ -313,6 +865,19 @@ static apr_status_t on_response(const md_http_response_t *res)
                           apr_table_get(res->headers, "Content-Type"));
         }
     }
+    else if (res->status == 304 && req->on_res 
+             && apr_table_get(req->req_hdrs, "If-None-Match")) {
+        /* conditional request, the resource is unchanged */
+        rv = req->on_res(req->acme, res, req->baton);
+    }
+    else if (res->status == 429 
+             || (res->status == 503 && apr_table_get(res->headers, "Retry-After"))) {
+        rl_block(req, res);
+        /* no retries while the CA wants us to wait */
+        if (APR_EAGAIN == (rv = inspect_problem(req, res))) {
+            rv = APR_BADARG;
+        }
+    }
     else if (APR_EAGAIN == (rv = inspect_problem(req, res))) {
         /* leave req alive */
         return rv;
@@ -333,25 +898,36 @@ static apr_status_t md_acme_req_send(md_acme_req_t *req)
     
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, req->p, 
                   "sending req: %s %s", req->method, req->url);
+    if (APR_SUCCESS != (rv = rl_await_request(req))) {
+        md_acme_req_done(req);
+        return rv;
+    }
     if (strcmp("GET", req->method) && strcmp("HEAD", req->method)) {
         if (acme->version == MD_ACME_VERSION_UNKNOWN) {
             if (APR_SUCCESS != (rv = md_acme_setup(acme))) {
                 return rv;
             }
         }
-        if (!acme->nonce) {
-            if (APR_SUCCESS != (rv = acme->new_nonce_fn(acme))) {
+        if (!acme->nonces_count) {
+            rv = nonces_fetch(acme, MD_ACME_NONCES_PREFETCH, 1);
+            if (APR_SUCCESS == rv && !acme->nonces_count) {
+                rv = APR_EGENERAL;
+            }
+            if (APR_SUCCESS != rv) {
                 md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, req->p, 
                               "error retrieving new nonce from ACME server");
                 return rv;
             }
         }
         
-        apr_table_set(req->prot_hdrs, "nonce", acme->nonce);
+        apr_table_set(req->prot_hdrs, "nonce", nonce_pop(acme));
         if (MD_ACME_VERSION_MAJOR(acme->version) > 1) {
             apr_table_set(req->prot_hdrs, "url", req->url);
         }
-        acme->nonce = NULL;
+        if (!acme->nonces_count) {
+            /* running low, get the next one while this request is underway */
+            nonces_fetch(acme, 1, 0);
+        }
     }
     
     rv = req->on_init? req->on_init(req, req->baton) : APR_SUCCESS;
@@ -374,14 +950,15 @@ static apr_status_t md_acme_req_send(md_acme_req_t *req)
         }
         
         if (!strcmp("GET", req->method)) {
-            rv = md_http_GET(req->acme->http, req->url, NULL, on_response, req);
+            rv = md_http_GET(req->acme->http, req->url, req->req_hdrs, on_response, req);
         }
         else if (!strcmp("POST", req->method)) {
-            rv = md_http_POSTd(req->acme->http, req->url, NULL, "application/jose+json",  
-                               body, body? strlen(body) : 0, on_response, req);
+            rv = md_http_POSTd(req->acme->http, req->url, req->req_hdrs, 
+                               "application/jose+json", body, body? strlen(body) : 0, 
+                               on_response, req);
         }
         else if (!strcmp("HEAD", req->method)) {
-            rv = md_http_HEAD(req->acme->http, req->url, NULL, on_response, req);
+            rv = md_http_HEAD(req->acme->http, req->url, req->req_hdrs, on_response, req);
         }
         else {
             md_log_perror(MD_LOG_MARK, MD_LOG_ERR, 0, req->p, 
@@ -482,6 +1059,66 @@ apr_status_t md_acme_get_json(struct md_json_t **pjson, md_acme_t *acme,
 /**************************************************************************************************/
 /* Generic ACME operations */
 
+typedef struct {
+    apr_time_t start;
+    apr_time_t end;
+    apr_time_t retry_at;
+} renewal_info_ctx;
+
+static apr_status_t on_got_renewal_info(md_acme_t *acme, apr_pool_t *p, 
+                                        const apr_table_t *headers, 
+                                        md_json_t *jbody, void *baton)
+{
+    renewal_info_ctx *ctx = baton;
+    
+    (void)acme;
+    (void)p;
+    ctx->start = md_util_parse_rfc3339(md_json_gets(jbody, MD_KEY_SUGGESTED_WINDOW, 
+                                                    MD_KEY_START, NULL));
+    ctx->end = md_util_parse_rfc3339(md_json_gets(jbody, MD_KEY_SUGGESTED_WINDOW, 
+                                                  MD_KEY_END, NULL));
+    ctx->retry_at = md_util_parse_retry_after(apr_table_get(headers, "Retry-After"), 
+                                              apr_time_now());
+    return (ctx->start > 0 && ctx->end >= ctx->start)? APR_SUCCESS : APR_EINVAL;
+}
+
+apr_status_t md_acme_get_renewal_info(apr_time_t *pstart, apr_time_t *pend, 
+                                      apr_time_t *pretry_at, md_acme_t *acme, 
+                                      md_cert_t *cert, apr_pool_t *p)
+{
+    renewal_info_ctx ctx;
+    const char *id, *base, *url;
+    apr_size_t len;
+    apr_status_t rv;
+    
+    *pstart = *pend = *pretry_at = 0;
+    if (acme->version == MD_ACME_VERSION_UNKNOWN 
+        && APR_SUCCESS != (rv = md_acme_setup(acme))) {
+        return rv;
+    }
+    if (MD_ACME_VERSION_MAJOR(acme->version) < 2 || !acme->api.v2.renewal_info) {
+        return APR_ENOTIMPL;
+    }
+    if (APR_SUCCESS != (rv = md_cert_get_ari_id(&id, cert, p))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, 
+                      "certificate has no authority key id, no renewal info");
+        return rv;
+    }
+    base = acme->api.v2.renewal_info;
+    len = strlen(base);
+    url = apr_pstrcat(p, base, (len > 0 && base[len-1] == '/')? "" : "/", id, NULL);
+    
+    memset(&ctx, 0, sizeof(ctx));
+    rv = md_acme_GET(acme, url, NULL, on_got_renewal_info, NULL, &ctx);
+    if (APR_SUCCESS == rv) {
+        *pstart = ctx.start;
+        *pend = ctx.end;
+        *pretry_at = ctx.retry_at;
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "get renewal info %s", url);
+    return rv;
+}
+
 void md_acme_clear_acct(md_acme_t *acme)
 {
     acme->acct_id = NULL;
@@ -506,13 +1143,18 @@ apr_status_t md_acme_use_acct(md_acme_t *acme, md_store_t *store,
     md_pkey_t *pkey;
     apr_status_t rv;
     
+    if (md_acme_cache_acct_get(acme, acct_id)) {
+        return APR_SUCCESS;
+    }
     if (APR_SUCCESS == (rv = md_acme_acct_load(&acct, &pkey, 
                                                store, MD_SG_ACCOUNTS, acct_id, acme->p))) {
         if (acct->ca_url && !strcmp(acct->ca_url, acme->url)) {
             acme->acct_id = apr_pstrdup(p, acct_id);
             acme->acct = acct;
             acme->acct_key = pkey;
-            rv = md_acme_acct_validate(acme, store, p);
+            if (APR_SUCCESS == (rv = md_acme_acct_validate(acme, store, p))) {
+                md_acme_cache_acct_set(acme);
+            }
         }
         else {
             /* account is from a nother server or, more likely, from another
@@ -525,7 +1167,13 @@ apr_status_t md_acme_use_acct(md_acme_t *acme, md_store_t *store,
 
 apr_status_t md_acme_save_acct(md_acme_t *acme, apr_pool_t *p, md_store_t *store)
 {
-    return md_acme_acct_save(store, p, acme, &acme->acct_id, acme->acct, acme->acct_key);
+    apr_status_t rv;
+    
+    rv = md_acme_acct_save(store, p, acme, &acme->acct_id, acme->acct, acme->acct_key);
+    if (APR_SUCCESS == rv) {
+        md_acme_cache_acct_set(acme);
+    }
+    return rv;
 }
 
 static apr_status_t acmev1_POST_new_account(md_acme_t *acme, 
@@ -604,6 +1252,7 @@ apr_status_t md_acme_setup(md_acme_t *acme)
     apr_status_t rv;
     md_json_t *json;
     const char *s;
+    apr_time_t start;
     
     assert(acme->url);
     acme->version = MD_ACME_VERSION_UNKNOWN;
@@ -613,10 +1262,18 @@ apr_status_t md_acme_setup(md_acme_t *acme)
         return rv;
     }
     md_http_set_response_limit(acme->http, 1024*1024);
+    md_http_set_trace_name(acme->http, acme->trace_name);
     
-    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, acme->p, "get directory from %s", acme->url);
-    
-    rv = md_acme_get_json(&json, acme, acme->url, acme->p);
+    if (dir_cache_get(acme, &json)) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, acme->p, "cached directory of %s", acme->url);
+        rv = APR_SUCCESS;
+    }
+    else {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, acme->p, "get directory from %s", acme->url);
+        start = apr_time_now();
+        rv = md_acme_get_json(&json, acme, acme->url, acme->p);
+        md_acme_ca_health_add(acme, start, rv);
+    }
     if (APR_SUCCESS != rv) {
         md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, 0, acme->p, "unsuccessful in contacting ACME "
                       "server at %s. If this problem persists, please check your network "
@@ -649,6 +1306,7 @@ apr_status_t md_acme_setup(md_acme_t *acme)
         acme->api.v2.revoke_cert = md_json_gets(json, "revokeCert", NULL);
         acme->api.v2.key_change = md_json_gets(json, "keyChange", NULL);
         acme->api.v2.new_nonce = md_json_gets(json, "newNonce", NULL);
+        acme->api.v2.renewal_info = md_json_gets(json, "renewalInfo", NULL);
         if (acme->api.v2.new_account && acme->api.v2.new_order 
             && acme->api.v2.revoke_cert && acme->api.v2.key_change
             && acme->api.v2.new_nonce) {
@@ -665,6 +1323,9 @@ apr_status_t md_acme_setup(md_acme_t *acme)
                       "Unable to understand ACME server response. Wrong ACME protocol version or link?");
         rv = APR_EINVAL;
     }
+    else {
+        dir_cache_set(acme, json);
+    }
 out:
     return rv;
 }
@@ -21,6 +21,7 @@ struct apr_array_header_t;
 struct apr_bucket_brigade;
 struct md_http_response_t;
 struct apr_hash_t;
+struct md_cert_t;
 struct md_http_t;
 struct md_json_t;
 struct md_pkey_t;
@@ -41,6 +42,9 @@ struct md_store_t;
 
 #define MD_ACME_VERSION_MAJOR(i)    (((i)&0xFF0000) >> 16)
 
+#define MD_ACME_NONCES_MAX          8
+#define MD_ACME_NONCES_PREFETCH     2
+
 typedef enum {
     MD_ACME_S_UNKNOWN,              /* MD has not been analysed yet */
     MD_ACME_S_REGISTERED,           /* MD is registered at CA, but not more */
@@ -55,7 +59,8 @@ typedef struct md_acme_t md_acme_t;
 
 typedef struct md_acme_req_t md_acme_req_t;
 /**
- * Request callback on a successful HTTP response (status 2xx).
+ * Request callback on a successful HTTP response (status 2xx), or on a 304 when
+ * the request carried an If-None-Match header.
  */
 typedef apr_status_t md_acme_req_res_cb(md_acme_t *acme, 
                                         const struct md_http_response_t *res, void *baton);
@@ -109,6 +114,7 @@ struct md_acme_t {
             const char *key_change;
             const char *revoke_cert;
             const char *new_nonce;
+            const char *renewal_info;   /* ACME renewal information or NULL */
         } v2;
     } api;
     const char *ca_agreement;
@@ -119,8 +125,10 @@ struct md_acme_t {
     md_acme_post_fn *post_new_account_fn;
     
     struct md_http_t *http;
+    const char *trace_name;         /* name requests are traced under, e.g. the MD, or NULL */
     
-    const char *nonce;
+    const char *nonces[MD_ACME_NONCES_MAX]; /* unused nonces from the server, newest last */
+    int nonces_count;
     int max_retries;
 };
 
@@ -157,6 +165,88 @@ apr_status_t md_acme_setup(md_acme_t *acme);
  */
 void md_acme_clear_acct(md_acme_t *acme);
 
+/**
+ * Accounts validated with the server are remembered per process and CA url for a
+ * while, so that other instances for the same CA do not need to load and validate
+ * them again. 
+ * - md_acme_cache_acct_get() makes the cached account current, if there is one with
+ *   the given id (or any, if acct_id is NULL). Returns != 0 on success.
+ * - md_acme_cache_acct_set() remembers the current account of the instance.
+ * - md_acme_cache_acct_drop() forgets the account for the instance's CA.
+ */
+int md_acme_cache_acct_get(md_acme_t *acme, const char *acct_id);
+void md_acme_cache_acct_set(md_acme_t *acme);
+void md_acme_cache_acct_drop(md_acme_t *acme);
+
+/**
+ * Get the window in which the CA suggests to renew the certificate, from its ACME
+ * renewal information (RFC 9773). In *pretry_at the time the CA wants to be asked 
+ * again, if it says so, else 0. Returns APR_ENOTIMPL if the CA does not offer 
+ * renewal information.
+ */
+apr_status_t md_acme_get_renewal_info(apr_time_t *pstart, apr_time_t *pend, 
+                                      apr_time_t *pretry_at, md_acme_t *acme, 
+                                      struct md_cert_t *cert, apr_pool_t *p);
+
+/**
+ * Rate limits of CAs, kept per process and CA url as token buckets. The limits
+ * are the same for all CAs, but each CA has buckets of its own. Besides the
+ * configured limits, a CA answering 429 (or 503 with a Retry-After header) gets
+ * no requests until the time it asks for.
+ */
+typedef enum {
+    MD_ACME_RL_REQUESTS,            /* any request to the CA */
+    MD_ACME_RL_ORDERS,              /* new orders, new authorizations for ACMEv1 */
+    MD_ACME_RL_CERTS,               /* certificates per registered domain */
+    MD_ACME_RL_FAILED,              /* failed validations, no new orders while exceeded */
+    MD_ACME_RL_COUNT
+} md_acme_rl_kind_t;
+
+typedef struct md_acme_rl_t {
+    int count;                      /* events allowed per period, 0 for no limit */
+    apr_interval_time_t period;
+} md_acme_rl_t;
+
+/**
+ * Set the limits, MD_ACME_RL_COUNT of them indexed by kind, or none for NULL.
+ */
+void md_acme_rl_configure(const md_acme_rl_t *limits);
+
+/**
+ * Take a token for an event of the given kind from the buckets of the acme's CA.
+ * domains are the ones of the certificate for MD_ACME_RL_CERTS, NULL otherwise.
+ * Returns APR_BADARG, as the CA does for limits, when the bucket is empty and 
+ * gives the time it will have a token again in *pretry_at, else 0.
+ */
+apr_status_t md_acme_rl_take(md_acme_t *acme, md_acme_rl_kind_t kind, 
+                             struct apr_array_header_t *domains, apr_time_t *pretry_at);
+
+/**
+ * Count an event that has already happened, like a failed validation.
+ */
+void md_acme_rl_count(md_acme_t *acme, md_acme_rl_kind_t kind, 
+                      struct apr_array_header_t *domains);
+
+/**
+ * The time the CA at ca_url takes new orders again, 0 if it does now.
+ */
+apr_time_t md_acme_rl_retry_at(const char *ca_url);
+
+/**
+ * Count a directory or new order request to the acme's CA, started at start, that
+ * ended with rv. Requests the CA did not answer properly count as failures, the
+ * others for the time the CA takes. This is kept for the process.
+ */
+void md_acme_ca_health_add(md_acme_t *acme, apr_time_t start, apr_status_t rv);
+
+/**
+ * Order the urls of CAs for trying them: in the given order the ones that answer
+ * in time or were not asked yet, then the slow ones and last the ones that failed
+ * lately. A CA is tried in its place again after a while without requests, which
+ * grows with each failure in a row, up to an hour.
+ */
+struct apr_array_header_t *md_acme_ca_order(struct apr_array_header_t *urls, apr_pool_t *p);
+
 apr_status_t md_acme_POST_new_account(md_acme_t *acme, 
                                       md_acme_req_init_cb *on_init,
                                       md_acme_req_json_cb *on_json,
@@ -220,6 +310,7 @@ struct md_acme_req_t {
     const char *url;               /* url to POST the request to */
     const char *method;            /* HTTP method to use */
     apr_table_t *prot_hdrs;        /* JWS headers needing protection (nonce) */
+    apr_table_t *req_hdrs;         /* additional HTTP headers, set in on_init */
     struct md_json_t *req_json;    /* JSON to be POSTed in request body */
 
     apr_table_t *resp_hdrs;        /* HTTP response headers */
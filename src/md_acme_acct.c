@@ -86,6 +86,24 @@ static md_acme_acct_st acct_st_from_str(const char *s)
     return MD_ACME_ACCT_ST_UNKNOWN;
 }
 
+/* The members of an account written as they are */
+static const md_json_field_t acct_fields[] = {
+    { MD_JSON_PATH(MD_KEY_URL),       MD_JSON_FIELD_STR,  APR_OFFSETOF(md_acme_acct_t, url) },
+    { MD_JSON_PATH(MD_KEY_CA_URL),    MD_JSON_FIELD_STR,  APR_OFFSETOF(md_acme_acct_t, ca_url) },
+    { MD_JSON_PATH(MD_KEY_CONTACT),   MD_JSON_FIELD_STRA, APR_OFFSETOF(md_acme_acct_t, contacts) },
+    { MD_JSON_PATH(MD_KEY_AGREEMENT), MD_JSON_FIELD_STR,  APR_OFFSETOF(md_acme_acct_t, agreement) },
+    { MD_JSON_PATH(MD_KEY_ORDERS),    MD_JSON_FIELD_STR,  APR_OFFSETOF(md_acme_acct_t, orders) },
+};
+
+static const md_json_path_t P_STATUS = MD_JSON_PATH(MD_KEY_STATUS);
+static const md_json_path_t P_DISABLED = MD_JSON_PATH(MD_KEY_DISABLED);
+static const md_json_path_t P_URL = MD_JSON_PATH(MD_KEY_URL);
+static const md_json_path_t P_CA_URL = MD_JSON_PATH(MD_KEY_CA_URL);
+static const md_json_path_t P_CONTACT = MD_JSON_PATH(MD_KEY_CONTACT);
+static const md_json_path_t P_REG_CONTACT = MD_JSON_PATH(MD_KEY_REGISTRATION, MD_KEY_CONTACT);
+static const md_json_path_t P_TOS = MD_JSON_PATH("terms-of-service");
+static const md_json_path_t P_ORDERS = MD_JSON_PATH(MD_KEY_ORDERS);
+
 md_json_t *md_acme_acct_to_json(md_acme_acct_t *acct, apr_pool_t *p)
 {
     md_json_t *jacct;
@@ -108,18 +126,10 @@ md_json_t *md_acme_acct_to_json(md_acme_acct_t *acct, apr_pool_t *p)
             break;
     }    
     if (s) {
-        md_json_sets(s, jacct, MD_KEY_STATUS, NULL);
+        md_json_sets_p(s, jacct, &P_STATUS);
     }
-    md_json_sets(acct->url, jacct, MD_KEY_URL, NULL);
-    md_json_sets(acct->ca_url, jacct, MD_KEY_CA_URL, NULL);
-    md_json_setsa(acct->contacts, jacct, MD_KEY_CONTACT, NULL);
+    md_json_fields_set(acct, acct_fields, sizeof(acct_fields)/sizeof(acct_fields[0]), jacct);
     md_json_setj(acct->registration, jacct, MD_KEY_REGISTRATION, NULL);
-    if (acct->agreement) {
-        md_json_sets(acct->agreement, jacct, MD_KEY_AGREEMENT, NULL);
-    }
-    if (acct->orders) {
-        md_json_sets(acct->orders, jacct, MD_KEY_ORDERS, NULL);
-    }
     
     return jacct;
 }
@@ -129,43 +139,43 @@ apr_status_t md_acme_acct_from_json(md_acme_acct_t **pacct, md_json_t *json, apr
     apr_status_t rv = APR_EINVAL;
     md_acme_acct_t *acct;
     md_acme_acct_st status = MD_ACME_ACCT_ST_UNKNOWN;
-    const char *ca_url, *url;
+    const char *ca_url, *url, *s;
     apr_array_header_t *contacts;
     
-    if (md_json_has_key(json, MD_KEY_STATUS, NULL)) {
-        status = acct_st_from_str(md_json_gets(json, MD_KEY_STATUS, NULL));
+    if ((s = md_json_gets_p(json, &P_STATUS))) {
+        status = acct_st_from_str(s);
     }
     else {
         /* old accounts only had disabled boolean field */
-        status = md_json_getb(json, MD_KEY_DISABLED, NULL)? 
+        status = md_json_getb_p(json, &P_DISABLED)? 
             MD_ACME_ACCT_ST_DEACTIVATED : MD_ACME_ACCT_ST_VALID;
     }
     
-    url = md_json_gets(json, MD_KEY_URL, NULL);
+    url = md_json_gets_p(json, &P_URL);
     if (!url) {
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "account has no url");
         goto out;
     }
 
-    ca_url = md_json_gets(json, MD_KEY_CA_URL, NULL);
+    ca_url = md_json_gets_p(json, &P_CA_URL);
     if (!ca_url) {
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "account has no CA url: %s", url);
         goto out;
     }
     
     contacts = apr_array_make(p, 5, sizeof(const char *));
-    if (md_json_has_key(json, MD_KEY_CONTACT, NULL)) {
-        md_json_getsa(contacts, json, MD_KEY_CONTACT, NULL);
+    if (md_json_has_key_p(json, &P_CONTACT)) {
+        md_json_dupsa_p(contacts, p, json, &P_CONTACT);
     }
     else {
-        md_json_getsa(contacts, json, MD_KEY_REGISTRATION, MD_KEY_CONTACT, NULL);
+        md_json_dupsa_p(contacts, p, json, &P_REG_CONTACT);
     }
     rv = acct_make(&acct, p, ca_url, contacts);
     if (APR_SUCCESS == rv) {
         acct->status = status;
         acct->url = url;
-        acct->agreement = md_json_gets(json, "terms-of-service", NULL);
-        acct->orders = md_json_gets(json, MD_KEY_ORDERS, NULL);
+        acct->agreement = md_json_gets_p(json, &P_TOS);
+        acct->orders = md_json_gets_p(json, &P_ORDERS);
     }
 
 out:
@@ -331,6 +341,9 @@ apr_status_t md_acme_find_acct(md_acme_t *acme, md_store_t *store)
 {
     apr_status_t rv;
     
+    if (md_acme_cache_acct_get(acme, NULL)) {
+        return APR_SUCCESS;
+    }
     while (APR_EAGAIN == (rv = acct_find_and_verify(store, MD_SG_ACCOUNTS, 
                                                     mk_acct_pattern(acme->p, acme), 
                                                     acme, acme->p))) {
@@ -478,6 +491,7 @@ apr_status_t md_acme_acct_validate(md_acme_t *acme, md_store_t *store, apr_pool_
     apr_status_t rv;
     
     if (APR_SUCCESS != (rv = md_acme_acct_update(acme))) {
+        md_acme_cache_acct_drop(acme);
         if (acme->acct && (APR_ENOENT == rv || APR_EACCES == rv)) {
             if (MD_ACME_ACCT_ST_VALID == acme->acct->status) {
                 acme->acct->status = MD_ACME_ACCT_ST_UNKNOWN;
@@ -592,8 +606,8 @@ apr_status_t md_acme_acct_register(md_acme_t *acme, md_store_t *store, apr_pool_
     
     /* If we still have no key, generate a new one */
     if (!acme->acct_key) {
-        spec.type = MD_PKEY_TYPE_RSA;
-        spec.params.rsa.bits = MD_ACME_ACCT_PKEY_BITS;
+        spec.type = MD_PKEY_TYPE_EC;
+        spec.params.ec.curve = MD_ACME_ACCT_PKEY_CURVE;
         
         if (APR_SUCCESS != (rv = md_pkey_gen(&pkey, acme->p, &spec))) goto out;
         acme->acct_key = pkey;
@@ -648,6 +662,7 @@ apr_status_t md_acme_acct_deactivate(md_acme_t *acme, apr_pool_t *p)
                   acct->url, acct->ca_url);
     ctx.acme = acme;
     ctx.p = p;
+    md_acme_cache_acct_drop(acme);
     return md_acme_POST(acme, acct->url, on_init_acct_del, acct_upd, NULL, &ctx);
 }
 
@@ -685,6 +700,7 @@ apr_status_t md_acme_agree(md_acme_t *acme, apr_pool_t *p, const char *agreement
     
     ctx.acme = acme;
     ctx.p = p;
+    md_acme_cache_acct_drop(acme);
     return md_acme_POST(acme, acme->acct->url, on_init_agree_tos, acct_upd, NULL, &ctx);
 }
 
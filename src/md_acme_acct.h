@@ -49,8 +49,10 @@ struct md_acme_acct_t {
 #define MD_FN_ACCOUNT           "account.json"
 #define MD_FN_ACCT_KEY          "account.pem"
 
-/* ACME account private keys are always RSA and have that many bits. Since accounts
- * are expected to live long, better err on the safe side. */
+/* New ACME account private keys are EC keys on this curve, so that requests to the
+ * CA are signed with ES256. Existing RSA account keys, which have that many bits,
+ * continue to be used. */
+#define MD_ACME_ACCT_PKEY_CURVE "P-256"
 #define MD_ACME_ACCT_PKEY_BITS  3072
 
 #define MD_ACME_ACCT_STAGED     "staged"
@@ -16,9 +16,11 @@
  
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <apr_lib.h>
 #include <apr_buckets.h>
+#include <apr_date.h>
 #include <apr_file_info.h>
 #include <apr_file_io.h>
 #include <apr_fnmatch.h>
@@ -119,6 +121,12 @@ apr_status_t md_acme_authz_register(struct md_acme_authz_t **pauthz, md_acme_t *
     
     authz_req_ctx_init(&ctx, acme, domain, NULL, p);
     
+    if (APR_SUCCESS != (rv = md_acme_rl_take(acme, MD_ACME_RL_ORDERS, NULL, NULL))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, p, 
+                      "%s: CA takes no new authorizations at this time", domain);
+        *pauthz = NULL;
+        return rv;
+    }
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, acme->p, "create new authz");
     rv = md_acme_POST(acme, acme->api.v1.new_authz, on_init_authz, authz_created, NULL, &ctx);
     
@@ -143,28 +151,20 @@ apr_status_t md_acme_authz_retrieve(md_acme_t *acme, apr_pool_t *p, const char *
     return rv;
 }
 
-apr_status_t md_acme_authz_update(md_acme_authz_t *authz, md_acme_t *acme, apr_pool_t *p)
+static apr_status_t authz_update_json(md_acme_authz_t *authz, md_json_t *json, 
+                                      apr_status_t rv, apr_pool_t *p)
 {
-    md_json_t *json;
     const char *s, *err;
     md_log_level_t log_level;
-    apr_status_t rv;
-    MD_CHK_VARS;
     
-    assert(acme);
-    assert(acme->http);
-    assert(authz);
-    assert(authz->url);
-
     authz->state = MD_ACME_AUTHZ_S_UNKNOWN;
-    json = NULL;
     err = "unable to parse response";
     log_level = MD_LOG_ERR;
     
-    if (MD_OK(md_acme_get_json(&json, acme, authz->url, p))
-        && (s = md_json_gets(json, MD_KEY_STATUS, NULL))) {
+    if (APR_SUCCESS == rv && json && (s = md_json_gets(json, MD_KEY_STATUS, NULL))) {
             
         authz->domain = md_json_gets(json, MD_KEY_IDENTIFIER, MD_KEY_VALUE, NULL); 
+        authz->expires = md_util_parse_rfc3339(md_json_gets(json, MD_KEY_EXPIRES, NULL));
         authz->resource = json;
         if (!strcmp(s, "pending")) {
             authz->state = MD_ACME_AUTHZ_S_PENDING;
@@ -196,6 +196,381 @@ apr_status_t md_acme_authz_update(md_acme_authz_t *authz, md_acme_t *acme, apr_p
     return rv;
 }
 
+apr_status_t md_acme_authz_update(md_acme_authz_t *authz, md_acme_t *acme, apr_pool_t *p)
+{
+    md_json_t *json;
+    apr_status_t rv;
+    
+    assert(acme);
+    assert(acme->http);
+    assert(authz);
+    assert(authz->url);
+
+    json = NULL;
+    rv = md_acme_get_json(&json, acme, authz->url, p);
+    return authz_update_json(authz, json, rv, p);
+}
+
+typedef struct {
+    apr_pool_t *p;
+    md_acme_authz_t *authz;
+    apr_time_t retry_after;
+    apr_status_t rv;
+} authz_upd_ctx;
+
+static apr_status_t on_authz_upd(md_acme_t *acme, apr_pool_t *p, const apr_table_t *hdrs, 
+                                 md_json_t *body, void *baton)
+{
+    authz_upd_ctx *ctx = baton;
+    
+    (void)acme;
+    (void)p;
+    if (hdrs) {
+        ctx->retry_after = md_util_parse_retry_after(apr_table_get(hdrs, "Retry-After"), 
+                                                     apr_time_now());
+    }
+    ctx->rv = authz_update_json(ctx->authz, md_json_clone(ctx->p, body), APR_SUCCESS, ctx->p);
+    return ctx->rv;
+}
+
+apr_status_t md_acme_authz_update_all(apr_array_header_t *authzs, md_acme_t *acme, 
+                                      apr_time_t *pretry_after, apr_pool_t *p)
+{
+    authz_upd_ctx *ctxs;
+    md_acme_authz_t *authz;
+    apr_status_t rv = APR_SUCCESS, rv_http;
+    int i, deferred;
+    
+    assert(acme);
+    assert(acme->http);
+    
+    *pretry_after = 0;
+    if (authzs->nelts <= 0) {
+        return APR_SUCCESS;
+    }
+    
+    ctxs = apr_pcalloc(p, (apr_size_t)authzs->nelts * sizeof(*ctxs));
+    deferred = md_http_set_deferred(acme->http, 1);
+    for (i = 0; i < authzs->nelts; ++i) {
+        authz = APR_ARRAY_IDX(authzs, i, md_acme_authz_t *);
+        assert(authz->url);
+        authz->state = MD_ACME_AUTHZ_S_UNKNOWN;
+        ctxs[i].p = p;
+        ctxs[i].authz = authz;
+        ctxs[i].rv = APR_EINCOMPLETE;
+        rv = md_acme_GET(acme, authz->url, NULL, on_authz_upd, NULL, &ctxs[i]);
+        if (APR_SUCCESS != rv) {
+            ctxs[i].rv = rv;
+        }
+    }
+    rv_http = md_http_await_all(acme->http);
+    md_http_set_deferred(acme->http, deferred);
+    
+    rv = APR_SUCCESS;
+    for (i = 0; i < authzs->nelts; ++i) {
+        if (ctxs[i].retry_after > *pretry_after) {
+            *pretry_after = ctxs[i].retry_after;
+        }
+        if (APR_SUCCESS == rv && APR_SUCCESS != ctxs[i].rv) {
+            rv = ctxs[i].rv;
+        }
+    }
+    /* a failed request may never have reached its callback, prefer the real cause */
+    if (APR_SUCCESS != rv_http) {
+        rv = rv_http;
+    }
+    return rv;
+}
+
+/**************************************************************************************************/
+/* cache of valid authorizations */
+
+#define MD_KEY_AUTHZS           "authzs"
+
+/* An authorization needs to stay valid until the order using it is finalized. */
+#define AUTHZ_CACHE_MARGIN      apr_time_from_sec(24 * 60 * 60)
+
+struct md_acme_authz_cache_t {
+    apr_pool_t *p;
+    struct md_store_t *store;
+    const char *acct_id;
+    md_json_t *json;
+    int dirty;
+};
+
+apr_status_t md_acme_authz_cache_load(md_acme_authz_cache_t **pcache, struct md_store_t *store,
+                                      md_acme_t *acme, apr_pool_t *p)
+{
+    md_acme_authz_cache_t *cache;
+    apr_status_t rv = APR_SUCCESS;
+    
+    cache = apr_pcalloc(p, sizeof(*cache));
+    cache->p = p;
+    cache->store = store;
+    cache->acct_id = md_acme_acct_id_get(acme);
+    if (cache->acct_id) {
+        rv = md_store_load_json(store, MD_SG_ACCOUNTS, cache->acct_id, MD_FN_AUTHZ_CACHE, 
+                                &cache->json, p);
+        if (APR_STATUS_IS_ENOENT(rv)) {
+            rv = APR_SUCCESS;
+        }
+        else if (APR_SUCCESS != rv) {
+            /* a cache we cannot read is started anew */
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
+                          "%s: unable to read authz cache, starting a new one", cache->acct_id);
+            cache->json = NULL;
+            rv = APR_SUCCESS;
+        }
+    }
+    if (!cache->json) {
+        cache->json = md_json_create(p);
+    }
+    *pcache = cache;
+    return rv;
+}
+
+static apr_time_t cache_expires(md_json_t *entry)
+{
+    const char *s = md_json_gets(entry, MD_KEY_EXPIRES, NULL);
+    return s? apr_date_parse_rfc(s) : 0;
+}
+
+const char *md_acme_authz_cache_get(md_acme_authz_cache_t *cache, const char *url)
+{
+    md_json_t *entry;
+    
+    if (!url || !(entry = md_json_viewj(cache->json, MD_KEY_AUTHZS, url, NULL))) {
+        return NULL;
+    }
+    if (cache_expires(entry) <= apr_time_now() + AUTHZ_CACHE_MARGIN) {
+        return NULL;
+    }
+    return md_json_gets(entry, MD_KEY_DOMAIN, NULL);
+}
+
+void md_acme_authz_cache_update(md_acme_authz_cache_t *cache, md_acme_authz_t *authz)
+{
+    md_json_t *entry;
+    char ts[APR_RFC822_DATE_LEN];
+    
+    if (!authz->url) {
+        return;
+    }
+    if (authz->state == MD_ACME_AUTHZ_S_VALID && authz->domain && authz->expires > 0) {
+        entry = md_json_create(cache->p);
+        md_json_sets(authz->domain, entry, MD_KEY_DOMAIN, NULL);
+        apr_rfc822_date(ts, authz->expires);
+        md_json_sets(apr_pstrdup(cache->p, ts), entry, MD_KEY_EXPIRES, NULL);
+        md_json_setj(entry, cache->json, MD_KEY_AUTHZS, authz->url, NULL);
+        cache->dirty = 1;
+    }
+    else if (md_json_has_key(cache->json, MD_KEY_AUTHZS, authz->url, NULL)) {
+        md_json_del(cache->json, MD_KEY_AUTHZS, authz->url, NULL);
+        cache->dirty = 1;
+    }
+}
+
+typedef struct {
+    apr_pool_t *p;
+    apr_array_header_t *expired;
+} cache_prune_ctx;
+
+static int collect_expired(void *baton, const char *key, md_json_t *json)
+{
+    cache_prune_ctx *ctx = baton;
+    
+    if (cache_expires(json) <= apr_time_now()) {
+        APR_ARRAY_PUSH(ctx->expired, const char *) = apr_pstrdup(ctx->p, key);
+    }
+    return 1;
+}
+
+apr_status_t md_acme_authz_cache_save(md_acme_authz_cache_t *cache, apr_pool_t *p)
+{
+    cache_prune_ctx ctx;
+    int i;
+    
+    if (!cache->acct_id) {
+        return APR_SUCCESS;
+    }
+    ctx.p = p;
+    ctx.expired = apr_array_make(p, 5, sizeof(const char *));
+    md_json_iterkey(collect_expired, &ctx, cache->json, MD_KEY_AUTHZS, NULL);
+    for (i = 0; i < ctx.expired->nelts; ++i) {
+        md_json_del(cache->json, MD_KEY_AUTHZS, APR_ARRAY_IDX(ctx.expired, i, const char *), NULL);
+        cache->dirty = 1;
+    }
+    if (!cache->dirty) {
+        return APR_SUCCESS;
+    }
+    cache->dirty = 0;
+    return md_store_save_json(cache->store, p, MD_SG_ACCOUNTS, cache->acct_id, 
+                              MD_FN_AUTHZ_CACHE, cache->json, 0);
+}
+
+/**************************************************************************************************/
+/* challenge statistics */
+
+/* below this rate of success, a type is taken to be failing */
+#define CHA_STATS_RELIABLE      0.5
+
+struct md_acme_cha_stats_t {
+    apr_pool_t *p;
+    struct md_store_t *store;
+    const char *name;
+    const char *suffix;
+    md_json_t *json;
+    int dirty;
+};
+
+apr_status_t md_acme_cha_stats_load(md_acme_cha_stats_t **pstats, struct md_store_t *store,
+                                    const char *name, apr_pool_t *p)
+{
+    md_acme_cha_stats_t *stats;
+    apr_status_t rv;
+    
+    stats = apr_pcalloc(p, sizeof(*stats));
+    stats->p = p;
+    stats->store = store;
+    stats->name = name;
+    stats->suffix = md_dns_suffix(name);
+    rv = md_store_load_json(store, MD_SG_STATS, stats->suffix, MD_FN_CHA_STATS, 
+                            &stats->json, p);
+    if (APR_SUCCESS != rv) {
+        if (!APR_STATUS_IS_ENOENT(rv)) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
+                          "%s: unable to read challenge statistics, starting anew", 
+                          stats->suffix);
+        }
+        stats->json = md_json_create(p);
+        rv = APR_SUCCESS;
+    }
+    *pstats = stats;
+    return rv;
+}
+
+static md_json_t *cha_stats_entry(md_acme_cha_stats_t *stats, const char *name, 
+                                  const char *type, int create)
+{
+    md_json_t *entry;
+    
+    /* an MD's own records, or those of its suffix for a NULL name */
+    entry = name? md_json_viewj(stats->json, MD_KEY_MDS, name, type, NULL)
+                : md_json_viewj(stats->json, MD_KEY_CHALLENGES, type, NULL);
+    if (!entry && create) {
+        if (name) {
+            md_json_setj(md_json_create(stats->p), stats->json, MD_KEY_MDS, name, type, NULL);
+            entry = md_json_viewj(stats->json, MD_KEY_MDS, name, type, NULL);
+        }
+        else {
+            md_json_setj(md_json_create(stats->p), stats->json, MD_KEY_CHALLENGES, type, NULL);
+            entry = md_json_viewj(stats->json, MD_KEY_CHALLENGES, type, NULL);
+        }
+    }
+    return entry;
+}
+
+static void cha_stats_update(md_json_t *entry, int valid, apr_interval_time_t duration)
+{
+    long count, ms, d;
+    double rate;
+    
+    if (!entry) return;
+    count = md_json_getl(entry, MD_KEY_COUNT, NULL);
+    /* halfway to the latest outcome: a reliable type stays so after one failure, 
+     * but not after two in a row */
+    rate = valid? 1.0 : 0.0;
+    if (count > 0) {
+        rate = (md_json_getn(entry, MD_KEY_RATE, NULL) + rate) / 2;
+    }
+    md_json_setl(count + 1, entry, MD_KEY_COUNT, NULL);
+    md_json_setn(rate, entry, MD_KEY_RATE, NULL);
+    if (valid) {
+        d = (long)apr_time_as_msec(duration);
+        if (md_json_has_key(entry, MD_KEY_MS, NULL)) {
+            ms = md_json_getl(entry, MD_KEY_MS, NULL);
+            d = (3 * ms + d) / 4;
+        }
+        md_json_setl(d, entry, MD_KEY_MS, NULL);
+    }
+}
+
+void md_acme_cha_stats_add(md_acme_cha_stats_t *stats, const char *type, int valid, 
+                           apr_interval_time_t duration)
+{
+    cha_stats_update(cha_stats_entry(stats, stats->name, type, 1), valid, duration);
+    cha_stats_update(cha_stats_entry(stats, NULL, type, 1), valid, duration);
+    stats->dirty = 1;
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, stats->p, "%s: challenge '%s' %s after %s", 
+                  stats->name, type, valid? "valid" : "failed", 
+                  md_print_duration(stats->p, duration));
+}
+
+typedef struct {
+    const char *type;
+    int rank;                          /* 0 reliable, 1 not tried, 2 failing */
+    long ms;
+    int index;
+} cha_rank_t;
+
+static int cha_rank_cmp(const void *a, const void *b)
+{
+    const cha_rank_t *ra = a, *rb = b;
+    
+    if (ra->rank != rb->rank) return (ra->rank < rb->rank)? -1 : 1;
+    if (ra->ms != rb->ms) return (ra->ms < rb->ms)? -1 : 1;
+    return (ra->index < rb->index)? -1 : ((ra->index > rb->index)? 1 : 0);
+}
+
+apr_array_header_t *md_acme_cha_stats_sort(md_acme_cha_stats_t *stats, 
+                                           apr_array_header_t *types, apr_pool_t *p)
+{
+    apr_array_header_t *sorted;
+    cha_rank_t *ranks;
+    md_json_t *entry;
+    int i;
+    
+    if (types->nelts <= 1) {
+        return types;
+    }
+    ranks = apr_pcalloc(p, (apr_size_t)types->nelts * sizeof(*ranks));
+    for (i = 0; i < types->nelts; ++i) {
+        ranks[i].type = APR_ARRAY_IDX(types, i, const char *);
+        ranks[i].index = i;
+        if (!(entry = cha_stats_entry(stats, stats->name, ranks[i].type, 0))) {
+            entry = cha_stats_entry(stats, NULL, ranks[i].type, 0);
+        }
+        if (!entry || md_json_getl(entry, MD_KEY_COUNT, NULL) <= 0) {
+            ranks[i].rank = 1;
+        }
+        else if (md_json_getn(entry, MD_KEY_RATE, NULL) < CHA_STATS_RELIABLE) {
+            ranks[i].rank = 2;
+        }
+        else {
+            ranks[i].ms = md_json_getl(entry, MD_KEY_MS, NULL);
+        }
+    }
+    qsort(ranks, (size_t)types->nelts, sizeof(*ranks), cha_rank_cmp);
+    
+    sorted = apr_array_make(p, types->nelts, sizeof(const char *));
+    for (i = 0; i < types->nelts; ++i) {
+        APR_ARRAY_PUSH(sorted, const char *) = ranks[i].type;
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: challenge types in order: %s", 
+                  stats->name, apr_array_pstrcat(p, sorted, ' '));
+    return sorted;
+}
+
+apr_status_t md_acme_cha_stats_save(md_acme_cha_stats_t *stats, apr_pool_t *p)
+{
+    if (!stats->dirty) {
+        return APR_SUCCESS;
+    }
+    stats->dirty = 0;
+    return md_store_save_json(stats->store, p, MD_SG_STATS, stats->suffix, 
+                              MD_FN_CHA_STATS, stats->json, 0);
+}
+
 /**************************************************************************************************/
 /* response to a challenge */
 
@@ -278,7 +653,7 @@ static apr_status_t setup_key_authz(md_acme_authz_cha_t *cha, md_acme_authz_t *a
 static apr_status_t cha_http_01_setup(md_acme_authz_cha_t *cha, md_acme_authz_t *authz, 
                                       md_acme_t *acme, md_store_t *store, 
                                       md_pkey_spec_t *key_spec,  apr_table_t *env, 
-                                      apr_pool_t *p)
+                                      md_acme_authz_batch_t *batch, apr_pool_t *p)
 {
     const char *data;
     apr_status_t rv;
@@ -287,6 +662,7 @@ static apr_status_t cha_http_01_setup(md_acme_authz_cha_t *cha, md_acme_authz_t
     
     (void)key_spec;
     (void)env;
+    (void)batch;
     if (!MD_OK(setup_key_authz(cha, authz, acme, p, &notify_server))) {
         goto out;
     }
@@ -315,7 +691,7 @@ out:
 static apr_status_t cha_tls_alpn_01_setup(md_acme_authz_cha_t *cha, md_acme_authz_t *authz, 
                                           md_acme_t *acme, md_store_t *store, 
                                           md_pkey_spec_t *key_spec,  apr_table_t *env, 
-                                          apr_pool_t *p)
+                                          md_acme_authz_batch_t *batch, apr_pool_t *p)
 {
     md_cert_t *cha_cert;
     md_pkey_t *cha_key;
@@ -325,6 +701,7 @@ static apr_status_t cha_tls_alpn_01_setup(md_acme_authz_cha_t *cha, md_acme_auth
     MD_CHK_VARS;
     
     (void)env;
+    (void)batch;
     if (!MD_OK(setup_key_authz(cha, authz, acme, p, &notify_server))) {
         goto out;
     }
@@ -333,7 +710,7 @@ static apr_status_t cha_tls_alpn_01_setup(md_acme_authz_cha_t *cha, md_acme_auth
     if ((APR_SUCCESS == rv && !md_cert_covers_domain(cha_cert, authz->domain)) 
         || APR_STATUS_IS_ENOENT(rv)) {
         
-        if (APR_SUCCESS != (rv = md_pkey_gen(&cha_key, p, key_spec))) {
+        if (APR_SUCCESS != (rv = md_pkey_pool_gen(&cha_key, store, key_spec, p))) {
             md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s: create tls-alpn-01 challenge key",
                           authz->domain);
             goto out;
@@ -379,19 +756,218 @@ out:
     return rv;
 }
 
+/**************************************************************************************************/
+/* dns-01 */
+
+/* How long to wait for DNS records to become visible, unless configured otherwise */
+#define DNS01_CHECK_TIMEOUT         apr_time_from_sec(5 * 60)
+/* A dns-01 command running longer than this is killed */
+#define DNS01_CMD_TIMEOUT           apr_time_from_sec(5 * 60)
+
+/* With a DNS check, the drive leaves while records are not visible yet and comes back
+ * later. What has been set up, and since when, is remembered in the challenges
+ * group, so the command is not run again and the timeout counts from the setup. */
+#define MD_FN_DNS01                 "acme-dns-01.json"
+
+typedef struct {
+    md_acme_authz_cha_t *cha;
+    md_acme_authz_t *authz;
+    md_store_t *store;
+    const char *token;
+    apr_time_t since;               /* when the record was set up, 0 if not yet */
+    int visible;
+} dns01_record_t;
+
+struct md_acme_authz_batch_t {
+    apr_pool_t *p;
+    apr_array_header_t *dns01;      /* dns01_record_t* set up on md_acme_authz_batch_run() */
+};
+
+md_acme_authz_batch_t *md_acme_authz_batch_make(apr_pool_t *p)
+{
+    md_acme_authz_batch_t *batch;
+    
+    batch = apr_pcalloc(p, sizeof(*batch));
+    batch->p = p;
+    batch->dns01 = apr_array_make(p, 5, sizeof(dns01_record_t*));
+    return batch;
+}
+
+static apr_status_t dns01_exec(const char *cmdline, const char *name, apr_pool_t *p)
+{
+    const char * const *argv;
+    apr_status_t rv;
+    int exit_code;
+    
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: dns-01 command: %s", name, cmdline);
+    apr_tokenize_to_argv(cmdline, (char***)&argv, p);
+    rv = md_util_exec_timeout(p, argv[0], argv, DNS01_CMD_TIMEOUT, &exit_code);
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
+                      "%s: dns-01 command failed to execute", name);
+    }
+    else if (exit_code) {
+        rv = APR_EGENERAL;
+        md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, p, 
+                      "%s: dns-01 command returns %d", name, exit_code);
+    }
+    return rv;
+}
+
+/* Look up when the record's token has been set up by an earlier run, if it has. */
+static void dns01_state_load(dns01_record_t *rec, apr_table_t *env, apr_pool_t *p)
+{
+    md_json_t *json;
+    const char *token;
+    
+    rec->since = 0;
+    if (apr_table_get(env, MD_KEY_DNS01_CHECK)
+        && APR_SUCCESS == md_store_load_json(rec->store, MD_SG_CHALLENGES, rec->authz->domain, 
+                                             MD_FN_DNS01, &json, p)
+        && (token = md_json_gets(json, MD_KEY_TOKEN, NULL)) && !strcmp(token, rec->token)) {
+        rec->since = apr_time_from_sec(md_json_getl(json, MD_KEY_START, NULL));
+    }
+}
+
+static apr_status_t dns01_state_save(dns01_record_t *rec, apr_table_t *env, apr_pool_t *p)
+{
+    md_json_t *json;
+    
+    rec->since = apr_time_now();
+    if (!apr_table_get(env, MD_KEY_DNS01_CHECK)) {
+        return APR_SUCCESS;
+    }
+    json = md_json_create(p);
+    md_json_sets(rec->token, json, MD_KEY_TOKEN, NULL);
+    md_json_setl((long)apr_time_sec(rec->since), json, MD_KEY_START, NULL);
+    return md_store_save_json(rec->store, p, MD_SG_CHALLENGES, rec->authz->domain, 
+                              MD_FN_DNS01, json, 0);
+}
+
+static void dns01_state_remove(md_store_t *store, const char *domain, apr_pool_t *p)
+{
+    md_store_remove(store, MD_SG_CHALLENGES, domain, MD_FN_DNS01, p, 1);
+}
+
+static int dns01_answer_matches(void *baton, size_t index, md_json_t *json)
+{
+    dns01_record_t *rec = baton;
+    const char *data;
+    apr_size_t len;
+    
+    (void)index;
+    /* TXT records, their data comes as a quoted string */
+    if (16 == md_json_getl(json, "type", NULL)
+        && (data = md_json_gets(json, "data", NULL))
+        && (len = strlen(data)) >= 2 && data[0] == '"' && data[len-1] == '"'
+        && strlen(rec->token) == len - 2 && !strncmp(data + 1, rec->token, len - 2)) {
+        rec->visible = 1;
+        return 0;
+    }
+    return 1;
+}
+
+static apr_status_t on_dns01_answer(const md_http_response_t *res)
+{
+    dns01_record_t *rec = res->req->baton;
+    md_json_t *json;
+    
+    if (APR_SUCCESS == res->rv && res->status == 200 && res->body
+        && APR_SUCCESS == md_json_readb(&json, res->req->pool, res->body)) {
+        md_json_itera(dns01_answer_matches, rec, json, "Answer", NULL);
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, res->rv, res->req->pool, 
+                  "%s: dns-01 record lookup (status %d), %s", rec->authz->domain, 
+                  res->status, rec->visible? "visible" : "not visible yet");
+    return APR_SUCCESS;
+}
+
+/* Look up the records at the configured DNS query service, all at the same time, 
+ * once. Returns APR_EINPROGRESS when some are not visible yet, for the caller to
+ * come back later, and APR_TIMEUP when they have not become visible in time. */
+static apr_status_t dns01_check_visible(apr_array_header_t *records, md_acme_t *acme, 
+                                        apr_table_t *env, apr_pool_t *p)
+{
+    dns01_record_t *rec;
+    const char *url, *qurl, *s;
+    apr_table_t *headers;
+    apr_interval_time_t timeout;
+    apr_time_t since = 0;
+    apr_status_t rv = APR_SUCCESS;
+    int i, deferred, pending;
+    
+    if (!(url = apr_table_get(env, MD_KEY_DNS01_CHECK)) || records->nelts <= 0) {
+        return APR_SUCCESS;
+    }
+    s = apr_table_get(env, MD_KEY_DNS01_CHECK_TIMEOUT);
+    timeout = s? apr_time_from_sec(apr_atoi64(s)) : DNS01_CHECK_TIMEOUT;
+    
+    headers = apr_table_make(p, 1);
+    apr_table_set(headers, "Accept", "application/dns-json");
+    deferred = md_http_set_deferred(acme->http, 1);
+    for (i = 0; i < records->nelts; ++i) {
+        rec = APR_ARRAY_IDX(records, i, dns01_record_t*);
+        if (!rec->visible) {
+            qurl = apr_psprintf(p, "%s%sname=_acme-challenge.%s&type=TXT", url, 
+                                strchr(url, '?')? "&" : "?", rec->authz->domain);
+            md_http_GET(acme->http, qurl, headers, on_dns01_answer, rec);
+        }
+    }
+    md_http_await_all(acme->http);
+    md_http_set_deferred(acme->http, deferred);
+    
+    for (i = 0, pending = 0; i < records->nelts; ++i) {
+        rec = APR_ARRAY_IDX(records, i, dns01_record_t*);
+        if (!rec->visible) {
+            ++pending;
+            if (!since || rec->since < since) since = rec->since;
+        }
+    }
+    if (!pending) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
+                      "all %d dns-01 records are visible", records->nelts);
+    }
+    else if (apr_time_now() >= since + timeout) {
+        rv = APR_TIMEUP;
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
+                      "%d of %d dns-01 records are not visible at %s, giving up", 
+                      pending, records->nelts, url);
+        /* set them up anew when trying again */
+        for (i = 0; i < records->nelts; ++i) {
+            rec = APR_ARRAY_IDX(records, i, dns01_record_t*);
+            dns01_state_remove(rec->store, rec->authz->domain, p);
+        }
+    }
+    else {
+        rv = APR_EINPROGRESS;
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
+                      "%d of %d dns-01 records are not visible yet", pending, records->nelts);
+    }
+    return rv;
+}
+
+static apr_status_t dns01_notify(dns01_record_t *rec, md_acme_t *acme, apr_pool_t *p)
+{
+    authz_req_ctx ctx;
+
+    /* challenge is setup, tell ACME server so it may (re)try verification */        
+    authz_req_ctx_init(&ctx, acme, NULL, rec->authz, p);
+    ctx.challenge = rec->cha;
+    return md_acme_POST(acme, rec->cha->uri, on_init_authz_resp, authz_http_set, NULL, &ctx);
+}
+
 static apr_status_t cha_dns_01_setup(md_acme_authz_cha_t *cha, md_acme_authz_t *authz, 
                                      md_acme_t *acme, md_store_t *store, 
-                                     md_pkey_spec_t *key_spec, apr_table_t *env, apr_pool_t *p)
+                                     md_pkey_spec_t *key_spec, apr_table_t *env, 
+                                     md_acme_authz_batch_t *batch, apr_pool_t *p)
 {
-    const char *token;
-    const char * const *argv;
     const char *cmdline, *dns01_cmd;
+    apr_array_header_t *records;
+    dns01_record_t *rec;
     apr_status_t rv;
-    int exit_code, notify_server;
-    authz_req_ctx ctx;
+    int notify_server;
     MD_CHK_VARS;
     
-    (void)store;
     (void)key_spec;
     
     dns01_cmd = apr_table_get(env, MD_KEY_CMD_DNS01);
@@ -406,39 +982,101 @@ static apr_status_t cha_dns_01_setup(md_acme_authz_cha_t *cha, md_acme_authz_t *
         goto out;
     }
     
-    rv = md_crypt_sha256_digest64(&token, p, cha->key_authz, strlen(cha->key_authz));
+    rec = apr_pcalloc(p, sizeof(*rec));
+    rec->cha = cha;
+    rec->authz = authz;
+    rec->store = store;
+    rv = md_crypt_sha256_digest64(&rec->token, p, cha->key_authz, strlen(cha->key_authz));
     if (APR_SUCCESS != rv) {
         md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s: create dns-01 token",
                       authz->domain);
         goto out;
     }
+    dns01_state_load(rec, env, p);
 
-    cmdline = apr_psprintf(p, "%s setup %s %s", dns01_cmd, authz->domain, token); 
-    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
-                  "%s: dns-01 setup command: %s", authz->domain, cmdline);
-    apr_tokenize_to_argv(cmdline, (char***)&argv, p);
-    if (APR_SUCCESS != (rv = md_util_exec(p, argv[0], argv, &exit_code))) {
-        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
-                      "%s: dns-01 setup command failed to execute", authz->domain);
+    if (batch && apr_table_get(env, MD_KEY_CMD_DNS01_BATCH)) {
+        /* set up together with all others in the order, see md_acme_authz_batch_run() */
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: dns-01 setup queued", 
+                      authz->domain);
+        APR_ARRAY_PUSH(batch->dns01, dns01_record_t*) = rec;
         goto out;
     }
-    if (exit_code) {
-        rv = APR_EGENERAL;
-        md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, p, 
-                      "%s: dns-01 setup command returns %d", authz->domain, exit_code);
-        goto out;
+    
+    if (rec->since) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: dns-01 set up before", 
+                      authz->domain);
+    }
+    else {
+        cmdline = apr_psprintf(p, "%s setup %s %s", dns01_cmd, authz->domain, rec->token); 
+        if (!MD_OK(dns01_exec(cmdline, authz->domain, p))
+            || !MD_OK(dns01_state_save(rec, env, p))) {
+            goto out;
+        }
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "%s: dns-01 setup succeeded", 
+                      authz->domain);
     }
     
-    /* challenge is setup, tell ACME server so it may (re)try verification */        
-    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "%s: dns-01 setup succeeded", authz->domain);
-    authz_req_ctx_init(&ctx, acme, NULL, authz, p);
-    ctx.challenge = cha;
-    rv = md_acme_POST(acme, cha->uri, on_init_authz_resp, authz_http_set, NULL, &ctx);
+    records = apr_array_make(p, 1, sizeof(dns01_record_t*));
+    APR_ARRAY_PUSH(records, dns01_record_t*) = rec;
+    if (MD_OK(dns01_check_visible(records, acme, env, p))) {
+        rv = dns01_notify(rec, acme, p);
+    }
     
 out:    
     return rv;
 }
 
+apr_status_t md_acme_authz_batch_run(md_acme_authz_batch_t *batch, md_acme_t *acme, 
+                                     apr_table_t *env, apr_pool_t *p)
+{
+    dns01_record_t *rec;
+    const char *cmdline;
+    apr_status_t rv = APR_SUCCESS;
+    int i, count = 0;
+    MD_CHK_VARS;
+    
+    if (batch->dns01->nelts <= 0) {
+        goto out;
+    }
+    
+    /* the records an earlier run has set up already are left out */
+    cmdline = apr_pstrcat(p, apr_table_get(env, MD_KEY_CMD_DNS01), " setup-all", NULL);
+    for (i = 0; i < batch->dns01->nelts; ++i) {
+        rec = APR_ARRAY_IDX(batch->dns01, i, dns01_record_t*);
+        if (!rec->since) {
+            cmdline = apr_pstrcat(p, cmdline, " ", rec->authz->domain, " ", rec->token, NULL);
+            ++count;
+        }
+    }
+    if (count > 0) {
+        if (!MD_OK(dns01_exec(cmdline, "batch", p))) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, 
+                          "setup of %d dns-01 challenges failed", count);
+            goto out;
+        }
+        md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, p, "set up %d dns-01 challenges", count);
+        for (i = 0; i < batch->dns01->nelts; ++i) {
+            rec = APR_ARRAY_IDX(batch->dns01, i, dns01_record_t*);
+            if (!rec->since && !MD_OK(dns01_state_save(rec, env, p))) {
+                goto out;
+            }
+        }
+    }
+    
+    if (!MD_OK(dns01_check_visible(batch->dns01, acme, env, p))) {
+        goto out;
+    }
+    for (i = 0; i < batch->dns01->nelts; ++i) {
+        rec = APR_ARRAY_IDX(batch->dns01, i, dns01_record_t*);
+        if (!MD_OK(dns01_notify(rec, acme, p))) {
+            goto out;
+        }
+    }
+out:
+    apr_array_clear(batch->dns01);
+    return rv;
+}
+
 static apr_status_t cha_dns_01_teardown(md_store_t *store, const char *domain, 
                                         apr_table_t *env, apr_pool_t *p)
 {
@@ -447,8 +1085,7 @@ static apr_status_t cha_dns_01_teardown(md_store_t *store, const char *domain,
     apr_status_t rv;
     int exit_code;
     
-    (void)store;
-    
+    dns01_state_remove(store, domain, p);
     dns01_cmd = apr_table_get(env, MD_KEY_CMD_DNS01);
     if (!dns01_cmd) {
         rv = APR_ENOTIMPL;
@@ -458,7 +1095,8 @@ static apr_status_t cha_dns_01_teardown(md_store_t *store, const char *domain,
     
     cmdline = apr_psprintf(p, "%s teardown %s", dns01_cmd, domain); 
     apr_tokenize_to_argv(cmdline, (char***)&argv, p);
-    if (APR_SUCCESS != (rv = md_util_exec(p, argv[0], argv, &exit_code)) || exit_code) {
+    rv = md_util_exec_timeout(p, argv[0], argv, DNS01_CMD_TIMEOUT, &exit_code);
+    if (APR_SUCCESS != rv || exit_code) {
         md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
                       "%s: dns-01 teardown command failed (exit code=%d)",
                       domain, exit_code);
@@ -476,7 +1114,8 @@ static apr_status_t cha_teardown_dir(md_store_t *store, const char *domain,
 
 typedef apr_status_t cha_setup(md_acme_authz_cha_t *cha, md_acme_authz_t *authz, 
                                md_acme_t *acme, md_store_t *store, 
-                               md_pkey_spec_t *key_spec, apr_table_t *env, apr_pool_t *p);
+                               md_pkey_spec_t *key_spec, apr_table_t *env, 
+                               md_acme_authz_batch_t *batch, apr_pool_t *p);
                                
 typedef apr_status_t cha_teardown(md_store_t *store, const char *domain, 
                                   apr_table_t *env, apr_pool_t *p);
@@ -527,7 +1166,8 @@ static apr_status_t find_type(void *baton, size_t index, md_json_t *json)
 
 apr_status_t md_acme_authz_respond(md_acme_authz_t *authz, md_acme_t *acme, md_store_t *store, 
                                    apr_array_header_t *challenges, md_pkey_spec_t *key_spec,
-                                   apr_table_t *env, apr_pool_t *p, const char **psetup_token)
+                                   apr_table_t *env, md_acme_authz_batch_t *batch,
+                                   apr_pool_t *p, const char **psetup_token)
 {
     apr_status_t rv;
     int i;
@@ -561,8 +1201,10 @@ apr_status_t md_acme_authz_respond(md_acme_authz_t *authz, md_acme_t *acme, md_s
         if (fctx.accepted) {
             for (i = 0; i < (int)CHA_TYPES_LEN; ++i) {
                 if (!apr_strnatcasecmp(CHA_TYPES[i].name, fctx.accepted->type)) {
-                    rv = CHA_TYPES[i].setup(fctx.accepted, authz, acme, store, key_spec, env, p);
-                    if (APR_SUCCESS == rv) {
+                    rv = CHA_TYPES[i].setup(fctx.accepted, authz, acme, store, key_spec, 
+                                            env, batch, p);
+                    if (APR_SUCCESS == rv || APR_STATUS_IS_EINPROGRESS(rv)) {
+                        /* in progress: set up, the CA is told later */
                         md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, p, 
                                       "%s: set up challenge '%s'", 
                                       authz->domain, fctx.accepted->type);
@@ -578,7 +1220,8 @@ apr_status_t md_acme_authz_respond(md_acme_authz_t *authz, md_acme_t *acme, md_s
     }
     
 out:
-    *psetup_token = (APR_SUCCESS == rv)? apr_psprintf(p, "%s:%s", cha_setup, authz->domain) : NULL;
+    *psetup_token = (APR_SUCCESS == rv || APR_STATUS_IS_EINPROGRESS(rv))? 
+                    apr_psprintf(p, "%s:%s", cha_setup, authz->domain) : NULL;
     if (!fctx.accepted || APR_ENOTIMPL == rv) {
         rv = APR_EINVAL;
         fctx.offered = apr_array_make(p, 5, sizeof(const char*));
@@ -593,7 +1236,7 @@ out:
                       authz->url);
         return rv;
     }
-    else if (APR_SUCCESS != rv) {
+    else if (APR_SUCCESS != rv && !APR_STATUS_IS_EINPROGRESS(rv)) {
         md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, 
                       "%s: none of the offered challenges could be set up successfully",
                       authz->domain);
@@ -601,8 +1244,7 @@ out:
     return rv;
 }
 
-apr_status_t md_acme_authz_teardown(struct md_store_t *store, 
-                                    const char *token, apr_table_t *env, apr_pool_t *p)
+static const cha_type *token_split(const char **pdomain, const char *token, apr_pool_t *p)
 {
     char *cha_type, *domain;
     int i;
@@ -613,13 +1255,55 @@ apr_status_t md_acme_authz_teardown(struct md_store_t *store,
         *domain = '\0'; domain++;
         for (i = 0; i < (int)CHA_TYPES_LEN; ++i) {
             if (!apr_strnatcasecmp(CHA_TYPES[i].name, cha_type)) {
-                if (CHA_TYPES[i].teardown) {
-                    return CHA_TYPES[i].teardown(store, domain, env, p);
-                }
-                break;
+                *pdomain = domain;
+                return &CHA_TYPES[i];
             }
         }
     }
+    return NULL;
+}
+
+apr_status_t md_acme_authz_teardown(struct md_store_t *store, 
+                                    const char *token, apr_table_t *env, apr_pool_t *p)
+{
+    const cha_type *type;
+    const char *domain;
+    
+    if ((type = token_split(&domain, token, p)) && type->teardown) {
+        return type->teardown(store, domain, env, p);
+    }
     return APR_SUCCESS;
 }
 
+apr_status_t md_acme_authz_teardown_all(struct md_store_t *store, 
+                                        apr_array_header_t *setup_tokens, 
+                                        apr_table_t *env, apr_pool_t *p)
+{
+    const cha_type *type;
+    const char *token, *domain, *cmdline = NULL;
+    apr_status_t rv = APR_SUCCESS, rv2;
+    int i, batch;
+    
+    batch = (NULL != apr_table_get(env, MD_KEY_CMD_DNS01_BATCH));
+    for (i = 0; i < setup_tokens->nelts; ++i) {
+        token = APR_ARRAY_IDX(setup_tokens, i, const char*);
+        if (!token || !(type = token_split(&domain, token, p)) || !type->teardown) {
+            continue;
+        }
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "teardown setup %s", token);
+        if (batch && type->teardown == cha_dns_01_teardown) {
+            dns01_state_remove(store, domain, p);
+            cmdline = apr_pstrcat(p, cmdline? cmdline : "teardown-all", " ", domain, NULL);
+        }
+        else if (APR_SUCCESS != (rv2 = type->teardown(store, domain, env, p))) {
+            rv = rv2;
+        }
+    }
+    if (cmdline && apr_table_get(env, MD_KEY_CMD_DNS01)) {
+        cmdline = apr_pstrcat(p, apr_table_get(env, MD_KEY_CMD_DNS01), " ", cmdline, NULL);
+        if (APR_SUCCESS != (rv2 = dns01_exec(cmdline, "batch", p))) {
+            rv = rv2;
+        }
+    }
+    return rv;
+}
@@ -57,6 +57,8 @@ struct md_acme_authz_t {
 #define MD_FN_TLSSNI01_PKEY     "acme-tls-sni-01.key.pem"
 #define MD_FN_TLSALPN01_CERT    "acme-tls-alpn-01.cert.pem"
 #define MD_FN_TLSALPN01_PKEY    "acme-tls-alpn-01.key.pem"
+#define MD_FN_AUTHZ_CACHE       "authzs.json"
+#define MD_FN_CHA_STATS         "challenges.json"
 
 
 md_acme_authz_t *md_acme_authz_create(apr_pool_t *p);
@@ -69,12 +71,120 @@ apr_status_t md_acme_authz_retrieve(md_acme_t *acme, apr_pool_t *p, const char *
                                     md_acme_authz_t **pauthz);
 apr_status_t md_acme_authz_update(md_acme_authz_t *authz, struct md_acme_t *acme, apr_pool_t *p);
 
+/**
+ * Update the state of all md_acme_authz_t* in the array. The requests are sent 
+ * together and performed concurrently when the http implementation supports it.
+ * Returns APR_SUCCESS when all were retrieved, otherwise the first error seen. 
+ * In *pretry_after the latest time given by the server in a Retry-After header
+ * is returned, or 0 if there was none.
+ */
+apr_status_t md_acme_authz_update_all(struct apr_array_header_t *authzs, struct md_acme_t *acme, 
+                                      apr_time_t *pretry_after, apr_pool_t *p);
+
+/**
+ * Authorizations known to be valid, kept per ACME account in the store as
+ * MD_FN_AUTHZ_CACHE, so that later orders for the same domains need neither
+ * fetch them again nor answer a challenge. Entries are keyed by authz url.
+ * Several orders updating the cache at the same time may lose an entry, which
+ * only costs a new challenge.
+ */
+typedef struct md_acme_authz_cache_t md_acme_authz_cache_t;
+
+/**
+ * Load the cache of the account acme uses. Without an account, the cache 
+ * starts empty and is never saved.
+ */
+apr_status_t md_acme_authz_cache_load(md_acme_authz_cache_t **pcache, struct md_store_t *store,
+                                      struct md_acme_t *acme, apr_pool_t *p);
+
+/**
+ * Get the domain of the valid authorization at url, or NULL if it is not known
+ * or expires within a day.
+ */
+const char *md_acme_authz_cache_get(md_acme_authz_cache_t *cache, const char *url);
+
+/**
+ * Remember authz when it is valid, otherwise forget about it.
+ */
+void md_acme_authz_cache_update(md_acme_authz_cache_t *cache, md_acme_authz_t *authz);
+
+/**
+ * Drop expired entries and write the cache to the store, if it changed.
+ */
+apr_status_t md_acme_authz_cache_save(md_acme_authz_cache_t *cache, apr_pool_t *p);
+
+/**
+ * How the challenge types did for an MD and, for MDs without experience of their own,
+ * for all MDs under the same domain suffix (see md_dns_suffix()). For each type, the 
+ * rate of success, weighing recent validations most, and the average time until a 
+ * challenge was valid are kept, in group MD_SG_STATS as MD_FN_CHA_STATS, one per suffix.
+ * MDs of the same suffix validating at the same time may lose a record.
+ */
+typedef struct md_acme_cha_stats_t md_acme_cha_stats_t;
+
+apr_status_t md_acme_cha_stats_load(md_acme_cha_stats_t **pstats, struct md_store_t *store,
+                                    const char *name, apr_pool_t *p);
+
+/**
+ * Record the outcome of a challenge of the type, with the time it took to be valid.
+ */
+void md_acme_cha_stats_add(md_acme_cha_stats_t *stats, const char *type, int valid, 
+                           apr_interval_time_t duration);
+
+/**
+ * Get the types in the order they are best tried: the reliable ones, fastest first,
+ * then the ones not tried yet and last the ones that failed recently. Types that
+ * compare equal keep their order.
+ */
+apr_array_header_t *md_acme_cha_stats_sort(md_acme_cha_stats_t *stats, 
+                                           apr_array_header_t *types, apr_pool_t *p);
+
+/**
+ * Write the statistics to the store, if they changed.
+ */
+apr_status_t md_acme_cha_stats_save(md_acme_cha_stats_t *stats, apr_pool_t *p);
+
+/**
+ * Challenges whose setup is done for several authorizations together. With 
+ * MD_KEY_CMD_DNS01_BATCH in the env, dns-01 challenges are collected here by
+ * md_acme_authz_respond() and the dns-01 command is invoked once for all of them as
+ *   <cmd> setup-all <domain> <token> [<domain> <token> ...]
+ * by md_acme_authz_batch_run().
+ */
+typedef struct md_acme_authz_batch_t md_acme_authz_batch_t;
+
+md_acme_authz_batch_t *md_acme_authz_batch_make(apr_pool_t *p);
+
+/**
+ * Set up a challenge for authz, one of the given types the CA offers. batch may be NULL,
+ * challenges are then set up right away. Returns APR_EINPROGRESS when the challenge
+ * is set up, but the CA is not told yet, see md_acme_authz_batch_run().
+ */
 apr_status_t md_acme_authz_respond(md_acme_authz_t *authz, struct md_acme_t *acme, 
                                    struct md_store_t *store, apr_array_header_t *challenges, 
                                    struct md_pkey_spec_t *key_spec, struct apr_table_t *env,  
-                                   apr_pool_t *p, const char **setup_token);
+                                   md_acme_authz_batch_t *batch, apr_pool_t *p, 
+                                   const char **setup_token);
+
+/**
+ * Set up all challenges collected in the batch and tell the CA about them. With
+ * MD_KEY_DNS01_CHECK in the env, all dns-01 records are first looked up at that
+ * DNS query service, once. While some are not visible there, the CA is not told and 
+ * APR_EINPROGRESS is returned. Calling again with the same challenges does not set
+ * them up again, only looks them up anew, until the check timeout runs out.
+ */
+apr_status_t md_acme_authz_batch_run(md_acme_authz_batch_t *batch, struct md_acme_t *acme, 
+                                     struct apr_table_t *env, apr_pool_t *p);
 
 apr_status_t md_acme_authz_teardown(struct md_store_t *store, const char *setup_token, 
                                     struct apr_table_t *env, apr_pool_t *p);
 
+/**
+ * Tear down the challenges for all setup tokens. dns-01 challenges are torn down 
+ * in one call of "<cmd> teardown-all <domain> [<domain> ...]" when batching is on.
+ */
+apr_status_t md_acme_authz_teardown_all(struct md_store_t *store, 
+                                        struct apr_array_header_t *setup_tokens, 
+                                        struct apr_table_t *env, apr_pool_t *p);
+
 #endif /* md_acme_authz_h */
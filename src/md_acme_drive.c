@@ -20,6 +20,7 @@
 #include <apr_lib.h>
 #include <apr_strings.h>
 #include <apr_buckets.h>
+#include <apr_date.h>
 #include <apr_hash.h>
 #include <apr_uri.h>
 
@@ -31,6 +32,7 @@
 #include "md_log.h"
 #include "md_reg.h"
 #include "md_store.h"
+#include "md_trace.h"
 #include "md_util.h"
 
 #include "md_acme.h"
@@ -42,6 +44,26 @@
 #include "md_acmev1_drive.h"
 #include "md_acmev2_drive.h"
 
+/**************************************************************************************************/
+/* phases */
+
+void md_acme_drive_phase(md_acme_driver_t *ad, const char *phase, apr_status_t rv)
+{
+    apr_time_t now;
+    
+    if (md_trace_on()) {
+        now = apr_time_now();
+        if (ad->phase && ad->phase_start) {
+            md_trace_add(MD_TRACE_PHASE, ad->driver->md->name, ad->phase, rv, 
+                         ad->phase_start, now);
+        }
+        ad->phase_start = phase? now : 0;
+    }
+    if (phase) {
+        ad->phase = phase;
+    }
+}
+
 /**************************************************************************************************/
 /* account setup */
 
@@ -85,7 +107,7 @@ apr_status_t md_acme_drive_set_acct(md_proto_driver_t *d)
     apr_status_t rv = APR_SUCCESS;
     int update_md = 0, update_acct = 0;
     
-    ad->phase = "choose account";
+    md_acme_drive_phase(ad, "choose account", APR_SUCCESS);
     md_acme_clear_acct(ad->acme);
     
     /* Do we have a staged (modified) account? */
@@ -245,7 +267,7 @@ apr_status_t md_acme_drive_cert_poll(md_proto_driver_t *d, int only_once)
     assert(ad->order);
     assert(ad->order->certificate);
     
-    ad->phase = "poll certificate";
+    md_acme_drive_phase(ad, "poll certificate", APR_SUCCESS);
     if (only_once) {
         rv = get_cert(d, 0);
     }
@@ -344,24 +366,40 @@ apr_status_t md_acme_drive_setup_certificate(md_proto_driver_t *d)
     md_pkey_t *privkey;
     apr_status_t rv;
 
-    ad->phase = "setup cert privkey";
+    md_acme_drive_phase(ad, "setup cert privkey", APR_SUCCESS);
     
-    rv = md_pkey_load(d->store, MD_SG_STAGING, ad->md->name, &privkey, d->p);
+    rv = md_pkey_load_for(d->store, MD_SG_STAGING, ad->md->name, ad->spec, &privkey, d->p);
     if (APR_STATUS_IS_ENOENT(rv)) {
-        if (APR_SUCCESS == (rv = md_pkey_gen(&privkey, d->p, d->md->pkey_spec))) {
-            rv = md_pkey_save(d->store, d->p, MD_SG_STAGING, ad->md->name, privkey, 1);
+        rv = md_pkey_pool_gen(&privkey, d->store, 
+                              ad->spec? ad->spec : d->md->pkey_spec, d->p);
+        if (APR_SUCCESS == rv) {
+            rv = md_pkey_save_for(d->store, d->p, MD_SG_STAGING, ad->md->name, 
+                                  ad->spec, privkey, 1);
         }
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, d->p, "%s: generate privkey", ad->md->name);
     }
     if (APR_SUCCESS != rv) goto out;
     
-    ad->phase = "setup csr";
-    rv = md_cert_req_create(&ad->csr_der_64, ad->md->name, ad->domains, 
-                            ad->md->must_staple, privkey, d->p);
-    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, d->p, "%s: create CSR", ad->md->name);
-    if (APR_SUCCESS != rv) goto out;
+    md_acme_drive_phase(ad, "setup csr", APR_SUCCESS);
+    if (APR_SUCCESS == md_csr_load_for(&ad->csr_der_64, d->store, MD_SG_STAGING, ad->md->name,
+                                       ad->spec, ad->domains, ad->md->must_staple, d->p)
+        && md_cert_req_is_for(ad->csr_der_64, privkey, d->p)) {
+        /* prepared by md_reg_prestage() */
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, d->p, "%s: using staged CSR", ad->md->name);
+    }
+    else {
+        rv = md_cert_req_create(&ad->csr_der_64, ad->md->name, ad->domains, 
+                                ad->md->must_staple, privkey, d->p);
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, d->p, "%s: create CSR", ad->md->name);
+        if (APR_SUCCESS != rv) goto out;
+    }
 
-    ad->phase = "submit csr";
+    md_acme_drive_phase(ad, "submit csr", APR_SUCCESS);
+    if (APR_SUCCESS != (rv = md_acme_rl_take(ad->acme, MD_ACME_RL_CERTS, ad->domains, NULL))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, d->p, 
+                      "%s: certificate limit for its domains reached at the CA", ad->md->name);
+        goto out;
+    }
     switch (MD_ACME_VERSION_MAJOR(ad->acme->version)) {
         case 1:
             rv = md_acme_POST(ad->acme, ad->acme->api.v1.new_cert, on_init_csr_req, NULL, csr_req, d);
@@ -380,27 +418,175 @@ out:
 /**************************************************************************************************/
 /* cert chain retrieval */
 
+/* how long an issuer is used from the cache when the server does not say */
+#define ISSUER_CACHE_TTL        apr_time_from_sec(7 * MD_SECS_PER_DAY)
+
+static apr_time_t issuer_expiry(const md_http_response_t *res)
+{
+    const char *s;
+    apr_time_t t;
+    
+    if ((s = apr_table_get(res->headers, "Cache-Control"))) {
+        if (strstr(s, "no-store") || strstr(s, "no-cache")) {
+            /* keep it for revalidation only */
+            return apr_time_now();
+        }
+        if ((s = strstr(s, "max-age="))) {
+            return apr_time_now() + apr_time_from_sec(apr_atoi64(s + sizeof("max-age=") - 1));
+        }
+    }
+    if ((s = apr_table_get(res->headers, "Expires")) && (t = apr_date_parse_http(s))) {
+        return t;
+    }
+    return apr_time_now() + ISSUER_CACHE_TTL;
+}
+
+static void issuer_cache_put(md_proto_driver_t *d, const md_http_response_t *res, 
+                             apr_array_header_t *certs, int first, const char *up)
+{
+    md_issuer_t issuer;
+    apr_status_t rv;
+    int i;
+    
+    memset(&issuer, 0, sizeof(issuer));
+    issuer.url = res->req->url;
+    issuer.etag = apr_table_get(res->headers, "ETag");
+    issuer.expires = issuer_expiry(res);
+    issuer.up = up;
+    issuer.certs = apr_array_make(d->p, 3, sizeof(md_cert_t *));
+    for (i = first; i < certs->nelts; ++i) {
+        APR_ARRAY_PUSH(issuer.certs, md_cert_t *) = APR_ARRAY_IDX(certs, i, md_cert_t *);
+    }
+    if (APR_SUCCESS != (rv = md_issuer_save(d->store, d->p, &issuer))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, d->p, 
+                      "caching issuer certificates from %s", issuer.url);
+    }
+}
+
 static apr_status_t on_add_chain(md_acme_t *acme, const md_http_response_t *res, void *baton)
 {
     md_proto_driver_t *d = baton;
     md_acme_driver_t *ad = d->baton;
     apr_status_t rv = APR_SUCCESS;
     const char *ct;
+    int nelts = ad->certs->nelts;
     
     (void)acme;
     ct = apr_table_get(res->headers, "Content-Type");
     if (ct && !strcmp("application/x-pkcs7-mime", ct)) {
         /* root cert most likely, end it here */
+        issuer_cache_put(d, res, ad->certs, nelts, NULL);
         return APR_SUCCESS;
     }
     
     if (APR_SUCCESS == (rv = add_http_certs(ad->certs, d->p, res))) {
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, d->p, "chain cert parsed");
         get_up_link(d, res->headers);
+        issuer_cache_put(d, res, ad->certs, nelts, ad->next_up_link);
     }
     return rv;
 }
 
+typedef struct {
+    md_proto_driver_t *d;
+    md_issuer_t *issuer;
+} issuer_ctx;
+
+static apr_status_t on_init_issuer(md_acme_req_t *req, void *baton)
+{
+    issuer_ctx *ctx = baton;
+    
+    if (ctx->issuer->etag) {
+        apr_table_set(req->req_hdrs, "If-None-Match", ctx->issuer->etag);
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t on_issuer_revalidated(md_acme_t *acme, const md_http_response_t *res, 
+                                          void *baton)
+{
+    issuer_ctx *ctx = baton;
+    md_proto_driver_t *d = ctx->d;
+    apr_array_header_t *certs;
+    const char *ct;
+    apr_status_t rv = APR_SUCCESS;
+    
+    (void)acme;
+    if (res->status == 304) {
+        ctx->issuer->expires = issuer_expiry(res);
+        return md_issuer_save(d->store, d->p, ctx->issuer);
+    }
+    certs = apr_array_make(d->p, 3, sizeof(md_cert_t *));
+    ct = apr_table_get(res->headers, "Content-Type");
+    if (ct && !strcmp("application/x-pkcs7-mime", ct)) {
+        issuer_cache_put(d, res, certs, 0, NULL);
+    }
+    else if (APR_SUCCESS == (rv = md_cert_chain_read_http(certs, d->p, res))) {
+        issuer_cache_put(d, res, certs, 0, md_link_find_relation(res->headers, d->p, "up"));
+    }
+    else {
+        return rv;
+    }
+    return APR_SUCCESS;
+}
+
+static void issuers_revalidate(md_proto_driver_t *d, const char *url)
+{
+    md_acme_driver_t *ad = d->baton;
+    apr_array_header_t *stale;
+    md_issuer_t *issuer;
+    issuer_ctx *ctx;
+    apr_time_t now = apr_time_now();
+    int i, deferred;
+    
+    /* The known issuers tell us the links up the chain, without asking the server
+     * for each hop in turn. The expired ones among them are revalidated together. */
+    stale = apr_array_make(d->p, 5, sizeof(issuer_ctx *));
+    for (i = 0; url && i < 10; ++i) {
+        if (APR_SUCCESS != md_issuer_load(&issuer, d->store, url, d->p)) break;
+        if (issuer->expires <= now) {
+            ctx = apr_pcalloc(d->p, sizeof(*ctx));
+            ctx->d = d;
+            ctx->issuer = issuer;
+            APR_ARRAY_PUSH(stale, issuer_ctx *) = ctx;
+        }
+        url = issuer->up;
+    }
+    if (md_array_is_empty(stale)) {
+        return;
+    }
+    
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, d->p, 
+                  "revalidating %d cached issuers", stale->nelts);
+    deferred = md_http_set_deferred(ad->acme->http, 1);
+    for (i = 0; i < stale->nelts; ++i) {
+        ctx = APR_ARRAY_IDX(stale, i, issuer_ctx *);
+        /* failures leave the entry expired and it is retrieved again further on */
+        md_acme_GET(ad->acme, ctx->issuer->url, on_init_issuer, NULL, on_issuer_revalidated, ctx);
+    }
+    md_http_await_all(ad->acme->http);
+    md_http_set_deferred(ad->acme->http, deferred);
+}
+
+static apr_status_t chain_from_cache(md_proto_driver_t *d, const char *url)
+{
+    md_acme_driver_t *ad = d->baton;
+    md_issuer_t *issuer;
+    int i;
+    
+    if (APR_SUCCESS != md_issuer_load(&issuer, d->store, url, d->p)
+        || issuer->expires <= apr_time_now()) {
+        return APR_ENOENT;
+    }
+    for (i = 0; i < issuer->certs->nelts; ++i) {
+        APR_ARRAY_PUSH(ad->certs, md_cert_t *) = APR_ARRAY_IDX(issuer->certs, i, md_cert_t *);
+    }
+    ad->next_up_link = issuer->up;
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, d->p, 
+                  "%d chain certs from cache for %s", issuer->certs->nelts, url);
+    return APR_SUCCESS;
+}
+
 static apr_status_t get_chain(void *baton, int attempt)
 {
     md_proto_driver_t *d = baton;
@@ -408,15 +594,18 @@ static apr_status_t get_chain(void *baton, int attempt)
     const char *prev_link = NULL;
     apr_status_t rv = APR_SUCCESS;
 
+    issuers_revalidate(d, ad->next_up_link);
     while (APR_SUCCESS == rv && ad->certs->nelts < 10) {
         int nelts = ad->certs->nelts;
         
         if (ad->next_up_link && (!prev_link || strcmp(prev_link, ad->next_up_link))) {
             prev_link = ad->next_up_link;
 
-            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, d->p, 
-                          "next chain cert at  %s", ad->next_up_link);
-            rv = md_acme_GET(ad->acme, ad->next_up_link, NULL, NULL, on_add_chain, d);
+            if (APR_SUCCESS != chain_from_cache(d, ad->next_up_link)) {
+                md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, d->p, 
+                              "next chain cert at  %s", ad->next_up_link);
+                rv = md_acme_GET(ad->acme, ad->next_up_link, NULL, NULL, on_add_chain, d);
+            }
             
             if (APR_SUCCESS == rv && nelts == ad->certs->nelts) {
                 break;
@@ -567,13 +756,96 @@ static apr_status_t acme_driver_init(md_proto_driver_t *d)
 /**************************************************************************************************/
 /* ACME staging */
 
+/* Obtain the certificate chain for the private key of 'spec' in STAGING, unless it
+ * is already there. A NULL spec stands for the primary certificate of the MD. */
+static apr_status_t acme_stage_cert(md_proto_driver_t *d, md_pkey_spec_t *spec)
+{
+    md_acme_driver_t *ad = d->baton;
+    apr_status_t rv = APR_SUCCESS;
+    
+    ad->spec = spec;
+    ad->certs = NULL;
+    ad->next_up_link = NULL;
+    
+    /* have we created this already? */
+    md_pubcert_load_for(d->store, MD_SG_STAGING, ad->md->name, spec, &ad->certs, d->p);
+    if (!md_array_is_empty(ad->certs)) {
+        goto out;
+    }
+    
+    /* The process of setting up challenges and verifying domain
+     * names differs between ACME versions. */
+    switch (MD_ACME_VERSION_MAJOR(ad->acme->version)) {
+            case 1:
+            rv = md_acmev1_drive_renew(ad, d);
+            break;
+            case 2:
+            rv = md_acmev2_drive_renew(ad, d);
+            break;
+        default:
+            rv = APR_EINVAL;
+            break;
+    }
+    if (APR_SUCCESS != rv) goto out;
+    
+    if (md_array_is_empty(ad->certs) || ad->next_up_link) {
+        md_acme_drive_phase(ad, "retrieve certificate chain", APR_SUCCESS);
+        md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, d->p, 
+                      "%s: retrieving certificate chain", d->md->name);
+        rv = ad_chain_retrieve(d);
+        
+        if (APR_SUCCESS == rv && !md_array_is_empty(ad->certs)) {
+            rv = md_pubcert_save_for(d->store, d->p, MD_SG_STAGING, ad->md->name, 
+                                     spec, ad->certs, 0);
+        }
+        if (APR_SUCCESS != rv) goto out;
+    }
+    
+out:
+    if (APR_SUCCESS == rv) {
+        /* we should have the complete cert chain now */
+        assert(!md_array_is_empty(ad->certs));
+        assert(ad->certs->nelts > 1);
+        /* Cleanup any order we created so that challenge data may be removed asap.
+         * The next certificate, if any, needs an order of its own. */
+        md_acme_order_purge(d->store, d->p, MD_SG_STAGING, d->md->name, d->env);
+        ad->order = NULL;
+    }
+    return rv;
+}
+
+/* Check if the keys and certificates for all additional key specs are staged. */
+static int alt_creds_staged(md_proto_driver_t *d)
+{
+    md_acme_driver_t *ad = d->baton;
+    md_pkey_spec_t *spec;
+    md_pkey_t *privkey;
+    apr_array_header_t *pubcert;
+    int i;
+    
+    for (i = 0; d->md->alt_pkey_specs && i < d->md->alt_pkey_specs->nelts; ++i) {
+        spec = APR_ARRAY_IDX(d->md->alt_pkey_specs, i, md_pkey_spec_t*);
+        if (APR_SUCCESS != md_pkey_load_for(d->store, MD_SG_STAGING, ad->md->name, 
+                                            spec, &privkey, d->p)
+            || APR_SUCCESS != md_pubcert_load_for(d->store, MD_SG_STAGING, ad->md->name, 
+                                                  spec, &pubcert, d->p)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
 static apr_status_t acme_stage(md_proto_driver_t *d)
 {
     md_acme_driver_t *ad = d->baton;
     int reset_staging = d->reset;
     apr_status_t rv = APR_SUCCESS;
-    apr_time_t now;
+    apr_time_t now, valid_from;
     apr_interval_time_t max_delay, delay_activation; 
+    md_pkey_spec_t *spec;
+    apr_array_header_t *cas;
+    const char *ca_url = NULL;
+    int i;
 
     if (md_log_is_level(d->p, MD_LOG_DEBUG)) {
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, d->p, "%s: staging started, "
@@ -626,25 +898,44 @@ static apr_status_t acme_stage(md_proto_driver_t *d)
     }
     
     /* Find out where we're at with this managed domain */
-    if (ad->ncreds && ad->ncreds->privkey && ad->ncreds->pubcert) {
+    if (ad->ncreds && ad->ncreds->privkey && ad->ncreds->pubcert && alt_creds_staged(d)) {
         /* There is a full set staged, to be loaded */
         md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, d->p, "%s: all data staged", d->md->name);
         goto out;
     }
 
-    /* Need to renew */
-    if (APR_SUCCESS != (rv = md_acme_create(&ad->acme, d->p, d->md->ca_url, d->proxy_url)) 
-        || APR_SUCCESS != (rv = md_acme_setup(ad->acme))) {
-        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, d->p, "%s: setup ACME(%s)", 
-                      d->md->name, d->md->ca_url);
+    /* Need to renew, at the first CA that answers, the healthy ones first */
+    if (d->md->ca_urls && d->md->ca_urls->nelts > 0) {
+        cas = md_acme_ca_order(d->md->ca_urls, d->p);
+    }
+    else {
+        cas = apr_array_make(d->p, 1, sizeof(const char*));
+        APR_ARRAY_PUSH(cas, const char*) = d->md->ca_url;
+    }
+    for (i = 0; i < cas->nelts; ++i) {
+        ca_url = APR_ARRAY_IDX(cas, i, const char*);
+        if (APR_SUCCESS == (rv = md_acme_create(&ad->acme, d->p, ca_url, d->proxy_url))) {
+            ad->acme->trace_name = d->md->name;
+            rv = md_acme_setup(ad->acme);
+        }
+        if (APR_SUCCESS == rv) break;
+        md_log_perror(MD_LOG_MARK, (i + 1 < cas->nelts)? MD_LOG_WARNING : MD_LOG_ERR, rv, d->p, 
+                      "%s: setup ACME(%s)", d->md->name, ca_url);
+    }
+    if (APR_SUCCESS != rv) {
         goto out;
     }
+    if (cas->nelts > 1) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, d->p, "%s: using CA %s", 
+                      d->md->name, ca_url);
+    }
     
-    if (!ad->md || strcmp(ad->md->ca_url, d->md->ca_url)) {
-        /* re-initialize staging */
+    if (!ad->md || strcmp(md_ca_effective(ad->md), ca_url)) {
+        /* re-initialize staging, orders and accounts are for one CA */
         md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, d->p, "%s: setup staging", d->md->name);
         md_store_purge(d->store, d->p, MD_SG_STAGING, d->md->name);
         ad->md = md_copy(d->p, d->md);
+        ad->md->ca_effective = ca_url;
         ad->order = NULL;
         rv = md_save(d->store, d->p, MD_SG_STAGING, ad->md, 0);
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, d->p, "%s: save staged md", 
@@ -654,47 +945,21 @@ static apr_status_t acme_stage(md_proto_driver_t *d)
     if (!ad->domains) {
         ad->domains = md_dns_make_minimal(d->p, ad->md->domains);
     }
-    if (md_array_is_empty(ad->certs)) {
-        /* have we created this already? */
-        md_pubcert_load(d->store, MD_SG_STAGING, ad->md->name, &ad->certs, d->p);
-    }
     
-    if (md_array_is_empty(ad->certs)) {
-        /* The process of setting up challenges and verifying domain
-         * names differs between ACME versions. */
-        switch (MD_ACME_VERSION_MAJOR(ad->acme->version)) {
-                case 1:
-                rv = md_acmev1_drive_renew(ad, d);
-                break;
-                case 2:
-                rv = md_acmev2_drive_renew(ad, d);
-                break;
-            default:
-                rv = APR_EINVAL;
-                break;
-        }
-        if (APR_SUCCESS != rv) goto out;
-    }
-    
-    if (md_array_is_empty(ad->certs) || ad->next_up_link) {
-        ad->phase = "retrieve certificate chain";
-        md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, d->p, 
-                      "%s: retrieving certificate chain", d->md->name);
-        rv = ad_chain_retrieve(d);
+    /* Get the primary certificate and one for each additional key spec */
+    d->stage_valid_from = 0;
+    for (i = -1; i < (d->md->alt_pkey_specs? d->md->alt_pkey_specs->nelts : 0); ++i) {
+        spec = (i < 0)? NULL : APR_ARRAY_IDX(d->md->alt_pkey_specs, i, md_pkey_spec_t*);
+        if (APR_SUCCESS != (rv = acme_stage_cert(d, spec))) goto out;
         
-        if (APR_SUCCESS == rv && !md_array_is_empty(ad->certs)) {
-            rv = md_pubcert_save(d->store, d->p, MD_SG_STAGING, ad->md->name, ad->certs, 0);
+        valid_from = md_cert_get_not_before(APR_ARRAY_IDX(ad->certs, 0, md_cert_t*));
+        if (valid_from > d->stage_valid_from) {
+            d->stage_valid_from = valid_from;
         }
-        if (APR_SUCCESS != rv) goto out;
     }
     
-    /* we should have the complete cert chain now */
-    assert(!md_array_is_empty(ad->certs));
-    assert(ad->certs->nelts > 1);
-    
-    /* determine when this cert should be activated */
+    /* determine when the certificates should be activated */
     now = apr_time_now();
-    d->stage_valid_from = md_cert_get_not_before(APR_ARRAY_IDX(ad->certs, 0, md_cert_t*));
     if (d->md->state == MD_S_COMPLETE && d->md->expires > now) {            
         /* The MD is complete and un-expired. This is a renewal run. 
          * Give activation 24 hours leeway (if we have that time) to
@@ -707,10 +972,6 @@ static apr_status_t acme_stage(md_proto_driver_t *d)
         d->stage_valid_from += delay_activation;
     }
 
-    /* As last step, cleanup any order we created so that challenge data
-     * may be removed asap. */
-    md_acme_order_purge(d->store, d->p, MD_SG_STAGING, d->md->name, d->env);
-
 out:    
     return rv;
 }
@@ -720,8 +981,10 @@ static apr_status_t acme_driver_stage(md_proto_driver_t *d)
     md_acme_driver_t *ad = d->baton;
     apr_status_t rv;
 
-    ad->phase = "ACME staging";
-    if (APR_SUCCESS == (rv = acme_stage(d))) {
+    md_acme_drive_phase(ad, "ACME staging", APR_SUCCESS);
+    rv = acme_stage(d);
+    md_acme_drive_phase(ad, NULL, rv);
+    if (APR_SUCCESS == rv) {
         ad->phase = "staging done";
     }
         
@@ -737,10 +1000,14 @@ static apr_status_t acme_preload(md_proto_driver_t *d, md_store_group_t load_gro
                                  const char *name) 
 {
     apr_status_t rv;
-    md_pkey_t *privkey, *acct_key;
+    md_pkey_t *privkey, *acct_key, *alt_privkey;
     md_t *md;
-    apr_array_header_t *pubcert;
+    apr_array_header_t *pubcert, *alt_pubcert, *alt_privkeys, *alt_pubcerts;
     struct md_acme_acct_t *acct;
+    md_pkey_spec_t *spec;
+    md_store_txn_t *txn;
+    const char *cert_fname, *pkey_fname;
+    int i, n;
 
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, d->p, "%s: preload start", name);
     /* Load data from MD_SG_STAGING and save it into "load_group".
@@ -763,6 +1030,26 @@ static apr_status_t acme_preload(md_proto_driver_t *d, md_store_group_t load_gro
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, d->p, "%s: loading pubcert", name);
         return rv;
     }
+    n = md->alt_pkey_specs? md->alt_pkey_specs->nelts : 0;
+    alt_privkeys = apr_array_make(d->p, n + 1, sizeof(md_pkey_t*));
+    alt_pubcerts = apr_array_make(d->p, n + 1, sizeof(apr_array_header_t*));
+    for (i = 0; i < n; ++i) {
+        spec = APR_ARRAY_IDX(md->alt_pkey_specs, i, md_pkey_spec_t*);
+        if (APR_SUCCESS != (rv = md_pkey_load_for(d->store, MD_SG_STAGING, name, 
+                                                  spec, &alt_privkey, d->p))) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, d->p, "%s: loading staging "
+                          "private key %s", name, md_pkey_fname_for(spec, d->p));
+            return rv;
+        }
+        if (APR_SUCCESS != (rv = md_pubcert_load_for(d->store, MD_SG_STAGING, name, 
+                                                     spec, &alt_pubcert, d->p))) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, d->p, "%s: loading pubcert %s", 
+                          name, md_pubcert_fname_for(spec, d->p));
+            return rv;
+        }
+        APR_ARRAY_PUSH(alt_privkeys, md_pkey_t*) = alt_privkey;
+        APR_ARRAY_PUSH(alt_pubcerts, apr_array_header_t*) = alt_pubcert;
+    }
 
     /* See if staging holds a new or modified account data */
     rv = md_acme_acct_load(&acct, &acct_key, d->store, MD_SG_STAGING, name, d->p);
@@ -807,7 +1094,8 @@ static apr_status_t acme_preload(md_proto_driver_t *d, md_store_group_t load_gro
             }
         }
         
-        if (APR_SUCCESS != (rv = md_acme_create(&acme, d->p, md->ca_url, d->proxy_url))) {
+        if (APR_SUCCESS != (rv = md_acme_create(&acme, d->p, md_ca_effective(md), 
+                                                d->proxy_url))) {
             md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, d->p, "%s: error creating acme", name);
             return rv;
         }
@@ -821,16 +1109,29 @@ static apr_status_t acme_preload(md_proto_driver_t *d, md_store_group_t load_gro
                       name, id);
     }
     
-    if (APR_SUCCESS != (rv = md_save(d->store, d->p, load_group, md, 1))) {
-        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, d->p, "%s: saving md json", name);
-        return rv;
-    }
-    if (APR_SUCCESS != (rv = md_pubcert_save(d->store, d->p, load_group, name, pubcert, 1))) {
-        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, d->p, "%s: saving cert chain", name);
-        return rv;
+    /* md, certificates and keys replace the ones in load_group together */
+    txn = md_store_txn_begin(d->store, d->p, load_group, name);
+    md_store_txn_save(txn, MD_FN_MD, MD_SV_JSON, md_to_json(md, d->p));
+    md_store_txn_save(txn, MD_FN_PUBCERT, MD_SV_CHAIN, pubcert);
+    md_store_txn_save(txn, MD_FN_PRIVKEY, MD_SV_PKEY, privkey);
+    for (i = 0; i < n; ++i) {
+        spec = APR_ARRAY_IDX(md->alt_pkey_specs, i, md_pkey_spec_t*);
+        alt_pubcert = APR_ARRAY_IDX(alt_pubcerts, i, apr_array_header_t*);
+        alt_privkey = APR_ARRAY_IDX(alt_privkeys, i, md_pkey_t*);
+        cert_fname = md_pubcert_fname_for(spec, d->p);
+        pkey_fname = md_pkey_fname_for(spec, d->p);
+        if (!cert_fname || !pkey_fname) {
+            rv = APR_EINVAL;
+            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, d->p, "%s: no file names for "
+                          "alternate key %d", name, i);
+            return rv;
+        }
+        md_store_txn_save(txn, cert_fname, MD_SV_CHAIN, alt_pubcert);
+        md_store_txn_save(txn, pkey_fname, MD_SV_PKEY, alt_privkey);
     }
-    if (APR_SUCCESS != (rv = md_pkey_save(d->store, d->p, load_group, name, privkey, 1))) {
-        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, d->p, "%s: saving private key", name);
+    if (APR_SUCCESS != (rv = md_store_txn_commit(txn))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, d->p, "%s: saving md, cert chains "
+                      "and private keys", name);
         return rv;
     }
     
@@ -842,8 +1143,10 @@ static apr_status_t acme_driver_preload(md_proto_driver_t *d, md_store_group_t g
     md_acme_driver_t *ad = d->baton;
     apr_status_t rv;
 
-    ad->phase = "ACME preload";
-    if (APR_SUCCESS == (rv = acme_preload(d, group, d->md->name))) {
+    md_acme_drive_phase(ad, "ACME preload", APR_SUCCESS);
+    rv = acme_preload(d, group, d->md->name);
+    md_acme_drive_phase(ad, NULL, rv);
+    if (APR_SUCCESS == rv) {
         ad->phase = "preload done";
     }
         
@@ -852,8 +1155,23 @@ static apr_status_t acme_driver_preload(md_proto_driver_t *d, md_store_group_t g
     return rv;
 }
 
+static apr_status_t acme_driver_renewal_info(md_proto_driver_t *d, md_cert_t *cert, 
+                                             apr_time_t *pstart, apr_time_t *pend, 
+                                             apr_time_t *pretry_at)
+{
+    md_acme_t *acme;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS == (rv = md_acme_create(&acme, d->p, md_ca_effective(d->md), 
+                                            d->proxy_url))) {
+        rv = md_acme_get_renewal_info(pstart, pend, pretry_at, acme, cert, d->p);
+    }
+    return rv;
+}
+
 static md_proto_t ACME_PROTO = {
-    MD_PROTO_ACME, acme_driver_init, acme_driver_stage, acme_driver_preload
+    MD_PROTO_ACME, acme_driver_init, acme_driver_stage, acme_driver_preload,
+    acme_driver_renewal_info
 };
  
 apr_status_t md_acme_protos_add(apr_hash_t *protos, apr_pool_t *p)
@@ -18,14 +18,17 @@
 
 struct apr_array_header_t;
 struct md_acme_order_t;
+struct md_pkey_spec_t;
 
 typedef struct md_acme_driver_t {
     md_proto_driver_t *driver;
     void *sub_driver;
     
     const char *phase;
+    apr_time_t phase_start;          /* when tracing, the time the phase started */
     int complete;
 
+    struct md_pkey_spec_t *spec;     /* key spec of the certificate in work, NULL for primary */
     md_pkey_t *privkey;              /* the new private key */
     apr_array_header_t *pubcert;     /* the new certificate + chain certs */
     
@@ -46,6 +49,13 @@ typedef struct md_acme_driver_t {
     
 } md_acme_driver_t;
 
+/**
+ * Enter the next phase of the drive, ending the current one with status rv. With
+ * tracing on, the time spent in the ended phase is recorded. A NULL phase only ends
+ * the current one, keeping its name for messages.
+ */
+void md_acme_drive_phase(md_acme_driver_t *ad, const char *phase, apr_status_t rv);
+
 apr_status_t md_acme_drive_set_acct(struct md_proto_driver_t *d);
 apr_status_t md_acme_drive_setup_certificate(struct md_proto_driver_t *d);
 apr_status_t md_acme_drive_cert_poll(struct md_proto_driver_t *d, int only_once);
@@ -97,43 +97,43 @@ static const char *order_st_to_str(md_acme_order_st status)
     }
 }
 
+/* The members of an order kept as they are, updated from server responses as well */
+static const md_json_field_t order_fields[] = {
+    { MD_JSON_PATH(MD_KEY_AUTHORIZATIONS), MD_JSON_FIELD_STRA, 
+      APR_OFFSETOF(md_acme_order_t, authz_urls) },
+    { MD_JSON_PATH(MD_KEY_CHALLENGE_SETUPS), MD_JSON_FIELD_STRA, 
+      APR_OFFSETOF(md_acme_order_t, challenge_setups) },
+    { MD_JSON_PATH(MD_KEY_FINALIZE), MD_JSON_FIELD_STR, 
+      APR_OFFSETOF(md_acme_order_t, finalize) },
+    { MD_JSON_PATH(MD_KEY_CERTIFICATE), MD_JSON_FIELD_STR, 
+      APR_OFFSETOF(md_acme_order_t, certificate) },
+};
+
+static const md_json_path_t P_URL = MD_JSON_PATH(MD_KEY_URL);
+static const md_json_path_t P_STATUS = MD_JSON_PATH(MD_KEY_STATUS);
+
 md_json_t *md_acme_order_to_json(md_acme_order_t *order, apr_pool_t *p)
 {
     md_json_t *json = md_json_create(p);
 
     if (order->url) {
-        md_json_sets(order->url, json, MD_KEY_URL, NULL);
-    }
-    md_json_sets(order_st_to_str(order->status), json, MD_KEY_STATUS, NULL);
-    md_json_setsa(order->authz_urls, json, MD_KEY_AUTHORIZATIONS, NULL);
-    md_json_setsa(order->challenge_setups, json, MD_KEY_CHALLENGE_SETUPS, NULL);
-    if (order->finalize) {
-        md_json_sets(order->finalize, json, MD_KEY_FINALIZE, NULL);
-    }
-    if (order->certificate) {
-        md_json_sets(order->certificate, json, MD_KEY_CERTIFICATE, NULL);
+        md_json_sets_p(order->url, json, &P_URL);
     }
+    md_json_sets_p(order_st_to_str(order->status), json, &P_STATUS);
+    md_json_fields_set(order, order_fields, sizeof(order_fields)/sizeof(order_fields[0]), json);
     return json;
 }
 
 static void order_update_from_json(md_acme_order_t *order, md_json_t *json, apr_pool_t *p)
 {
-    if (!order->url && md_json_has_key(json, MD_KEY_URL, NULL)) {
-        order->url = md_json_dups(p, json, MD_KEY_URL, NULL);
-    }
-    order->status = order_st_from_str(md_json_gets(json, MD_KEY_STATUS, NULL));
-    if (md_json_has_key(json, MD_KEY_AUTHORIZATIONS, NULL)) {
-        md_json_dupsa(order->authz_urls, p, json, MD_KEY_AUTHORIZATIONS, NULL);
-    }
-    if (md_json_has_key(json, MD_KEY_CHALLENGE_SETUPS, NULL)) {
-        md_json_dupsa(order->challenge_setups, p, json, MD_KEY_CHALLENGE_SETUPS, NULL);
-    }
-    if (md_json_has_key(json, MD_KEY_FINALIZE, NULL)) {
-        order->finalize = md_json_dups(p, json, MD_KEY_FINALIZE, NULL);
-    }
-    if (md_json_has_key(json, MD_KEY_CERTIFICATE, NULL)) {
-        order->certificate = md_json_dups(p, json, MD_KEY_CERTIFICATE, NULL);
+    const char *s;
+    
+    if (!order->url && (s = md_json_dups_p(p, json, &P_URL))) {
+        order->url = s;
     }
+    order->status = order_st_from_str(md_json_gets_p(json, &P_STATUS));
+    md_json_fields_get(order, order_fields, sizeof(order_fields)/sizeof(order_fields[0]), 
+                       json, p);
 }
 
 md_acme_order_t *md_acme_order_from_json(md_json_t *json, apr_pool_t *p)
@@ -225,9 +225,8 @@ static apr_status_t p_purge(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_li
     md_store_t *store = baton;
     md_acme_order_t *order;
     md_store_group_t group;
-    const char *md_name, *setup_token;
+    const char *md_name;
     apr_table_t *env;
-    int i;
 
     group = (md_store_group_t)va_arg(ap, int);
     md_name = va_arg(ap, const char *);
@@ -235,14 +234,7 @@ static apr_status_t p_purge(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_li
 
     if (APR_SUCCESS == md_acme_order_load(store, group, md_name, &order, p)) {
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "order loaded for %s", md_name);
-        for (i = 0; i < order->challenge_setups->nelts; ++i) {
-            setup_token = APR_ARRAY_IDX(order->challenge_setups, i, const char*);
-            if (setup_token) {
-                md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
-                              "order teardown setup %s", setup_token);
-                md_acme_authz_teardown(store, setup_token, env, p);
-            }
-        }
+        md_acme_authz_teardown_all(store, order->challenge_setups, env, p);
     }
     return md_store_remove(store, group, md_name, MD_FN_ORDER, ptemp, 1);
 }
@@ -319,11 +311,20 @@ apr_status_t md_acme_order_register(md_acme_order_t **porder, md_acme_t *acme, a
                                     const char *name, apr_array_header_t *domains)
 {
     order_ctx_t ctx;
+    apr_time_t start;
     apr_status_t rv;
     
     assert(MD_ACME_VERSION_MAJOR(acme->version) > 1);
+    if (APR_SUCCESS != (rv = md_acme_rl_take(acme, MD_ACME_RL_ORDERS, NULL, NULL))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, p, 
+                      "%s: CA takes no new orders at this time", name);
+        *porder = NULL;
+        return rv;
+    }
     ORDER_CTX_INIT(&ctx, p, NULL, acme, name, domains);
+    start = apr_time_now();
     rv = md_acme_POST(acme, acme->api.v2.new_order, on_init_order_register, on_order_upd, NULL, &ctx);
+    md_acme_ca_health_add(acme, start, rv);
     *porder = (APR_SUCCESS == rv)? ctx.order : NULL;
     return rv;
 }
@@ -432,11 +433,24 @@ apr_status_t md_acme_order_start_challenges(md_acme_order_t *order, md_acme_t *a
 {
     apr_status_t rv = APR_SUCCESS;
     md_acme_authz_t *authz;
-    const char *url, *setup_token;
-    int i;
+    md_acme_authz_batch_t *batch;
+    md_acme_authz_cache_t *cache;
+    md_acme_cha_stats_t *stats;
+    const char *url, *setup_token, *domain;
+    int i, in_progress = 0;
     
+    batch = md_acme_authz_batch_make(p);
+    md_acme_authz_cache_load(&cache, store, acme, p);
+    /* try the types that did best for this MD and its domain first */
+    md_acme_cha_stats_load(&stats, store, md->name, p);
+    challenge_types = md_acme_cha_stats_sort(stats, challenge_types, p);
     for (i = 0; i < order->authz_urls->nelts; ++i) {
         url = APR_ARRAY_IDX(order->authz_urls, i, const char*);
+        if ((domain = md_acme_authz_cache_get(cache, url))) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: AUTHZ for %s at %s " 
+                          "is known to be valid", md->name, domain, url);
+            continue;
+        }
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "%s: check AUTHZ at %s", md->name, url);
         
         if (APR_SUCCESS != (rv = md_acme_authz_retrieve(acme, p, url, &authz))) {
@@ -445,14 +459,20 @@ apr_status_t md_acme_order_start_challenges(md_acme_order_t *order, md_acme_t *a
             goto out;
         }
 
+        md_acme_authz_cache_update(cache, authz);
         switch (authz->state) {
             case MD_ACME_AUTHZ_S_VALID:
                 break;
                 
             case MD_ACME_AUTHZ_S_PENDING:
                 rv = md_acme_authz_respond(authz, acme, store, challenge_types, 
-                                           md->pkey_spec, env, p, &setup_token);
-                if (APR_SUCCESS != rv) {
+                                           md->pkey_spec, env, batch, p, &setup_token);
+                if (APR_STATUS_IS_EINPROGRESS(rv)) {
+                    /* set up, go on with the others meanwhile */
+                    in_progress = 1;
+                    rv = APR_SUCCESS;
+                }
+                else if (APR_SUCCESS != rv) {
                     goto out;
                 }
                 add_setup_token(order, setup_token);
@@ -466,53 +486,182 @@ apr_status_t md_acme_order_start_challenges(md_acme_order_t *order, md_acme_t *a
              goto out;
         }
     }
+    /* challenges whose setup is done for all authorizations at once */
+    rv = md_acme_authz_batch_run(batch, acme, env, p);
+    if (APR_SUCCESS == rv && in_progress) {
+        rv = APR_EINPROGRESS;
+    }
 out:    
+    md_acme_authz_cache_save(cache, p);
     return rv;
 }
 
-static apr_status_t check_challenges(void *baton, int attempt)
+/* Authorizations that are valid stay that way, we only need to poll the others. */
+typedef struct {
+    apr_pool_t *p;
+    md_acme_t *acme;
+    const char *name;
+    md_acme_authz_cache_t *cache;
+    md_acme_cha_stats_t *stats;
+    md_acme_order_t *order;
+    apr_array_header_t *pending;       /* md_acme_authz_t* not valid yet */
+    int total;
+    apr_time_t start;
+    apr_time_t retry_after;
+} authz_monitor_t;
+
+/* The type of challenge set up for domain in this order, NULL if none was. */
+static const char *setup_type(md_acme_order_t *order, const char *domain, apr_pool_t *p)
 {
-    order_ctx_t *ctx = baton;
-    const char *url;
-    md_acme_authz_t *authz;
-    apr_status_t rv = APR_SUCCESS;
+    const char *token, *s;
     int i;
     
-    for (i = 0; i < ctx->order->authz_urls->nelts && APR_SUCCESS == rv; ++i) {
-        url = APR_ARRAY_IDX(ctx->order->authz_urls, i, const char*);
-        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ctx->p, "%s: check AUTHZ at %s(%d. attempt)", 
-                      ctx->name, url, attempt);
-        if (APR_SUCCESS == (rv = md_acme_authz_retrieve(ctx->acme, ctx->p, url, &authz))) {
-            switch (authz->state) {
-                case MD_ACME_AUTHZ_S_VALID:
-                    break;
-                case MD_ACME_AUTHZ_S_PENDING:
-                    rv = APR_EAGAIN;
-                    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ctx->p, 
-                                  "%s: status pending at %s", authz->domain, authz->url);
-                    break;
-                default:
+    /* the latest setup for the domain is the one the CA validates */
+    for (i = order->challenge_setups->nelts - 1; domain && i >= 0; --i) {
+        token = APR_ARRAY_IDX(order->challenge_setups, i, const char *);
+        if ((s = strchr(token, ':')) && !strcmp(s + 1, domain)) {
+            return apr_pstrndup(p, token, (apr_size_t)(s - token));
+        }
+    }
+    return NULL;
+}
+
+static void record_challenge(authz_monitor_t *m, md_acme_authz_t *authz, int valid)
+{
+    const char *type;
+    
+    if ((type = setup_type(m->order, authz->domain, m->p))) {
+        md_acme_cha_stats_add(m->stats, type, valid, apr_time_now() - m->start);
+    }
+}
+
+static apr_status_t check_challenges(authz_monitor_t *m, int attempt)
+{
+    md_acme_authz_t *authz;
+    apr_status_t rv;
+    int i, j;
+    
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, m->p, "%s: check %d of %d AUTHZ (%d. attempt)", 
+                  m->name, m->pending->nelts, m->total, attempt);
+    if (APR_SUCCESS != (rv = md_acme_authz_update_all(m->pending, m->acme, 
+                                                      &m->retry_after, m->p))) {
+        return rv;
+    }
+    
+    for (i = 0, j = 0; i < m->pending->nelts && APR_SUCCESS == rv; ++i) {
+        authz = APR_ARRAY_IDX(m->pending, i, md_acme_authz_t *);
+        switch (authz->state) {
+            case MD_ACME_AUTHZ_S_VALID:
+                md_acme_authz_cache_update(m->cache, authz);
+                record_challenge(m, authz, 1);
+                break;
+            case MD_ACME_AUTHZ_S_PENDING:
+                if (md_acme_authz_cache_get(m->cache, authz->url)) {
+                    /* we skipped the challenge for it, the next run needs to answer one */
+                    md_acme_authz_cache_update(m->cache, authz);
                     rv = APR_EINVAL;
-                    md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ctx->p, 
-                                  "%s: unexpected AUTHZ state %d at %s", 
-                                  authz->domain, authz->state, authz->url);
+                    md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, m->p, 
+                                  "%s: cached AUTHZ at %s is no longer valid", 
+                                  authz->domain, authz->url);
                     break;
-            }
+                }
+                md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, m->p, 
+                              "%s: status pending at %s", authz->domain, authz->url);
+                APR_ARRAY_IDX(m->pending, j++, md_acme_authz_t *) = authz;
+                break;
+            default:
+                md_acme_authz_cache_update(m->cache, authz);
+                if (authz->state == MD_ACME_AUTHZ_S_INVALID) {
+                    md_acme_rl_count(m->acme, MD_ACME_RL_FAILED, NULL);
+                    record_challenge(m, authz, 0);
+                }
+                rv = APR_EINVAL;
+                md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, m->p, 
+                              "%s: unexpected AUTHZ state %d at %s", 
+                              authz->domain, authz->state, authz->url);
+                break;
+        }
+    }
+    if (APR_SUCCESS == rv) {
+        m->pending->nelts = j;
+        if (j > 0) {
+            rv = APR_EAGAIN;
         }
     }
     return rv;
 }
 
 apr_status_t md_acme_order_monitor_authzs(md_acme_order_t *order, md_acme_t *acme, 
-                                          const md_t *md, apr_interval_time_t timeout, 
-                                          apr_pool_t *p)
+                                          md_store_t *store, const md_t *md, 
+                                          apr_interval_time_t timeout, apr_pool_t *p)
 {
-    order_ctx_t ctx;
+    authz_monitor_t m;
+    md_acme_authz_t *authz;
+    apr_time_t now, giveup;
+    apr_interval_time_t nap, backoff, left;
     apr_status_t rv;
+    int i, attempt = 0;
     
-    ORDER_CTX_INIT(&ctx, p, order, acme, md->name, NULL);
-    rv = md_util_try(check_challenges, &ctx, 0, timeout, 0, 0, 1);
+    m.p = p;
+    m.acme = acme;
+    m.name = md->name;
+    md_acme_authz_cache_load(&m.cache, store, acme, p);
+    md_acme_cha_stats_load(&m.stats, store, md->name, p);
+    m.order = order;
+    m.total = order->authz_urls->nelts;
+    m.start = apr_time_now();
+    m.retry_after = 0;
+    m.pending = apr_array_make(p, m.total, sizeof(md_acme_authz_t *));
+    for (i = 0; i < order->authz_urls->nelts; ++i) {
+        authz = md_acme_authz_create(p);
+        authz->url = APR_ARRAY_IDX(order->authz_urls, i, const char*);
+        APR_ARRAY_PUSH(m.pending, md_acme_authz_t *) = authz;
+    }
     
+    /* Same schedule as md_util_try() with backoff, unless the server tells us when
+     * to come back. */
+    giveup = apr_time_now() + timeout;
+    backoff = apr_time_from_msec(100);
+    while (1) {
+        rv = check_challenges(&m, attempt++);
+        if (!APR_STATUS_IS_EAGAIN(rv)) {
+            break;
+        }
+        
+        now = apr_time_now();
+        if (now > giveup) {
+            rv = APR_TIMEUP;
+            break;
+        }
+        left = giveup - now;
+        if (m.retry_after > now) {
+            nap = m.retry_after - now;
+        }
+        else {
+            nap = backoff;
+            if (backoff < apr_time_from_sec(10)) {
+                backoff *= 2;
+            }
+        }
+        if (nap > apr_time_from_sec(10) && m.retry_after <= now) {
+            nap = apr_time_from_sec(10);
+        }
+        if (nap > left) {
+            nap = left;
+        }
+        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, p, "%s: %d AUTHZ pending, next check in %s", 
+                      md->name, m.pending->nelts, md_print_duration(p, nap));
+        apr_sleep(nap);
+    }
+    
+    if (APR_TIMEUP == rv) {
+        /* challenges that take longer than we wait are no better than failed ones */
+        for (i = 0; i < m.pending->nelts; ++i) {
+            record_challenge(&m, APR_ARRAY_IDX(m.pending, i, md_acme_authz_t *), 0);
+        }
+    }
+    md_acme_authz_cache_save(m.cache, p);
+    md_acme_cha_stats_save(m.stats, p);
     md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, p, "%s: checked authorizations", md->name);
     return rv;
 }
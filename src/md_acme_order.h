@@ -62,15 +62,23 @@ apr_status_t md_acme_order_purge(struct md_store_t *store, apr_pool_t *p,
                                  md_store_group_t group, const char *md_name,
                                  apr_table_t *env);
 
-
+/**
+ * Set up the challenges of all pending authorizations of the order and tell the CA.
+ * Returns APR_EINPROGRESS when they are set up, but the CA can only be told in a
+ * later call, e.g. while dns-01 records are not visible yet.
+ */
 apr_status_t md_acme_order_start_challenges(md_acme_order_t *order, md_acme_t *acme, 
                                             apr_array_header_t *challenge_types,
                                             md_store_t *store, const md_t *md, 
                                             apr_table_t *env, apr_pool_t *p);
 
+/**
+ * Wait for all authorizations of the order to become valid. The valid ones are
+ * remembered in the authz cache of the account.
+ */
 apr_status_t md_acme_order_monitor_authzs(md_acme_order_t *order, md_acme_t *acme, 
-                                          const md_t *md, apr_interval_time_t timeout, 
-                                          apr_pool_t *p);
+                                          md_store_t *store, const md_t *md, 
+                                          apr_interval_time_t timeout, apr_pool_t *p);
 
 /* ACMEv2 only ************************************************************************************/
 
@@ -64,7 +64,7 @@ static apr_status_t ad_setup_order(md_proto_driver_t *d)
     assert(ad->md);
     assert(ad->acme);
 
-    ad->phase = "check authz";
+    md_acme_drive_phase(ad, "check authz", APR_SUCCESS);
     
     /* For each domain in MD: AUTHZ setup
      * if an AUTHZ resource is known, check if it is still valid
@@ -138,7 +138,7 @@ apr_status_t md_acmev1_drive_renew(md_acme_driver_t *ad, md_proto_driver_t *d)
 {
     apr_status_t rv = APR_SUCCESS;
     
-    ad->phase = "get certificate";
+    md_acme_drive_phase(ad, "get certificate", APR_SUCCESS);
     md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, d->p, "%s: (ACMEv1) need certificate", d->md->name);
     
     /* Chose (or create) and ACME account to use */
@@ -150,7 +150,7 @@ apr_status_t md_acmev1_drive_renew(md_acme_driver_t *ad, md_proto_driver_t *d)
     if (APR_SUCCESS == rv) {
         const char *required;
         
-        ad->phase = "check agreement";
+        md_acme_drive_phase(ad, "check agreement", APR_SUCCESS);
         md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, d->p, 
                       "%s: (ACMEv1) check Tems-of-Service agreement", d->md->name);
         
@@ -186,7 +186,7 @@ apr_status_t md_acmev1_drive_renew(md_acme_driver_t *ad, md_proto_driver_t *d)
         
         md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, d->p, 
                       "%s: setup new challenges", d->md->name);
-        ad->phase = "start challenges";
+        md_acme_drive_phase(ad, "start challenges", APR_SUCCESS);
         if (APR_SUCCESS != (rv = md_acme_order_start_challenges(ad->order, ad->acme,
                                                                 ad->ca_challenges,
                                                                 d->store, d->md, d->env, d->p))) {
@@ -197,9 +197,10 @@ apr_status_t md_acmev1_drive_renew(md_acme_driver_t *ad, md_proto_driver_t *d)
         
         md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, d->p, 
                       "%s: monitoring challenge status", d->md->name);
-        ad->phase = "monitor challenges";
-        if (APR_SUCCESS != (rv = md_acme_order_monitor_authzs(ad->order, ad->acme, d->md,
-                                                              ad->authz_monitor_timeout, d->p))) {
+        md_acme_drive_phase(ad, "monitor challenges", APR_SUCCESS);
+        if (APR_SUCCESS != (rv = md_acme_order_monitor_authzs(ad->order, ad->acme, d->store,
+                                                              d->md, ad->authz_monitor_timeout,
+                                                              d->p))) {
             md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, d->p, "%s: monitor challenges", 
                           ad->md->name);
             goto out;
@@ -207,7 +208,7 @@ apr_status_t md_acmev1_drive_renew(md_acme_driver_t *ad, md_proto_driver_t *d)
         
         md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, d->p, 
                       "%s: finalizing order", d->md->name);
-        ad->phase = "finalize order";
+        md_acme_drive_phase(ad, "finalize order", APR_SUCCESS);
         if (APR_SUCCESS != (rv = md_acme_drive_setup_certificate(d))) {
             md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, d->p, "%s: setup certificate", 
                           ad->md->name);
@@ -339,11 +339,14 @@ static apr_status_t main_opts(md_cmd_ctx *ctx, int option, const char *optarg)
             if (active_level > 0) {
                 --active_level;
             }
+            /* the log keeps the levels it was set up with */
+            md_log_set(log_is_level, log_print, NULL);
             break;
         case 'v':
             if (active_level < MD_LOG_TRACE8) {
                 ++active_level;
             }
+            md_log_set(log_is_level, log_print, NULL);
             break;
         case 'V':
             md_cmd_ctx_set_option(ctx, "version", "1");
@@ -363,6 +366,7 @@ static const md_cmd_t *MainSubCmds[] = {
     &MD_RegUpdateCmd, 
     &MD_RegDriveCmd,
     &MD_RegListCmd,
+    &MD_RegBatchCmd,
     &MD_StoreCmd,
     NULL
 };
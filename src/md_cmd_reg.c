@@ -15,12 +15,16 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <apr_lib.h>
 #include <apr_buckets.h>
+#include <apr_file_io.h>
 #include <apr_getopt.h>
 #include <apr_hash.h>
 #include <apr_strings.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_proc.h>
 
 #include "md.h"
 #include "md_json.h"
@@ -70,9 +74,15 @@ md_cmd_t MD_RegAddCmd = {
 static int list_add_md(void *baton, md_reg_t *reg, md_t *md)
 {
     apr_array_header_t *mdlist = baton;
+    md_t *copy;
     
     (void)reg;
-    APR_ARRAY_PUSH(mdlist, const md_t *) = md;
+    /* the md is only valid during the callback */
+    copy = md_clone(mdlist->pool, md);
+    copy->transitive = md->transitive;
+    copy->valid_from = md->valid_from;
+    copy->expires = md->expires;
+    APR_ARRAY_PUSH(mdlist, const md_t *) = copy;
     return 1;
 }
 
@@ -244,59 +254,87 @@ md_cmd_t MD_RegUpdateCmd = {
 /**************************************************************************************************/
 /* command: drive */
 
-static apr_status_t assess_and_drive(md_cmd_ctx *ctx, md_t *md)
+/* how long to wait before staging again when it is in progress */
+#define DRIVE_PROGRESS_NAP      apr_time_from_sec(5)
+
+/* Obtain new credentials into staging, if the md needs them or force is set.
+ * *pstaged is set when there are credentials to load. */
+static apr_status_t assess_and_stage(md_cmd_ctx *ctx, md_t *md, const char *challenge, 
+                                     int force, int reset, int *pstaged, const char **pmsg,
+                                     apr_pool_t *p)
 {
-    int errored, force, renew, reset;
-    const char *challenge, *msg;
+    int errored, renew;
+    const char *msg;
     apr_status_t rv;
     
-    reset = md_cmd_ctx_has_option(ctx, "reset");  
-    force = md_cmd_ctx_has_option(ctx, "force");
-    challenge = md_cmd_ctx_get_option(ctx, "challenge");
-     
-    if (APR_SUCCESS != (rv = md_reg_assess(ctx->reg, md, &errored, &renew, ctx->p))) {
-        msg = "error assessing the current state of the "
-              "Managed Domain. Please check the server "
-              "logs or run this command in very verbose form and check the output.";
-        goto out;
+    *pstaged = 0;
+    if (APR_SUCCESS != (rv = md_reg_assess(ctx->reg, md, &errored, &renew, p))) {
+        *pmsg = "error assessing the current state of the "
+                "Managed Domain. Please check the server "
+                "logs or run this command in very verbose form and check the output.";
+        return rv;
     }
     
     if (errored) {
-        rv = APR_EGENERAL;
-        msg = "is in error state. Please check the server "
-              "logs or run this command in very verbose form and check the output.";
-        goto out;
+        *pmsg = "is in error state. Please check the server "
+                "logs or run this command in very verbose form and check the output.";
+        return APR_EGENERAL;
     }
     
-    if (renew || force) {
-        
-        msg = "incomplete, sign up";
-        if (md->state == MD_S_COMPLETE) {
-            msg = force? "forcing renewal" : "for renewal";
-        }
-        md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, ctx->p, "%s: %s", md->name, msg);
-        
-        if (APR_SUCCESS == (rv = md_reg_stage(ctx->reg, md, challenge, ctx->env, 
-                                              reset, NULL, ctx->p))) {
-            md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, ctx->p, "%s: loading", md->name);
-            
-            rv = md_reg_load(ctx->reg, md->name, ctx->env, ctx->p);
-            
-            if (APR_SUCCESS == rv) {
-                msg = "new credentials active on next server restart";
-            }
-            else {
-                msg = "error activating new credentials";
-            }
-        }
-        else {
-            msg = "error obtaining new credentials";
-        }
+    if (!renew && !force) {
+        *pmsg = "up-to-date";
+        return APR_SUCCESS;
+    }
+    
+    msg = "incomplete, sign up";
+    if (md->state == MD_S_COMPLETE) {
+        msg = force? "forcing renewal" : "for renewal";
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, p, "%s: %s", md->name, msg);
+    
+    while (APR_STATUS_IS_EINPROGRESS(rv = md_reg_stage(ctx->reg, md, challenge, ctx->env, 
+                                                        reset, NULL, p))) {
+        /* nothing else to do here meanwhile, wait and carry on with what is staged */
+        md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, p, "%s: staging in progress", md->name);
+        apr_sleep(DRIVE_PROGRESS_NAP);
+        reset = 0;
+    }
+    if (APR_SUCCESS != rv) {
+        *pmsg = "error obtaining new credentials";
+        return rv;
+    }
+    *pstaged = 1;
+    *pmsg = "new credentials staged";
+    return APR_SUCCESS;
+}
+
+static apr_status_t load_staged(md_cmd_ctx *ctx, md_t *md, const char **pmsg, apr_pool_t *p)
+{
+    apr_status_t rv;
+    
+    md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, p, "%s: loading", md->name);
+    rv = md_reg_load(ctx->reg, md->name, ctx->env, p);
+    if (APR_SUCCESS == rv) {
+        *pmsg = "new credentials active on next server restart";
     }
     else {
-        msg = "up-to-date";
+        *pmsg = "error activating new credentials";
+    }
+    return rv;
+}
+
+static apr_status_t assess_and_drive(md_cmd_ctx *ctx, md_t *md)
+{
+    const char *msg;
+    int staged;
+    apr_status_t rv;
+    
+    rv = assess_and_stage(ctx, md, md_cmd_ctx_get_option(ctx, "challenge"),
+                          md_cmd_ctx_has_option(ctx, "force"), 
+                          md_cmd_ctx_has_option(ctx, "reset"), &staged, &msg, ctx->p);
+    if (APR_SUCCESS == rv && staged) {
+        rv = load_staged(ctx, md, &msg, ctx->p);
     }
-out:
     md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, ctx->p, "%s: %s", md->name, msg);
     return rv;
 }
@@ -369,3 +407,492 @@ md_cmd_t MD_RegDriveCmd = {
 };
 
 
+
+/**************************************************************************************************/
+/* command: batch */
+
+/* A manifest has one operation per line as a JSON object, e.g.
+ *   {"op": "add", "domains": ["a.org", "www.a.org"], "contacts": ["admin@a.org"]}
+ *   {"op": "update", "name": "a.org", "ca-url": "https://ca.example/directory"}
+ *   {"op": "drive", "name": "a.org", "force": true}
+ * Empty lines and lines starting with '#' are ignored. Operations run in the order 
+ * given, except that consecutive drives run in parallel. All share the registry and
+ * the process' cache of ACME directories and accounts. Each operation gets a pool 
+ * of its own that is gone once its result has been reported. */
+
+#define BATCH_MAX_PARALLEL      64
+
+typedef struct {
+    int line;                       /* line number in the manifest */
+    md_json_t *json;                /* the operation, NULL if the line did not parse */
+    const char *op;
+    apr_pool_t *p;
+    md_t *md;                       /* md as it is after the operation, if known */
+    int staged;
+    apr_status_t rv;
+    const char *msg;
+} batch_item_t;
+
+typedef struct {
+    md_cmd_ctx *ctx;
+    int parallel;
+    int failed;
+    apr_array_header_t *drives;     /* batch_item_t* waiting to run */
+    int next;                       /* the next drive to run */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+} batch_ctx;
+
+static apr_status_t read_manifest(char **pdata, apr_size_t *plen, const char *fname, 
+                                  apr_pool_t *p)
+{
+    apr_file_t *f;
+    char buffer[8192], *data = NULL, *ndata;
+    apr_size_t len = 0, cap = 0, n;
+    apr_status_t rv;
+    
+    rv = strcmp("-", fname)? apr_file_open(&f, fname, APR_FOPEN_READ, APR_OS_DEFAULT, p)
+                           : apr_file_open_stdin(&f, p);
+    if (APR_SUCCESS != rv) {
+        return rv;
+    }
+    while (1) {
+        n = sizeof(buffer);
+        if (APR_SUCCESS != (rv = apr_file_read(f, buffer, &n))) {
+            break;
+        }
+        if (len + n + 1 > cap) {
+            cap = 2 * (len + n + 1);
+            ndata = apr_palloc(p, cap);
+            if (len) memcpy(ndata, data, len);
+            data = ndata;
+        }
+        memcpy(data + len, buffer, n);
+        len += n;
+    }
+    apr_file_close(f);
+    if (!APR_STATUS_IS_EOF(rv)) {
+        return rv;
+    }
+    if (!data) {
+        data = apr_pcalloc(p, 1);
+    }
+    data[len] = '\0';
+    *pdata = data;
+    *plen = len;
+    return APR_SUCCESS;
+}
+
+static apr_status_t batch_pool_create(apr_pool_t **pp)
+{
+    apr_allocator_t *allocator;
+    apr_status_t rv;
+    
+    /* an allocator of its own, so that the pool may be used in another thread */
+    if (APR_SUCCESS != (rv = apr_allocator_create(&allocator))) {
+        return rv;
+    }
+    if (APR_SUCCESS != (rv = apr_pool_create_ex(pp, NULL, NULL, allocator))) {
+        apr_allocator_destroy(allocator);
+        return rv;
+    }
+    apr_allocator_owner_set(allocator, *pp);
+    apr_pool_tag(*pp, "a2md_batch");
+    return APR_SUCCESS;
+}
+
+static apr_array_header_t *batch_contacts(md_json_t *json, apr_pool_t *p)
+{
+    apr_array_header_t *contacts;
+    int i;
+    
+    contacts = apr_array_make(p, 5, sizeof(const char *));
+    md_json_dupsa(contacts, p, json, MD_KEY_CONTACTS, NULL);
+    for (i = 0; i < contacts->nelts; ++i) {
+        APR_ARRAY_IDX(contacts, i, const char *) = 
+            md_util_schemify(p, APR_ARRAY_IDX(contacts, i, const char *), "mailto");
+    }
+    return contacts;
+}
+
+static void batch_add(batch_ctx *bctx, batch_item_t *item)
+{
+    md_cmd_ctx *ctx = bctx->ctx;
+    apr_array_header_t *domains;
+    const char *name;
+    md_t *md;
+    
+    domains = apr_array_make(item->p, 5, sizeof(const char *));
+    md_json_dupsa(domains, item->p, item->json, MD_KEY_DOMAINS, NULL);
+    if (domains->nelts == 0) {
+        item->rv = APR_EINVAL;
+        item->msg = "add needs at least 1 domain name";
+        return;
+    }
+    md = md_create(item->p, domains);
+    if (NULL != (name = md_json_gets(item->json, MD_KEY_NAME, NULL))) {
+        md->name = apr_pstrdup(item->p, name);
+    }
+    md->ca_url = md_json_dups(item->p, item->json, "ca-url", NULL);
+    if (!md->ca_url) {
+        md->ca_url = ctx->ca_url;
+    }
+    md->ca_proto = "ACME";
+    if (md_json_has_key(item->json, MD_KEY_CONTACTS, NULL)) {
+        md->contacts = batch_contacts(item->json, item->p);
+    }
+    
+    if (APR_SUCCESS == (item->rv = md_reg_add(ctx->reg, md, item->p))) {
+        item->md = md_reg_get(ctx->reg, md->name, item->p);
+    }
+}
+
+static void batch_update(batch_ctx *bctx, batch_item_t *item)
+{
+    md_cmd_ctx *ctx = bctx->ctx;
+    const char *name, *s;
+    md_t *md, *nmd;
+    int fields = 0;
+    
+    if (NULL == (name = md_json_dups(item->p, item->json, MD_KEY_NAME, NULL))) {
+        item->rv = APR_EINVAL;
+        item->msg = "update needs the name of the managed domain";
+        return;
+    }
+    if (NULL == (md = md_reg_get(ctx->reg, name, item->p))) {
+        item->rv = APR_ENOENT;
+        item->msg = "not found";
+        return;
+    }
+    
+    nmd = md_copy(item->p, md);
+    if (md_json_has_key(item->json, MD_KEY_DOMAINS, NULL)) {
+        nmd->domains = apr_array_make(item->p, 5, sizeof(const char *));
+        md_json_dupsa(nmd->domains, item->p, item->json, MD_KEY_DOMAINS, NULL);
+        if (apr_is_empty_array(nmd->domains)) {
+            item->rv = APR_EINVAL;
+            item->msg = "update of domains needs at least 1 domain name";
+            return;
+        }
+        fields |= MD_UPD_DOMAINS;
+    }
+    if (NULL != (s = md_json_dups(item->p, item->json, "ca-url", NULL))) {
+        nmd->ca_url = s;
+        fields |= MD_UPD_CA_URL;
+    }
+    if (NULL != (s = md_json_dups(item->p, item->json, "ca-proto", NULL))) {
+        nmd->ca_proto = s;
+        fields |= MD_UPD_CA_PROTO;
+    }
+    if (NULL != (s = md_json_dups(item->p, item->json, MD_KEY_ACCOUNT, NULL))) {
+        nmd->ca_account = s;
+        fields |= MD_UPD_CA_ACCOUNT;
+    }
+    if (NULL != (s = md_json_dups(item->p, item->json, MD_KEY_AGREEMENT, NULL))) {
+        nmd->ca_agreement = s;
+        fields |= MD_UPD_AGREEMENT;
+    }
+    if (md_json_has_key(item->json, MD_KEY_CONTACTS, NULL)) {
+        nmd->contacts = batch_contacts(item->json, item->p);
+        if (apr_is_empty_array(nmd->contacts)) {
+            item->rv = APR_EINVAL;
+            item->msg = "update of contacts needs at least 1 contact email";
+            return;
+        }
+        fields |= MD_UPD_CONTACTS;
+    }
+    
+    if (!fields) {
+        item->msg = "no changes necessary";
+        item->md = md;
+    }
+    else if (APR_SUCCESS == (item->rv = md_reg_update(ctx->reg, item->p, md->name, nmd, fields))) {
+        item->md = md_reg_get(ctx->reg, md->name, item->p);
+    }
+}
+
+/* Drives only stage in parallel, loading is done afterwards, one by one. */
+static void batch_drive(batch_ctx *bctx, batch_item_t *item)
+{
+    md_cmd_ctx *ctx = bctx->ctx;
+    const char *name, *challenge;
+    int force, reset;
+    
+    if (NULL == (name = md_json_dups(item->p, item->json, MD_KEY_NAME, NULL))) {
+        item->rv = APR_EINVAL;
+        item->msg = "drive needs the name of the managed domain";
+        return;
+    }
+    if (NULL == (item->md = md_reg_get(ctx->reg, name, item->p))) {
+        item->rv = APR_ENOENT;
+        item->msg = "not found";
+        return;
+    }
+    challenge = md_json_dups(item->p, item->json, "challenge", NULL);
+    if (!challenge) {
+        challenge = md_cmd_ctx_get_option(ctx, "challenge");
+    }
+    force = md_json_has_key(item->json, "force", NULL)? 
+        md_json_getb(item->json, "force", NULL) : md_cmd_ctx_has_option(ctx, "force");
+    reset = md_json_has_key(item->json, "reset", NULL)? 
+        md_json_getb(item->json, "reset", NULL) : md_cmd_ctx_has_option(ctx, "reset");
+    
+    item->rv = assess_and_stage(ctx, item->md, challenge, force, reset, 
+                                &item->staged, &item->msg, item->p);
+}
+
+static void batch_report(batch_ctx *bctx, batch_item_t *item)
+{
+    md_cmd_ctx *ctx = bctx->ctx;
+    md_json_t *json;
+    apr_pool_t *p;
+    const char *s;
+    char errbuff[32];
+    
+    /* results in the -j output have to outlive the item */
+    p = ctx->json_out? ctx->p : item->p;
+    json = md_json_create(p);
+    md_json_setl(item->line, json, "line", NULL);
+    if (item->op) {
+        md_json_sets(item->op, json, "op", NULL);
+    }
+    md_json_setl((long)item->rv, json, "status", NULL);
+    if (APR_SUCCESS != item->rv) {
+        ++bctx->failed;
+        md_json_sets(apr_strerror(item->rv, errbuff, sizeof(errbuff)/sizeof(errbuff[0])), 
+                     json, "description", NULL);
+    }
+    if (item->msg) {
+        md_json_sets(item->msg, json, "message", NULL);
+    }
+    if (item->md) {
+        md_json_setj(md_to_json(item->md, p), json, "md", NULL);
+    }
+    
+    if (ctx->json_out) {
+        md_json_addj(json, ctx->json_out, "output", NULL);
+    }
+    else {
+        s = md_json_writep(json, p, MD_JSON_FMT_COMPACT);
+        fprintf(stdout, "%s\n", s? s : "{}");
+        fflush(stdout);
+    }
+    apr_pool_destroy(item->p);
+    item->p = NULL;
+}
+
+static batch_item_t *batch_next_drive(batch_ctx *bctx)
+{
+    batch_item_t *item = NULL;
+    
+#if APR_HAS_THREADS
+    if (bctx->mutex) apr_thread_mutex_lock(bctx->mutex);
+#endif
+    if (bctx->next < bctx->drives->nelts) {
+        item = APR_ARRAY_IDX(bctx->drives, bctx->next, batch_item_t*);
+        ++bctx->next;
+    }
+#if APR_HAS_THREADS
+    if (bctx->mutex) apr_thread_mutex_unlock(bctx->mutex);
+#endif
+    return item;
+}
+
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC batch_worker(apr_thread_t *thread, void *data)
+{
+    batch_ctx *bctx = data;
+    batch_item_t *item;
+    
+    (void)thread;
+    while (NULL != (item = batch_next_drive(bctx))) {
+        batch_drive(bctx, item);
+    }
+    return NULL;
+}
+#endif
+
+static void batch_run_drives(batch_ctx *bctx)
+{
+    batch_item_t *item;
+    int i;
+#if APR_HAS_THREADS
+    apr_thread_t **threads;
+    apr_pool_t *tpool;
+    apr_status_t rv;
+    int n;
+    
+    n = (bctx->parallel < bctx->drives->nelts)? bctx->parallel : bctx->drives->nelts;
+    /* the workers use the registry, which allocates from ctx->p, do not touch
+     * that pool here while they run */
+    if (n > 1 && bctx->mutex && APR_SUCCESS == batch_pool_create(&tpool)) {
+        threads = apr_pcalloc(tpool, (apr_size_t)n * sizeof(*threads));
+        for (i = 0; i < n; ++i) {
+            if (APR_SUCCESS != apr_thread_create(&threads[i], NULL, batch_worker, 
+                                                 bctx, tpool)) {
+                md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, 0, tpool, 
+                              "batch: started only %d of %d workers", i, n);
+                break;
+            }
+        }
+        n = i;
+        for (i = 0; i < n; ++i) {
+            apr_thread_join(&rv, threads[i]);
+        }
+        apr_pool_destroy(tpool);
+    }
+#endif
+    /* whatever no worker did */
+    while (NULL != (item = batch_next_drive(bctx))) {
+        batch_drive(bctx, item);
+    }
+    
+    for (i = 0; i < bctx->drives->nelts; ++i) {
+        item = APR_ARRAY_IDX(bctx->drives, i, batch_item_t*);
+        if (APR_SUCCESS == item->rv && item->staged
+            && APR_SUCCESS == (item->rv = load_staged(bctx->ctx, item->md, &item->msg, item->p))) {
+            item->md = md_reg_get(bctx->ctx->reg, item->md->name, item->p);
+        }
+        md_log_perror(MD_LOG_MARK, MD_LOG_INFO, item->rv, bctx->ctx->p, "%s: %s", 
+                      item->md? item->md->name : "-", item->msg);
+        batch_report(bctx, item);
+    }
+    apr_array_clear(bctx->drives);
+    bctx->next = 0;
+}
+
+static apr_status_t cmd_reg_batch(md_cmd_ctx *ctx, const md_cmd_t *cmd)
+{
+    batch_ctx bctx;
+    batch_item_t *item;
+    const char *s;
+    char *data, *line, *eol;
+    apr_size_t len;
+    apr_status_t rv;
+    int n;
+    
+    if (ctx->argc > 1) {
+        return usage(cmd, NULL);
+    }
+    memset(&bctx, 0, sizeof(bctx));
+    bctx.ctx = ctx;
+    bctx.parallel = 1;
+    if (NULL != (s = md_cmd_ctx_get_option(ctx, "parallel"))) {
+        bctx.parallel = atoi(s);
+        if (bctx.parallel < 1 || bctx.parallel > BATCH_MAX_PARALLEL) {
+            return usage(cmd, "parallel must be a number from 1 to 64");
+        }
+    }
+    bctx.drives = apr_array_make(ctx->p, 10, sizeof(batch_item_t*));
+#if APR_HAS_THREADS
+    if (bctx.parallel > 1) {
+        md_http_t *http;
+        
+        if (APR_SUCCESS != apr_thread_mutex_create(&bctx.mutex, APR_THREAD_MUTEX_DEFAULT, 
+                                                   ctx->p)) {
+            bctx.mutex = NULL;
+        }
+        /* the HTTP implementation initializes itself on first use, have that done
+         * here and not by several drives at the same time */
+        md_http_create(&http, ctx->p, "a2md", NULL);
+    }
+#endif
+    
+    if (APR_SUCCESS != (rv = read_manifest(&data, &len, (ctx->argc > 0)? ctx->argv[0] : "-", 
+                                           ctx->p))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ctx->p, "reading manifest %s", 
+                      (ctx->argc > 0)? ctx->argv[0] : "from stdin");
+        return rv;
+    }
+    
+    for (n = 1, line = data; line < data + len; ++n, line = eol + 1) {
+        if (NULL == (eol = strchr(line, '\n'))) {
+            eol = data + len;
+        }
+        while (line < eol && apr_isspace(*line)) ++line;
+        if (line == eol || *line == '#') {
+            continue;
+        }
+        
+        item = apr_pcalloc(ctx->p, sizeof(*item));
+        item->line = n;
+        if (APR_SUCCESS != (rv = batch_pool_create(&item->p))) {
+            return rv;
+        }
+        if (APR_SUCCESS != md_json_readd(&item->json, item->p, line, (size_t)(eol - line))) {
+            item->json = NULL;
+            item->rv = APR_EINVAL;
+            item->msg = "not a JSON object";
+        }
+        else if (NULL != (s = md_json_gets(item->json, "op", NULL))) {
+            item->op = apr_pstrdup(item->p, s);
+        }
+        
+        if (item->op && !strcmp("drive", item->op)) {
+            APR_ARRAY_PUSH(bctx.drives, batch_item_t*) = item;
+            continue;
+        }
+        /* other operations see the results of the drives before them */
+        if (bctx.drives->nelts > 0) {
+            batch_run_drives(&bctx);
+        }
+        if (!item->json) {
+            /* reported as is */
+        }
+        else if (!item->op) {
+            item->rv = APR_EINVAL;
+            item->msg = "missing 'op'";
+        }
+        else if (!strcmp("add", item->op)) {
+            batch_add(&bctx, item);
+        }
+        else if (!strcmp("update", item->op)) {
+            batch_update(&bctx, item);
+        }
+        else {
+            item->rv = APR_ENOTIMPL;
+            item->msg = "unknown op, use one of 'add', 'update' or 'drive'";
+        }
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, item->rv, ctx->p, "batch line %d: %s", 
+                      item->line, item->msg? item->msg : "done");
+        batch_report(&bctx, item);
+    }
+    if (bctx.drives->nelts > 0) {
+        batch_run_drives(&bctx);
+    }
+    
+    if (bctx.failed > 0) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, ctx->p, "batch: %d operations failed", 
+                      bctx.failed);
+        return APR_EGENERAL;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t cmd_reg_batch_opts(md_cmd_ctx *ctx, int option, const char *optarg)
+{
+    switch (option) {
+        case 'n':
+            md_cmd_ctx_set_option(ctx, "parallel", optarg);
+            return APR_SUCCESS;
+        default:
+            return cmd_reg_drive_opts(ctx, option, optarg);
+    }
+}
+
+static apr_getopt_option_t BatchOptions [] = {
+    { "parallel", 'n', 1, "number of managed domains to drive at the same time, default 1"},
+    { "challenge",'c', 1, "challenge type for drives that do not name one"},
+    { "force",    'f', 0, "force drives that do not say otherwise"},
+    { "reset",    'r', 0, "reset staging data for drives that do not say otherwise"},
+    { NULL , 0, 0, NULL }
+};
+
+md_cmd_t MD_RegBatchCmd = {
+    "batch", MD_CTX_REG, 
+    cmd_reg_batch_opts, cmd_reg_batch, BatchOptions, NULL,
+    "batch [opts] [manifest]",
+    "run the 'add', 'update' and 'drive' operations in the manifest (or stdin), one JSON "
+    "object per line, e.g. {\"op\": \"drive\", \"name\": \"a.org\"}, and report each result"
+};
@@ -20,5 +20,6 @@ extern md_cmd_t MD_RegAddCmd;
 extern md_cmd_t MD_RegUpdateCmd;
 extern md_cmd_t MD_RegDriveCmd;
 extern md_cmd_t MD_RegListCmd;
+extern md_cmd_t MD_RegBatchCmd;
 
 #endif /* md_cmd_reg_h */
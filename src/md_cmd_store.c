@@ -28,6 +28,7 @@
 #include "md_log.h"
 #include "md_reg.h"
 #include "md_store.h"
+#include "md_store_fs.h"
 #include "md_util.h"
 #include "md_version.h"
 #include "md_cmd.h"
@@ -213,6 +214,84 @@ static md_cmd_t UpdateCmd = {
     "update the managed domain <name> in the store"
 };
 
+/**************************************************************************************************/
+/* command: store dump */
+
+static apr_status_t cmd_dump(md_cmd_ctx *ctx, const md_cmd_t *cmd)
+{
+    md_store_group_t group;
+    md_json_t *json;
+    const char *out;
+    apr_status_t rv;
+    
+    if (ctx->argc != 3) {
+        return usage(cmd, "needs group, name and aspect");
+    }
+    for (group = MD_SG_NONE; group < MD_SG_COUNT; ++group) {
+        if (!strcmp(ctx->argv[0], md_store_group_name(group))) break;
+    }
+    if (group == MD_SG_COUNT) {
+        fprintf(stderr, "unknown store group: %s\n", ctx->argv[0]);
+        return APR_EINVAL;
+    }
+    
+    /* whichever format the value is stored in, show it as text */
+    rv = md_store_load_json(ctx->store, group, ctx->argv[1], ctx->argv[2], &json, ctx->p);
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ctx->p, "loading %s/%s/%s", 
+                      ctx->argv[0], ctx->argv[1], ctx->argv[2]);
+        return rv;
+    }
+    if (ctx->json_out) {
+        md_json_addj(json, ctx->json_out, "output", NULL);
+    }
+    else if (NULL != (out = md_json_writep(json, ctx->p, MD_JSON_FMT_INDENT))) {
+        fprintf(stdout, "%s\n", out);
+    }
+    return APR_SUCCESS;
+}
+
+static md_cmd_t DumpCmd = {
+    "dump", MD_CTX_STORE, 
+    NULL, cmd_dump, MD_NoOptions, NULL,
+    "dump group name aspect",
+    "print the JSON value of 'aspect' for 'name' in the store 'group' as text"
+};
+
+/**************************************************************************************************/
+/* command: store format */
+
+static apr_status_t cmd_format(md_cmd_ctx *ctx, const md_cmd_t *cmd)
+{
+    apr_status_t rv = APR_SUCCESS;
+    
+    if (ctx->argc > 1) {
+        return usage(cmd, NULL);
+    }
+    if (ctx->argc == 1) {
+        if (!strcmp("json", ctx->argv[0])) {
+            rv = md_store_fs_binary_set(ctx->store, 0, ctx->p);
+        }
+        else if (!strcmp("binary", ctx->argv[0])) {
+            rv = md_store_fs_binary_set(ctx->store, 1, ctx->p);
+        }
+        else {
+            return usage(cmd, "format is either 'json' or 'binary'");
+        }
+    }
+    if (APR_SUCCESS == rv) {
+        fprintf(stdout, "%s\n", md_store_fs_is_binary(ctx->store)? "binary" : "json");
+    }
+    return rv;
+}
+
+static md_cmd_t FormatCmd = {
+    "format", MD_CTX_STORE, 
+    NULL, cmd_format, MD_NoOptions, NULL,
+    "format [json|binary]",
+    "show the format JSON values are stored in or convert the store to another"
+};
+
 /**************************************************************************************************/
 /* command: store */
 
@@ -221,6 +300,8 @@ static const md_cmd_t *StoreSubCmds[] = {
     &RemoveCmd,
     &ListCmd,
     &UpdateCmd,
+    &DumpCmd,
+    &FormatCmd,
     NULL
 };
 
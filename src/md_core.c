@@ -18,6 +18,7 @@
 #include <stdlib.h>
 
 #include <apr_lib.h>
+#include <apr_hash.h>
 #include <apr_strings.h>
 #include <apr_tables.h>
 #include <apr_time.h>
@@ -36,47 +37,64 @@ int md_contains(const md_t *md, const char *domain, int case_sensitive)
    return md_array_str_index(md->domains, domain, 0, case_sensitive) >= 0;
 }
 
-const char *md_common_name(const md_t *md1, const md_t *md2)
+/* Below this many comparisons, scanning the domain lists is cheaper than hashing */
+#define DOMAINS_SCAN_MAX    64
+
+/* Count the domains of md1 that md2 contains, stop at the first one if pfirst is given.
+ * Large lists are compared through a set made in a sub pool of p, if p is given. */
+static apr_size_t common_domains(const md_t *md1, const md_t *md2, const char **pfirst, 
+                                 apr_pool_t *p)
 {
+    apr_pool_t *ptemp = NULL;
+    md_dns_set_t *set = NULL;
+    const char *name1;
+    apr_size_t hits = 0;
     int i;
     
-    if (md1 == NULL || md1->domains == NULL
-        || md2 == NULL || md2->domains == NULL) {
-        return NULL;
+    if (p && md1->domains->nelts * md2->domains->nelts > DOMAINS_SCAN_MAX
+        && APR_SUCCESS == apr_pool_create(&ptemp, p)) {
+        set = md_dns_set_make(ptemp, md2->domains);
     }
-    
     for (i = 0; i < md1->domains->nelts; ++i) {
-        const char *name1 = APR_ARRAY_IDX(md1->domains, i, const char*);
-        if (md_contains(md2, name1, 0)) {
-            return name1;
+        name1 = APR_ARRAY_IDX(md1->domains, i, const char*);
+        if (set? (NULL != md_dns_set_get(set, name1)) : md_contains(md2, name1, 0)) {
+            ++hits;
+            if (pfirst) {
+                *pfirst = name1;
+                break;
+            }
         }
     }
-    return NULL;
+    if (ptemp) {
+        apr_pool_destroy(ptemp);
+    }
+    return hits;
 }
 
-int md_domains_overlap(const md_t *md1, const md_t *md2)
+const char *md_common_name(const md_t *md1, const md_t *md2, apr_pool_t *p)
 {
-    return md_common_name(md1, md2) != NULL;
+    const char *name = NULL;
+    
+    if (md1 == NULL || md1->domains == NULL
+        || md2 == NULL || md2->domains == NULL) {
+        return NULL;
+    }
+    common_domains(md1, md2, &name, p);
+    return name;
 }
 
-apr_size_t md_common_name_count(const md_t *md1, const md_t *md2)
+int md_domains_overlap(const md_t *md1, const md_t *md2, apr_pool_t *p)
+{
+    return md_common_name(md1, md2, p) != NULL;
+}
+
+apr_size_t md_common_name_count(const md_t *md1, const md_t *md2, apr_pool_t *p)
 {
-    int i;
-    apr_size_t hits;
-    
     if (md1 == NULL || md1->domains == NULL
         || md2 == NULL || md2->domains == NULL) {
         return 0;
     }
-    
-    hits = 0;
-    for (i = 0; i < md1->domains->nelts; ++i) {
-        const char *name1 = APR_ARRAY_IDX(md1->domains, i, const char*);
-        if (md_contains(md2, name1, 0)) {
-            ++hits;
-        }
-    }
-    return hits;
+    return common_domains(md1, md2, NULL, p);
 }
 
 md_t *md_create_empty(apr_pool_t *p)
@@ -99,6 +117,9 @@ int md_equal_domains(const md_t *md1, const md_t *md2, int case_sensitive)
 {
     int i;
     if (md1->domains->nelts == md2->domains->nelts) {
+        if (!case_sensitive) {
+            return common_domains(md1, md2, NULL, NULL) == (apr_size_t)md1->domains->nelts;
+        }
         for (i = 0; i < md1->domains->nelts; ++i) {
             const char *name1 = APR_ARRAY_IDX(md1->domains, i, const char*);
             if (!md_contains(md2, name1, case_sensitive)) {
@@ -110,22 +131,15 @@ int md_equal_domains(const md_t *md1, const md_t *md2, int case_sensitive)
     return 0;
 }
 
-int md_contains_domains(const md_t *md1, const md_t *md2)
+int md_contains_domains(const md_t *md1, const md_t *md2, apr_pool_t *p)
 {
-    int i;
     if (md1->domains->nelts >= md2->domains->nelts) {
-        for (i = 0; i < md2->domains->nelts; ++i) {
-            const char *name2 = APR_ARRAY_IDX(md2->domains, i, const char*);
-            if (!md_contains(md1, name2, 0)) {
-                return 0;
-            }
-        }
-        return 1;
+        return common_domains(md2, md1, NULL, p) == (apr_size_t)md2->domains->nelts;
     }
     return 0;
 }
 
-md_t *md_find_closest_match(apr_array_header_t *mds, const md_t *md)
+md_t *md_find_closest_match(apr_array_header_t *mds, const md_t *md, apr_pool_t *p)
 {
     md_t *candidate, *m;
     apr_size_t cand_n, n;
@@ -136,7 +150,7 @@ md_t *md_find_closest_match(apr_array_header_t *mds, const md_t *md)
         /* try to find an instance that contains all domain names from md */ 
         for (i = 0; i < mds->nelts; ++i) {
             m = APR_ARRAY_IDX(mds, i, md_t *);
-            if (md_contains_domains(m, md)) {
+            if (md_contains_domains(m, md, p)) {
                 return m;
             }
         }
@@ -147,7 +161,7 @@ md_t *md_find_closest_match(apr_array_header_t *mds, const md_t *md)
         cand_n = 0;
         for (i = 0; i < mds->nelts; ++i) {
             m = APR_ARRAY_IDX(mds, i, md_t *);
-            n = md_common_name_count(md, m);
+            n = md_common_name_count(md, m, p);
             if (n > cand_n) {
                 candidate = m;
                 cand_n = n;
@@ -181,18 +195,130 @@ md_t *md_get_by_domain(struct apr_array_header_t *mds, const char *domain)
     return NULL;
 }
 
-md_t *md_get_by_dns_overlap(struct apr_array_header_t *mds, const md_t *md)
+md_t *md_get_by_dns_overlap(struct apr_array_header_t *mds, const md_t *md, 
+                            apr_pool_t *p)
 {
     int i;
     for (i = 0; i < mds->nelts; ++i) {
         md_t *o = APR_ARRAY_IDX(mds, i, md_t *);
-        if (strcmp(o->name, md->name) && md_common_name(o, md)) {
+        if (strcmp(o->name, md->name) && md_common_name(o, md, p)) {
             return o;
         }
     }
     return NULL;
 }
 
+/**************************************************************************************************/
+/* domain index */
+
+/* DNS names are at most 253 chars, anything longer is never found */
+#define INDEX_KEY_MAX       256
+
+struct md_domain_index_t {
+    apr_pool_t *p;
+    apr_hash_t *by_name;
+    apr_hash_t *by_domain;
+};
+
+static const char *index_key(char *buffer, apr_size_t blen, const char *name)
+{
+    apr_size_t i;
+    
+    for (i = 0; name[i] && i + 1 < blen; ++i) {
+        buffer[i] = (char)apr_tolower(name[i]);
+    }
+    if (name[i]) {
+        return NULL;
+    }
+    buffer[i] = '\0';
+    return buffer;
+}
+
+md_domain_index_t *md_domain_index_make(apr_pool_t *p, apr_array_header_t *mds)
+{
+    md_domain_index_t *idx;
+    int i;
+    
+    idx = apr_pcalloc(p, sizeof(*idx));
+    idx->p = p;
+    idx->by_name = apr_hash_make(p);
+    idx->by_domain = apr_hash_make(p);
+    for (i = 0; mds && i < mds->nelts; ++i) {
+        md_domain_index_add(idx, APR_ARRAY_IDX(mds, i, md_t*));
+    }
+    return idx;
+}
+
+void md_domain_index_add(md_domain_index_t *idx, md_t *md)
+{
+    const char *domain, *key;
+    int i;
+    
+    if (md->name && !apr_hash_get(idx->by_name, md->name, APR_HASH_KEY_STRING)) {
+        apr_hash_set(idx->by_name, md->name, APR_HASH_KEY_STRING, md);
+    }
+    for (i = 0; i < md->domains->nelts; ++i) {
+        domain = APR_ARRAY_IDX(md->domains, i, const char*);
+        key = md_util_str_tolower(apr_pstrdup(idx->p, domain));
+        if (!apr_hash_get(idx->by_domain, key, APR_HASH_KEY_STRING)) {
+            apr_hash_set(idx->by_domain, key, APR_HASH_KEY_STRING, md);
+        }
+    }
+}
+
+md_t *md_domain_index_get_by_name(const md_domain_index_t *idx, const char *name)
+{
+    return apr_hash_get(idx->by_name, name, APR_HASH_KEY_STRING);
+}
+
+md_t *md_domain_index_get_by_domain(const md_domain_index_t *idx, const char *domain)
+{
+    char buffer[INDEX_KEY_MAX];
+    const char *key;
+    
+    if (NULL == (key = index_key(buffer, sizeof(buffer), domain))) {
+        return NULL;
+    }
+    return apr_hash_get(idx->by_domain, key, APR_HASH_KEY_STRING);
+}
+
+md_t *md_domain_index_find_match(const md_domain_index_t *idx, const char *domain)
+{
+    char buffer[INDEX_KEY_MAX+1];
+    const char *parent;
+    md_t *md;
+    
+    if (NULL != (md = md_domain_index_get_by_domain(idx, domain))) {
+        return md;
+    }
+    /* a wildcard matches exactly one label, see md_dns_matches() */
+    if (NULL == (parent = strchr(domain, '.')) 
+        || NULL == index_key(buffer + 1, sizeof(buffer) - 1, parent)) {
+        return NULL;
+    }
+    buffer[0] = '*';
+    return apr_hash_get(idx->by_domain, buffer, APR_HASH_KEY_STRING);
+}
+
+const char *md_domain_index_common_name(const md_domain_index_t *idx, const md_t *md, 
+                                        md_t **pother)
+{
+    const char *domain;
+    md_t *other;
+    int i;
+    
+    for (i = 0; i < md->domains->nelts; ++i) {
+        domain = APR_ARRAY_IDX(md->domains, i, const char*);
+        other = md_domain_index_get_by_domain(idx, domain);
+        if (other && other != md) {
+            if (pother) *pother = other;
+            return domain;
+        }
+    }
+    if (pother) *pother = NULL;
+    return NULL;
+}
+
 md_t *md_create(apr_pool_t *p, apr_array_header_t *domains)
 {
     md_t *md;
@@ -204,32 +330,29 @@ md_t *md_create(apr_pool_t *p, apr_array_header_t *domains)
     return md;
 }
 
+apr_time_t md_renew_at(const md_t *md)
+{
+    double renew_win, life;
+    
+    if (md->expires <= 0) {
+        return 0;
+    }
+    renew_win = (double)md->renew_window;
+    if (md->renew_norm > 0 
+        && md->renew_norm > renew_win
+        && md->expires > md->valid_from) {
+        /* Calc renewal days as fraction of cert lifetime - if known */
+        life = (double)(md->expires - md->valid_from); 
+        renew_win = life * renew_win / (double)md->renew_norm;
+    }
+    return md->expires - (apr_interval_time_t)renew_win;
+}
+
 int md_should_renew(const md_t *md) 
 {
     apr_time_t now = apr_time_now();
 
-    if (md->expires <= now) {
-        return 1;
-    }
-    else if (md->expires > 0) {
-        double renew_win,  life;
-        apr_interval_time_t left;
-        
-        renew_win = (double)md->renew_window;
-        if (md->renew_norm > 0 
-            && md->renew_norm > renew_win
-            && md->expires > md->valid_from) {
-            /* Calc renewal days as fraction of cert lifetime - if known */
-            life = (double)(md->expires - md->valid_from); 
-            renew_win = life * renew_win / (double)md->renew_norm;
-        }
-        
-        left = md->expires - now;
-        if (left <= renew_win) {
-            return 1;
-        }                
-    }
-    return 0;
+    return (md->expires <= now) || (md_renew_at(md) <= now);
 }
 
 /**************************************************************************************************/
@@ -247,13 +370,36 @@ md_t *md_copy(apr_pool_t *p, const md_t *src)
         if (src->ca_challenges) {
             md->ca_challenges = apr_array_copy(p, src->ca_challenges);
         }
+        if (src->ca_urls) {
+            md->ca_urls = apr_array_copy(p, src->ca_urls);
+        }
+        if (src->alt_pkey_specs) {
+            md->alt_pkey_specs = apr_array_copy(p, src->alt_pkey_specs);
+        }
     }    
     return md;   
 }
 
+const char *md_ca_effective(const md_t *md)
+{
+    return md->ca_effective? md->ca_effective : md->ca_url;
+}
+
+static md_pkey_spec_t *pkey_spec_clone(apr_pool_t *p, const md_pkey_spec_t *src)
+{
+    md_pkey_spec_t *spec;
+    
+    if (!src) return NULL;
+    spec = apr_pcalloc(p, sizeof(*spec));
+    /* the only string is a static curve name */
+    *spec = *src;
+    return spec;
+}
+
 md_t *md_clone(apr_pool_t *p, const md_t *src)
 {
     md_t *md;
+    int i;
     
     md = apr_pcalloc(p, sizeof(*md));
     if (md) {
@@ -263,11 +409,21 @@ md_t *md_clone(apr_pool_t *p, const md_t *src)
         md->must_staple = src->must_staple;
         md->drive_mode = src->drive_mode;
         md->domains = md_array_str_compact(p, src->domains, 0);
-        md->pkey_spec = src->pkey_spec;
+        md->pkey_spec = pkey_spec_clone(p, src->pkey_spec);
+        if (src->alt_pkey_specs) {
+            md->alt_pkey_specs = apr_array_make(p, src->alt_pkey_specs->nelts, 
+                                                sizeof(md_pkey_spec_t*));
+            for (i = 0; i < src->alt_pkey_specs->nelts; ++i) {
+                APR_ARRAY_PUSH(md->alt_pkey_specs, md_pkey_spec_t*) = pkey_spec_clone(p, 
+                    APR_ARRAY_IDX(src->alt_pkey_specs, i, const md_pkey_spec_t*));
+            }
+        }
         md->renew_norm = src->renew_norm;
         md->renew_window = src->renew_window;
         md->contacts = md_array_str_clone(p, src->contacts);
         if (src->ca_url) md->ca_url = apr_pstrdup(p, src->ca_url);
+        if (src->ca_urls) md->ca_urls = md_array_str_clone(p, src->ca_urls);
+        if (src->ca_effective) md->ca_effective = apr_pstrdup(p, src->ca_effective);
         if (src->ca_proto) md->ca_proto = apr_pstrdup(p, src->ca_proto);
         if (src->ca_account) md->ca_account = apr_pstrdup(p, src->ca_account);
         if (src->ca_agreement) md->ca_agreement = apr_pstrdup(p, src->ca_agreement);
@@ -286,12 +442,15 @@ md_t *md_merge(apr_pool_t *p, const md_t *add, const md_t *base)
     md_t *n = apr_pcalloc(p, sizeof(*n));
 
     n->ca_url = add->ca_url? add->ca_url : base->ca_url;
+    n->ca_urls = add->ca_url? add->ca_urls : base->ca_urls;
+    n->ca_effective = add->ca_effective? add->ca_effective : base->ca_effective;
     n->ca_proto = add->ca_proto? add->ca_proto : base->ca_proto;
     n->ca_agreement = add->ca_agreement? add->ca_agreement : base->ca_agreement;
     n->require_https = (add->require_https != MD_REQUIRE_UNSET)? add->require_https : base->require_https;
     n->must_staple = (add->must_staple >= 0)? add->must_staple : base->must_staple;
     n->drive_mode = (add->drive_mode != MD_DRIVE_DEFAULT)? add->drive_mode : base->drive_mode;
     n->pkey_spec = add->pkey_spec? add->pkey_spec : base->pkey_spec;
+    n->alt_pkey_specs = add->pkey_spec? add->alt_pkey_specs : base->alt_pkey_specs;
     n->renew_norm = (add->renew_norm > 0)? add->renew_norm : base->renew_norm;
     n->renew_window = (add->renew_window > 0)? add->renew_window : base->renew_window;
     n->transitive = (add->transitive >= 0)? add->transitive : base->transitive;
@@ -307,59 +466,93 @@ md_t *md_merge(apr_pool_t *p, const md_t *add, const md_t *base)
 /**************************************************************************************************/
 /* format conversion */
 
+static apr_status_t spec_to_json(void *value, md_json_t *json, apr_pool_t *p, void *baton)
+{
+    (void)baton;
+    return md_json_setj(md_pkey_spec_to_json(value, p), json, NULL);
+}
+
+static apr_status_t spec_from_json(void **pvalue, md_json_t *json, apr_pool_t *p, void *baton)
+{
+    (void)baton;
+    *pvalue = md_pkey_spec_from_json(json, p);
+    return APR_SUCCESS;
+}
+
+/* The members of md_t stored as they are */
+static const md_json_field_t md_fields[] = {
+    { MD_JSON_PATH(MD_KEY_NAME),                MD_JSON_FIELD_STR,  APR_OFFSETOF(md_t, name) },
+    { MD_JSON_PATH(MD_KEY_CONTACTS),            MD_JSON_FIELD_STRA, APR_OFFSETOF(md_t, contacts) },
+    { MD_JSON_PATH(MD_KEY_TRANSITIVE),          MD_JSON_FIELD_INT,  APR_OFFSETOF(md_t, transitive) },
+    { MD_JSON_PATH(MD_KEY_CA, MD_KEY_ACCOUNT),  MD_JSON_FIELD_STR,  APR_OFFSETOF(md_t, ca_account) },
+    { MD_JSON_PATH(MD_KEY_CA, MD_KEY_PROTO),    MD_JSON_FIELD_STR,  APR_OFFSETOF(md_t, ca_proto) },
+    { MD_JSON_PATH(MD_KEY_CA, MD_KEY_URL),      MD_JSON_FIELD_STR,  APR_OFFSETOF(md_t, ca_url) },
+    { MD_JSON_PATH(MD_KEY_CA, MD_KEY_URLS),     MD_JSON_FIELD_STRA, APR_OFFSETOF(md_t, ca_urls) },
+    { MD_JSON_PATH(MD_KEY_CA, MD_KEY_EFFECTIVE), MD_JSON_FIELD_STR, APR_OFFSETOF(md_t, ca_effective) },
+    { MD_JSON_PATH(MD_KEY_CA, MD_KEY_AGREEMENT), MD_JSON_FIELD_STR, APR_OFFSETOF(md_t, ca_agreement) },
+    { MD_JSON_PATH(MD_KEY_DRIVE_MODE),          MD_JSON_FIELD_INT,  APR_OFFSETOF(md_t, drive_mode) },
+    { MD_JSON_PATH(MD_KEY_MUST_STAPLE),         MD_JSON_FIELD_BOOL, APR_OFFSETOF(md_t, must_staple) },
+    { MD_JSON_PATH(MD_KEY_PROTO, MD_KEY_ACME_TLS_1), MD_JSON_FIELD_BOOL, 
+      APR_OFFSETOF(md_t, can_acme_tls_1) },
+};
+
+static const md_json_path_t P_DOMAINS = MD_JSON_PATH(MD_KEY_DOMAINS);
+static const md_json_path_t P_CA_CHALLENGES = MD_JSON_PATH(MD_KEY_CA, MD_KEY_CHALLENGES);
+static const md_json_path_t P_ALT_PKEYS = MD_JSON_PATH(MD_KEY_ALT_PKEYS);
+static const md_json_path_t P_STATE = MD_JSON_PATH(MD_KEY_STATE);
+static const md_json_path_t P_CERT_EXPIRES = MD_JSON_PATH(MD_KEY_CERT, MD_KEY_EXPIRES);
+static const md_json_path_t P_CERT_VALID_FROM = MD_JSON_PATH(MD_KEY_CERT, MD_KEY_VALID_FROM);
+static const md_json_path_t P_RENEW_WINDOW = MD_JSON_PATH(MD_KEY_RENEW_WINDOW);
+static const md_json_path_t P_RENEW = MD_JSON_PATH(MD_KEY_RENEW);
+static const md_json_path_t P_REQUIRE_HTTPS = MD_JSON_PATH(MD_KEY_REQUIRE_HTTPS);
+
 md_json_t *md_to_json(const md_t *md, apr_pool_t *p)
 {
     md_json_t *json = md_json_create(p);
     if (json) {
         apr_array_header_t *domains = md_array_str_compact(p, md->domains, 0);
-        md_json_sets(md->name, json, MD_KEY_NAME, NULL);
-        md_json_setsa(domains, json, MD_KEY_DOMAINS, NULL);
-        md_json_setsa(md->contacts, json, MD_KEY_CONTACTS, NULL);
-        md_json_setl(md->transitive, json, MD_KEY_TRANSITIVE, NULL);
-        md_json_sets(md->ca_account, json, MD_KEY_CA, MD_KEY_ACCOUNT, NULL);
-        md_json_sets(md->ca_proto, json, MD_KEY_CA, MD_KEY_PROTO, NULL);
-        md_json_sets(md->ca_url, json, MD_KEY_CA, MD_KEY_URL, NULL);
-        md_json_sets(md->ca_agreement, json, MD_KEY_CA, MD_KEY_AGREEMENT, NULL);
+        md_json_setsa_p(domains, json, &P_DOMAINS);
+        md_json_fields_set(md, md_fields, sizeof(md_fields)/sizeof(md_fields[0]), json);
         if (md->pkey_spec) {
             md_json_setj(md_pkey_spec_to_json(md->pkey_spec, p), json, MD_KEY_PKEY, NULL);
         }
-        md_json_setl(md->state, json, MD_KEY_STATE, NULL);
-        md_json_setl(md->drive_mode, json, MD_KEY_DRIVE_MODE, NULL);
+        if (md->alt_pkey_specs && md->alt_pkey_specs->nelts > 0) {
+            md_json_seta(md->alt_pkey_specs, spec_to_json, NULL, json, MD_KEY_ALT_PKEYS, NULL);
+        }
+        md_json_setl_p(md->state, json, &P_STATE);
         if (md->expires > 0) {
             char *ts = apr_pcalloc(p, APR_RFC822_DATE_LEN);
             apr_rfc822_date(ts, md->expires);
-            md_json_sets(ts, json, MD_KEY_CERT, MD_KEY_EXPIRES, NULL);
+            md_json_sets_p(ts, json, &P_CERT_EXPIRES);
         }
         if (md->valid_from > 0) {
             char *ts = apr_pcalloc(p, APR_RFC822_DATE_LEN);
             apr_rfc822_date(ts, md->valid_from);
-            md_json_sets(ts, json, MD_KEY_CERT, MD_KEY_VALID_FROM, NULL);
+            md_json_sets_p(ts, json, &P_CERT_VALID_FROM);
         }
         if (md->renew_norm > 0) {
-            md_json_sets(apr_psprintf(p, "%ld%%", (long)(md->renew_window * 100L / md->renew_norm)), 
-                                      json, MD_KEY_RENEW_WINDOW, NULL);
+            md_json_sets_p(apr_psprintf(p, "%ld%%", (long)(md->renew_window * 100L / md->renew_norm)), 
+                           json, &P_RENEW_WINDOW);
         }
         else {
-            md_json_setl((long)apr_time_sec(md->renew_window), json, MD_KEY_RENEW_WINDOW, NULL);
+            md_json_setl_p((long)apr_time_sec(md->renew_window), json, &P_RENEW_WINDOW);
         }
-        md_json_setb(md_should_renew(md), json, MD_KEY_RENEW, NULL);
+        md_json_setb_p(md_should_renew(md), json, &P_RENEW);
         if (md->ca_challenges && md->ca_challenges->nelts > 0) {
             apr_array_header_t *na;
             na = md_array_str_compact(p, md->ca_challenges, 0);
-            md_json_setsa(na, json, MD_KEY_CA, MD_KEY_CHALLENGES, NULL);
+            md_json_setsa_p(na, json, &P_CA_CHALLENGES);
         }
         switch (md->require_https) {
             case MD_REQUIRE_TEMPORARY:
-                md_json_sets(MD_KEY_TEMPORARY, json, MD_KEY_REQUIRE_HTTPS, NULL);
+                md_json_sets_p(MD_KEY_TEMPORARY, json, &P_REQUIRE_HTTPS);
                 break;
             case MD_REQUIRE_PERMANENT:
-                md_json_sets(MD_KEY_PERMANENT, json, MD_KEY_REQUIRE_HTTPS, NULL);
+                md_json_sets_p(MD_KEY_PERMANENT, json, &P_REQUIRE_HTTPS);
                 break;
             default:
                 break;
         }
-        md_json_setb(md->must_staple > 0, json, MD_KEY_MUST_STAPLE, NULL);
-        md_json_setb(md->can_acme_tls_1 > 0, json, MD_KEY_PROTO, MD_KEY_ACME_TLS_1, NULL);
         return json;
     }
     return NULL;
@@ -368,34 +561,33 @@ md_json_t *md_to_json(const md_t *md, apr_pool_t *p)
 md_t *md_from_json(md_json_t *json, apr_pool_t *p)
 {
     const char *s;
+    md_json_t *jpkey;
     md_t *md = md_create_empty(p);
     if (md) {
-        md->name = md_json_dups(p, json, MD_KEY_NAME, NULL);            
-        md_json_dupsa(md->domains, p, json, MD_KEY_DOMAINS, NULL);
-        md_json_dupsa(md->contacts, p, json, MD_KEY_CONTACTS, NULL);
-        md->ca_account = md_json_dups(p, json, MD_KEY_CA, MD_KEY_ACCOUNT, NULL);
-        md->ca_proto = md_json_dups(p, json, MD_KEY_CA, MD_KEY_PROTO, NULL);
-        md->ca_url = md_json_dups(p, json, MD_KEY_CA, MD_KEY_URL, NULL);
-        md->ca_agreement = md_json_dups(p, json, MD_KEY_CA, MD_KEY_AGREEMENT, NULL);
-        if (md_json_has_key(json, MD_KEY_PKEY, MD_KEY_TYPE, NULL)) {
-            md->pkey_spec = md_pkey_spec_from_json(md_json_getj(json, MD_KEY_PKEY, NULL), p);
-        }
-        md->state = (md_state_t)md_json_getl(json, MD_KEY_STATE, NULL);
-        md->drive_mode = (int)md_json_getl(json, MD_KEY_DRIVE_MODE, NULL);
+        md_json_fields_get(md, md_fields, sizeof(md_fields)/sizeof(md_fields[0]), json, p);
+        md_json_dupsa_p(md->domains, p, json, &P_DOMAINS);
         md->domains = md_array_str_compact(p, md->domains, 0);
-        md->transitive = (int)md_json_getl(json, MD_KEY_TRANSITIVE, NULL);
-        s = md_json_dups(p, json, MD_KEY_CERT, MD_KEY_EXPIRES, NULL);
+        if ((jpkey = md_json_viewj(json, MD_KEY_PKEY, NULL)) 
+            && md_json_has_key(jpkey, MD_KEY_TYPE, NULL)) {
+            md->pkey_spec = md_pkey_spec_from_json(jpkey, p);
+        }
+        if (md_json_has_key_p(json, &P_ALT_PKEYS)) {
+            md->alt_pkey_specs = apr_array_make(p, 3, sizeof(md_pkey_spec_t*));
+            md_json_geta(md->alt_pkey_specs, spec_from_json, NULL, json, MD_KEY_ALT_PKEYS, NULL);
+        }
+        md->state = (md_state_t)md_json_getl_p(json, &P_STATE);
+        s = md_json_gets_p(json, &P_CERT_EXPIRES);
         if (s && *s) {
             md->expires = apr_date_parse_rfc(s);
         }
-        s = md_json_dups(p, json, MD_KEY_CERT, MD_KEY_VALID_FROM, NULL);
+        s = md_json_gets_p(json, &P_CERT_VALID_FROM);
         if (s && *s) {
             md->valid_from = apr_date_parse_rfc(s);
         }
         md->renew_norm = 0;
-        md->renew_window = apr_time_from_sec(md_json_getl(json, MD_KEY_RENEW_WINDOW, NULL));
+        md->renew_window = apr_time_from_sec(md_json_getl_p(json, &P_RENEW_WINDOW));
         if (md->renew_window <= 0) {
-            s = md_json_gets(json, MD_KEY_RENEW_WINDOW, NULL);
+            s = md_json_gets_p(json, &P_RENEW_WINDOW);
             if (s && strchr(s, '%')) {
                 int percent = atoi(s);
                 if (0 < percent && percent < 100) {
@@ -404,20 +596,18 @@ md_t *md_from_json(md_json_t *json, apr_pool_t *p)
                 }
             }
         }
-        if (md_json_has_key(json, MD_KEY_CA, MD_KEY_CHALLENGES, NULL)) {
+        if (md_json_has_key_p(json, &P_CA_CHALLENGES)) {
             md->ca_challenges = apr_array_make(p, 5, sizeof(const char*));
-            md_json_dupsa(md->ca_challenges, p, json, MD_KEY_CA, MD_KEY_CHALLENGES, NULL);
+            md_json_dupsa_p(md->ca_challenges, p, json, &P_CA_CHALLENGES);
         }
         md->require_https = MD_REQUIRE_OFF;
-        s = md_json_gets(json, MD_KEY_REQUIRE_HTTPS, NULL);
+        s = md_json_gets_p(json, &P_REQUIRE_HTTPS);
         if (s && !strcmp(MD_KEY_TEMPORARY, s)) {
             md->require_https = MD_REQUIRE_TEMPORARY;
         }
         else if (s && !strcmp(MD_KEY_PERMANENT, s)) {
             md->require_https = MD_REQUIRE_PERMANENT;
         }
-        md->must_staple = (int)md_json_getb(json, MD_KEY_MUST_STAPLE, NULL);
-        md->can_acme_tls_1 = (int)md_json_getb(json, MD_KEY_PROTO, MD_KEY_ACME_TLS_1, NULL);
         
         return md;
     }
@@ -15,14 +15,19 @@
  */
  
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <apr_lib.h>
 #include <apr_buckets.h>
 #include <apr_file_io.h>
+#include <apr_hash.h>
 #include <apr_strings.h>
+#include <apr_thread_mutex.h>
 
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
 #include <openssl/pem.h>
@@ -57,11 +62,18 @@
 #define MD_USE_OPENSSL_PRE_1_1_API (OPENSSL_VERSION_NUMBER < 0x10100000L)
 #endif
 
+#if MD_USE_OPENSSL_PRE_1_1_API
+#define X509_up_ref(x)          CRYPTO_add(&(x)->references, 1, CRYPTO_LOCK_X509)
+#define EVP_PKEY_up_ref(pkey)   CRYPTO_add(&(pkey)->references, 1, CRYPTO_LOCK_EVP_PKEY)
+#endif
+
 static int initialized;
 
 struct md_pkey_t {
     apr_pool_t *pool;
     EVP_PKEY   *pkey;
+    const char *jwk;                /* public key as RFC 7638 JWK, once computed */
+    const char *jwk_thumb;          /* its SHA-256 thumbprint, base64url encoded */
 };
 
 #ifdef MD_HAVE_ARC4RANDOM
@@ -122,6 +134,30 @@ static void seed_RAND(int pid)
 #endif /*ifdef MD_HAVE_ARC4RANDOM (else part) */
 
 
+/* Chains of all MDs carry the same few intermediate certificates. Those are parsed 
+ * once per process and shared, found by the SHA-256 of their DER encoding. */
+static apr_pool_t *shared_pool;
+static apr_hash_t *shared_certs;    /* sha256 hex -> md_cert_t* */
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *shared_mutex;
+#endif
+
+static void shared_init(void)
+{
+    /* lives as long as the process, the pool given to us may not */
+    if (APR_SUCCESS != apr_pool_create(&shared_pool, NULL)) {
+        return;
+    }
+    apr_pool_tag(shared_pool, "md_shared_certs");
+#if APR_HAS_THREADS
+    if (APR_SUCCESS != apr_thread_mutex_create(&shared_mutex, APR_THREAD_MUTEX_DEFAULT, 
+                                               shared_pool)) {
+        return;
+    }
+#endif
+    shared_certs = apr_hash_make(shared_pool);
+}
+
 apr_status_t md_crypt_init(apr_pool_t *pool)
 {
     (void)pool;
@@ -136,12 +172,22 @@ apr_status_t md_crypt_init(apr_pool_t *pool)
         while (!RAND_status()) {
             seed_RAND(pid);
 	}
+        shared_init();
 
         initialized = 1;
     }
     return APR_SUCCESS;
 }
 
+int md_crypt_is_threadsafe(void)
+{
+#if MD_USE_OPENSSL_PRE_1_1_API
+    return 0;
+#else
+    return 1;
+#endif
+}
+
 typedef struct {
     char *data;
     apr_size_t len;
@@ -195,7 +241,7 @@ static int pem_passwd(char *buf, int size, int rwflag, void *baton)
  * not caughts up yet or chose to ignore. An alternative is implemented, we prefer 
  * however the *SSL to maintain such things.
  */
-static apr_time_t md_asn1_time_get(const ASN1_TIME* time)
+apr_time_t md_asn1_time_get(const ASN1_TIME* time)
 {
 #if OPENSSL_VERSION_NUMBER < 0x10002000L || defined(LIBRESSL_VERSION_NUMBER)
     /* courtesy: https://stackoverflow.com/questions/10975542/asn1-time-to-time-t-conversion#11263731
@@ -264,6 +310,12 @@ md_json_t *md_pkey_spec_to_json(const md_pkey_spec_t *spec, apr_pool_t *p)
                     md_json_setl((long)spec->params.rsa.bits, json, MD_KEY_BITS, NULL);
                 }
                 break;
+            case MD_PKEY_TYPE_EC:
+                md_json_sets("EC", json, MD_KEY_TYPE, NULL);
+                if (spec->params.ec.curve) {
+                    md_json_sets(spec->params.ec.curve, json, MD_KEY_CURVE, NULL);
+                }
+                break;
             default:
                 md_json_sets("Unsupported", json, MD_KEY_TYPE, NULL);
                 break;
@@ -293,6 +345,16 @@ md_pkey_spec_t *md_pkey_spec_from_json(struct md_json_t *json, apr_pool_t *p)
                 spec->params.rsa.bits = MD_PKEY_RSA_BITS_DEF;
             }
         }
+        else if (!apr_strnatcasecmp("EC", s)) {
+            spec->type = MD_PKEY_TYPE_EC;
+            s = md_json_gets(json, MD_KEY_CURVE, NULL);
+            spec->params.ec.curve = md_pkey_ec_curve_name(s? s : MD_PKEY_EC_CURVE_DEF);
+            if (!spec->params.ec.curve) {
+                md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, 0, p, 
+                              "unsupported EC curve '%s', using %s", s, MD_PKEY_EC_CURVE_DEF);
+                spec->params.ec.curve = md_pkey_ec_curve_name(MD_PKEY_EC_CURVE_DEF);
+            }
+        }
     }
     return spec;
 }
@@ -311,11 +373,36 @@ int md_pkey_spec_eq(md_pkey_spec_t *spec1, md_pkey_spec_t *spec2)
                     return 1;
                 }
                 break;
+            case MD_PKEY_TYPE_EC:
+                if (spec1->params.ec.curve == spec2->params.ec.curve
+                    || (spec1->params.ec.curve && spec2->params.ec.curve
+                        && !strcmp(spec1->params.ec.curve, spec2->params.ec.curve))) {
+                    return 1;
+                }
+                break;
         }
     }
     return 0;
 }
 
+int md_pkey_specs_eq(apr_array_header_t *specs1, apr_array_header_t *specs2)
+{
+    int i, n1, n2;
+    
+    n1 = specs1? specs1->nelts : 0;
+    n2 = specs2? specs2->nelts : 0;
+    if (n1 != n2) {
+        return 0;
+    }
+    for (i = 0; i < n1; ++i) {
+        if (!md_pkey_spec_eq(APR_ARRAY_IDX(specs1, i, md_pkey_spec_t*), 
+                             APR_ARRAY_IDX(specs2, i, md_pkey_spec_t*))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
 static md_pkey_t *make_pkey(apr_pool_t *p) 
 {
     md_pkey_t *pkey = apr_pcalloc(p, sizeof(*pkey));
@@ -343,23 +430,67 @@ void *md_pkey_get_EVP_PKEY(struct md_pkey_t *pkey)
     return pkey->pkey;
 }
 
+md_pkey_t *md_pkey_ref(md_pkey_t *pkey, apr_pool_t *p)
+{
+    md_pkey_t *ref = make_pkey(p);
+    
+    EVP_PKEY_up_ref(pkey->pkey);
+    ref->pkey = pkey->pkey;
+    if (apr_pool_is_ancestor(pkey->pool, p)) {
+        ref->jwk = pkey->jwk;
+        ref->jwk_thumb = pkey->jwk_thumb;
+    }
+    apr_pool_cleanup_register(p, ref, pkey_cleanup, apr_pool_cleanup_null);
+    return ref;
+}
+
+/* Read the file in one go and give a memory BIO on its contents, allocated in ptemp. */
+static apr_status_t fload_bio(BIO **pbio, char **pdata, apr_size_t *plen, 
+                              apr_pool_t *ptemp, const char *fname)
+{
+    const char *data;
+    apr_size_t len;
+    apr_status_t rv;
+    
+    *pbio = NULL;
+    if (APR_SUCCESS == (rv = md_util_file_load(&data, &len, ptemp, fname, 0))) {
+        if (len > INT_MAX) {
+            rv = APR_EINVAL;
+        }
+        else if (NULL == (*pbio = BIO_new_mem_buf((void*)data, (int)len))) {
+            rv = APR_ENOMEM;
+        }
+    }
+    if (pdata) *pdata = (char*)data;
+    if (plen) *plen = (APR_SUCCESS == rv)? len : 0;
+    return rv;
+}
+
 apr_status_t md_pkey_fload(md_pkey_t **ppkey, apr_pool_t *p, 
                            const char *key, apr_size_t key_len,
                            const char *fname)
 {
-    apr_status_t rv = APR_ENOENT;
+    apr_status_t rv;
+    apr_pool_t *ptemp;
     md_pkey_t *pkey;
     BIO *bf;
+    char *data;
+    apr_size_t len;
     passwd_ctx ctx;
     
     pkey =  make_pkey(p);
-    if (NULL != (bf = BIO_new_file(fname, "r"))) {
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, p))) {
+        *ppkey = NULL;
+        return rv;
+    }
+    if (APR_SUCCESS == (rv = fload_bio(&bf, &data, &len, ptemp, fname))) {
         ctx.pass_phrase = key;
         ctx.pass_len = (int)key_len;
         
         ERR_clear_error();
         pkey->pkey = PEM_read_bio_PrivateKey(bf, NULL, pem_passwd, &ctx);
         BIO_free(bf);
+        OPENSSL_cleanse(data, len);
         
         if (pkey->pkey != NULL) {
             rv = APR_SUCCESS;
@@ -373,6 +504,7 @@ apr_status_t md_pkey_fload(md_pkey_t **ppkey, apr_pool_t *p,
                           ERR_error_string(err, NULL), key? "not " : ""); 
         }
     }
+    apr_pool_destroy(ptemp);
     *ppkey = (APR_SUCCESS == rv)? pkey : NULL;
     return rv;
 }
@@ -440,6 +572,20 @@ apr_status_t md_pkey_fsave(md_pkey_t *pkey, apr_pool_t *p,
     return rv;
 }
 
+apr_status_t md_pkey_to_pem(const char **ppem, apr_size_t *plen, md_pkey_t *pkey, 
+                            apr_pool_t *p, const char *pass_phrase, apr_size_t pass_len)
+{
+    buffer_rec buffer;
+    apr_status_t rv;
+    
+    buffer.data = NULL;
+    buffer.len = 0;
+    rv = pkey_to_buffer(&buffer, pkey, p, pass_phrase, pass_len);
+    *ppem = (APR_SUCCESS == rv)? buffer.data : NULL;
+    *plen = (APR_SUCCESS == rv)? buffer.len : 0;
+    return rv;
+}
+
 static apr_status_t gen_rsa(md_pkey_t **ppkey, apr_pool_t *p, unsigned int bits)
 {
     EVP_PKEY_CTX *ctx = NULL;
@@ -465,6 +611,90 @@ static apr_status_t gen_rsa(md_pkey_t **ppkey, apr_pool_t *p, unsigned int bits)
     return rv;
 }
 
+typedef struct {
+    const char *name;       /* JWA name */
+    const char *alias1;     /* OpenSSL names */
+    const char *alias2;
+    int nid;
+    apr_size_t len;         /* length of a coordinate in bytes */
+} ec_curve_t;
+
+static const ec_curve_t EC_CURVES[] = {
+    { "P-256", "secp256r1", "prime256v1", NID_X9_62_prime256v1, 32 },
+    { "P-384", "secp384r1", NULL,         NID_secp384r1,        48 },
+};
+
+static const ec_curve_t *ec_curve_by_name(const char *name)
+{
+    apr_size_t i;
+    
+    if (name) {
+        for (i = 0; i < sizeof(EC_CURVES)/sizeof(EC_CURVES[0]); ++i) {
+            if (!apr_strnatcasecmp(name, EC_CURVES[i].name)
+                || (EC_CURVES[i].alias1 && !apr_strnatcasecmp(name, EC_CURVES[i].alias1))
+                || (EC_CURVES[i].alias2 && !apr_strnatcasecmp(name, EC_CURVES[i].alias2))) {
+                return &EC_CURVES[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+static const ec_curve_t *ec_curve_by_nid(int nid)
+{
+    apr_size_t i;
+    
+    for (i = 0; i < sizeof(EC_CURVES)/sizeof(EC_CURVES[0]); ++i) {
+        if (nid == EC_CURVES[i].nid) {
+            return &EC_CURVES[i];
+        }
+    }
+    return NULL;
+}
+
+const char *md_pkey_ec_curve_name(const char *curve)
+{
+    const ec_curve_t *c = ec_curve_by_name(curve);
+    return c? c->name : NULL;
+}
+
+static apr_status_t gen_ec(md_pkey_t **ppkey, apr_pool_t *p, const char *curve)
+{
+    const ec_curve_t *c;
+    EC_KEY *ec = NULL;
+    apr_status_t rv = APR_EGENERAL;
+    
+    *ppkey = make_pkey(p);
+    if (!(c = ec_curve_by_name(curve? curve : MD_PKEY_EC_CURVE_DEF))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, 0, p, "unsupported EC curve %s", curve); 
+        rv = APR_ENOTIMPL;
+    }
+    else if ((ec = EC_KEY_new_by_curve_name(c->nid)) != NULL) {
+        /* write the curve name instead of its parameters to PEM files and certificates */
+        EC_KEY_set_asn1_flag(ec, OPENSSL_EC_NAMED_CURVE);
+        if (EC_KEY_generate_key(ec)
+            && ((*ppkey)->pkey = EVP_PKEY_new()) != NULL
+            && EVP_PKEY_assign_EC_KEY((*ppkey)->pkey, ec)) {
+            /* key now owned by EVP_PKEY */
+            ec = NULL;
+            apr_pool_cleanup_register(p, *ppkey, pkey_cleanup, apr_pool_cleanup_null);
+            rv = APR_SUCCESS;
+        }
+    }
+    
+    if (APR_SUCCESS != rv) {
+        if (c) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, 0, p, "error generate pkey EC %s", c->name); 
+        }
+        pkey_cleanup(*ppkey);
+        *ppkey = NULL;
+    }
+    if (ec) {
+        EC_KEY_free(ec);
+    }
+    return rv;
+}
+
 apr_status_t md_pkey_gen(md_pkey_t **ppkey, apr_pool_t *p, md_pkey_spec_t *spec)
 {
     md_pkey_type_t ptype = spec? spec->type : MD_PKEY_TYPE_DEFAULT;
@@ -473,6 +703,8 @@ apr_status_t md_pkey_gen(md_pkey_t **ppkey, apr_pool_t *p, md_pkey_spec_t *spec)
             return gen_rsa(ppkey, p, MD_PKEY_RSA_BITS_DEF);
         case MD_PKEY_TYPE_RSA:
             return gen_rsa(ppkey, p, spec->params.rsa.bits);
+        case MD_PKEY_TYPE_EC:
+            return gen_ec(ppkey, p, spec->params.ec.curve);
         default:
             return APR_ENOTIMPL;
     }
@@ -496,6 +728,14 @@ static void RSA_get0_key(const RSA *r,
         *d = r->d;
 }
 
+static void ECDSA_SIG_get0(const ECDSA_SIG *sig, const BIGNUM **pr, const BIGNUM **ps)
+{
+    if (pr != NULL)
+        *pr = sig->r;
+    if (ps != NULL)
+        *ps = sig->s;
+}
+
 #endif
 
 static const char *bn64(const BIGNUM *b, apr_pool_t *p) 
@@ -511,49 +751,191 @@ static const char *bn64(const BIGNUM *b, apr_pool_t *p)
     return NULL;
 }
 
+/* big endian bytes of b, left padded with zeros to len bytes */
+static int bn_to_padded(unsigned char *buffer, apr_size_t len, const BIGNUM *b)
+{
+    apr_size_t blen;
+    
+    if (!b) {
+        return 0;
+    }
+    blen = (apr_size_t)BN_num_bytes(b);
+    if (blen > len) {
+        return 0;
+    }
+    memset(buffer, 0, len - blen);
+    BN_bn2bin(b, buffer + (len - blen));
+    return 1;
+}
+
+static const ec_curve_t *pkey_ec_curve(md_pkey_t *pkey)
+{
+    const ec_curve_t *c = NULL;
+    EC_KEY *ec;
+    
+    if (pkey->pkey && EVP_PKEY_EC == EVP_PKEY_base_id(pkey->pkey)
+        && (ec = EVP_PKEY_get1_EC_KEY(pkey->pkey)) != NULL) {
+        c = ec_curve_by_nid(EC_GROUP_get_curve_name(EC_KEY_get0_group(ec)));
+        EC_KEY_free(ec);
+    }
+    return c;
+}
+
+const char *md_pkey_get_ec_curve(md_pkey_t *pkey)
+{
+    const ec_curve_t *c = pkey_ec_curve(pkey);
+    return c? c->name : NULL;
+}
+
+static const char *ec_coord64(md_pkey_t *pkey, int want_y, apr_pool_t *p)
+{
+    const ec_curve_t *c;
+    const EC_POINT *pt;
+    EC_KEY *ec = NULL;
+    BIGNUM *x = NULL, *y = NULL;
+    unsigned char *buffer;
+    const char *s64 = NULL;
+    
+    if ((c = pkey_ec_curve(pkey)) != NULL
+        && (ec = EVP_PKEY_get1_EC_KEY(pkey->pkey)) != NULL
+        && (pt = EC_KEY_get0_public_key(ec)) != NULL
+        && (x = BN_new()) != NULL && (y = BN_new()) != NULL
+        && EC_POINT_get_affine_coordinates_GFp(EC_KEY_get0_group(ec), pt, x, y, NULL)) {
+        buffer = apr_pcalloc(p, c->len);
+        if (bn_to_padded(buffer, c->len, want_y? y : x)) {
+            s64 = md_util_base64url_encode((const char*)buffer, c->len, p);
+        }
+    }
+    if (x) BN_free(x);
+    if (y) BN_free(y);
+    if (ec) EC_KEY_free(ec);
+    return s64;
+}
+
+const char *md_pkey_get_ec_x64(md_pkey_t *pkey, apr_pool_t *p)
+{
+    return ec_coord64(pkey, 0, p);
+}
+
+const char *md_pkey_get_ec_y64(md_pkey_t *pkey, apr_pool_t *p)
+{
+    return ec_coord64(pkey, 1, p);
+}
+
 const char *md_pkey_get_rsa_e64(md_pkey_t *pkey, apr_pool_t *p)
 {
     const BIGNUM *e;
+    const char *e64;
     RSA *rsa = EVP_PKEY_get1_RSA(pkey->pkey);
     
     if (!rsa) {
         return NULL;
     }
     RSA_get0_key(rsa, NULL, &e, NULL);
-    return bn64(e, p);
+    e64 = bn64(e, p);
+    RSA_free(rsa);
+    return e64;
 }
 
 const char *md_pkey_get_rsa_n64(md_pkey_t *pkey, apr_pool_t *p)
 {
     const BIGNUM *n;
+    const char *n64;
     RSA *rsa = EVP_PKEY_get1_RSA(pkey->pkey);
     
     if (!rsa) {
         return NULL;
     }
     RSA_get0_key(rsa, &n, NULL, NULL);
-    return bn64(n, p);
+    n64 = bn64(n, p);
+    RSA_free(rsa);
+    return n64;
+}
+
+const char *md_pkey_get_jwk(md_pkey_t *pkey)
+{
+    const char *e64, *n64, *x64, *y64, *curve;
+    
+    if (pkey->jwk) {
+        return pkey->jwk;
+    }
+    if ((curve = md_pkey_get_ec_curve(pkey))) {
+        x64 = md_pkey_get_ec_x64(pkey, pkey->pool);
+        y64 = md_pkey_get_ec_y64(pkey, pkey->pool);
+        if (x64 && y64) {
+            /* RFC 7638: required members in lexicographic order, no whitespace */
+            pkey->jwk = apr_psprintf(pkey->pool, 
+                                     "{\"crv\":\"%s\",\"kty\":\"EC\",\"x\":\"%s\",\"y\":\"%s\"}", 
+                                     curve, x64, y64);
+        }
+    }
+    else {
+        e64 = md_pkey_get_rsa_e64(pkey, pkey->pool);
+        n64 = md_pkey_get_rsa_n64(pkey, pkey->pool);
+        if (e64 && n64) {
+            pkey->jwk = apr_psprintf(pkey->pool, "{\"e\":\"%s\",\"kty\":\"RSA\",\"n\":\"%s\"}", 
+                                     e64, n64);
+        }
+    }
+    return pkey->jwk;
+}
+
+const char *md_pkey_get_jwk_thumb(md_pkey_t *pkey)
+{
+    const char *jwk, *thumb;
+    
+    if (!pkey->jwk_thumb && (jwk = md_pkey_get_jwk(pkey))
+        && APR_SUCCESS == md_crypt_sha256_digest64(&thumb, pkey->pool, jwk, strlen(jwk))) {
+        pkey->jwk_thumb = thumb;
+    }
+    return pkey->jwk_thumb;
+}
+
+/* JWS wants EC signatures as R || S, each padded to the curve's coordinate length,
+ * instead of the DER encoded ECDSA-Sig-Value produced by OpenSSL. */
+static const char *ec_sig64(const ec_curve_t *c, const unsigned char *der, unsigned int dlen, 
+                            apr_pool_t *p)
+{
+    ECDSA_SIG *sig;
+    const BIGNUM *r, *s;
+    unsigned char *raw;
+    const char *sign64 = NULL;
+    
+    if ((sig = d2i_ECDSA_SIG(NULL, &der, (long)dlen)) != NULL) {
+        ECDSA_SIG_get0(sig, &r, &s);
+        raw = apr_pcalloc(p, 2 * c->len);
+        if (bn_to_padded(raw, c->len, r) && bn_to_padded(raw + c->len, c->len, s)) {
+            sign64 = md_util_base64url_encode((const char*)raw, 2 * c->len, p);
+        }
+        ECDSA_SIG_free(sig);
+    }
+    return sign64;
 }
 
 apr_status_t md_crypt_sign64(const char **psign64, md_pkey_t *pkey, apr_pool_t *p, 
                              const char *d, size_t dlen)
 {
     EVP_MD_CTX *ctx = NULL;
+    const EVP_MD *digest;
+    const ec_curve_t *curve;
     char *buffer;
     unsigned int blen;
     const char *sign64 = NULL;
     apr_status_t rv = APR_ENOMEM;
     
+    curve = pkey_ec_curve(pkey);
+    digest = (curve && curve->len > 32)? EVP_sha384() : EVP_sha256();
     buffer = apr_pcalloc(p, (apr_size_t)EVP_PKEY_size(pkey->pkey));
     if (buffer) {
         ctx = EVP_MD_CTX_create();
         if (ctx) {
             rv = APR_ENOTIMPL;
-            if (EVP_SignInit_ex(ctx, EVP_sha256(), NULL)) {
+            if (EVP_SignInit_ex(ctx, digest, NULL)) {
                 rv = APR_EGENERAL;
                 if (EVP_SignUpdate(ctx, d, dlen)) {
                     if (EVP_SignFinal(ctx, (unsigned char*)buffer, &blen, pkey->pkey)) {
-                        sign64 = md_util_base64url_encode(buffer, blen, p);
+                        sign64 = curve? ec_sig64(curve, (const unsigned char*)buffer, blen, p)
+                                      : md_util_base64url_encode(buffer, blen, p);
                         if (sign64) {
                             rv = APR_SUCCESS;
                         }
@@ -682,7 +1064,10 @@ apr_status_t md_crypt_sha256_digest_hex(const char **pdigesthex, apr_pool_t *p,
 struct md_cert_t {
     apr_pool_t *pool;
     X509 *x509;
-    apr_array_header_t *alt_names;
+    apr_time_t not_before;
+    apr_time_t not_after;
+    apr_array_header_t *alt_names;  /* NULL when the certificate has none */
+    apr_hash_t *alt_hash;           /* lower case alt name -> alt name */
 };
 
 static apr_status_t cert_cleanup(void *data)
@@ -695,12 +1080,63 @@ static apr_status_t cert_cleanup(void *data)
     return APR_SUCCESS;
 }
 
+static apr_array_header_t *x509_alt_names(X509 *x509, apr_pool_t *p)
+{
+    apr_array_header_t *names = NULL;
+    STACK_OF(GENERAL_NAME) *xalt_names;
+    unsigned char *buf;
+    int i;
+    
+    xalt_names = X509_get_ext_d2i(x509, NID_subject_alt_name, NULL, NULL);
+    if (xalt_names) {
+        GENERAL_NAME *cval;
+        
+        names = apr_array_make(p, sk_GENERAL_NAME_num(xalt_names), sizeof(char *));
+        for (i = 0; i < sk_GENERAL_NAME_num(xalt_names); ++i) {
+            cval = sk_GENERAL_NAME_value(xalt_names, i);
+            switch (cval->type) {
+                case GEN_DNS:
+                case GEN_URI:
+                case GEN_IPADD:
+                    ASN1_STRING_to_UTF8(&buf, cval->d.ia5);
+                    APR_ARRAY_PUSH(names, const char *) = apr_pstrdup(p, (char*)buf);
+                    OPENSSL_free(buf);
+                    break;
+                default:
+                    break;
+            }
+        }
+        sk_GENERAL_NAME_pop_free(xalt_names, GENERAL_NAME_free);
+    }
+    return names;
+}
+
+static void cert_init_meta(md_cert_t *cert)
+{
+    const char *name;
+    char *lname;
+    int i;
+    
+    /* the certificate does not change, parse what we are asked for all the time only once */
+    cert->not_before = md_asn1_time_get(X509_get_notBefore(cert->x509));
+    cert->not_after = md_asn1_time_get(X509_get_notAfter(cert->x509));
+    cert->alt_names = x509_alt_names(cert->x509, cert->pool);
+    cert->alt_hash = apr_hash_make(cert->pool);
+    for (i = 0; cert->alt_names && i < cert->alt_names->nelts; ++i) {
+        name = APR_ARRAY_IDX(cert->alt_names, i, const char *);
+        lname = apr_pstrdup(cert->pool, name);
+        md_util_str_tolower(lname);
+        apr_hash_set(cert->alt_hash, lname, APR_HASH_KEY_STRING, name);
+    }
+}
+
 static md_cert_t *make_cert(apr_pool_t *p, X509 *x509) 
 {
     md_cert_t *cert = apr_pcalloc(p, sizeof(*cert));
     cert->pool = p;
     cert->x509 = x509;
     apr_pool_cleanup_register(p, cert, cert_cleanup, apr_pool_cleanup_null);
+    cert_init_meta(cert);
     
     return cert;
 }
@@ -715,6 +1151,63 @@ void *md_cert_get_X509(struct md_cert_t *cert)
     return cert->x509;
 }
 
+md_cert_t *md_cert_ref(md_cert_t *cert, apr_pool_t *p)
+{
+    md_cert_t *ref;
+    
+    X509_up_ref(cert->x509);
+    if (!apr_pool_is_ancestor(cert->pool, p)) {
+        return make_cert(p, cert->x509);
+    }
+    /* cert outlives the reference, its parsed data can be shared */
+    ref = apr_pcalloc(p, sizeof(*ref));
+    *ref = *cert;
+    ref->pool = p;
+    apr_pool_cleanup_register(p, ref, cert_cleanup, apr_pool_cleanup_null);
+    return ref;
+}
+
+static apr_status_t cert_from_der(md_cert_t **pcert, const unsigned char *der, long der_len,
+                                  apr_pool_t *p)
+{
+    X509 *x509;
+    
+    if (NULL == (x509 = d2i_X509(NULL, &der, der_len))) {
+        *pcert = NULL;
+        return APR_EINVAL;
+    }
+    *pcert = make_cert(p, x509);
+    return APR_SUCCESS;
+}
+
+static apr_status_t cert_shared_get(md_cert_t **pcert, const unsigned char *der, long der_len,
+                                    apr_pool_t *p)
+{
+    md_cert_t *cert;
+    const char *digest;
+    apr_status_t rv;
+    
+    if (!shared_certs) {
+        return cert_from_der(pcert, der, der_len, p);
+    }
+    if (APR_SUCCESS != (rv = md_crypt_sha256_digest_hex(&digest, p, (const char*)der, 
+                                                        (size_t)der_len))) {
+        return rv;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(shared_mutex);
+#endif
+    cert = apr_hash_get(shared_certs, digest, APR_HASH_KEY_STRING);
+    if (!cert && APR_SUCCESS == (rv = cert_from_der(&cert, der, der_len, shared_pool))) {
+        apr_hash_set(shared_certs, apr_pstrdup(shared_pool, digest), APR_HASH_KEY_STRING, cert);
+    }
+    *pcert = (APR_SUCCESS == rv)? md_cert_ref(cert, p) : NULL;
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(shared_mutex);
+#endif
+    return rv;
+}
+
 int md_cert_is_valid_now(const md_cert_t *cert)
 {
     return ((X509_cmp_current_time(X509_get_notBefore(cert->x509)) < 0)
@@ -728,39 +1221,63 @@ int md_cert_has_expired(const md_cert_t *cert)
 
 apr_time_t md_cert_get_not_after(md_cert_t *cert)
 {
-    return md_asn1_time_get(X509_get_notAfter(cert->x509));
+    return cert->not_after;
 }
 
 apr_time_t md_cert_get_not_before(md_cert_t *cert)
 {
-    return md_asn1_time_get(X509_get_notBefore(cert->x509));
+    return cert->not_before;
 }
 
-int md_cert_covers_domain(md_cert_t *cert, const char *domain_name)
+static int cert_has_alt_name(md_cert_t *cert, const char *prefix, const char *name)
 {
-    if (!cert->alt_names) {
-        md_cert_get_alt_names(&cert->alt_names, cert, cert->pool);
-    }
-    if (cert->alt_names) {
-        return md_array_str_index(cert->alt_names, domain_name, 0, 0) >= 0;
+    char lname[256];
+    apr_size_t plen = strlen(prefix), len = strlen(name);
+    int i;
+    
+    if (plen + len < sizeof(lname)) {
+        memcpy(lname, prefix, plen);
+        memcpy(lname + plen, name, len + 1);
+        md_util_str_tolower(lname);
+        return NULL != apr_hash_get(cert->alt_hash, lname, APR_HASH_KEY_STRING);
+    }
+    /* longer than any DNS name, look through all of them */
+    for (i = 0; cert->alt_names && i < cert->alt_names->nelts; ++i) {
+        const char *alt = APR_ARRAY_IDX(cert->alt_names, i, const char *);
+        if (strlen(alt) == plen + len 
+            && !apr_strnatcasecmp(alt + plen, name) && !strncmp(alt, prefix, plen)) {
+            return 1;
+        }
     }
     return 0;
 }
 
+static int cert_matches_domain(md_cert_t *cert, const char *domain)
+{
+    const char *s;
+    
+    if (cert_has_alt_name(cert, "", domain)) return 1;
+    /* same as md_dns_matches(): a wildcard covers names with one more label */
+    s = strchr(domain, '.');
+    return s && cert_has_alt_name(cert, "*", s);
+}
+
+int md_cert_covers_domain(md_cert_t *cert, const char *domain_name)
+{
+    return cert_has_alt_name(cert, "", domain_name);
+}
+
 int md_cert_covers_md(md_cert_t *cert, const md_t *md)
 {
     const char *name;
     int i;
     
-    if (!cert->alt_names) {
-        md_cert_get_alt_names(&cert->alt_names, cert, cert->pool);
-    }
     if (cert->alt_names) {
         md_log_perror(MD_LOG_MARK, MD_LOG_TRACE4, 0, cert->pool, "cert has %d alt names",
                       cert->alt_names->nelts); 
         for (i = 0; i < md->domains->nelts; ++i) {
             name = APR_ARRAY_IDX(md->domains, i, const char *);
-            if (!md_dns_domains_match(cert->alt_names, name)) {
+            if (!cert_matches_domain(cert, name)) {
                 md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, cert->pool, 
                               "md domain %s not covered by cert", name);
                 return 0;
@@ -801,52 +1318,106 @@ apr_status_t md_cert_get_issuers_uri(const char **puri, md_cert_t *cert, apr_poo
     return rv;
 }
 
-apr_status_t md_cert_get_alt_names(apr_array_header_t **pnames, md_cert_t *cert, apr_pool_t *p)
+apr_status_t md_cert_get_ocsp_responder_url(const char **purl, md_cert_t *cert, apr_pool_t *p)
 {
-    apr_array_header_t *names;
+    STACK_OF(OPENSSL_STRING) *ssk;
     apr_status_t rv = APR_ENOENT;
-    STACK_OF(GENERAL_NAME) *xalt_names;
-    unsigned char *buf;
-    int i;
-    
-    xalt_names = X509_get_ext_d2i(cert->x509, NID_subject_alt_name, NULL, NULL);
-    if (xalt_names) {
-        GENERAL_NAME *cval;
-        
-        names = apr_array_make(p, sk_GENERAL_NAME_num(xalt_names), sizeof(char *));
-        for (i = 0; i < sk_GENERAL_NAME_num(xalt_names); ++i) {
-            cval = sk_GENERAL_NAME_value(xalt_names, i);
-            switch (cval->type) {
-                case GEN_DNS:
-                case GEN_URI:
-                case GEN_IPADD:
-                    ASN1_STRING_to_UTF8(&buf, cval->d.ia5);
-                    APR_ARRAY_PUSH(names, const char *) = apr_pstrdup(p, (char*)buf);
-                    OPENSSL_free(buf);
-                    break;
-                default:
-                    break;
-            }
+    const char *url = NULL;
+
+    ssk = X509_get1_ocsp(cert->x509);
+    if (ssk) {
+        if (sk_OPENSSL_STRING_num(ssk) > 0) {
+            url = apr_pstrdup(p, sk_OPENSSL_STRING_value(ssk, 0));
+            rv = APR_SUCCESS;
         }
-        sk_GENERAL_NAME_pop_free(xalt_names, GENERAL_NAME_free);
+        X509_email_free(ssk);
+    }
+    *purl = url;
+    return rv;
+}
+
+apr_status_t md_cert_get_ari_id(const char **pid, md_cert_t *cert, apr_pool_t *p)
+{
+    AUTHORITY_KEYID *akid;
+    ASN1_INTEGER *serial;
+    unsigned char *der;
+    apr_size_t len;
+    const char *kid64, *serial64;
+    apr_status_t rv = APR_ENOENT;
+
+    *pid = NULL;
+    akid = X509_get_ext_d2i(cert->x509, NID_authority_key_identifier, NULL, NULL);
+    serial = X509_get_serialNumber(cert->x509);
+    if (akid && akid->keyid && akid->keyid->length > 0 && serial && serial->length > 0) {
+        /* the content octets of the DER encoded INTEGER, which has a leading
+         * zero when the top bit is set */
+        len = (apr_size_t)serial->length;
+        der = apr_pcalloc(p, len + 1);
+        if (serial->data[0] & 0x80) {
+            memcpy(der + 1, serial->data, len++);
+        }
+        else {
+            memcpy(der, serial->data, len);
+        }
+        kid64 = md_util_base64url_encode((const char*)akid->keyid->data, 
+                                         (apr_size_t)akid->keyid->length, p);
+        serial64 = md_util_base64url_encode((const char*)der, len, p);
+        if (kid64 && serial64) {
+            *pid = apr_pstrcat(p, kid64, ".", serial64, NULL);
+            rv = APR_SUCCESS;
+        }
+    }
+    if (akid) {
+        AUTHORITY_KEYID_free(akid);
+    }
+    return rv;
+}
+
+apr_status_t md_cert_get_serial_number(const char **pserial, md_cert_t *cert, apr_pool_t *p)
+{
+    ASN1_INTEGER *serial;
+    BIGNUM *bn = NULL;
+    char *hex = NULL;
+    apr_status_t rv = APR_ENOENT;
+
+    *pserial = NULL;
+    if ((serial = X509_get_serialNumber(cert->x509))
+        && (bn = ASN1_INTEGER_to_BN(serial, NULL))
+        && (hex = BN_bn2hex(bn))) {
+        *pserial = apr_pstrdup(p, hex);
         rv = APR_SUCCESS;
     }
-    *pnames = (APR_SUCCESS == rv)? names : NULL;
+    if (hex) OPENSSL_free(hex);
+    if (bn) BN_free(bn);
     return rv;
 }
 
+apr_status_t md_cert_get_alt_names(apr_array_header_t **pnames, md_cert_t *cert, apr_pool_t *p)
+{
+    if (!cert->alt_names) {
+        *pnames = NULL;
+        return APR_ENOENT;
+    }
+    *pnames = apr_pool_is_ancestor(cert->pool, p)? 
+        apr_array_copy(p, cert->alt_names) : x509_alt_names(cert->x509, p);
+    return APR_SUCCESS;
+}
+
 apr_status_t md_cert_fload(md_cert_t **pcert, apr_pool_t *p, const char *fname)
 {
-    FILE *f;
     apr_status_t rv;
-    md_cert_t *cert;
+    apr_pool_t *ptemp;
+    md_cert_t *cert = NULL;
     X509 *x509;
+    BIO *bf;
     
-    rv = md_util_fopen(&f, fname, "r");
-    if (rv == APR_SUCCESS) {
-    
-        x509 = PEM_read_X509(f, NULL, NULL, NULL);
-        rv = fclose(f);
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, p))) {
+        *pcert = NULL;
+        return rv;
+    }
+    if (APR_SUCCESS == (rv = fload_bio(&bf, NULL, NULL, ptemp, fname))) {
+        x509 = PEM_read_bio_X509(bf, NULL, NULL, NULL);
+        BIO_free(bf);
         if (x509 != NULL) {
             cert =  make_cert(p, x509);
         }
@@ -854,6 +1425,7 @@ apr_status_t md_cert_fload(md_cert_t **pcert, apr_pool_t *p, const char *fname)
             rv = APR_EINVAL;
         }
     }
+    apr_pool_destroy(ptemp);
 
     *pcert = (APR_SUCCESS == rv)? cert : NULL;
     return rv;
@@ -898,6 +1470,20 @@ apr_status_t md_cert_fsave(md_cert_t *cert, apr_pool_t *p,
     return rv;
 }
 
+apr_status_t md_cert_to_pem(const char **ppem, apr_size_t *plen, 
+                            md_cert_t *cert, apr_pool_t *p)
+{
+    buffer_rec buffer;
+    apr_status_t rv;
+    
+    buffer.data = NULL;
+    buffer.len = 0;
+    rv = cert_to_buffer(&buffer, cert, p);
+    *ppem = (APR_SUCCESS == rv)? buffer.data : NULL;
+    *plen = (APR_SUCCESS == rv)? buffer.len : 0;
+    return rv;
+}
+
 apr_status_t md_cert_to_base64url(const char **ps64, md_cert_t *cert, apr_pool_t *p)
 {
     buffer_rec buffer;
@@ -911,6 +1497,25 @@ apr_status_t md_cert_to_base64url(const char **ps64, md_cert_t *cert, apr_pool_t
     return rv;
 }
 
+apr_status_t md_cert_from_base64url(md_cert_t **pcert, const char *s64, apr_pool_t *p)
+{
+    const char *der;
+    const unsigned char *s;
+    apr_size_t len;
+    X509 *x509;
+    
+    *pcert = NULL;
+    if (0 == (len = md_util_base64url_decode(&der, s64, p))) {
+        return APR_EINVAL;
+    }
+    s = (const unsigned char*)der;
+    if (NULL == (x509 = d2i_X509(NULL, &s, (long)len))) {
+        return APR_EINVAL;
+    }
+    *pcert = make_cert(p, x509);
+    return APR_SUCCESS;
+}
+
 static int md_cert_read_pem(BIO *bf, apr_pool_t *p, md_cert_t **pcert)
 {
     md_cert_t *cert;
@@ -1041,20 +1646,40 @@ md_cert_state_t md_cert_state_get(md_cert_t *cert)
 
 apr_status_t md_chain_fappend(struct apr_array_header_t *certs, apr_pool_t *p, const char *fname)
 {
-    FILE *f;
+    apr_pool_t *ptemp;
+    BIO *bio;
     apr_status_t rv;
-    X509 *x509;
     md_cert_t *cert;
+    char *name, *header;
+    unsigned char *der;
+    long der_len;
+    apr_size_t flen;
     unsigned long err;
     
-    rv = md_util_fopen(&f, fname, "r");
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, p))) {
+        return rv;
+    }
+    rv = fload_bio(&bio, NULL, &flen, ptemp, fname);
     if (rv == APR_SUCCESS) {
         ERR_clear_error();
-        while (NULL != (x509 = PEM_read_X509(f, NULL, NULL, NULL))) {
-            cert = make_cert(p, x509);
-            APR_ARRAY_PUSH(certs, md_cert_t *) = cert;
+        while (APR_SUCCESS == rv && PEM_read_bio(bio, &name, &header, &der, &der_len)) {
+            if (!strcmp(PEM_STRING_X509, name) || !strcmp(PEM_STRING_X509_OLD, name)) {
+                /* the first is the MD's own certificate, all others are intermediates */
+                rv = (certs->nelts > 0)? cert_shared_get(&cert, der, der_len, p) 
+                                       : cert_from_der(&cert, der, der_len, p);
+                if (APR_SUCCESS == rv) {
+                    APR_ARRAY_PUSH(certs, md_cert_t *) = cert;
+                }
+            }
+            OPENSSL_free(name);
+            OPENSSL_free(header);
+            OPENSSL_free(der);
+        }
+        BIO_free(bio);
+        if (APR_SUCCESS != rv) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "invalid certificate in %s", fname);
+            goto out;
         }
-        fclose(f);
         
         if (0 < (err =  ERR_get_error())
             && !(ERR_GET_LIB(err) == ERR_LIB_PEM && ERR_GET_REASON(err) == PEM_R_NO_START_LINE)) {
@@ -1067,8 +1692,7 @@ apr_status_t md_chain_fappend(struct apr_array_header_t *certs, apr_pool_t *p, c
             /* Did not find any. This is acceptable unless the file has a certain size
              * when we no longer accept it as empty chain file. Something seems to be
              * wrong then. */
-            apr_finfo_t info;
-            if (APR_SUCCESS == apr_stat(&info, fname, APR_FINFO_SIZE, p) && info.size >= 1024) {
+            if (flen >= 1024) {
                 /* "Too big for a moon." */
                 rv = APR_EINVAL;
                 md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, 
@@ -1078,6 +1702,7 @@ apr_status_t md_chain_fappend(struct apr_array_header_t *certs, apr_pool_t *p, c
         }        
     }
 out:
+    apr_pool_destroy(ptemp);
     md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, rv, p, "read chain file %s, found %d certs", 
                   fname, certs? certs->nelts : 0);
     return rv;
@@ -1094,36 +1719,62 @@ apr_status_t md_chain_fload(apr_array_header_t **pcerts, apr_pool_t *p, const ch
     return rv;
 }
 
-apr_status_t md_chain_fsave(apr_array_header_t *certs, apr_pool_t *p, 
-                            const char *fname, apr_fileperms_t perms)
+static apr_status_t chain_to_buffer(buffer_rec *buffer, apr_array_header_t *certs, 
+                                    apr_pool_t *p)
 {
-    FILE *f;
-    apr_status_t rv;
+    BIO *bio = BIO_new(BIO_s_mem());
     const md_cert_t *cert;
-    unsigned long err = 0;
     int i;
     
-    (void)p;
-    rv = md_util_fopen(&f, fname, "w");
-    if (rv == APR_SUCCESS) {
-        apr_file_perms_set(fname, perms);
-        ERR_clear_error();
-        for (i = 0; i < certs->nelts; ++i) {
-            cert = APR_ARRAY_IDX(certs, i, const md_cert_t *);
-            assert(cert->x509);
-            
-            PEM_write_X509(f, cert->x509);
-            
-            if (0 < (err = ERR_get_error())) {
-                break;
-            }
-            
-        }
-        rv = fclose(f);
-        if (err) {
-            rv = APR_EINVAL;
+    if (!bio) {
+        return APR_ENOMEM;
+    }
+
+    ERR_clear_error();
+    for (i = 0; i < certs->nelts; ++i) {
+        cert = APR_ARRAY_IDX(certs, i, const md_cert_t *);
+        assert(cert->x509);
+        PEM_write_bio_X509(bio, cert->x509);
+        if (ERR_get_error() > 0) {
+            BIO_free(bio);
+            return APR_EINVAL;
         }
     }
+
+    buffer->data = apr_pcalloc(p, 1);
+    buffer->len = 0;
+    i = BIO_pending(bio);
+    if (i > 0) {
+        buffer->data = apr_palloc(p, (apr_size_t)i + 1);
+        i = BIO_read(bio, buffer->data, i);
+        buffer->data[i] = '\0';
+        buffer->len = (apr_size_t)i;
+    }
+    BIO_free(bio);
+    return APR_SUCCESS;
+}
+
+apr_status_t md_chain_to_pem(const char **ppem, apr_size_t *plen, 
+                             apr_array_header_t *certs, apr_pool_t *p)
+{
+    buffer_rec buffer;
+    apr_status_t rv;
+    
+    rv = chain_to_buffer(&buffer, certs, p);
+    *ppem = (APR_SUCCESS == rv)? buffer.data : NULL;
+    *plen = (APR_SUCCESS == rv)? buffer.len : 0;
+    return rv;
+}
+
+apr_status_t md_chain_fsave(apr_array_header_t *certs, apr_pool_t *p, 
+                            const char *fname, apr_fileperms_t perms)
+{
+    buffer_rec buffer;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS == (rv = chain_to_buffer(&buffer, certs, p))) {
+        rv = md_util_freplace(fname, perms, p, fwrite_buffer, &buffer); 
+    }
     return rv;
 }
 
@@ -1313,6 +1964,26 @@ out:
     return rv;
 }
 
+int md_cert_req_is_for(const char *csr_der_64, md_pkey_t *pkey, apr_pool_t *p)
+{
+    const char *der;
+    const unsigned char *s;
+    X509_REQ *csr;
+    apr_size_t len;
+    int ok = 0;
+    
+    if (0 == (len = md_util_base64url_decode(&der, csr_der_64, p))) {
+        return 0;
+    }
+    s = (const unsigned char*)der;
+    if (NULL != (csr = d2i_X509_REQ(NULL, &s, (long)len))) {
+        /* the signature only verifies with the key the CSR is for */
+        ok = (X509_REQ_verify(csr, pkey->pkey) == 1);
+        X509_REQ_free(csr);
+    }
+    return ok;
+}
+
 static apr_status_t mk_x509(X509 **px, md_pkey_t *pkey, const char *cn,
                             apr_interval_time_t valid_for, apr_pool_t *p)
 {
@@ -24,6 +24,7 @@ struct md_t;
 struct md_http_response_t;
 struct md_cert_t;
 struct md_pkey_t;
+struct asn1_string_st;
 
 /**************************************************************************************************/
 /* random */
@@ -45,43 +46,98 @@ typedef struct md_pkey_t md_pkey_t;
 typedef enum {
     MD_PKEY_TYPE_DEFAULT,
     MD_PKEY_TYPE_RSA,
+    MD_PKEY_TYPE_EC,
 } md_pkey_type_t;
 
 typedef struct md_pkey_rsa_spec_t {
     apr_uint32_t bits;
 } md_pkey_rsa_spec_t;
 
+typedef struct md_pkey_ec_spec_t {
+    const char *curve;  /* JWA name of the curve, "P-256" or "P-384" (static string) */
+} md_pkey_ec_spec_t;
+
 typedef struct md_pkey_spec_t {
     md_pkey_type_t type;
     union {
         md_pkey_rsa_spec_t rsa;
+        md_pkey_ec_spec_t ec;
     } params;
 } md_pkey_spec_t;
 
 apr_status_t md_crypt_init(apr_pool_t *pool);
 
+/**
+ * Return != 0 if keys and certificates may be used from several threads without
+ * the locking callbacks older OpenSSL versions need the application to install.
+ */
+int md_crypt_is_threadsafe(void);
+
 apr_status_t md_pkey_gen(md_pkey_t **ppkey, apr_pool_t *p, md_pkey_spec_t *spec);
 void md_pkey_free(md_pkey_t *pkey);
 
 const char *md_pkey_get_rsa_e64(md_pkey_t *pkey, apr_pool_t *p);
 const char *md_pkey_get_rsa_n64(md_pkey_t *pkey, apr_pool_t *p);
 
+/**
+ * Get the JWA name of the curve of an EC key, e.g. "P-256", or NULL if the key is
+ * not an EC key on a supported curve.
+ */
+const char *md_pkey_get_ec_curve(md_pkey_t *pkey);
+const char *md_pkey_get_ec_x64(md_pkey_t *pkey, apr_pool_t *p);
+const char *md_pkey_get_ec_y64(md_pkey_t *pkey, apr_pool_t *p);
+
+/**
+ * Get the public key as JWK in the canonical form of RFC 7638, or its base64url
+ * encoded SHA-256 thumbprint. Both are computed once and live as long as the key,
+ * refs made in sub pools of the key's pool share them. NULL if the key has no
+ * JWK representation.
+ */
+const char *md_pkey_get_jwk(md_pkey_t *pkey);
+const char *md_pkey_get_jwk_thumb(md_pkey_t *pkey);
+
+/**
+ * Get the canonical JWA name of a curve given by JWA or OpenSSL name, e.g. "P-256"
+ * for "prime256v1". Returns NULL for unsupported curves.
+ */
+const char *md_pkey_ec_curve_name(const char *curve);
+
 apr_status_t md_pkey_fload(md_pkey_t **ppkey, apr_pool_t *p, 
                            const char *pass_phrase, apr_size_t pass_len,
                            const char *fname);
 apr_status_t md_pkey_fsave(md_pkey_t *pkey, apr_pool_t *p, 
                            const char *pass_phrase, apr_size_t pass_len, 
                            const char *fname, apr_fileperms_t perms);
+/* The PEM text md_pkey_fsave() would write, allocated from p. */
+apr_status_t md_pkey_to_pem(const char **ppem, apr_size_t *plen, md_pkey_t *pkey, 
+                            apr_pool_t *p, const char *pass_phrase, apr_size_t pass_len);
 
+/**
+ * Sign data with the key as needed for JWS and return the base64url encoded signature.
+ * RSA keys sign with SHA-256 (RS256). EC keys sign with the digest matching their
+ * curve (ES256/ES384) and produce the fixed length R || S form of the signature.
+ */
 apr_status_t md_crypt_sign64(const char **psign64, md_pkey_t *pkey, apr_pool_t *p, 
                              const char *d, size_t dlen);
 
 void *md_cert_get_X509(struct md_cert_t *cert);
 void *md_pkey_get_EVP_PKEY(struct md_pkey_t *pkey);
 
+/**
+ * Get another reference to the same key/certificate that lives as long as pool p,
+ * independant of the lifetime of the original.
+ */
+struct md_pkey_t *md_pkey_ref(struct md_pkey_t *pkey, apr_pool_t *p);
+struct md_cert_t *md_cert_ref(struct md_cert_t *cert, apr_pool_t *p);
+
 struct md_json_t *md_pkey_spec_to_json(const md_pkey_spec_t *spec, apr_pool_t *p);
 md_pkey_spec_t *md_pkey_spec_from_json(struct md_json_t *json, apr_pool_t *p);
 int md_pkey_spec_eq(md_pkey_spec_t *spec1, md_pkey_spec_t *spec2);
+/* Compare two arrays of md_pkey_spec_t*, NULL counts as empty. */
+int md_pkey_specs_eq(struct apr_array_header_t *specs1, struct apr_array_header_t *specs2);
+
+/* Get the apr time from an ASN1_TIME, as used in certificates and OCSP responses. */
+apr_time_t md_asn1_time_get(const struct asn1_string_st *time);
 
 /**************************************************************************************************/
 /* X509 certificates */
@@ -127,15 +183,28 @@ apr_time_t md_cert_get_not_after(md_cert_t *cert);
 apr_time_t md_cert_get_not_before(md_cert_t *cert);
 
 apr_status_t md_cert_get_issuers_uri(const char **puri, md_cert_t *cert, apr_pool_t *p);
+/* Get the url of the first OCSP responder in the certificate's authority info access. */
+apr_status_t md_cert_get_ocsp_responder_url(const char **purl, md_cert_t *cert, apr_pool_t *p);
+/* Get the identifier of the certificate in ACME renewal information (RFC 9773): the
+ * base64url encoded authority key identifier and serial number, joined by a '.'. */
+apr_status_t md_cert_get_ari_id(const char **pid, md_cert_t *cert, apr_pool_t *p);
+/* Get the serial number of the certificate in upper case hex. */
+apr_status_t md_cert_get_serial_number(const char **pserial, md_cert_t *cert, apr_pool_t *p);
 apr_status_t md_cert_get_alt_names(apr_array_header_t **pnames, md_cert_t *cert, apr_pool_t *p);
 
 apr_status_t md_cert_to_base64url(const char **ps64, md_cert_t *cert, apr_pool_t *p);
+/* The PEM text md_cert_fsave() would write, allocated from p. */
+apr_status_t md_cert_to_pem(const char **ppem, apr_size_t *plen, 
+                            md_cert_t *cert, apr_pool_t *p);
 apr_status_t md_cert_from_base64url(md_cert_t **pcert, const char *s64, apr_pool_t *p);
 
 apr_status_t md_chain_fload(struct apr_array_header_t **pcerts, 
                             apr_pool_t *p, const char *fname);
 apr_status_t md_chain_fsave(struct apr_array_header_t *certs, 
                             apr_pool_t *p, const char *fname, apr_fileperms_t perms);
+/* The PEM text md_chain_fsave() would write, allocated from p. */
+apr_status_t md_chain_to_pem(const char **ppem, apr_size_t *plen, 
+                             struct apr_array_header_t *certs, apr_pool_t *p);
 apr_status_t md_chain_fappend(struct apr_array_header_t *certs, 
                               apr_pool_t *p, const char *fname);
 
@@ -143,6 +212,9 @@ apr_status_t md_cert_req_create(const char **pcsr_der_64, const char *name,
                                 apr_array_header_t *domains, int must_staple, 
                                 md_pkey_t *pkey, apr_pool_t *p);
 
+/* Return != 0 iff the base64url encoded CSR is signed by pkey. */
+int md_cert_req_is_for(const char *csr_der_64, md_pkey_t *pkey, apr_pool_t *p);
+
 /**
  * Create a self-signed cerftificate with the given cn, key and list
  * of alternate domain names.
@@ -15,15 +15,19 @@
  */
  
 #include <assert.h>
+#include <stdlib.h>
 
 #include <curl/curl.h>
 
 #include <apr_lib.h>
 #include <apr_strings.h>
 #include <apr_buckets.h>
+#include <apr_thread_mutex.h>
+#include <apr_time.h>
 
 #include "md_http.h"
 #include "md_log.h"
+#include "md_trace.h"
 #include "md_curl.h"
 
 /**************************************************************************************************/
@@ -90,29 +94,6 @@ static size_t req_data_cb(void *data, size_t len, size_t nmemb, void *baton)
     return read_len;
 }
 
-static size_t resp_data_cb(void *data, size_t len, size_t nmemb, void *baton)
-{
-    md_http_response_t *res = baton;
-    size_t blen = len * nmemb;
-    apr_status_t rv;
-    
-    if (res->body) {
-        if (res->req->resp_limit) {
-            apr_off_t body_len = 0;
-            apr_brigade_length(res->body, 0, &body_len);
-            if (body_len + (apr_off_t)len > res->req->resp_limit) {
-                return 0; /* signal curl failure */
-            }
-        }
-        rv = apr_brigade_write(res->body, NULL, NULL, (const char *)data, blen);
-        if (rv != APR_SUCCESS) {
-            /* returning anything != blen will make CURL fail this */
-            return 0;
-        }
-    }
-    return blen;
-}
-
 static size_t header_cb(void *buffer, size_t elen, size_t nmemb, void *baton)
 {
     md_http_response_t *res = baton;
@@ -142,24 +123,6 @@ static size_t header_cb(void *buffer, size_t elen, size_t nmemb, void *baton)
     return clen;
 }
 
-static apr_status_t curl_init(md_http_request_t *req)
-{
-    CURL *curl = curl_easy_init();
-    if (!curl) {
-        return APR_EGENERAL;
-    }
-    
-    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_cb);
-    curl_easy_setopt(curl, CURLOPT_HEADERDATA, NULL);
-    curl_easy_setopt(curl, CURLOPT_READFUNCTION, req_data_cb);
-    curl_easy_setopt(curl, CURLOPT_READDATA, NULL);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, resp_data_cb);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
-    
-    req->internals = curl;
-    return APR_SUCCESS;
-}
-
 typedef struct {
     md_http_request_t *req;
     struct curl_slist *hdrs;
@@ -181,24 +144,117 @@ static int curlify_headers(void *baton, const char *key, const char *value)
     return 1;
 }
 
-static apr_status_t curl_perform(md_http_request_t *req)
+/* connection independent data (DNS, TLS sessions) shared by all requests */
+static CURLSH *curl_share;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *share_mutexes[CURL_LOCK_DATA_LAST];
+#endif
+
+typedef struct md_curl_internals_t md_curl_internals_t;
+struct md_curl_internals_t {
+    md_http_request_t *req;
+    CURL *curl;
+    struct curl_slist *req_hdrs;
+    md_http_response_t *response;
+    char *resp_data;                 /* response body, collected in one buffer */
+    apr_size_t resp_len;
+    apr_size_t resp_size;
+    apr_time_t start;                /* when tracing, the time the request was set up */
+    md_curl_internals_t *next;       /* in list of requests submitted to a multi handle */
+};
+
+#define RESP_DATA_MIN       4096
+#define RESP_DATA_PREALLOC  (1024 * 1024)
+
+/* Make room for len more bytes of response body. The buffer is sized from the 
+ * Content-Length, when the server announced it, and only grows otherwise. Not
+ * more than RESP_DATA_PREALLOC is allocated on the server's word, beyond that
+ * the buffer grows with the data that actually arrives. */
+static apr_status_t resp_data_grow(md_curl_internals_t *internals, apr_size_t len)
 {
-    apr_status_t rv = APR_SUCCESS;
-    CURLcode curle;
+    md_http_request_t *req = internals->req;
+    const char *s;
+    apr_off_t clen;
+    apr_size_t nsize;
+    char *ndata, *end;
+    
+    if (req->resp_limit && (apr_off_t)(internals->resp_len + len) > req->resp_limit) {
+        return APR_ENOSPC;
+    }
+    if (internals->resp_len + len <= internals->resp_size) {
+        return APR_SUCCESS;
+    }
+    nsize = internals->resp_size? 2 * internals->resp_size : RESP_DATA_MIN;
+    if (!internals->resp_data && (s = apr_table_get(internals->response->headers, 
+                                                    "Content-Length"))
+        && APR_SUCCESS == apr_strtoff(&clen, s, &end, 10) && clen > 0) {
+        nsize = (clen > RESP_DATA_PREALLOC)? RESP_DATA_PREALLOC : (apr_size_t)clen;
+    }
+    if (nsize < internals->resp_len + len) {
+        nsize = internals->resp_len + len;
+    }
+    if (req->resp_limit && (apr_off_t)nsize > req->resp_limit) {
+        nsize = (apr_size_t)req->resp_limit;
+    }
+    ndata = apr_palloc(req->pool, nsize);
+    if (internals->resp_len) {
+        memcpy(ndata, internals->resp_data, internals->resp_len);
+    }
+    internals->resp_data = ndata;
+    internals->resp_size = nsize;
+    return APR_SUCCESS;
+}
+
+static size_t resp_data_cb(void *data, size_t len, size_t nmemb, void *baton)
+{
+    md_curl_internals_t *internals = baton;
+    size_t blen = len * nmemb;
+    
+    if (internals->response->body && blen > 0) {
+        if (APR_SUCCESS != resp_data_grow(internals, blen)) {
+            return 0; /* signal curl failure */
+        }
+        memcpy(internals->resp_data + internals->resp_len, data, blen);
+        internals->resp_len += blen;
+    }
+    return blen;
+}
+
+static apr_status_t internals_setup(md_http_request_t *req)
+{
+    md_curl_internals_t *internals;
     md_http_response_t *res;
     CURL *curl;
-    struct curl_slist *req_hdrs = NULL;
 
-    if (APR_SUCCESS != (rv = curl_init(req))) return rv;
-    curl = req->internals;
+    curl = curl_easy_init();
+    if (!curl) {
+        return APR_EGENERAL;
+    }
+    internals = apr_pcalloc(req->pool, sizeof(*internals));
+    internals->req = req;
+    internals->curl = curl;
+    if (md_trace_on()) {
+        internals->start = apr_time_now();
+    }
+    req->internals = internals;
     
     res = apr_pcalloc(req->pool, sizeof(*res));
-    
     res->req = req;
     res->rv = APR_SUCCESS;
     res->status = 400;
     res->headers = apr_table_make(req->pool, 5);
     res->body = apr_brigade_create(req->pool, req->bucket_alloc);
+    internals->response = res;
+    
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_cb);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, res);
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION, req_data_cb);
+    curl_easy_setopt(curl, CURLOPT_READDATA, req->body);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, resp_data_cb);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, internals);
+    if (curl_share) {
+        curl_easy_setopt(curl, CURLOPT_SHARE, curl_share);
+    }
     
     curl_easy_setopt(curl, CURLOPT_URL, req->url);
     if (!apr_strnatcasecmp("GET", req->method)) {
@@ -213,9 +269,6 @@ static apr_status_t curl_perform(md_http_request_t *req)
     else {
         curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, req->method);
     }
-    curl_easy_setopt(curl, CURLOPT_HEADERDATA, res);
-    curl_easy_setopt(curl, CURLOPT_READDATA, req->body);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, res);
     
     if (req->user_agent) {
         curl_easy_setopt(curl, CURLOPT_USERAGENT, req->user_agent);
@@ -230,25 +283,35 @@ static apr_status_t curl_perform(md_http_request_t *req)
         ctx.hdrs = NULL;
         ctx.rv = APR_SUCCESS;
         apr_table_do(curlify_headers, &ctx, req->headers, NULL);
-        req_hdrs = ctx.hdrs;
+        internals->req_hdrs = ctx.hdrs;
         if (ctx.rv == APR_SUCCESS) {
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req_hdrs);
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, internals->req_hdrs);
         }
     }
     
-    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, req->pool, 
-                  "request --> %s %s", req->method, req->url);
-    
     if (md_log_is_level(req->pool, MD_LOG_TRACE3)) {
         curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
     }
+    return APR_SUCCESS;
+}
+
+static apr_status_t req_done(md_http_request_t *req, CURLcode curle)
+{
+    md_curl_internals_t *internals = req->internals;
+    md_http_response_t *res = internals->response;
+    char what[128];
     
-    curle = curl_easy_perform(curl);
+    if (res->body && internals->resp_len > 0) {
+        /* hand out the body as is, a single bucket that readers can parse in place */
+        APR_BRIGADE_INSERT_TAIL(res->body, apr_bucket_pool_create(internals->resp_data, 
+                                internals->resp_len, req->pool, req->bucket_alloc));
+        internals->resp_data = NULL;
+        internals->resp_len = internals->resp_size = 0;
+    }
     res->rv = curl_status(curle);
-    
     if (APR_SUCCESS == res->rv) {
         long l;
-        res->rv = curl_status(curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &l));
+        res->rv = curl_status(curl_easy_getinfo(internals->curl, CURLINFO_RESPONSE_CODE, &l));
         if (APR_SUCCESS == res->rv) {
             res->status = (int)l;
         }
@@ -261,16 +324,37 @@ static apr_status_t curl_perform(md_http_request_t *req)
                       curl_easy_strerror(curle));
     }
     
+    if (internals->start) {
+        apr_snprintf(what, sizeof(what), "%s %s", req->method, req->url);
+        md_trace_add(MD_TRACE_HTTP, md_http_get_trace_name(req->http), what, 
+                     (APR_SUCCESS == res->rv)? res->status : 0, internals->start, 
+                     apr_time_now());
+    }
+    
     if (req->cb) {
         res->rv = req->cb(res);
     }
-    
-    rv = res->rv;
-    md_http_req_destroy(req);
-    if (req_hdrs) {
-        curl_slist_free_all(req_hdrs);
+    return res->rv;
+}
+
+static apr_status_t curl_perform(md_http_request_t *req)
+{
+    md_curl_internals_t *internals;
+    CURLcode curle;
+    apr_status_t rv;
+
+    if (APR_SUCCESS != (rv = internals_setup(req))) {
+        md_http_req_destroy(req);
+        return rv;
     }
+    internals = req->internals;
     
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, req->pool, 
+                  "request --> %s %s", req->method, req->url);
+    
+    curle = curl_easy_perform(internals->curl);
+    rv = req_done(req, curle);
+    md_http_req_destroy(req);
     return rv;
 }
 
@@ -286,8 +370,17 @@ static apr_status_t md_curl_init(void) {
 
 static void curl_req_cleanup(md_http_request_t *req) 
 {
-    if (req->internals) {
-        curl_easy_cleanup(req->internals);
+    md_curl_internals_t *internals = req->internals;
+    
+    if (internals) {
+        if (internals->curl) {
+            curl_easy_cleanup(internals->curl);
+            internals->curl = NULL;
+        }
+        if (internals->req_hdrs) {
+            curl_slist_free_all(internals->req_hdrs);
+            internals->req_hdrs = NULL;
+        }
         req->internals = NULL;
     }
 }
@@ -295,7 +388,10 @@ static void curl_req_cleanup(md_http_request_t *req)
 static md_http_impl_t impl = {
     md_curl_init,
     curl_req_cleanup,
-    curl_perform
+    curl_perform,
+    NULL,
+    NULL,
+    NULL,
 };
 
 md_http_impl_t * md_curl_get_impl(apr_pool_t *p)
@@ -305,3 +401,250 @@ md_http_impl_t * md_curl_get_impl(apr_pool_t *p)
     md_curl_init();
     return &impl;
 }
+
+/**************************************************************************************************/
+/* md_http curl_multi implementation */
+
+/* One multi handle per md_http_t instance. It keeps the connections to the server
+ * open between requests and lets several of them run at the same time, multiplexed
+ * on a single HTTP/2 connection when the server supports it. */
+typedef struct {
+    CURLM *multi;
+    md_curl_internals_t *submitted;
+    int pending;
+} md_curl_multi_t;
+
+static md_curl_multi_t *multi_get(md_http_t *http)
+{
+    md_curl_multi_t *m = md_http_get_impl_data(http);
+    
+    if (!m) {
+        m = calloc(1, sizeof(*m));
+        if (!m) {
+            return NULL;
+        }
+        m->multi = curl_multi_init();
+        if (!m->multi) {
+            free(m);
+            return NULL;
+        }
+#ifdef CURLPIPE_MULTIPLEX
+        curl_multi_setopt(m->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+        md_http_set_impl_data(http, m);
+    }
+    return m;
+}
+
+static void multi_unlink(md_curl_multi_t *m, md_curl_internals_t *internals)
+{
+    md_curl_internals_t **pnext;
+    
+    for (pnext = &m->submitted; *pnext; pnext = &(*pnext)->next) {
+        if (*pnext == internals) {
+            *pnext = internals->next;
+            internals->next = NULL;
+            --m->pending;
+            break;
+        }
+    }
+    curl_multi_remove_handle(m->multi, internals->curl);
+}
+
+static void multi_abort_all(md_curl_multi_t *m)
+{
+    md_curl_internals_t *internals;
+    
+    while (m->submitted) {
+        internals = m->submitted;
+        multi_unlink(m, internals);
+        md_http_req_destroy(internals->req);
+    }
+}
+
+static apr_status_t multi_submit(md_http_request_t *req)
+{
+    md_curl_internals_t *internals;
+    md_curl_multi_t *m;
+    apr_status_t rv;
+    
+    if (!(m = multi_get(req->http))) {
+        md_http_req_destroy(req);
+        return APR_ENOMEM;
+    }
+    if (APR_SUCCESS != (rv = internals_setup(req))) {
+        md_http_req_destroy(req);
+        return rv;
+    }
+    internals = req->internals;
+    curl_easy_setopt(internals->curl, CURLOPT_PRIVATE, (char *)req);
+#if LIBCURL_VERSION_NUM >= 0x072f00
+    curl_easy_setopt(internals->curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072b00
+    /* rather wait for an existing connection to allow multiplexing than open a new one */
+    curl_easy_setopt(internals->curl, CURLOPT_PIPEWAIT, 1L);
+#endif
+    
+    if (CURLM_OK != curl_multi_add_handle(m->multi, internals->curl)) {
+        md_http_req_destroy(req);
+        return APR_EGENERAL;
+    }
+    internals->next = m->submitted;
+    m->submitted = internals;
+    ++m->pending;
+    
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, req->pool, 
+                  "request --> %s %s", req->method, req->url);
+    return APR_SUCCESS;
+}
+
+static apr_status_t multi_await(md_http_t *http)
+{
+    md_curl_multi_t *m = md_http_get_impl_data(http);
+    md_http_request_t *req;
+    CURLMsg *msg;
+    CURLMcode mc;
+    char *pdata;
+    apr_status_t rv = APR_SUCCESS, rv2;
+    int running, left;
+    
+    if (!m) {
+        return APR_SUCCESS;
+    }
+    
+    while (m->pending > 0) {
+        mc = curl_multi_perform(m->multi, &running);
+        if (CURLM_OK != mc) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, 0, m->submitted->req->pool, 
+                          "curl multi perform failed(%d): %s", mc, curl_multi_strerror(mc));
+            multi_abort_all(m);
+            return APR_EGENERAL;
+        }
+        
+        while ((msg = curl_multi_info_read(m->multi, &left))) {
+            if (CURLMSG_DONE == msg->msg) {
+                pdata = NULL;
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &pdata);
+                req = (md_http_request_t *)(void *)pdata;
+                multi_unlink(m, req->internals);
+                
+                /* the callback may submit further requests, which we then also await */
+                rv2 = req_done(req, msg->data.result);
+                if (APR_SUCCESS == rv) {
+                    rv = rv2;
+                }
+                md_http_req_destroy(req);
+            }
+        }
+        
+        if (m->pending > 0) {
+#if LIBCURL_VERSION_NUM >= 0x071c00
+            curl_multi_wait(m->multi, NULL, 0, 1000, NULL);
+#else
+            apr_sleep(apr_time_from_msec(10));
+#endif
+        }
+    }
+    return rv;
+}
+
+static apr_status_t multi_perform(md_http_request_t *req)
+{
+    md_http_t *http = req->http;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS == (rv = multi_submit(req))) {
+        rv = multi_await(http);
+    }
+    return rv;
+}
+
+static void multi_cleanup(md_http_t *http)
+{
+    md_curl_multi_t *m = md_http_get_impl_data(http);
+    
+    if (m) {
+        multi_abort_all(m);
+        curl_multi_cleanup(m->multi);
+        free(m);
+        md_http_set_impl_data(http, NULL);
+    }
+}
+
+#if APR_HAS_THREADS
+static void share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+    (void)handle;
+    (void)access;
+    (void)userptr;
+    if (data < CURL_LOCK_DATA_LAST && share_mutexes[data]) {
+        apr_thread_mutex_lock(share_mutexes[data]);
+    }
+}
+
+static void share_unlock(CURL *handle, curl_lock_data data, void *userptr)
+{
+    (void)handle;
+    (void)userptr;
+    if (data < CURL_LOCK_DATA_LAST && share_mutexes[data]) {
+        apr_thread_mutex_unlock(share_mutexes[data]);
+    }
+}
+#endif
+
+static apr_status_t share_cleanup(void *data)
+{
+    (void)data;
+    if (curl_share) {
+        curl_share_cleanup(curl_share);
+        curl_share = NULL;
+    }
+#if APR_HAS_THREADS
+    memset(share_mutexes, 0, sizeof(share_mutexes));
+#endif
+    return APR_SUCCESS;
+}
+
+static void share_init(apr_pool_t *p)
+{
+    CURLSH *share;
+    
+    if (curl_share || !(share = curl_share_init())) {
+        return;
+    }
+#if APR_HAS_THREADS
+    if (APR_SUCCESS != apr_thread_mutex_create(&share_mutexes[CURL_LOCK_DATA_SHARE], 
+                                               APR_THREAD_MUTEX_DEFAULT, p)
+        || APR_SUCCESS != apr_thread_mutex_create(&share_mutexes[CURL_LOCK_DATA_DNS], 
+                                                  APR_THREAD_MUTEX_DEFAULT, p)
+        || APR_SUCCESS != apr_thread_mutex_create(&share_mutexes[CURL_LOCK_DATA_SSL_SESSION], 
+                                                  APR_THREAD_MUTEX_DEFAULT, p)) {
+        curl_share_cleanup(share);
+        memset(share_mutexes, 0, sizeof(share_mutexes));
+        return;
+    }
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+#endif
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share = share;
+    apr_pool_cleanup_register(p, NULL, share_cleanup, apr_pool_cleanup_null);
+}
+
+static md_http_impl_t multi_impl = {
+    md_curl_init,
+    curl_req_cleanup,
+    multi_perform,
+    multi_submit,
+    multi_await,
+    multi_cleanup,
+};
+
+md_http_impl_t * md_curl_get_multi_impl(apr_pool_t *p)
+{
+    md_curl_init();
+    share_init(p);
+    return &multi_impl;
+}
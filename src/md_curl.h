@@ -21,4 +21,11 @@ struct md_http_impl;
 
 struct md_http_impl_t * md_curl_get_impl(apr_pool_t *p);
 
+/**
+ * Get the implementation based on curl_multi. It keeps connections to a server open
+ * across requests of the same md_http_t, shares DNS and TLS session data between
+ * all of them and supports deferred requests (see md_http_set_deferred()).
+ */
+struct md_http_impl_t * md_curl_get_multi_impl(apr_pool_t *p);
+
 #endif /* md_curl_h */
@@ -30,6 +30,9 @@ struct md_http_t {
     md_http_impl_t *impl;
     const char *user_agent;
     const char *proxy_url;
+    const char *trace_name;
+    int deferred;
+    void *impl_data;
 };
 
 static md_http_impl_t *cur_impl;
@@ -43,6 +46,17 @@ void md_http_use_implementation(md_http_impl_t *impl)
     }
 }
 
+static apr_status_t http_cleanup(void *data)
+{
+    md_http_t *http = data;
+    
+    if (http->impl->cleanup) {
+        http->impl->cleanup(http);
+    }
+    http->impl_data = NULL;
+    return APR_SUCCESS;
+}
+
 apr_status_t md_http_create(md_http_t **phttp, apr_pool_t *p, const char *user_agent,
                             const char *proxy_url)
 {
@@ -72,6 +86,8 @@ apr_status_t md_http_create(md_http_t **phttp, apr_pool_t *p, const char *user_a
     if (!http->bucket_alloc) {
         return APR_EGENERAL;
     }
+    /* run before the pools of any requests still pending are gone */
+    apr_pool_pre_cleanup_register(p, http, http_cleanup);
     *phttp = http;
     return APR_SUCCESS;
 }
@@ -81,6 +97,47 @@ void md_http_set_response_limit(md_http_t *http, apr_off_t resp_limit)
     http->resp_limit = resp_limit;
 }
 
+void md_http_set_trace_name(md_http_t *http, const char *name)
+{
+    http->trace_name = name? apr_pstrdup(http->pool, name) : NULL;
+}
+
+const char *md_http_get_trace_name(md_http_t *http)
+{
+    return http->trace_name;
+}
+
+int md_http_set_deferred(md_http_t *http, int deferred)
+{
+    int prev = http->deferred;
+    
+    http->deferred = deferred;
+    return prev;
+}
+
+int md_http_can_defer(md_http_t *http)
+{
+    return http->impl->submit && http->impl->await;
+}
+
+apr_status_t md_http_await_all(md_http_t *http)
+{
+    if (http->impl->await) {
+        return http->impl->await(http);
+    }
+    return APR_SUCCESS;
+}
+
+void *md_http_get_impl_data(md_http_t *http)
+{
+    return http->impl_data;
+}
+
+void md_http_set_impl_data(md_http_t *http, void *data)
+{
+    http->impl_data = data;
+}
+
 static apr_status_t req_create(md_http_request_t **preq, md_http_t *http, 
                                const char *method, const char *url, struct apr_table_t *headers,
                                md_http_cb *cb, void *baton)
@@ -143,6 +200,9 @@ static apr_status_t schedule(md_http_request_t *req,
         apr_table_setn(req->headers, "Content-Length", apr_off_t_toa(req->pool, req->body_len));
     }
     
+    if (req->http->deferred && req->http->impl->submit) {
+        return req->http->impl->submit(req);
+    }
     return req->http->impl->perform(req);
 }
 
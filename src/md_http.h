@@ -58,6 +58,13 @@ apr_status_t md_http_create(md_http_t **phttp, apr_pool_t *p, const char *user_a
 
 void md_http_set_response_limit(md_http_t *http, apr_off_t resp_limit);
 
+/**
+ * Get/set the name the requests of this instance are traced under, e.g. the MD
+ * they are made for. NULL by default.
+ */
+void md_http_set_trace_name(md_http_t *http, const char *name);
+const char *md_http_get_trace_name(md_http_t *http);
+
 apr_status_t md_http_GET(md_http_t *http, 
                          const char *url, struct apr_table_t *headers,
                          md_http_cb *cb, void *baton);
@@ -78,22 +85,56 @@ apr_status_t md_http_POSTd(md_http_t *http, const char *url,
 
 void md_http_req_destroy(md_http_request_t *req);
 
+/**
+ * Enable/disable deferred requests on the http instance. While enabled, md_http_GET(),
+ * md_http_HEAD() and md_http_POST*() only submit their request and return. The
+ * requests are carried out together, with their callbacks invoked as responses 
+ * arrive, by md_http_await_all() or the next request that is not deferred.
+ * Implementations without support for this perform each request right away.
+ * Returns the previous setting.
+ */
+int md_http_set_deferred(md_http_t *http, int deferred);
+
+/**
+ * Return != 0 iff the implementation in use supports deferred requests.
+ */
+int md_http_can_defer(md_http_t *http);
+
+/**
+ * Perform all submitted, deferred requests and return when all are done. Returns
+ * APR_SUCCESS when all callbacks succeeded, otherwise the status of the first request
+ * that failed.
+ */
+apr_status_t md_http_await_all(md_http_t *http);
+
 /**************************************************************************************************/
 /* interface to implementation */
 
 typedef apr_status_t md_http_init_cb(void);
 typedef void md_http_req_cleanup_cb(md_http_request_t *req);
 typedef apr_status_t md_http_perform_cb(md_http_request_t *req);
+typedef apr_status_t md_http_await_cb(md_http_t *http);
+typedef void md_http_cleanup_cb(md_http_t *http);
 
 typedef struct md_http_impl_t md_http_impl_t;
 struct md_http_impl_t {
     md_http_init_cb *init;
     md_http_req_cleanup_cb *req_cleanup;
     md_http_perform_cb *perform;
+    md_http_perform_cb *submit;         /* optional, queue request for md_http_await_all() */
+    md_http_await_cb *await;            /* optional, perform all submitted requests */
+    md_http_cleanup_cb *cleanup;        /* optional, called when the md_http_t is destroyed */
 };
 
 void md_http_use_implementation(md_http_impl_t *impl);
 
+/**
+ * Get/set the data an implementation keeps for a md_http_t instance, e.g. the 
+ * connections it holds open.
+ */
+void *md_http_get_impl_data(md_http_t *http);
+void md_http_set_impl_data(md_http_t *http, void *data);
+
 
 
 #endif /* md_http_h */
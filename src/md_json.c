@@ -54,6 +54,7 @@
 struct md_json_t {
     apr_pool_t *p;
     json_t *j;
+    int borrowed;               /* j is held by another md_json_t, no ref of our own */
 };
 
 /**************************************************************************************************/
@@ -87,6 +88,14 @@ static md_json_t *json_create(apr_pool_t *pool, json_t *j)
     return json;
 }
 
+/* A view of a value inside another json, without reference or pool cleanup. */
+static void json_view_init(md_json_t *view, apr_pool_t *pool, json_t *j)
+{
+    view->p = pool;
+    view->j = j;
+    view->borrowed = 1;
+}
+
 md_json_t *md_json_create(apr_pool_t *pool)
 {
     return json_create(pool, json_object());
@@ -100,8 +109,10 @@ md_json_t *md_json_create_s(apr_pool_t *pool, const char *s)
 void md_json_destroy(md_json_t *json)
 {
     if (json && json->j) {
-        assert(json->j->refcount > 0);
-        json_decref(json->j);
+        if (!json->borrowed) {
+            assert(json->j->refcount > 0);
+            json_decref(json->j);
+        }
         json->j = NULL;
     }
 }
@@ -394,6 +405,27 @@ md_json_t *md_json_getj(md_json_t *json, ...)
     return NULL;
 }
 
+md_json_t *md_json_viewj(md_json_t *json, ...)
+{
+    md_json_t *view;
+    json_t *j;
+    va_list ap;
+    
+    va_start(ap, json);
+    j = jselect(json, ap);
+    va_end(ap);
+    
+    if (j) {
+        if (j == json->j) {
+            return json;
+        }
+        view = apr_palloc(json->p, sizeof(*view));
+        json_view_init(view, json->p, j);
+        return view;
+    }
+    return NULL;
+}
+
 apr_status_t md_json_setj(md_json_t *value, md_json_t *json, ...)
 {
     va_list ap;
@@ -586,7 +618,7 @@ apr_status_t md_json_geta(apr_array_header_t *a, md_json_from_cb *cb, void *bato
         return APR_ENOENT;
     }
         
-    wrap.p = a->pool;
+    json_view_init(&wrap, a->pool, NULL);
     json_array_foreach(j, index, val) {
         wrap.j = val;
         if (APR_SUCCESS == (rv = cb(&element, &wrap, wrap.p, baton))) {
@@ -633,7 +665,7 @@ apr_status_t md_json_seta(apr_array_header_t *a, md_json_to_cb *cb, void *baton,
     }
     
     json_array_clear(j);
-    wrap.p = json->p;
+    json_view_init(&wrap, json->p, NULL);
     for (i = 0; i < a->nelts; ++i) {
         if (!cb) {
             return APR_EINVAL;
@@ -662,7 +694,7 @@ int md_json_itera(md_json_itera_cb *cb, void *baton, md_json_t *json, ...)
         return 0;
     }
         
-    wrap.p = json->p;
+    json_view_init(&wrap, json->p, NULL);
     json_array_foreach(j, index, val) {
         wrap.j = val;
         if (!cb(baton, index, &wrap)) {
@@ -672,6 +704,32 @@ int md_json_itera(md_json_itera_cb *cb, void *baton, md_json_t *json, ...)
     return 1;
 }
 
+int md_json_iterkey(md_json_iterkey_cb *cb, void *baton, md_json_t *json, ...)
+{
+    json_t *j;
+    va_list ap;
+    const char *key;
+    json_t *val;
+    md_json_t wrap;
+    
+    va_start(ap, json);
+    j = jselect(json, ap);
+    va_end(ap);
+    
+    if (!j || !json_is_object(j)) {
+        return 0;
+    }
+        
+    json_view_init(&wrap, json->p, NULL);
+    json_object_foreach(j, key, val) {
+        wrap.j = val;
+        if (!cb(baton, key, &wrap)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
 /**************************************************************************************************/
 /* array strings */
 
@@ -753,6 +811,507 @@ apr_status_t md_json_setsa(apr_array_header_t *a, md_json_t *json, ...)
     return APR_SUCCESS;
 }
 
+/**************************************************************************************************/
+/* compiled paths */
+
+static json_t *pselect(md_json_t *json, const md_json_path_t *path)
+{
+    json_t *j = json->j;
+    int i;
+
+    for (i = 0; i < path->nkeys && j; ++i) {
+        j = json_object_get(j, path->keys[i]);
+    }
+    return j;
+}
+
+/* The object holding the last key of path, created as needed */
+static json_t *pselect_parent(md_json_t *json, const md_json_path_t *path)
+{
+    json_t *j = json->j, *jn;
+    int i;
+
+    if (path->nkeys <= 0) {
+        return NULL;
+    }
+    for (i = 0; i < path->nkeys - 1 && j; ++i) {
+        jn = json_object_get(j, path->keys[i]);
+        if (!jn) {
+            jn = json_object();
+            json_object_set_new(j, path->keys[i], jn);
+        }
+        j = jn;
+    }
+    return (j && json_is_object(j))? j : NULL;
+}
+
+static apr_status_t pselect_set_new(json_t *val, md_json_t *json, const md_json_path_t *path)
+{
+    json_t *j;
+
+    if (!val || !(j = pselect_parent(json, path))) {
+        json_decref(val);
+        return APR_EINVAL;
+    }
+    json_object_set_new(j, path->keys[path->nkeys - 1], val);
+    return APR_SUCCESS;
+}
+
+int md_json_has_key_p(md_json_t *json, const md_json_path_t *path)
+{
+    return pselect(json, path) != NULL;
+}
+
+int md_json_getb_p(md_json_t *json, const md_json_path_t *path)
+{
+    json_t *j = pselect(json, path);
+    return j? json_is_true(j) : 0;
+}
+
+apr_status_t md_json_setb_p(int value, md_json_t *json, const md_json_path_t *path)
+{
+    return pselect_set_new(json_boolean(value), json, path);
+}
+
+long md_json_getl_p(md_json_t *json, const md_json_path_t *path)
+{
+    json_t *j = pselect(json, path);
+    return (long)((j && json_is_number(j))? json_integer_value(j) : 0L);
+}
+
+apr_status_t md_json_setl_p(long value, md_json_t *json, const md_json_path_t *path)
+{
+    return pselect_set_new(json_integer(value), json, path);
+}
+
+const char *md_json_gets_p(md_json_t *json, const md_json_path_t *path)
+{
+    json_t *j = pselect(json, path);
+    return (j && json_is_string(j))? json_string_value(j) : NULL;
+}
+
+const char *md_json_dups_p(apr_pool_t *p, md_json_t *json, const md_json_path_t *path)
+{
+    json_t *j = pselect(json, path);
+    return (j && json_is_string(j))? apr_pstrdup(p, json_string_value(j)) : NULL;
+}
+
+apr_status_t md_json_sets_p(const char *value, md_json_t *json, const md_json_path_t *path)
+{
+    return pselect_set_new(json_string(value), json, path);
+}
+
+apr_status_t md_json_dupsa_p(apr_array_header_t *a, apr_pool_t *p, md_json_t *json,
+                             const md_json_path_t *path)
+{
+    json_t *j = pselect(json, path), *val;
+    size_t index;
+
+    if (!j || !json_is_array(j)) {
+        return APR_ENOENT;
+    }
+    json_array_foreach(j, index, val) {
+        if (json_is_string(val)) {
+            APR_ARRAY_PUSH(a, const char *) = apr_pstrdup(p, json_string_value(val));
+        }
+    }
+    return APR_SUCCESS;
+}
+
+apr_status_t md_json_setsa_p(apr_array_header_t *a, md_json_t *json,
+                             const md_json_path_t *path)
+{
+    json_t *j;
+    int i;
+
+    j = json_array();
+    for (i = 0; i < a->nelts; ++i) {
+        json_array_append_new(j, json_string(APR_ARRAY_IDX(a, i, const char*)));
+    }
+    return pselect_set_new(j, json, path);
+}
+
+/**************************************************************************************************/
+/* field tables */
+
+void md_json_fields_get(void *obj, const md_json_field_t *fields, apr_size_t nfields,
+                        md_json_t *json, apr_pool_t *p)
+{
+    const md_json_field_t *f;
+    apr_array_header_t **pa;
+    const char *s;
+    char *member;
+    apr_size_t i;
+
+    for (i = 0; i < nfields; ++i) {
+        f = &fields[i];
+        member = (char*)obj + f->offset;
+        switch (f->type) {
+            case MD_JSON_FIELD_STR:
+                if ((s = md_json_dups_p(p, json, &f->path))) {
+                    *(const char**)member = s;
+                }
+                break;
+            case MD_JSON_FIELD_STRA:
+                if (md_json_has_key_p(json, &f->path)) {
+                    pa = (apr_array_header_t**)member;
+                    if (!*pa) {
+                        *pa = apr_array_make(p, 5, sizeof(const char*));
+                    }
+                    md_json_dupsa_p(*pa, p, json, &f->path);
+                }
+                break;
+            case MD_JSON_FIELD_INT:
+                *(int*)member = (int)md_json_getl_p(json, &f->path);
+                break;
+            case MD_JSON_FIELD_BOOL:
+                *(int*)member = md_json_getb_p(json, &f->path);
+                break;
+        }
+    }
+}
+
+apr_status_t md_json_fields_set(const void *obj, const md_json_field_t *fields,
+                                apr_size_t nfields, md_json_t *json)
+{
+    const md_json_field_t *f;
+    const char *member, *s;
+    apr_array_header_t *a;
+    apr_status_t rv = APR_SUCCESS;
+    apr_size_t i;
+
+    for (i = 0; i < nfields && APR_SUCCESS == rv; ++i) {
+        f = &fields[i];
+        member = (const char*)obj + f->offset;
+        switch (f->type) {
+            case MD_JSON_FIELD_STR:
+                if ((s = *(const char* const*)member)) {
+                    rv = md_json_sets_p(s, json, &f->path);
+                }
+                break;
+            case MD_JSON_FIELD_STRA:
+                if ((a = *(apr_array_header_t* const*)member)) {
+                    rv = md_json_setsa_p(a, json, &f->path);
+                }
+                break;
+            case MD_JSON_FIELD_INT:
+                rv = md_json_setl_p(*(const int*)member, json, &f->path);
+                break;
+            case MD_JSON_FIELD_BOOL:
+                rv = md_json_setb_p(*(const int*)member > 0, json, &f->path);
+                break;
+        }
+    }
+    return rv;
+}
+
+/**************************************************************************************************/
+/* binary format: a subset of CBOR (RFC 8949) that maps 1:1 to JSON */
+
+/* The self-describe tag 55799 written in front, how readers tell it from text */
+static const unsigned char CBOR_MAGIC[] = { 0xd9, 0xd9, 0xf7 };
+
+#define CBOR_MAX_DEPTH      64
+
+enum {
+    CBOR_UINT   = 0,
+    CBOR_NINT   = 1,
+    CBOR_TEXT   = 3,
+    CBOR_ARRAY  = 4,
+    CBOR_MAP    = 5,
+    CBOR_TAG    = 6,
+    CBOR_SIMPLE = 7,
+};
+
+#define CBOR_FALSE      20
+#define CBOR_TRUE       21
+#define CBOR_NULL       22
+#define CBOR_FLOAT64    27
+
+typedef struct {
+    apr_pool_t *p;
+    unsigned char *data;
+    apr_size_t len;
+    apr_size_t size;
+} cbor_wbuf;
+
+static void cbor_put(cbor_wbuf *b, const void *data, apr_size_t len)
+{
+    unsigned char *ndata;
+    
+    if (b->len + len > b->size) {
+        b->size = (b->size > 0)? b->size * 2 : 1024;
+        while (b->len + len > b->size) {
+            b->size *= 2;
+        }
+        ndata = apr_palloc(b->p, b->size);
+        if (b->len) memcpy(ndata, b->data, b->len);
+        b->data = ndata;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void cbor_put_head(cbor_wbuf *b, int major, apr_uint64_t n)
+{
+    unsigned char head[9];
+    apr_size_t i, nlen;
+    
+    if (n < 24) {
+        head[0] = (unsigned char)((major << 5) | (int)n);
+        nlen = 0;
+    }
+    else if (n <= 0xff) {
+        head[0] = (unsigned char)((major << 5) | 24);
+        nlen = 1;
+    }
+    else if (n <= 0xffff) {
+        head[0] = (unsigned char)((major << 5) | 25);
+        nlen = 2;
+    }
+    else if (n <= 0xffffffffu) {
+        head[0] = (unsigned char)((major << 5) | 26);
+        nlen = 4;
+    }
+    else {
+        head[0] = (unsigned char)((major << 5) | 27);
+        nlen = 8;
+    }
+    for (i = 0; i < nlen; ++i) {
+        head[nlen - i] = (unsigned char)(n >> (8 * i));
+    }
+    cbor_put(b, head, nlen + 1);
+}
+
+static apr_status_t cbor_encode(cbor_wbuf *b, json_t *j)
+{
+    const char *key;
+    json_t *val;
+    json_int_t ival;
+    double dval;
+    apr_uint64_t bits;
+    size_t i;
+    unsigned char c;
+    apr_status_t rv = APR_SUCCESS;
+    
+    switch (json_typeof(j)) {
+        case JSON_OBJECT:
+            cbor_put_head(b, CBOR_MAP, json_object_size(j));
+            json_object_foreach(j, key, val) {
+                cbor_put_head(b, CBOR_TEXT, strlen(key));
+                cbor_put(b, key, strlen(key));
+                if (APR_SUCCESS != (rv = cbor_encode(b, val))) break;
+            }
+            break;
+        case JSON_ARRAY:
+            cbor_put_head(b, CBOR_ARRAY, json_array_size(j));
+            for (i = 0; i < json_array_size(j) && APR_SUCCESS == rv; ++i) {
+                rv = cbor_encode(b, json_array_get(j, i));
+            }
+            break;
+        case JSON_STRING:
+            cbor_put_head(b, CBOR_TEXT, json_string_length(j));
+            cbor_put(b, json_string_value(j), json_string_length(j));
+            break;
+        case JSON_INTEGER:
+            ival = json_integer_value(j);
+            if (ival >= 0) {
+                cbor_put_head(b, CBOR_UINT, (apr_uint64_t)ival);
+            }
+            else {
+                cbor_put_head(b, CBOR_NINT, (apr_uint64_t)(-(ival + 1)));
+            }
+            break;
+        case JSON_REAL:
+            dval = json_real_value(j);
+            memcpy(&bits, &dval, sizeof(bits));
+            c = (unsigned char)((CBOR_SIMPLE << 5) | CBOR_FLOAT64);
+            cbor_put(b, &c, 1);
+            for (i = 0; i < 8; ++i) {
+                c = (unsigned char)(bits >> (56 - 8 * i));
+                cbor_put(b, &c, 1);
+            }
+            break;
+        case JSON_TRUE:
+        case JSON_FALSE:
+        case JSON_NULL:
+            c = (unsigned char)((CBOR_SIMPLE << 5) | (json_is_true(j)? CBOR_TRUE : 
+                                                      (json_is_false(j)? CBOR_FALSE : CBOR_NULL)));
+            cbor_put(b, &c, 1);
+            break;
+        default:
+            rv = APR_EINVAL;
+            break;
+    }
+    return rv;
+}
+
+static apr_status_t cbor_write(const char **pdata, apr_size_t *plen, json_t *j, apr_pool_t *p)
+{
+    cbor_wbuf b;
+    apr_status_t rv;
+    
+    memset(&b, 0, sizeof(b));
+    b.p = p;
+    cbor_put(&b, CBOR_MAGIC, sizeof(CBOR_MAGIC));
+    rv = cbor_encode(&b, j);
+    *pdata = (const char *)b.data;
+    *plen = b.len;
+    return rv;
+}
+
+typedef struct {
+    const unsigned char *data;
+    apr_size_t len;
+    apr_size_t pos;
+} cbor_rbuf;
+
+static apr_status_t cbor_get_head(cbor_rbuf *b, int *pmajor, int *pinfo, apr_uint64_t *pn)
+{
+    apr_size_t nlen;
+    
+    if (b->pos >= b->len) return APR_EINVAL;
+    *pmajor = b->data[b->pos] >> 5;
+    *pinfo = b->data[b->pos] & 0x1f;
+    ++b->pos;
+    if (*pinfo < 24) {
+        *pn = (apr_uint64_t)*pinfo;
+        return APR_SUCCESS;
+    }
+    else if (*pinfo > 27) {
+        /* indefinite lengths and reserved values are never written by us */
+        return APR_EINVAL;
+    }
+    nlen = (apr_size_t)1 << (*pinfo - 24);
+    if (b->len - b->pos < nlen) return APR_EINVAL;
+    *pn = 0;
+    while (nlen--) {
+        *pn = (*pn << 8) | b->data[b->pos++];
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t cbor_decode(json_t **pj, cbor_rbuf *b, apr_pool_t *p, int depth)
+{
+    json_t *j = NULL, *val;
+    int major, info;
+    apr_uint64_t n, i, klen;
+    const char *key;
+    char kbuf[256];
+    double dval;
+    apr_status_t rv;
+    
+    *pj = NULL;
+    if (depth > CBOR_MAX_DEPTH) return APR_EINVAL;
+    if (APR_SUCCESS != (rv = cbor_get_head(b, &major, &info, &n))) return rv;
+    
+    switch (major) {
+        case CBOR_UINT:
+        case CBOR_NINT:
+            if (n > (apr_uint64_t)APR_INT64_MAX) return APR_EINVAL;
+            j = json_integer((major == CBOR_UINT)? (json_int_t)n : -1 - (json_int_t)n);
+            break;
+        case CBOR_TEXT:
+            if (n > b->len - b->pos) return APR_EINVAL;
+            /* NULL on invalid UTF-8 */
+            j = json_stringn((const char *)b->data + b->pos, (size_t)n);
+            if (!j) return APR_EINVAL;
+            b->pos += (apr_size_t)n;
+            break;
+        case CBOR_ARRAY:
+            /* every item has at least one byte, do not trust larger counts */
+            if (n > b->len - b->pos) return APR_EINVAL;
+            j = json_array();
+            for (i = 0; i < n; ++i) {
+                if (APR_SUCCESS != (rv = cbor_decode(&val, b, p, depth + 1))) goto leave;
+                json_array_append_new(j, val);
+            }
+            break;
+        case CBOR_MAP:
+            if (n > (b->len - b->pos) / 2) return APR_EINVAL;
+            j = json_object();
+            for (i = 0; i < n; ++i) {
+                /* keys are text as in JSON, copied for their terminating NUL */
+                if (APR_SUCCESS != (rv = cbor_get_head(b, &major, &info, &klen))) goto leave;
+                if (major != CBOR_TEXT || klen > b->len - b->pos
+                    || memchr(b->data + b->pos, '\0', (size_t)klen)) {
+                    rv = APR_EINVAL;
+                    goto leave;
+                }
+                if (klen < sizeof(kbuf)) {
+                    memcpy(kbuf, b->data + b->pos, (size_t)klen);
+                    kbuf[klen] = '\0';
+                    key = kbuf;
+                }
+                else {
+                    key = apr_pstrmemdup(p, (const char *)b->data + b->pos, (apr_size_t)klen);
+                }
+                b->pos += (apr_size_t)klen;
+                if (APR_SUCCESS != (rv = cbor_decode(&val, b, p, depth + 1))) goto leave;
+                if (json_object_set_new(j, key, val)) {
+                    rv = APR_EINVAL;
+                    goto leave;
+                }
+            }
+            break;
+        case CBOR_TAG:
+            if (n != 55799) return APR_EINVAL;
+            return cbor_decode(pj, b, p, depth + 1);
+        case CBOR_SIMPLE:
+            switch (info) {
+                case CBOR_FALSE: 
+                    j = json_false(); 
+                    break;
+                case CBOR_TRUE: 
+                    j = json_true(); 
+                    break;
+                case CBOR_NULL: 
+                    j = json_null(); 
+                    break;
+                case CBOR_FLOAT64:
+                    memcpy(&dval, &n, sizeof(dval));
+                    j = json_real(dval);
+                    break;
+                default:
+                    return APR_EINVAL;
+            }
+            break;
+        default:
+            /* byte strings have no JSON equivalent */
+            return APR_EINVAL;
+    }
+    if (!j) return APR_ENOMEM;
+    *pj = j;
+    return APR_SUCCESS;
+leave:
+    json_decref(j);
+    return rv;
+}
+
+static int is_cbor(const char *data, apr_size_t len)
+{
+    return len >= sizeof(CBOR_MAGIC) && !memcmp(data, CBOR_MAGIC, sizeof(CBOR_MAGIC));
+}
+
+static json_t *cbor_load(const char *data, apr_size_t len, apr_pool_t *p)
+{
+    cbor_rbuf b;
+    json_t *j;
+    
+    b.data = (const unsigned char *)data;
+    b.len = len;
+    b.pos = 0;
+    if (APR_SUCCESS != cbor_decode(&j, &b, p, 0)) {
+        return NULL;
+    }
+    if (b.pos != b.len) {
+        /* trailing garbage */
+        json_decref(j);
+        return NULL;
+    }
+    return j;
+}
+
 /**************************************************************************************************/
 /* formatting, parsing */
 
@@ -784,8 +1343,17 @@ static int dump_cb(const char *buffer, size_t len, void *baton)
 
 apr_status_t md_json_writeb(md_json_t *json, md_json_fmt_t fmt, apr_bucket_brigade *bb)
 {
-    int rv = json_dump_callback(json->j, dump_cb, bb, fmt_to_flags(fmt));
-    return rv? APR_EGENERAL : APR_SUCCESS;
+    const char *data;
+    apr_size_t len;
+    apr_status_t rv;
+    
+    if (fmt == MD_JSON_FMT_BINARY) {
+        if (APR_SUCCESS == (rv = cbor_write(&data, &len, json->j, bb->p))) {
+            rv = apr_brigade_write(bb, NULL, NULL, data, len);
+        }
+        return rv;
+    }
+    return json_dump_callback(json->j, dump_cb, bb, fmt_to_flags(fmt))? APR_EGENERAL : APR_SUCCESS;
 }
 
 static int chunk_cb(const char *buffer, size_t len, void *baton)
@@ -803,6 +1371,11 @@ const char *md_json_writep(md_json_t *json, apr_pool_t *p, md_json_fmt_t fmt)
     apr_array_header_t *chunks;
     int rv;
 
+    if (fmt == MD_JSON_FMT_BINARY) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, 0, p,
+                      "md_json_writep cannot return binary JSON as string");
+        return NULL;
+    }
     chunks = apr_array_make(p, 10, sizeof(char *));
     rv = json_dump_callback(json->j, chunk_cb, chunks, fmt_to_flags(fmt));
 
@@ -822,18 +1395,28 @@ const char *md_json_writep(md_json_t *json, apr_pool_t *p, md_json_fmt_t fmt)
     }
 }
 
+apr_status_t md_json_writem(const char **pdata, apr_size_t *plen, md_json_t *json, 
+                            apr_pool_t *p, md_json_fmt_t fmt)
+{
+    if (fmt == MD_JSON_FMT_BINARY) {
+        return cbor_write(pdata, plen, json->j, p);
+    }
+    if (NULL == (*pdata = md_json_writep(json, p, fmt))) {
+        *plen = 0;
+        return APR_EINVAL;
+    }
+    *plen = strlen(*pdata);
+    return APR_SUCCESS;
+}
+
 apr_status_t md_json_writef(md_json_t *json, apr_pool_t *p, md_json_fmt_t fmt, apr_file_t *f)
 {
     apr_status_t rv;
     const char *s;
+    apr_size_t len;
     
-    s = md_json_writep(json, p, fmt);
-
-    if (s) {
-        rv = apr_file_write_full(f, s, strlen(s), NULL);
-    }
-    else {
-        rv = APR_EINVAL;
+    if (APR_SUCCESS == (rv = md_json_writem(&s, &len, json, p, fmt))) {
+        rv = apr_file_write_full(f, s, len, NULL);
     }
 
     if (APR_SUCCESS != rv) {
@@ -881,7 +1464,12 @@ apr_status_t md_json_readd(md_json_t **pjson, apr_pool_t *pool, const char *data
     json_error_t error;
     json_t *j;
     
-    j = json_loadb(data, data_len, 0, &error);
+    if (is_cbor(data, data_len)) {
+        j = cbor_load(data, data_len, pool);
+    }
+    else {
+        j = json_loadb(data, data_len, 0, &error);
+    }
     if (!j) {
         return APR_EINVAL;
     }
@@ -936,8 +1524,22 @@ apr_status_t md_json_readb(md_json_t **pjson, apr_pool_t *pool, apr_bucket_briga
 {
     json_error_t error;
     json_t *j;
+    apr_bucket *b;
+    const char *data;
+    apr_size_t len;
     
-    j = json_load_callback(load_cb, bb, 0, &error);
+    b = APR_BRIGADE_FIRST(bb);
+    if (b != APR_BRIGADE_SENTINEL(bb) && !APR_BUCKET_IS_METADATA(b)
+        && (APR_BUCKET_NEXT(b) == APR_BRIGADE_SENTINEL(bb) 
+            || APR_BUCKET_IS_EOS(APR_BUCKET_NEXT(b)))
+        && APR_SUCCESS == apr_bucket_read(b, &data, &len, APR_BLOCK_READ)) {
+        /* all in one bucket, as http responses are: parse in place */
+        j = json_loadb(data, len, 0, &error);
+        apr_brigade_cleanup(bb);
+    }
+    else {
+        j = json_load_callback(load_cb, bb, 0, &error);
+    }
     if (!j) {
         return APR_EINVAL;
     }
@@ -945,35 +1547,34 @@ apr_status_t md_json_readb(md_json_t **pjson, apr_pool_t *pool, apr_bucket_briga
     return APR_SUCCESS;
 }
 
-static size_t load_file_cb(void *data, size_t max_len, void *baton)
-{
-    apr_file_t *f = baton;
-    apr_size_t len = max_len;
-    apr_status_t rv;
-    
-    rv = apr_file_read(f, data, &len);
-    if (APR_SUCCESS == rv) {
-        return len;
-    }
-    else if (APR_EOF == rv) {
-        return 0;
-    }
-    return (size_t)-1;
-}
-
 apr_status_t md_json_readf(md_json_t **pjson, apr_pool_t *p, const char *fpath)
 {
-    apr_file_t *f;
-    json_t *j;
+    apr_pool_t *ptemp;
+    const char *data;
+    apr_size_t len;
+    json_t *j = NULL;
     apr_status_t rv;
     json_error_t error;
     
-    rv = apr_file_open(&f, fpath, APR_FOPEN_READ, 0, p);
-    if (rv != APR_SUCCESS) {
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, p))) {
         return rv;
     }
-
-    j = json_load_callback(load_file_cb, f, 0, &error);
+    /* one read of the whole file, parsed in place */
+    if (APR_SUCCESS != (rv = md_util_file_load(&data, &len, ptemp, fpath, 0))) {
+        goto out;
+    }
+    if (is_cbor(data, len)) {
+        if (NULL != (j = cbor_load(data, len, ptemp))) {
+            *pjson = json_create(p, j);
+        }
+        else {
+            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, 0, p,
+                          "failed to load binary JSON file %s", fpath);
+            rv = APR_EINVAL;
+        }
+        goto out;
+    }
+    j = json_loadb(data, len, 0, &error);
     if (j) {
         *pjson = json_create(p, j);
     }
@@ -981,10 +1582,11 @@ apr_status_t md_json_readf(md_json_t **pjson, apr_pool_t *p, const char *fpath)
         md_log_perror(MD_LOG_MARK, MD_LOG_ERR, 0, p,
                       "failed to load JSON file %s: %s (line %d:%d)",
                       fpath, error.text, error.line, error.column);
+        rv = APR_EINVAL;
     }
-
-    apr_file_close(f);
-    return (j && *pjson) ? APR_SUCCESS : APR_EINVAL;
+out:
+    apr_pool_destroy(ptemp);
+    return rv;
 }
 
 /**************************************************************************************************/
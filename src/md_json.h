@@ -31,6 +31,7 @@ typedef struct md_json_t md_json_t;
 typedef enum {
     MD_JSON_FMT_COMPACT,
     MD_JSON_FMT_INDENT,
+    MD_JSON_FMT_BINARY,         /* CBOR (RFC 8949), read back by md_json_readd/readf */
 } md_json_fmt_t;
 
 md_json_t *md_json_create(apr_pool_t *pool);
@@ -61,6 +62,12 @@ apr_status_t md_json_sets(const char *s, md_json_t *json, ...);
 
 /* json manipulation */
 md_json_t *md_json_getj(md_json_t *json, ...);
+/**
+ * Get a view of the value at the path. The view holds no reference and registers no
+ * pool cleanup, it is valid only as long as json keeps that value. For reading or
+ * copying right away, use md_json_getj() to keep a value around.
+ */
+md_json_t *md_json_viewj(md_json_t *json, ...);
 apr_status_t md_json_setj(md_json_t *value, md_json_t *json, ...);
 apr_status_t md_json_addj(md_json_t *value, md_json_t *json, ...);
 
@@ -89,6 +96,10 @@ apr_status_t md_json_seta(apr_array_header_t *a, md_json_to_cb *cb,
 typedef int md_json_itera_cb(void *baton, size_t index, md_json_t *json);
 int md_json_itera(md_json_itera_cb *cb, void *baton, md_json_t *json, ...);
 
+/* Iterating over the keys of an object */
+typedef int md_json_iterkey_cb(void *baton, const char *key, md_json_t *json);
+int md_json_iterkey(md_json_iterkey_cb *cb, void *baton, md_json_t *json, ...);
+
 /* Manipulating Object String values */
 apr_status_t md_json_gets_dict(apr_table_t *dict, md_json_t *json, ...);
 apr_status_t md_json_sets_dict(apr_table_t *dict, md_json_t *json, ...);
@@ -98,9 +109,66 @@ apr_status_t md_json_getsa(apr_array_header_t *a, md_json_t *json, ...);
 apr_status_t md_json_dupsa(apr_array_header_t *a, apr_pool_t *p, md_json_t *json, ...);
 apr_status_t md_json_setsa(apr_array_header_t *a, md_json_t *json, ...);
 
+/* Compiled paths, for values accessed often. Defined once, as a static:
+ *   static const md_json_path_t P_CA_URL = MD_JSON_PATH(MD_KEY_CA, MD_KEY_URL);
+ * The _p accessors behave like the ones above, without walking a va_list. */
+#define MD_JSON_PATH_MAX    4
+
+typedef struct md_json_path_t {
+    int nkeys;
+    const char *keys[MD_JSON_PATH_MAX];
+} md_json_path_t;
+
+#define MD_JSON_PATH(...) \
+    { (int)(sizeof((const char*[]){ __VA_ARGS__ }) / sizeof(const char*)), { __VA_ARGS__ } }
+
+int md_json_has_key_p(md_json_t *json, const md_json_path_t *path);
+int md_json_getb_p(md_json_t *json, const md_json_path_t *path);
+apr_status_t md_json_setb_p(int value, md_json_t *json, const md_json_path_t *path);
+long md_json_getl_p(md_json_t *json, const md_json_path_t *path);
+apr_status_t md_json_setl_p(long value, md_json_t *json, const md_json_path_t *path);
+const char *md_json_gets_p(md_json_t *json, const md_json_path_t *path);
+const char *md_json_dups_p(apr_pool_t *p, md_json_t *json, const md_json_path_t *path);
+apr_status_t md_json_sets_p(const char *value, md_json_t *json, const md_json_path_t *path);
+apr_status_t md_json_dupsa_p(apr_array_header_t *a, apr_pool_t *p, md_json_t *json,
+                             const md_json_path_t *path);
+apr_status_t md_json_setsa_p(apr_array_header_t *a, md_json_t *json,
+                             const md_json_path_t *path);
+
+/* Tables of the struct members that map 1:1 to a JSON value, read and written in one
+ * go instead of by a chain of accessor calls. */
+typedef enum {
+    MD_JSON_FIELD_STR,          /* const char*, copied on read, not written when NULL */
+    MD_JSON_FIELD_STRA,         /* apr_array_header_t* of const char*, created on read
+                                   when NULL, not written when NULL */
+    MD_JSON_FIELD_INT,          /* int, read as 0 when missing */
+    MD_JSON_FIELD_BOOL,         /* int, written as true when > 0, read as 0 when missing */
+} md_json_field_type_t;
+
+typedef struct md_json_field_t {
+    md_json_path_t path;
+    md_json_field_type_t type;
+    apr_size_t offset;          /* of the member, APR_OFFSETOF(struct, member) */
+} md_json_field_t;
+
+/**
+ * Read the fields from json into the struct at obj. Strings and string arrays not
+ * in json leave the member as it is, numbers and booleans read as 0.
+ */
+void md_json_fields_get(void *obj, const md_json_field_t *fields, apr_size_t nfields,
+                        md_json_t *json, apr_pool_t *p);
+/**
+ * Write the fields of the struct at obj into json.
+ */
+apr_status_t md_json_fields_set(const void *obj, const md_json_field_t *fields,
+                                apr_size_t nfields, md_json_t *json);
+
 /* serialization & parsing */
 apr_status_t md_json_writeb(md_json_t *json, md_json_fmt_t fmt, struct apr_bucket_brigade *bb);
+/* NULL for MD_JSON_FMT_BINARY, as it may contain NULs. Use md_json_writem() for that. */
 const char *md_json_writep(md_json_t *json, apr_pool_t *p, md_json_fmt_t fmt);
+apr_status_t md_json_writem(const char **pdata, apr_size_t *plen, md_json_t *json, 
+                            apr_pool_t *p, md_json_fmt_t fmt);
 apr_status_t md_json_writef(md_json_t *json, apr_pool_t *p, 
                             md_json_fmt_t fmt, struct apr_file_t *f);
 apr_status_t md_json_fcreatex(md_json_t *json, apr_pool_t *p, md_json_fmt_t fmt, 
@@ -109,6 +177,7 @@ apr_status_t md_json_freplace(md_json_t *json, apr_pool_t *p, md_json_fmt_t fmt,
                               const char *fpath, apr_fileperms_t perms);
 
 apr_status_t md_json_readb(md_json_t **pjson, apr_pool_t *pool, struct apr_bucket_brigade *bb);
+/* These two detect and parse MD_JSON_FMT_BINARY data as well. */
 apr_status_t md_json_readd(md_json_t **pjson, apr_pool_t *pool, const char *data, size_t data_len);
 apr_status_t md_json_readf(md_json_t **pjson, apr_pool_t *pool, const char *fpath);
 
@@ -25,58 +25,118 @@
 #include "md_log.h"
 #include "md_util.h"
 
-static int header_set(void *data, const char *key, const char *val)
+/* s as JSON string, quoted and escaped */
+static const char *json_quote(const char *s, apr_pool_t *p)
 {
-    md_json_sets(val, (md_json_t *)data, key, NULL);
+    apr_size_t len = strlen(s), i, j;
+    char *q = apr_palloc(p, 6 * len + 3);
+    unsigned char c;
+    
+    j = 0;
+    q[j++] = '"';
+    for (i = 0; i < len; ++i) {
+        c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') {
+            q[j++] = '\\';
+            q[j++] = (char)c;
+        }
+        else if (c < 0x20) {
+            apr_snprintf(q + j, 7, "\\u%04x", c);
+            j += 6;
+        }
+        else {
+            q[j++] = (char)c;
+        }
+    }
+    q[j++] = '"';
+    q[j] = '\0';
+    return q;
+}
+
+typedef struct {
+    apr_pool_t *p;
+    apr_array_header_t *parts;
+} header_ctx;
+
+static int header_add(void *baton, const char *key, const char *val)
+{
+    header_ctx *ctx = baton;
+    
+    APR_ARRAY_PUSH(ctx->parts, const char *) = ",";
+    APR_ARRAY_PUSH(ctx->parts, const char *) = json_quote(key, ctx->p);
+    APR_ARRAY_PUSH(ctx->parts, const char *) = ":";
+    APR_ARRAY_PUSH(ctx->parts, const char *) = json_quote(val, ctx->p);
     return 1;
 }
 
+static const char *jws_alg(const char *curve)
+{
+    if (!curve) {
+        return "RS256";
+    }
+    return strcmp("P-384", curve)? "ES256" : "ES384";
+}
+
 apr_status_t md_jws_sign(md_json_t **pmsg, apr_pool_t *p,
                          const char *payload, size_t len, 
                          struct apr_table_t *protected, 
                          struct md_pkey_t *pkey, const char *key_id)
 {
-    md_json_t *msg, *jprotected;
-    const char *prot64, *pay64, *sign64, *sign, *prot;
+    md_json_t *msg;
+    const char *sign64, *prot, *jwk;
+    char *sign = NULL, *pay64 = NULL;
+    apr_size_t prot_len, prot64_len = 0, pay64_len;
+    header_ctx ctx;
     apr_status_t rv = APR_SUCCESS;
 
     *pmsg = NULL;
     
     msg = md_json_create(p);
 
-    jprotected = md_json_create(p);
-    md_json_sets("RS256", jprotected, "alg", NULL);
+    /* The key's JWK is computed once, the protected header is assembled as string 
+     * around it instead of going through a JSON object on every request. */
+    ctx.p = p;
+    ctx.parts = apr_array_make(p, 16, sizeof(const char *));
+    APR_ARRAY_PUSH(ctx.parts, const char *) = "{\"alg\":\"";
+    APR_ARRAY_PUSH(ctx.parts, const char *) = jws_alg(md_pkey_get_ec_curve(pkey));
     if (key_id) {
-        md_json_sets(key_id, jprotected, "kid", NULL);
+        APR_ARRAY_PUSH(ctx.parts, const char *) = "\",\"kid\":";
+        APR_ARRAY_PUSH(ctx.parts, const char *) = json_quote(key_id, p);
+    }
+    else if ((jwk = md_pkey_get_jwk(pkey))) {
+        APR_ARRAY_PUSH(ctx.parts, const char *) = "\",\"jwk\":";
+        APR_ARRAY_PUSH(ctx.parts, const char *) = jwk;
     }
     else {
-        md_json_sets(md_pkey_get_rsa_e64(pkey, p), jprotected, "jwk", "e", NULL);
-        md_json_sets("RSA", jprotected, "jwk", "kty", NULL);
-        md_json_sets(md_pkey_get_rsa_n64(pkey, p), jprotected, "jwk", "n", NULL);
+        rv = APR_EINVAL;
     }
-    apr_table_do(header_set, jprotected, protected, NULL);
-    prot = md_json_writep(jprotected, p, MD_JSON_FMT_COMPACT);
+    apr_table_do(header_add, &ctx, protected, NULL);
+    APR_ARRAY_PUSH(ctx.parts, const char *) = "}";
+    prot = (APR_SUCCESS == rv)? apr_array_pstrcat(p, ctx.parts, 0) : NULL;
     md_log_perror(MD_LOG_MARK, MD_LOG_TRACE4, 0, p, "protected: %s",
                   prot ? prot : "<failed to serialize!>");
 
-    if (!prot) {
-        rv = APR_EINVAL;
-    }
-    
     if (rv == APR_SUCCESS) {
-        prot64 = md_util_base64url_encode(prot, strlen(prot), p);
-        md_json_sets(prot64, msg, "protected", NULL);
-        pay64 = md_util_base64url_encode(payload, len, p);
-
+        /* Encode both parts straight into the signing input "prot64.pay64", one
+         * buffer for all. The '.' is put in after each part went into msg. */
+        prot_len = strlen(prot);
+        prot64_len = md_util_base64url_enclen(prot_len);
+        pay64_len = md_util_base64url_enclen(len);
+        sign = apr_palloc(p, prot64_len + 1 + pay64_len + 1);
+        pay64 = sign + prot64_len + 1;
+        md_util_base64url_encode_to(sign, prot64_len + 1, prot, prot_len);
+        md_json_sets(sign, msg, "protected", NULL);
+        md_util_base64url_encode_to(pay64, pay64_len + 1, payload, len);
         md_json_sets(pay64, msg, "payload", NULL);
-        sign = apr_psprintf(p, "%s.%s", prot64, pay64);
+        sign[prot64_len] = '.';
 
-        rv = md_crypt_sign64(&sign64, pkey, p, sign, strlen(sign));
+        rv = md_crypt_sign64(&sign64, pkey, p, sign, prot64_len + 1 + pay64_len);
     }
 
     if (rv == APR_SUCCESS) {
         md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, p, 
-                      "jws pay64=%s\nprot64=%s\nsign64=%s", pay64, prot64, sign64);
+                      "jws pay64=%s\nprot64=%.*s\nsign64=%s", 
+                      pay64, (int)prot64_len, sign, sign64);
         
         md_json_sets(sign64, msg, "signature", NULL);
     }
@@ -90,17 +150,12 @@ apr_status_t md_jws_sign(md_json_t **pmsg, apr_pool_t *p,
 
 apr_status_t md_jws_pkey_thumb(const char **pthumb, apr_pool_t *p, struct md_pkey_t *pkey)
 {
-    const char *e64, *n64, *s;
-    apr_status_t rv;
+    const char *thumb;
     
-    e64 = md_pkey_get_rsa_e64(pkey, p);
-    n64 = md_pkey_get_rsa_n64(pkey, p);
-    if (!e64 || !n64) {
+    if (!(thumb = md_pkey_get_jwk_thumb(pkey))) {
+        *pthumb = NULL;
         return APR_EINVAL;
     }
-
-    /* whitespace and order is relevant, since we hand out a digest of this */
-    s = apr_psprintf(p, "{\"e\":\"%s\",\"kty\":\"RSA\",\"n\":\"%s\"}", e64, n64);
-    rv = md_crypt_sha256_digest64(pthumb, p, s, strlen(s));
-    return rv;
+    *pthumb = apr_pstrdup(p, thumb);
+    return APR_SUCCESS;
 }
@@ -14,13 +14,18 @@
  * limitations under the License.
  */
  
+#include <string.h>
+
 #include <apr_lib.h>
+#include <apr_atomic.h>
+#include <apr_portable.h>
 #include <apr_strings.h>
 #include <apr_buckets.h>
 
 #include "md_log.h"
 
 #define LOG_BUFFER_LEN  1024
+#define LOG_RING_MAX_RECORDS  (1024*1024)
 
 static const char *level_names[] = {
     "emergency",
@@ -49,30 +54,168 @@ const char *md_log_level_name(md_log_level_t level)
 static md_log_print_cb *log_printv;
 static md_log_level_cb *log_level;
 static void *log_baton;
+static int log_print_max = -1;
+
+int md_log_level_max = -1;
+
+typedef struct {
+    volatile apr_uint32_t seq;       /* number of the record + 1, 0 while it is written */
+    md_log_level_t level;
+    int line;
+    apr_status_t rv;
+    apr_time_t time;
+    const char *file;                /* __FILE__ of the caller, not copied */
+#if APR_HAS_THREADS
+    apr_os_thread_t thread;          /* that logged the message */
+#endif
+    char msg[224];
+} log_rec_t;
+
+static log_rec_t *ring;
+static apr_uint32_t ring_mask;
+static md_log_level_t ring_level;
+static volatile apr_uint32_t ring_next;
+
+static void update_level_max(void)
+{
+    int level;
+    
+    log_print_max = -1;
+    if (log_level && log_printv) {
+        for (level = MD_LOG_TRACE8; level >= MD_LOG_EMERG; --level) {
+            if (log_level(log_baton, NULL, (md_log_level_t)level)) {
+                log_print_max = level;
+                break;
+            }
+        }
+    }
+    md_log_level_max = (ring && (int)ring_level > log_print_max)? 
+                       (int)ring_level : log_print_max;
+}
 
 void md_log_set(md_log_level_cb *level_cb, md_log_print_cb *print_cb, void *baton)
 {
     log_printv = print_cb;
     log_level = level_cb;
     log_baton = baton;
+    update_level_max();
 }
 
 int md_log_is_level(apr_pool_t *p, md_log_level_t level)
 {
-    if (!log_level) {
-        return 0;
+    (void)p;
+    return MD_LOG_IS_ON(level);
+}
+
+static apr_status_t ring_cleanup(void *data)
+{
+    (void)data;
+    ring = NULL;
+    ring_mask = 0;
+    update_level_max();
+    return APR_SUCCESS;
+}
+
+apr_status_t md_log_ring_init(apr_pool_t *p, apr_size_t nrecords, md_log_level_t level)
+{
+    apr_uint32_t size;
+
+    ring = NULL;
+    ring_mask = 0;
+    apr_atomic_set32(&ring_next, 0);
+    if (nrecords == 0 || level < MD_LOG_TRACE1) {
+        update_level_max();
+        return APR_SUCCESS;
+    }
+    if (nrecords > LOG_RING_MAX_RECORDS) {
+        update_level_max();
+        return APR_EINVAL;
+    }
+    size = 1;
+    while (size < nrecords) {
+        size <<= 1;
+    }
+
+    ring = apr_pcalloc(p, size * sizeof(*ring));
+    ring_mask = size - 1;
+    ring_level = level;
+    apr_pool_cleanup_register(p, NULL, ring_cleanup, apr_pool_cleanup_null);
+    update_level_max();
+    return APR_SUCCESS;
+}
+
+static void ring_add(const char *file, int line, md_log_level_t level, apr_status_t rv,
+                     const char *fmt, va_list ap)
+{
+    log_rec_t *rec;
+    apr_uint32_t n;
+
+    /* as with the trace of drives, each writer gets a record of its own */
+    n = apr_atomic_inc32(&ring_next);
+    rec = &ring[n & ring_mask];
+    apr_atomic_set32(&rec->seq, 0);
+    rec->level = level;
+    rec->line = line;
+    rec->rv = rv;
+    rec->time = apr_time_now();
+    rec->file = file;
+#if APR_HAS_THREADS
+    rec->thread = apr_os_thread_current();
+#endif
+    apr_vsnprintf(rec->msg, sizeof(rec->msg), fmt, ap);
+    apr_atomic_set32(&rec->seq, n + 1);
+}
+
+apr_uint32_t md_log_ring_mark(void)
+{
+    return apr_atomic_read32(&ring_next);
+}
+
+int md_log_ring_drain(apr_uint32_t mark, md_log_ring_cb *cb, void *baton)
+{
+    log_rec_t rec;
+    apr_uint32_t first, next, i, seq;
+#if APR_HAS_THREADS
+    apr_os_thread_t self = apr_os_thread_current();
+#endif
+    int count = 0;
+
+    if (!ring) return 0;
+    next = apr_atomic_read32(&ring_next);
+    first = mark;
+    if (next - first > ring_mask + 1) {
+        first = next - ring_mask - 1;
     }
-    return log_level(log_baton, p, level);
+    for (i = first; i != next; ++i) {
+        /* use the copy only when no writer touched the record meanwhile */
+        seq = apr_atomic_read32(&ring[i & ring_mask].seq);
+        if (seq != i + 1) continue;
+        memcpy(&rec, &ring[i & ring_mask], sizeof(rec));
+        if (apr_atomic_read32(&ring[i & ring_mask].seq) != seq) continue;
+#if APR_HAS_THREADS
+        /* jobs run in parallel, each only gets what its own thread logged */
+        if (!apr_os_thread_equal(rec.thread, self)) continue;
+#endif
+        rec.msg[sizeof(rec.msg)-1] = '\0';
+        cb(baton, rec.file, rec.line, rec.level, rec.rv, rec.time, rec.msg);
+        ++count;
+    }
+    return count;
 }
 
-void md_log_perror(const char *file, int line, md_log_level_t level, 
-                   apr_status_t rv, apr_pool_t *p, const char *fmt, ...)
+void md_log_write(const char *file, int line, md_log_level_t level, 
+                  apr_status_t rv, apr_pool_t *p, const char *fmt, ...)
 {
     va_list ap;
 
-    va_start(ap, fmt);
-    if (log_printv) {
+    if (ring && level >= MD_LOG_TRACE1 && level <= ring_level) {
+        va_start(ap, fmt);
+        ring_add(file, line, level, rv, fmt, ap);
+        va_end(ap);
+    }
+    if (log_printv && (int)level <= log_print_max) {
+        va_start(ap, fmt);
         log_printv(file, line, level, rv, log_baton, p, fmt, ap);
+        va_end(ap);
     }
-    va_end(ap);
 }
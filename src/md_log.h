@@ -40,10 +40,28 @@ typedef enum {
 
 const char *md_log_level_name(md_log_level_t level);
 
+/**
+ * The highest level of messages that are kept, -1 for none. It is updated by
+ * md_log_set() and md_log_ring_init(), not to be changed otherwise.
+ */
+extern int md_log_level_max;
+
+#define MD_LOG_IS_ON(level)     ((int)(level) <= md_log_level_max)
+
 int md_log_is_level(apr_pool_t *p, md_log_level_t level);
 
-void md_log_perror(const char *file, int line, md_log_level_t level, 
-                   apr_status_t rv, apr_pool_t *p, const char *fmt, ...)
+/**
+ * Log a message. For levels not kept, this costs one comparison and the remaining
+ * arguments are not evaluated.
+ */
+#define md_log_perror(...)      MD_LOG_PERROR(__VA_ARGS__)
+#define MD_LOG_PERROR(file, line, level, rv, p, ...) \
+    do { \
+        if (MD_LOG_IS_ON(level)) md_log_write(file, line, level, rv, p, __VA_ARGS__); \
+    } while (0)
+
+void md_log_write(const char *file, int line, md_log_level_t level, 
+                  apr_status_t rv, apr_pool_t *p, const char *fmt, ...)
                                 __attribute__((format(printf,6,7)));
 
 typedef int md_log_level_cb(void *baton, apr_pool_t *p, md_log_level_t level);
@@ -51,6 +69,36 @@ typedef int md_log_level_cb(void *baton, apr_pool_t *p, md_log_level_t level);
 typedef void md_log_print_cb(const char *file, int line, md_log_level_t level, 
                 apr_status_t rv, void *baton, apr_pool_t *p, const char *fmt, va_list ap);
 
+/**
+ * Set where messages go. The level callback is asked here, with a NULL pool, for
+ * each level and its answers are kept until the next call. print_cb only gets the
+ * messages of levels it said yes to.
+ */
 void md_log_set(md_log_level_cb *level_cb, md_log_print_cb *print_cb, void *baton);
 
+/**
+ * Keep the messages of the TRACE levels up to level in a ring of fixed size in
+ * memory, whether the log callbacks want them or not. The ring has room for at
+ * least nrecords, rounded up to a power of 2, and 0 turns it off. Messages are
+ * added without locks or allocations, truncated when too long for a record, and
+ * the oldest ones are overwritten once the ring is full. Not to be called while
+ * messages are logged.
+ */
+apr_status_t md_log_ring_init(apr_pool_t *p, apr_size_t nrecords, md_log_level_t level);
+
+typedef void md_log_ring_cb(void *baton, const char *file, int line, md_log_level_t level, 
+                            apr_status_t rv, apr_time_t at, const char *msg);
+
+/**
+ * The position in the ring the next message goes to, for md_log_ring_drain().
+ */
+apr_uint32_t md_log_ring_mark(void);
+
+/**
+ * Call cb for each message the calling thread added to the ring since mark was
+ * taken, oldest first, and return their number. Messages of other threads and
+ * those overwritten meanwhile are left out.
+ */
+int md_log_ring_drain(apr_uint32_t mark, md_log_ring_cb *cb, void *baton);
+
 #endif /* md_log_h */
@@ -0,0 +1,676 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <apr_lib.h>
+#include <apr_buckets.h>
+#include <apr_date.h>
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <apr_thread_mutex.h>
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ocsp.h>
+#include <openssl/x509.h>
+#include <openssl/x509_vfy.h>
+
+#include "md.h"
+#include "md_crypt.h"
+#include "md_http.h"
+#include "md_json.h"
+#include "md_log.h"
+#include "md_store.h"
+#include "md_util.h"
+#include "md_ocsp.h"
+
+/* when a response has no nextUpdate, get a new one after this time */
+#define MD_OCSP_DEF_LIFETIME        apr_time_from_sec(MD_SECS_PER_DAY / 2)
+/* delays of retries after failed attempts, doubling up to the max */
+#define MD_OCSP_RETRY_MIN           apr_time_from_sec(5 * 60)
+#define MD_OCSP_RETRY_MAX           apr_time_from_sec(60 * 60)
+/* allowed clock skew against the responder, in seconds */
+#define MD_OCSP_MAX_SKEW            (5 * 60)
+/* responses are usually < 2k */
+#define MD_OCSP_MAX_RESP            (64 * 1024)
+
+typedef struct md_ocsp_status_t md_ocsp_status_t;
+struct md_ocsp_status_t {
+    md_ocsp_reg_t *reg;
+    unsigned char id[EVP_MAX_MD_SIZE]; /* SHA-1 fingerprint of the certificate */
+    unsigned int id_len;
+    const char *md_name;               /* MD the certificate belongs to */
+    const char *aspect;                /* name of the response in the store */
+    const char *responder_url;
+    OCSP_CERTID *certid;
+    md_cert_t *issuer;
+
+    unsigned char *der;                /* current response, malloc'ed, or NULL */
+    apr_size_t der_len;
+    int cert_status;                   /* V_OCSP_CERTSTATUS_* of the response */
+    apr_time_t valid_from;             /* thisUpdate of the response */
+    apr_time_t valid_until;            /* nextUpdate of the response or 0 */
+
+    apr_time_t resp_mtime;             /* modification time of the store copy we know */
+    apr_time_t next_try;               /* earliest time for a new request after errors */
+    int errors;                        /* number of failed requests in a row */
+};
+
+struct md_ocsp_reg_t {
+    apr_pool_t *p;
+    md_store_t *store;
+    const char *user_agent;
+    const char *proxy_url;
+    apr_hash_t *hash;                  /* fingerprint -> md_ocsp_status_t* */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+};
+
+static void reg_lock(md_ocsp_reg_t *reg)
+{
+#if APR_HAS_THREADS
+    if (reg->mutex) apr_thread_mutex_lock(reg->mutex);
+#else
+    (void)reg;
+#endif
+}
+
+static void reg_unlock(md_ocsp_reg_t *reg)
+{
+#if APR_HAS_THREADS
+    if (reg->mutex) apr_thread_mutex_unlock(reg->mutex);
+#else
+    (void)reg;
+#endif
+}
+
+apr_status_t md_ocsp_reg_make(md_ocsp_reg_t **preg, apr_pool_t *p, md_store_t *store,
+                              const char *user_agent, const char *proxy_url)
+{
+    md_ocsp_reg_t *reg;
+    apr_status_t rv = APR_SUCCESS;
+
+    reg = apr_pcalloc(p, sizeof(*reg));
+    reg->p = p;
+    reg->store = store;
+    reg->user_agent = user_agent;
+    reg->proxy_url = proxy_url;
+    reg->hash = apr_hash_make(p);
+#if APR_HAS_THREADS
+    rv = apr_thread_mutex_create(&reg->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+#endif
+    *preg = (APR_SUCCESS == rv)? reg : NULL;
+    return rv;
+}
+
+/**************************************************************************************************/
+/* status of a single certificate */
+
+static apr_status_t ostat_cleanup(void *data)
+{
+    md_ocsp_status_t *ostat = data;
+
+    if (ostat->certid) {
+        OCSP_CERTID_free(ostat->certid);
+        ostat->certid = NULL;
+    }
+    if (ostat->der) {
+        free(ostat->der);
+        ostat->der = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+/* Replace the response of ostat, called with the registry locked */
+static apr_status_t ostat_set(md_ocsp_status_t *ostat, const char *der, apr_size_t der_len,
+                              int cert_status, apr_time_t valid_from, apr_time_t valid_until)
+{
+    unsigned char *buf;
+
+    if (!(buf = malloc(der_len))) {
+        return APR_ENOMEM;
+    }
+    memcpy(buf, der, der_len);
+    if (ostat->der) {
+        free(ostat->der);
+    }
+    ostat->der = buf;
+    ostat->der_len = der_len;
+    ostat->cert_status = cert_status;
+    ostat->valid_from = valid_from;
+    ostat->valid_until = valid_until;
+    return APR_SUCCESS;
+}
+
+/* When the response of ostat should be replaced by a new one */
+static apr_time_t ostat_renew_at(md_ocsp_status_t *ostat)
+{
+    if (!ostat->der) {
+        return 0;
+    }
+    if (ostat->valid_until > ostat->valid_from) {
+        /* half way through its validity, so that there is plenty of time for retries */
+        return ostat->valid_until - (ostat->valid_until - ostat->valid_from) / 2;
+    }
+    return ostat->valid_from + MD_OCSP_DEF_LIFETIME;
+}
+
+static const char *cert_status_str(int status)
+{
+    switch (status) {
+        case V_OCSP_CERTSTATUS_GOOD: return "good";
+        case V_OCSP_CERTSTATUS_REVOKED: return "revoked";
+        default: return "unknown";
+    }
+}
+
+static int cert_status_from_str(const char *s)
+{
+    if (s && !strcmp("good", s)) return V_OCSP_CERTSTATUS_GOOD;
+    if (s && !strcmp("revoked", s)) return V_OCSP_CERTSTATUS_REVOKED;
+    return V_OCSP_CERTSTATUS_UNKNOWN;
+}
+
+static apr_time_t json_get_time(md_json_t *json, const char *key)
+{
+    const char *s = md_json_gets(json, key, NULL);
+    return (s && *s)? apr_date_parse_rfc(s) : 0;
+}
+
+static void json_set_time(apr_time_t t, md_json_t *json, const char *key, apr_pool_t *p)
+{
+    char ts[APR_RFC822_DATE_LEN];
+
+    if (t > 0) {
+        apr_rfc822_date(ts, t);
+        md_json_sets(apr_pstrdup(p, ts), json, key, NULL);
+    }
+}
+
+/* If a response is about the certificate of ostat. A renewed certificate
+ * may be primed before the response in the store, still about the old one,
+ * has been replaced. */
+static int ostat_resp_matches(md_ocsp_status_t *ostat, const char *der, apr_size_t der_len)
+{
+    const unsigned char *bf = (const unsigned char*)der;
+    OCSP_RESPONSE *resp;
+    OCSP_BASICRESP *bs = NULL;
+    int matches = 0;
+
+    if ((resp = d2i_OCSP_RESPONSE(NULL, &bf, (long)der_len))
+        && (bs = OCSP_response_get1_basic(resp))) {
+        matches = (OCSP_resp_find(bs, ostat->certid, -1) >= 0);
+    }
+    if (bs) OCSP_BASICRESP_free(bs);
+    if (resp) OCSP_RESPONSE_free(resp);
+    return matches;
+}
+
+/* Pick up a response from the store that is newer than what we have. The store
+ * is read without holding the registry lock, only the result is applied with it. */
+static void ostat_refresh(md_ocsp_status_t *ostat, apr_pool_t *p)
+{
+    md_ocsp_reg_t *reg = ostat->reg;
+    md_json_t *json;
+    const char *s, *der;
+    apr_size_t der_len;
+    apr_time_t mtime, known_mtime, valid_from;
+
+    reg_lock(reg);
+    known_mtime = ostat->resp_mtime;
+    reg_unlock(reg);
+    
+    mtime = md_store_get_modified(reg->store, MD_SG_OCSP, ostat->md_name, ostat->aspect, p);
+    if (!mtime || mtime == known_mtime) {
+        return;
+    }
+    if (APR_SUCCESS != md_store_load(reg->store, MD_SG_OCSP, ostat->md_name, ostat->aspect,
+                                     MD_SV_JSON, (void**)&json, p)) {
+        return;
+    }
+    s = md_json_gets(json, MD_KEY_RESPONSE, NULL);
+    if (!s || !(der_len = md_util_base64url_decode(&der, s, p))) {
+        return;
+    }
+    if (!ostat_resp_matches(ostat, der, der_len)) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: OCSP response %s in store is "
+                      "for another certificate", ostat->md_name, ostat->aspect);
+        return;
+    }
+    valid_from = json_get_time(json, MD_KEY_VALID_FROM);
+    
+    reg_lock(reg);
+    ostat->resp_mtime = mtime;
+    if (!ostat->der || valid_from > ostat->valid_from) {
+        ostat_set(ostat, der, der_len, 
+                  cert_status_from_str(md_json_gets(json, MD_KEY_STATUS, NULL)),
+                  valid_from, json_get_time(json, MD_KEY_VALID_UNTIL));
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: loaded OCSP response %s, "
+                      "status %s", ostat->md_name, ostat->aspect, 
+                      cert_status_str(ostat->cert_status));
+    }
+    reg_unlock(reg);
+}
+
+/* All certificates primed so far. Entries are never removed from the registry,
+ * so they may be used after letting go of the lock. */
+static apr_array_header_t *reg_all(md_ocsp_reg_t *reg, apr_pool_t *p)
+{
+    apr_array_header_t *all;
+    apr_hash_index_t *hi;
+    void *val;
+
+    all = apr_array_make(p, 10, sizeof(md_ocsp_status_t*));
+    reg_lock(reg);
+    for (hi = apr_hash_first(p, reg->hash); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, &val);
+        APR_ARRAY_PUSH(all, md_ocsp_status_t*) = val;
+    }
+    reg_unlock(reg);
+    return all;
+}
+
+/* Save a response of ostat in the store, called without the registry lock */
+static apr_status_t ostat_save(md_ocsp_status_t *ostat, const char *der, apr_size_t der_len,
+                               int cert_status, apr_time_t valid_from, 
+                               apr_time_t valid_until, apr_pool_t *p)
+{
+    md_json_t *json;
+
+    json = md_json_create(p);
+    md_json_sets(md_util_base64url_encode(der, der_len, p), json, MD_KEY_RESPONSE, NULL);
+    md_json_sets(cert_status_str(cert_status), json, MD_KEY_STATUS, NULL);
+    json_set_time(valid_from, json, MD_KEY_VALID_FROM, p);
+    json_set_time(valid_until, json, MD_KEY_VALID_UNTIL, p);
+    return md_store_save(ostat->reg->store, p, MD_SG_OCSP, ostat->md_name, ostat->aspect,
+                         MD_SV_JSON, json, 0);
+}
+
+/**************************************************************************************************/
+/* registry */
+
+static apr_status_t cert_fingerprint(unsigned char *id, unsigned int *pid_len, X509 *x)
+{
+    return X509_digest(x, EVP_sha1(), id, pid_len)? APR_SUCCESS : APR_EGENERAL;
+}
+
+apr_status_t md_ocsp_prime(md_ocsp_reg_t *reg, md_cert_t *cert, md_cert_t *issuer,
+                           const char *md_name, const char *aspect, apr_pool_t *p)
+{
+    md_ocsp_status_t *ostat = NULL;
+    unsigned char id[EVP_MAX_MD_SIZE];
+    unsigned int id_len;
+    OCSP_CERTID *certid;
+    const char *url;
+    X509 *x = md_cert_get_X509(cert);
+    apr_status_t rv;
+
+    if (APR_SUCCESS != (rv = cert_fingerprint(id, &id_len, x))) {
+        return rv;
+    }
+
+    /* certificates are also primed at runtime, on hot activations, so reg->p
+     * is only used with the registry locked and for certificates not seen before */
+    reg_lock(reg);
+    if (apr_hash_get(reg->hash, id, (apr_ssize_t)id_len)) {
+        /* already primed */
+        goto out;
+    }
+    if (APR_SUCCESS != (rv = md_cert_get_ocsp_responder_url(&url, cert, p))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p,
+                      "%s: certificate %s names no OCSP responder", md_name, aspect);
+        goto out;
+    }
+    if (!(certid = OCSP_cert_to_id(NULL, x, md_cert_get_X509(issuer)))) {
+        rv = APR_EGENERAL;
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p,
+                      "%s: unable to create OCSP certificate id for %s", md_name, aspect);
+        goto out;
+    }
+    ostat = apr_pcalloc(reg->p, sizeof(*ostat));
+    memcpy(ostat->id, id, id_len);
+    ostat->id_len = id_len;
+    ostat->certid = certid;
+    apr_pool_cleanup_register(reg->p, ostat, ostat_cleanup, apr_pool_cleanup_null);
+    ostat->reg = reg;
+    ostat->md_name = apr_pstrdup(reg->p, md_name);
+    ostat->aspect = apr_pstrdup(reg->p, aspect);
+    ostat->responder_url = apr_pstrdup(reg->p, url);
+    ostat->issuer = md_cert_ref(issuer, reg->p);
+    ostat->cert_status = V_OCSP_CERTSTATUS_UNKNOWN;
+    apr_hash_set(reg->hash, ostat->id, (apr_ssize_t)ostat->id_len, ostat);
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: primed OCSP stapling for %s, "
+                  "responder %s", md_name, aspect, url);
+out:
+    reg_unlock(reg);
+    if (ostat) {
+        ostat_refresh(ostat, p);
+    }
+    return rv;
+}
+
+int md_ocsp_count(md_ocsp_reg_t *reg)
+{
+    return reg? (int)apr_hash_count(reg->hash) : 0;
+}
+
+apr_status_t md_ocsp_get_resp_der(const unsigned char **pder, apr_size_t *pder_len,
+                                  md_ocsp_reg_t *reg, void *x509, apr_pool_t *p)
+{
+    md_ocsp_status_t *ostat;
+    unsigned char id[EVP_MAX_MD_SIZE];
+    unsigned int id_len;
+    apr_status_t rv;
+
+    *pder = NULL;
+    *pder_len = 0;
+    if (APR_SUCCESS != (rv = cert_fingerprint(id, &id_len, x509))) {
+        return rv;
+    }
+
+    /* called during handshakes, only what is in memory is looked at */
+    rv = APR_ENOENT;
+    reg_lock(reg);
+    ostat = apr_hash_get(reg->hash, id, (apr_ssize_t)id_len);
+    if (ostat && ostat->der 
+        && (!ostat->valid_until || apr_time_now() < ostat->valid_until)) {
+        *pder = apr_pmemdup(p, ostat->der, ostat->der_len);
+        *pder_len = ostat->der_len;
+        rv = APR_SUCCESS;
+    }
+    reg_unlock(reg);
+    return rv;
+}
+
+void md_ocsp_reload(md_ocsp_reg_t *reg, apr_pool_t *p)
+{
+    apr_array_header_t *all;
+    int i;
+
+    all = reg_all(reg, p);
+    for (i = 0; i < all->nelts; ++i) {
+        ostat_refresh(APR_ARRAY_IDX(all, i, md_ocsp_status_t*), p);
+    }
+}
+
+/**************************************************************************************************/
+/* response retrieval */
+
+typedef struct {
+    md_ocsp_status_t *ostat;
+    OCSP_REQUEST *req;
+    apr_pool_t *p;
+    apr_status_t rv;
+    const char *der;
+    apr_size_t der_len;
+    int cert_status;
+    apr_time_t valid_from;
+    apr_time_t valid_until;
+} ocsp_fetch_ctx;
+
+static apr_status_t resp_verify(ocsp_fetch_ctx *ctx, OCSP_RESPONSE *resp)
+{
+    md_ocsp_status_t *ostat = ctx->ostat;
+    OCSP_BASICRESP *bs = NULL;
+    X509_STORE *xstore = NULL;
+    ASN1_GENERALIZEDTIME *this_upd = NULL, *next_upd = NULL, *rev_time = NULL;
+    int status, reason;
+    apr_status_t rv = APR_EINVAL;
+
+    if (OCSP_RESPONSE_STATUS_SUCCESSFUL != (status = OCSP_response_status(resp))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, ctx->p, "%s: OCSP responder %s "
+                      "answered with status %s", ostat->md_name, ostat->responder_url,
+                      OCSP_response_status_str(status));
+        goto out;
+    }
+    if (!(bs = OCSP_response_get1_basic(resp))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, ctx->p, "%s: OCSP response from %s "
+                      "has no basic response", ostat->md_name, ostat->responder_url);
+        goto out;
+    }
+    if (OCSP_check_nonce(ctx->req, bs) == 0) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, ctx->p, "%s: OCSP response from %s "
+                      "has a wrong nonce", ostat->md_name, ostat->responder_url);
+        goto out;
+    }
+
+    /* The response is signed by the issuer or by a responder certificate the
+     * issuer delegated to. The issuer is all we trust here. */
+    if (!(xstore = X509_STORE_new())
+        || !X509_STORE_add_cert(xstore, md_cert_get_X509(ostat->issuer))) {
+        rv = APR_ENOMEM;
+        goto out;
+    }
+#ifdef X509_V_FLAG_PARTIAL_CHAIN
+    X509_STORE_set_flags(xstore, X509_V_FLAG_PARTIAL_CHAIN);
+#endif
+    if (OCSP_basic_verify(bs, NULL, xstore, 0) <= 0) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, ctx->p, "%s: OCSP response from %s "
+                      "does not verify: %s", ostat->md_name, ostat->responder_url,
+                      ERR_reason_error_string(ERR_get_error()));
+        goto out;
+    }
+
+    if (!OCSP_resp_find_status(bs, ostat->certid, &status, &reason,
+                               &rev_time, &this_upd, &next_upd)) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, ctx->p, "%s: OCSP response from %s "
+                      "is not about %s", ostat->md_name, ostat->responder_url, ostat->aspect);
+        goto out;
+    }
+    if (!OCSP_check_validity(this_upd, next_upd, MD_OCSP_MAX_SKEW, -1)) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, ctx->p, "%s: OCSP response from %s "
+                      "is not valid now", ostat->md_name, ostat->responder_url);
+        goto out;
+    }
+
+    ctx->cert_status = status;
+    ctx->valid_from = md_asn1_time_get(this_upd);
+    ctx->valid_until = next_upd? md_asn1_time_get(next_upd) : 0;
+    rv = APR_SUCCESS;
+
+out:
+    if (xstore) X509_STORE_free(xstore);
+    if (bs) OCSP_BASICRESP_free(bs);
+    return rv;
+}
+
+static apr_status_t on_ocsp_resp(const md_http_response_t *res)
+{
+    ocsp_fetch_ctx *ctx = res->req->baton;
+    md_ocsp_status_t *ostat = ctx->ostat;
+    OCSP_RESPONSE *resp = NULL;
+    const unsigned char *bf;
+    char *der;
+    apr_size_t der_len;
+    apr_off_t body_len;
+    apr_status_t rv;
+
+    if (res->status != 200) {
+        rv = APR_EINVAL;
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, ctx->p, "%s: OCSP responder %s "
+                      "answered with HTTP status %d", ostat->md_name, ostat->responder_url,
+                      res->status);
+        goto out;
+    }
+    if (!res->body
+        || APR_SUCCESS != (rv = apr_brigade_length(res->body, 1, &body_len))
+        || body_len > MD_OCSP_MAX_RESP
+        || APR_SUCCESS != (rv = apr_brigade_pflatten(res->body, &der, &der_len, ctx->p))) {
+        rv = APR_EINVAL;
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, ctx->p, "%s: reading OCSP response "
+                      "from %s", ostat->md_name, ostat->responder_url);
+        goto out;
+    }
+
+    bf = (const unsigned char*)der;
+    if (!(resp = d2i_OCSP_RESPONSE(NULL, &bf, (long)der_len))) {
+        rv = APR_EINVAL;
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, ctx->p, "%s: unable to parse OCSP "
+                      "response from %s", ostat->md_name, ostat->responder_url);
+        goto out;
+    }
+    if (APR_SUCCESS == (rv = resp_verify(ctx, resp))) {
+        ctx->der = der;
+        ctx->der_len = der_len;
+    }
+
+out:
+    if (resp) OCSP_RESPONSE_free(resp);
+    ctx->rv = rv;
+    return rv;
+}
+
+static apr_status_t ostat_fetch(md_ocsp_status_t *ostat, md_http_t *http, apr_pool_t *p)
+{
+    ocsp_fetch_ctx ctx;
+    OCSP_CERTID *certid = NULL;
+    unsigned char *req_der = NULL;
+    int req_len;
+    apr_time_t mtime;
+    apr_status_t rv = APR_ENOMEM;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.ostat = ostat;
+    ctx.p = p;
+    ctx.rv = APR_ENOENT;
+
+    if (!(ctx.req = OCSP_REQUEST_new())
+        || !(certid = OCSP_CERTID_dup(ostat->certid))
+        || !OCSP_request_add0_id(ctx.req, certid)) {
+        if (certid) OCSP_CERTID_free(certid);
+        goto out;
+    }
+    /* certid is owned by the request now */
+    OCSP_request_add1_nonce(ctx.req, NULL, -1);
+    if ((req_len = i2d_OCSP_REQUEST(ctx.req, &req_der)) <= 0) {
+        goto out;
+    }
+
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: requesting OCSP response for %s "
+                  "from %s", ostat->md_name, ostat->aspect, ostat->responder_url);
+    rv = md_http_POSTd(http, ostat->responder_url, NULL, "application/ocsp-request",
+                       (const char*)req_der, (size_t)req_len, on_ocsp_resp, &ctx);
+    if (APR_SUCCESS == rv) {
+        rv = ctx.rv;
+    }
+    if (APR_SUCCESS != rv) goto out;
+
+    /* handshakes only wait for the response to be replaced in memory */
+    reg_lock(ostat->reg);
+    rv = ostat_set(ostat, ctx.der, ctx.der_len, ctx.cert_status,
+                   ctx.valid_from, ctx.valid_until);
+    reg_unlock(ostat->reg);
+    if (APR_SUCCESS == rv) {
+        rv = ostat_save(ostat, ctx.der, ctx.der_len, ctx.cert_status,
+                        ctx.valid_from, ctx.valid_until, p);
+        mtime = md_store_get_modified(ostat->reg->store, MD_SG_OCSP,
+                                      ostat->md_name, ostat->aspect, p);
+        reg_lock(ostat->reg);
+        ostat->resp_mtime = mtime;
+        reg_unlock(ostat->reg);
+    }
+    if (APR_SUCCESS == rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, p, "%s: new OCSP response for %s, "
+                      "status %s", ostat->md_name, ostat->aspect,
+                      cert_status_str(ctx.cert_status));
+    }
+
+out:
+    if (req_der) OPENSSL_free(req_der);
+    if (ctx.req) OCSP_REQUEST_free(ctx.req);
+    return rv;
+}
+
+apr_status_t md_ocsp_renew(md_ocsp_reg_t *reg, apr_pool_t *p, apr_time_t *pnext_run)
+{
+    apr_array_header_t *all, *due;
+    apr_hash_index_t *hi;
+    md_ocsp_status_t *ostat;
+    md_http_t *http = NULL;
+    void *val;
+    apr_time_t now, renew_at, delay, next_run = 0;
+    apr_status_t rv = APR_SUCCESS;
+    int i, fetched;
+
+    /* collect the certificates that need a new response, after picking up
+     * what other processes saved */
+    all = reg_all(reg, p);
+    for (i = 0; i < all->nelts; ++i) {
+        ostat_refresh(APR_ARRAY_IDX(all, i, md_ocsp_status_t*), p);
+    }
+    due = apr_array_make(p, 10, sizeof(md_ocsp_status_t*));
+    now = apr_time_now();
+    reg_lock(reg);
+    for (i = 0; i < all->nelts; ++i) {
+        ostat = APR_ARRAY_IDX(all, i, md_ocsp_status_t*);
+        renew_at = ostat_renew_at(ostat);
+        if (renew_at < ostat->next_try) {
+            renew_at = ostat->next_try;
+        }
+        if (renew_at <= now) {
+            APR_ARRAY_PUSH(due, md_ocsp_status_t*) = ostat;
+        }
+    }
+    reg_unlock(reg);
+
+    for (i = 0; i < due->nelts; ++i) {
+        ostat = APR_ARRAY_IDX(due, i, md_ocsp_status_t*);
+        if (!http) {
+            if (APR_SUCCESS != (rv = md_http_create(&http, p, reg->user_agent, reg->proxy_url))) {
+                md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "create http for OCSP requests");
+                goto out;
+            }
+            md_http_set_response_limit(http, MD_OCSP_MAX_RESP);
+        }
+        fetched = (APR_SUCCESS == ostat_fetch(ostat, http, p));
+        reg_lock(reg);
+        if (fetched) {
+            ostat->errors = 0;
+            ostat->next_try = 0;
+        }
+        else {
+            /* keep stapling what we have while it is valid, retry with increasing delays */
+            delay = MD_OCSP_RETRY_MIN << (ostat->errors < 4? ostat->errors : 4);
+            ostat->next_try = apr_time_now() + (delay < MD_OCSP_RETRY_MAX?
+                                                delay : MD_OCSP_RETRY_MAX);
+            ++ostat->errors;
+        }
+        reg_unlock(reg);
+    }
+
+out:
+    /* when is the next renewal due? */
+    reg_lock(reg);
+    for (hi = apr_hash_first(p, reg->hash); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, &val);
+        ostat = val;
+        renew_at = ostat_renew_at(ostat);
+        if (renew_at < ostat->next_try) {
+            renew_at = ostat->next_try;
+        }
+        if (!next_run || renew_at < next_run) {
+            next_run = renew_at;
+        }
+    }
+    reg_unlock(reg);
+    now = apr_time_now();
+    *pnext_run = (next_run > now)? next_run : now + MD_OCSP_RETRY_MIN;
+    return rv;
+}
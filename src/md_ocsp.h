@@ -0,0 +1,70 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef mod_md_md_ocsp_h
+#define mod_md_md_ocsp_h
+
+struct md_cert_t;
+struct md_store_t;
+
+/**
+ * A registry of the OCSP responses for managed certificates. Certificates are
+ * primed once, responses are fetched from the responder named in the certificate,
+ * kept in memory and persisted in the store group MD_SG_OCSP, so that all
+ * processes with the same store can staple them.
+ */
+typedef struct md_ocsp_reg_t md_ocsp_reg_t;
+
+apr_status_t md_ocsp_reg_make(md_ocsp_reg_t **preg, apr_pool_t *p,
+                              struct md_store_t *store,
+                              const char *user_agent, const char *proxy_url);
+
+/**
+ * Register a certificate with its issuer for stapling. Its response is kept under
+ * the MD's name with the given aspect. Returns APR_ENOENT if the certificate does
+ * not name an OCSP responder.
+ */
+apr_status_t md_ocsp_prime(md_ocsp_reg_t *reg, struct md_cert_t *cert,
+                           struct md_cert_t *issuer, const char *md_name,
+                           const char *aspect, apr_pool_t *p);
+
+/**
+ * Number of certificates primed in the registry.
+ */
+int md_ocsp_count(md_ocsp_reg_t *reg);
+
+/**
+ * Get the DER encoded OCSP response for a primed certificate (given as X509*),
+ * allocated from pool p. Only looks at the responses in memory, the store is
+ * not touched. Returns APR_ENOENT when there is no response that is valid now.
+ */
+apr_status_t md_ocsp_get_resp_der(const unsigned char **pder, apr_size_t *pder_len,
+                                  md_ocsp_reg_t *reg, void *x509, apr_pool_t *p);
+
+/**
+ * Pick up the responses that other processes saved in the store since this
+ * one last looked. The store is read without blocking md_ocsp_get_resp_der().
+ */
+void md_ocsp_reload(md_ocsp_reg_t *reg, apr_pool_t *p);
+
+/**
+ * Fetch new responses for all primed certificates whose response is missing or
+ * approaching its nextUpdate, and save them in the store. Sets *pnext_run to the
+ * time when the next renewal is due.
+ */
+apr_status_t md_ocsp_renew(md_ocsp_reg_t *reg, apr_pool_t *p, apr_time_t *pnext_run);
+
+#endif /* md_ocsp_h */
@@ -0,0 +1,195 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include <apr_pools.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+
+#include "md.h"
+#include "md_crypt.h"
+#include "md_plan.h"
+#include "md_util.h"
+
+static int str_eq(const char *s1, const char *s2)
+{
+    if (s1 == s2) return 1;
+    return s1 && s2 && !strcmp(s1, s2);
+}
+
+static int strs_eq(const apr_array_header_t *a1, const apr_array_header_t *a2)
+{
+    if (!a1 || !a2) return a1 == a2;
+    return md_array_str_eq(a1, a2, 0);
+}
+
+static int pkey_specs_eq(const apr_array_header_t *a1, const apr_array_header_t *a2)
+{
+    int i;
+    
+    if (!a1 || !a2) return (a1? a1->nelts : 0) == (a2? a2->nelts : 0);
+    if (a1->nelts != a2->nelts) return 0;
+    for (i = 0; i < a1->nelts; ++i) {
+        if (!md_pkey_spec_eq(APR_ARRAY_IDX(a1, i, md_pkey_spec_t*), 
+                             APR_ARRAY_IDX(a2, i, md_pkey_spec_t*))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int md_plan_compatible(const md_t *md1, const md_t *md2, apr_pool_t *p)
+{
+    return (md1->sc == md2->sc
+            && md1->transitive == md2->transitive
+            && md1->require_https == md2->require_https
+            && md1->drive_mode == md2->drive_mode
+            && md1->must_staple == md2->must_staple
+            && md1->renew_norm == md2->renew_norm
+            && md1->renew_window == md2->renew_window
+            && md_pkey_spec_eq(md1->pkey_spec, md2->pkey_spec)
+            && pkey_specs_eq(md1->alt_pkey_specs, md2->alt_pkey_specs)
+            && str_eq(md1->ca_url, md2->ca_url)
+            && strs_eq(md1->ca_urls, md2->ca_urls)
+            && str_eq(md1->ca_proto, md2->ca_proto)
+            && str_eq(md1->ca_agreement, md2->ca_agreement)
+            && strs_eq(md1->ca_challenges, md2->ca_challenges)
+            && strs_eq(md1->contacts, md2->contacts)
+            && !md_domains_overlap(md1, md2, p));
+}
+
+typedef struct {
+    apr_array_header_t *mds;         /* md_t* of the group */
+    apr_array_header_t *names;       /* the domains of all of them */
+    md_dns_set_t *set;               /* the same, for lookups */
+    apr_array_header_t *kept;        /* names without the ones covered by wildcards */
+} plan_group_t;
+
+/* How many names the group's certificate grows by with the md, which has the minimal
+ * names mnames, or -1 if the md does not fit. */
+static int group_growth(plan_group_t *g, const md_t *md, apr_array_header_t *mnames, 
+                        int max_names, apr_pool_t *p)
+{
+    const char *name, *kname;
+    int i, j, added = 0, removed = 0;
+    
+    for (i = 0; i < md->domains->nelts; ++i) {
+        if (md_dns_set_get(g->set, APR_ARRAY_IDX(md->domains, i, const char*))) {
+            return -1;
+        }
+    }
+    if (!md_plan_compatible(APR_ARRAY_IDX(g->mds, 0, const md_t*), md, p)) {
+        return -1;
+    }
+    for (i = 0; i < mnames->nelts; ++i) {
+        name = APR_ARRAY_IDX(mnames, i, const char*);
+        if (!md_dns_set_match(g->set, name)) {
+            ++added;
+        }
+        if (name[0] == '*' && name[1] == '.') {
+            /* plain names of the group it covers are no longer needed */
+            for (j = 0; j < g->kept->nelts; ++j) {
+                kname = APR_ARRAY_IDX(g->kept, j, const char*);
+                if (kname[0] != '*' && md_dns_matches(name, kname)) {
+                    ++removed;
+                }
+            }
+        }
+    }
+    if (g->kept->nelts + added - removed > max_names) {
+        return -1;
+    }
+    return (added > removed)? added - removed : 0;
+}
+
+static void group_add(plan_group_t *g, md_t *md, apr_pool_t *ptemp)
+{
+    const char *name;
+    int i;
+    
+    APR_ARRAY_PUSH(g->mds, md_t*) = md;
+    for (i = 0; i < md->domains->nelts; ++i) {
+        name = APR_ARRAY_IDX(md->domains, i, const char*);
+        APR_ARRAY_PUSH(g->names, const char*) = name;
+        md_dns_set_add(g->set, name);
+    }
+    g->kept = md_dns_make_minimal(ptemp, g->names);
+}
+
+apr_array_header_t *md_plan_groups(apr_pool_t *p, const apr_array_header_t *mds, 
+                                   int max_names)
+{
+    apr_pool_t *ptemp;
+    apr_array_header_t *groups, *result, *mnames;
+    plan_group_t *g, *best;
+    md_t *md;
+    int i, j, growth, best_growth;
+    
+    result = apr_array_make(p, mds->nelts, sizeof(apr_array_header_t*));
+    if (APR_SUCCESS != apr_pool_create(&ptemp, p)) {
+        return result;
+    }
+    groups = apr_array_make(ptemp, mds->nelts, sizeof(plan_group_t*));
+    for (i = 0; i < mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(mds, i, md_t*);
+        mnames = md_dns_make_minimal(ptemp, md->domains);
+        best = NULL;
+        best_growth = 0;
+        for (j = 0; j < groups->nelts; ++j) {
+            g = APR_ARRAY_IDX(groups, j, plan_group_t*);
+            growth = group_growth(g, md, mnames, max_names, ptemp);
+            if (growth >= 0 && (!best || growth < best_growth)) {
+                best = g;
+                best_growth = growth;
+                if (growth == 0) break;
+            }
+        }
+        if (!best) {
+            best = apr_pcalloc(ptemp, sizeof(*best));
+            best->mds = apr_array_make(p, 5, sizeof(md_t*));
+            best->names = apr_array_make(ptemp, 5, sizeof(const char*));
+            best->set = md_dns_set_make(ptemp, NULL);
+            APR_ARRAY_PUSH(groups, plan_group_t*) = best;
+        }
+        group_add(best, md, ptemp);
+    }
+    for (i = 0; i < groups->nelts; ++i) {
+        g = APR_ARRAY_IDX(groups, i, plan_group_t*);
+        APR_ARRAY_PUSH(result, apr_array_header_t*) = g->mds;
+    }
+    apr_pool_destroy(ptemp);
+    return result;
+}
+
+md_t *md_plan_merge(apr_pool_t *p, const apr_array_header_t *group)
+{
+    const md_t *m;
+    md_t *md;
+    int i, j;
+    
+    assert(group->nelts > 0);
+    md = md_copy(p, APR_ARRAY_IDX(group, 0, const md_t*));
+    for (i = 1; i < group->nelts; ++i) {
+        m = APR_ARRAY_IDX(group, i, const md_t*);
+        for (j = 0; j < m->domains->nelts; ++j) {
+            APR_ARRAY_PUSH(md->domains, const char*) = 
+                APR_ARRAY_IDX(m->domains, j, const char*);
+        }
+    }
+    return md;
+}
@@ -0,0 +1,54 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef mod_md_md_plan_h
+#define mod_md_md_plan_h
+
+struct apr_array_header_t;
+struct md_t;
+
+/**
+ * Planning of certificates shared by several MDs. Each MD is a certificate of its
+ * own, with an order, keys and files in the store. MDs configured alike may as well
+ * share one, up to the number of names a CA allows in a certificate. Names covered
+ * by a wildcard in the same certificate do not count, see md_dns_make_minimal().
+ */
+
+/**
+ * Return != 0 iff a certificate for md1 would also do for md2: same CA, account
+ * settings, challenges, keys, renewal and drive mode, and no domain in common.
+ */
+int md_plan_compatible(const struct md_t *md1, const struct md_t *md2, apr_pool_t *p);
+
+/**
+ * Group the mds, so that the MDs in a group are compatible and their names, after
+ * removing those covered by wildcards, number at most max_names. Returns an array
+ * of apr_array_header_t* of md_t*, in the order of the first MD in each group. An
+ * MD is added to the group whose certificate gets the fewest additional names, so
+ * that names go together with wildcards covering them. MDs that share with no
+ * other are groups of their own.
+ */
+struct apr_array_header_t *md_plan_groups(apr_pool_t *p, 
+                                          const struct apr_array_header_t *mds, 
+                                          int max_names);
+
+/**
+ * Get the group's MDs as a single one, with the name and definition of the first
+ * and the domains of all.
+ */
+struct md_t *md_plan_merge(apr_pool_t *p, const struct apr_array_header_t *group);
+
+#endif /* md_plan_h */
@@ -22,6 +22,7 @@
 #include <apr_lib.h>
 #include <apr_hash.h>
 #include <apr_strings.h>
+#include <apr_thread_mutex.h>
 #include <apr_uri.h>
 
 #include "md.h"
@@ -36,11 +37,17 @@
 #include "md_acme_acct.h"
 
 struct md_reg_t {
+    apr_pool_t *p;
     struct md_store_t *store;
     struct apr_hash_t *protos;
     int can_http;
     int can_https;
     const char *proxy_url;
+    struct apr_hash_t *state_cache;
+    struct apr_hash_t *cred_cache;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *state_mutex;
+#endif
 };
 
 /**************************************************************************************************/
@@ -74,12 +81,22 @@ apr_status_t md_reg_init(md_reg_t **preg, apr_pool_t *p, struct md_store_t *stor
     apr_status_t rv;
     
     reg = apr_pcalloc(p, sizeof(*reg));
+    reg->p = p;
     reg->store = store;
     reg->protos = apr_hash_make(p);
     reg->can_http = 1;
     reg->can_https = 1;
     reg->proxy_url = proxy_url? apr_pstrdup(p, proxy_url) : NULL;
+    reg->state_cache = apr_hash_make(p);
+    reg->cred_cache = apr_hash_make(p);
     
+#if APR_HAS_THREADS
+    rv = apr_thread_mutex_create(&reg->state_mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (APR_SUCCESS != rv) {
+        *preg = NULL;
+        return rv;
+    }
+#endif
     if (APR_SUCCESS == (rv = md_acme_protos_add(reg->protos, p))) {
         rv = load_props(reg, p);
     }
@@ -146,12 +163,24 @@ static apr_status_t check_values(md_reg_t *reg, apr_pool_t *p, const md_t *md, i
     }
     
     if ((MD_UPD_CA_URL & fields) && md->ca_url) { /* setting to empty is ok */
+        const char *s;
+        int i;
+        
         rv = md_util_abs_uri_check(p, md->ca_url, &err);
         if (err) {
             md_log_perror(MD_LOG_MARK, MD_LOG_ERR, APR_EINVAL, p, 
                           "CA url for %s invalid (%s): %s", md->name, err, md->ca_url);
             return APR_EINVAL;
         }
+        for (i = 0; md->ca_urls && i < md->ca_urls->nelts; ++i) {
+            s = APR_ARRAY_IDX(md->ca_urls, i, const char*);
+            rv = md_util_abs_uri_check(p, s, &err);
+            if (err) {
+                md_log_perror(MD_LOG_MARK, MD_LOG_ERR, APR_EINVAL, p, 
+                              "CA url for %s invalid (%s): %s", md->name, err, s);
+                return APR_EINVAL;
+            }
+        }
     }
     
     if ((MD_UPD_CA_PROTO & fields) && md->ca_proto) { /* setting to empty is ok */
@@ -178,16 +207,377 @@ static apr_status_t check_values(md_reg_t *reg, apr_pool_t *p, const md_t *md, i
 /**************************************************************************************************/
 /* state assessment */
 
+/**************************************************************************************************/
+/* state cache */
+
+/* Assessing the state of a md means loading its key and certificate chain and checking
+ * them. The result only changes when those files do, when the md's domains or must-staple
+ * setting change or when a certificate in the chain runs out. Remember it until then. */
+typedef struct {
+    apr_time_t key_mtime;
+    apr_time_t cert_mtime;
+    const char *domains;
+    int must_staple;
+    md_state_t state;
+    apr_time_t valid_from;
+    apr_time_t expires;
+    apr_time_t refresh_at;     /* 0 if the state does not change over time */
+} state_cache_entry;
+
+static void state_cache_lock(md_reg_t *reg)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(reg->state_mutex);
+#else
+    (void)reg;
+#endif
+}
+
+static void state_cache_unlock(md_reg_t *reg)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(reg->state_mutex);
+#else
+    (void)reg;
+#endif
+}
+
+static int state_cache_get(md_reg_t *reg, const md_t *md, const char *domains, 
+                           apr_time_t key_mtime, apr_time_t cert_mtime, md_state_t *pstate, 
+                           apr_time_t *pvalid_from, apr_time_t *pexpires)
+{
+    state_cache_entry *entry;
+    int found = 0;
+    
+    if (!key_mtime || !cert_mtime) {
+        return 0;
+    }
+    state_cache_lock(reg);
+    entry = apr_hash_get(reg->state_cache, md->name, APR_HASH_KEY_STRING);
+    if (entry 
+        && entry->key_mtime == key_mtime && entry->cert_mtime == cert_mtime
+        && !entry->must_staple == !md->must_staple && !strcmp(entry->domains, domains)
+        && (!entry->refresh_at || apr_time_now() < entry->refresh_at)) {
+        *pstate = entry->state;
+        *pvalid_from = entry->valid_from;
+        *pexpires = entry->expires;
+        found = 1;
+    }
+    state_cache_unlock(reg);
+    return found;
+}
+
+static void state_cache_set(md_reg_t *reg, const md_t *md, const char *domains, 
+                            apr_time_t key_mtime, apr_time_t cert_mtime, 
+                            md_state_t state, apr_time_t valid_from, apr_time_t expires, 
+                            apr_time_t refresh_at)
+{
+    state_cache_entry *entry;
+    
+    if (!key_mtime || !cert_mtime) {
+        return;
+    }
+    state_cache_lock(reg);
+    entry = apr_hash_get(reg->state_cache, md->name, APR_HASH_KEY_STRING);
+    if (!entry) {
+        entry = apr_pcalloc(reg->p, sizeof(*entry));
+        apr_hash_set(reg->state_cache, apr_pstrdup(reg->p, md->name), APR_HASH_KEY_STRING, entry);
+    }
+    if (!entry->domains || strcmp(entry->domains, domains)) {
+        entry->domains = apr_pstrdup(reg->p, domains);
+    }
+    entry->key_mtime = key_mtime;
+    entry->cert_mtime = cert_mtime;
+    entry->must_staple = md->must_staple;
+    entry->state = state;
+    entry->valid_from = valid_from;
+    entry->expires = expires;
+    entry->refresh_at = refresh_at;
+    state_cache_unlock(reg);
+}
+
+/* Sum of the modification times of the files for all additional key specs. Any 
+ * change of those files, including their removal, changes the sum. */
+static apr_time_t alt_mtimes(md_reg_t *reg, const md_t *md, int certs, apr_pool_t *p)
+{
+    md_pkey_spec_t *spec;
+    apr_time_t sum = 0;
+    int i;
+    
+    for (i = 0; md->alt_pkey_specs && i < md->alt_pkey_specs->nelts; ++i) {
+        spec = APR_ARRAY_IDX(md->alt_pkey_specs, i, md_pkey_spec_t*);
+        sum += md_store_get_modified(reg->store, MD_SG_DOMAINS, md->name, certs? 
+                                     md_pubcert_fname_for(spec, p) : md_pkey_fname_for(spec, p), 
+                                     p);
+    }
+    return sum;
+}
+
+static void cred_mtimes(md_reg_t *reg, const md_t *md, apr_time_t *pkey_mtime, 
+                        apr_time_t *pcert_mtime, apr_pool_t *p)
+{
+    *pkey_mtime = md_store_get_modified(reg->store, MD_SG_DOMAINS, md->name, MD_FN_PRIVKEY, p);
+    *pcert_mtime = md_store_get_modified(reg->store, MD_SG_DOMAINS, md->name, MD_FN_PUBCERT, p);
+    if (*pkey_mtime && *pcert_mtime) {
+        *pkey_mtime += alt_mtimes(reg, md, 0, p);
+        *pcert_mtime += alt_mtimes(reg, md, 1, p);
+    }
+}
+
+/* The parsed keys and chains of an MD, for the primary and all additional key specs,
+ * as long as their files stay the same. Handed out as references, so that all servers
+ * of an MD share the same objects. Each entry has its own pool, replaced on change. */
+typedef struct {
+    apr_pool_t *p;
+    apr_time_t key_mtime;
+    apr_time_t cert_mtime;
+    apr_array_header_t *pkeys;         /* md_pkey_t*, primary first, NULL if missing */
+    apr_array_header_t *chains;        /* apr_array_header_t* of md_cert_t*, or NULL */
+} cred_cache_entry;
+
+static int cred_cache_is_for(cred_cache_entry *entry, const md_t *md, 
+                             apr_time_t key_mtime, apr_time_t cert_mtime)
+{
+    int n = md->alt_pkey_specs? md->alt_pkey_specs->nelts : 0;
+    
+    return (entry && entry->key_mtime == key_mtime && entry->cert_mtime == cert_mtime 
+            && entry->pkeys->nelts == n + 1);
+}
+
+/* Read and parse the files into the pool of entry, without any lock held. */
+static void cred_cache_parse(cred_cache_entry *entry, md_reg_t *reg, const md_t *md)
+{
+    md_pkey_spec_t *spec;
+    md_pkey_t *pkey;
+    apr_array_header_t *chain;
+    apr_pool_t *p = entry->p;
+    int i, n;
+    
+    n = md->alt_pkey_specs? md->alt_pkey_specs->nelts : 0;
+    entry->pkeys = apr_array_make(p, n + 1, sizeof(md_pkey_t*));
+    entry->chains = apr_array_make(p, n + 1, sizeof(apr_array_header_t*));
+    for (i = -1; i < n; ++i) {
+        spec = (i < 0)? NULL : APR_ARRAY_IDX(md->alt_pkey_specs, i, md_pkey_spec_t*);
+        if (APR_SUCCESS != md_pkey_load_for(reg->store, MD_SG_DOMAINS, md->name, spec, 
+                                            &pkey, p)) {
+            pkey = NULL;
+        }
+        if (APR_SUCCESS != md_pubcert_load_for(reg->store, MD_SG_DOMAINS, md->name, spec, 
+                                               &chain, p) || md_array_is_empty(chain)) {
+            chain = NULL;
+        }
+        APR_ARRAY_PUSH(entry->pkeys, md_pkey_t*) = pkey;
+        APR_ARRAY_PUSH(entry->chains, apr_array_header_t*) = chain;
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, 0, p, "md{%s}: credentials parsed", md->name);
+}
+
+/* Get the cache entry for the files with the given modification times, parsing
+ * them when the cache has none. Returns with the lock held, the entry stays valid
+ * until it is released. The files are read and parsed without the lock, so that
+ * MDs are parsed in parallel and lookups of other MDs do not wait on it. */
+static cred_cache_entry *cred_cache_acquire(md_reg_t *reg, const md_t *md, 
+                                            apr_time_t key_mtime, apr_time_t cert_mtime)
+{
+    cred_cache_entry *entry, *old;
+    apr_pool_t *p;
+    
+    state_cache_lock(reg);
+    if (!key_mtime || !cert_mtime) {
+        return NULL;
+    }
+    old = apr_hash_get(reg->cred_cache, md->name, APR_HASH_KEY_STRING);
+    if (cred_cache_is_for(old, md, key_mtime, cert_mtime)) {
+        return old;
+    }
+    /* sub pools of reg->p are only created and destroyed with the lock held */
+    if (APR_SUCCESS != apr_pool_create(&p, reg->p)) {
+        return NULL;
+    }
+    state_cache_unlock(reg);
+    
+    entry = apr_pcalloc(p, sizeof(*entry));
+    entry->p = p;
+    entry->key_mtime = key_mtime;
+    entry->cert_mtime = cert_mtime;
+    cred_cache_parse(entry, reg, md);
+    
+    state_cache_lock(reg);
+    old = apr_hash_get(reg->cred_cache, md->name, APR_HASH_KEY_STRING);
+    if (cred_cache_is_for(old, md, key_mtime, cert_mtime)) {
+        /* parsed by another thread meanwhile */
+        apr_pool_destroy(p);
+        return old;
+    }
+    apr_hash_set(reg->cred_cache, md->name, APR_HASH_KEY_STRING, NULL);
+    apr_hash_set(reg->cred_cache, apr_pstrdup(p, md->name), APR_HASH_KEY_STRING, entry);
+    if (old) {
+        /* references handed out live on in their own pools */
+        apr_pool_destroy(old->p);
+    }
+    return entry;
+}
+
+/* Get the primary credentials of md as md_reg_creds_get() with references for pool p
+ * to the parsed data in the cache. */
+static apr_status_t cred_cache_creds(const md_creds_t **pcreds, md_reg_t *reg, const md_t *md, 
+                                     apr_time_t key_mtime, apr_time_t cert_mtime, apr_pool_t *p)
+{
+    cred_cache_entry *entry;
+    md_creds_t *creds;
+    md_pkey_t *pkey;
+    apr_array_header_t *chain;
+    int i;
+    
+    if (!(entry = cred_cache_acquire(reg, md, key_mtime, cert_mtime))) {
+        state_cache_unlock(reg);
+        return md_reg_creds_get(pcreds, reg, MD_SG_DOMAINS, md, p);
+    }
+    creds = apr_pcalloc(p, sizeof(*creds));
+    if ((pkey = APR_ARRAY_IDX(entry->pkeys, 0, md_pkey_t*))) {
+        creds->privkey = md_pkey_ref(pkey, p);
+    }
+    if ((chain = APR_ARRAY_IDX(entry->chains, 0, apr_array_header_t*))) {
+        creds->pubcert = apr_array_make(p, chain->nelts, sizeof(md_cert_t*));
+        for (i = 0; i < chain->nelts; ++i) {
+            APR_ARRAY_PUSH(creds->pubcert, md_cert_t*) = 
+                md_cert_ref(APR_ARRAY_IDX(chain, i, md_cert_t*), p);
+        }
+        creds->cert = APR_ARRAY_IDX(creds->pubcert, 0, md_cert_t*);
+        creds->expired = md_cert_has_expired(creds->cert);
+    }
+    state_cache_unlock(reg);
+    *pcreds = creds;
+    return APR_SUCCESS;
+}
+
+apr_status_t md_reg_get_cred_objects(apr_array_header_t **ppkeys, apr_array_header_t **pchains,
+                                     md_reg_t *reg, const md_t *md, apr_pool_t *p)
+{
+    cred_cache_entry *entry;
+    apr_array_header_t *chain, *refs;
+    md_pkey_t *pkey;
+    apr_time_t key_mtime, cert_mtime;
+    apr_status_t rv = APR_ENOENT;
+    int i, j;
+    
+    *ppkeys = apr_array_make(p, 5, sizeof(md_pkey_t*));
+    *pchains = apr_array_make(p, 5, sizeof(apr_array_header_t*));
+    cred_mtimes(reg, md, &key_mtime, &cert_mtime, p);
+    
+    entry = cred_cache_acquire(reg, md, key_mtime, cert_mtime);
+    for (i = 0; entry && i < entry->pkeys->nelts; ++i) {
+        pkey = APR_ARRAY_IDX(entry->pkeys, i, md_pkey_t*);
+        chain = APR_ARRAY_IDX(entry->chains, i, apr_array_header_t*);
+        if (!pkey || !chain) {
+            if (i == 0) break;
+            continue;
+        }
+        refs = apr_array_make(p, chain->nelts, sizeof(md_cert_t*));
+        for (j = 0; j < chain->nelts; ++j) {
+            APR_ARRAY_PUSH(refs, md_cert_t*) = md_cert_ref(APR_ARRAY_IDX(chain, j, md_cert_t*), p);
+        }
+        APR_ARRAY_PUSH(*ppkeys, md_pkey_t*) = md_pkey_ref(pkey, p);
+        APR_ARRAY_PUSH(*pchains, apr_array_header_t*) = refs;
+        rv = APR_SUCCESS;
+    }
+    state_cache_unlock(reg);
+    return rv;
+}
+
+/* Inspect the certificates for the additional key specs of a MD whose primary 
+ * certificate is complete. Lowers *pexpires and *prefresh_at to the earliest time
+ * one of them needs renewal. */
+static md_state_t alt_state_init(md_reg_t *reg, md_t *md, 
+                                 apr_time_t key_mtime, apr_time_t cert_mtime,
+                                 apr_time_t *pexpires, apr_time_t *prefresh_at, apr_pool_t *p)
+{
+    cred_cache_entry *entry;
+    md_pkey_spec_t *spec;
+    md_pkey_t *privkey;
+    apr_array_header_t *pubcert;
+    const md_cert_t *cert;
+    apr_time_t not_after;
+    md_state_t state = MD_S_COMPLETE;
+    int i;
+    
+    if (!(entry = cred_cache_acquire(reg, md, key_mtime, cert_mtime))) {
+        /* files are read below, not with the lock held */
+        state_cache_unlock(reg);
+    }
+    for (i = 0; md->alt_pkey_specs && i < md->alt_pkey_specs->nelts; ++i) {
+        spec = APR_ARRAY_IDX(md->alt_pkey_specs, i, md_pkey_spec_t*);
+        if (entry) {
+            privkey = APR_ARRAY_IDX(entry->pkeys, i + 1, md_pkey_t*);
+            pubcert = APR_ARRAY_IDX(entry->chains, i + 1, apr_array_header_t*);
+        }
+        else if (APR_SUCCESS != md_pkey_load_for(reg->store, MD_SG_DOMAINS, md->name, 
+                                                 spec, &privkey, p)
+                 || APR_SUCCESS != md_pubcert_load_for(reg->store, MD_SG_DOMAINS, md->name, 
+                                                       spec, &pubcert, p)) {
+            privkey = NULL;
+            pubcert = NULL;
+        }
+        if (!privkey || !pubcert || md_array_is_empty(pubcert)) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "md{%s}: incomplete, "
+                          "no certificate in %s", md->name, md_pubcert_fname_for(spec, p));
+            state = MD_S_INCOMPLETE;
+            goto out;
+        }
+        cert = APR_ARRAY_IDX(pubcert, 0, const md_cert_t*);
+        if (md_cert_has_expired(cert)) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "md{%s}: expired, certificate "
+                          "in %s has expired", md->name, md_pubcert_fname_for(spec, p));
+            state = MD_S_EXPIRED;
+            goto out;
+        }
+        if (!md_cert_covers_md(cert, md) 
+            || !md->must_staple != !md_cert_must_staple(cert)) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, p, "md{%s}: incomplete, "
+                          "certificate in %s no longer matches the configuration", 
+                          md->name, md_pubcert_fname_for(spec, p));
+            state = MD_S_INCOMPLETE;
+            goto out;
+        }
+        not_after = md_cert_get_not_after(cert);
+        if (not_after < *pexpires) {
+            *pexpires = not_after;
+        }
+        if (not_after < *prefresh_at) {
+            *prefresh_at = not_after;
+        }
+    }
+out:
+    if (entry) {
+        state_cache_unlock(reg);
+    }
+    return state;
+}
+
 static apr_status_t state_init(md_reg_t *reg, apr_pool_t *p, md_t *md, int save_changes)
 {
     md_state_t state = MD_S_UNKNOWN;
     const md_creds_t *creds;
     const md_cert_t *cert;
-    apr_time_t expires = 0, valid_from = 0;
+    apr_time_t expires = 0, valid_from = 0, refresh_at = 0, not_after;
+    apr_time_t key_mtime, cert_mtime;
+    const char *domains;
     apr_status_t rv;
     int i;
 
-    if (APR_SUCCESS == (rv = md_reg_creds_get(&creds, reg, MD_SG_DOMAINS, md, p))) {
+    /* sample the modification times before loading, so that changes made while
+     * we inspect the files will invalidate what we remember. */
+    domains = apr_array_pstrcat(p, md->domains, ' ');
+    cred_mtimes(reg, md, &key_mtime, &cert_mtime, p);
+    if (state_cache_get(reg, md, domains, key_mtime, cert_mtime, 
+                        &state, &valid_from, &expires)) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, 0, p, "md{%s}: state from cache", md->name);
+        rv = APR_SUCCESS;
+        goto apply;
+    }
+    
+    /* parsed once for the state and for handing out, see md_reg_get_cred_objects() */
+    if (APR_SUCCESS == (rv = cred_cache_creds(&creds, reg, md, key_mtime, cert_mtime, p))) {
         state = MD_S_INCOMPLETE;
         if (!creds->privkey) {
             md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, 
@@ -199,7 +589,7 @@ static apr_status_t state_init(md_reg_t *reg, apr_pool_t *p, md_t *md, int save_
         }
         else {
             valid_from = md_cert_get_not_before(creds->cert);
-            expires = md_cert_get_not_after(creds->cert);
+            expires = refresh_at = md_cert_get_not_after(creds->cert);
             if (md_cert_has_expired(creds->cert)) {
                 state = MD_S_EXPIRED;
                 md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, 
@@ -232,6 +622,10 @@ static apr_status_t state_init(md_reg_t *reg, apr_pool_t *p, md_t *md, int save_
 
             for (i = 1; i < creds->pubcert->nelts; ++i) {
                 cert = APR_ARRAY_IDX(creds->pubcert, i, const md_cert_t *);
+                not_after = md_cert_get_not_after(cert);
+                if (not_after < refresh_at) {
+                    refresh_at = not_after;
+                }
                 if (!md_cert_is_valid_now(cert)) {
                     state = MD_S_ERROR;
                     md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, 
@@ -242,7 +636,10 @@ static apr_status_t state_init(md_reg_t *reg, apr_pool_t *p, md_t *md, int save_
                 }
             } 
 
-            state = MD_S_COMPLETE;
+            if (MD_S_COMPLETE != (state = alt_state_init(reg, md, key_mtime, cert_mtime, 
+                                                          &expires, &refresh_at, p))) {
+                goto out;
+            }
             md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "md{%s}: is complete", md->name);
         }
     }
@@ -252,7 +649,13 @@ out:
         state = MD_S_ERROR;
         md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "md{%s}: error", md->name);
     }
+    else if (MD_S_ERROR != state) {
+        state_cache_set(reg, md, domains, key_mtime, cert_mtime, 
+                        state, valid_from, expires, 
+                        (MD_S_EXPIRED == state)? 0 : refresh_at);
+    }
     
+apply:
     if (save_changes && md->state == state
         && md->valid_from == valid_from && md->expires == expires) {
         save_changes = 0;
@@ -318,6 +721,7 @@ typedef struct {
     md_reg_do_cb *cb;
     void *baton;
     const char *exclude;
+    int with_state;
     const void *result;
 } reg_do_ctx;
 
@@ -327,13 +731,17 @@ static int reg_md_iter(void *baton, md_store_t *store, md_t *md, apr_pool_t *pte
     
     (void)store;
     if (!ctx->exclude || strcmp(ctx->exclude, md->name)) {
-        state_init(ctx->reg, ptemp, (md_t*)md, 1);
+        if (ctx->with_state) {
+            state_init(ctx->reg, ptemp, (md_t*)md, 1);
+        }
         return ctx->cb(ctx->baton, ctx->reg, md);
     }
     return 1;
 }
 
-static int reg_do(md_reg_do_cb *cb, void *baton, md_reg_t *reg, apr_pool_t *p, const char *exclude)
+/* Without state, the callback only sees what md.json has, no certificates are loaded */
+static int reg_do(md_reg_do_cb *cb, void *baton, md_reg_t *reg, apr_pool_t *p, 
+                  const char *exclude, int with_state)
 {
     reg_do_ctx ctx;
     
@@ -341,13 +749,14 @@ static int reg_do(md_reg_do_cb *cb, void *baton, md_reg_t *reg, apr_pool_t *p, c
     ctx.cb = cb;
     ctx.baton = baton;
     ctx.exclude = exclude;
+    ctx.with_state = with_state;
     return md_store_md_iter(reg_md_iter, &ctx, reg->store, p, MD_SG_DOMAINS, "*");
 }
 
 
 int md_reg_do(md_reg_do_cb *cb, void *baton, md_reg_t *reg, apr_pool_t *p)
 {
-    return reg_do(cb, baton, reg, p, NULL);
+    return reg_do(cb, baton, reg, p, NULL, 1);
 }
 
 /**************************************************************************************************/
@@ -364,9 +773,12 @@ md_t *md_reg_get(md_reg_t *reg, const char *name, apr_pool_t *p)
     return NULL;
 }
 
+/* The lookups only compare domains. They remember the name of the md found and
+ * load it again, as the md seen during iteration does not outlive the callback. */
 typedef struct {
+    apr_pool_t *p;
     const char *domain;
-    md_t *md;
+    const char *name;
 } find_domain_ctx;
 
 static int find_domain(void *baton, md_reg_t *reg, md_t *md)
@@ -375,7 +787,7 @@ static int find_domain(void *baton, md_reg_t *reg, md_t *md)
     
     (void)reg;
     if (md_contains(md, ctx->domain, 0)) {
-        ctx->md = md;
+        ctx->name = apr_pstrdup(ctx->p, md->name);
         return 0;
     }
     return 1;
@@ -385,19 +797,18 @@ md_t *md_reg_find(md_reg_t *reg, const char *domain, apr_pool_t *p)
 {
     find_domain_ctx ctx;
 
+    ctx.p = p;
     ctx.domain = domain;
-    ctx.md = NULL;
+    ctx.name = NULL;
     
-    md_reg_do(find_domain, &ctx, reg, p);
-    if (ctx.md) {
-        state_init(reg, p, ctx.md, 1);
-    }
-    return ctx.md;
+    reg_do(find_domain, &ctx, reg, p, NULL, 0);
+    return ctx.name? md_reg_get(reg, ctx.name, p) : NULL;
 }
 
 typedef struct {
-    const md_t *md_checked;
-    md_t *md;
+    apr_pool_t *p;
+    md_dns_set_t *domains;
+    const char *name;
     const char *s;
 } find_overlap_ctx;
 
@@ -405,12 +816,16 @@ static int find_overlap(void *baton, md_reg_t *reg, md_t *md)
 {
     find_overlap_ctx *ctx = baton;
     const char *overlap;
+    int i;
     
     (void)reg;
-    if ((overlap = md_common_name(ctx->md_checked, md))) {
-        ctx->md = md;
-        ctx->s = overlap;
-        return 0;
+    for (i = 0; i < md->domains->nelts; ++i) {
+        overlap = md_dns_set_get(ctx->domains, APR_ARRAY_IDX(md->domains, i, const char*));
+        if (overlap) {
+            ctx->name = apr_pstrdup(ctx->p, md->name);
+            ctx->s = overlap;
+            return 0;
+        }
     }
     return 1;
 }
@@ -419,18 +834,16 @@ md_t *md_reg_find_overlap(md_reg_t *reg, const md_t *md, const char **pdomain, a
 {
     find_overlap_ctx ctx;
     
-    ctx.md_checked = md;
-    ctx.md = NULL;
+    ctx.p = p;
+    ctx.domains = md_dns_set_make(p, md->domains);
+    ctx.name = NULL;
     ctx.s = NULL;
     
-    reg_do(find_overlap, &ctx, reg, p, md->name);
+    reg_do(find_overlap, &ctx, reg, p, md->name, 0);
     if (pdomain && ctx.s) {
         *pdomain = ctx.s;
     }
-    if (ctx.md) {
-        state_init(reg, p, ctx.md, 1);
-    }
-    return ctx.md;
+    return ctx.name? md_reg_get(reg, ctx.name, p) : NULL;
 }
 
 apr_status_t md_reg_get_cred_files(md_reg_t *reg, const md_t *md, apr_pool_t *p,
@@ -445,6 +858,34 @@ apr_status_t md_reg_get_cred_files(md_reg_t *reg, const md_t *md, apr_pool_t *p,
     return rv;
 }
 
+apr_status_t md_reg_get_alt_cred_files(md_reg_t *reg, const md_t *md, apr_pool_t *p,
+                                       apr_array_header_t **pkeyfiles, 
+                                       apr_array_header_t **pcertfiles)
+{
+    md_pkey_spec_t *spec;
+    const char *fname;
+    apr_status_t rv = APR_SUCCESS;
+    int i, n;
+    
+    n = md->alt_pkey_specs? md->alt_pkey_specs->nelts : 0;
+    *pkeyfiles = apr_array_make(p, n + 1, sizeof(const char*));
+    *pcertfiles = apr_array_make(p, n + 1, sizeof(const char*));
+    for (i = 0; i < n && APR_SUCCESS == rv; ++i) {
+        spec = APR_ARRAY_IDX(md->alt_pkey_specs, i, md_pkey_spec_t*);
+        rv = md_store_get_fname(&fname, reg->store, MD_SG_DOMAINS, md->name, 
+                                md_pkey_fname_for(spec, p), p);
+        if (APR_SUCCESS == rv) {
+            APR_ARRAY_PUSH(*pkeyfiles, const char*) = fname;
+            rv = md_store_get_fname(&fname, reg->store, MD_SG_DOMAINS, md->name, 
+                                    md_pubcert_fname_for(spec, p), p);
+        }
+        if (APR_SUCCESS == rv) {
+            APR_ARRAY_PUSH(*pcertfiles, const char*) = fname;
+        }
+    }
+    return rv;
+}
+
 /**************************************************************************************************/
 /* manipulation */
 
@@ -499,6 +940,7 @@ static apr_status_t p_md_update(void *baton, apr_pool_t *p, apr_pool_t *ptemp, v
     }
     if (MD_UPD_CA_URL & fields) {
         nmd->ca_url = updates->ca_url;
+        nmd->ca_urls = updates->ca_urls;
         md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, ptemp, "update ca url: %s", name);
     }
     if (MD_UPD_CA_PROTO & fields) {
@@ -537,6 +979,8 @@ static apr_status_t p_md_update(void *baton, apr_pool_t *p, apr_pool_t *ptemp, v
         if (updates->pkey_spec) {
             nmd->pkey_spec = apr_pmemdup(p, updates->pkey_spec, sizeof(md_pkey_spec_t));
         }
+        nmd->alt_pkey_specs = (updates->alt_pkey_specs? 
+                               apr_array_copy(p, updates->alt_pkey_specs) : NULL);
     }
     if (MD_UPD_REQUIRE_HTTPS & fields) {
         md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, ptemp, "update require-https: %s", name);
@@ -645,9 +1089,14 @@ apr_status_t md_reg_creds_get(const md_creds_t **pcreds, md_reg_t *reg,
 /**************************************************************************************************/
 /* synching */
 
+#define MD_REG_SYNC_WAIT        apr_time_from_sec(30)
+
 typedef struct {
     apr_pool_t *p;
     apr_array_header_t *store_mds;
+    md_domain_index_t *idx;         /* store_mds by name and domain */
+    md_json_t *prev;                /* fingerprints of the last sync, may be NULL */
+    md_json_t *next;                /* fingerprints of this sync */
 } sync_ctx;
 
 static int do_add_md(void *baton, md_store_t *store, md_t *md, apr_pool_t *ptemp)
@@ -669,9 +1118,118 @@ static apr_status_t read_store_mds(md_reg_t *reg, sync_ctx *ctx)
     if (APR_STATUS_IS_ENOENT(rv) || APR_STATUS_IS_EINVAL(rv)) {
         rv = APR_SUCCESS;
     }
+    ctx->idx = md_domain_index_make(ctx->p, ctx->store_mds);
     return rv;
 }
 
+/* The fingerprint of a configured MD covers all properties that md_reg_sync()
+ * compares against the store. */
+static const char *sync_fingerprint(const md_t *md, apr_pool_t *p)
+{
+    const char *s, *digest;
+    
+    if (NULL == (s = md_json_writep(md_to_json(md, p), p, MD_JSON_FMT_COMPACT))) {
+        return NULL;
+    }
+    s = apr_psprintf(p, "%s %d %d %d %d %d %" APR_TIME_T_FMT " %" APR_TIME_T_FMT, s, 
+                     md->transitive, md->drive_mode, (int)md->require_https, 
+                     md->must_staple, md->can_acme_tls_1, 
+                     (apr_time_t)md->renew_norm, (apr_time_t)md->renew_window);
+    if (APR_SUCCESS != md_crypt_sha256_digest_hex(&digest, p, s, strlen(s))) {
+        return NULL;
+    }
+    return digest;
+}
+
+/* A configured MD needs no synching when its fingerprint is the same as on the last
+ * sync and the stored md.json has not been modified since. */
+static int sync_unchanged(md_reg_t *reg, sync_ctx *ctx, md_t *md, const char *cname,
+                          const char *fingerprint, apr_pool_t *p)
+{
+    md_json_t *entry;
+    const char *s, *name;
+    
+    if (   !fingerprint || !ctx->prev
+        || NULL == (entry = md_json_viewj(ctx->prev, MD_KEY_MDS, cname, NULL))
+        || NULL == (s = md_json_gets(entry, MD_KEY_FINGERPRINT, NULL))
+        || strcmp(fingerprint, s)
+        || NULL == (name = md_json_gets(entry, MD_KEY_NAME, NULL))
+        || !md_domain_index_get_by_name(ctx->idx, name)
+        || (apr_time_t)md_json_getn(entry, MD_KEY_MODIFIED, NULL) 
+           != md_store_get_modified(reg->store, MD_SG_DOMAINS, name, MD_FN_MD, ctx->p)) {
+        return 0;
+    }
+    /* Once stored, we keep the name */
+    if (strcmp(md->name, name)) {
+        md->name = apr_pstrdup(p, name);
+    }
+    md_json_setj(entry, ctx->next, MD_KEY_MDS, cname, NULL);
+    return 1;
+}
+
+static void sync_remember(md_reg_t *reg, sync_ctx *ctx, const md_t *md, const char *cname,
+                          const char *fingerprint)
+{
+    md_json_t *entry;
+    apr_time_t modified;
+    
+    if (fingerprint 
+        && 0 != (modified = md_store_get_modified(reg->store, MD_SG_DOMAINS, 
+                                                  md->name, MD_FN_MD, ctx->p))) {
+        entry = md_json_create(ctx->p);
+        md_json_sets(md->name, entry, MD_KEY_NAME, NULL);
+        md_json_sets(fingerprint, entry, MD_KEY_FINGERPRINT, NULL);
+        md_json_setn((double)modified, entry, MD_KEY_MODIFIED, NULL);
+        md_json_setj(entry, ctx->next, MD_KEY_MDS, cname, NULL);
+    }
+}
+
+/* Same as md_find_closest_match(), using the index of store mds. */
+static md_t *sync_closest_match(sync_ctx *ctx, const md_t *md)
+{
+    md_t *candidate, *m;
+    apr_size_t cand_n, n;
+    int i;
+    
+    if (NULL != (candidate = md_domain_index_get_by_name(ctx->idx, md->name))) {
+        return candidate;
+    }
+    for (i = 0; i < md->domains->nelts; ++i) {
+        m = md_domain_index_get_by_domain(ctx->idx, APR_ARRAY_IDX(md->domains, i, const char*));
+        if (m && md_contains_domains(m, md, ctx->p)) {
+            return m;
+        }
+    }
+    cand_n = 0;
+    for (i = 0; i < md->domains->nelts; ++i) {
+        m = md_domain_index_get_by_domain(ctx->idx, APR_ARRAY_IDX(md->domains, i, const char*));
+        if (m && (n = md_common_name_count(md, m, ctx->p)) > cand_n) {
+            candidate = m;
+            cand_n = n;
+        }
+    }
+    return candidate;
+}
+
+/* Same as md_get_by_dns_overlap(), using the index of store mds. */
+static md_t *sync_find_overlap(sync_ctx *ctx, const md_t *md, const char **pcommon)
+{
+    const char *domain;
+    md_t *o;
+    int i;
+    
+    for (i = 0; i < md->domains->nelts; ++i) {
+        domain = APR_ARRAY_IDX(md->domains, i, const char*);
+        o = md_domain_index_get_by_domain(ctx->idx, domain);
+        if (o && strcmp(o->name, md->name) && md_contains(o, domain, 0)) {
+            *pcommon = domain;
+            return o;
+        }
+    }
+    *pcommon = NULL;
+    return NULL;
+}
+
 apr_status_t md_reg_set_props(md_reg_t *reg, apr_pool_t *p, int can_http, int can_https)
 {
     if (reg->can_http != can_http || reg->can_https != can_https) {
@@ -704,29 +1262,56 @@ apr_status_t md_reg_set_props(md_reg_t *reg, apr_pool_t *p, int can_http, int ca
  *        issue WARNING.
  *      - store misses dns name from config, add dns name and update store
  *   c. compare MD acme url/protocol, update if changed
+ *   Configured MDs that are unchanged since the last sync, according to their 
+ *   fingerprint in MD_FN_SYNC_JSON and the modification time of their stored
+ *   md.json, are skipped. 
  */
 apr_status_t md_reg_sync(md_reg_t *reg, apr_pool_t *p, apr_pool_t *ptemp, 
                          apr_array_header_t *master_mds) 
 {
     sync_ctx ctx;
     apr_status_t rv;
+    void *prev;
+    const char *s, *sprev;
+    apr_status_t rv2;
+    md_store_lock_t *lock;
 
+    /* wait for drivers and a2md of other processes to finish their changes */
+    rv = md_store_lock(&lock, reg->store, ptemp, MD_SG_DOMAINS, NULL, 1, MD_REG_SYNC_WAIT);
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "sync: locking domains");
+        return rv;
+    }
+    
     ctx.p = ptemp;
     ctx.store_mds = apr_array_make(ptemp,100, sizeof(md_t *));
+    ctx.next = md_json_create(ptemp);
+    ctx.prev = (APR_SUCCESS == md_store_load(reg->store, MD_SG_NONE, NULL, MD_FN_SYNC_JSON, 
+                                             MD_SV_JSON, &prev, ptemp))? prev : NULL;
     rv = read_store_mds(reg, &ctx);
     
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, 
                   "sync: found %d mds in store", ctx.store_mds->nelts);
     if (APR_SUCCESS == rv) {
-        int i, fields;
+        int i, fields, unchanged = 0;
         md_t *md, *config_md, *smd, *omd;
-        const char *common;
+        const char *common, *cname, *fingerprint;
         
         for (i = 0; i < master_mds->nelts; ++i) {
             md = APR_ARRAY_IDX(master_mds, i, md_t *);
+            if (md->ca_challenges) {
+                md->ca_challenges = md_array_str_compact(p, md->ca_challenges, 0);
+            }
+            
+            cname = md->name;
+            fingerprint = sync_fingerprint(md, ptemp);
+            if (sync_unchanged(reg, &ctx, md, cname, fingerprint, p)) {
+                ++unchanged;
+                continue;
+            }
             
             /* find the store md that is closest match for the configured md */
-            smd = md_find_closest_match(ctx.store_mds, md);
+            smd = sync_closest_match(&ctx, md);
             if (smd) {
                 fields = 0;
                 
@@ -741,13 +1326,12 @@ apr_status_t md_reg_sync(md_reg_t *reg, apr_pool_t *p, apr_pool_t *ptemp,
                     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, 
                                  "%s: domains changed", smd->name);
                     smd->domains = md_array_str_clone(ptemp, md->domains);
+                    md_domain_index_add(ctx.idx, smd);
                     fields |= MD_UPD_DOMAINS;
                 }
                 
                 /* Look for other store mds which have domains now being part of smd */
-                while (APR_SUCCESS == rv && (omd = md_get_by_dns_overlap(ctx.store_mds, md))) {
-                    /* find the name now duplicate */
-                    common = md_common_name(md, omd);
+                while (APR_SUCCESS == rv && (omd = sync_find_overlap(&ctx, md, &common))) {
                     assert(common);
                     
                     /* Is this md still configured or has it been abandoned in the config? */
@@ -775,8 +1359,11 @@ apr_status_t md_reg_sync(md_reg_t *reg, apr_pool_t *p, apr_pool_t *ptemp,
                     }
                 }
 
-                if (MD_SVAL_UPDATE(md, smd, ca_url)) {
+                if (MD_SVAL_UPDATE(md, smd, ca_url) 
+                    || (!md->ca_urls != !smd->ca_urls)
+                    || (md->ca_urls && !md_array_str_eq(md->ca_urls, smd->ca_urls, 1))) {
                     smd->ca_url = md->ca_url;
+                    smd->ca_urls = md->ca_urls;
                     fields |= MD_UPD_CA_URL;
                 }
                 if (MD_SVAL_UPDATE(md, smd, ca_proto)) {
@@ -810,7 +1397,6 @@ apr_status_t md_reg_sync(md_reg_t *reg, apr_pool_t *p, apr_pool_t *ptemp,
                     fields |= MD_UPD_RENEW_WINDOW;
                 }
                 if (md->ca_challenges) {
-                    md->ca_challenges = md_array_str_compact(p, md->ca_challenges, 0);
                     if (!smd->ca_challenges 
                         || !md_array_str_eq(md->ca_challenges, smd->ca_challenges, 0)) {
                         smd->ca_challenges = apr_array_copy(ptemp, md->ca_challenges);
@@ -821,12 +1407,14 @@ apr_status_t md_reg_sync(md_reg_t *reg, apr_pool_t *p, apr_pool_t *ptemp,
                     smd->ca_challenges = NULL;
                     fields |= MD_UPD_CA_CHALLENGES;
                 }
-                if (!md_pkey_spec_eq(md->pkey_spec, smd->pkey_spec)) {
+                if (!md_pkey_spec_eq(md->pkey_spec, smd->pkey_spec)
+                    || !md_pkey_specs_eq(md->alt_pkey_specs, smd->alt_pkey_specs)) {
                     fields |= MD_UPD_PKEY_SPEC;
                     smd->pkey_spec = NULL;
                     if (md->pkey_spec) {
                         smd->pkey_spec = apr_pmemdup(p, md->pkey_spec, sizeof(md_pkey_spec_t));
                     }
+                    smd->alt_pkey_specs = md->alt_pkey_specs;
                 }
                 if (MD_VAL_UPDATE(md, smd, require_https)) {
                     smd->require_https = md->require_https;
@@ -851,12 +1439,30 @@ apr_status_t md_reg_sync(md_reg_t *reg, apr_pool_t *p, apr_pool_t *ptemp,
                 rv = md_reg_add(reg, md, ptemp);
                 md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "new md %s added", md->name);
             }
+            if (APR_SUCCESS == rv) {
+                sync_remember(reg, &ctx, md, cname, fingerprint);
+            }
+        }
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, 
+                      "sync: %d of %d configured mds unchanged", unchanged, master_mds->nelts);
+        
+        if (APR_SUCCESS == rv) {
+            s = md_json_writep(ctx.next, ptemp, MD_JSON_FMT_COMPACT);
+            sprev = ctx.prev? md_json_writep(ctx.prev, ptemp, MD_JSON_FMT_COMPACT) : NULL;
+            if (!s || !sprev || strcmp(s, sprev)) {
+                /* not being able to skip next time is no reason to fail */
+                rv2 = md_store_save(reg->store, ptemp, MD_SG_NONE, NULL, MD_FN_SYNC_JSON, 
+                                    MD_SV_JSON, ctx.next, 0);
+                md_log_perror(MD_LOG_MARK, (APR_SUCCESS == rv2)? MD_LOG_TRACE1 : MD_LOG_WARNING, 
+                              rv2, p, "sync: saving fingerprints");
+            }
         }
     }
     else {
         md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "loading mds");
     }
     
+    md_store_unlock(reg->store, lock);
     return rv;
 }
 
@@ -869,6 +1475,8 @@ apr_status_t md_reg_remove(md_reg_t *reg, apr_pool_t *p, const char *name, int a
 /**************************************************************************************************/
 /* driving */
 
+#define MD_REG_LOCK_WAIT        apr_time_from_sec(10)
+
 static apr_status_t init_proto_driver(md_proto_driver_t *driver, const md_proto_t *proto, 
                                       md_reg_t *reg, const md_t *md, 
                                       const char *challenge, apr_table_t *env, 
@@ -904,6 +1512,7 @@ static apr_status_t run_stage(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_
     const char *challenge;
     apr_time_t *pvalid_from;
     apr_table_t *env;
+    md_store_lock_t *lock;
     apr_status_t rv;
     
     (void)p;
@@ -914,6 +1523,15 @@ static apr_status_t run_stage(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_
     reset = va_arg(ap, int); 
     pvalid_from = va_arg(ap, apr_time_t*);
     
+    /* Only one driver at a time works on the staging area of an MD. If someone
+     * else does already, do not wait for it. */
+    rv = md_store_lock(&lock, reg->store, ptemp, MD_SG_STAGING, md->name, 1, 0);
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, 
+                      "%s: staging is locked, driven by another process", md->name);
+        return APR_STATUS_IS_TIMEUP(rv)? APR_EBUSY : rv;
+    }
+    
     driver = apr_pcalloc(ptemp, sizeof(*driver));
     rv = init_proto_driver(driver, proto, reg, md, challenge, env, reset, ptemp);
     if (APR_SUCCESS == rv && 
@@ -926,6 +1544,7 @@ static apr_status_t run_stage(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_
             *pvalid_from = driver->stage_valid_from;
         }
     }
+    md_store_unlock(reg->store, lock);
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "%s: staging done", md->name);
     return rv;
 }
@@ -952,6 +1571,162 @@ apr_status_t md_reg_stage(md_reg_t *reg, const md_t *md, const char *challenge,
     return md_util_pool_vdo(run_stage, reg, p, proto, md, challenge, env, reset, pvalid_from, NULL);
 }
 
+static apr_status_t run_renewal_info(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_reg_t *reg = baton;
+    const md_proto_t *proto;
+    const md_t *md;
+    apr_time_t *pstart, *pend, *pretry_at, start, end, retry_at;
+    md_proto_driver_t *driver;
+    md_pkey_spec_t *spec;
+    apr_array_header_t *certs;
+    apr_status_t rv = APR_ENOENT;
+    int i;
+    
+    (void)p;
+    proto = va_arg(ap, const md_proto_t *);
+    md = va_arg(ap, const md_t *);
+    pstart = va_arg(ap, apr_time_t *);
+    pend = va_arg(ap, apr_time_t *);
+    pretry_at = va_arg(ap, apr_time_t *);
+    
+    *pstart = *pend = *pretry_at = 0;
+    driver = apr_pcalloc(ptemp, sizeof(*driver));
+    init_proto_driver(driver, proto, reg, md, NULL, NULL, 0, ptemp);
+    for (i = -1; i < (md->alt_pkey_specs? md->alt_pkey_specs->nelts : 0); ++i) {
+        spec = (i < 0)? NULL : APR_ARRAY_IDX(md->alt_pkey_specs, i, md_pkey_spec_t*);
+        if (APR_SUCCESS != md_pubcert_load_for(reg->store, MD_SG_DOMAINS, md->name, 
+                                               spec, &certs, ptemp) || certs->nelts <= 0) {
+            /* not obtained yet, renewal will get it */
+            continue;
+        }
+        rv = proto->renewal_info(driver, APR_ARRAY_IDX(certs, 0, md_cert_t*), 
+                                 &start, &end, &retry_at);
+        if (APR_SUCCESS != rv) {
+            break;
+        }
+        if (!*pstart || start < *pstart) *pstart = start;
+        if (!*pend || end < *pend) *pend = end;
+        if (retry_at && (!*pretry_at || retry_at < *pretry_at)) *pretry_at = retry_at;
+    }
+    if (APR_SUCCESS == rv && *pend < *pstart) {
+        *pend = *pstart;
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "%s: renewal info", md->name);
+    return rv;
+}
+
+apr_status_t md_reg_renewal_info(md_reg_t *reg, const md_t *md, 
+                                 apr_time_t *pstart, apr_time_t *pend, 
+                                 apr_time_t *pretry_at, apr_pool_t *p)
+{
+    const md_proto_t *proto;
+    
+    proto = md->ca_proto? apr_hash_get(reg->protos, md->ca_proto, 
+                                       (apr_ssize_t)strlen(md->ca_proto)) : NULL;
+    if (!proto || !proto->renewal_info || !md->ca_url) {
+        *pstart = *pend = *pretry_at = 0;
+        return APR_ENOTIMPL;
+    }
+    return md_util_pool_vdo(run_renewal_info, reg, p, proto, md, 
+                            pstart, pend, pretry_at, NULL);
+}
+
+static apr_status_t prestage_spec(md_reg_t *reg, const md_t *md, md_pkey_spec_t *spec, 
+                                  apr_array_header_t *domains, apr_pool_t *p)
+{
+    md_pkey_t *privkey;
+    const char *csr;
+    apr_status_t rv;
+    
+    rv = md_pkey_load_for(reg->store, MD_SG_STAGING, md->name, spec, &privkey, p);
+    if (APR_STATUS_IS_ENOENT(rv)) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: prestage %s", 
+                      md->name, md_pkey_fname_for(spec, p));
+        if (APR_SUCCESS != (rv = md_pkey_pool_gen(&privkey, reg->store, 
+                                                  spec? spec : md->pkey_spec, p))
+            || APR_SUCCESS != (rv = md_pkey_save_for(reg->store, p, MD_SG_STAGING, md->name, 
+                                                     spec, privkey, 1))) {
+            return rv;
+        }
+    }
+    else if (APR_SUCCESS != rv) {
+        return rv;
+    }
+    
+    if (APR_SUCCESS == md_csr_load_for(&csr, reg->store, MD_SG_STAGING, md->name, spec, 
+                                       domains, md->must_staple, p)
+        && md_cert_req_is_for(csr, privkey, p)) {
+        return APR_SUCCESS;
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: prestage %s", 
+                  md->name, md_csr_fname_for(spec, p));
+    if (APR_SUCCESS == (rv = md_cert_req_create(&csr, md->name, domains, 
+                                                md->must_staple, privkey, p))) {
+        rv = md_csr_save_for(reg->store, p, MD_SG_STAGING, md->name, spec, 
+                             csr, domains, md->must_staple);
+    }
+    return rv;
+}
+
+static apr_status_t run_prestage(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_reg_t *reg = baton;
+    const md_t *md;
+    md_t *smd;
+    apr_array_header_t *domains;
+    md_pkey_spec_t *spec;
+    md_store_lock_t *lock;
+    apr_status_t rv;
+    int i;
+    
+    (void)p;
+    md = va_arg(ap, const md_t *);
+    
+    /* as for staging, do not wait for someone else working on it */
+    rv = md_store_lock(&lock, reg->store, ptemp, MD_SG_STAGING, md->name, 1, 0);
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, 
+                      "%s: staging is locked, not prestaging", md->name);
+        return APR_STATUS_IS_TIMEUP(rv)? APR_EBUSY : rv;
+    }
+    
+    /* Set up the staging area the way the ACME driver does, so that it carries on 
+     * with it instead of starting over. */
+    rv = md_load(reg->store, MD_SG_STAGING, md->name, &smd, ptemp);
+    if (APR_SUCCESS != rv 
+        || md_is_newer(reg->store, MD_SG_DOMAINS, MD_SG_STAGING, md->name, ptemp)
+        || !smd->ca_url || strcmp(smd->ca_url, md->ca_url)) {
+        md_store_purge(reg->store, ptemp, MD_SG_STAGING, md->name);
+        smd = md_copy(ptemp, md);
+        /* the driver keeps this when it renews at the first CA */
+        smd->ca_effective = NULL;
+        if (APR_SUCCESS != (rv = md_save(reg->store, ptemp, MD_SG_STAGING, smd, 0))) {
+            goto out;
+        }
+    }
+    
+    domains = md_dns_make_minimal(ptemp, md->domains);
+    for (i = -1; i < (md->alt_pkey_specs? md->alt_pkey_specs->nelts : 0); ++i) {
+        spec = (i < 0)? NULL : APR_ARRAY_IDX(md->alt_pkey_specs, i, md_pkey_spec_t*);
+        if (APR_SUCCESS != (rv = prestage_spec(reg, md, spec, domains, ptemp))) {
+            goto out;
+        }
+    }
+out:
+    md_store_unlock(reg->store, lock);
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "%s: prestaging done", md->name);
+    return rv;
+}
+
+apr_status_t md_reg_prestage(md_reg_t *reg, const md_t *md, apr_pool_t *p)
+{
+    if (!md->ca_url) {
+        return APR_EINVAL;
+    }
+    return md_util_pool_vdo(run_prestage, reg, p, md, NULL);
+}
+
 static apr_status_t run_load(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
 {
     md_reg_t *reg = baton;
@@ -960,7 +1735,9 @@ static apr_status_t run_load(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
     const md_t *md, *nmd;
     md_proto_driver_t *driver;
     apr_table_t *env;
+    md_store_lock_t *slock, *dlock;
     apr_status_t rv;
+    MD_CHK_VARS;
     
     /* For the MD of given name,  check if something is in the STAGING area.
      * - If none is there, return that status.
@@ -995,6 +1772,17 @@ static apr_status_t run_load(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
         return APR_EINVAL;
     }
     
+    /* Staging must be complete and no one else may swap the domain meanwhile, 
+     * always lock in this order. */
+    slock = dlock = NULL;
+    if (   !MD_OK(md_store_lock(&slock, reg->store, ptemp, MD_SG_STAGING, name, 
+                                1, MD_REG_LOCK_WAIT))
+        || !MD_OK(md_store_lock(&dlock, reg->store, ptemp, MD_SG_DOMAINS, name, 
+                                1, MD_REG_LOCK_WAIT))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "%s: locking for load", name);
+        goto out;
+    }
+    
     driver = apr_pcalloc(ptemp, sizeof(*driver));
     init_proto_driver(driver, proto, reg, md, NULL, env, 0, ptemp);
 
@@ -1021,6 +1809,9 @@ static apr_status_t run_load(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
             }
         }
     }
+out:
+    md_store_unlock(reg->store, dlock);
+    md_store_unlock(reg->store, slock);
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "%s: load done", md->name);
     return rv;
 }
@@ -118,6 +118,26 @@ apr_status_t md_reg_creds_get(const md_creds_t **pcreds, md_reg_t *reg,
 apr_status_t md_reg_get_cred_files(md_reg_t *reg, const md_t *md, apr_pool_t *p,
                                    const char **pkeyfile, const char **pcertfile);
 
+/**
+ * Get the private keys and certificate chains of the MD, the primary first, followed 
+ * by those for the additional key specifications that have both, as arrays of 
+ * md_pkey_t* and of apr_array_header_t* of md_cert_t*. The registry parses the files 
+ * once and keeps the result until they change. What is returned are references to
+ * these objects that live as long as pool p.
+ * Returns APR_ENOENT when there is no primary key and certificate.
+ */
+apr_status_t md_reg_get_cred_objects(struct apr_array_header_t **ppkeys, 
+                                     struct apr_array_header_t **pchains,
+                                     md_reg_t *reg, const md_t *md, apr_pool_t *p);
+
+/**
+ * Get the file names of private key and certificate chain for each additional key
+ * specification of the MD, in the order of md->alt_pkey_specs.
+ */
+apr_status_t md_reg_get_alt_cred_files(md_reg_t *reg, const md_t *md, apr_pool_t *p,
+                                       struct apr_array_header_t **pkeyfiles, 
+                                       struct apr_array_header_t **pcertfiles);
+
 /**
  * Synchronise the give master mds with the store.
  */
@@ -158,23 +178,49 @@ struct md_proto_driver_t {
 typedef apr_status_t md_proto_init_cb(md_proto_driver_t *driver);
 typedef apr_status_t md_proto_stage_cb(md_proto_driver_t *driver);
 typedef apr_status_t md_proto_preload_cb(md_proto_driver_t *driver, md_store_group_t group);
+typedef apr_status_t md_proto_renewal_info_cb(md_proto_driver_t *driver, struct md_cert_t *cert,
+                                              apr_time_t *pstart, apr_time_t *pend, 
+                                              apr_time_t *pretry_at);
 
 struct md_proto_t {
     const char *protocol;
     md_proto_init_cb *init;
     md_proto_stage_cb *stage;
     md_proto_preload_cb *preload;
+    md_proto_renewal_info_cb *renewal_info; /* NULL if the protocol has none */
 };
 
 
 /**
  * Stage a new credentials set for the given managed domain in a separate location
- * without interfering with any existing credentials.
+ * without interfering with any existing credentials. Returns APR_EBUSY, without
+ * waiting, when another process or thread stages the domain at the time, and
+ * APR_EINPROGRESS when staging has to wait for something outside, like DNS records
+ * of challenges becoming visible, and is to be called again a little later.
  */
 apr_status_t md_reg_stage(md_reg_t *reg, const md_t *md, 
                           const char *challenge, struct apr_table_t *env,
                           int reset, apr_time_t *pvalid_from, apr_pool_t *p);
 
+/**
+ * Get the window in which the CA suggests to renew the certificates of the managed 
+ * domain, the earliest of all its certificates. In *pretry_at the time the CA wants 
+ * to be asked again, if it said so, else 0. Returns APR_ENOTIMPL when the CA does 
+ * not suggest any and APR_ENOENT if the MD has no certificate.
+ */
+apr_status_t md_reg_renewal_info(md_reg_t *reg, const md_t *md, 
+                                 apr_time_t *pstart, apr_time_t *pend, 
+                                 apr_time_t *pretry_at, apr_pool_t *p);
+
+/**
+ * Prepare the next staging of the managed domain ahead of time: generate the 
+ * private keys for all its key specs and a CSR for each, in the staging area, 
+ * so that md_reg_stage() finds them and only needs to talk to the CA. Does
+ * nothing for what is there already. Fails with APR_EBUSY if a driver works on
+ * the staging area at the time.
+ */
+apr_status_t md_reg_prestage(md_reg_t *reg, const md_t *md, apr_pool_t *p);
+
 /**
  * Load a staged set of new credentials for the managed domain. This will archive
  * any existing credential data and make the staged set the new live one.
@@ -0,0 +1,73 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <apr_atomic.h>
+#include <apr_pools.h>
+#include <apr_time.h>
+
+#include "md_snap.h"
+
+struct md_snap_slot_t {
+    volatile void *current;          /* the published snapshot */
+    apr_pool_t *pool;                /* its pool, only touched by the writer */
+    volatile apr_uint32_t epoch;
+    volatile apr_uint32_t readers[2]; /* readers inside an even and an odd epoch */
+};
+
+md_snap_slot_t *md_snap_slot_make(apr_pool_t *p)
+{
+    return apr_pcalloc(p, sizeof(md_snap_slot_t));
+}
+
+const void *md_snap_acquire(md_snap_slot_t *slot, apr_uint32_t *ptoken)
+{
+    apr_uint32_t epoch;
+
+    while (1) {
+        epoch = apr_atomic_read32(&slot->epoch);
+        apr_atomic_inc32(&slot->readers[epoch & 1]);
+        if (apr_atomic_read32(&slot->epoch) == epoch) break;
+        /* a writer moved on before we were counted, it may not wait for us */
+        apr_atomic_dec32(&slot->readers[epoch & 1]);
+    }
+    *ptoken = epoch;
+    return apr_atomic_casptr(&slot->current, NULL, NULL);
+}
+
+void md_snap_release(md_snap_slot_t *slot, apr_uint32_t token)
+{
+    apr_atomic_dec32(&slot->readers[token & 1]);
+}
+
+void md_snap_publish(md_snap_slot_t *slot, const void *snap, apr_pool_t *snap_pool)
+{
+    apr_pool_t *old_pool;
+    apr_uint32_t epoch;
+
+    apr_atomic_xchgptr(&slot->current, (void*)snap);
+    old_pool = slot->pool;
+    slot->pool = snap_pool;
+    
+    /* Readers from now on count in the next epoch and may only see the new snapshot.
+     * The ones of the next epoch before have all left when the last publish returned. */
+    epoch = apr_atomic_inc32(&slot->epoch);
+    while (apr_atomic_read32(&slot->readers[epoch & 1]) > 0) {
+        apr_sleep(apr_time_from_msec(1));
+    }
+    if (old_pool) {
+        apr_pool_destroy(old_pool);
+    }
+}
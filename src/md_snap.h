@@ -0,0 +1,47 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef mod_md_md_snap_h
+#define mod_md_md_snap_h
+
+/**
+ * A slot holding the current one of a series of immutable snapshots, each in a
+ * pool of its own. Readers get the current snapshot without taking locks. A writer
+ * swaps in a new one atomically and destroys the pool of the one before, once all
+ * readers that might still use it have released it. Readers that come late are
+ * counted in a new epoch and do not delay the writer.
+ */
+typedef struct md_snap_slot_t md_snap_slot_t;
+
+md_snap_slot_t *md_snap_slot_make(apr_pool_t *p);
+
+/**
+ * Get the current snapshot, NULL when none was published yet. It remains valid
+ * until md_snap_release() is called with the token given. A thread holding a
+ * snapshot must not publish one.
+ */
+const void *md_snap_acquire(md_snap_slot_t *slot, apr_uint32_t *ptoken);
+
+void md_snap_release(md_snap_slot_t *slot, apr_uint32_t token);
+
+/**
+ * Make snap, allocated in snap_pool, the current snapshot and wait until the
+ * previous one is no longer in use, then destroy its pool. Only one thread may
+ * publish at a time.
+ */
+void md_snap_publish(md_snap_slot_t *slot, const void *snap, apr_pool_t *snap_pool);
+
+#endif /* md_snap_h */
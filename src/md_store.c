@@ -20,6 +20,7 @@
 #include <stdlib.h>
 
 #include <apr_lib.h>
+#include <apr_date.h>
 #include <apr_file_info.h>
 #include <apr_file_io.h>
 #include <apr_fnmatch.h>
@@ -55,6 +56,12 @@ static const char *GROUP_NAME[] = {
     "staging",
     "archive",
     "tmp",
+    "keypool",
+    "ocsp",
+    "locks",
+    "leases",
+    "issuers",
+    "stats",
     NULL
 };
 
@@ -71,6 +78,74 @@ void md_store_destroy(md_store_t *store)
     if (store->destroy) store->destroy(store);
 }
 
+apr_status_t md_store_lock(md_store_lock_t **plock, md_store_t *store, apr_pool_t *p,
+                           md_store_group_t group, const char *name, int exclusive,
+                           apr_interval_time_t timeout)
+{
+    if (!store->lock) {
+        *plock = NULL;
+        return APR_SUCCESS;
+    }
+    return store->lock(plock, store, p, group, name, exclusive, timeout);
+}
+
+void md_store_unlock(md_store_t *store, md_store_lock_t *lock)
+{
+    if (lock && store->unlock) store->unlock(store, lock);
+}
+
+md_store_txn_t *md_store_txn_begin(md_store_t *store, apr_pool_t *p, 
+                                   md_store_group_t group, const char *name)
+{
+    md_store_txn_t *txn;
+    
+    txn = apr_pcalloc(p, sizeof(*txn));
+    txn->store = store;
+    txn->p = p;
+    txn->group = group;
+    txn->name = name;
+    txn->entries = apr_array_make(p, 5, sizeof(md_store_txn_entry_t*));
+    return txn;
+}
+
+void md_store_txn_save(md_store_txn_t *txn, const char *aspect, 
+                       md_store_vtype_t vtype, void *value)
+{
+    md_store_txn_entry_t *entry;
+    int i;
+    
+    for (i = 0; i < txn->entries->nelts; ++i) {
+        entry = APR_ARRAY_IDX(txn->entries, i, md_store_txn_entry_t*);
+        if (!strcmp(aspect, entry->aspect)) {
+            entry->vtype = vtype;
+            entry->value = value;
+            return;
+        }
+    }
+    entry = apr_pcalloc(txn->p, sizeof(*entry));
+    entry->aspect = apr_pstrdup(txn->p, aspect);
+    entry->vtype = vtype;
+    entry->value = value;
+    APR_ARRAY_PUSH(txn->entries, md_store_txn_entry_t*) = entry;
+}
+
+apr_status_t md_store_txn_commit(md_store_txn_t *txn)
+{
+    md_store_txn_entry_t *entry;
+    apr_status_t rv = APR_SUCCESS;
+    int i;
+    
+    if (txn->store->commit) {
+        return txn->store->commit(txn->store, txn);
+    }
+    for (i = 0; i < txn->entries->nelts && APR_SUCCESS == rv; ++i) {
+        entry = APR_ARRAY_IDX(txn->entries, i, md_store_txn_entry_t*);
+        rv = md_store_save(txn->store, txn->p, txn->group, txn->name, 
+                           entry->aspect, entry->vtype, entry->value, 0);
+    }
+    return rv;
+}
+
 apr_status_t md_store_load(md_store_t *store, md_store_group_t group, 
                            const char *name, const char *aspect, 
                            md_store_vtype_t vtype, void **pdata, 
@@ -145,6 +220,15 @@ int md_store_is_newer(md_store_t *store, md_store_group_t group1, md_store_group
     return store->is_newer(store, group1, group2, name, aspect, p);
 }
 
+apr_time_t md_store_get_modified(md_store_t *store, md_store_group_t group,  
+                                 const char *name, const char *aspect, apr_pool_t *p)
+{
+    if (store->get_modified) {
+        return store->get_modified(store, group, name, aspect, p);
+    }
+    return 0;
+}
+
 /**************************************************************************************************/
 /* convenience */
 
@@ -231,6 +315,20 @@ typedef struct {
     apr_array_header_t *mds;
 } md_load_ctx;
 
+static const char *pkey_spec_label(const md_pkey_spec_t *spec, apr_pool_t *p)
+{
+    switch (spec? spec->type : MD_PKEY_TYPE_DEFAULT) {
+        case MD_PKEY_TYPE_DEFAULT:
+            return apr_psprintf(p, "rsa-%d", MD_PKEY_RSA_BITS_DEF);
+        case MD_PKEY_TYPE_RSA:
+            return apr_psprintf(p, "rsa-%u", (unsigned int)spec->params.rsa.bits);
+        case MD_PKEY_TYPE_EC:
+            return spec->params.ec.curve? apr_pstrcat(p, "ec-", spec->params.ec.curve, NULL) : NULL;
+        default:
+            return NULL;
+    }
+}
+
 apr_status_t md_pkey_load(md_store_t *store, md_store_group_t group, const char *name, 
                           md_pkey_t **ppkey, apr_pool_t *p)
 {
@@ -256,6 +354,143 @@ apr_status_t md_pubcert_save(md_store_t *store, apr_pool_t *p,
     return md_store_save(store, p, group, name, MD_FN_PUBCERT, MD_SV_CHAIN, pubcert, create);
 }
 
+const char *md_pkey_fname_for(md_pkey_spec_t *spec, apr_pool_t *p)
+{
+    const char *label;
+    
+    if (!spec) {
+        return MD_FN_PRIVKEY;
+    }
+    label = pkey_spec_label(spec, p);
+    return label? apr_pstrcat(p, "privkey.", label, ".pem", NULL) : NULL;
+}
+
+const char *md_pubcert_fname_for(md_pkey_spec_t *spec, apr_pool_t *p)
+{
+    const char *label;
+    
+    if (!spec) {
+        return MD_FN_PUBCERT;
+    }
+    label = pkey_spec_label(spec, p);
+    return label? apr_pstrcat(p, "pubcert.", label, ".pem", NULL) : NULL;
+}
+
+const char *md_ocsp_fname_for(md_pkey_spec_t *spec, apr_pool_t *p)
+{
+    const char *label;
+    
+    if (!spec) {
+        return MD_FN_OCSP;
+    }
+    label = pkey_spec_label(spec, p);
+    return label? apr_pstrcat(p, "ocsp.", label, ".json", NULL) : NULL;
+}
+
+const char *md_csr_fname_for(md_pkey_spec_t *spec, apr_pool_t *p)
+{
+    const char *label;
+    
+    if (!spec) {
+        return MD_FN_CSR;
+    }
+    label = pkey_spec_label(spec, p);
+    return label? apr_pstrcat(p, "csr.", label, ".json", NULL) : NULL;
+}
+
+apr_status_t md_csr_load_for(const char **pcsr_der_64, md_store_t *store, 
+                             md_store_group_t group, const char *name, 
+                             md_pkey_spec_t *spec, apr_array_header_t *domains, 
+                             int must_staple, apr_pool_t *p)
+{
+    const char *aspect, *csr;
+    apr_array_header_t *csr_domains;
+    md_json_t *json;
+    apr_status_t rv;
+    
+    *pcsr_der_64 = NULL;
+    if (!(aspect = md_csr_fname_for(spec, p))) {
+        return APR_EINVAL;
+    }
+    if (APR_SUCCESS != (rv = md_store_load_json(store, group, name, aspect, &json, p))) {
+        return rv;
+    }
+    csr = md_json_dups(p, json, MD_KEY_CSR, NULL);
+    csr_domains = apr_array_make(p, 5, sizeof(const char*));
+    md_json_dupsa(csr_domains, p, json, MD_KEY_DOMAINS, NULL);
+    if (!csr || !md_array_str_eq(csr_domains, domains, 0)
+        || !md_json_getb(json, MD_KEY_MUST_STAPLE, NULL) != !must_staple) {
+        return APR_ENOENT;
+    }
+    *pcsr_der_64 = csr;
+    return APR_SUCCESS;
+}
+
+apr_status_t md_csr_save_for(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
+                             const char *name, md_pkey_spec_t *spec, 
+                             const char *csr_der_64, apr_array_header_t *domains, 
+                             int must_staple)
+{
+    const char *aspect;
+    md_json_t *json;
+    
+    if (!(aspect = md_csr_fname_for(spec, p))) {
+        return APR_EINVAL;
+    }
+    json = md_json_create(p);
+    md_json_sets(csr_der_64, json, MD_KEY_CSR, NULL);
+    md_json_setsa(domains, json, MD_KEY_DOMAINS, NULL);
+    md_json_setb(must_staple, json, MD_KEY_MUST_STAPLE, NULL);
+    return md_store_save_json(store, p, group, name, aspect, json, 0);
+}
+
+apr_status_t md_pkey_load_for(md_store_t *store, md_store_group_t group, const char *name, 
+                              md_pkey_spec_t *spec, md_pkey_t **ppkey, apr_pool_t *p)
+{
+    const char *aspect;
+    
+    if (!(aspect = md_pkey_fname_for(spec, p))) {
+        return APR_EINVAL;
+    }
+    return md_store_load(store, group, name, aspect, MD_SV_PKEY, (void**)ppkey, p);
+}
+
+apr_status_t md_pkey_save_for(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
+                              const char *name, md_pkey_spec_t *spec, 
+                              md_pkey_t *pkey, int create)
+{
+    const char *aspect;
+    
+    if (!(aspect = md_pkey_fname_for(spec, p))) {
+        return APR_EINVAL;
+    }
+    return md_store_save(store, p, group, name, aspect, MD_SV_PKEY, pkey, create);
+}
+
+apr_status_t md_pubcert_load_for(md_store_t *store, md_store_group_t group, const char *name, 
+                                 md_pkey_spec_t *spec, apr_array_header_t **ppubcert, 
+                                 apr_pool_t *p)
+{
+    const char *aspect;
+    
+    if (!(aspect = md_pubcert_fname_for(spec, p))) {
+        return APR_EINVAL;
+    }
+    return md_store_load(store, group, name, aspect, MD_SV_CHAIN, (void**)ppubcert, p);
+}
+
+apr_status_t md_pubcert_save_for(md_store_t *store, apr_pool_t *p, 
+                                 md_store_group_t group, const char *name, 
+                                 md_pkey_spec_t *spec, apr_array_header_t *pubcert, int create)
+{
+    const char *aspect;
+    
+    if (!(aspect = md_pubcert_fname_for(spec, p))) {
+        return APR_EINVAL;
+    }
+    return md_store_save(store, p, group, name, aspect, MD_SV_CHAIN, pubcert, create);
+}
+
 typedef struct {
     md_store_t *store;
     md_store_group_t group;
@@ -291,3 +526,323 @@ apr_status_t md_store_md_iter(md_store_md_inspect *inspect, void *baton, md_stor
     return md_store_iter(insp_md, &ctx, store, p, group, pattern, MD_FN_MD, MD_SV_JSON);
 }
 
+/**************************************************************************************************/
+/* private key pool */
+
+static int pool_count(void *baton, const char *name, const char *aspect, 
+                      md_store_vtype_t vtype, void *value, apr_pool_t *ptemp)
+{
+    int *pcount = baton;
+    
+    (void)name;
+    (void)aspect;
+    (void)vtype;
+    (void)value;
+    (void)ptemp;
+    ++(*pcount);
+    return 1;
+}
+
+int md_pkey_pool_count(md_store_t *store, md_pkey_spec_t *spec, apr_pool_t *p)
+{
+    const char *label;
+    int count = 0;
+    
+    if ((label = pkey_spec_label(spec, p))) {
+        md_store_iter(pool_count, &count, store, p, MD_SG_KEYPOOL, 
+                      apr_pstrcat(p, label, "-*", NULL), MD_FN_PRIVKEY, MD_SV_TEXT);
+    }
+    return count;
+}
+
+apr_status_t md_pkey_pool_add(md_store_t *store, md_pkey_spec_t *spec, apr_pool_t *p)
+{
+    const char *label, *name;
+    unsigned char rnd[9];
+    md_pkey_t *pkey;
+    apr_status_t rv;
+    
+    if (!(label = pkey_spec_label(spec, p))) {
+        return APR_ENOTIMPL;
+    }
+    if (APR_SUCCESS == (rv = md_rand_bytes(rnd, sizeof(rnd), p))
+        && APR_SUCCESS == (rv = md_pkey_gen(&pkey, p, spec))) {
+        name = apr_pstrcat(p, label, "-", 
+                           md_util_base64url_encode((const char*)rnd, sizeof(rnd), p), NULL);
+        rv = md_pkey_save(store, p, MD_SG_KEYPOOL, name, pkey, 1);
+        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, rv, p, "key pool: added %s", name);
+    }
+    return rv;
+}
+
+typedef struct {
+    md_store_t *store;
+    md_pkey_t *pkey;
+    apr_pool_t *p;
+} pool_take_ctx;
+
+static int pool_take(void *baton, const char *name, const char *aspect, 
+                     md_store_vtype_t vtype, void *value, apr_pool_t *ptemp)
+{
+    pool_take_ctx *ctx = baton;
+    
+    (void)aspect;
+    (void)vtype;
+    /* Several processes may look at the same key. Only one of them succeeds in
+     * removing the file and gets to use it. */
+    if (APR_SUCCESS == md_store_remove(ctx->store, MD_SG_KEYPOOL, name, 
+                                       MD_FN_PRIVKEY, ptemp, 0)) {
+        ctx->pkey = md_pkey_ref(value, ctx->p);
+        md_store_purge(ctx->store, ptemp, MD_SG_KEYPOOL, name);
+        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, ptemp, "key pool: took %s", name);
+        return 0;
+    }
+    return 1;
+}
+
+apr_status_t md_pkey_pool_take(md_pkey_t **ppkey, md_store_t *store, 
+                               md_pkey_spec_t *spec, apr_pool_t *p)
+{
+    pool_take_ctx ctx;
+    const char *label;
+    
+    *ppkey = NULL;
+    if (!(label = pkey_spec_label(spec, p))) {
+        return APR_ENOENT;
+    }
+    ctx.store = store;
+    ctx.pkey = NULL;
+    ctx.p = p;
+    md_store_iter(pool_take, &ctx, store, p, MD_SG_KEYPOOL, 
+                  apr_pstrcat(p, label, "-*", NULL), MD_FN_PRIVKEY, MD_SV_PKEY);
+    *ppkey = ctx.pkey;
+    return ctx.pkey? APR_SUCCESS : APR_ENOENT;
+}
+
+apr_status_t md_pkey_pool_gen(md_pkey_t **ppkey, md_store_t *store, 
+                              md_pkey_spec_t *spec, apr_pool_t *p)
+{
+    if (APR_SUCCESS == md_pkey_pool_take(ppkey, store, spec, p)) {
+        return APR_SUCCESS;
+    }
+    return md_pkey_gen(ppkey, p, spec);
+}
+
+/**************************************************************************************************/
+/* leases */
+
+static apr_time_t json_get_time(md_json_t *json, const char *key)
+{
+    const char *s = md_json_gets(json, key, NULL);
+    return s? apr_date_parse_rfc(s) : 0;
+}
+
+static void json_set_time(md_json_t *json, const char *key, apr_time_t t, apr_pool_t *p)
+{
+    char ts[APR_RFC822_DATE_LEN];
+
+    apr_rfc822_date(ts, t);
+    md_json_sets(apr_pstrdup(p, ts), json, key, NULL);
+}
+
+/* Two servers taking a free lease at the same time both write it. Whoever reads back
+ * another owner after this delay steps down. A server reads a lease right before it
+ * writes one, so only a server taking longer than this between the two may still
+ * find its own lease in place after another wrote over it. */
+#define MD_LEASE_SETTLE     apr_time_from_sec(1)
+
+static apr_status_t lease_read(const char **pholder, apr_time_t *pexpires, md_store_t *store,
+                               apr_pool_t *p, const char *name)
+{
+    md_json_t *json;
+    apr_status_t rv;
+
+    *pholder = NULL;
+    *pexpires = 0;
+    if (APR_SUCCESS == (rv = md_store_load_json(store, MD_SG_LEASES, name, MD_FN_LEASE, 
+                                                &json, p))) {
+        *pholder = md_json_gets(json, MD_KEY_OWNER, NULL);
+        *pexpires = json_get_time(json, MD_KEY_EXPIRES);
+    }
+    return rv;
+}
+
+apr_status_t md_store_lease_acquire(md_store_t *store, apr_pool_t *p, const char *name, 
+                                    const char *owner, apr_interval_time_t ttl)
+{
+    md_store_lock_t *lock;
+    md_json_t *json;
+    const char *holder;
+    apr_time_t now, expires;
+    int extend = 0;
+    apr_status_t rv;
+    
+    /* keeps other processes on this server out, other servers are sorted out below */
+    if (APR_SUCCESS != (rv = md_store_lock(&lock, store, p, MD_SG_LEASES, name, 1, 
+                                           apr_time_from_sec(5)))) {
+        return rv;
+    }
+    
+    now = apr_time_now();
+    if (APR_SUCCESS == lease_read(&holder, &expires, store, p, name) 
+        && holder && expires > now) {
+        if (strcmp(owner, holder)) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: lease held by %s", 
+                          name, holder);
+            rv = APR_EBUSY;
+            goto out;
+        }
+        /* nobody else takes a lease before it expires, no need to settle */
+        extend = 1;
+    }
+    
+    json = md_json_create(p);
+    md_json_sets(owner, json, MD_KEY_OWNER, NULL);
+    json_set_time(json, MD_KEY_HEARTBEAT, now, p);
+    json_set_time(json, MD_KEY_EXPIRES, now + ttl, p);
+    if (APR_SUCCESS != (rv = md_store_save_json(store, p, MD_SG_LEASES, name, 
+                                                MD_FN_LEASE, json, 0)) || extend) {
+        goto out;
+    }
+    
+    /* Others may have taken the lease at the same time. Once they all wrote, only one 
+     * lease is in the store and whoever reads back another owner steps down. */
+    apr_sleep(MD_LEASE_SETTLE);
+    if (APR_SUCCESS == (rv = lease_read(&holder, &expires, store, p, name))
+        && (!holder || strcmp(owner, holder))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: lease taken by %s", 
+                      name, holder? holder : "unknown");
+        rv = APR_EBUSY;
+    }
+out:
+    md_store_unlock(store, lock);
+    return rv;
+}
+
+apr_status_t md_store_lease_check(md_store_t *store, apr_pool_t *p, const char *name, 
+                                  const char *owner)
+{
+    const char *holder;
+    apr_time_t expires;
+    apr_status_t rv;
+
+    rv = lease_read(&holder, &expires, store, p, name);
+    if (APR_SUCCESS == rv) {
+        if (!holder || expires <= apr_time_now()) {
+            rv = APR_ENOENT;
+        }
+        else if (strcmp(owner, holder)) {
+            rv = APR_EBUSY;
+        }
+    }
+    return rv;
+}
+
+apr_status_t md_store_lease_release(md_store_t *store, apr_pool_t *p, const char *name, 
+                                    const char *owner)
+{
+    md_store_lock_t *lock;
+    md_json_t *json;
+    const char *holder;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS != (rv = md_store_lock(&lock, store, p, MD_SG_LEASES, name, 1, 
+                                           apr_time_from_sec(5)))) {
+        return rv;
+    }
+    if (APR_SUCCESS == (rv = md_store_load_json(store, MD_SG_LEASES, name, MD_FN_LEASE, 
+                                                &json, p))) {
+        holder = md_json_gets(json, MD_KEY_OWNER, NULL);
+        if (holder && !strcmp(owner, holder)) {
+            rv = md_store_remove(store, MD_SG_LEASES, name, MD_FN_LEASE, p, 1);
+        }
+    }
+    md_store_unlock(store, lock);
+    return APR_STATUS_IS_ENOENT(rv)? APR_SUCCESS : rv;
+}
+
+/**************************************************************************************************/
+/* issuer cache */
+
+static const char *issuer_name(const char *url, apr_pool_t *p)
+{
+    const char *name;
+    
+    if (APR_SUCCESS != md_crypt_sha256_digest_hex(&name, p, url, strlen(url))) {
+        return NULL;
+    }
+    return name;
+}
+
+apr_status_t md_issuer_load(md_issuer_t **pissuer, md_store_t *store, 
+                            const char *url, apr_pool_t *p)
+{
+    md_issuer_t *issuer;
+    md_json_t *json;
+    md_cert_t *cert;
+    apr_array_header_t *certs64;
+    const char *name, *s;
+    apr_status_t rv;
+    int i;
+    
+    *pissuer = NULL;
+    if (!(name = issuer_name(url, p))) {
+        return APR_EINVAL;
+    }
+    if (APR_SUCCESS != (rv = md_store_load_json(store, MD_SG_ISSUERS, name, MD_FN_ISSUER, 
+                                                &json, p))) {
+        return rv;
+    }
+    s = md_json_gets(json, MD_KEY_URL, NULL);
+    if (!s || strcmp(url, s)) {
+        return APR_ENOENT;
+    }
+    
+    issuer = apr_pcalloc(p, sizeof(*issuer));
+    issuer->url = apr_pstrdup(p, url);
+    issuer->etag = md_json_dups(p, json, MD_KEY_ETAG, NULL);
+    issuer->up = md_json_dups(p, json, MD_KEY_UP, NULL);
+    issuer->expires = json_get_time(json, MD_KEY_EXPIRES);
+    certs64 = apr_array_make(p, 5, sizeof(const char *));
+    md_json_getsa(certs64, json, MD_KEY_CERTS, NULL);
+    issuer->certs = apr_array_make(p, certs64->nelts + 1, sizeof(md_cert_t *));
+    for (i = 0; i < certs64->nelts; ++i) {
+        s = APR_ARRAY_IDX(certs64, i, const char *);
+        if (APR_SUCCESS != (rv = md_cert_from_base64url(&cert, s, p))) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
+                          "issuer cache entry for %s has an unreadable certificate", url);
+            return rv;
+        }
+        APR_ARRAY_PUSH(issuer->certs, md_cert_t *) = cert;
+    }
+    *pissuer = issuer;
+    return APR_SUCCESS;
+}
+
+apr_status_t md_issuer_save(md_store_t *store, apr_pool_t *p, const md_issuer_t *issuer)
+{
+    md_json_t *json;
+    apr_array_header_t *certs64;
+    const char *name, *s64;
+    apr_status_t rv;
+    int i;
+    
+    if (!(name = issuer_name(issuer->url, p))) {
+        return APR_EINVAL;
+    }
+    json = md_json_create(p);
+    md_json_sets(issuer->url, json, MD_KEY_URL, NULL);
+    if (issuer->etag) md_json_sets(issuer->etag, json, MD_KEY_ETAG, NULL);
+    if (issuer->up) md_json_sets(issuer->up, json, MD_KEY_UP, NULL);
+    json_set_time(json, MD_KEY_EXPIRES, issuer->expires, p);
+    certs64 = apr_array_make(p, 5, sizeof(const char *));
+    for (i = 0; issuer->certs && i < issuer->certs->nelts; ++i) {
+        if (APR_SUCCESS != (rv = md_cert_to_base64url(&s64, 
+            APR_ARRAY_IDX(issuer->certs, i, md_cert_t *), p))) {
+            return rv;
+        }
+        APR_ARRAY_PUSH(certs64, const char *) = s64;
+    }
+    md_json_setsa(certs64, json, MD_KEY_CERTS, NULL);
+    return md_store_save_json(store, p, MD_SG_ISSUERS, name, MD_FN_ISSUER, json, 0);
+}
@@ -20,6 +20,7 @@
 struct apr_array_header_t;
 struct md_cert_t;
 struct md_pkey_t;
+struct md_pkey_spec_t;
 
 typedef struct md_store_t md_store_t;
 
@@ -42,6 +43,11 @@ typedef apr_status_t md_store_remove_cb(md_store_t *store, md_store_group_t grou
 typedef apr_status_t md_store_purge_cb(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
                                         const char *name);
 
+/**
+ * Called for each value found by md_store_iter(). The value and everything allocated
+ * from ptemp are only valid during the call, the memory is reused for the next one.
+ * What needs to live longer has to be copied. Return 0 to stop the iteration.
+ */
 typedef int md_store_inspect(void *baton, const char *name, const char *aspect, 
                              md_store_vtype_t vtype, void *value, apr_pool_t *ptemp);
 
@@ -61,6 +67,20 @@ typedef int md_store_is_newer_cb(md_store_t *store,
                                  md_store_group_t group1, md_store_group_t group2,  
                                  const char *name, const char *aspect, apr_pool_t *p);
 
+typedef apr_time_t md_store_get_modified_cb(md_store_t *store, md_store_group_t group,  
+                                            const char *name, const char *aspect, apr_pool_t *p);
+
+typedef struct md_store_lock_t md_store_lock_t;
+
+typedef apr_status_t md_store_lock_cb(md_store_lock_t **plock, md_store_t *store, apr_pool_t *p,
+                                      md_store_group_t group, const char *name, int exclusive,
+                                      apr_interval_time_t timeout);
+typedef void md_store_unlock_cb(md_store_t *store, md_store_lock_t *lock);
+
+typedef struct md_store_txn_t md_store_txn_t;
+
+typedef apr_status_t md_store_commit_cb(md_store_t *store, md_store_txn_t *txn);
+
 struct md_store_t {
     md_store_destroy_cb *destroy;
 
@@ -72,6 +92,10 @@ struct md_store_t {
     md_store_purge_cb *purge;
     md_store_get_fname_cb *get_fname;
     md_store_is_newer_cb *is_newer;
+    md_store_get_modified_cb *get_modified;
+    md_store_lock_cb *lock;
+    md_store_unlock_cb *unlock;
+    md_store_commit_cb *commit;
 };
 
 void md_store_destroy(md_store_t *store);
@@ -115,6 +139,57 @@ apr_status_t md_store_get_fname(const char **pfname,
 int md_store_is_newer(md_store_t *store, md_store_group_t group1, md_store_group_t group2,  
                       const char *name, const char *aspect, apr_pool_t *p);
 
+/**
+ * Get the time the value was last modified in the store or 0 if this
+ * is not known (because it does not exist or the store cannot tell).
+ */
+apr_time_t md_store_get_modified(md_store_t *store, md_store_group_t group,  
+                                 const char *name, const char *aspect, apr_pool_t *p);
+
+/**
+ * Lock a name in a group of the store against other processes and threads using 
+ * the same store. Several shared locks may be held at the same time, an exclusive
+ * one only alone. A lock on a name also holds a shared lock on its group, so that
+ * locking the group itself (name == NULL) exclusively waits for all names.
+ * Locks are advisory, only code asking for them is affected.
+ * Returns APR_TIMEUP if the lock could not be obtained within timeout. Stores
+ * without locking support succeed with *plock == NULL.
+ */
+apr_status_t md_store_lock(md_store_lock_t **plock, md_store_t *store, apr_pool_t *p,
+                           md_store_group_t group, const char *name, int exclusive,
+                           apr_interval_time_t timeout);
+void md_store_unlock(md_store_t *store, md_store_lock_t *lock);
+
+/**************************************************************************************************/
+/* transactions */
+
+typedef struct {
+    const char *aspect;
+    md_store_vtype_t vtype;
+    void *value;
+} md_store_txn_entry_t;
+
+/**
+ * Aspects of one name in a group that are stored together. Nothing is written
+ * before md_store_txn_commit(). A store writes all values, before any of them
+ * replaces an existing one, so a failure leaves the old values in place. Stores
+ * without support for this save the aspects one after the other.
+ */
+struct md_store_txn_t {
+    md_store_t *store;
+    apr_pool_t *p;
+    md_store_group_t group;
+    const char *name;
+    struct apr_array_header_t *entries; /* md_store_txn_entry_t*, in order of staging */
+};
+
+md_store_txn_t *md_store_txn_begin(md_store_t *store, apr_pool_t *p, 
+                                   md_store_group_t group, const char *name);
+/* Stage a value for the aspect, replacing one staged before. value must live until commit. */
+void md_store_txn_save(md_store_txn_t *txn, const char *aspect, 
+                       md_store_vtype_t vtype, void *value);
+apr_status_t md_store_txn_commit(md_store_txn_t *txn);
+
 /**************************************************************************************************/
 /* Storage handling utils */
 
@@ -145,5 +220,117 @@ apr_status_t md_pubcert_save(md_store_t *store, apr_pool_t *p,
                              md_store_group_t group, const char *name, 
                              struct apr_array_header_t *pubcert, int create);
 
+/**
+ * Next to its primary certificate, an MD may have certificates for additional
+ * key specifications. Their keys and chains live in files named after the spec,
+ * e.g. "privkey.ec-P-256.pem" and "pubcert.ec-P-256.pem". A NULL spec selects
+ * the files of the primary certificate.
+ */
+const char *md_pkey_fname_for(struct md_pkey_spec_t *spec, apr_pool_t *p);
+const char *md_pubcert_fname_for(struct md_pkey_spec_t *spec, apr_pool_t *p);
+/* Name of the OCSP response for the certificate of a spec, kept in MD_SG_OCSP */
+const char *md_ocsp_fname_for(struct md_pkey_spec_t *spec, apr_pool_t *p);
+/* Name of a CSR prepared for the key of a spec, e.g. "csr.ec-P-256.json" */
+const char *md_csr_fname_for(struct md_pkey_spec_t *spec, apr_pool_t *p);
+
+apr_status_t md_pkey_load_for(md_store_t *store, md_store_group_t group, const char *name, 
+                              struct md_pkey_spec_t *spec, struct md_pkey_t **ppkey, 
+                              apr_pool_t *p);
+apr_status_t md_pkey_save_for(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
+                              const char *name, struct md_pkey_spec_t *spec, 
+                              struct md_pkey_t *pkey, int create);
+/**
+ * A CSR, base64url encoded, saved together with the domains and the must-staple 
+ * setting it was made for. Loading fails with APR_ENOENT when there is none or
+ * it was made for other domains or settings. Callers check that it is for the
+ * key they have, see md_cert_req_is_for().
+ */
+apr_status_t md_csr_load_for(const char **pcsr_der_64, md_store_t *store, 
+                             md_store_group_t group, const char *name, 
+                             struct md_pkey_spec_t *spec, struct apr_array_header_t *domains, 
+                             int must_staple, apr_pool_t *p);
+apr_status_t md_csr_save_for(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
+                             const char *name, struct md_pkey_spec_t *spec, 
+                             const char *csr_der_64, struct apr_array_header_t *domains, 
+                             int must_staple);
+
+apr_status_t md_pubcert_load_for(md_store_t *store, md_store_group_t group, const char *name, 
+                                 struct md_pkey_spec_t *spec, 
+                                 struct apr_array_header_t **ppubcert, apr_pool_t *p);
+apr_status_t md_pubcert_save_for(md_store_t *store, apr_pool_t *p, 
+                                 md_store_group_t group, const char *name, 
+                                 struct md_pkey_spec_t *spec, 
+                                 struct apr_array_header_t *pubcert, int create);
+
+/**************************************************************************************************/
+/* private key pool */
+
+/**
+ * Private keys may be generated ahead of time and kept in group MD_SG_KEYPOOL, with
+ * a stock for each key specification. Whoever needs a new key takes one from there
+ * and only generates it on the spot when the stock is empty.
+ */
+int md_pkey_pool_count(md_store_t *store, struct md_pkey_spec_t *spec, apr_pool_t *p);
+apr_status_t md_pkey_pool_add(md_store_t *store, struct md_pkey_spec_t *spec, apr_pool_t *p);
+apr_status_t md_pkey_pool_take(struct md_pkey_t **ppkey, md_store_t *store, 
+                               struct md_pkey_spec_t *spec, apr_pool_t *p);
+
+/**
+ * Take a key from the pool or, if there is none, generate a new one.
+ */
+apr_status_t md_pkey_pool_gen(struct md_pkey_t **ppkey, md_store_t *store, 
+                              struct md_pkey_spec_t *spec, apr_pool_t *p);
+
+/**************************************************************************************************/
+/* leases */
+
+/**
+ * Servers sharing a store agree on who renews an MD with a lease, one per MD name in
+ * group MD_SG_LEASES. The owner keeps it with heartbeats, each extending the lease by
+ * ttl. Once expired, any server may take it. This relies on the servers' clocks being
+ * in sync. Since a shared file system has no compare-and-swap, a server taking a 
+ * lease reads it back after a settle delay and steps down if another owner is there.
+ * That makes two holders unlikely, not impossible, so owners check the lease again
+ * with md_store_lease_check() before they act on it.
+ *
+ * Returns APR_SUCCESS when owner holds the lease now, APR_EBUSY when someone else does.
+ */
+apr_status_t md_store_lease_acquire(md_store_t *store, apr_pool_t *p, const char *name, 
+                                    const char *owner, apr_interval_time_t ttl);
+
+/**
+ * Check the lease for the MD name without changing it. Returns APR_SUCCESS when owner 
+ * holds it, APR_EBUSY when someone else does and APR_ENOENT when nobody does.
+ */
+apr_status_t md_store_lease_check(md_store_t *store, apr_pool_t *p, const char *name, 
+                                  const char *owner);
+
+/**
+ * Give up the lease for the MD name, if owner holds it.
+ */
+apr_status_t md_store_lease_release(md_store_t *store, apr_pool_t *p, const char *name, 
+                                    const char *owner);
+
+/**************************************************************************************************/
+/* issuer cache */
+
+/**
+ * Certificates of issuers, as retrieved when following the "up" links while completing
+ * a chain, are kept in group MD_SG_ISSUERS by the url they came from. An entry is used 
+ * without asking the server again until it expires and revalidated with its etag after
+ * that. An entry without certificates marks the end of a chain, e.g. a root.
+ */
+typedef struct md_issuer_t md_issuer_t;
+struct md_issuer_t {
+    const char *url;                   /* where the certificates were retrieved */
+    const char *etag;                  /* ETag of the response, may be NULL */
+    apr_time_t expires;                /* when to revalidate, from the response */
+    const char *up;                    /* the "up" link of the response, may be NULL */
+    struct apr_array_header_t *certs;  /* the md_cert_t* retrieved, may be empty */
+};
+
+apr_status_t md_issuer_load(md_issuer_t **pissuer, md_store_t *store, 
+                            const char *url, apr_pool_t *p);
+apr_status_t md_issuer_save(md_store_t *store, apr_pool_t *p, const md_issuer_t *issuer);
 
 #endif /* mod_md_md_store_h */
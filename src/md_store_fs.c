@@ -25,6 +25,7 @@
 #include <apr_fnmatch.h>
 #include <apr_hash.h>
 #include <apr_strings.h>
+#include <apr_thread_mutex.h>
 
 #include "md.h"
 #include "md_crypt.h"
@@ -58,14 +59,25 @@ struct md_store_fs_t {
     const unsigned char *key;
     apr_size_t key_len;
     int plain_pkey[MD_SG_COUNT];
+    int use_index[MD_SG_COUNT];
+    int binary;             /* JSON values are written as CBOR */
+    
+    apr_hash_t *locks;      /* fs_flock_t* held by this process, by path */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
     
     int port_80;
     int port_443;
 };
 
 #define FS_STORE(store)     (md_store_fs_t*)(((char*)store)-offsetof(md_store_fs_t, s))
-#define FS_STORE_JSON       "md_store.json"
+#define FS_STORE_JSON       MD_FN_STORE_JSON
 #define FS_STORE_KLEN       48
+#define FS_FORMAT_BINARY    "binary"
+
+#define FS_JSON_FMT(s_fs)   ((s_fs)->binary? MD_JSON_FMT_BINARY : MD_JSON_FMT_INDENT)
+#define FS_IDX_FMT(s_fs)    ((s_fs)->binary? MD_JSON_FMT_BINARY : MD_JSON_FMT_COMPACT)
 
 static apr_status_t fs_load(md_store_t *store, md_store_group_t group, 
                             const char *name, const char *aspect,  
@@ -91,6 +103,13 @@ static apr_status_t fs_get_fname(const char **pfname,
                                  apr_pool_t *p);
 static int fs_is_newer(md_store_t *store, md_store_group_t group1, md_store_group_t group2,  
                        const char *name, const char *aspect, apr_pool_t *p);
+static apr_time_t fs_get_modified(md_store_t *store, md_store_group_t group,  
+                                  const char *name, const char *aspect, apr_pool_t *p);
+static apr_status_t fs_lock(md_store_lock_t **plock, md_store_t *store, apr_pool_t *p,
+                            md_store_group_t group, const char *name, int exclusive,
+                            apr_interval_time_t timeout);
+static void fs_unlock(md_store_t *store, md_store_lock_t *lock);
+static apr_status_t fs_commit(md_store_t *store, md_store_txn_t *txn);
 
 static apr_status_t init_store_file(md_store_fs_t *s_fs, const char *fname, 
                                     apr_pool_t *p, apr_pool_t *ptemp)
@@ -193,7 +212,7 @@ static apr_status_t read_store_file(md_store_fs_t *s_fs, const char *fname,
                                     apr_pool_t *p, apr_pool_t *ptemp)
 {
     md_json_t *json;
-    const char *key64, *key;
+    const char *key64, *key, *format;
     apr_status_t rv;
     double store_version;
     MD_CHK_VARS;
@@ -222,6 +241,9 @@ static apr_status_t read_store_file(md_store_fs_t *s_fs, const char *fname,
                           s_fs->key_len);
             return APR_EINVAL;
         }
+        
+        format = md_json_gets(json, MD_KEY_STORE, MD_KEY_FORMAT, NULL);
+        s_fs->binary = (format && !strcmp(FS_FORMAT_BINARY, format));
 
         /* Need to migrate format? */
         if (store_version < MD_STORE_VERSION) {
@@ -254,6 +276,10 @@ static apr_status_t setup_store_file(void *baton, apr_pool_t *p, apr_pool_t *pte
     (void)ap;
     s_fs->plain_pkey[MD_SG_DOMAINS] = 1;
     s_fs->plain_pkey[MD_SG_TMP] = 1;
+    s_fs->plain_pkey[MD_SG_KEYPOOL] = 1;
+    /* groups that are iterated frequently */
+    s_fs->use_index[MD_SG_DOMAINS] = 1;
+    s_fs->use_index[MD_SG_ACCOUNTS] = 1;
     
     if (!MD_OK(md_util_path_merge(&fname, ptemp, s_fs->base, FS_STORE_JSON, NULL))) {
         return rv;
@@ -286,6 +312,19 @@ apr_status_t md_store_fs_init(md_store_t **pstore, apr_pool_t *p, const char *pa
     s_fs->s.iterate = fs_iterate;
     s_fs->s.get_fname = fs_get_fname;
     s_fs->s.is_newer = fs_is_newer;
+    s_fs->s.get_modified = fs_get_modified;
+    s_fs->s.lock = fs_lock;
+    s_fs->s.unlock = fs_unlock;
+    s_fs->s.commit = fs_commit;
+    
+    s_fs->locks = apr_hash_make(p);
+#if APR_HAS_THREADS
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&s_fs->mutex, 
+                                                     APR_THREAD_MUTEX_DEFAULT, p))) {
+        *pstore = NULL;
+        return rv;
+    }
+#endif
     
     /* by default, everything is only readable by the current user */ 
     s_fs->def_perms.dir = MD_FPROT_D_UONLY;
@@ -300,6 +339,15 @@ apr_status_t md_store_fs_init(md_store_t **pstore, apr_pool_t *p, const char *pa
     /* challenges dir and files are readable by all, no secrets involved */ 
     s_fs->group_perms[MD_SG_CHALLENGES].dir = MD_FPROT_D_UALL_WREAD;
     s_fs->group_perms[MD_SG_CHALLENGES].file = MD_FPROT_F_UALL_WREAD;
+    /* OCSP responses are public and read by all child processes */
+    s_fs->group_perms[MD_SG_OCSP].dir = MD_FPROT_D_UALL_WREAD;
+    s_fs->group_perms[MD_SG_OCSP].file = MD_FPROT_F_UALL_WREAD;
+    /* renewal leases only name the server holding them */
+    s_fs->group_perms[MD_SG_LEASES].dir = MD_FPROT_D_UALL_WREAD;
+    s_fs->group_perms[MD_SG_LEASES].file = MD_FPROT_F_UALL_WREAD;
+    /* issuer certificates are public */
+    s_fs->group_perms[MD_SG_ISSUERS].dir = MD_FPROT_D_UALL_WREAD;
+    s_fs->group_perms[MD_SG_ISSUERS].file = MD_FPROT_F_UALL_WREAD;
 
     s_fs->base = apr_pstrdup(p, path);
     
@@ -463,10 +511,8 @@ static apr_status_t pfs_load(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
 static apr_status_t dispatch(md_store_fs_t *s_fs, md_store_fs_ev_t ev, unsigned int group, 
                              const char *fname, apr_filetype_e ftype, apr_pool_t *p)
 {
-    (void)ev;
     if (s_fs->event_cb) {
-        return s_fs->event_cb(s_fs->event_baton, &s_fs->s, MD_S_FS_EV_CREATED, 
-                              group, fname, ftype, p);
+        return s_fs->event_cb(s_fs->event_baton, &s_fs->s, ev, group, fname, ftype, p);
     }
     return APR_SUCCESS;
 }
@@ -542,6 +588,317 @@ static int fs_is_newer(md_store_t *store, md_store_group_t group1, md_store_grou
     return 0;
 }
 
+static apr_status_t pfs_get_modified(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_fs_t *s_fs = baton;
+    const char *fname, *name, *aspect;
+    md_store_group_t group;
+    apr_finfo_t inf;
+    apr_time_t *pmtime;
+    apr_status_t rv;
+    MD_CHK_VARS;
+    
+    (void)p;
+    group = (md_store_group_t)va_arg(ap, int);
+    name = va_arg(ap, const char*);
+    aspect = va_arg(ap, const char*);
+    pmtime = va_arg(ap, apr_time_t*);
+    
+    *pmtime = 0;
+    if (   MD_OK(fs_get_fname(&fname, &s_fs->s, group, name, aspect, ptemp))
+        && MD_OK(apr_stat(&inf, fname, APR_FINFO_MTIME, ptemp))) {
+        *pmtime = inf.mtime;
+    }
+    return rv;
+}
+
+static apr_time_t fs_get_modified(md_store_t *store, md_store_group_t group,  
+                                  const char *name, const char *aspect, apr_pool_t *p)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    apr_time_t mtime;
+    apr_status_t rv;
+    
+    rv = md_util_pool_vdo(pfs_get_modified, s_fs, p, group, name, aspect, &mtime, NULL);
+    if (APR_SUCCESS == rv) {
+        return mtime;
+    }
+    return 0;
+}
+
+/**************************************************************************************************/
+/* group index */
+
+/* Groups that are iterated often have an index file next to md_store.json, e.g.
+ * "domains.index.json". It lists all names with their aspects and modification 
+ * times and carries the content of all JSON aspects, so that iterating the group 
+ * reads one file instead of scanning and parsing every sub directory. The group 
+ * directories themselves only hold the names, as they always did.
+ * The index is replaced atomically and afterwards gets the modification time of its
+ * group directory. If names are added or removed without the store knowing it, the
+ * times differ and the index is rebuilt. Changes inside a name's directory are 
+ * detected by the modification times recorded for it. 
+ */
+#define FS_INDEX_SUFFIX     ".index.json"
+#define FS_INDEX_VERSION    1
+
+typedef struct {
+    md_store_fs_t *s_fs;
+    md_store_group_t group;
+    md_json_t *idx;
+} idx_ctx;
+
+static int is_json_aspect(const char *aspect)
+{
+    apr_size_t len = strlen(aspect);
+    return (len > 5 && !strcmp(".json", aspect + len - 5));
+}
+
+static apr_status_t idx_scan_aspect(void *baton, apr_pool_t *p, apr_pool_t *ptemp, 
+                                    const char *dir, const char *aspect, apr_filetype_e ftype)
+{
+    md_json_t *jaspects = baton, *jentry, *value;
+    const char *fpath;
+    apr_finfo_t info;
+    apr_status_t rv;
+    MD_CHK_VARS;
+    
+    (void)p;
+    if (APR_REG != ftype) {
+        return APR_SUCCESS;
+    }
+    if (   MD_OK(md_util_path_merge(&fpath, ptemp, dir, aspect, NULL))
+        && MD_OK(apr_stat(&info, fpath, APR_FINFO_MTIME, ptemp))) {
+        jentry = md_json_create(ptemp);
+        md_json_setn((double)info.mtime, jentry, MD_KEY_MODIFIED, NULL);
+        if (is_json_aspect(aspect) && APR_SUCCESS == md_json_readf(&value, ptemp, fpath)) {
+            md_json_setj(value, jentry, MD_KEY_VALUE, NULL);
+        }
+        md_json_setj(jentry, jaspects, aspect, NULL);
+    }
+    return APR_STATUS_IS_ENOENT(rv)? APR_SUCCESS : rv;
+}
+
+static apr_status_t idx_scan_name(md_json_t *idx, md_store_fs_t *s_fs, md_store_group_t group,
+                                  const char *name, apr_pool_t *p)
+{
+    md_json_t *jname, *jaspects;
+    const char *dir;
+    apr_finfo_t info;
+    apr_status_t rv;
+    MD_CHK_VARS;
+    
+    if (!MD_OK(md_util_path_merge(&dir, p, s_fs->base, md_store_group_name(group), name, NULL))) {
+        return rv;
+    }
+    rv = apr_stat(&info, dir, APR_FINFO_TYPE|APR_FINFO_MTIME, p);
+    if (APR_SUCCESS != rv || APR_DIR != info.filetype) {
+        md_json_del(idx, MD_KEY_NAMES, name, NULL);
+        return APR_STATUS_IS_ENOENT(rv)? APR_SUCCESS : rv;
+    }
+    
+    jname = md_json_create(p);
+    jaspects = md_json_create(p);
+    if (MD_OK(md_util_files_do(idx_scan_aspect, jaspects, p, dir, "*", NULL))) {
+        md_json_setn((double)info.mtime, jname, MD_KEY_MODIFIED, NULL);
+        md_json_setj(jaspects, jname, MD_KEY_ASPECTS, NULL);
+        md_json_setj(jname, idx, MD_KEY_NAMES, name, NULL);
+    }
+    return rv;
+}
+
+static apr_status_t idx_scan_dir(void *baton, apr_pool_t *p, apr_pool_t *ptemp, 
+                                 const char *dir, const char *name, apr_filetype_e ftype)
+{
+    idx_ctx *ctx = baton;
+    
+    (void)p;
+    (void)dir;
+    if (APR_DIR != ftype && APR_LNK != ftype) {
+        return APR_SUCCESS;
+    }
+    return idx_scan_name(ctx->idx, ctx->s_fs, ctx->group, name, ptemp);
+}
+
+static apr_status_t idx_build(md_json_t **pidx, md_store_fs_t *s_fs, 
+                              md_store_group_t group, apr_pool_t *p)
+{
+    idx_ctx ctx;
+    apr_status_t rv;
+    
+    ctx.s_fs = s_fs;
+    ctx.group = group;
+    ctx.idx = md_json_create(p);
+    md_json_setl(FS_INDEX_VERSION, ctx.idx, MD_KEY_VERSION, NULL);
+    
+    rv = md_util_files_do(idx_scan_dir, &ctx, p, s_fs->base, md_store_group_name(group), 
+                          "*", NULL);
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "rebuilt index of %s", 
+                  md_store_group_name(group));
+    *pidx = (APR_SUCCESS == rv)? ctx.idx : NULL;
+    return rv;
+}
+
+static apr_status_t idx_paths(const char **pgdir, const char **pfname, md_store_fs_t *s_fs,
+                              md_store_group_t group, apr_pool_t *p)
+{
+    const char *gname = md_store_group_name(group);
+    apr_status_t rv;
+    MD_CHK_VARS;
+    
+    if (MD_OK(md_util_path_merge(pgdir, p, s_fs->base, gname, NULL))) {
+        rv = md_util_path_merge(pfname, p, s_fs->base, 
+                                apr_pstrcat(p, gname, FS_INDEX_SUFFIX, NULL), NULL);
+    }
+    return rv;
+}
+
+static md_json_t *idx_load(md_store_fs_t *s_fs, md_store_group_t group, apr_pool_t *p)
+{
+    const char *gdir, *fname;
+    apr_finfo_t dinfo, finfo;
+    md_json_t *idx;
+    
+    if (   !s_fs->use_index[group]
+        || APR_SUCCESS != idx_paths(&gdir, &fname, s_fs, group, p)
+        || APR_SUCCESS != apr_stat(&dinfo, gdir, APR_FINFO_MTIME, p)
+        || APR_SUCCESS != apr_stat(&finfo, fname, APR_FINFO_MTIME, p)
+        || dinfo.mtime != finfo.mtime
+        || APR_SUCCESS != md_json_readf(&idx, p, fname)
+        || FS_INDEX_VERSION != md_json_getl(idx, MD_KEY_VERSION, NULL)) {
+        return NULL;
+    }
+    return idx;
+}
+
+static apr_status_t idx_save(md_store_fs_t *s_fs, md_store_group_t group, 
+                             md_json_t *idx, apr_pool_t *p)
+{
+    const char *gdir, *fname;
+    apr_finfo_t dinfo;
+    apr_status_t rv;
+    MD_CHK_VARS;
+    
+    if (   MD_OK(idx_paths(&gdir, &fname, s_fs, group, p))
+        && MD_OK(md_json_freplace(idx, p, FS_IDX_FMT(s_fs), fname, gperms(s_fs, group)->file))
+        && MD_OK(apr_stat(&dinfo, gdir, APR_FINFO_MTIME, p))) {
+        rv = apr_file_mtime_set(fname, dinfo.mtime, p);
+    }
+    return rv;
+}
+
+/* Bring the index of a group up to date after the store changed name. idx is the
+ * index as loaded before the change, or NULL if there was none valid. A failure
+ * to write the index is not an error of the store, it is then rebuilt later. */
+static void idx_update(md_store_fs_t *s_fs, md_store_group_t group, md_json_t *idx, 
+                       const char *name, apr_pool_t *p)
+{
+    apr_status_t rv;
+    MD_CHK_VARS;
+    
+    if (!s_fs->use_index[group]) {
+        return;
+    }
+    if (idx) {
+        rv = idx_scan_name(idx, s_fs, group, name, p);
+    }
+    else {
+        rv = idx_build(&idx, s_fs, group, p);
+    }
+    if (APR_SUCCESS == rv) {
+        rv = idx_save(s_fs, group, idx, p);
+    }
+    md_log_perror(MD_LOG_MARK, (APR_SUCCESS == rv)? MD_LOG_TRACE2 : MD_LOG_DEBUG, rv, p, 
+                  "update index of %s for %s", md_store_group_name(group), name);
+}
+
+/**************************************************************************************************/
+/* format of JSON values */
+
+typedef struct {
+    md_store_fs_t *s_fs;
+    md_store_group_t group;
+} fmt_ctx;
+
+static apr_status_t convert_json(void *baton, apr_pool_t *p, apr_pool_t *ptemp, 
+                                 const char *dir, const char *name, apr_filetype_e ftype)
+{
+    fmt_ctx *ctx = baton;
+    const char *fpath;
+    md_json_t *json;
+    apr_status_t rv;
+    MD_CHK_VARS;
+    
+    (void)p;
+    if (APR_REG != ftype) {
+        return APR_SUCCESS;
+    }
+    if (   MD_OK(md_util_path_merge(&fpath, ptemp, dir, name, NULL))
+        && MD_OK(md_json_readf(&json, ptemp, fpath))) {
+        rv = md_json_freplace(json, ptemp, FS_JSON_FMT(ctx->s_fs), fpath, 
+                              gperms(ctx->s_fs, ctx->group)->file);
+    }
+    return rv;
+}
+
+static apr_status_t pfs_binary_set(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_fs_t *s_fs = baton;
+    const char *fname;
+    md_json_t *json, *idx;
+    fmt_ctx ctx;
+    apr_status_t rv;
+    MD_CHK_VARS;
+    
+    s_fs->binary = va_arg(ap, int);
+    ctx.s_fs = s_fs;
+    for (ctx.group = MD_SG_NONE; ctx.group < MD_SG_COUNT; ++ctx.group) {
+        /* readers take either format, a store converted halfway is still usable */
+        rv = md_util_files_do(convert_json, &ctx, p, s_fs->base, 
+                              md_store_group_name(ctx.group), "*", "*.json", NULL);
+        if (APR_SUCCESS != rv && !APR_STATUS_IS_ENOENT(rv)) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "converting JSON in %s", 
+                          md_store_group_name(ctx.group));
+            return rv;
+        }
+        if (s_fs->use_index[ctx.group] 
+            && APR_SUCCESS == idx_build(&idx, s_fs, ctx.group, ptemp)) {
+            idx_save(s_fs, ctx.group, idx, ptemp);
+        }
+    }
+    
+    /* the store file itself stays text, older versions must be able to read it */
+    if (   MD_OK(md_util_path_merge(&fname, ptemp, s_fs->base, FS_STORE_JSON, NULL))
+        && MD_OK(md_json_readf(&json, ptemp, fname))) {
+        if (s_fs->binary) {
+            md_json_sets(FS_FORMAT_BINARY, json, MD_KEY_STORE, MD_KEY_FORMAT, NULL);
+        }
+        else {
+            md_json_del(json, MD_KEY_STORE, MD_KEY_FORMAT, NULL);
+        }
+        rv = md_json_freplace(json, ptemp, MD_JSON_FMT_INDENT, fname, MD_FPROT_F_UONLY);
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, p, "converted store to %s JSON", 
+                  s_fs->binary? "binary" : "text");
+    return rv;
+}
+
+apr_status_t md_store_fs_binary_set(struct md_store_t *store, int binary, apr_pool_t *p)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    
+    binary = !!binary;
+    if (binary == s_fs->binary) {
+        return APR_SUCCESS;
+    }
+    return md_util_pool_vdo(pfs_binary_set, s_fs, p, binary, NULL);
+}
+
+int md_store_fs_is_binary(struct md_store_t *store)
+{
+    return FS_STORE(store)->binary;
+}
+
 static apr_status_t pfs_save(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
 {
     md_store_fs_t *s_fs = baton;
@@ -554,6 +911,7 @@ static apr_status_t pfs_save(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
     const perms_t *perms;
     const char *pass;
     apr_size_t pass_len;
+    md_json_t *idx;
     MD_CHK_VARS;
     
     group = (md_store_group_t)va_arg(ap, int);
@@ -564,6 +922,7 @@ static apr_status_t pfs_save(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
     create = va_arg(ap, int);
     
     perms = gperms(s_fs, group);
+    idx = idx_load(s_fs, group, ptemp);
     
     if (   MD_OK(mk_group_dir(&gdir, s_fs, group, NULL, p)) 
         && MD_OK(mk_group_dir(&dir, s_fs, group, name, p))
@@ -576,9 +935,9 @@ static apr_status_t pfs_save(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
                       : md_text_freplace(fpath, perms->file, p, value));
                 break;
             case MD_SV_JSON:
-                rv = (create? md_json_fcreatex((md_json_t *)value, p, MD_JSON_FMT_INDENT, 
+                rv = (create? md_json_fcreatex((md_json_t *)value, p, FS_JSON_FMT(s_fs), 
                                                fpath, perms->file)
-                      : md_json_freplace((md_json_t *)value, p, MD_JSON_FMT_INDENT, 
+                      : md_json_freplace((md_json_t *)value, p, FS_JSON_FMT(s_fs), 
                                          fpath, perms->file));
                 break;
             case MD_SV_CERT:
@@ -598,7 +957,9 @@ static apr_status_t pfs_save(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
                 return APR_ENOTIMPL;
         }
         if (APR_SUCCESS == rv) {
-            rv = dispatch(s_fs, MD_S_FS_EV_CREATED, group, fpath, APR_REG, p);
+            rv = dispatch(s_fs, create? MD_S_FS_EV_CREATED : MD_S_FS_EV_CHANGED, 
+                          group, fpath, APR_REG, p);
+            idx_update(s_fs, group, idx, name, ptemp);
         }
     }
     return rv;
@@ -612,6 +973,7 @@ static apr_status_t pfs_remove(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va
     int force;
     apr_finfo_t info;
     md_store_group_t group;
+    md_json_t *idx;
     MD_CHK_VARS;
     
     (void)p;
@@ -621,6 +983,7 @@ static apr_status_t pfs_remove(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va
     force = va_arg(ap, int);
     
     groupname = md_store_group_name(group);
+    idx = idx_load(s_fs, group, ptemp);
     
     if (   MD_OK(md_util_path_merge(&dir, ptemp, s_fs->base, groupname, name, NULL))
         && MD_OK(md_util_path_merge(&fpath, ptemp, dir, aspect, NULL))) {
@@ -635,7 +998,11 @@ static apr_status_t pfs_remove(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va
         }
     
         rv = apr_file_remove(fpath, ptemp);
-        if (APR_ENOENT == rv && force) {
+        if (APR_SUCCESS == rv) {
+            rv = dispatch(s_fs, MD_S_FS_EV_REMOVED, group, fpath, APR_REG, ptemp);
+            idx_update(s_fs, group, idx, name, ptemp);
+        }
+        else if (APR_ENOENT == rv && force) {
             rv = APR_SUCCESS;
         }
     }
@@ -659,6 +1026,136 @@ static apr_status_t fs_save(md_store_t *store, apr_pool_t *p, md_store_group_t g
                             vtype, value, create, NULL);
 }
 
+typedef struct {
+    const char *fpath;
+    const char *tmp;
+    const char *data;
+    apr_size_t len;
+} fs_staged_t;
+
+static apr_status_t write_staged(void *baton, apr_file_t *f, apr_pool_t *p)
+{
+    fs_staged_t *staged = baton;
+    apr_size_t len = staged->len;
+    
+    (void)p;
+    return apr_file_write_full(f, staged->data, len, &len);
+}
+
+static apr_status_t fs_serialize(fs_staged_t *staged, apr_fileperms_t *pperms, 
+                                 md_store_fs_t *s_fs, md_store_group_t group, 
+                                 md_store_txn_entry_t *entry, apr_pool_t *p)
+{
+    const char *pass;
+    apr_size_t pass_len;
+    apr_status_t rv = APR_SUCCESS;
+    
+    *pperms = gperms(s_fs, group)->file;
+    switch (entry->vtype) {
+        case MD_SV_TEXT:
+            staged->data = entry->value;
+            staged->len = strlen(staged->data);
+            break;
+        case MD_SV_JSON:
+            rv = md_json_writem(&staged->data, &staged->len, (md_json_t *)entry->value, 
+                                p, FS_JSON_FMT(s_fs));
+            break;
+        case MD_SV_CERT:
+            rv = md_cert_to_pem(&staged->data, &staged->len, (md_cert_t *)entry->value, p);
+            break;
+        case MD_SV_PKEY:
+            get_pass(&pass, &pass_len, s_fs, group);
+            rv = md_pkey_to_pem(&staged->data, &staged->len, (md_pkey_t *)entry->value, 
+                                p, pass, pass_len);
+            if (!pass || !pass_len) {
+                *pperms = MD_FPROT_F_UONLY;
+            }
+            break;
+        case MD_SV_CHAIN:
+            rv = md_chain_to_pem(&staged->data, &staged->len, 
+                                 (apr_array_header_t *)entry->value, p);
+            break;
+        default:
+            rv = APR_ENOTIMPL;
+            break;
+    }
+    return rv;
+}
+
+static apr_status_t pfs_commit(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_fs_t *s_fs = baton;
+    md_store_txn_t *txn;
+    md_store_txn_entry_t *entry;
+    fs_staged_t *staged;
+    apr_array_header_t *all;
+    const char *gdir, *dir;
+    apr_fileperms_t perms;
+    md_json_t *idx;
+    int i;
+    apr_status_t rv;
+    MD_CHK_VARS;
+    
+    txn = va_arg(ap, md_store_txn_t *);
+    
+    idx = idx_load(s_fs, txn->group, ptemp);
+    if (   !MD_OK(mk_group_dir(&gdir, s_fs, txn->group, NULL, p))
+        || !MD_OK(mk_group_dir(&dir, s_fs, txn->group, txn->name, p))) {
+        return rv;
+    }
+    
+    /* Write all values next to their files first, the old files stay as
+     * they are until each one has made it to disk. */
+    all = apr_array_make(ptemp, txn->entries->nelts, sizeof(fs_staged_t*));
+    for (i = 0; i < txn->entries->nelts; ++i) {
+        entry = APR_ARRAY_IDX(txn->entries, i, md_store_txn_entry_t*);
+        staged = apr_pcalloc(ptemp, sizeof(*staged));
+        if (   !MD_OK(md_util_path_merge(&staged->fpath, ptemp, dir, entry->aspect, NULL))
+            || !MD_OK(fs_serialize(staged, &perms, s_fs, txn->group, entry, ptemp))
+            || !MD_OK(md_util_fstage(&staged->tmp, staged->fpath, perms, ptemp, 
+                                     write_staged, staged))) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "staging %s/%s/%s", 
+                          md_store_group_name(txn->group), txn->name, entry->aspect);
+            goto out;
+        }
+        APR_ARRAY_PUSH(all, fs_staged_t*) = staged;
+    }
+    
+    for (i = 0; i < all->nelts; ++i) {
+        staged = APR_ARRAY_IDX(all, i, fs_staged_t*);
+        if (!MD_OK(apr_file_rename(staged->tmp, staged->fpath, ptemp))) {
+            goto out;
+        }
+        staged->tmp = NULL;
+        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, ptemp, "stored in %s", staged->fpath);
+    }
+    if (MD_DURABLE_DIR == md_util_durability_get() && !MD_OK(md_util_fsync_dir(dir, ptemp))) {
+        goto out;
+    }
+    for (i = 0; i < all->nelts && APR_SUCCESS == rv; ++i) {
+        staged = APR_ARRAY_IDX(all, i, fs_staged_t*);
+        rv = dispatch(s_fs, MD_S_FS_EV_CHANGED, txn->group, staged->fpath, APR_REG, p);
+    }
+    
+out:
+    for (i = 0; i < all->nelts; ++i) {
+        staged = APR_ARRAY_IDX(all, i, fs_staged_t*);
+        if (staged->tmp) {
+            apr_file_remove(staged->tmp, ptemp);
+        }
+    }
+    if (all->nelts) {
+        idx_update(s_fs, txn->group, idx, txn->name, ptemp);
+    }
+    return rv;
+}
+
+static apr_status_t fs_commit(md_store_t *store, md_store_txn_t *txn)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    return md_util_pool_vdo(pfs_commit, s_fs, txn->p, txn, NULL);
+}
+
 static apr_status_t fs_remove(md_store_t *store, md_store_group_t group, 
                               const char *name, const char *aspect, 
                               apr_pool_t *p, int force)
@@ -672,6 +1169,7 @@ static apr_status_t pfs_purge(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_
     md_store_fs_t *s_fs = baton;
     const char *dir, *name, *groupname;
     md_store_group_t group;
+    md_json_t *idx;
     apr_status_t rv;
     MD_CHK_VARS;
     
@@ -680,10 +1178,13 @@ static apr_status_t pfs_purge(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_
     name = va_arg(ap, const char*);
     
     groupname = md_store_group_name(group);
+    idx = idx_load(s_fs, group, ptemp);
 
     if (MD_OK(md_util_path_merge(&dir, ptemp, s_fs->base, groupname, name, NULL))) {
         /* Remove all files in dir, there should be no sub-dirs */
         rv = md_util_rm_recursive(dir, ptemp, 1);
+        dispatch(s_fs, MD_S_FS_EV_PURGED, group, dir, APR_DIR, ptemp);
+        idx_update(s_fs, group, idx, name, ptemp);
     }
     md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, rv, ptemp, "purge %s/%s (%s)", groupname, name, dir);
     return APR_SUCCESS;
@@ -696,6 +1197,175 @@ static apr_status_t fs_purge(md_store_t *store, apr_pool_t *p,
     return md_util_pool_vdo(pfs_purge, s_fs, p, group, name, NULL);
 }
 
+/**************************************************************************************************/
+/* locking */
+
+/* Locks are held with apr_file_lock() on files in the MD_SG_LOCKS directory. Those
+ * locks belong to the process and a file's locks are all gone when any descriptor
+ * for it is closed. Each lock file is therefore opened only once per process and
+ * threads share that one, counting the holders. */ 
+#define FS_LOCK_POLL        apr_time_from_msec(50)
+
+typedef struct fs_flock_t fs_flock_t;
+struct fs_flock_t {
+    apr_pool_t *p;
+    const char *path;
+    apr_file_t *f;
+    int holders;
+    int exclusive;
+};
+
+struct md_store_lock_t {
+    fs_flock_t *group;
+    fs_flock_t *name;
+};
+
+static void locks_enter(md_store_fs_t *s_fs)
+{
+#if APR_HAS_THREADS
+    if (s_fs->mutex) apr_thread_mutex_lock(s_fs->mutex);
+#else
+    (void)s_fs;
+#endif
+}
+
+static void locks_leave(md_store_fs_t *s_fs)
+{
+#if APR_HAS_THREADS
+    if (s_fs->mutex) apr_thread_mutex_unlock(s_fs->mutex);
+#else
+    (void)s_fs;
+#endif
+}
+
+/* Try once to get the lock at fpath, called with the mutex held. */
+static apr_status_t flock_try(fs_flock_t **pfl, md_store_fs_t *s_fs, const char *fpath, 
+                              int exclusive)
+{
+    fs_flock_t *fl;
+    apr_pool_t *lp;
+    apr_status_t rv;
+    int created;
+    
+    *pfl = NULL;
+    if (NULL != (fl = apr_hash_get(s_fs->locks, fpath, APR_HASH_KEY_STRING))) {
+        if (exclusive || fl->exclusive) {
+            return APR_EAGAIN;
+        }
+        ++fl->holders;
+        *pfl = fl;
+        return APR_SUCCESS;
+    }
+    
+    /* lives as long as the lock, independent of the pool of whoever asked first */
+    if (APR_SUCCESS != (rv = apr_pool_create(&lp, NULL))) {
+        return rv;
+    }
+    fl = apr_pcalloc(lp, sizeof(*fl));
+    fl->p = lp;
+    fl->path = apr_pstrdup(lp, fpath);
+    fl->holders = 1;
+    fl->exclusive = exclusive;
+    
+    created = APR_STATUS_IS_ENOENT(md_util_is_file(fpath, lp));
+    rv = apr_file_open(&fl->f, fpath, (APR_FOPEN_WRITE|APR_FOPEN_CREATE), 
+                       gperms(s_fs, MD_SG_LOCKS)->file, lp);
+    if (APR_SUCCESS == rv) {
+        if (created) {
+            dispatch(s_fs, MD_S_FS_EV_CREATED, MD_SG_LOCKS, fpath, APR_REG, lp);
+        }
+        rv = apr_file_lock(fl->f, (exclusive? APR_FLOCK_EXCLUSIVE : APR_FLOCK_SHARED)
+                                  | APR_FLOCK_NONBLOCK);
+        if (APR_SUCCESS == rv) {
+            apr_hash_set(s_fs->locks, fl->path, APR_HASH_KEY_STRING, fl);
+            *pfl = fl;
+            return APR_SUCCESS;
+        }
+        if (APR_STATUS_IS_EAGAIN(rv) || APR_STATUS_IS_EACCES(rv)) {
+            /* held by another process */
+            rv = APR_EAGAIN;
+        }
+    }
+    apr_pool_destroy(lp);
+    return rv;
+}
+
+/* Give up one hold of the lock, called with the mutex held. */
+static void flock_release(md_store_fs_t *s_fs, fs_flock_t *fl)
+{
+    if (--fl->holders <= 0) {
+        apr_hash_set(s_fs->locks, fl->path, APR_HASH_KEY_STRING, NULL);
+        apr_file_unlock(fl->f);
+        apr_pool_destroy(fl->p);
+    }
+}
+
+static apr_status_t fs_lock(md_store_lock_t **plock, md_store_t *store, apr_pool_t *p,
+                            md_store_group_t group, const char *name, int exclusive,
+                            apr_interval_time_t timeout)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    md_store_lock_t *lock;
+    const char *ldir, *gpath, *npath = NULL;
+    apr_time_t deadline;
+    apr_status_t rv;
+    MD_CHK_VARS;
+    
+    *plock = NULL;
+    lock = apr_pcalloc(p, sizeof(*lock));
+    if (   !MD_OK(mk_group_dir(&ldir, s_fs, MD_SG_LOCKS, NULL, p))
+        || !MD_OK(md_util_path_merge(&gpath, p, ldir, 
+                  apr_pstrcat(p, md_store_group_name(group), ".lock", NULL), NULL))
+        || (name && !MD_OK(md_util_path_merge(&npath, p, ldir, 
+                  apr_pstrcat(p, md_store_group_name(group), "-", name, ".lock", NULL), NULL)))) {
+        return rv;
+    }
+    
+    deadline = apr_time_now() + timeout;
+    for (;;) {
+        locks_enter(s_fs);
+        rv = flock_try(&lock->group, s_fs, gpath, name? 0 : exclusive);
+        if (APR_SUCCESS == rv && npath) {
+            rv = flock_try(&lock->name, s_fs, npath, exclusive);
+            if (APR_SUCCESS != rv) {
+                flock_release(s_fs, lock->group);
+                lock->group = NULL;
+            }
+        }
+        locks_leave(s_fs);
+        
+        if (!APR_STATUS_IS_EAGAIN(rv)) {
+            break;
+        }
+        if (apr_time_now() >= deadline) {
+            rv = APR_TIMEUP;
+            break;
+        }
+        apr_sleep(FS_LOCK_POLL);
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, rv, p, "%s lock on %s/%s", 
+                  exclusive? "exclusive" : "shared", md_store_group_name(group), 
+                  name? name : "*");
+    *plock = (APR_SUCCESS == rv)? lock : NULL;
+    return rv;
+}
+
+static void fs_unlock(md_store_t *store, md_store_lock_t *lock)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    
+    locks_enter(s_fs);
+    if (lock->name) {
+        flock_release(s_fs, lock->name);
+        lock->name = NULL;
+    }
+    if (lock->group) {
+        flock_release(s_fs, lock->group);
+        lock->group = NULL;
+    }
+    locks_leave(s_fs);
+}
+
 /**************************************************************************************************/
 /* iteration */
 
@@ -708,6 +1378,12 @@ typedef struct {
     md_store_inspect *inspect;
     const char *dirname;
     void *baton;
+    apr_pool_t *p;
+    apr_pool_t *np;         /* for the current name, cleared for the next */
+    apr_pool_t *vp;         /* for the current value, cleared for the next */
+    const char *dir;
+    apr_array_header_t *stale;
+    apr_status_t rv;
 } inspect_ctx;
 
 static apr_status_t insp(void *baton, apr_pool_t *p, apr_pool_t *ptemp, 
@@ -718,12 +1394,14 @@ static apr_status_t insp(void *baton, apr_pool_t *p, apr_pool_t *ptemp,
     void *value;
     const char *fpath;
  
+    (void)p;
     (void)ftype;   
     md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, ptemp, "inspecting value at: %s/%s", dir, name);
-    if (APR_SUCCESS == (rv = md_util_path_merge(&fpath, ptemp, dir, name, NULL))) {
-        rv = fs_fload(&value, ctx->s_fs, fpath, ctx->group, ctx->vtype, p, ptemp);
+    apr_pool_clear(ctx->vp);
+    if (APR_SUCCESS == (rv = md_util_path_merge(&fpath, ctx->vp, dir, name, NULL))) {
+        rv = fs_fload(&value, ctx->s_fs, fpath, ctx->group, ctx->vtype, ctx->vp, ctx->vp);
         if (APR_SUCCESS == rv 
-            && !ctx->inspect(ctx->baton, ctx->dirname, name, ctx->vtype, value, p)) {
+            && !ctx->inspect(ctx->baton, ctx->dirname, name, ctx->vtype, value, ctx->vp)) {
             return APR_EOF;
         }
         else if (APR_STATUS_IS_ENOENT(rv)) {
@@ -741,8 +1419,9 @@ static apr_status_t insp_dir(void *baton, apr_pool_t *p, apr_pool_t *ptemp,
     const char *fpath;
     MD_CHK_VARS;
  
+    (void)ptemp;
     (void)ftype;
-    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, ptemp, "inspecting dir at: %s/%s", dir, name);
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, p, "inspecting dir at: %s/%s", dir, name);
     if (MD_OK(md_util_path_merge(&fpath, p, dir, name, NULL))) {
         ctx->dirname = name;
         rv = md_util_files_do(insp, ctx, p, fpath, ctx->aspect, NULL);
@@ -753,6 +1432,106 @@ static apr_status_t insp_dir(void *baton, apr_pool_t *p, apr_pool_t *ptemp,
     return rv;
 }
 
+/* Each name of the group gets a fresh ctx->np, instead of all in the caller's pool. */
+static apr_status_t insp_group_dir(void *baton, apr_pool_t *p, apr_pool_t *ptemp, 
+                                   const char *dir, const char *name, apr_filetype_e ftype)
+{
+    inspect_ctx *ctx = baton;
+    
+    (void)p;
+    apr_pool_clear(ctx->np);
+    return insp_dir(ctx, ctx->np, ptemp, dir, name, ftype);
+}
+
+static void mark_stale(inspect_ctx *ctx, const char *name)
+{
+    if (ctx->stale->nelts <= 0 
+        || strcmp(name, APR_ARRAY_IDX(ctx->stale, ctx->stale->nelts-1, const char*))) {
+        APR_ARRAY_PUSH(ctx->stale, const char*) = apr_pstrdup(ctx->p, name);
+    }
+}
+
+static int insp_idx_aspect(void *baton, const char *aspect, md_json_t *jentry)
+{
+    inspect_ctx *ctx = baton;
+    md_json_t *jvalue;
+    const char *fpath;
+    apr_finfo_t info;
+    apr_time_t mtime;
+    void *value;
+    apr_status_t rv;
+    MD_CHK_VARS;
+    
+    if (APR_SUCCESS != apr_fnmatch(ctx->aspect, aspect, 0)) {
+        return 1;
+    }
+    apr_pool_clear(ctx->vp);
+    if (   !MD_OK(md_util_path_merge(&fpath, ctx->vp, ctx->dir, aspect, NULL))
+        || !MD_OK(apr_stat(&info, fpath, APR_FINFO_MTIME, ctx->vp))) {
+        goto out;
+    }
+    
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, ctx->vp, "inspecting indexed value at: %s", fpath);
+    mtime = (apr_time_t)md_json_getn(jentry, MD_KEY_MODIFIED, NULL);
+    if (   mtime == info.mtime 
+        && MD_SV_JSON == ctx->vtype
+        && NULL != (jvalue = md_json_viewj(jentry, MD_KEY_VALUE, NULL))) {
+        value = md_json_clone(ctx->vp, jvalue);
+    }
+    else {
+        if (mtime != info.mtime) {
+            mark_stale(ctx, ctx->dirname);
+        }
+        if (!MD_OK(fs_fload(&value, ctx->s_fs, fpath, ctx->group, ctx->vtype, ctx->vp, ctx->vp))) {
+            goto out;
+        }
+    }
+    
+    if (!ctx->inspect(ctx->baton, ctx->dirname, aspect, ctx->vtype, value, ctx->vp)) {
+        rv = APR_EOF;
+    }
+out:
+    if (APR_STATUS_IS_ENOENT(rv)) {
+        /* removed since the index was written */
+        mark_stale(ctx, ctx->dirname);
+        rv = APR_SUCCESS;
+    }
+    ctx->rv = rv;
+    return (APR_SUCCESS == rv);
+}
+
+static int insp_idx_name(void *baton, const char *name, md_json_t *jname)
+{
+    inspect_ctx *ctx = baton;
+    const char *gdir;
+    apr_finfo_t info;
+    apr_status_t rv;
+    MD_CHK_VARS;
+    
+    if (APR_SUCCESS != apr_fnmatch(ctx->pattern, name, 0)) {
+        return 1;
+    }
+    apr_pool_clear(ctx->np);
+    if (   MD_OK(md_util_path_merge(&gdir, ctx->np, ctx->s_fs->base, 
+                                    md_store_group_name(ctx->group), NULL))
+        && MD_OK(md_util_path_merge(&ctx->dir, ctx->np, gdir, name, NULL))) {
+        rv = apr_stat(&info, ctx->dir, APR_FINFO_MTIME, ctx->np);
+        if (   APR_SUCCESS == rv 
+            && info.mtime == (apr_time_t)md_json_getn(jname, MD_KEY_MODIFIED, NULL)) {
+            ctx->dirname = name;
+            md_json_iterkey(insp_idx_aspect, ctx, jname, MD_KEY_ASPECTS, NULL);
+            rv = ctx->rv;
+        }
+        else {
+            /* changed outside the store, look at the directory itself */
+            mark_stale(ctx, name);
+            rv = insp_dir(ctx, ctx->np, ctx->np, gdir, name, APR_DIR);
+        }
+    }
+    ctx->rv = rv;
+    return (APR_SUCCESS == rv);
+}
+
 static apr_status_t fs_iterate(md_store_inspect *inspect, void *baton, md_store_t *store, 
                                apr_pool_t *p, md_store_group_t group, const char *pattern, 
                                const char *aspect, md_store_vtype_t vtype)
@@ -760,6 +1539,8 @@ static apr_status_t fs_iterate(md_store_inspect *inspect, void *baton, md_store_
     const char *groupname;
     apr_status_t rv;
     inspect_ctx ctx;
+    md_json_t *idx;
+    int i;
     
     ctx.s_fs = FS_STORE(store);
     ctx.group = group;
@@ -769,9 +1550,44 @@ static apr_status_t fs_iterate(md_store_inspect *inspect, void *baton, md_store_
     ctx.inspect = inspect;
     ctx.baton = baton;
     groupname = md_store_group_name(group);
+    /* memory for one item at a time, the pools are cleared for the next */
+    if (APR_SUCCESS != (rv = apr_pool_create(&ctx.np, p))) {
+        return rv;
+    }
+    if (APR_SUCCESS != (rv = apr_pool_create(&ctx.vp, p))) {
+        apr_pool_destroy(ctx.np);
+        return rv;
+    }
+    apr_pool_tag(ctx.np, "md_store_iter_name");
+    apr_pool_tag(ctx.vp, "md_store_iter_value");
 
-    rv = md_util_files_do(insp_dir, &ctx, p, ctx.s_fs->base, groupname, pattern, NULL);
+    idx = idx_load(ctx.s_fs, group, p);
+    if (!idx && ctx.s_fs->use_index[group] 
+        && APR_SUCCESS == idx_build(&idx, ctx.s_fs, group, p)) {
+        rv = idx_save(ctx.s_fs, group, idx, p);
+        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, rv, p, "saved index of %s", groupname);
+    }
+    
+    if (idx) {
+        ctx.p = p;
+        ctx.stale = apr_array_make(p, 5, sizeof(const char*));
+        ctx.rv = APR_SUCCESS;
+        md_json_iterkey(insp_idx_name, &ctx, idx, MD_KEY_NAMES, NULL);
+        rv = ctx.rv;
+        
+        if (ctx.stale->nelts > 0) {
+            for (i = 0; i < ctx.stale->nelts; ++i) {
+                idx_scan_name(idx, ctx.s_fs, group, APR_ARRAY_IDX(ctx.stale, i, const char*), p);
+            }
+            idx_save(ctx.s_fs, group, idx, p);
+        }
+        goto out;
+    }
     
+    rv = md_util_files_do(insp_group_dir, &ctx, p, ctx.s_fs->base, groupname, pattern, NULL);
+out:
+    apr_pool_destroy(ctx.vp);
+    apr_pool_destroy(ctx.np);
     return rv;
 }
 
@@ -783,6 +1599,7 @@ static apr_status_t pfs_move(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
     md_store_fs_t *s_fs = baton;
     const char *name, *from_group, *to_group, *from_dir, *to_dir, *arch_dir, *dir;
     md_store_group_t from, to;
+    md_json_t *from_idx, *to_idx;
     int archive;
     apr_status_t rv;
     MD_CHK_VARS;
@@ -798,6 +1615,8 @@ static apr_status_t pfs_move(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
     if (!strcmp(from_group, to_group)) {
         return APR_EINVAL;
     }
+    from_idx = idx_load(s_fs, from, ptemp);
+    to_idx = idx_load(s_fs, to, ptemp);
 
     if (   !MD_OK(md_util_path_merge(&from_dir, ptemp, s_fs->base, from_group, name, NULL))
         || !MD_OK(md_util_path_merge(&to_dir, ptemp, s_fs->base, to_group, name, NULL))) {
@@ -889,6 +1708,7 @@ static apr_status_t pfs_move(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
                           from_dir, to_dir);
             goto out;
         }
+        rv = dispatch(s_fs, MD_S_FS_EV_MOVED, to, to_dir, APR_DIR, ptemp);
     }
     else {
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "target is no dir: %s", to_dir);
@@ -896,6 +1716,11 @@ static apr_status_t pfs_move(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
     }
     
 out:
+    if (APR_SUCCESS == rv) {
+        rv = dispatch(s_fs, MD_S_FS_EV_REMOVED, from, from_dir, APR_DIR, ptemp);
+        idx_update(s_fs, from, from_idx, name, ptemp);
+        idx_update(s_fs, to, to_idx, name, ptemp);
+    }
     return rv;
 }
 
@@ -50,9 +50,26 @@ apr_status_t md_store_fs_group_perms_set(struct md_store_t *store,
                                          apr_fileperms_t file_perms,
                                          apr_fileperms_t dir_perms);
 
+/**
+ * Have JSON values written in binary (CBOR) or text. A change converts all JSON
+ * files of the store and is recorded in its md_store.json. Files are read in 
+ * either format, so a store that was converted only in part still works. Before
+ * running an older version on the store, it needs to be converted back to text.
+ */
+apr_status_t md_store_fs_binary_set(struct md_store_t *store, int binary, apr_pool_t *p);
+int md_store_fs_is_binary(struct md_store_t *store);
+
+/**
+ * Events reported to the callback after the store changed a file or directory.
+ * Every change of a group is reported, so that holders of copies from the store
+ * know when to load them again.
+ */
 typedef enum {
-    MD_S_FS_EV_CREATED,
-    MD_S_FS_EV_MOVED,
+    MD_S_FS_EV_CREATED,         /* a new file or directory */
+    MD_S_FS_EV_MOVED,           /* a directory moved into the group */
+    MD_S_FS_EV_PURGED,          /* a directory of a name was removed */
+    MD_S_FS_EV_CHANGED,         /* an existing file was written again */
+    MD_S_FS_EV_REMOVED,         /* a file was removed or a directory moved away */
 } md_store_fs_ev_t; 
 
 typedef apr_status_t md_store_fs_cb(void *baton, struct md_store_t *store,
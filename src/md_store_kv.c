@@ -0,0 +1,1165 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <apr_lib.h>
+#include <apr_file_info.h>
+#include <apr_file_io.h>
+#include <apr_fnmatch.h>
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <apr_thread_mutex.h>
+
+#include "md.h"
+#include "md_crypt.h"
+#include "md_json.h"
+#include "md_log.h"
+#include "md_store.h"
+#include "md_store_fs.h"
+#include "md_store_kv.h"
+#include "md_util.h"
+
+/**************************************************************************************************/
+/* key/value service based implementation of md_store_t */
+
+#define KV_INDEX            ".index"
+#define KV_INDEX_CLAIM      ".index-lock"
+#define KV_LOCK_CLAIM       ".lock"
+#define KV_INDEX_LOCK       "kv-index-"
+#define KV_LOCK_WAIT        apr_time_from_sec(5)
+
+#define KV_CLAIM_SETTLE     apr_time_from_msec(20)
+#define KV_CLAIM_POLL       apr_time_from_msec(50)
+#define KV_INDEX_TTL        apr_time_from_sec(60)
+#define KV_LOCK_TTL         apr_time_from_sec(15 * 60)
+
+typedef struct {
+    apr_pool_t *p;             /* holds aspects, created anew on every fetch */
+    md_json_t *aspects;        /* aspect -> modification time */
+    apr_time_t fetched;        /* when aspects were fetched, 0 to fetch on next use */
+} kv_name_t;
+
+typedef struct {
+    apr_pool_t *p;             /* holds idx, created anew on every fetch */
+    md_json_t *idx;            /* names -> name -> true */
+    apr_time_t fetched;        /* when idx was fetched, 0 to fetch on next use */
+    apr_hash_t *names;         /* name -> kv_name_t*, for the names looked at */
+} kv_group_t;
+
+/* What kv_lock() hands out as md_store_lock_t, also used for changing an index */
+typedef struct {
+    md_store_lock_t *local;    /* on the local copies, for this server */
+    const char *claim;         /* key of the claim for other servers, NULL for none */
+    apr_pool_t *p;
+} kv_lock_t;
+
+typedef struct md_store_kv_store_t md_store_kv_store_t;
+struct md_store_kv_store_t {
+    md_store_t s;
+
+    apr_pool_t *p;
+    md_store_kv_t *kv;
+    const char *owner;         /* of the claims this server makes */
+    md_store_t *cache;         /* md_store_fs with the local copies */
+    apr_interval_time_t max_age;
+    kv_group_t groups[MD_SG_COUNT];
+    apr_hash_t *local;         /* value key -> apr_time_t* modification of local copy */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+};
+
+#define KV_STORE(store)     (md_store_kv_store_t*)(((char*)store)-offsetof(md_store_kv_store_t, s))
+
+static void kv_enter(md_store_kv_store_t *s_kv)
+{
+#if APR_HAS_THREADS
+    if (s_kv->mutex) apr_thread_mutex_lock(s_kv->mutex);
+#else
+    (void)s_kv;
+#endif
+}
+
+static void kv_leave(md_store_kv_store_t *s_kv)
+{
+#if APR_HAS_THREADS
+    if (s_kv->mutex) apr_thread_mutex_unlock(s_kv->mutex);
+#else
+    (void)s_kv;
+#endif
+}
+
+static const char *idx_name(const char *name)
+{
+    /* files at the top of the store have no name */
+    return name? name : "";
+}
+
+static const char *val_key(md_store_group_t group, const char *name, const char *aspect,
+                           apr_pool_t *p)
+{
+    return apr_pstrcat(p, md_store_group_name(group), "/", idx_name(name), "/", aspect, NULL);
+}
+
+static const char *idx_key(md_store_group_t group, apr_pool_t *p)
+{
+    return apr_pstrcat(p, md_store_group_name(group), "/" KV_INDEX, NULL);
+}
+
+static const char *name_key(md_store_group_t group, const char *name, apr_pool_t *p)
+{
+    return val_key(group, name, KV_INDEX, p);
+}
+
+static apr_status_t read_file(const char **pdata, apr_size_t *plen, const char *fpath,
+                              apr_pool_t *p)
+{
+    apr_file_t *f;
+    apr_finfo_t info;
+    char *data;
+    apr_status_t rv;
+    MD_CHK_VARS;
+
+    if (MD_OK(apr_file_open(&f, fpath, APR_FOPEN_READ|APR_FOPEN_BINARY, 0, p))) {
+        if (MD_OK(apr_file_info_get(&info, APR_FINFO_SIZE, f))) {
+            *plen = (apr_size_t)info.size;
+            data = apr_palloc(p, *plen + 1);
+            if (MD_OK(apr_file_read_full(f, data, *plen, plen))) {
+                data[*plen] = '\0';
+                *pdata = data;
+            }
+        }
+        apr_file_close(f);
+    }
+    return rv;
+}
+
+/**************************************************************************************************/
+/* local copies, called with the mutex held */
+
+static apr_time_t local_get(md_store_kv_store_t *s_kv, const char *key)
+{
+    apr_time_t *pmtime = apr_hash_get(s_kv->local, key, APR_HASH_KEY_STRING);
+    return pmtime? *pmtime : -1;
+}
+
+static void local_set(md_store_kv_store_t *s_kv, const char *key, apr_time_t mtime)
+{
+    apr_time_t *pmtime = apr_hash_get(s_kv->local, key, APR_HASH_KEY_STRING);
+
+    if (!pmtime) {
+        pmtime = apr_palloc(s_kv->p, sizeof(*pmtime));
+        apr_hash_set(s_kv->local, apr_pstrdup(s_kv->p, key), APR_HASH_KEY_STRING, pmtime);
+    }
+    *pmtime = mtime;
+}
+
+static void local_forget(md_store_kv_store_t *s_kv, const char *prefix, apr_pool_t *p)
+{
+    apr_hash_index_t *hi;
+    const void *key;
+    apr_size_t plen = strlen(prefix);
+
+    for (hi = apr_hash_first(p, s_kv->local); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, &key, NULL, NULL);
+        if (!strncmp(prefix, key, plen)) {
+            apr_hash_set(s_kv->local, key, APR_HASH_KEY_STRING, NULL);
+        }
+    }
+}
+
+/**************************************************************************************************/
+/* claims, the locks between servers */
+
+static apr_time_t claim_parse(const char **powner, const char *data, apr_size_t len,
+                              apr_pool_t *p)
+{
+    char *s, *end;
+    apr_int64_t expires;
+
+    s = apr_pstrmemdup(p, data, len);
+    expires = apr_strtoi64(s, &end, 10);
+    *powner = (*end == ' ')? end + 1 : "";
+    return (apr_time_t)expires;
+}
+
+/* Try once to take the claim at key. The service cannot compare and swap, so a claim
+ * that is free, expired or already ours is written and read back after a while: we
+ * have it when our value is still there. A server writing more than KV_CLAIM_SETTLE
+ * after us may take it as well, claims make collisions rare, not impossible. */
+static apr_status_t claim_try(md_store_kv_store_t *s_kv, const char *key,
+                              apr_interval_time_t ttl, apr_pool_t *p)
+{
+    md_store_kv_t *kv = s_kv->kv;
+    const char *data, *owner, *value;
+    apr_size_t len;
+    apr_time_t now = apr_time_now();
+    apr_status_t rv;
+
+    rv = kv->get(kv, key, &data, &len, p);
+    if (APR_SUCCESS == rv) {
+        if (claim_parse(&owner, data, len, p) > now && strcmp(owner, s_kv->owner)) {
+            return APR_EAGAIN;
+        }
+    }
+    else if (!APR_STATUS_IS_ENOENT(rv)) {
+        return rv;
+    }
+    value = apr_psprintf(p, "%" APR_TIME_T_FMT " %s", now + ttl, s_kv->owner);
+    if (APR_SUCCESS != (rv = kv->set(kv, key, value, strlen(value), p))) {
+        return rv;
+    }
+    apr_sleep(KV_CLAIM_SETTLE);
+    rv = kv->get(kv, key, &data, &len, p);
+    if (APR_SUCCESS == rv) {
+        claim_parse(&owner, data, len, p);
+        return strcmp(owner, s_kv->owner)? APR_EAGAIN : APR_SUCCESS;
+    }
+    return APR_STATUS_IS_ENOENT(rv)? APR_EAGAIN : rv;
+}
+
+static apr_status_t claim_acquire(md_store_kv_store_t *s_kv, const char *key,
+                                  apr_interval_time_t ttl, apr_interval_time_t timeout,
+                                  apr_pool_t *p)
+{
+    apr_time_t deadline = apr_time_now() + timeout;
+    apr_status_t rv;
+
+    while (APR_STATUS_IS_EAGAIN(rv = claim_try(s_kv, key, ttl, p))) {
+        if (apr_time_now() >= deadline) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s held by another server", key);
+            return APR_TIMEUP;
+        }
+        apr_sleep(KV_CLAIM_POLL);
+    }
+    return rv;
+}
+
+static void claim_release(md_store_kv_store_t *s_kv, const char *key, apr_pool_t *p)
+{
+    md_store_kv_t *kv = s_kv->kv;
+    const char *data, *owner;
+    apr_size_t len;
+
+    if (APR_SUCCESS == kv->get(kv, key, &data, &len, p)) {
+        claim_parse(&owner, data, len, p);
+        if (!strcmp(owner, s_kv->owner)) {
+            kv->remove(kv, key, p);
+        }
+    }
+}
+
+/**************************************************************************************************/
+/* indices, called with the mutex held */
+
+/* The index of a group lists its names, each name has an index of its own with the
+ * aspects and their modification times. A change to a value only rewrites the index
+ * of its name, the group's one changes when a name comes or goes. */
+
+static int stop_at_key(void *baton, const char *key, md_json_t *json)
+{
+    (void)baton;
+    (void)key;
+    (void)json;
+    return 0;
+}
+
+static int idx_is_empty(md_json_t *idx)
+{
+    /* iterating returns 1 only when no key stopped it */
+    return md_json_iterkey(stop_at_key, NULL, idx, NULL);
+}
+
+/* Get the index at key into a new pool, an empty one if there is none */
+static apr_status_t idx_fetch(md_json_t **pidx, apr_pool_t **ppool, md_store_kv_store_t *s_kv,
+                              const char *key, apr_pool_t *ptemp)
+{
+    const char *data;
+    apr_size_t len;
+    apr_status_t rv;
+
+    if (APR_SUCCESS != (rv = apr_pool_create(ppool, s_kv->p))) {
+        return rv;
+    }
+    rv = s_kv->kv->get(s_kv->kv, key, &data, &len, ptemp);
+    if (APR_SUCCESS == rv) {
+        rv = md_json_readd(pidx, *ppool, data, len);
+    }
+    else if (APR_STATUS_IS_ENOENT(rv)) {
+        *pidx = md_json_create(*ppool);
+        rv = APR_SUCCESS;
+    }
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, ptemp, "fetching index %s", key);
+        apr_pool_destroy(*ppool);
+    }
+    return rv;
+}
+
+static apr_status_t idx_commit(md_store_kv_store_t *s_kv, const char *key, md_json_t *idx,
+                               apr_pool_t *p)
+{
+    const char *s;
+    apr_status_t rv = APR_EINVAL;
+
+    if (NULL != (s = md_json_writep(idx, p, MD_JSON_FMT_COMPACT))) {
+        rv = s_kv->kv->set(s_kv->kv, key, s, strlen(s), p);
+    }
+    if (APR_STATUS_IS_ENOSPC(rv)) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "index %s has grown to %lu bytes, more "
+                      "than the key/value service keeps in one value", key, 
+                      (unsigned long)strlen(s));
+    }
+    else if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "saving index %s", key);
+    }
+    return rv;
+}
+
+static apr_status_t grp_fetch(md_store_kv_store_t *s_kv, md_store_group_t group, int force,
+                              apr_pool_t *ptemp)
+{
+    kv_group_t *g = &s_kv->groups[group];
+    apr_pool_t *gp;
+    md_json_t *idx;
+    apr_time_t now = apr_time_now();
+    apr_status_t rv;
+
+    if (!force && g->fetched && (now - g->fetched) < s_kv->max_age) {
+        return APR_SUCCESS;
+    }
+    if (APR_SUCCESS != (rv = idx_fetch(&idx, &gp, s_kv, idx_key(group, ptemp), ptemp))) {
+        return rv;
+    }
+    if (g->p) {
+        apr_pool_destroy(g->p);
+    }
+    g->p = gp;
+    g->idx = idx;
+    g->fetched = now;
+    return APR_SUCCESS;
+}
+
+/* Get the names of a group for reading, an outdated list is used when it cannot 
+ * be fetched */
+static apr_status_t grp_read(kv_group_t **pg, md_store_kv_store_t *s_kv,
+                             md_store_group_t group, apr_pool_t *ptemp)
+{
+    apr_status_t rv;
+
+    *pg = &s_kv->groups[group];
+    rv = grp_fetch(s_kv, group, 0, ptemp);
+    return (*pg)->idx? APR_SUCCESS : rv;
+}
+
+/* Add or remove a name in the index of its group, if that changes it */
+static apr_status_t grp_set_name(md_store_kv_store_t *s_kv, md_store_group_t group,
+                                 const char *name, int present, apr_pool_t *p)
+{
+    kv_group_t *g = &s_kv->groups[group];
+    apr_status_t rv;
+
+    if (!present == !md_json_has_key(g->idx, MD_KEY_NAMES, idx_name(name), NULL)) {
+        return APR_SUCCESS;
+    }
+    if (present) {
+        md_json_setb(1, g->idx, MD_KEY_NAMES, idx_name(name), NULL);
+    }
+    else {
+        md_json_del(g->idx, MD_KEY_NAMES, idx_name(name), NULL);
+    }
+    if (APR_SUCCESS != (rv = idx_commit(s_kv, idx_key(group, p), g->idx, p))) {
+        /* our copy has changes the service does not have */
+        g->fetched = 0;
+    }
+    return rv;
+}
+
+static kv_name_t *name_get(md_store_kv_store_t *s_kv, md_store_group_t group, const char *name)
+{
+    kv_group_t *g = &s_kv->groups[group];
+    kv_name_t *n;
+
+    name = idx_name(name);
+    if (NULL == (n = apr_hash_get(g->names, name, APR_HASH_KEY_STRING))) {
+        n = apr_pcalloc(s_kv->p, sizeof(*n));
+        apr_hash_set(g->names, apr_pstrdup(s_kv->p, name), APR_HASH_KEY_STRING, n);
+    }
+    return n;
+}
+
+/* Have the aspects of n replaced, a NULL aspects clears them */
+static apr_status_t name_replace(md_store_kv_store_t *s_kv, kv_name_t *n, md_json_t *aspects)
+{
+    apr_pool_t *np;
+    apr_status_t rv;
+
+    if (APR_SUCCESS != (rv = apr_pool_create(&np, s_kv->p))) {
+        return rv;
+    }
+    if (n->p) {
+        apr_pool_destroy(n->p);
+    }
+    n->p = np;
+    n->aspects = aspects? md_json_clone(np, aspects) : md_json_create(np);
+    n->fetched = apr_time_now();
+    return APR_SUCCESS;
+}
+
+/* Get the aspects of a name. Unless forced, a recent copy is used and, when the
+ * index cannot be fetched, an outdated one. */
+static apr_status_t name_read(kv_name_t **pn, md_store_kv_store_t *s_kv,
+                              md_store_group_t group, const char *name, int force,
+                              apr_pool_t *ptemp)
+{
+    kv_name_t *n;
+    apr_pool_t *np;
+    md_json_t *aspects;
+    apr_time_t now = apr_time_now();
+    apr_status_t rv;
+
+    *pn = n = name_get(s_kv, group, name);
+    if (!force && n->fetched && (now - n->fetched) < s_kv->max_age) {
+        return APR_SUCCESS;
+    }
+    if (APR_SUCCESS != (rv = idx_fetch(&aspects, &np, s_kv, name_key(group, name, ptemp), 
+                                       ptemp))) {
+        return (!force && n->aspects)? APR_SUCCESS : rv;
+    }
+    if (n->p) {
+        apr_pool_destroy(n->p);
+    }
+    n->p = np;
+    n->aspects = aspects;
+    n->fetched = now;
+    return APR_SUCCESS;
+}
+
+/* Write the index of a name, removing it and the name from its group once empty */
+static apr_status_t name_commit(md_store_kv_store_t *s_kv, md_store_group_t group,
+                                const char *name, kv_name_t *n, apr_pool_t *p)
+{
+    const char *key = name_key(group, name, p);
+    int empty = idx_is_empty(n->aspects);
+    apr_status_t rv;
+
+    if (empty) {
+        rv = s_kv->kv->remove(s_kv->kv, key, p);
+        if (APR_STATUS_IS_ENOENT(rv)) {
+            rv = APR_SUCCESS;
+        }
+    }
+    else {
+        rv = idx_commit(s_kv, key, n->aspects, p);
+    }
+    if (APR_SUCCESS == rv) {
+        rv = grp_set_name(s_kv, group, name, !empty, p);
+    }
+    else {
+        n->fetched = 0;
+    }
+    return rv;
+}
+
+/* Lock a group for changing its indices, against this server's processes and 
+ * threads and, with a claim, against other servers. The group's index is fetched. */
+static apr_status_t grp_begin(kv_lock_t *lock, md_store_kv_store_t *s_kv, 
+                              md_store_group_t group, apr_pool_t *p)
+{
+    apr_status_t rv;
+
+    memset(lock, 0, sizeof(*lock));
+    lock->p = p;
+    rv = md_store_lock(&lock->local, s_kv->cache, p, MD_SG_NONE,
+                       apr_pstrcat(p, KV_INDEX_LOCK, md_store_group_name(group), NULL),
+                       1, KV_LOCK_WAIT);
+    if (APR_SUCCESS != rv) {
+        return rv;
+    }
+    lock->claim = apr_pstrcat(p, md_store_group_name(group), "/" KV_INDEX_CLAIM, NULL);
+    if (APR_SUCCESS != (rv = claim_acquire(s_kv, lock->claim, KV_INDEX_TTL, 
+                                           KV_LOCK_WAIT, p))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "claiming index of %s", 
+                      md_store_group_name(group));
+        md_store_unlock(s_kv->cache, lock->local);
+        return rv;
+    }
+    kv_enter(s_kv);
+    if (APR_SUCCESS != (rv = grp_fetch(s_kv, group, 1, p))) {
+        kv_leave(s_kv);
+        claim_release(s_kv, lock->claim, p);
+        md_store_unlock(s_kv->cache, lock->local);
+    }
+    return rv;
+}
+
+static void grp_end(md_store_kv_store_t *s_kv, kv_lock_t *lock)
+{
+    kv_leave(s_kv);
+    claim_release(s_kv, lock->claim, lock->p);
+    md_store_unlock(s_kv->cache, lock->local);
+}
+
+static apr_status_t get_mtime(apr_time_t *pmtime, md_store_kv_store_t *s_kv,
+                              md_store_group_t group, const char *name, const char *aspect,
+                              apr_pool_t *p)
+{
+    kv_name_t *n;
+    apr_status_t rv;
+
+    *pmtime = 0;
+    kv_enter(s_kv);
+    if (APR_SUCCESS == (rv = name_read(&n, s_kv, group, name, 0, p))) {
+        *pmtime = (apr_time_t)md_json_getn(n->aspects, aspect, NULL);
+    }
+    kv_leave(s_kv);
+    return rv;
+}
+
+/* A copy of the aspects of a name, NULL if it has none */
+static md_json_t *get_aspects(md_store_kv_store_t *s_kv, md_store_group_t group,
+                              const char *name, int force, apr_pool_t *p)
+{
+    kv_name_t *n;
+    md_json_t *aspects = NULL;
+
+    if (APR_SUCCESS == name_read(&n, s_kv, group, name, force, p)
+        && !idx_is_empty(n->aspects)) {
+        aspects = md_json_clone(p, n->aspects);
+    }
+    return aspects;
+}
+
+/* Bring the local copy of a value up to the given modification time, 0 for none */
+static apr_status_t sync_local(md_store_kv_store_t *s_kv, md_store_group_t group,
+                               const char *name, const char *aspect, apr_time_t mtime,
+                               apr_pool_t *p)
+{
+    const char *key, *data;
+    apr_size_t len;
+    apr_time_t local;
+    apr_status_t rv;
+
+    key = val_key(group, name, aspect, p);
+    kv_enter(s_kv);
+    local = local_get(s_kv, key);
+    kv_leave(s_kv);
+    if (local == mtime) {
+        return APR_SUCCESS;
+    }
+
+    if (!mtime) {
+        rv = md_store_remove(s_kv->cache, group, name, aspect, p, 1);
+        if (APR_STATUS_IS_ENOENT(rv)) {
+            rv = APR_SUCCESS;
+        }
+    }
+    else if (APR_SUCCESS == (rv = s_kv->kv->get(s_kv->kv, key, &data, &len, p))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, 0, p, "fetched %s", key);
+        rv = md_store_save(s_kv->cache, p, group, name, aspect, MD_SV_TEXT,
+                           apr_pstrmemdup(p, data, len), 0);
+    }
+    if (APR_SUCCESS == rv) {
+        kv_enter(s_kv);
+        local_set(s_kv, key, mtime);
+        kv_leave(s_kv);
+    }
+    return rv;
+}
+
+/**************************************************************************************************/
+/* store callbacks */
+
+static apr_status_t kv_load(md_store_t *store, md_store_group_t group,
+                            const char *name, const char *aspect,
+                            md_store_vtype_t vtype, void **pvalue, apr_pool_t *p)
+{
+    md_store_kv_store_t *s_kv = KV_STORE(store);
+    apr_time_t mtime;
+    apr_status_t rv;
+    MD_CHK_VARS;
+
+    if (   MD_OK(get_mtime(&mtime, s_kv, group, name, aspect, p))
+        && MD_OK(sync_local(s_kv, group, name, aspect, mtime, p))) {
+        rv = mtime? md_store_load(s_kv->cache, group, name, aspect, vtype, pvalue, p) : APR_ENOENT;
+    }
+    return rv;
+}
+
+static apr_status_t kv_save(md_store_t *store, apr_pool_t *p, md_store_group_t group,
+                            const char *name, const char *aspect,
+                            md_store_vtype_t vtype, void *value, int create)
+{
+    md_store_kv_store_t *s_kv = KV_STORE(store);
+    kv_lock_t lock;
+    kv_name_t *n;
+    const char *key, *fpath, *data;
+    apr_size_t len;
+    apr_time_t mtime, old;
+    apr_status_t rv;
+    MD_CHK_VARS;
+
+    if (!MD_OK(grp_begin(&lock, s_kv, group, p))) {
+        return rv;
+    }
+    key = val_key(group, name, aspect, p);
+    if (!MD_OK(name_read(&n, s_kv, group, name, 1, p))) {
+        goto out;
+    }
+    old = (apr_time_t)md_json_getn(n->aspects, aspect, NULL);
+    if (create && old) {
+        rv = APR_EEXIST;
+        goto out;
+    }
+
+    if (   MD_OK(md_store_save(s_kv->cache, p, group, name, aspect, vtype, value, 0))
+        && MD_OK(md_store_get_fname(&fpath, s_kv->cache, group, name, aspect, p))
+        && MD_OK(read_file(&data, &len, fpath, p))
+        && MD_OK(s_kv->kv->set(s_kv->kv, key, data, len, p))) {
+        /* keep modification times increasing, md_store_is_newer() relies on them */
+        mtime = apr_time_now();
+        if (mtime <= old) {
+            mtime = old + 1;
+        }
+        md_json_setn((double)mtime, n->aspects, aspect, NULL);
+        if (MD_OK(name_commit(s_kv, group, name, n, p))) {
+            local_set(s_kv, key, mtime);
+        }
+    }
+    if (APR_SUCCESS != rv) {
+        /* the local copy may have changed, fetch it again */
+        local_forget(s_kv, key, p);
+    }
+out:
+    grp_end(s_kv, &lock);
+    return rv;
+}
+
+static apr_status_t kv_remove(md_store_t *store, md_store_group_t group,
+                              const char *name, const char *aspect,
+                              apr_pool_t *p, int force)
+{
+    md_store_kv_store_t *s_kv = KV_STORE(store);
+    kv_lock_t lock;
+    kv_name_t *n;
+    const char *key;
+    apr_status_t rv;
+    MD_CHK_VARS;
+
+    if (!MD_OK(grp_begin(&lock, s_kv, group, p))) {
+        return rv;
+    }
+    key = val_key(group, name, aspect, p);
+    if (!MD_OK(name_read(&n, s_kv, group, name, 1, p))) {
+        /* keep the value, the index still has it */
+    }
+    else if (!md_json_getn(n->aspects, aspect, NULL)) {
+        rv = force? APR_SUCCESS : APR_ENOENT;
+    }
+    else if (MD_OK(s_kv->kv->remove(s_kv->kv, key, p)) || APR_STATUS_IS_ENOENT(rv)) {
+        md_json_del(n->aspects, aspect, NULL);
+        rv = name_commit(s_kv, group, name, n, p);
+    }
+    local_forget(s_kv, key, p);
+    grp_end(s_kv, &lock);
+
+    md_store_remove(s_kv->cache, group, name, aspect, p, 1);
+    return rv;
+}
+
+typedef struct {
+    md_store_kv_store_t *s_kv;
+    apr_pool_t *p;
+    md_store_group_t from;
+    const char *from_name;
+    md_store_group_t to;
+    const char *to_name;
+    apr_status_t rv;
+} copy_ctx;
+
+static int copy_value(void *baton, const char *aspect, md_json_t *json)
+{
+    copy_ctx *ctx = baton;
+    md_store_kv_t *kv = ctx->s_kv->kv;
+    const char *data;
+    apr_size_t len;
+
+    (void)json;
+    if (APR_SUCCESS == (ctx->rv = kv->get(kv, val_key(ctx->from, ctx->from_name, aspect, ctx->p),
+                                          &data, &len, ctx->p))) {
+        ctx->rv = kv->set(kv, val_key(ctx->to, ctx->to_name, aspect, ctx->p), data, len, ctx->p);
+    }
+    return APR_SUCCESS == ctx->rv;
+}
+
+static int remove_value(void *baton, const char *aspect, md_json_t *json)
+{
+    copy_ctx *ctx = baton;
+    md_store_kv_t *kv = ctx->s_kv->kv;
+
+    (void)json;
+    ctx->rv = kv->remove(kv, val_key(ctx->from, ctx->from_name, aspect, ctx->p), ctx->p);
+    if (APR_STATUS_IS_ENOENT(ctx->rv)) {
+        ctx->rv = APR_SUCCESS;
+    }
+    return APR_SUCCESS == ctx->rv;
+}
+
+/* Copy all values of a name to another group and/or name, the index of the target
+ * name is changed with the group locked */
+static apr_status_t copy_name(md_store_kv_store_t *s_kv, apr_pool_t *p,
+                              md_store_group_t from, const char *from_name, md_json_t *aspects,
+                              md_store_group_t to, const char *to_name)
+{
+    kv_lock_t lock;
+    kv_name_t *n;
+    copy_ctx ctx;
+    apr_status_t rv;
+    MD_CHK_VARS;
+
+    if (!MD_OK(grp_begin(&lock, s_kv, to, p))) {
+        return rv;
+    }
+    ctx.s_kv = s_kv;
+    ctx.p = p;
+    ctx.from = from;
+    ctx.from_name = from_name;
+    ctx.to = to;
+    ctx.to_name = to_name;
+    ctx.rv = APR_SUCCESS;
+    md_json_iterkey(copy_value, &ctx, aspects, NULL);
+    n = name_get(s_kv, to, to_name);
+    if (MD_OK(ctx.rv) && MD_OK(name_replace(s_kv, n, aspects))) {
+        rv = name_commit(s_kv, to, to_name, n, p);
+    }
+    local_forget(s_kv, val_key(to, to_name, "", p), p);
+    grp_end(s_kv, &lock);
+    return rv;
+}
+
+static apr_status_t kv_purge(md_store_t *store, apr_pool_t *p, md_store_group_t group,
+                             const char *name)
+{
+    md_store_kv_store_t *s_kv = KV_STORE(store);
+    kv_lock_t lock;
+    kv_name_t *n;
+    md_json_t *aspects;
+    copy_ctx ctx;
+    apr_status_t rv;
+    MD_CHK_VARS;
+
+    if (!MD_OK(grp_begin(&lock, s_kv, group, p))) {
+        return rv;
+    }
+    if (MD_OK(name_read(&n, s_kv, group, name, 1, p))) {
+        aspects = md_json_clone(p, n->aspects);
+        memset(&ctx, 0, sizeof(ctx));
+        ctx.s_kv = s_kv;
+        ctx.p = p;
+        ctx.from = group;
+        ctx.from_name = name;
+        ctx.rv = APR_SUCCESS;
+        md_json_iterkey(remove_value, &ctx, aspects, NULL);
+        /* an empty index drops the name from its group as well */
+        if (   MD_OK(name_replace(s_kv, n, NULL))
+            && MD_OK(name_commit(s_kv, group, name, n, p))) {
+            rv = ctx.rv;
+        }
+    }
+    local_forget(s_kv, val_key(group, name, "", p), p);
+    grp_end(s_kv, &lock);
+
+    md_store_purge(s_kv->cache, p, group, name);
+    return rv;
+}
+
+static apr_status_t kv_move(md_store_t *store, apr_pool_t *p,
+                            md_store_group_t from, md_store_group_t to,
+                            const char *name, int archive)
+{
+    md_store_kv_store_t *s_kv = KV_STORE(store);
+    kv_lock_t lock;
+    kv_group_t *g;
+    md_json_t *from_aspects, *to_aspects;
+    const char *arch_name = NULL;
+    int n;
+    apr_status_t rv = APR_SUCCESS;
+    MD_CHK_VARS;
+
+    if (from == to) {
+        return APR_EINVAL;
+    }
+
+    kv_enter(s_kv);
+    to_aspects = NULL;
+    if (NULL != (from_aspects = get_aspects(s_kv, from, name, 1, p))) {
+        to_aspects = get_aspects(s_kv, to, name, 1, p);
+    }
+    kv_leave(s_kv);
+    if (!from_aspects) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "nothing to move: %s/%s",
+                      md_store_group_name(from), name);
+        return APR_ENOENT;
+    }
+
+    if (to_aspects) {
+        if (!archive) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "target exists: %s/%s",
+                          md_store_group_name(to), name);
+            return APR_EEXIST;
+        }
+        if (!MD_OK(grp_begin(&lock, s_kv, MD_SG_ARCHIVE, p))) {
+            return rv;
+        }
+        g = &s_kv->groups[MD_SG_ARCHIVE];
+        for (n = 1; n < 1000; ++n) {
+            arch_name = apr_psprintf(p, "%s.%d", name, n);
+            if (!md_json_has_key(g->idx, MD_KEY_NAMES, arch_name, NULL)) {
+                /* take the name, so nobody else uses it while we copy */
+                rv = grp_set_name(s_kv, MD_SG_ARCHIVE, arch_name, 1, p);
+                break;
+            }
+            arch_name = NULL;
+        }
+        grp_end(s_kv, &lock);
+        if (!arch_name) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, 0, p, "ran out of numbers less than 1000 "
+                          "while looking for an available one to archive %s/%s",
+                          md_store_group_name(to), name);
+            return APR_EGENERAL;
+        }
+        if (   !MD_OK(rv)
+            || !MD_OK(copy_name(s_kv, p, to, name, to_aspects, MD_SG_ARCHIVE, arch_name))) {
+            goto out;
+        }
+    }
+
+    if (   MD_OK(kv_purge(store, p, to, name))
+        && MD_OK(copy_name(s_kv, p, from, name, from_aspects, to, name))) {
+        rv = kv_purge(store, p, from, name);
+    }
+out:
+    md_store_purge(s_kv->cache, p, from, name);
+    md_store_purge(s_kv->cache, p, to, name);
+    return rv;
+}
+
+typedef struct {
+    md_store_kv_store_t *s_kv;
+    apr_pool_t *np;         /* for the current name, cleared for the next */
+    apr_pool_t *vp;         /* for the current value, cleared for the next */
+    md_store_group_t group;
+    const char *pattern;
+    const char *aspect;
+    md_store_vtype_t vtype;
+    md_store_inspect *inspect;
+    void *baton;
+    const char *name;
+    apr_status_t rv;
+} inspect_ctx;
+
+static int insp_aspect(void *baton, const char *aspect, md_json_t *json)
+{
+    inspect_ctx *ctx = baton;
+    void *value;
+    apr_status_t rv;
+    MD_CHK_VARS;
+
+    if (APR_SUCCESS != apr_fnmatch(ctx->aspect, aspect, 0)) {
+        return 1;
+    }
+    apr_pool_clear(ctx->vp);
+    if (   MD_OK(sync_local(ctx->s_kv, ctx->group, ctx->name, aspect,
+                            (apr_time_t)md_json_getn(json, NULL), ctx->vp))
+        && MD_OK(md_store_load(ctx->s_kv->cache, ctx->group, ctx->name, aspect,
+                               ctx->vtype, &value, ctx->vp))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, ctx->vp, "inspecting value at: %s/%s/%s",
+                      md_store_group_name(ctx->group), ctx->name, aspect);
+        if (!ctx->inspect(ctx->baton, ctx->name, aspect, ctx->vtype, value, ctx->vp)) {
+            rv = APR_EOF;
+        }
+    }
+    else if (APR_STATUS_IS_ENOENT(rv)) {
+        /* removed since the index was fetched */
+        rv = APR_SUCCESS;
+    }
+    ctx->rv = rv;
+    return (APR_SUCCESS == rv);
+}
+
+static int insp_name(void *baton, const char *name, md_json_t *json)
+{
+    inspect_ctx *ctx = baton;
+    md_json_t *aspects;
+
+    (void)json;
+    if (APR_SUCCESS != apr_fnmatch(ctx->pattern, name, 0)) {
+        return 1;
+    }
+    apr_pool_clear(ctx->np);
+    ctx->name = apr_pstrdup(ctx->np, name);
+    kv_enter(ctx->s_kv);
+    aspects = get_aspects(ctx->s_kv, ctx->group, ctx->name, 0, ctx->np);
+    kv_leave(ctx->s_kv);
+    if (aspects) {
+        md_json_iterkey(insp_aspect, ctx, aspects, NULL);
+    }
+    return (APR_SUCCESS == ctx->rv);
+}
+
+static apr_status_t kv_iterate(md_store_inspect *inspect, void *baton, md_store_t *store,
+                               apr_pool_t *p, md_store_group_t group, const char *pattern,
+                               const char *aspect, md_store_vtype_t vtype)
+{
+    md_store_kv_store_t *s_kv = KV_STORE(store);
+    kv_group_t *g;
+    md_json_t *names = NULL;
+    inspect_ctx ctx;
+    apr_status_t rv;
+    MD_CHK_VARS;
+
+    kv_enter(s_kv);
+    if (MD_OK(grp_read(&g, s_kv, group, p))
+        && NULL != (names = md_json_viewj(g->idx, MD_KEY_NAMES, NULL))) {
+        /* inspecting fetches values, do not hold the mutex for that */
+        names = md_json_clone(p, names);
+    }
+    kv_leave(s_kv);
+    if (APR_SUCCESS != rv || !names) {
+        return rv;
+    }
+
+    /* memory for one item at a time, the pools are cleared for the next */
+    if (APR_SUCCESS != (rv = apr_pool_create(&ctx.np, p))) {
+        return rv;
+    }
+    if (APR_SUCCESS != (rv = apr_pool_create(&ctx.vp, p))) {
+        apr_pool_destroy(ctx.np);
+        return rv;
+    }
+    apr_pool_tag(ctx.np, "md_store_iter_name");
+    apr_pool_tag(ctx.vp, "md_store_iter_value");
+    ctx.s_kv = s_kv;
+    ctx.group = group;
+    ctx.pattern = pattern;
+    ctx.aspect = aspect;
+    ctx.vtype = vtype;
+    ctx.inspect = inspect;
+    ctx.baton = baton;
+    ctx.name = NULL;
+    ctx.rv = APR_SUCCESS;
+    md_json_iterkey(insp_name, &ctx, names, NULL);
+    apr_pool_destroy(ctx.vp);
+    apr_pool_destroy(ctx.np);
+    return ctx.rv;
+}
+
+static apr_status_t kv_get_fname(const char **pfname,
+                                 md_store_t *store, md_store_group_t group,
+                                 const char *name, const char *aspect,
+                                 apr_pool_t *p)
+{
+    md_store_kv_store_t *s_kv = KV_STORE(store);
+    apr_time_t mtime;
+    apr_status_t rv;
+    MD_CHK_VARS;
+
+    /* the file is used by others, e.g. mod_ssl or a challenge response, make it current */
+    if (aspect
+        && (!MD_OK(get_mtime(&mtime, s_kv, group, name, aspect, p))
+            || !MD_OK(sync_local(s_kv, group, name, aspect, mtime, p)))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "updating local copy of %s",
+                      val_key(group, name, aspect, p));
+    }
+    return md_store_get_fname(pfname, s_kv->cache, group, name, aspect, p);
+}
+
+static int kv_is_newer(md_store_t *store, md_store_group_t group1, md_store_group_t group2,
+                       const char *name, const char *aspect, apr_pool_t *p)
+{
+    md_store_kv_store_t *s_kv = KV_STORE(store);
+    apr_time_t mtime1, mtime2;
+
+    if (   APR_SUCCESS == get_mtime(&mtime1, s_kv, group1, name, aspect, p)
+        && APR_SUCCESS == get_mtime(&mtime2, s_kv, group2, name, aspect, p)) {
+        return mtime1 && mtime2 && mtime1 > mtime2;
+    }
+    return 0;
+}
+
+static apr_time_t kv_get_modified(md_store_t *store, md_store_group_t group,
+                                  const char *name, const char *aspect, apr_pool_t *p)
+{
+    md_store_kv_store_t *s_kv = KV_STORE(store);
+    apr_time_t mtime;
+
+    if (APR_SUCCESS == get_mtime(&mtime, s_kv, group, name, aspect, p)) {
+        return mtime;
+    }
+    return 0;
+}
+
+/* Locks are held on the local copies and, when exclusive, claimed in the service
+ * as well. Other servers only see the exclusive ones. */
+static apr_status_t kv_lock(md_store_lock_t **plock, md_store_t *store, apr_pool_t *p,
+                            md_store_group_t group, const char *name, int exclusive,
+                            apr_interval_time_t timeout)
+{
+    md_store_kv_store_t *s_kv = KV_STORE(store);
+    kv_lock_t *lock;
+    apr_time_t deadline = apr_time_now() + timeout;
+    apr_status_t rv;
+    MD_CHK_VARS;
+
+    *plock = NULL;
+    lock = apr_pcalloc(p, sizeof(*lock));
+    lock->p = p;
+    if (!MD_OK(md_store_lock(&lock->local, s_kv->cache, p, group, name, exclusive, timeout))) {
+        return rv;
+    }
+    if (exclusive) {
+        lock->claim = val_key(group, name, KV_LOCK_CLAIM, p);
+        timeout = deadline - apr_time_now();
+        if (!MD_OK(claim_acquire(s_kv, lock->claim, KV_LOCK_TTL, 
+                                 (timeout > 0)? timeout : 0, p))) {
+            md_store_unlock(s_kv->cache, lock->local);
+            return rv;
+        }
+    }
+    *plock = (md_store_lock_t*)lock;
+    return APR_SUCCESS;
+}
+
+static void kv_unlock(md_store_t *store, md_store_lock_t *plock)
+{
+    md_store_kv_store_t *s_kv = KV_STORE(store);
+    kv_lock_t *lock = (kv_lock_t*)plock;
+
+    if (lock->claim) {
+        claim_release(s_kv, lock->claim, lock->p);
+    }
+    md_store_unlock(s_kv->cache, lock->local);
+}
+
+/**************************************************************************************************/
+/* setup */
+
+/* Keys in the store are encrypted with the passphrase in the md_store_fs's own file,
+ * all servers need the same one. The first one to start publishes its file. */
+static apr_status_t setup_cache(md_store_kv_store_t *s_kv, const char *cache_dir, apr_pool_t *p)
+{
+    md_store_kv_t *kv = s_kv->kv;
+    const char *fpath, *data, *local;
+    apr_size_t len, llen;
+    apr_status_t rv;
+    MD_CHK_VARS;
+
+    if (   !MD_OK(apr_dir_make_recursive(cache_dir, MD_FPROT_D_UONLY, p))
+        || !MD_OK(md_util_path_merge(&fpath, p, cache_dir, MD_FN_STORE_JSON, NULL))) {
+        return rv;
+    }
+
+    if (MD_IS_ERR(kv->get(kv, MD_FN_STORE_JSON, &data, &len, p), ENOENT)) {
+        if (   MD_OK(md_store_fs_init(&s_kv->cache, s_kv->p, cache_dir))
+            && MD_OK(read_file(&local, &llen, fpath, p))
+            && MD_OK(kv->set(kv, MD_FN_STORE_JSON, local, llen, p))
+            && MD_OK(kv->get(kv, MD_FN_STORE_JSON, &data, &len, p))
+            && len == llen && !memcmp(data, local, len)) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "published %s", MD_FN_STORE_JSON);
+            return APR_SUCCESS;
+        }
+        if (APR_SUCCESS != rv) {
+            return rv;
+        }
+        /* someone else was faster */
+    }
+    else if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "fetching %s", MD_FN_STORE_JSON);
+        return rv;
+    }
+
+    if (MD_OK(md_text_freplace(fpath, MD_FPROT_F_UONLY, p, apr_pstrmemdup(p, data, len)))) {
+        rv = md_store_fs_init(&s_kv->cache, s_kv->p, cache_dir);
+    }
+    return rv;
+}
+
+apr_status_t md_store_kv_init(md_store_t **pstore, apr_pool_t *p, md_store_kv_t *kv,
+                              const char *cache_dir, apr_interval_time_t max_age)
+{
+    md_store_kv_store_t *s_kv;
+    apr_pool_t *ptemp;
+    unsigned char id[12];
+    apr_status_t rv;
+    int i;
+    MD_CHK_VARS;
+
+    *pstore = NULL;
+    s_kv = apr_pcalloc(p, sizeof(*s_kv));
+
+    s_kv->s.load = kv_load;
+    s_kv->s.save = kv_save;
+    s_kv->s.remove = kv_remove;
+    s_kv->s.move = kv_move;
+    s_kv->s.purge = kv_purge;
+    s_kv->s.iterate = kv_iterate;
+    s_kv->s.get_fname = kv_get_fname;
+    s_kv->s.is_newer = kv_is_newer;
+    s_kv->s.get_modified = kv_get_modified;
+    s_kv->s.lock = kv_lock;
+    s_kv->s.unlock = kv_unlock;
+
+    s_kv->p = p;
+    s_kv->kv = kv;
+    s_kv->max_age = max_age;
+    s_kv->local = apr_hash_make(p);
+    for (i = 0; i < MD_SG_COUNT; ++i) {
+        s_kv->groups[i].names = apr_hash_make(p);
+    }
+    if (!MD_OK(md_rand_bytes(id, sizeof(id), p))) {
+        return rv;
+    }
+    s_kv->owner = md_util_base64url_encode((const char*)id, sizeof(id), p);
+#if APR_HAS_THREADS
+    if (!MD_OK(apr_thread_mutex_create(&s_kv->mutex, APR_THREAD_MUTEX_DEFAULT, p))) {
+        return rv;
+    }
+#endif
+
+    if (!MD_OK(apr_pool_create(&ptemp, p))) {
+        return rv;
+    }
+    if (MD_OK(setup_cache(s_kv, cache_dir, ptemp))) {
+        *pstore = &s_kv->s;
+    }
+    else {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "init kv store with cache at %s",
+                      cache_dir);
+    }
+    apr_pool_destroy(ptemp);
+    return rv;
+}
+
+md_store_t *md_store_kv_get_cache(md_store_t *store)
+{
+    md_store_kv_store_t *s_kv = KV_STORE(store);
+    return s_kv->cache;
+}
@@ -0,0 +1,67 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef mod_md_md_store_kv_h
+#define mod_md_md_store_kv_h
+
+struct md_store_t;
+
+/**
+ * Access to a key/value service, e.g. a network cache shared by several servers.
+ * get() returns APR_ENOENT for keys without value.
+ */
+typedef struct md_store_kv_t md_store_kv_t;
+
+typedef apr_status_t md_store_kv_get_cb(md_store_kv_t *kv, const char *key,
+                                        const char **pvalue, apr_size_t *plen,
+                                        apr_pool_t *p);
+typedef apr_status_t md_store_kv_set_cb(md_store_kv_t *kv, const char *key,
+                                        const char *value, apr_size_t len,
+                                        apr_pool_t *p);
+typedef apr_status_t md_store_kv_remove_cb(md_store_kv_t *kv, const char *key,
+                                           apr_pool_t *p);
+
+struct md_store_kv_t {
+    void *baton;
+    md_store_kv_get_cb *get;
+    md_store_kv_set_cb *set;
+    md_store_kv_remove_cb *remove;
+};
+
+/**
+ * A store keeping its data in a key/value service. The values are the contents of
+ * the files a md_store_fs in cache_dir would have, and that md_store_fs holds local
+ * copies of the values in use. A value is fetched when it is first used or has
+ * changed, so certificates and keys are files, as mod_ssl needs them.
+ *
+ * Each group has an index value with its names and each name one with its aspects
+ * and their modification times, so a value stays small with many MDs. An index is
+ * fetched again when older than max_age. Changes are made holding a claim on the
+ * group in the service, so servers sharing it do not lose each other's updates.
+ * Exclusive locks are claimed in the service as well, shared ones only locally.
+ * The service has no compare and swap: a claim is written and checked again after
+ * a short while, which makes it unlikely, not impossible, for two servers to hold it.
+ * A claim expires after a while, in case its server went away.
+ */
+apr_status_t md_store_kv_init(struct md_store_t **pstore, apr_pool_t *p, md_store_kv_t *kv,
+                              const char *cache_dir, apr_interval_time_t max_age);
+
+/**
+ * The md_store_fs holding the local copies, e.g. for setting its event callback.
+ */
+struct md_store_t *md_store_kv_get_cache(struct md_store_t *store);
+
+#endif /* mod_md_md_store_kv_h */
@@ -0,0 +1,190 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include <apr_atomic.h>
+#include <apr_strings.h>
+
+#include "md.h"
+#include "md_json.h"
+#include "md_trace.h"
+
+#define TRACE_MAX_RECORDS  (1024*1024)
+
+typedef struct md_trace_rec_t md_trace_rec_t;
+struct md_trace_rec_t {
+    volatile apr_uint32_t seq;       /* number of the record + 1, 0 while it is written */
+    md_trace_kind_t kind;
+    int status;
+    apr_time_t start;
+    apr_interval_time_t duration;
+    char name[64];
+    char what[128];
+};
+
+static md_trace_rec_t *ring;
+static apr_uint32_t ring_mask;
+static volatile apr_uint32_t ring_next;
+static md_trace_hist_t *http_hist;
+
+static const apr_uint32_t hist_bounds_ms[MD_TRACE_HIST_BUCKETS-1] = {
+    50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000, 60000, 300000, 600000,
+};
+
+static apr_status_t trace_cleanup(void *data)
+{
+    (void)data;
+    ring = NULL;
+    ring_mask = 0;
+    return APR_SUCCESS;
+}
+
+apr_status_t md_trace_init(apr_pool_t *p, apr_size_t nrecords)
+{
+    apr_uint32_t size;
+
+    ring = NULL;
+    ring_mask = 0;
+    apr_atomic_set32(&ring_next, 0);
+    if (nrecords == 0) {
+        return APR_SUCCESS;
+    }
+    if (nrecords > TRACE_MAX_RECORDS) {
+        return APR_EINVAL;
+    }
+    size = 1;
+    while (size < nrecords) {
+        size <<= 1;
+    }
+
+    ring = apr_pcalloc(p, size * sizeof(*ring));
+    ring_mask = size - 1;
+    apr_pool_cleanup_register(p, NULL, trace_cleanup, apr_pool_cleanup_null);
+    return APR_SUCCESS;
+}
+
+int md_trace_on(void)
+{
+    return ring != NULL || http_hist != NULL;
+}
+
+apr_uint32_t md_trace_hist_bound_ms(int i)
+{
+    return (i >= 0 && i < MD_TRACE_HIST_BUCKETS-1)? hist_bounds_ms[i] : 0;
+}
+
+void md_trace_hist_add(md_trace_hist_t *hist, apr_interval_time_t duration)
+{
+    apr_uint32_t ms;
+    int i;
+    
+    ms = (duration > 0)? (apr_uint32_t)apr_time_as_msec(duration) : 0;
+    i = 0;
+    while (i < MD_TRACE_HIST_BUCKETS-1 && ms > hist_bounds_ms[i]) {
+        ++i;
+    }
+    apr_atomic_inc32(&hist->counts[i]);
+    apr_atomic_add32(&hist->sum_ms, ms);
+}
+
+void md_trace_set_http_hist(md_trace_hist_t *hist)
+{
+    http_hist = hist;
+}
+
+void md_trace_add(md_trace_kind_t kind, const char *name, const char *what, int status,
+                  apr_time_t start, apr_time_t end)
+{
+    md_trace_rec_t *rec;
+    apr_uint32_t n;
+
+    if (kind == MD_TRACE_HTTP && http_hist) {
+        md_trace_hist_add(http_hist, end - start);
+    }
+    if (!ring) return;
+    /* Each writer gets a record of its own. Only when the ring wraps around while
+     * a writer is still busy may a record be overwritten before it is complete. */
+    n = apr_atomic_inc32(&ring_next);
+    rec = &ring[n & ring_mask];
+    apr_atomic_set32(&rec->seq, 0);
+    rec->kind = kind;
+    rec->status = status;
+    rec->start = start;
+    rec->duration = end - start;
+    apr_cpystrn(rec->name, name? name : "", sizeof(rec->name));
+    apr_cpystrn(rec->what, what? what : "", sizeof(rec->what));
+    apr_atomic_set32(&rec->seq, n + 1);
+}
+
+apr_uint32_t md_trace_mark(void)
+{
+    return apr_atomic_read32(&ring_next);
+}
+
+md_json_t *md_trace_dump(apr_pool_t *p, const char *name, apr_uint32_t mark)
+{
+    md_json_t *json, *jrec;
+    md_trace_rec_t rec;
+    apr_uint32_t first, next, i, seq;
+    long http_count = 0;
+    apr_interval_time_t http_time = 0;
+
+    json = md_json_create(p);
+    md_json_setj(md_json_create(p), json, MD_KEY_PHASES, NULL);
+    md_json_setsa(apr_array_make(p, 0, sizeof(const char*)), json, MD_KEY_RECORDS, NULL);
+    if (ring) {
+        next = apr_atomic_read32(&ring_next);
+        first = (next > ring_mask)? next - ring_mask - 1 : 0;
+        /* record numbers wrap around, compare distances back from next */
+        if ((apr_uint32_t)(next - mark) < (apr_uint32_t)(next - first)) {
+            first = mark;
+        }
+        for (i = first; i != next; ++i) {
+            /* copy the record and use it only when no writer touched it meanwhile */
+            seq = apr_atomic_read32(&ring[i & ring_mask].seq);
+            if (seq != i + 1) continue;
+            memcpy(&rec, &ring[i & ring_mask], sizeof(rec));
+            if (apr_atomic_read32(&ring[i & ring_mask].seq) != seq) continue;
+            rec.name[sizeof(rec.name)-1] = '\0';
+            rec.what[sizeof(rec.what)-1] = '\0';
+            if (name && strcmp(name, rec.name)) continue;
+
+            jrec = md_json_create(p);
+            md_json_sets((rec.kind == MD_TRACE_HTTP)? MD_KEY_HTTP : "phase",
+                         jrec, MD_KEY_TYPE, NULL);
+            md_json_sets(rec.name, jrec, MD_KEY_NAME, NULL);
+            md_json_sets(rec.what, jrec, MD_KEY_WHAT, NULL);
+            md_json_setl(rec.status, jrec, MD_KEY_STATUS, NULL);
+            md_json_setl((long)apr_time_as_msec(rec.start), jrec, MD_KEY_START, NULL);
+            md_json_setl((long)apr_time_as_msec(rec.duration), jrec, MD_KEY_MS, NULL);
+            md_json_addj(jrec, json, MD_KEY_RECORDS, NULL);
+
+            if (rec.kind == MD_TRACE_HTTP) {
+                ++http_count;
+                http_time += rec.duration;
+            }
+            else {
+                md_json_setl(md_json_getl(json, MD_KEY_PHASES, rec.what, NULL)
+                             + (long)apr_time_as_msec(rec.duration),
+                             json, MD_KEY_PHASES, rec.what, NULL);
+            }
+        }
+    }
+    md_json_setl(http_count, json, MD_KEY_HTTP, MD_KEY_REQUESTS, NULL);
+    md_json_setl((long)apr_time_as_msec(http_time), json, MD_KEY_HTTP, MD_KEY_MS, NULL);
+    return json;
+}
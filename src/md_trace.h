@@ -0,0 +1,91 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef mod_md_md_trace_h
+#define mod_md_md_trace_h
+
+struct md_json_t;
+
+/**
+ * Timing records of what the drives do, kept in a ring of fixed size in memory.
+ * Tracing is off unless md_trace_init() was called with a size > 0. Records are
+ * added without locks, from any thread, and the oldest ones are overwritten once
+ * the ring is full.
+ */
+typedef enum {
+    MD_TRACE_PHASE,                  /* a phase of a drive, e.g. "monitor challenges" */
+    MD_TRACE_HTTP,                   /* a HTTP request, 'what' is "METHOD url" */
+} md_trace_kind_t;
+
+/**
+ * Start tracing with room for at least nrecords, rounded up to a power of 2.
+ * 0 turns tracing off. Not to be called while records are being added.
+ */
+apr_status_t md_trace_init(apr_pool_t *p, apr_size_t nrecords);
+
+/**
+ * Return != 0 iff records are kept or HTTP requests counted. Callers check this 
+ * before taking times.
+ */
+int md_trace_on(void);
+
+/**
+ * Counts of durations in buckets, kept with atomic operations, so that several
+ * processes may update them in shared memory. The last bucket counts all
+ * durations longer than the bound of the one before.
+ */
+#define MD_TRACE_HIST_BUCKETS   13
+
+typedef struct md_trace_hist_t {
+    volatile apr_uint32_t counts[MD_TRACE_HIST_BUCKETS];
+    volatile apr_uint32_t sum_ms;    /* total milliseconds, wraps around */
+} md_trace_hist_t;
+
+/**
+ * The upper bound of bucket i in milliseconds, 0 for the last one.
+ */
+apr_uint32_t md_trace_hist_bound_ms(int i);
+
+void md_trace_hist_add(md_trace_hist_t *hist, apr_interval_time_t duration);
+
+/**
+ * Have the durations of all HTTP requests counted in hist, NULL to stop. This
+ * works with records being off.
+ */
+void md_trace_set_http_hist(md_trace_hist_t *hist);
+
+/**
+ * Add a record of something done for the MD of the given name, which may be NULL.
+ * Names and descriptions too long for a record are truncated.
+ */
+void md_trace_add(md_trace_kind_t kind, const char *name, const char *what, int status,
+                  apr_time_t start, apr_time_t end);
+
+/**
+ * The number the next record gets, for md_trace_dump().
+ */
+apr_uint32_t md_trace_mark(void);
+
+/**
+ * Get the records of the MD with the given name, or all for a NULL name, as JSON,
+ * oldest first, starting with the record numbered mark, as md_trace_mark() gave
+ * it, or with the oldest one still in the ring. Besides the records, the result
+ * has the number of HTTP requests, their total milliseconds, and the milliseconds
+ * spent in each phase. Records overwritten while this runs are left out.
+ */
+struct md_json_t *md_trace_dump(apr_pool_t *p, const char *name, apr_uint32_t mark);
+
+#endif /* md_trace_h */
@@ -14,15 +14,24 @@
  * limitations under the License.
  */
  
+#include <errno.h>
+#include <signal.h>
 #include <stdio.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
 
 #include <apr_lib.h>
+#include <apr_date.h>
 #include <apr_strings.h>
 #include <apr_portable.h>
 #include <apr_file_info.h>
 #include <apr_fnmatch.h>
+#include <apr_hash.h>
 #include <apr_tables.h>
+#include <apr_thread_proc.h>
 #include <apr_uri.h>
+#include <apr_version.h>
 
 #include "md_log.h"
 #include "md_util.h"
@@ -240,36 +249,105 @@ apr_status_t md_util_path_merge(const char **ppath, apr_pool_t *p, ...)
     return rv;
 }
 
-apr_status_t md_util_freplace(const char *fpath, apr_fileperms_t perms, apr_pool_t *p, 
-                              md_util_file_cb *write_cb, void *baton)
+static md_durability_t durability = MD_DURABLE_NONE;
+
+void md_util_durability_set(md_durability_t value)
+{
+    durability = value;
+}
+
+md_durability_t md_util_durability_get(void)
+{
+    return durability;
+}
+
+static apr_status_t file_sync(apr_file_t *f)
+{
+#if APR_VERSION_AT_LEAST(1,7,0)
+    return apr_file_sync(f);
+#elif !defined(WIN32)
+    apr_os_file_t fd;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS == (rv = apr_os_file_get(&fd, f)) && fsync(fd) < 0) {
+        rv = APR_FROM_OS_ERROR(errno);
+    }
+    return rv;
+#else
+    (void)f;
+    return APR_ENOTIMPL;
+#endif
+}
+
+apr_status_t md_util_fsync_dir(const char *dir, apr_pool_t *p)
 {
-    apr_status_t rv = APR_EEXIST;
+#ifndef WIN32
     apr_file_t *f;
-    const char *tmp;
-    int i, max;
-    
-    tmp = apr_psprintf(p, "%s.tmp", fpath);
-    i = 0; max = 20;
-creat:
-    while (i < max && APR_EEXIST == (rv = md_util_fcreatex(&f, tmp, perms, p))) {
-        ++i;
-        apr_sleep(apr_time_msec(50));
-    } 
-    if (APR_EEXIST == rv 
-        && APR_SUCCESS == (rv = apr_file_remove(tmp, p))
-        && max <= 20) {
-        max *= 2;
-        goto creat;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS == (rv = apr_file_open(&f, dir, APR_FOPEN_READ, APR_OS_DEFAULT, p))) {
+        rv = file_sync(f);
+        apr_file_close(f);
     }
+    return APR_STATUS_IS_ENOTIMPL(rv)? APR_SUCCESS : rv;
+#else
+    /* directory entries are not synced separately there */
+    (void)dir;
+    (void)p;
+    return APR_SUCCESS;
+#endif
+}
+
+apr_status_t md_util_fstage(const char **ptmp, const char *fpath, apr_fileperms_t perms, 
+                            apr_pool_t *p, md_util_file_cb *write_cb, void *baton)
+{
+    apr_status_t rv;
+    apr_file_t *f;
+    char *tmp;
     
+    /* a name of our own, so concurrent writers never wait on each other */
+    tmp = apr_pstrcat(p, fpath, ".XXXXXX", NULL);
+    rv = apr_file_mktemp(&f, tmp, APR_FOPEN_CREATE|APR_FOPEN_WRITE|APR_FOPEN_EXCL, p);
     if (APR_SUCCESS == rv) {
-        rv = write_cb(baton, f, p);
-        apr_file_close(f);
-        
+        rv = apr_file_perms_set(tmp, perms);
+        if (APR_STATUS_IS_ENOTIMPL(rv)) {
+            rv = APR_SUCCESS;
+        }
         if (APR_SUCCESS == rv) {
-            rv = apr_file_rename(tmp, fpath, p);
-            if (APR_SUCCESS != rv) {
-                apr_file_remove(tmp, p);
+            rv = write_cb(baton, f, p);
+        }
+        if (APR_SUCCESS == rv && MD_DURABLE_NONE != durability) {
+            rv = file_sync(f);
+            if (APR_STATUS_IS_ENOTIMPL(rv)) {
+                rv = APR_SUCCESS;
+            }
+        }
+        apr_file_close(f);
+        if (APR_SUCCESS != rv) {
+            apr_file_remove(tmp, p);
+        }
+    }
+    *ptmp = (APR_SUCCESS == rv)? tmp : NULL;
+    return rv;
+}
+
+apr_status_t md_util_freplace(const char *fpath, apr_fileperms_t perms, apr_pool_t *p, 
+                              md_util_file_cb *write_cb, void *baton)
+{
+    const char *tmp;
+    char *dir, *sep;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS == (rv = md_util_fstage(&tmp, fpath, perms, p, write_cb, baton))) {
+        rv = apr_file_rename(tmp, fpath, p);
+        if (APR_SUCCESS != rv) {
+            apr_file_remove(tmp, p);
+        }
+        else if (MD_DURABLE_DIR == durability) {
+            dir = apr_pstrdup(p, fpath);
+            if (NULL != (sep = strrchr(dir, '/'))) {
+                *sep = '\0';
+                rv = md_util_fsync_dir(dir, p);
             }
         }
     }
@@ -279,25 +357,43 @@ creat:
 /**************************************************************************************************/
 /* text files */
 
-apr_status_t md_text_fread8k(const char **ptext, apr_pool_t *p, const char *fpath)
+apr_status_t md_util_file_load(const char **pdata, apr_size_t *plen, apr_pool_t *p,
+                               const char *fpath, apr_size_t max_len)
 {
     apr_status_t rv;
     apr_file_t *f;
-    char buffer[8 * 1024];
+    apr_finfo_t info;
+    apr_size_t len = 0;
+    char *data = NULL;
 
-    *ptext = NULL;
     if (APR_SUCCESS == (rv = apr_file_open(&f, fpath, APR_FOPEN_READ, 0, p))) {
-        apr_size_t blen = sizeof(buffer)/sizeof(buffer[0]) - 1;
-        rv = apr_file_read_full(f, buffer, blen, &blen);
-        if (APR_SUCCESS == rv || APR_STATUS_IS_EOF(rv)) {
-            *ptext = apr_pstrndup(p, buffer, blen);
-            rv = APR_SUCCESS;
+        if (APR_SUCCESS == (rv = apr_file_info_get(&info, APR_FINFO_SIZE, f))) {
+            len = (info.size > 0)? (apr_size_t)info.size : 0;
+            if (max_len && len > max_len) {
+                len = max_len;
+            }
+            data = apr_palloc(p, len + 1);
+            rv = apr_file_read_full(f, data, len, &len);
+            if (APR_STATUS_IS_EOF(rv)) {
+                /* file got shorter meanwhile */
+                rv = APR_SUCCESS;
+            }
+            data[len] = '\0';
         }
         apr_file_close(f);
     }
+    *pdata = (APR_SUCCESS == rv)? data : NULL;
+    *plen = (APR_SUCCESS == rv)? len : 0;
     return rv;
 }
 
+apr_status_t md_text_fread8k(const char **ptext, apr_pool_t *p, const char *fpath)
+{
+    apr_size_t len;
+    
+    return md_util_file_load(ptext, &len, p, fpath, 8 * 1024 - 1);
+}
+
 static apr_status_t write_text(void *baton, struct apr_file_t *f, apr_pool_t *p)
 {
     const char *text = baton;
@@ -655,6 +751,19 @@ int md_dns_is_wildcard(apr_pool_t *p, const char *domain)
     return md_dns_is_name(p, domain+2, 1);
 }
 
+const char *md_dns_suffix(const char *domain)
+{
+    const char *s, *dot = NULL;
+    
+    for (s = domain + strlen(domain); s > domain; --s) {
+        if (s[-1] == '.') {
+            if (dot) return s;
+            dot = s;
+        }
+    }
+    return domain;
+}
+
 int md_dns_matches(const char *pattern, const char *domain)
 {
     const char *s;
@@ -667,39 +776,119 @@ int md_dns_matches(const char *pattern, const char *domain)
     return 0;
 }
 
+/**************************************************************************************************/
+/* dns name sets */
+
+/* DNS names are at most 253 chars, anything longer is never found */
+#define DNS_SET_KEY_MAX     256
+
+struct md_dns_set_t {
+    apr_pool_t *p;
+    apr_hash_t *names;      /* lower case name -> name as added */
+};
+
+static const char *dns_set_key(char *buffer, apr_size_t blen, 
+                               const char *prefix, const char *name)
+{
+    apr_size_t i = 0;
+    
+    while (*prefix && i + 1 < blen) {
+        buffer[i++] = *prefix++;
+    }
+    for (; *name && i + 1 < blen; ++name) {
+        buffer[i++] = (char)apr_tolower(*name);
+    }
+    if (*prefix || *name) {
+        return NULL;
+    }
+    buffer[i] = '\0';
+    return buffer;
+}
+
+md_dns_set_t *md_dns_set_make(apr_pool_t *p, const apr_array_header_t *domains)
+{
+    md_dns_set_t *set;
+    int i;
+    
+    set = apr_pcalloc(p, sizeof(*set));
+    set->p = p;
+    set->names = apr_hash_make(p);
+    for (i = 0; domains && i < domains->nelts; ++i) {
+        md_dns_set_add(set, APR_ARRAY_IDX(domains, i, const char*));
+    }
+    return set;
+}
+
+int md_dns_set_add(md_dns_set_t *set, const char *domain)
+{
+    const char *key;
+    
+    if (md_dns_set_get(set, domain)) {
+        return 0;
+    }
+    key = md_util_str_tolower(apr_pstrdup(set->p, domain));
+    apr_hash_set(set->names, key, APR_HASH_KEY_STRING, domain);
+    return 1;
+}
+
+const char *md_dns_set_get(const md_dns_set_t *set, const char *domain)
+{
+    char buffer[DNS_SET_KEY_MAX];
+    const char *key;
+    
+    if (NULL == (key = dns_set_key(buffer, sizeof(buffer), "", domain))) {
+        return NULL;
+    }
+    return apr_hash_get(set->names, key, APR_HASH_KEY_STRING);
+}
+
+const char *md_dns_set_match(const md_dns_set_t *set, const char *domain)
+{
+    char buffer[DNS_SET_KEY_MAX];
+    const char *name, *parent, *key;
+    
+    if (NULL != (name = md_dns_set_get(set, domain))) {
+        return name;
+    }
+    /* a wildcard matches exactly one label, see md_dns_matches() */
+    if (NULL == (parent = strchr(domain, '.'))
+        || NULL == (key = dns_set_key(buffer, sizeof(buffer), "*", parent))) {
+        return NULL;
+    }
+    return apr_hash_get(set->names, key, APR_HASH_KEY_STRING);
+}
+
+int md_dns_set_count(const md_dns_set_t *set)
+{
+    return (int)apr_hash_count(set->names);
+}
+
 apr_array_header_t *md_dns_make_minimal(apr_pool_t *p, apr_array_header_t *domains)
 {
     apr_array_header_t *minimal;
-    const char *domain, *pattern;
-    int i, j, duplicate;
+    md_dns_set_t *all, *kept;
+    char buffer[DNS_SET_KEY_MAX];
+    const char *domain, *parent, *key;
+    int i;
     
     minimal = apr_array_make(p, domains->nelts, sizeof(const char *));
+    all = md_dns_set_make(p, domains);
+    kept = md_dns_set_make(p, NULL);
     for (i = 0; i < domains->nelts; ++i) {
         domain = APR_ARRAY_IDX(domains, i, const char*);
-        duplicate = 0;
         /* is it matched in minimal already? */
-        for (j = 0; j < minimal->nelts; ++j) {
-            pattern = APR_ARRAY_IDX(minimal, j, const char*);
-            if (md_dns_matches(pattern, domain)) {
-                duplicate = 1;
-                break;
-            }
+        if (md_dns_set_match(kept, domain)) {
+            continue;
         }
-        if (!duplicate) {
-            if (!md_dns_is_wildcard(p, domain)) {
-                /* plain name, will we see a wildcard that replaces it? */
-                for (j = i+1; j < domains->nelts; ++j) {
-                    pattern = APR_ARRAY_IDX(domains, j, const char*);
-                    if (md_dns_is_wildcard(p, pattern) && md_dns_matches(pattern, domain)) {
-                        duplicate = 1;
-                        break;
-                    }
-                }
-            }
-            if (!duplicate) {
-                APR_ARRAY_PUSH(minimal, const char *) = domain; 
-            }
+        if (!md_dns_is_wildcard(p, domain)
+            && NULL != (parent = strchr(domain, '.'))
+            && NULL != (key = dns_set_key(buffer, sizeof(buffer), "*", parent))
+            && md_dns_set_get(all, key) && md_dns_is_wildcard(p, key)) {
+            /* plain name, replaced by a wildcard we will see */
+            continue;
         }
+        md_dns_set_add(kept, domain);
+        APR_ARRAY_PUSH(minimal, const char *) = domain; 
     }
     return minimal;
 }
@@ -868,44 +1057,196 @@ apr_status_t md_util_try(md_util_try_fn *fn, void *baton, int ignore_errs,
 
 /* execute process ********************************************************************************/
 
-apr_status_t md_util_exec(apr_pool_t *p, const char *cmd, const char * const *argv,
-                          int *exit_code)
+/* Most we keep of what a process writes */
+#define PROC_OUTPUT_MAX         (16 * 1024)
+#define PROC_NAP_MIN            apr_time_from_msec(10)
+#define PROC_NAP_MAX            apr_time_from_msec(200)
+
+struct md_util_proc_t {
+    apr_pool_t *p;
+    const char *cmd;
+    apr_proc_t proc;
+    apr_time_t giveup;                 /* when to kill it, 0 for never */
+    md_util_proc_cb *cb;
+    void *baton;
+    
+    char *output;
+    apr_size_t out_len;
+    char line[2][1024];                /* stdout/stderr line being read */
+    apr_size_t line_len[2];
+    
+    int done;
+    apr_status_t rv;
+    int exit_code;
+};
+
+static void proc_log_lines(md_util_proc_t *proc, int is_err, const char *data, apr_size_t len)
+{
+    char *line = proc->line[is_err];
+    apr_size_t i, *plen = &proc->line_len[is_err];
+    
+    for (i = 0; i < len; ++i) {
+        if (data[i] == '\n' || *plen + 1 >= sizeof(proc->line[0])) {
+            line[*plen] = '\0';
+            md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, proc->p, "cmd(%s) %s: %s", 
+                          proc->cmd, is_err? "stderr" : "stdout", line);
+            *plen = 0;
+            if (data[i] == '\n') continue;
+        }
+        line[(*plen)++] = data[i];
+    }
+}
+
+static void proc_read(md_util_proc_t *proc, apr_file_t **pf, int is_err)
 {
+    char buffer[4096];
+    apr_size_t len, keep;
     apr_status_t rv;
-    apr_procattr_t *procattr;
-    apr_proc_t *proc;
-    apr_exit_why_e ewhy;
-    char buffer[1024];
     
-    *exit_code = 0;
-    if (!(proc = apr_pcalloc(p, sizeof(*proc)))) {
-        return APR_ENOMEM;
+    while (*pf) {
+        len = sizeof(buffer);
+        rv = apr_file_read(*pf, buffer, &len);
+        if (APR_SUCCESS != rv) {
+            if (!APR_STATUS_IS_EAGAIN(rv)) {
+                /* EOF or broken, either way there is nothing more to get */
+                apr_file_close(*pf);
+                *pf = NULL;
+            }
+            break;
+        }
+        if (proc->out_len < PROC_OUTPUT_MAX) {
+            keep = (len > PROC_OUTPUT_MAX - proc->out_len)? PROC_OUTPUT_MAX - proc->out_len : len;
+            memcpy(proc->output + proc->out_len, buffer, keep);
+            proc->out_len += keep;
+            proc->output[proc->out_len] = '\0';
+        }
+        proc_log_lines(proc, is_err, buffer, len);
+    }
+}
+
+static apr_status_t proc_done(md_util_proc_t *proc, apr_status_t rv)
+{
+    proc_read(proc, &proc->proc.out, 0);
+    proc_read(proc, &proc->proc.err, 1);
+    if (proc->line_len[0]) {
+        proc_log_lines(proc, 0, "\n", 1);
+    }
+    if (proc->line_len[1]) {
+        proc_log_lines(proc, 1, "\n", 1);
     }
+    proc->done = 1;
+    proc->rv = rv;
+    if (proc->cb) {
+        proc->cb(proc->baton, proc->rv, proc->exit_code, proc->output);
+    }
+    return rv;
+}
+
+apr_status_t md_util_proc_start(md_util_proc_t **pproc, apr_pool_t *p, 
+                                const char *cmd, const char * const *argv,
+                                apr_interval_time_t timeout, 
+                                md_util_proc_cb *cb, void *baton)
+{
+    md_util_proc_t *proc;
+    apr_procattr_t *procattr;
+    apr_status_t rv;
+    
+    proc = apr_pcalloc(p, sizeof(*proc));
+    proc->p = p;
+    proc->cmd = cmd;
+    proc->giveup = (timeout > 0)? apr_time_now() + timeout : 0;
+    proc->cb = cb;
+    proc->baton = baton;
+    proc->output = apr_pcalloc(p, PROC_OUTPUT_MAX + 1);
+    
+    /* our ends of the pipes do not block, we read whatever is there when we look */
     if (   APR_SUCCESS == (rv = apr_procattr_create(&procattr, p))
         && APR_SUCCESS == (rv = apr_procattr_io_set(procattr, APR_NO_FILE, 
-                                                    APR_NO_PIPE, APR_FULL_BLOCK))
+                                                    APR_CHILD_BLOCK, APR_CHILD_BLOCK))
         && APR_SUCCESS == (rv = apr_procattr_cmdtype_set(procattr, APR_PROGRAM))
-        && APR_SUCCESS == (rv = apr_proc_create(proc, cmd, argv, NULL, procattr, p))) {
-        
-        /* read stderr and log on INFO for possible fault analysis. */
-        while(APR_SUCCESS == (rv = apr_file_gets(buffer, sizeof(buffer)-1, proc->err))) {
-            md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, p, "cmd(%s) stderr: %s", cmd, buffer);
-        }
-        if (!APR_STATUS_IS_EOF(rv)) goto out;
-        apr_file_close(proc->err);
-        
-        if (APR_CHILD_DONE == (rv = apr_proc_wait(proc, exit_code, &ewhy, APR_WAIT))) {
-            /* let's not dwell on exit stati, but core should signal something's bad */
-            if (*exit_code > 127 || APR_PROC_SIGNAL_CORE == ewhy) {
-                return APR_EINCOMPLETE;
-            }
-            return APR_SUCCESS;
-        }
+        && APR_SUCCESS == (rv = apr_proc_create(&proc->proc, cmd, argv, NULL, procattr, p))) {
+        apr_pool_note_subprocess(p, &proc->proc, APR_KILL_AFTER_TIMEOUT);
     }
-out:
+    *pproc = (APR_SUCCESS == rv)? proc : NULL;
     return rv;
 }
 
+apr_status_t md_util_proc_poll(md_util_proc_t *proc)
+{
+    apr_exit_why_e ewhy;
+    apr_status_t rv;
+    
+    if (proc->done) {
+        return proc->rv;
+    }
+    proc_read(proc, &proc->proc.out, 0);
+    proc_read(proc, &proc->proc.err, 1);
+    
+    rv = apr_proc_wait(&proc->proc, &proc->exit_code, &ewhy, APR_NOWAIT);
+    if (APR_CHILD_DONE == rv) {
+        /* let's not dwell on exit stati, but core should signal something's bad */
+        return proc_done(proc, (proc->exit_code > 127 || APR_PROC_SIGNAL_CORE == ewhy)? 
+                         APR_EINCOMPLETE : APR_SUCCESS);
+    }
+    else if (APR_CHILD_NOTDONE != rv) {
+        return proc_done(proc, rv);
+    }
+    else if (proc->giveup && apr_time_now() >= proc->giveup) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, APR_TIMEUP, proc->p, 
+                      "cmd(%s) did not finish in time, killing it", proc->cmd);
+#ifdef SIGKILL
+        apr_proc_kill(&proc->proc, SIGKILL);
+#else
+        apr_proc_kill(&proc->proc, SIGTERM);
+#endif
+        apr_proc_wait(&proc->proc, &proc->exit_code, &ewhy, APR_WAIT);
+        return proc_done(proc, APR_TIMEUP);
+    }
+    return APR_EAGAIN;
+}
+
+apr_status_t md_util_proc_wait(md_util_proc_t *proc)
+{
+    apr_interval_time_t nap = PROC_NAP_MIN;
+    apr_status_t rv;
+    
+    while (APR_STATUS_IS_EAGAIN(rv = md_util_proc_poll(proc))) {
+        apr_sleep(nap);
+        nap = (2 * nap > PROC_NAP_MAX)? PROC_NAP_MAX : 2 * nap;
+    }
+    return rv;
+}
+
+int md_util_proc_exit_code(md_util_proc_t *proc)
+{
+    return proc->exit_code;
+}
+
+const char *md_util_proc_output(md_util_proc_t *proc)
+{
+    return proc->output;
+}
+
+apr_status_t md_util_exec_timeout(apr_pool_t *p, const char *cmd, const char * const *argv,
+                                  apr_interval_time_t timeout, int *exit_code)
+{
+    md_util_proc_t *proc;
+    apr_status_t rv;
+    
+    *exit_code = 0;
+    if (APR_SUCCESS == (rv = md_util_proc_start(&proc, p, cmd, argv, timeout, NULL, NULL))) {
+        rv = md_util_proc_wait(proc);
+        *exit_code = proc->exit_code;
+    }
+    return rv;
+}
+
+apr_status_t md_util_exec(apr_pool_t *p, const char *cmd, const char * const *argv,
+                          int *exit_code)
+{
+    return md_util_exec_timeout(p, cmd, argv, 0, exit_code);
+}
+
 
 /* date/time encoding *****************************************************************************/
 
@@ -917,6 +1258,37 @@ const char *md_print_duration(apr_pool_t *p, apr_interval_time_t duration)
                         (int)(secs%60));
 }
 
+apr_time_t md_time_window_next(apr_time_t t, apr_interval_time_t start, apr_interval_time_t end)
+{
+    apr_time_exp_t exp;
+    apr_time_t midnight;
+    apr_interval_time_t daytime;
+    
+    if (start == end) {
+        return t;
+    }
+    apr_time_exp_lt(&exp, t);
+    exp.tm_hour = exp.tm_min = exp.tm_sec = exp.tm_usec = 0;
+    if (APR_SUCCESS != apr_time_exp_gmt_get(&midnight, &exp)) {
+        return t;
+    }
+    daytime = t - midnight;
+    if (start < end) {
+        if (daytime < start) {
+            return midnight + start;
+        }
+        else if (daytime < end) {
+            return t;
+        }
+        return midnight + apr_time_from_sec(MD_SECS_PER_DAY) + start;
+    }
+    /* window spans midnight */
+    if (daytime >= start || daytime < end) {
+        return t;
+    }
+    return midnight + start;
+}
+
 
 /* base64 url encoding ****************************************************************************/
 
@@ -967,10 +1339,10 @@ apr_size_t md_util_base64url_decode(const char **decoded, const char *encoded,
     }
     len = (int)(p - e);
     mlen = (len/4)*4;
-    *decoded = apr_pcalloc(pool, (apr_size_t)len + 1);
+    d = apr_palloc(pool, (apr_size_t)len + 1);
+    *decoded = (const char*)d;
     
     i = 0;
-    d = (unsigned char*)*decoded;
     for (; i < mlen; i += 4) {
         n = ((BASE64URL_UINT6[ e[i+0] ] << 18) +
              (BASE64URL_UINT6[ e[i+1] ] << 12) +
@@ -999,36 +1371,65 @@ apr_size_t md_util_base64url_decode(const char **decoded, const char *encoded,
         default: /* do nothing */
             break;
     }
+    *d = '\0';
     return (apr_size_t)(mlen/4*3 + remain);
 }
 
-const char *md_util_base64url_encode(const char *data, apr_size_t dlen, apr_pool_t *pool)
+apr_size_t md_util_base64url_enclen(apr_size_t dlen)
+{
+    return (dlen / 3) * 4 + ((dlen % 3)? (dlen % 3) + 1 : 0);
+}
+
+apr_size_t md_util_base64url_encode_to(char *buf, apr_size_t buflen, 
+                                       const char *data, apr_size_t dlen)
 {
-    int i, len = (int)dlen;
-    apr_size_t slen = ((dlen+2)/3)*4 + 1; /* 0 terminated */
     const unsigned char *udata = (const unsigned char*)data;
-    unsigned char *enc, *p = apr_pcalloc(pool, slen);
+    const unsigned char *end = udata + (dlen - dlen % 3);
+    unsigned char *p = (unsigned char*)buf;
+    apr_size_t slen = md_util_base64url_enclen(dlen);
+    apr_uint32_t n;
     
-    enc = p;
-    for (i = 0; i < len-2; i+= 3) {
-        *p++ = BASE64URL_CHAR( (udata[i]   >> 2) );
-        *p++ = BASE64URL_CHAR( (udata[i]   << 4) + (udata[i+1] >> 4) );
-        *p++ = BASE64URL_CHAR( (udata[i+1] << 2) + (udata[i+2] >> 6) );
-        *p++ = BASE64URL_CHAR( (udata[i+2]) );
+    if (slen >= buflen) {
+        return 0;
     }
-    
-    if (i < len) {
-        *p++ = BASE64URL_CHAR( (udata[i] >> 2) );
-        if (i == (len - 1)) {
-            *p++ = BASE64URL_CHARS[ ((unsigned int)udata[i] << 4) & 0x3fu ];
-        }
-        else {
-            *p++ = BASE64URL_CHAR( (udata[i] << 4) + (udata[i+1] >> 4) );
-            *p++ = BASE64URL_CHAR( (udata[i+1] << 2) );
-        }
+    /* 3 bytes give 24 bits, written as 4 characters of 6 bits each */
+    while (udata < end) {
+        n = ((apr_uint32_t)udata[0] << 16) | ((apr_uint32_t)udata[1] << 8) | udata[2];
+        p[0] = BASE64URL_CHAR( (n >> 18) );
+        p[1] = BASE64URL_CHAR( (n >> 12) );
+        p[2] = BASE64URL_CHAR( (n >> 6) );
+        p[3] = BASE64URL_CHAR( n );
+        udata += 3;
+        p += 4;
+    }
+    switch (dlen % 3) {
+        case 2:
+            n = ((apr_uint32_t)udata[0] << 16) | ((apr_uint32_t)udata[1] << 8);
+            p[0] = BASE64URL_CHAR( (n >> 18) );
+            p[1] = BASE64URL_CHAR( (n >> 12) );
+            p[2] = BASE64URL_CHAR( (n >> 6) );
+            p += 3;
+            break;
+        case 1:
+            n = ((apr_uint32_t)udata[0] << 16);
+            p[0] = BASE64URL_CHAR( (n >> 18) );
+            p[1] = BASE64URL_CHAR( (n >> 12) );
+            p += 2;
+            break;
+        default: /* nothing left */
+            break;
     }
-    *p++ = '\0';
-    return (char *)enc;
+    *p = '\0';
+    return slen;
+}
+
+const char *md_util_base64url_encode(const char *data, apr_size_t dlen, apr_pool_t *pool)
+{
+    apr_size_t slen = md_util_base64url_enclen(dlen) + 1; /* 0 terminated */
+    char *enc = apr_palloc(pool, slen);
+    
+    md_util_base64url_encode_to(enc, slen, data, dlen);
+    return enc;
 }
 
 /*******************************************************************************
@@ -1342,3 +1743,85 @@ const char *md_link_find_relation(const apr_table_t *headers,
     return ctx.url;
 }
 
+apr_time_t md_util_parse_retry_after(const char *value, apr_time_t now)
+{
+    apr_int64_t secs;
+    apr_time_t t;
+    char *end;
+    
+    if (!value) {
+        return 0;
+    }
+    while (apr_isspace(*value)) {
+        ++value;
+    }
+    if (apr_isdigit(*value)) {
+        secs = apr_strtoi64(value, &end, 10);
+        if (secs >= 0 && (!*end || apr_isspace(*end))) {
+            return now + apr_time_from_sec(secs);
+        }
+        return 0;
+    }
+    t = apr_date_parse_http(value);
+    return (APR_DATE_BAD == t)? 0 : t;
+}
+
+static int parse_digits(const char **ps, int n)
+{
+    int val = 0;
+    
+    for (; n > 0; --n, ++(*ps)) {
+        if (!apr_isdigit(**ps)) return -1;
+        val = val * 10 + (**ps - '0');
+    }
+    return val;
+}
+
+apr_time_t md_util_parse_rfc3339(const char *value)
+{
+    apr_time_exp_t exp;
+    apr_time_t t;
+    const char *s = value;
+    int offset = 0, sign, oh, om;
+    
+    if (!s) return 0;
+    memset(&exp, 0, sizeof(exp));
+    if ((exp.tm_year = parse_digits(&s, 4)) < 0 || *s++ != '-'
+        || (exp.tm_mon = parse_digits(&s, 2)) < 0 || *s++ != '-'
+        || (exp.tm_mday = parse_digits(&s, 2)) < 0) {
+        return 0;
+    }
+    if (*s != 'T' && *s != 't') {
+        return 0;
+    }
+    ++s;
+    if ((exp.tm_hour = parse_digits(&s, 2)) < 0 || *s++ != ':'
+        || (exp.tm_min = parse_digits(&s, 2)) < 0 || *s++ != ':'
+        || (exp.tm_sec = parse_digits(&s, 2)) < 0) {
+        return 0;
+    }
+    if (*s == '.') {
+        for (++s; apr_isdigit(*s); ++s);
+    }
+    if (*s == 'Z' || *s == 'z') {
+        ++s;
+    }
+    else if (*s == '+' || *s == '-') {
+        sign = (*s++ == '-')? -1 : 1;
+        if ((oh = parse_digits(&s, 2)) < 0 || *s++ != ':' || (om = parse_digits(&s, 2)) < 0) {
+            return 0;
+        }
+        offset = sign * (oh * 60 + om) * 60;
+    }
+    else {
+        return 0;
+    }
+    if (*s) return 0;
+    
+    exp.tm_year -= 1900;
+    exp.tm_mon -= 1;
+    if (APR_SUCCESS != apr_time_exp_gmt_get(&t, &exp)) {
+        return 0;
+    }
+    return t - apr_time_from_sec(offset);
+}
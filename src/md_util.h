@@ -69,6 +69,49 @@ int md_array_str_add_missing(struct apr_array_header_t *dest,
 apr_status_t md_util_exec(apr_pool_t *p, const char *cmd, const char * const *argv,
                           int *exit_code);
 
+/**
+ * A command running in the background. Its stdout and stderr are collected (up
+ * to a limit) while it runs, their lines are also logged at INFO level.
+ */
+typedef struct md_util_proc_t md_util_proc_t;
+
+/**
+ * Called once when the process is done. rv is APR_SUCCESS when it exited normally,
+ * APR_EINCOMPLETE when it exited with a code > 127 or dumped core and APR_TIMEUP 
+ * when it was killed for running too long. output is what it wrote to stdout/stderr.
+ */
+typedef void md_util_proc_cb(void *baton, apr_status_t rv, int exit_code, const char *output);
+
+/**
+ * Start cmd without waiting for it. The process is killed when it runs longer than
+ * timeout (if > 0) or the pool is destroyed. cb may be NULL.
+ */
+apr_status_t md_util_proc_start(md_util_proc_t **pproc, apr_pool_t *p, 
+                                const char *cmd, const char * const *argv,
+                                apr_interval_time_t timeout, 
+                                md_util_proc_cb *cb, void *baton);
+
+/**
+ * Look at the process without blocking: collect its output and check if it is done
+ * or ran out of time. Returns APR_EAGAIN while it is still running, otherwise the
+ * rv passed to the callback.
+ */
+apr_status_t md_util_proc_poll(md_util_proc_t *proc);
+
+/**
+ * Wait until the process is done or ran out of time, returns as md_util_proc_poll().
+ */
+apr_status_t md_util_proc_wait(md_util_proc_t *proc);
+
+int md_util_proc_exit_code(md_util_proc_t *proc);
+const char *md_util_proc_output(md_util_proc_t *proc);
+
+/**
+ * As md_util_exec(), killing the command when it does not finish in time.
+ */
+apr_status_t md_util_exec_timeout(apr_pool_t *p, const char *cmd, const char * const *argv,
+                                  apr_interval_time_t timeout, int *exit_code);
+
 /**************************************************************************************************/
 /* dns name check */
 
@@ -94,6 +137,13 @@ int md_dns_is_wildcard(apr_pool_t *p, const char *domain);
  */ 
 int md_dns_matches(const char *pattern, const char *domain);
 
+/**
+ * The last two labels of domain, e.g. "example.org" for "www.example.org", or domain
+ * itself when it has no more. Without a public suffix list, this stands in for the 
+ * domain a name is registered under.
+ */
+const char *md_dns_suffix(const char *domain);
+
 /**
  * Create a new array with the minimal set out of the given domain names that match all
  * of them. If none of the domains is a wildcard, only duplicates are removed.
@@ -108,6 +158,36 @@ struct apr_array_header_t *md_dns_make_minimal(apr_pool_t *p,
  */
 int md_dns_domains_match(struct apr_array_header_t *domains, const char *name);
 
+/**
+ * A set of DNS names, ignoring case. Lookups take constant time, where searching
+ * a list of domains is linear in its length.
+ */
+typedef struct md_dns_set_t md_dns_set_t;
+
+/**
+ * Create a set with the given domains, domains may be NULL.
+ */
+md_dns_set_t *md_dns_set_make(apr_pool_t *p, const struct apr_array_header_t *domains);
+
+/**
+ * Add a domain to the set. The name itself is not copied.
+ * @return != 0 iff the domain was not already in the set
+ */
+int md_dns_set_add(md_dns_set_t *set, const char *domain);
+
+/**
+ * Get the name as it was added to the set, if domain is in the set.
+ */
+const char *md_dns_set_get(const md_dns_set_t *set, const char *domain);
+
+/**
+ * Get the name in the set matching domain, itself or a wildcard covering it.
+ * Same as md_dns_domains_match() on the names in the set.
+ */
+const char *md_dns_set_match(const md_dns_set_t *set, const char *domain);
+
+int md_dns_set_count(const md_dns_set_t *set);
+
 /**************************************************************************************************/
 /* file system related */
 
@@ -126,6 +206,35 @@ apr_status_t md_util_is_file(const char *path, apr_pool_t *pool);
 
 typedef apr_status_t md_util_file_cb(void *baton, struct apr_file_t *f, apr_pool_t *p);
 
+typedef enum {
+    MD_DURABLE_NONE,                /* leave flushing to the OS */
+    MD_DURABLE_FILE,                /* sync file contents before they replace the old */
+    MD_DURABLE_DIR,                 /* also sync the directory after the rename */
+} md_durability_t;
+
+/**
+ * How far md_util_freplace() and md_util_fstage() sync written files, for the
+ * whole process. The default is MD_DURABLE_NONE.
+ */
+void md_util_durability_set(md_durability_t durability);
+md_durability_t md_util_durability_get(void);
+
+/**
+ * Sync the entries of directory dir to disk.
+ */
+apr_status_t md_util_fsync_dir(const char *dir, apr_pool_t *p);
+
+/**
+ * Write a new file with a unique name next to fpath, synced as the durability
+ * setting demands. *ptmp is its name, for renaming it to fpath later.
+ */
+apr_status_t md_util_fstage(const char **ptmp, const char *fpath, apr_fileperms_t perms, 
+                            apr_pool_t *p, md_util_file_cb *write, void *baton);
+
+/**
+ * Atomically replace fpath with the data write produces, by staging a file and
+ * renaming it.
+ */
 apr_status_t md_util_freplace(const char *fpath, apr_fileperms_t perms, apr_pool_t *p, 
                               md_util_file_cb *write, void *baton);
 
@@ -150,6 +259,14 @@ apr_status_t md_util_tree_do(md_util_fdo_cb *cb, void *baton, apr_pool_t *p,
 
 apr_status_t md_util_ftree_remove(const char *path, apr_pool_t *p);
 
+/**
+ * Read the file at fpath, or its first max_len bytes when max_len is not 0, with a
+ * single read into a buffer allocated from p. The data is NUL terminated for
+ * convenience, *plen does not count that.
+ */
+apr_status_t md_util_file_load(const char **pdata, apr_size_t *plen, apr_pool_t *p,
+                               const char *fpath, apr_size_t max_len);
+
 apr_status_t md_text_fread8k(const char **ptext, apr_pool_t *p, const char *fpath);
 apr_status_t md_text_fcreatex(const char *fpath, apr_fileperms_t 
                               perms, apr_pool_t *p, const char *text);
@@ -158,6 +275,14 @@ apr_status_t md_text_freplace(const char *fpath, apr_fileperms_t perms,
 
 /**************************************************************************************************/
 /* base64 url encodings */
+/* Number of characters encoding dlen bytes, without padding and terminating 0. */
+apr_size_t md_util_base64url_enclen(apr_size_t dlen);
+/**
+ * Encode dlen bytes of data into buf, 0 terminated. Returns the number of characters
+ * written, not counting the 0, or 0 when buflen is not larger than md_util_base64url_enclen().
+ */
+apr_size_t md_util_base64url_encode_to(char *buf, apr_size_t buflen, 
+                                       const char *data, apr_size_t dlen);
 const char *md_util_base64url_encode(const char *data, 
                                      apr_size_t len, apr_pool_t *pool);
 apr_size_t md_util_base64url_decode(const char **decoded, const char *encoded, 
@@ -173,6 +298,19 @@ apr_status_t md_util_abs_http_uri_check(apr_pool_t *p, const char *uri, const ch
 const char *md_link_find_relation(const struct apr_table_t *headers, 
                                   apr_pool_t *pool, const char *relation);
 
+/**
+ * Parse the value of a HTTP Retry-After header, either delta seconds or a HTTP date.
+ * Returns the absolute time or 0 if the value is missing or not understood.
+ */
+apr_time_t md_util_parse_retry_after(const char *value, apr_time_t now);
+
+/**
+ * Parse a RFC 3339 timestamp as ACME uses them, e.g. "2019-01-20T12:30:00Z", with
+ * optional fractions of a second and a numeric offset instead of 'Z'.
+ * Returns 0 if the value is missing or not understood.
+ */
+apr_time_t md_util_parse_rfc3339(const char *value);
+
 /**************************************************************************************************/
 /* retry logic */
 
@@ -190,4 +328,11 @@ apr_status_t md_util_try(md_util_try_fn *fn, void *baton, int ignore_errs,
 
 const char *md_print_duration(apr_pool_t *p, apr_interval_time_t duration);
 
+/**
+ * Get the earliest time, not before t, whose local time of day lies in the window
+ * [start, end), both given as offsets from midnight. A window with start > end 
+ * spans midnight, one with start == end covers the whole day.
+ */
+apr_time_t md_time_window_next(apr_time_t t, apr_interval_time_t start, apr_interval_time_t end);
+
 #endif /* md_util_h */
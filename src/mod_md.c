@@ -15,8 +15,16 @@
  */
  
 #include <assert.h>
+#include <apr_atomic.h>
+#include <apr_date.h>
+#include <apr_hash.h>
 #include <apr_optional.h>
+#include <apr_shm.h>
 #include <apr_strings.h>
+#include <apr_thread_cond.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_pool.h>
+#include <apr_thread_proc.h>
 
 #include <ap_release.h>
 #ifndef AP_ENABLE_EXCEPTION_HOOK
@@ -30,6 +38,7 @@
 #include <http_log.h>
 #include <http_vhost.h>
 #include <ap_listen.h>
+#include <ap_socache.h>
 
 #include "md.h"
 #include "md_curl.h"
@@ -38,8 +47,13 @@
 #include "md_json.h"
 #include "md_store.h"
 #include "md_store_fs.h"
+#include "md_store_kv.h"
 #include "md_log.h"
+#include "md_ocsp.h"
+#include "md_plan.h"
 #include "md_reg.h"
+#include "md_snap.h"
+#include "md_trace.h"
 #include "md_util.h"
 #include "md_version.h"
 #include "md_acme.h"
@@ -52,6 +66,10 @@
 #include "mod_watchdog.h"
 
 static void md_hooks(apr_pool_t *pool);
+static void store_gen_bump(unsigned int group);
+typedef struct md_startup_t md_startup_t;
+static void prepare_fallbacks(md_mod_conf_t *mc, md_reg_t *reg, server_rec *s, 
+                              md_startup_t *st, apr_pool_t *p);
 
 AP_DECLARE_MODULE(md) = {
     STANDARD20_MODULE_STUFF,
@@ -74,6 +92,7 @@ static void md_merge_srv(md_t *md, md_srv_conf_t *base_sc, apr_pool_t *p)
 
     if (!md->ca_url) {
         md->ca_url = md_config_gets(md->sc, MD_CONFIG_CA_URL);
+        md->ca_urls = md->sc->ca_url? md->sc->ca_urls : NULL;
     }
     if (!md->ca_proto) {
         md->ca_proto = md_config_gets(md->sc, MD_CONFIG_CA_PROTO);
@@ -101,7 +120,7 @@ static void md_merge_srv(md_t *md, md_srv_conf_t *base_sc, apr_pool_t *p)
     }        
     if (!md->pkey_spec) {
         md->pkey_spec = md->sc->pkey_spec;
-        
+        md->alt_pkey_specs = md->sc->alt_pkey_specs;
     }
     if (md->require_https < 0) {
         md->require_https = md_config_geti(md->sc, MD_CONFIG_REQUIRE_HTTPS);
@@ -297,6 +316,11 @@ static apr_status_t assign_to_servers(md_t *md, server_rec *base_server,
                 }
 
                 sc->assigned = md;
+                /* redirects to https: go to the default port, omitted in the URL. 
+                 * IPv6 literals are left to ap_get_server_name_for_url(). */
+                if (s->server_hostname && !strchr(s->server_hostname, ':')) {
+                    sc->https_prefix = apr_pstrcat(p, "https://", s->server_hostname, NULL);
+                }
                 APR_ARRAY_PUSH(servers, server_rec*) = s;
                 
                 ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, base_server, APLOGNO(10043)
@@ -378,17 +402,64 @@ static apr_status_t assign_to_servers(md_t *md, server_rec *base_server,
     return rv;
 }
 
+/* Let MDs configured alike share certificates, or only log which could, as
+ * MDConsolidate says. Overlapping MDs are never grouped, so they are still found
+ * to be in error afterwards. */
+static void consolidate_mds(md_mod_conf_t *mc, server_rec *s, apr_pool_t *p, 
+                            apr_pool_t *ptemp)
+{
+    apr_array_header_t *groups, *group, *names;
+    md_t *md;
+    int i, j, on = (mc->consolidate == MD_CONSOLIDATE_ON);
+
+    groups = md_plan_groups(ptemp, mc->mds, mc->consolidate_max);
+    if (groups->nelts == mc->mds->nelts) {
+        return;
+    }
+    ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s, APLOGNO(10151)
+                 "%d MDs %s %d certificates", mc->mds->nelts, 
+                 on? "share" : "could share", groups->nelts);
+    if (on) {
+        apr_array_clear(mc->mds);
+    }
+    for (i = 0; i < groups->nelts; ++i) {
+        group = APR_ARRAY_IDX(groups, i, apr_array_header_t*);
+        if (group->nelts == 1) {
+            if (on) apr_array_cat(mc->mds, group);
+            continue;
+        }
+        names = apr_array_make(ptemp, group->nelts, sizeof(const char*));
+        for (j = 0; j < group->nelts; ++j) {
+            APR_ARRAY_PUSH(names, const char*) = APR_ARRAY_IDX(group, j, md_t*)->name;
+        }
+        md = md_plan_merge(on? p : ptemp, group);
+        if (on) {
+            ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, APLOGNO(10152)
+                         "%s: one certificate for MDs %s", md->name, 
+                         apr_array_pstrcat(ptemp, names, ' '));
+            APR_ARRAY_PUSH(mc->mds, md_t*) = md;
+        }
+        else {
+            ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s, APLOGNO(10153)
+                         "MDs %s could share one certificate: MDomain %s", 
+                         apr_array_pstrcat(ptemp, names, ' '), 
+                         apr_array_pstrcat(ptemp, md->domains, ' '));
+        }
+    }
+}
+
 static apr_status_t md_calc_md_list(apr_pool_t *p, apr_pool_t *plog,
                                     apr_pool_t *ptemp, server_rec *base_server)
 {
     md_srv_conf_t *sc;
     md_mod_conf_t *mc;
     md_t *md, *omd;
+    md_domain_index_t *idx;
     const char *domain;
     apr_status_t rv = APR_SUCCESS;
     ap_listen_rec *lr;
     apr_sockaddr_t *sa;
-    int i, j;
+    int i;
 
     (void)plog;
     sc = md_config_get(base_server);
@@ -419,21 +490,25 @@ static apr_status_t md_calc_md_list(apr_pool_t *p, apr_pool_t *plog,
     /* Complete the properties of the MDs, now that we have the complete, merged
      * server configurations. 
      */
+    for (i = 0; i < mc->mds->nelts; ++i) {
+        md_merge_srv(APR_ARRAY_IDX(mc->mds, i, md_t*), sc, p);
+    }
+    if (mc->consolidate != MD_CONSOLIDATE_OFF) {
+        consolidate_mds(mc, base_server, p, ptemp);
+    }
+
+    idx = md_domain_index_make(p, NULL);
     for (i = 0; i < mc->mds->nelts; ++i) {
         md = APR_ARRAY_IDX(mc->mds, i, md_t*);
-        md_merge_srv(md, sc, p);
 
         /* Check that we have no overlap with the MDs already completed */
-        for (j = 0; j < i; ++j) {
-            omd = APR_ARRAY_IDX(mc->mds, j, md_t*);
-            if ((domain = md_common_name(md, omd)) != NULL) {
-                ap_log_error(APLOG_MARK, APLOG_ERR, 0, base_server, APLOGNO(10038)
-                             "two Managed Domains have an overlap in domain '%s'"
-                             ", first definition in %s(line %d), second in %s(line %d)",
-                             domain, md->defn_name, md->defn_line_number,
-                             omd->defn_name, omd->defn_line_number);
-                return APR_EINVAL;
-            }
+        if ((domain = md_domain_index_common_name(idx, md, &omd)) != NULL) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, base_server, APLOGNO(10038)
+                         "two Managed Domains have an overlap in domain '%s'"
+                         ", first definition in %s(line %d), second in %s(line %d)",
+                         domain, md->defn_name, md->defn_line_number,
+                         omd->defn_name, omd->defn_line_number);
+            return APR_EINVAL;
         }
 
         /* Assign MD to the server_rec configs that it matches. Perform some
@@ -441,12 +516,15 @@ static apr_status_t md_calc_md_list(apr_pool_t *p, apr_pool_t *plog,
         if (APR_SUCCESS != (rv = assign_to_servers(md, base_server, p, ptemp))) {
             return rv;
         }
+        /* index after assignment, transitive names may have been added */
+        md_domain_index_add(idx, md);
 
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, base_server, APLOGNO(10039)
                      "Completed MD[%s, CA=%s, Proto=%s, Agreement=%s, Drive=%d, renew=%ld]",
                      md->name, md->ca_url, md->ca_proto, md->ca_agreement,
                      md->drive_mode, (long)md->renew_window);
     }
+    mc->mds_index = idx;
     
     return rv;
 }
@@ -465,15 +543,39 @@ static apr_status_t store_file_ev(void *baton, struct md_store_t *store,
     (void)store;
     ap_log_error(APLOG_MARK, APLOG_TRACE3, 0, s, "store event=%d on %s %s (group %d)", 
                  ev, (ftype == APR_DIR)? "dir" : "file", fname, group);
+    
+    store_gen_bump(group);
+    if (MD_S_FS_EV_PURGED == ev || MD_S_FS_EV_REMOVED == ev) {
+        return APR_SUCCESS;
+    }
+    
+    /* Lock files are shared with the watchdog, directory as well as files. */
+    if (MD_SG_LOCKS == group) {
+        rv = md_make_worker_accessible(fname, p);
+        return (APR_ENOTIMPL == rv)? APR_SUCCESS : rv;
+    }
                  
-    /* Directories in group CHALLENGES and STAGING are written to by our watchdog,
-     * running on certain mpms in a child process under a different user. Give them
-     * ownership. 
+    /* Directories in group CHALLENGES, STAGING, KEYPOOL, OCSP, LEASES, ISSUERS and STATS are 
+     * written to by our watchdog, running on certain mpms in a child process under a different 
+     * user. Give them ownership. 
      */
     if (ftype == APR_DIR) {
         switch (group) {
+            case MD_SG_DOMAINS:
+            case MD_SG_ARCHIVE:
+            case MD_SG_TMP:
+                /* with hot activation, the watchdog moves new certificates in place */
+                if (!md_config_get(s)->mc->hot_activation) {
+                    break;
+                }
+                /* fall through */
             case MD_SG_CHALLENGES:
             case MD_SG_STAGING:
+            case MD_SG_KEYPOOL:
+            case MD_SG_OCSP:
+            case MD_SG_LEASES:
+            case MD_SG_ISSUERS:
+            case MD_SG_STATS:
                 rv = md_make_worker_accessible(fname, p);
                 if (APR_ENOTIMPL != rv) {
                     return rv;
@@ -499,27 +601,164 @@ static apr_status_t check_group_dir(md_store_t *store, md_store_group_t group,
     return rv;
 }
 
+/* With MDStoreSocache, the store keeps its data in a socache provider and 
+ * MDStoreDir has the local copies. */
+
+#define MD_SOCACHE_MAX_VALUE    (64 * 1024)
+#define MD_SOCACHE_EXPIRY       apr_time_from_sec(10 * 365 * MD_SECS_PER_DAY)
+
+typedef struct {
+    md_store_kv_t kv;
+    const ap_socache_provider_t *provider;
+    ap_socache_instance_t *instance;
+    server_rec *s;
+} md_socache_kv_t;
+
+static apr_status_t socache_get(md_store_kv_t *kv, const char *key, 
+                                const char **pvalue, apr_size_t *plen, apr_pool_t *p)
+{
+    md_socache_kv_t *sc = kv->baton;
+    unsigned char *data;
+    unsigned int len = MD_SOCACHE_MAX_VALUE;
+    apr_status_t rv;
+    
+    data = apr_palloc(p, len);
+    rv = sc->provider->retrieve(sc->instance, sc->s, (const unsigned char*)key, 
+                                (unsigned int)strlen(key), data, &len, p);
+    if (APR_SUCCESS == rv) {
+        *pvalue = (const char*)data;
+        *plen = len;
+    }
+    else if (APR_STATUS_IS_NOTFOUND(rv)) {
+        rv = APR_ENOENT;
+    }
+    return rv;
+}
+
+static apr_status_t socache_set(md_store_kv_t *kv, const char *key, 
+                                const char *value, apr_size_t len, apr_pool_t *p)
+{
+    md_socache_kv_t *sc = kv->baton;
+    
+    if (len > MD_SOCACHE_MAX_VALUE) {
+        return APR_ENOSPC;
+    }
+    return sc->provider->store(sc->instance, sc->s, (const unsigned char*)key, 
+                               (unsigned int)strlen(key), apr_time_now() + MD_SOCACHE_EXPIRY, 
+                               (unsigned char*)apr_pmemdup(p, value, len), 
+                               (unsigned int)len, p);
+}
+
+static apr_status_t socache_remove(md_store_kv_t *kv, const char *key, apr_pool_t *p)
+{
+    md_socache_kv_t *sc = kv->baton;
+    apr_status_t rv;
+    
+    rv = sc->provider->remove(sc->instance, sc->s, (const unsigned char*)key, 
+                              (unsigned int)strlen(key), p);
+    return APR_STATUS_IS_NOTFOUND(rv)? APR_ENOENT : rv;
+}
+
+static apr_status_t setup_socache_kv(md_store_kv_t **pkv, md_mod_conf_t *mc, 
+                                     apr_pool_t *p, server_rec *s)
+{
+    md_socache_kv_t *sc;
+    struct ap_socache_hints hints;
+    const char *err;
+    apr_status_t rv;
+    
+    sc = apr_pcalloc(p, sizeof(*sc));
+    sc->provider = mc->store_socache;
+    sc->s = s;
+    if (NULL != (err = sc->provider->create(&sc->instance, mc->store_socache_args, p, p))) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(10138) 
+                     "create socache %s for store: %s", sc->provider->name, err);
+        return APR_EINVAL;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.avg_id_len = 40;
+    hints.avg_obj_size = 4096;
+    hints.expiry_time = MD_SOCACHE_EXPIRY;
+    if (APR_SUCCESS != (rv = sc->provider->init(sc->instance, "mod_md-store", &hints, s, p))) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10139) 
+                     "init socache %s for store", sc->provider->name);
+        return rv;
+    }
+    sc->kv.baton = sc;
+    sc->kv.get = socache_get;
+    sc->kv.set = socache_set;
+    sc->kv.remove = socache_remove;
+    *pkv = &sc->kv;
+    return APR_SUCCESS;
+}
+
 static apr_status_t setup_store(md_store_t **pstore, md_mod_conf_t *mc, 
                                 apr_pool_t *p, server_rec *s)
 {
     const char *base_dir;
+    md_store_kv_t *kv;
+    md_store_t *fs_store;
     apr_status_t rv;
     MD_CHK_VARS;
     
     base_dir = ap_server_root_relative(p, mc->base_dir);
+    md_util_durability_set((md_durability_t)mc->store_durability);
     
-    if (!MD_OK(md_store_fs_init(pstore, p, base_dir))) {
+    if (mc->store_socache) {
+        if (   !MD_OK(setup_socache_kv(&kv, mc, p, s))
+            || !MD_OK(md_store_kv_init(pstore, p, kv, base_dir, mc->store_max_age))) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10140)
+                         "setup store in socache %s, cached in %s", 
+                         mc->store_socache->name, base_dir);
+            goto out;
+        }
+        fs_store = md_store_kv_get_cache(*pstore);
+    }
+    else if (!MD_OK(md_store_fs_init(pstore, p, base_dir))) {
         ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10046)"setup store for %s", base_dir);
         goto out;
     }
+    else {
+        fs_store = *pstore;
+    }
 
-    md_store_fs_set_event_cb(*pstore, store_file_ev, s);
+    md_store_fs_set_event_cb(fs_store, store_file_ev, s);
+    if (mc->store_socache) {
+        /* values travel through the socache as text */
+        if (mc->store_binary) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, APLOGNO(10143)
+                         "MDStoreFormat binary is not supported with MDStoreSocache, "
+                         "using json");
+        }
+        rv = md_store_fs_binary_set(fs_store, 0, p);
+    }
+    else {
+        rv = md_store_fs_binary_set(fs_store, mc->store_binary, p);
+    }
+    if (APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10144)
+                     "converting JSON files in store %s", base_dir);
+        goto out;
+    }
     if (   !MD_OK(check_group_dir(*pstore, MD_SG_CHALLENGES, p, s))
         || !MD_OK(check_group_dir(*pstore, MD_SG_STAGING, p, s))
-        || !MD_OK(check_group_dir(*pstore, MD_SG_ACCOUNTS, p, s))) {
+        || !MD_OK(check_group_dir(*pstore, MD_SG_ACCOUNTS, p, s))
+        || !MD_OK(check_group_dir(*pstore, MD_SG_KEYPOOL, p, s))
+        || !MD_OK(check_group_dir(*pstore, MD_SG_OCSP, p, s))
+        || !MD_OK(check_group_dir(*pstore, MD_SG_LOCKS, p, s))
+        || !MD_OK(check_group_dir(*pstore, MD_SG_LEASES, p, s))
+        || !MD_OK(check_group_dir(*pstore, MD_SG_ISSUERS, p, s))
+        || !MD_OK(check_group_dir(*pstore, MD_SG_STATS, p, s))) {
         ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10047) 
                      "setup challenges directory, call %s", MD_LAST_CHK);
     }
+    else if (mc->hot_activation
+        && (   !MD_OK(check_group_dir(*pstore, MD_SG_DOMAINS, p, s))
+            || !MD_OK(check_group_dir(*pstore, MD_SG_ARCHIVE, p, s))
+            || !MD_OK(check_group_dir(*pstore, MD_SG_TMP, p, s)))) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10132) 
+                     "setup directories for hot activation, call %s", MD_LAST_CHK);
+    }
     
 out:
     return rv;
@@ -565,20 +804,49 @@ static int log_is_level(void *baton, apr_pool_t *p, md_log_level_t level)
 static void log_print(const char *file, int line, md_log_level_t level, 
                       apr_status_t rv, void *baton, apr_pool_t *p, const char *fmt, va_list ap)
 {
-    if (log_is_level(baton, p, level)) {
-        char buffer[LOG_BUF_LEN];
-        
-        memset(buffer, 0, sizeof(buffer));
-        apr_vsnprintf(buffer, LOG_BUF_LEN-1, fmt, ap);
-        buffer[LOG_BUF_LEN-1] = '\0';
-
-        if (log_server) {
-            ap_log_error(file, line, APLOG_MODULE_INDEX, (int)level, rv, log_server, "%s",buffer);
-        }
-        else {
-            ap_log_perror(file, line, APLOG_MODULE_INDEX, (int)level, rv, p, "%s", buffer);
-        }
+    char buffer[LOG_BUF_LEN];
+    
+    /* md_log only calls this for levels log_is_level() said yes to */
+    (void)baton;
+    apr_vsnprintf(buffer, sizeof(buffer), fmt, ap);
+    if (log_server) {
+        ap_log_error(file, line, APLOG_MODULE_INDEX, (int)level, rv, log_server, "%s",buffer);
     }
+    else {
+        ap_log_perror(file, line, APLOG_MODULE_INDEX, (int)level, rv, p, "%s", buffer);
+    }
+}
+
+typedef struct {
+    server_rec *s;
+    const char *name;                /* of the MD whose renewal failed */
+    apr_time_t end;                  /* of the renewal */
+} log_ring_ctx;
+
+static void log_ring_print(void *baton, const char *file, int line, md_log_level_t level,
+                           apr_status_t rv, apr_time_t at, const char *msg)
+{
+    log_ring_ctx *ctx = baton;
+    
+    ap_log_error(file, line, APLOG_MODULE_INDEX, APLOG_NOTICE, rv, ctx->s, APLOGNO(10150)
+                 "%s: [%s, %ldms before failure] %s", ctx->name, md_log_level_name(level),
+                 (long)apr_time_as_msec(ctx->end - at), msg);
+}
+
+typedef struct {
+    server_rec *s;
+    const char *name;                /* of the MD renewed */
+    apr_pool_t *p;
+} trace_print_ctx;
+
+static int trace_rec_print(void *baton, size_t index, md_json_t *json)
+{
+    trace_print_ctx *ctx = baton;
+    
+    (void)index;
+    ap_log_error(APLOG_MARK, APLOG_INFO, 0, ctx->s, APLOGNO(10164) "%s: trace %s", 
+                 ctx->name, md_json_writep(json, ctx->p, MD_JSON_FMT_COMPACT));
+    return 1;
 }
 
 /**************************************************************************************************/
@@ -588,6 +856,8 @@ static apr_status_t cleanup_setups(void *dummy)
 {
     (void)dummy;
     log_server = NULL;
+    /* have the levels asked again, without the server */
+    md_log_set(log_is_level, log_print, NULL);
     return APR_SUCCESS;
 }
 
@@ -661,705 +931,3191 @@ static int md_protocol_switch(conn_rec *c, request_rec *r, server_rec *s,
 }
 
 /**************************************************************************************************/
-/* watchdog based impl. */
+/* job state shared between children */
 
-#define MD_WATCHDOG_NAME   "_md_"
-
-static APR_OPTIONAL_FN_TYPE(ap_watchdog_get_instance) *wd_get_instance;
-static APR_OPTIONAL_FN_TYPE(ap_watchdog_register_callback) *wd_register_callback;
-static APR_OPTIONAL_FN_TYPE(ap_watchdog_set_callback_interval) *wd_set_interval;
+/* The state of the watchdog jobs lives in shared memory, one slot per configured
+ * MD. A watchdog child replacing a reaped one continues from there and other
+ * children can read it without touching the store. Only the watchdog writes, 
+ * readers detect concurrent updates by the sequence number being odd or changed.
+ * The store gets the state written in the background, for server restarts. */
 
 typedef struct {
-    md_t *md;
-
-    int stalled;
-    int renewed;
-    int renewal_notified;
-    apr_time_t restart_at;
-    int need_restart;
+    volatile apr_uint32_t seq;
+    apr_uint32_t loaded;       /* slot holds the state of the job */
+    int error_runs;
     int restart_processed;
-
     apr_status_t last_rv;
     apr_time_t next_check;
-    int error_runs;
-} md_job_t;
+    apr_uint32_t renewals;     /* number of renewal runs */
+    apr_interval_time_t renewal_duration; /* of the last renewal run */
+    apr_time_t ari_start;      /* the renewal window of the job, see md_job_t */
+    apr_time_t ari_end;
+    apr_time_t ari_renew_at;
+    apr_time_t ari_poll_at;
+    md_state_t md_state;       /* of the MD as the job last saw it, after activations */
+    apr_time_t expires;        /* of the certificate in use */
+} md_job_slot_t;
 
+/* Counters for md-status and the store generations, in the same shared memory, 
+ * before the slots. */
 typedef struct {
-    apr_pool_t *p;
-    server_rec *s;
-    md_mod_conf_t *mc;
-    ap_watchdog_t *watchdog;
+    volatile apr_uint32_t cha_hits;      /* challenges answered from the cache */
+    volatile apr_uint32_t cha_misses;    /* challenges loaded from the store */
+    md_trace_hist_t requests;            /* outgoing HTTP requests */
+    md_trace_hist_t renewals;            /* renewal runs */
+    volatile apr_uint32_t store_gens[MD_SG_COUNT]; /* changes of each store group */
+} md_metrics_t;
+
+static apr_shm_t *job_shm;
+static apr_hash_t *job_slots;  /* MD name -> md_job_slot_t* */
+static md_metrics_t *metrics;
+
+static void init_job_slots(md_mod_conf_t *mc, server_rec *s, apr_pool_t *p)
+{
+    md_job_slot_t *slots;
+    const md_t *md;
+    apr_size_t metrics_len;
+    apr_status_t rv;
+    int i;
     
-    apr_time_t next_change;
+    job_shm = NULL;
+    job_slots = NULL;
+    metrics = NULL;
+    md_trace_set_http_hist(NULL);
+    if (mc->mds->nelts <= 0) {
+        return;
+    }
+    metrics_len = APR_ALIGN_DEFAULT(sizeof(md_metrics_t));
+    rv = apr_shm_create(&job_shm, metrics_len 
+                        + (apr_size_t)mc->mds->nelts * sizeof(md_job_slot_t), NULL, p);
+    if (APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(10134) 
+                     "no shared memory for the state of renewal jobs, using the store");
+        job_shm = NULL;
+        return;
+    }
+    memset(apr_shm_baseaddr_get(job_shm), 0, apr_shm_size_get(job_shm));
+    metrics = apr_shm_baseaddr_get(job_shm);
+    md_trace_set_http_hist(&metrics->requests);
+    slots = (md_job_slot_t*)((char*)metrics + metrics_len);
+    job_slots = apr_hash_make(p);
+    for (i = 0; i < mc->mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(mc->mds, i, const md_t *);
+        apr_hash_set(job_slots, md->name, APR_HASH_KEY_STRING, &slots[i]);
+    }
+}
+
+static md_job_slot_t *job_slot_get(const char *name)
+{
+    return job_slots? apr_hash_get(job_slots, name, APR_HASH_KEY_STRING) : NULL;
+}
+
+static int job_slot_read(md_job_slot_t *slot, md_job_slot_t *state)
+{
+    apr_uint32_t seq;
     
-    apr_array_header_t *jobs;
-    md_reg_t *reg;
-} md_watchdog;
+    do {
+        seq = apr_atomic_read32(&slot->seq);
+        state->loaded = slot->loaded;
+        state->error_runs = slot->error_runs;
+        state->restart_processed = slot->restart_processed;
+        state->last_rv = slot->last_rv;
+        state->next_check = slot->next_check;
+        state->renewals = slot->renewals;
+        state->renewal_duration = slot->renewal_duration;
+        state->ari_start = slot->ari_start;
+        state->ari_end = slot->ari_end;
+        state->ari_renew_at = slot->ari_renew_at;
+        state->ari_poll_at = slot->ari_poll_at;
+        state->md_state = slot->md_state;
+        state->expires = slot->expires;
+    } while ((seq & 1) || seq != apr_atomic_read32(&slot->seq));
+    return state->loaded != 0;
+}
 
-static void assess_renewal(md_watchdog *wd, md_job_t *job, apr_pool_t *ptemp) 
+static void metrics_cha_count(int hit)
 {
-    apr_time_t now = apr_time_now();
-    if (now >= job->restart_at) {
-        job->need_restart = 1;
-        ap_log_error( APLOG_MARK, APLOG_TRACE1, 0, wd->s, 
-                     "md(%s): has been renewed, needs restart now", job->md->name);
+    if (metrics) {
+        apr_atomic_inc32(hit? &metrics->cha_hits : &metrics->cha_misses);
     }
-    else {
-        job->next_check = job->restart_at;
-        
-        if (job->renewal_notified) {
-            ap_log_error(APLOG_MARK, APLOG_TRACE1, 0, wd->s, 
-                         "%s: renewed cert valid in %s", 
-                         job->md->name, md_print_duration(ptemp, job->restart_at - now));
-        }
-        else {
-            char ts[APR_RFC822_DATE_LEN];
+}
 
-            apr_rfc822_date(ts, job->restart_at);
-            ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, wd->s, APLOGNO(10051) 
-                         "%s: has been renewed successfully and should be activated at %s"
-                         " (this requires a server restart latest in %s)", 
-                         job->md->name, ts, md_print_duration(ptemp, job->restart_at - now));
-            job->renewal_notified = 1;
-        }
+/* Each change the store reports bumps the generation of its group. With the 
+ * shared memory in place, the store is changed only by processes of this server
+ * generation, which all count there. Before that, during post config, the count
+ * is only kept in this process. */
+static volatile apr_uint32_t local_store_gens[MD_SG_COUNT];
+
+static void store_gen_bump(unsigned int group)
+{
+    if (group < MD_SG_COUNT) {
+        apr_atomic_inc32(metrics? &metrics->store_gens[group] : &local_store_gens[group]);
     }
 }
 
-static apr_status_t load_job_props(md_reg_t *reg, md_job_t *job, apr_pool_t *p)
+static apr_uint32_t store_gen_get(unsigned int group)
 {
-    md_store_t *store = md_reg_store_get(reg);
-    md_json_t *jprops;
-    apr_status_t rv;
-    
-    rv = md_store_load_json(store, MD_SG_STAGING, job->md->name,
-                            MD_FN_JOB, &jprops, p);
-    if (APR_SUCCESS == rv) {
-        job->restart_processed = md_json_getb(jprops, MD_KEY_PROCESSED, NULL);
-        job->error_runs = (int)md_json_getl(jprops, MD_KEY_ERRORS, NULL);
+    if (group >= MD_SG_COUNT) {
+        return 0;
     }
-    return rv;
+    return apr_atomic_read32(metrics? &metrics->store_gens[group] : &local_store_gens[group]);
 }
 
-static apr_status_t save_job_props(md_reg_t *reg, md_job_t *job, apr_pool_t *p)
+/* Whether all changes to the store are seen in store_gen_get(). Not so when the 
+ * store is shared with other servers in a socache. */
+static int store_gen_shared(md_mod_conf_t *mc)
 {
-    md_store_t *store = md_reg_store_get(reg);
-    md_json_t *jprops;
+    return metrics && !mc->store_socache;
+}
+
+static void job_slot_renewal(md_job_slot_t *slot, apr_interval_time_t duration)
+{
+    apr_atomic_inc32(&slot->seq);
+    ++slot->renewals;
+    slot->renewal_duration = duration;
+    apr_atomic_inc32(&slot->seq);
+}
+
+/**************************************************************************************************/
+/* hot activation of renewed certificates */
+
+/* With "MDActivationMode hot", the watchdog activates renewed certificates itself
+ * and bumps the generation counter of the MD, and the version of all, in memory
+ * shared by all children. Children then take a new snapshot of their MDs which has
+ * the new key and certificate, and hand them to mod_ssl, which uses them instead
+ * of the ones in its SSL_CTX from server start. */
+
+typedef struct {
+    const char *name;          /* name of the MD */
+    int idx;                   /* index of its generation counter */
+} hot_creds_t;
+
+typedef struct {
+    apr_pool_t *p;
+    apr_shm_t *shm;
+    volatile apr_uint32_t *generations; /* in shared memory, one per configured MD */
+    volatile apr_uint32_t *version;     /* in shared memory, after the generations */
+    apr_hash_t *creds;                  /* MD name -> hot_creds_t* */
+    md_store_t *store;
+} hot_act_t;
+
+static hot_act_t *hot_act;
+
+static apr_status_t init_hot_activation(md_mod_conf_t *mc, md_reg_t *reg, 
+                                        server_rec *s, apr_pool_t *p)
+{
+    hot_act_t *act;
+    hot_creds_t *creds;
+    const md_t *md;
+    const char *dir;
     apr_status_t rv;
+    int i;
     
-    rv = md_store_load_json(store, MD_SG_STAGING, job->md->name, MD_FN_JOB, &jprops, p);
-    if (APR_STATUS_IS_ENOENT(rv)) {
-        jprops = md_json_create(p);
-        rv = APR_SUCCESS;
+    if (mc->mds->nelts <= 0) {
+        return APR_SUCCESS;
     }
-    if (APR_SUCCESS == rv) {
-        md_json_setb(job->restart_processed, jprops, MD_KEY_PROCESSED, NULL);
-        md_json_setl(job->error_runs, jprops, MD_KEY_ERRORS, NULL);
-        rv = md_store_save_json(store, p, MD_SG_STAGING, job->md->name,
-                                MD_FN_JOB, jprops, 0);
+    
+    act = apr_pcalloc(p, sizeof(*act));
+    act->p = p;
+    act->store = md_reg_store_get(reg);
+    rv = apr_shm_create(&act->shm, (apr_size_t)(mc->mds->nelts + 1) * sizeof(apr_uint32_t), 
+                        NULL, p);
+    if (APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(10128) 
+                     "no shared memory for hot activation, renewed certificates "
+                     "will be activated by a server restart");
+        return rv;
     }
-    return rv;
+    act->generations = apr_shm_baseaddr_get(act->shm);
+    act->version = &act->generations[mc->mds->nelts];
+    memset((void*)act->generations, 0, apr_shm_size_get(act->shm));
+    
+    act->creds = apr_hash_make(p);
+    for (i = 0; i < mc->mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(mc->mds, i, const md_t *);
+        creds = apr_pcalloc(p, sizeof(*creds));
+        creds->name = md->name;
+        creds->idx = i;
+        apr_hash_set(act->creds, md->name, APR_HASH_KEY_STRING, creds);
+        
+        /* On activation, the watchdog moves this directory into the archive */
+        if (APR_SUCCESS == md_store_get_fname(&dir, act->store, MD_SG_DOMAINS, 
+                                              md->name, NULL, p)
+            && APR_SUCCESS == md_util_is_dir(dir, p)) {
+            md_make_worker_accessible(dir, p);
+        }
+    }
+    hot_act = act;
+    return APR_SUCCESS;
 }
 
-static apr_status_t check_job(md_watchdog *wd, md_job_t *job, apr_pool_t *ptemp)
+/**************************************************************************************************/
+/* OCSP priming */
+
+static void prime_ocsp_pubcert(md_ocsp_reg_t *ocsp, const md_t *md, md_pkey_spec_t *spec,
+                               apr_array_header_t *pubcert, server_rec *s, apr_pool_t *p)
 {
-    apr_status_t rv = APR_SUCCESS;
-    apr_time_t valid_from, delay;
-    int errored, renew, error_runs;
-    char ts[APR_RFC822_DATE_LEN];
+    const char *aspect = md_ocsp_fname_for(spec, p);
+    apr_status_t rv;
     
-    if (apr_time_now() < job->next_check) {
-        /* Job needs to wait */
-        return APR_EAGAIN;
+    if (pubcert->nelts < 2) {
+        /* no issuer to verify responses against */
+        return;
     }
-    
-    job->next_check = 0;
-    error_runs = job->error_runs;
-
-    if (job->md->state == MD_S_MISSING) {
-        job->stalled = 1;
+    rv = md_ocsp_prime(ocsp, APR_ARRAY_IDX(pubcert, 0, md_cert_t*), 
+                       APR_ARRAY_IDX(pubcert, 1, md_cert_t*), md->name, aspect, p);
+    if (APR_SUCCESS != rv && !APR_STATUS_IS_ENOENT(rv)) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(10124)
+                     "%s: unable to prime OCSP stapling for %s", md->name, aspect);
     }
+}
+
+/* Prime the certificates of all key specs of md, as they are in the store. */
+static void prime_ocsp_md(md_ocsp_reg_t *ocsp, md_store_t *store, const md_t *md, 
+                          server_rec *s, apr_pool_t *p)
+{
+    apr_array_header_t *pubcert;
+    md_pkey_spec_t *spec;
+    int i;
     
-    if (job->stalled) {
-        /* Missing information, this will not change until configuration
-         * is changed and server restarted */
-        rv = APR_INCOMPLETE;
-        ++job->error_runs;
-        goto out;
-    }
-    else if (job->renewed) {
-        assess_renewal(wd, job, ptemp);
+    /* the primary certificate is in the files without a key label */
+    for (i = -1; i < (md->alt_pkey_specs? md->alt_pkey_specs->nelts : 0); ++i) {
+        spec = (i < 0)? NULL : APR_ARRAY_IDX(md->alt_pkey_specs, i, md_pkey_spec_t*);
+        if (APR_SUCCESS == md_pubcert_load_for(store, MD_SG_DOMAINS, md->name, spec, 
+                                               &pubcert, p)) {
+            prime_ocsp_pubcert(ocsp, md, spec, pubcert, s, p);
+        }
     }
-    else if (APR_SUCCESS == (rv = md_reg_assess(wd->reg, job->md, &errored, &renew, wd->p))) {
-        if (errored) {
-            ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10050) 
-                         "md(%s): in error state", job->md->name);
-        }
-        else if (renew) {
-            ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10052) 
-                         "md(%s): state=%d, driving", job->md->name, job->md->state);
-                         
-            rv = md_reg_stage(wd->reg, job->md, NULL, wd->mc->env, 0, &valid_from, ptemp);
-            
-            if (APR_SUCCESS == rv) {
-                job->renewed = 1;
-                job->restart_at = valid_from;
-                assess_renewal(wd, job, ptemp);
-            }
+}
+
+/**************************************************************************************************/
+/* snapshots of the MDs for request processing */
+
+/* Request processing looks up MDs, their domains and activated credentials in an
+ * immutable snapshot, without taking locks. The watchdog may run in another process,
+ * so it only bumps the shared version after an activation. The first thread of a 
+ * child to see the new version builds a new snapshot and publishes it, the others
+ * go on with the previous one meanwhile. Without hot activation, the snapshot
+ * taken at child start stays current. */
+
+typedef struct {
+    apr_array_header_t *pubcerts;    /* per key spec, the primary first, an array of
+                                        md_cert_t* of the certificate and its chain */
+    apr_array_header_t *pkeys;       /* md_pkey_t*, in the same order */
+} snap_creds_t;
+
+typedef struct {
+    apr_uint32_t version;            /* of the hot activations it was built for */
+    apr_array_header_t *mds;         /* md_t* */
+    md_domain_index_t *index;        /* the domains of mds */
+    apr_hash_t *creds;               /* MD name -> snap_creds_t*, when activated hot */
+} md_snapshot_t;
+
+static md_snap_slot_t *snap_slot;
+static md_mod_conf_t *snap_mc;
+static apr_pool_t *snap_parent;
+static volatile apr_uint32_t snap_building;
+
+static apr_uint32_t snap_version(void)
+{
+    return hot_act? apr_atomic_read32(hot_act->version) : 0;
+}
+
+static apr_status_t snap_creds_add(snap_creds_t *creds, const md_t *md, 
+                                   md_pkey_spec_t *spec, apr_pool_t *p, server_rec *s)
+{
+    apr_array_header_t *pubcert;
+    md_pkey_t *pkey;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS == (rv = md_pubcert_load_for(hot_act->store, MD_SG_DOMAINS, md->name,
+                                                 spec, &pubcert, p))
+        && APR_SUCCESS == (rv = md_pkey_load_for(hot_act->store, MD_SG_DOMAINS, md->name,
+                                                 spec, &pkey, p))) {
+        if (pubcert->nelts <= 0) {
+            return APR_ENOENT;
         }
-        else {
-            /* Renew is not necessary yet, leave job->next_check as 0 since 
-             * that keeps the default schedule of running twice a day. */
-            apr_rfc822_date(ts, job->md->expires);
-            ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10053) 
-                         "md(%s): no need to renew yet, cert expires %s", job->md->name, ts);
+        APR_ARRAY_PUSH(creds->pubcerts, apr_array_header_t*) = pubcert;
+        APR_ARRAY_PUSH(creds->pkeys, md_pkey_t*) = pkey;
+        /* staple responses for the new certificate once the watchdog has one */
+        if (snap_mc->ocsp) {
+            prime_ocsp_pubcert(snap_mc->ocsp, md, spec, pubcert, s, p);
         }
     }
+    return rv;
+}
+
+/* Load the credentials of all key specs of md. Missing ones of additional specs
+ * are left out, as md_get_certificates() does with the files. */
+static snap_creds_t *snap_creds_load(const md_t *md, apr_pool_t *p, server_rec *s)
+{
+    snap_creds_t *creds;
+    md_pkey_spec_t *spec;
+    apr_status_t rv;
+    int i;
     
-    if (APR_SUCCESS == rv) {
-        job->error_runs = 0;
+    creds = apr_pcalloc(p, sizeof(*creds));
+    creds->pubcerts = apr_array_make(p, 5, sizeof(apr_array_header_t*));
+    creds->pkeys = apr_array_make(p, 5, sizeof(md_pkey_t*));
+    rv = snap_creds_add(creds, md, NULL, p, s);
+    for (i = 0; APR_SUCCESS == rv && md->alt_pkey_specs && i < md->alt_pkey_specs->nelts; ++i) {
+        spec = APR_ARRAY_IDX(md->alt_pkey_specs, i, md_pkey_spec_t*);
+        if (APR_SUCCESS != snap_creds_add(creds, md, spec, p, s)) {
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(10163) 
+                         "%s: no activated credentials for %s", 
+                         md->name, md_pkey_fname_for(spec, p));
+        }
     }
-    else {
-        ap_log_error( APLOG_MARK, APLOG_ERR, rv, wd->s, APLOGNO(10056) 
-                     "processing %s", job->md->name);
-        ++job->error_runs;
-        /* back off duration, depending on the errors we encounter in a row */
-        delay = apr_time_from_sec(5 << (job->error_runs - 1));
-        if (delay > apr_time_from_sec(60*60)) {
-            delay = apr_time_from_sec(60*60);
+    ap_log_error(APLOG_MARK, rv? APLOG_ERR : APLOG_DEBUG, rv, s, APLOGNO(10131) 
+                 "%s: loading activated credentials", md->name);
+    return (APR_SUCCESS == rv)? creds : NULL;
+}
+
+static md_snapshot_t *snap_build(apr_uint32_t version, apr_pool_t *p, server_rec *s)
+{
+    md_snapshot_t *snap;
+    snap_creds_t *creds;
+    hot_creds_t *hc;
+    const md_t *md;
+    md_t *cur;
+    int i;
+    
+    snap = apr_pcalloc(p, sizeof(*snap));
+    snap->version = version;
+    snap->mds = apr_array_make(p, snap_mc->mds->nelts, sizeof(md_t*));
+    snap->creds = apr_hash_make(p);
+    for (i = 0; i < snap_mc->mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(snap_mc->mds, i, const md_t*);
+        cur = NULL;
+        hc = hot_act? apr_hash_get(hot_act->creds, md->name, APR_HASH_KEY_STRING) : NULL;
+        if (hc && apr_atomic_read32(&hot_act->generations[hc->idx])) {
+            /* activated since server start, the registry has its current state */
+            cur = md_reg_get(snap_mc->reg, md->name, p);
+            if (NULL != (creds = snap_creds_load(cur? cur : md, p, s))) {
+                apr_hash_set(snap->creds, md->name, APR_HASH_KEY_STRING, creds);
+            }
         }
-        job->next_check = apr_time_now() + delay;
-        ap_log_error(APLOG_MARK, APLOG_INFO, 0, wd->s, APLOGNO(10057) 
-                     "%s: encountered error for the %d. time, next run in %s",
-                     job->md->name, job->error_runs, md_print_duration(ptemp, delay));
+        APR_ARRAY_PUSH(snap->mds, md_t*) = cur? cur : md_copy(p, md);
     }
+    snap->index = md_domain_index_make(p, snap->mds);
+    return snap;
+}
+
+/* Build and publish a snapshot, only one thread at a time and holding none. */
+static void snap_update(apr_uint32_t version, server_rec *s)
+{
+    apr_allocator_t *allocator;
+    apr_pool_t *p;
     
-out:
-    if (error_runs != job->error_runs) {
-        apr_status_t rv2 = save_job_props(wd->reg, job, ptemp);
-        ap_log_error(APLOG_MARK, APLOG_TRACE1, rv2, wd->s, "%s: saving job props", job->md->name);
+    if (APR_SUCCESS != apr_allocator_create(&allocator)) {
+        return;
+    }
+    if (APR_SUCCESS != apr_pool_create_ex(&p, snap_parent, NULL, allocator)) {
+        apr_allocator_destroy(allocator);
+        return;
     }
+    apr_allocator_owner_set(allocator, p);
+    apr_pool_tag(p, "md_snapshot");
+    md_snap_publish(snap_slot, snap_build(version, p, s), p);
+}
 
-    job->last_rv = rv;
-    return rv;
+static void snap_init(apr_pool_t *pchild, server_rec *s)
+{
+    md_srv_conf_t *sc = md_config_get(s);
+    
+    snap_slot = NULL;
+    if (!sc || !sc->mc || !sc->mc->mds || sc->mc->mds->nelts <= 0) {
+        return;
+    }
+    snap_mc = sc->mc;
+    snap_parent = pchild;
+    apr_atomic_set32(&snap_building, 0);
+    snap_slot = md_snap_slot_make(pchild);
+    snap_update(snap_version(), s);
 }
 
-static apr_status_t run_watchdog(int state, void *baton, apr_pool_t *ptemp)
+/* Get the current snapshot, NULL if there is none. Release it when done. */
+static const md_snapshot_t *snap_acquire(server_rec *s, apr_uint32_t *ptoken)
 {
-    md_watchdog *wd = baton;
-    apr_status_t rv = APR_SUCCESS;
-    md_job_t *job;
-    apr_time_t next_run, now;
-    int restart = 0;
-    int i;
+    const md_snapshot_t *snap;
+    apr_uint32_t version;
     
-    switch (state) {
-        case AP_WATCHDOG_STATE_STARTING:
-            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10054)
-                         "md watchdog start, auto drive %d mds", wd->jobs->nelts);
-            assert(wd->reg);
-        
-            for (i = 0; i < wd->jobs->nelts; ++i) {
-                job = APR_ARRAY_IDX(wd->jobs, i, md_job_t *);
-                load_job_props(wd->reg, job, ptemp);
-            }
-            break;
-        case AP_WATCHDOG_STATE_RUNNING:
-        
-            wd->next_change = 0;
-            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10055)
-                         "md watchdog run, auto drive %d mds", wd->jobs->nelts);
-                         
-            /* normally, we'd like to run at least twice a day */
-            next_run = apr_time_now() + apr_time_from_sec(MD_SECS_PER_DAY / 2);
+    if (!snap_slot) {
+        return NULL;
+    }
+    version = snap_version();
+    snap = md_snap_acquire(snap_slot, ptoken);
+    if ((!snap || snap->version != version) && !apr_atomic_cas32(&snap_building, 1, 0)) {
+        md_snap_release(snap_slot, *ptoken);
+        snap_update(version, s);
+        apr_atomic_set32(&snap_building, 0);
+        snap = md_snap_acquire(snap_slot, ptoken);
+    }
+    if (!snap) {
+        md_snap_release(snap_slot, *ptoken);
+    }
+    return snap;
+}
 
-            /* Check on all the jobs we have */
-            for (i = 0; i < wd->jobs->nelts; ++i) {
-                job = APR_ARRAY_IDX(wd->jobs, i, md_job_t *);
-                
-                rv = check_job(wd, job, ptemp);
+static void snap_release(apr_uint32_t token)
+{
+    md_snap_release(snap_slot, token);
+}
 
-                if (job->need_restart && !job->restart_processed) {
-                    restart = 1;
-                }
-                if (job->next_check && job->next_check < next_run) {
-                    next_run = job->next_check;
-                }
-            }
+/**************************************************************************************************/
+/* watchdog based impl. */
 
-            now = apr_time_now();
-            if (APLOGdebug(wd->s)) {
-                ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10107)
-                             "next run in %s", md_print_duration(ptemp, next_run - now));
-            }
-            wd_set_interval(wd->watchdog, next_run - now, wd, run_watchdog);
-            break;
-            
-        case AP_WATCHDOG_STATE_STOPPING:
-            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10058)
-                         "md watchdog stopping");
-            break;
-    }
+#define MD_WATCHDOG_NAME   "_md_"
 
-    if (restart) {
-        const char *action, *names = "";
-        int n;
+static APR_OPTIONAL_FN_TYPE(ap_watchdog_get_instance) *wd_get_instance;
+static APR_OPTIONAL_FN_TYPE(ap_watchdog_register_callback) *wd_register_callback;
+static APR_OPTIONAL_FN_TYPE(ap_watchdog_set_callback_interval) *wd_set_interval;
+
+typedef struct md_watchdog md_watchdog;
+
+typedef struct {
+    md_t *md;
+    apr_pool_t *md_pool;       /* md after a hot activation, replaced by the next one */
+    md_watchdog *wd;
+    int *ca_running;           /* number of jobs currently running against the md's CA */
+    int dispatched;
+
+    int stalled;
+    int renewed;
+    int renewal_notified;
+    apr_time_t restart_at;
+    int need_restart;
+    int restart_processed;
+    apr_time_t cert_mtime;     /* modification time of the certificate in use */
+
+    apr_status_t last_rv;
+    apr_time_t next_check;
+    int error_runs;
+    
+    apr_time_t ari_start;      /* renewal window suggested by the CA, 0 if not known */
+    apr_time_t ari_end;
+    apr_time_t ari_renew_at;   /* chosen time inside the window */
+    apr_time_t ari_poll_at;    /* when to ask the CA for its suggestion again */
+    int ari_cleared;           /* window dropped, still to be removed from the store */
+    
+    md_job_slot_t *slot;       /* shared state of the job or NULL */
+    int dirty;                 /* state changed since last written to the store */
+    int flush_pending;         /* job is in the watchdog's flush list */
+} md_job_t;
+
+struct md_watchdog {
+    apr_pool_t *p;
+    server_rec *s;
+    md_mod_conf_t *mc;
+    ap_watchdog_t *watchdog;
+    
+    apr_time_t next_change;
+    apr_time_t activate_at;    /* when renewed MDs are activated, 0 if none is waiting */
+    int restart_pending;       /* renewed MDs are ready and wait for activation */
+    
+    apr_array_header_t *jobs;
+    apr_array_header_t *queue; /* md_job_t*, min-heap on next_check */
+    apr_array_header_t *flush; /* md_job_t* whose state needs writing to the store */
+    apr_time_t flush_at;       /* when to write the flush list to the store */
+    md_reg_t *reg;
+    apr_hash_t *ca_running;    /* CA url -> int* of jobs running against it */
+
+    md_util_proc_t *notify;    /* MDNotifyCmd running in the background or NULL */
+    apr_pool_t *notify_pool;   /* lives as long as notify */
+    const char *notify_names;
+    apr_array_header_t *notify_jobs; /* md_job_t* to mark processed when it succeeded */
+    int notify_restart;        /* restart the server when notify is done */
+    int notify_ok;
+    apr_pool_t *notify_next_pool; /* lives until notify_next is notified */
+    apr_array_header_t *notify_next; /* names of activated MDs to notify after the running one */
+
+#if APR_HAS_THREADS
+    apr_pool_t *worker_pool;
+    apr_thread_pool_t *workers;
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    int running;
+    
+    apr_array_header_t *kp_specs; /* md_pkey_spec_t* to keep a stock of keys for */
+    apr_thread_t *kp_thread;
+    apr_thread_mutex_t *kp_mutex;
+    apr_thread_cond_t *kp_cond;
+    int kp_stop;
+#endif
+};
+
+static void assess_renewal(md_watchdog *wd, md_job_t *job, apr_pool_t *ptemp) 
+{
+    apr_time_t now = apr_time_now();
+    if (now >= job->restart_at) {
+        job->need_restart = 1;
+        ap_log_error( APLOG_MARK, APLOG_TRACE1, 0, wd->s, 
+                     "md(%s): has been renewed, needs restart now", job->md->name);
+    }
+    else {
+        job->next_check = job->restart_at;
         
-        for (i = 0, n = 0; i < wd->jobs->nelts; ++i) {
-            job = APR_ARRAY_IDX(wd->jobs, i, md_job_t *);
-            if (job->need_restart && !job->restart_processed) {
-                names = apr_psprintf(ptemp, "%s%s%s", names, n? " " : "", job->md->name);
-                ++n;
-            }
+        if (job->renewal_notified) {
+            ap_log_error(APLOG_MARK, APLOG_TRACE1, 0, wd->s, 
+                         "%s: renewed cert valid in %s", 
+                         job->md->name, md_print_duration(ptemp, job->restart_at - now));
         }
+        else {
+            char ts[APR_RFC822_DATE_LEN];
 
-        if (n > 0) {
-            int notified = 1;
-
-            /* Run notify command for ready MDs (if configured) and persist that
-             * we have done so. This process might be reaped after n requests or die
-             * of another cause. The one taking over the watchdog need to notify again.
-             */
-            if (wd->mc->notify_cmd) {
-                const char * const *argv;
-                const char *cmdline;
-                int exit_code;
-                
-                cmdline = apr_psprintf(ptemp, "%s %s", wd->mc->notify_cmd, names); 
-                apr_tokenize_to_argv(cmdline, (char***)&argv, ptemp);
-                if (APR_SUCCESS == (rv = md_util_exec(ptemp, argv[0], argv, &exit_code))) {
-                    ap_log_error(APLOG_MARK, APLOG_DEBUG, rv, wd->s, APLOGNO(10108) 
-                                 "notify command '%s' returned %d", 
-                                 wd->mc->notify_cmd, exit_code);
-                }
-                else {
-                    if (APR_EINCOMPLETE == rv && exit_code) {
-                        rv = 0;
-                    }
-                    ap_log_error(APLOG_MARK, APLOG_ERR, rv, wd->s, APLOGNO(10109) 
-                                 "executing MDNotifyCmd %s returned %d", 
-                                  wd->mc->notify_cmd, exit_code);
-                    notified = 0;
-                } 
-            }
-            
-            if (notified) {
-                /* persist the jobs that were notified */
-                for (i = 0, n = 0; i < wd->jobs->nelts; ++i) {
-                    job = APR_ARRAY_IDX(wd->jobs, i, md_job_t *);
-                    if (job->need_restart && !job->restart_processed) {
-                        job->restart_processed = 1;
-                        save_job_props(wd->reg, job, ptemp);
-                    }
-                }
-            }
-            
-            /* FIXME: the server needs to start gracefully to take the new certificate in.
-             * This poses a variety of problems to solve satisfactory for everyone:
-             * - I myself, have no implementation for Windows 
-             * - on *NIX, child processes run with less privileges, preventing
-             *   the signal based restart trigger to work
-             * - admins want better control of timing windows for restarts, e.g.
-             *   during less busy hours/days.
-             */
-            rv = md_server_graceful(ptemp, wd->s);
-            if (APR_ENOTIMPL == rv) {
-                /* self-graceful restart not supported in this setup */
-                action = " and changes will be activated on next (graceful) server restart.";
-            }
-            else {
-                action = " and server has been asked to restart now.";
-            }
-            ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, wd->s, APLOGNO(10059) 
-                         "The Managed Domain%s %s %s been setup%s",
-                         (n > 1)? "s" : "", names, (n > 1)? "have" : "has", action);
+            apr_rfc822_date(ts, job->restart_at);
+            ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, wd->s, APLOGNO(10051) 
+                         "%s: has been renewed successfully and should be activated at %s"
+                         " (this requires a server restart latest in %s)", 
+                         job->md->name, ts, md_print_duration(ptemp, job->restart_at - now));
+            job->renewal_notified = 1;
         }
     }
-    
-    return APR_SUCCESS;
 }
 
-static apr_status_t start_watchdog(apr_array_header_t *names, apr_pool_t *p, 
-                                   md_reg_t *reg, server_rec *s, md_mod_conf_t *mc)
+/* Jobs wait in a min-heap ordered by their next_check, so that a watchdog run
+ * only touches the jobs that are due. A job's next_check does not change while 
+ * it is in the queue. */
+static void queue_push(md_watchdog *wd, md_job_t *job)
 {
-    apr_allocator_t *allocator;
-    md_watchdog *wd;
-    apr_pool_t *wdp;
-    apr_status_t rv;
-    const char *name;
-    md_t *md;
-    md_job_t *job;
-    int i, errored, renew;
-    
-    wd_get_instance = APR_RETRIEVE_OPTIONAL_FN(ap_watchdog_get_instance);
-    wd_register_callback = APR_RETRIEVE_OPTIONAL_FN(ap_watchdog_register_callback);
-    wd_set_interval = APR_RETRIEVE_OPTIONAL_FN(ap_watchdog_set_callback_interval);
+    md_job_t **heap;
+    int i, parent;
     
-    if (!wd_get_instance || !wd_register_callback || !wd_set_interval) {
-        ap_log_error(APLOG_MARK, APLOG_CRIT, 0, s, APLOGNO(10061) "mod_watchdog is required");
-        return !OK;
+    APR_ARRAY_PUSH(wd->queue, md_job_t*) = job;
+    heap = (md_job_t**)wd->queue->elts;
+    for (i = wd->queue->nelts - 1; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if (heap[parent]->next_check <= job->next_check) {
+            break;
+        }
+        heap[i] = heap[parent];
     }
+    heap[i] = job;
+}
+
+static md_job_t *queue_pop_due(md_watchdog *wd, apr_time_t now)
+{
+    md_job_t **heap = (md_job_t**)wd->queue->elts;
+    md_job_t *job, *last;
+    int i, child, n;
     
-    /* We want our own pool with own allocator to keep data across watchdog invocations */
-    apr_allocator_create(&allocator);
-    apr_allocator_max_free_set(allocator, ap_max_mem_free);
-    rv = apr_pool_create_ex(&wdp, p, NULL, allocator);
-    if (rv != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10062) "md_watchdog: create pool");
-        return rv;
+    if (wd->queue->nelts <= 0 || heap[0]->next_check > now) {
+        return NULL;
     }
-    apr_allocator_owner_set(allocator, wdp);
-    apr_pool_tag(wdp, "md_watchdog");
+    job = heap[0];
+    n = --wd->queue->nelts;
+    last = heap[n];
+    for (i = 0; (child = 2 * i + 1) < n; i = child) {
+        if (child + 1 < n && heap[child + 1]->next_check < heap[child]->next_check) {
+            ++child;
+        }
+        if (last->next_check <= heap[child]->next_check) {
+            break;
+        }
+        heap[i] = heap[child];
+    }
+    if (n > 0) {
+        heap[i] = last;
+    }
+    return job;
+}
 
-    wd = apr_pcalloc(wdp, sizeof(*wd));
-    wd->p = wdp;
-    wd->reg = reg;
-    wd->s = s;
-    wd->mc = mc;
+#define MD_JOB_DEF_INTERVAL     apr_time_from_sec(MD_SECS_PER_DAY / 2)
+#define MD_JOB_MAX_JITTER       apr_time_from_sec(MD_SECS_PER_DAY)
+
+/* A job without a specific time for its next check is checked again when its 
+ * MD comes up for renewal. Jobs start a little earlier by an amount that is 
+ * stable for the MD, so that certificates obtained together do not all hit 
+ * the CA again at the same time. */
+static void job_schedule(md_job_t *job, apr_time_t now)
+{
+    apr_time_t renew_at;
+    apr_interval_time_t spread;
+    apr_int64_t secs;
+    apr_ssize_t len = APR_HASH_KEY_STRING;
+    unsigned int hash;
     
-    wd->jobs = apr_array_make(wd->p, 10, sizeof(md_job_t *));
-    for (i = 0; i < names->nelts; ++i) {
-        name = APR_ARRAY_IDX(names, i, const char *);
-        md = md_reg_get(wd->reg, name, wd->p);
-        if (md) {
-            md_reg_assess(wd->reg, md, &errored, &renew, wd->p);
-            if (errored) {
-                ap_log_error( APLOG_MARK, APLOG_WARNING, 0, wd->s, APLOGNO(10063) 
-                             "md(%s): seems errored. Will not process this any further.", name);
-            }
-            else {
-                job = apr_pcalloc(wd->p, sizeof(*job));
-                
-                job->md = md;
-                APR_ARRAY_PUSH(wd->jobs, md_job_t*) = job;
+    if (job->next_check) {
+        return;
+    }
+    renew_at = (MD_S_COMPLETE == job->md->state && !job->renewed)? md_renew_at(job->md) : 0;
+    if (renew_at > now && job->ari_renew_at > 0) {
+        /* the CA's suggestion, spread already */
+        job->next_check = (job->ari_renew_at > now)? job->ari_renew_at : now;
+    }
+    else if (renew_at > now) {
+        spread = (renew_at - now) / 4;
+        if (spread > MD_JOB_MAX_JITTER) {
+            spread = MD_JOB_MAX_JITTER;
+        }
+        secs = apr_time_sec(spread);
+        if (secs > 0) {
+            hash = apr_hashfunc_default(job->md->name, &len);
+            renew_at -= apr_time_from_sec((apr_int64_t)(hash % (unsigned int)secs));
+        }
+        job->next_check = renew_at;
+    }
+    else {
+        job->next_check = now + MD_JOB_DEF_INTERVAL;
+    }
+    if (job->ari_poll_at > now && job->ari_poll_at < job->next_check) {
+        job->next_check = job->ari_poll_at;
+    }
+}
 
-                ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10064) 
-                             "md(%s): state=%d, driving", name, md->state);
-                
-                load_job_props(reg, job, wd->p);
-                if (job->error_runs) {
-                    /* We are just restarting. If we encounter jobs that had errors
-                     * running the protocol on previous staging runs, we reset
-                     * the staging area for it, in case we persisted something that
-                     * causes a loop. */
-                    md_store_t *store = md_reg_store_get(wd->reg);
-                    
-                    md_store_purge(store, p, MD_SG_STAGING, job->md->name);
-                    md_store_purge(store, p, MD_SG_CHALLENGES, job->md->name);
+static apr_time_t ari_get_time(md_json_t *json, const char *key)
+{
+    const char *s = md_json_gets(json, MD_KEY_RENEWAL_INFO, key, NULL);
+    return (s && *s)? apr_date_parse_rfc(s) : 0;
+}
+
+static void ari_set_time(apr_time_t t, md_json_t *json, const char *key, apr_pool_t *p)
+{
+    char ts[APR_RFC822_DATE_LEN];
+
+    if (t > 0) {
+        apr_rfc822_date(ts, t);
+        md_json_sets(apr_pstrdup(p, ts), json, MD_KEY_RENEWAL_INFO, key, NULL);
+    }
+}
+
+static void job_slot_write(md_job_t *job)
+{
+    md_job_slot_t *slot = job->slot;
+    
+    apr_atomic_inc32(&slot->seq);
+    slot->error_runs = job->error_runs;
+    slot->restart_processed = job->restart_processed;
+    slot->last_rv = job->last_rv;
+    slot->next_check = job->next_check;
+    slot->ari_start = job->ari_start;
+    slot->ari_end = job->ari_end;
+    slot->ari_renew_at = job->ari_renew_at;
+    slot->ari_poll_at = job->ari_poll_at;
+    slot->md_state = job->md->state;
+    slot->expires = job->md->expires;
+    slot->loaded = 1;
+    apr_atomic_inc32(&slot->seq);
+}
+
+static apr_status_t load_job_props(md_reg_t *reg, md_job_t *job, apr_pool_t *p)
+{
+    md_store_t *store = md_reg_store_get(reg);
+    md_job_slot_t state;
+    md_json_t *jprops;
+    apr_status_t rv;
+    
+    if (job->slot && job_slot_read(job->slot, &state)) {
+        job->restart_processed = state.restart_processed;
+        job->error_runs = state.error_runs;
+        job->last_rv = state.last_rv;
+        job->next_check = state.next_check;
+        job->ari_start = state.ari_start;
+        job->ari_end = state.ari_end;
+        job->ari_renew_at = state.ari_renew_at;
+        job->ari_poll_at = state.ari_poll_at;
+        return APR_SUCCESS;
+    }
+    
+    rv = md_store_load_json(store, MD_SG_STAGING, job->md->name,
+                            MD_FN_JOB, &jprops, p);
+    if (APR_SUCCESS == rv) {
+        job->restart_processed = md_json_getb(jprops, MD_KEY_PROCESSED, NULL);
+        job->error_runs = (int)md_json_getl(jprops, MD_KEY_ERRORS, NULL);
+        job->ari_start = ari_get_time(jprops, MD_KEY_START);
+        job->ari_end = ari_get_time(jprops, MD_KEY_END);
+        job->ari_renew_at = ari_get_time(jprops, MD_KEY_RENEW_AT);
+        job->ari_poll_at = ari_get_time(jprops, MD_KEY_RETRY_AT);
+    }
+    if (job->slot) {
+        job_slot_write(job);
+    }
+    return rv;
+}
+
+static apr_status_t store_job_props(md_reg_t *reg, md_job_t *job, apr_pool_t *p)
+{
+    md_store_t *store = md_reg_store_get(reg);
+    md_json_t *jprops;
+    apr_status_t rv;
+    
+    rv = md_store_load_json(store, MD_SG_STAGING, job->md->name, MD_FN_JOB, &jprops, p);
+    if (APR_STATUS_IS_ENOENT(rv)) {
+        jprops = md_json_create(p);
+        rv = APR_SUCCESS;
+    }
+    if (APR_SUCCESS == rv) {
+        md_json_setb(job->restart_processed, jprops, MD_KEY_PROCESSED, NULL);
+        md_json_setl(job->error_runs, jprops, MD_KEY_ERRORS, NULL);
+        if (job->ari_renew_at > 0) {
+            ari_set_time(job->ari_start, jprops, MD_KEY_START, p);
+            ari_set_time(job->ari_end, jprops, MD_KEY_END, p);
+            ari_set_time(job->ari_renew_at, jprops, MD_KEY_RENEW_AT, p);
+            ari_set_time(job->ari_poll_at, jprops, MD_KEY_RETRY_AT, p);
+        }
+        else if (job->ari_cleared) {
+            md_json_del(jprops, MD_KEY_RENEWAL_INFO, NULL);
+        }
+        rv = md_store_save_json(store, p, MD_SG_STAGING, job->md->name,
+                                MD_FN_JOB, jprops, 0);
+        if (APR_SUCCESS == rv) {
+            job->ari_cleared = 0;
+        }
+    }
+    return rv;
+}
+
+/* Record a change in the job's state. With shared memory, the store is updated 
+ * later by flush_job_props(), otherwise right away. */
+static apr_status_t save_job_props(md_reg_t *reg, md_job_t *job, apr_pool_t *p)
+{
+    if (job->slot) {
+        job_slot_write(job);
+        job->dirty = 1;
+        return APR_SUCCESS;
+    }
+    return store_job_props(reg, job, p);
+}
+
+#define MD_JOB_FLUSH_DELAY      apr_time_from_sec(5 * 60)
+
+/* Put a job with changed state on the flush list, called in the watchdog only. */
+static void job_flush_later(md_watchdog *wd, md_job_t *job)
+{
+    if (job->dirty && !job->flush_pending) {
+        job->flush_pending = 1;
+        APR_ARRAY_PUSH(wd->flush, md_job_t*) = job;
+        if (!wd->flush_at) {
+            wd->flush_at = apr_time_now() + MD_JOB_FLUSH_DELAY;
+        }
+    }
+}
+
+static void flush_job_props(md_watchdog *wd, apr_pool_t *ptemp)
+{
+    md_job_t *job;
+    apr_status_t rv;
+    int i;
+    
+    for (i = 0; i < wd->flush->nelts; ++i) {
+        job = APR_ARRAY_IDX(wd->flush, i, md_job_t *);
+        job->dirty = job->flush_pending = 0;
+        rv = store_job_props(wd->reg, job, ptemp);
+        ap_log_error(APLOG_MARK, APLOG_TRACE1, rv, wd->s, "%s: saving job props", job->md->name);
+    }
+    apr_array_clear(wd->flush);
+    wd->flush_at = 0;
+}
+
+static apr_time_t job_cert_mtime(md_watchdog *wd, md_job_t *job, apr_pool_t *p)
+{
+    return md_store_get_modified(md_reg_store_get(wd->reg), MD_SG_DOMAINS, 
+                                 job->md->name, MD_FN_PUBCERT, p);
+}
+
+/* With MDRenewLease, servers sharing a store renew an MD only while holding its
+ * lease. The others watch the store for the outcome: a certificate staged by a server 
+ * whose lease expired is taken over, a new one in domains is activated as if it had 
+ * been renewed here. Returns != 0 if this server is to drive the renewal. */
+static int lease_drive(md_watchdog *wd, md_job_t *job, apr_status_t *prv, apr_pool_t *ptemp)
+{
+    md_store_t *store = md_reg_store_get(wd->reg);
+    apr_status_t rv;
+    
+    *prv = APR_SUCCESS;
+    if (wd->mc->lease_ttl <= 0) {
+        return 1;
+    }
+    rv = md_store_lease_acquire(store, ptemp, job->md->name, wd->mc->lease_owner, 
+                                wd->mc->lease_ttl);
+    if (APR_SUCCESS == rv) {
+        if (!md_is_newer(store, MD_SG_STAGING, MD_SG_DOMAINS, job->md->name, ptemp)
+            || !md_store_get_modified(store, MD_SG_STAGING, job->md->name, 
+                                      MD_FN_PUBCERT, ptemp)) {
+            return 1;
+        }
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, wd->s, APLOGNO(10135) 
+                     "%s: taking over certificate staged by another server", job->md->name);
+    }
+    else if (APR_STATUS_IS_EBUSY(rv)) {
+        /* look again when the lease expires, unless its holder keeps it */
+        job->next_check = apr_time_now() + wd->mc->lease_ttl;
+        if (job_cert_mtime(wd, job, ptemp) <= job->cert_mtime) {
+            return 0;
+        }
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, wd->s, APLOGNO(10136) 
+                     "%s: certificate has been renewed by another server", job->md->name);
+    }
+    else {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, wd->s, APLOGNO(10137) 
+                     "%s: unable to acquire renewal lease", job->md->name);
+        *prv = rv;
+        return 0;
+    }
+    job->renewed = 1;
+    job->restart_at = 0;
+    assess_renewal(wd, job, ptemp);
+    return 0;
+}
+
+/* Returns != 0 if this server still holds the lease of the job's MD, or needs none. 
+ * Checked before acting on a renewal, since two servers may both have taken it. 
+ * A lease that expired meanwhile is taken again, if nobody else did. */
+static int lease_held(md_watchdog *wd, md_job_t *job, apr_pool_t *ptemp)
+{
+    md_store_t *store = md_reg_store_get(wd->reg);
+    apr_status_t rv;
+    
+    if (wd->mc->lease_ttl <= 0) {
+        return 1;
+    }
+    rv = md_store_lease_check(store, ptemp, job->md->name, wd->mc->lease_owner);
+    if (APR_STATUS_IS_ENOENT(rv)) {
+        rv = md_store_lease_acquire(store, ptemp, job->md->name, wd->mc->lease_owner, 
+                                    wd->mc->lease_ttl);
+    }
+    if (APR_SUCCESS == rv) {
+        return 1;
+    }
+    ap_log_error(APLOG_MARK, APLOG_INFO, rv, wd->s, APLOGNO(10160) 
+                 "%s: renewal lease lost, leaving the renewal to its holder", job->md->name);
+    return 0;
+}
+
+#if APR_HAS_THREADS
+
+/* While a renewal is driven, which may take longer than the lease lasts, a thread
+ * extends the lease every third of its duration. */
+typedef struct {
+    md_watchdog *wd;
+    const char *name;
+    apr_pool_t *p;
+    apr_thread_t *thread;
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    int stop;
+    int lost;                  /* another server has the lease now */
+} lease_keeper_t;
+
+static void * APR_THREAD_FUNC lease_keeper_run(apr_thread_t *thread, void *data)
+{
+    lease_keeper_t *keeper = data;
+    md_watchdog *wd = keeper->wd;
+    apr_allocator_t *allocator;
+    apr_pool_t *ptemp;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS == (rv = apr_allocator_create(&allocator))) {
+        if (APR_SUCCESS == (rv = apr_pool_create_ex(&ptemp, NULL, NULL, allocator))) {
+            apr_allocator_owner_set(allocator, ptemp);
+            apr_pool_tag(ptemp, "md_lease");
+            
+            apr_thread_mutex_lock(keeper->mutex);
+            while (!keeper->stop && !keeper->lost) {
+                apr_thread_cond_timedwait(keeper->cond, keeper->mutex, wd->mc->lease_ttl / 3);
+                if (keeper->stop) {
+                    break;
                 }
+                apr_thread_mutex_unlock(keeper->mutex);
+                rv = md_store_lease_acquire(md_reg_store_get(wd->reg), ptemp, keeper->name, 
+                                            wd->mc->lease_owner, wd->mc->lease_ttl);
+                ap_log_error(APLOG_MARK, APLOG_TRACE1, rv, wd->s, 
+                             "%s: extending renewal lease", keeper->name);
+                apr_pool_clear(ptemp);
+                apr_thread_mutex_lock(keeper->mutex);
+                keeper->lost = APR_STATUS_IS_EBUSY(rv);
+            }
+            apr_thread_mutex_unlock(keeper->mutex);
+            apr_pool_destroy(ptemp);
+        }
+        else {
+            apr_allocator_destroy(allocator);
+        }
+    }
+    apr_thread_exit(thread, rv);
+    return NULL;
+}
+
+static lease_keeper_t *lease_keep_start(md_watchdog *wd, md_job_t *job)
+{
+    lease_keeper_t *keeper;
+    apr_allocator_t *allocator;
+    apr_thread_mutex_t *amutex;
+    apr_pool_t *p;
+    apr_status_t rv;
+    
+    if (wd->mc->lease_ttl <= 0) {
+        return NULL;
+    }
+    /* the thread's pool is destroyed in the thread, give it an allocator for that */
+    if (APR_SUCCESS != (rv = apr_allocator_create(&allocator))) goto fail;
+    if (APR_SUCCESS != (rv = apr_pool_create_ex(&p, NULL, NULL, allocator))) {
+        apr_allocator_destroy(allocator);
+        goto fail;
+    }
+    apr_allocator_owner_set(allocator, p);
+    apr_pool_tag(p, "md_lease_keeper");
+    keeper = apr_pcalloc(p, sizeof(*keeper));
+    keeper->wd = wd;
+    keeper->name = apr_pstrdup(p, job->md->name);
+    keeper->p = p;
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&amutex, APR_THREAD_MUTEX_DEFAULT, p))) {
+        apr_pool_destroy(p);
+        goto fail;
+    }
+    apr_allocator_mutex_set(allocator, amutex);
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&keeper->mutex, 
+                                                        APR_THREAD_MUTEX_DEFAULT, p))
+        || APR_SUCCESS != (rv = apr_thread_cond_create(&keeper->cond, p))
+        || APR_SUCCESS != (rv = apr_thread_create(&keeper->thread, NULL, lease_keeper_run, 
+                                                  keeper, p))) {
+        apr_pool_destroy(p);
+        goto fail;
+    }
+    return keeper;
+fail:
+    ap_log_error(APLOG_MARK, APLOG_WARNING, rv, wd->s, APLOGNO(10161) 
+                 "%s: unable to start thread, renewal lease is not extended while driving", 
+                 job->md->name);
+    return NULL;
+}
+
+/* Stop extending the lease, returns != 0 if it was lost meanwhile */
+static int lease_keep_stop(lease_keeper_t *keeper)
+{
+    apr_status_t rv;
+    int lost;
+    
+    if (!keeper) {
+        return 0;
+    }
+    apr_thread_mutex_lock(keeper->mutex);
+    keeper->stop = 1;
+    apr_thread_cond_signal(keeper->cond);
+    apr_thread_mutex_unlock(keeper->mutex);
+    apr_thread_join(&rv, keeper->thread);
+    lost = keeper->lost;
+    apr_pool_destroy(keeper->p);
+    return lost;
+}
+
+#else /* APR_HAS_THREADS */
+
+/* Without threads, the lease is only extended by the job's checks */
+typedef void lease_keeper_t;
+
+static lease_keeper_t *lease_keep_start(md_watchdog *wd, md_job_t *job)
+{
+    (void)wd;
+    (void)job;
+    return NULL;
+}
+
+static int lease_keep_stop(lease_keeper_t *keeper)
+{
+    (void)keeper;
+    return 0;
+}
+
+#endif /* APR_HAS_THREADS */
+
+/* The time before which none of the CAs of an MD takes new orders. With several CAs,
+ * the job only has to wait when all of them are rate limited. */
+static apr_time_t ca_retry_at(const md_t *md)
+{
+    apr_time_t retry_at, t;
+    int i;
+
+    retry_at = md_acme_rl_retry_at(md->ca_url);
+    if (md->ca_urls) {
+        for (i = 0; i < md->ca_urls->nelts && retry_at > 0; ++i) {
+            t = md_acme_rl_retry_at(APR_ARRAY_IDX(md->ca_urls, i, const char *));
+            if (t < retry_at) retry_at = t;
+        }
+    }
+    return retry_at;
+}
+
+#define MD_ARI_POLL_DEFAULT     apr_time_from_sec(6 * 60 * 60)
+#define MD_ARI_POLL_MIN         apr_time_from_sec(60)
+#define MD_ARI_POLL_MAX         apr_time_from_sec(MD_SECS_PER_DAY)
+
+/* With MDRenewViaARI, the CA suggests a window for renewing the certificates of an MD
+ * (RFC 9773). The job renews at a random time inside it, so that servers and MDs
+ * do not all come at once, and asks again as often as the CA wants. Returns != 0
+ * if that time has come. */
+static int ari_renew_due(md_watchdog *wd, md_job_t *job, apr_pool_t *ptemp)
+{
+    apr_time_t now = apr_time_now(), start, end, retry_at;
+    apr_interval_time_t poll;
+    apr_uint32_t r = 0;
+    apr_int64_t secs;
+    char ts[APR_RFC822_DATE_LEN];
+    apr_status_t rv;
+    
+    if (MD_S_COMPLETE != job->md->state || job->renewed) {
+        return 0;
+    }
+    if (now >= job->ari_poll_at) {
+        rv = md_reg_renewal_info(wd->reg, job->md, &start, &end, &retry_at, ptemp);
+        if (APR_SUCCESS == rv) {
+            if (start != job->ari_start || end != job->ari_end || !job->ari_renew_at) {
+                secs = apr_time_sec(end - start);
+                md_rand_bytes((unsigned char*)&r, sizeof(r), ptemp);
+                job->ari_start = start;
+                job->ari_end = end;
+                job->ari_renew_at = start + ((secs > 0)? 
+                    apr_time_from_sec((apr_int64_t)(r % (apr_uint64_t)(secs + 1))) : 0);
+                apr_rfc822_date(ts, job->ari_renew_at);
+                ap_log_error(APLOG_MARK, APLOG_INFO, 0, wd->s, APLOGNO(10147) 
+                             "md(%s): CA suggests renewal within %s, renewing at %s", 
+                             job->md->name, md_print_duration(ptemp, end - start), ts);
+            }
+            poll = retry_at? retry_at - now : MD_ARI_POLL_DEFAULT;
+        }
+        else {
+            if (!APR_STATUS_IS_ENOTIMPL(rv) && !APR_STATUS_IS_ENOENT(rv)) {
+                ap_log_error(APLOG_MARK, APLOG_DEBUG, rv, wd->s, APLOGNO(10148) 
+                             "md(%s): getting renewal info", job->md->name);
+            }
+            poll = APR_STATUS_IS_ENOTIMPL(rv)? MD_ARI_POLL_MAX : MD_ARI_POLL_DEFAULT;
+        }
+        if (poll < MD_ARI_POLL_MIN) poll = MD_ARI_POLL_MIN;
+        if (poll > MD_ARI_POLL_MAX) poll = MD_ARI_POLL_MAX;
+        job->ari_poll_at = now + poll;
+        save_job_props(wd->reg, job, ptemp);
+    }
+    return job->ari_renew_at > 0 && job->ari_renew_at <= now;
+}
+
+/* when another process or thread stages the MD, look again after this */
+#define MD_JOB_BUSY_DELAY       apr_time_from_sec(60)
+/* when staging waits for something outside, e.g. DNS records, continue after this */
+#define MD_JOB_PROGRESS_DELAY   apr_time_from_sec(10)
+
+static apr_status_t check_job(md_watchdog *wd, md_job_t *job, apr_pool_t *ptemp)
+{
+    apr_status_t rv = APR_SUCCESS, prv;
+    apr_time_t valid_from, delay, start, retry_at;
+    apr_interval_time_t duration;
+    int errored, renew, error_runs;
+    char ts[APR_RFC822_DATE_LEN];
+    log_ring_ctx log_ctx;
+    trace_print_ctx trace_ctx;
+    apr_uint32_t log_mark, trace_mark;
+    lease_keeper_t *keeper;
+    md_json_t *trace;
+    
+    if (apr_time_now() < job->next_check) {
+        /* Job needs to wait */
+        return APR_EAGAIN;
+    }
+    
+    job->next_check = 0;
+    error_runs = job->error_runs;
+
+    if (job->md->state == MD_S_MISSING) {
+        job->stalled = 1;
+    }
+    
+    if (job->stalled) {
+        /* Missing information, this will not change until configuration
+         * is changed and server restarted */
+        rv = APR_INCOMPLETE;
+        ++job->error_runs;
+        goto out;
+    }
+    else if (job->renewed) {
+        assess_renewal(wd, job, ptemp);
+    }
+    else if (APR_SUCCESS == (rv = md_reg_assess(wd->reg, job->md, &errored, &renew, ptemp))) {
+        if (!errored && !renew && wd->mc->renew_via_ari) {
+            renew = ari_renew_due(wd, job, ptemp);
+        }
+        if (errored) {
+            ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10050) 
+                         "md(%s): in error state", job->md->name);
+        }
+        else if (renew && (retry_at = ca_retry_at(job->md)) > apr_time_now()) {
+            /* not an error of the job, keep its error count as it is */
+            job->next_check = retry_at;
+            ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10146) 
+                         "md(%s): CA is rate limited, next run in %s", job->md->name, 
+                         md_print_duration(ptemp, retry_at - apr_time_now()));
+            goto out;
+        }
+        else if (renew && !lease_drive(wd, job, &rv, ptemp)) {
+            ap_log_error( APLOG_MARK, APLOG_DEBUG, rv, wd->s, 
+                         "md(%s): renewal is up to another server", job->md->name);
+        }
+        else if (renew && !lease_held(wd, job, ptemp)) {
+            /* taken by another server since, not an error of the job */
+            job->next_check = apr_time_now() + wd->mc->lease_ttl;
+            goto out;
+        }
+        else if (renew) {
+            ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10052) 
+                         "md(%s): state=%d, driving", job->md->name, job->md->state);
+                         
+            start = apr_time_now();
+            log_mark = md_log_ring_mark();
+            trace_mark = md_trace_mark();
+            keeper = lease_keep_start(wd, job);
+            rv = md_reg_stage(wd->reg, job->md, NULL, wd->mc->env, 0, &valid_from, ptemp);
+            if (lease_keep_stop(keeper) || !lease_held(wd, job, ptemp)) {
+                /* Another server renews it now. What we staged is not ours to activate,
+                 * the holder takes it over or replaces it. */
+                ap_log_error(APLOG_MARK, APLOG_INFO, rv, wd->s, APLOGNO(10162) 
+                             "%s: renewal lease lost while driving", job->md->name);
+                job->next_check = apr_time_now() + wd->mc->lease_ttl;
+                rv = APR_SUCCESS;
+                goto out;
+            }
+            if (APR_STATUS_IS_EBUSY(rv)) {
+                /* staged by someone else right now, not an error of the job */
+                ap_log_error(APLOG_MARK, APLOG_DEBUG, rv, wd->s, APLOGNO(10165) 
+                             "%s: staging is busy, next run in %s", job->md->name, 
+                             md_print_duration(ptemp, MD_JOB_BUSY_DELAY));
+                job->next_check = apr_time_now() + MD_JOB_BUSY_DELAY;
+                rv = APR_SUCCESS;
+                goto out;
+            }
+            if (APR_STATUS_IS_EINPROGRESS(rv)) {
+                /* not done, but not failed either, the next run carries on */
+                ap_log_error(APLOG_MARK, APLOG_DEBUG, rv, wd->s, APLOGNO(10166) 
+                             "%s: staging in progress, next run in %s", job->md->name, 
+                             md_print_duration(ptemp, MD_JOB_PROGRESS_DELAY));
+                job->next_check = apr_time_now() + MD_JOB_PROGRESS_DELAY;
+                rv = APR_SUCCESS;
+                goto out;
+            }
+            if (job->slot) {
+                duration = apr_time_now() - start;
+                job_slot_renewal(job->slot, duration);
+                md_trace_hist_add(&metrics->renewals, duration);
+            }
+            if (wd->mc->trace_records > 0) {
+                /* the records of this run, one per line, a long run does not fit into one */
+                trace = md_trace_dump(ptemp, job->md->name, trace_mark);
+                ap_log_error(APLOG_MARK, APLOG_INFO, rv, wd->s, APLOGNO(10142)
+                             "%s: trace %ld http requests in %ldms, phases %s", job->md->name,
+                             md_json_getl(trace, MD_KEY_HTTP, MD_KEY_REQUESTS, NULL),
+                             md_json_getl(trace, MD_KEY_HTTP, MD_KEY_MS, NULL),
+                             md_json_writep(md_json_getj(trace, MD_KEY_PHASES, NULL),
+                                            ptemp, MD_JSON_FMT_COMPACT));
+                trace_ctx.s = wd->s;
+                trace_ctx.name = job->md->name;
+                trace_ctx.p = ptemp;
+                md_json_itera(trace_rec_print, &trace_ctx, trace, MD_KEY_RECORDS, NULL);
+            }
+            if (wd->mc->trace_log_records > 0) {
+                /* the messages this renewal run kept, shown when it failed */
+                if (APR_SUCCESS != rv) {
+                    log_ctx.s = wd->s;
+                    log_ctx.name = job->md->name;
+                    log_ctx.end = apr_time_now();
+                    md_log_ring_drain(log_mark, log_ring_print, &log_ctx);
+                }
+            }
+            
+            if (APR_SUCCESS == rv) {
+                job->renewed = 1;
+                /* the window was for the certificate just replaced */
+                job->ari_start = job->ari_end = job->ari_renew_at = job->ari_poll_at = 0;
+                job->ari_cleared = 1;
+                job->restart_at = valid_from;
+                assess_renewal(wd, job, ptemp);
+            }
+        }
+        else {
+            /* Renew is not necessary yet, leave job->next_check as 0 since 
+             * that keeps the default schedule of running twice a day. */
+            apr_rfc822_date(ts, job->md->expires);
+            ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10053) 
+                         "md(%s): no need to renew yet, cert expires %s", job->md->name, ts);
+            if (wd->mc->lease_ttl > 0) {
+                md_store_lease_release(md_reg_store_get(wd->reg), ptemp, job->md->name, 
+                                       wd->mc->lease_owner);
+            }
+            if (wd->mc->renew_prestage > 0 
+                && md_renew_at(job->md) - wd->mc->renew_prestage <= apr_time_now()) {
+                /* a failure here is not an error of the job, staging will retry */
+                prv = md_reg_prestage(wd->reg, job->md, ptemp);
+                ap_log_error( APLOG_MARK, APLOG_DEBUG, prv, wd->s, APLOGNO(10145) 
+                             "md(%s): prestaged keys and CSRs for renewal", job->md->name);
+            }
+        }
+    }
+    
+    if (APR_SUCCESS == rv) {
+        job->error_runs = 0;
+    }
+    else {
+        ap_log_error( APLOG_MARK, APLOG_ERR, rv, wd->s, APLOGNO(10056) 
+                     "processing %s", job->md->name);
+        ++job->error_runs;
+        /* back off duration, depending on the errors we encounter in a row */
+        delay = apr_time_from_sec(5 << (job->error_runs - 1));
+        if (delay > apr_time_from_sec(60*60)) {
+            delay = apr_time_from_sec(60*60);
+        }
+        job->next_check = apr_time_now() + delay;
+        /* no sooner than the CA lets us */
+        retry_at = ca_retry_at(job->md);
+        if (retry_at > job->next_check) {
+            job->next_check = retry_at;
+            delay = retry_at - apr_time_now();
+        }
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, wd->s, APLOGNO(10057) 
+                     "%s: encountered error for the %d. time, next run in %s",
+                     job->md->name, job->error_runs, md_print_duration(ptemp, delay));
+    }
+    
+out:
+    if (error_runs != job->error_runs || job->ari_cleared) {
+        apr_status_t rv2 = save_job_props(wd->reg, job, ptemp);
+        ap_log_error(APLOG_MARK, APLOG_TRACE1, rv2, wd->s, "%s: saving job props", job->md->name);
+    }
+
+    job->last_rv = rv;
+    return rv;
+}
+
+#if APR_HAS_THREADS
+
+/* With MDRenewConcurrency > 1, jobs are checked by a pool of worker threads. Each
+ * job is handed to one worker at a time and a run is over when all workers are done.
+ * Workers only touch their job and allocate from a pool of their own. */
+
+static void * APR_THREAD_FUNC renew_worker(apr_thread_t *thread, void *data)
+{
+    md_job_t *job = data;
+    md_watchdog *wd = job->wd;
+    apr_allocator_t *allocator;
+    apr_pool_t *ptemp;
+    apr_status_t rv;
+    
+    (void)thread;
+    if (APR_SUCCESS == (rv = apr_allocator_create(&allocator))) {
+        apr_allocator_max_free_set(allocator, ap_max_mem_free);
+        if (APR_SUCCESS == (rv = apr_pool_create_ex(&ptemp, NULL, NULL, allocator))) {
+            apr_allocator_owner_set(allocator, ptemp);
+            apr_pool_tag(ptemp, "md_renew");
+            check_job(wd, job, ptemp);
+            apr_pool_destroy(ptemp);
+        }
+        else {
+            apr_allocator_destroy(allocator);
+        }
+    }
+    if (APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, wd->s, APLOGNO(10117) 
+                     "%s: unable to create pool for renewal", job->md->name);
+        job->last_rv = rv;
+    }
+    
+    apr_thread_mutex_lock(wd->mutex);
+    --wd->running;
+    --(*job->ca_running);
+    apr_thread_cond_signal(wd->cond);
+    apr_thread_mutex_unlock(wd->mutex);
+    return NULL;
+}
+
+static apr_status_t start_workers(md_watchdog *wd)
+{
+    apr_allocator_t *allocator;
+    apr_thread_mutex_t *amutex;
+    apr_status_t rv;
+    
+    /* The thread pool creates and destroys its threads' pools in different
+     * threads, give it an allocator of its own that can handle that. */
+    wd->worker_pool = NULL;
+    if (APR_SUCCESS != (rv = apr_allocator_create(&allocator))) goto out;
+    if (APR_SUCCESS != (rv = apr_pool_create_ex(&wd->worker_pool, wd->p, NULL, allocator))) {
+        apr_allocator_destroy(allocator);
+        goto out;
+    }
+    apr_allocator_owner_set(allocator, wd->worker_pool);
+    apr_pool_tag(wd->worker_pool, "md_renew_workers");
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&amutex, APR_THREAD_MUTEX_DEFAULT, 
+                                                     wd->worker_pool))) goto out;
+    apr_allocator_mutex_set(allocator, amutex);
+    
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&wd->mutex, APR_THREAD_MUTEX_DEFAULT, 
+                                                     wd->worker_pool))) goto out;
+    if (APR_SUCCESS != (rv = apr_thread_cond_create(&wd->cond, wd->worker_pool))) goto out;
+    rv = apr_thread_pool_create(&wd->workers, 0, (apr_size_t)wd->mc->renew_concurrency, 
+                                wd->worker_pool);
+out:
+    if (APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, wd->s, APLOGNO(10118) 
+                     "md watchdog: unable to start %d renewal workers, "
+                     "renewing one domain at a time", wd->mc->renew_concurrency);
+        if (wd->worker_pool) {
+            apr_pool_destroy(wd->worker_pool);
+        }
+        wd->worker_pool = NULL;
+        wd->workers = NULL;
+    }
+    return rv;
+}
+
+static void stop_workers(md_watchdog *wd)
+{
+    if (wd->workers) {
+        apr_thread_pool_destroy(wd->workers);
+        apr_pool_destroy(wd->worker_pool);
+        wd->workers = NULL;
+        wd->worker_pool = NULL;
+    }
+}
+
+/* With MDPrivateKeyPool > 0, a thread keeps that many pre-generated private keys in the
+ * store for each key spec our MDs use. Renewals and challenges in this child, as well as
+ * fallback certificates set up at the next server restart, take their keys from there. */
+
+#define MD_KEYPOOL_CHECK_INTERVAL   apr_time_from_sec(5 * 60)
+
+static int keypool_stopping(md_watchdog *wd)
+{
+    int stop;
+    
+    apr_thread_mutex_lock(wd->kp_mutex);
+    stop = wd->kp_stop;
+    apr_thread_mutex_unlock(wd->kp_mutex);
+    return stop;
+}
+
+static void fill_keypool(md_watchdog *wd, md_store_t *store, apr_pool_t *ptemp)
+{
+    md_pkey_spec_t *spec;
+    apr_status_t rv;
+    int i, count;
+    
+    for (i = 0; i < wd->kp_specs->nelts && !keypool_stopping(wd); ++i) {
+        spec = APR_ARRAY_IDX(wd->kp_specs, i, md_pkey_spec_t*);
+        count = md_pkey_pool_count(store, spec, ptemp);
+        while (count < wd->mc->pkey_pool_size && !keypool_stopping(wd)) {
+            if (APR_SUCCESS != (rv = md_pkey_pool_add(store, spec, ptemp))) {
+                ap_log_error(APLOG_MARK, APLOG_WARNING, rv, wd->s, APLOGNO(10119) 
+                             "md key pool: unable to add a key");
+                break;
+            }
+            ++count;
+            apr_pool_clear(ptemp);
+        }
+        apr_pool_clear(ptemp);
+    }
+}
+
+static void * APR_THREAD_FUNC keypool_worker(apr_thread_t *thread, void *data)
+{
+    md_watchdog *wd = data;
+    apr_allocator_t *allocator;
+    apr_pool_t *ptemp;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS == (rv = apr_allocator_create(&allocator))) {
+        apr_allocator_max_free_set(allocator, ap_max_mem_free);
+        if (APR_SUCCESS == (rv = apr_pool_create_ex(&ptemp, NULL, NULL, allocator))) {
+            apr_allocator_owner_set(allocator, ptemp);
+            apr_pool_tag(ptemp, "md_keypool");
+            
+            while (!keypool_stopping(wd)) {
+                fill_keypool(wd, md_reg_store_get(wd->reg), ptemp);
+                
+                apr_thread_mutex_lock(wd->kp_mutex);
+                if (!wd->kp_stop) {
+                    apr_thread_cond_timedwait(wd->kp_cond, wd->kp_mutex, 
+                                              MD_KEYPOOL_CHECK_INTERVAL);
+                }
+                apr_thread_mutex_unlock(wd->kp_mutex);
+            }
+            apr_pool_destroy(ptemp);
+        }
+        else {
+            apr_allocator_destroy(allocator);
+        }
+    }
+    if (APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, wd->s, APLOGNO(10120) 
+                     "md key pool: unable to create pool");
+    }
+    apr_thread_exit(thread, rv);
+    return NULL;
+}
+
+static void keypool_add_spec(md_watchdog *wd, md_pkey_spec_t *spec)
+{
+    int i;
+    
+    for (i = 0; i < wd->kp_specs->nelts; ++i) {
+        if (md_pkey_spec_eq(spec, APR_ARRAY_IDX(wd->kp_specs, i, md_pkey_spec_t*))) {
+            return;
+        }
+    }
+    APR_ARRAY_PUSH(wd->kp_specs, md_pkey_spec_t*) = spec;
+}
+
+static void start_keypool(md_watchdog *wd)
+{
+    md_pkey_spec_t *spec;
+    md_job_t *job;
+    apr_status_t rv;
+    int i, j;
+    
+    /* Fallback certificates always use the default spec */
+    wd->kp_specs = apr_array_make(wd->p, 5, sizeof(md_pkey_spec_t*));
+    spec = apr_pcalloc(wd->p, sizeof(*spec));
+    spec->type = MD_PKEY_TYPE_DEFAULT;
+    APR_ARRAY_PUSH(wd->kp_specs, md_pkey_spec_t*) = spec;
+    for (i = 0; i < wd->jobs->nelts; ++i) {
+        job = APR_ARRAY_IDX(wd->jobs, i, md_job_t *);
+        if (job->md->pkey_spec) {
+            keypool_add_spec(wd, job->md->pkey_spec);
+        }
+        for (j = 0; job->md->alt_pkey_specs && j < job->md->alt_pkey_specs->nelts; ++j) {
+            keypool_add_spec(wd, APR_ARRAY_IDX(job->md->alt_pkey_specs, j, md_pkey_spec_t*));
+        }
+    }
+    
+    wd->kp_stop = 0;
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&wd->kp_mutex, APR_THREAD_MUTEX_DEFAULT, 
+                                                     wd->p))
+        || APR_SUCCESS != (rv = apr_thread_cond_create(&wd->kp_cond, wd->p))
+        || APR_SUCCESS != (rv = apr_thread_create(&wd->kp_thread, NULL, keypool_worker, 
+                                                  wd, wd->p))) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, wd->s, APLOGNO(10121) 
+                     "md key pool: unable to start thread, keys are generated when needed");
+        wd->kp_thread = NULL;
+    }
+}
+
+static void wake_keypool(md_watchdog *wd)
+{
+    if (wd->kp_thread) {
+        apr_thread_mutex_lock(wd->kp_mutex);
+        apr_thread_cond_signal(wd->kp_cond);
+        apr_thread_mutex_unlock(wd->kp_mutex);
+    }
+}
+
+static void stop_keypool(md_watchdog *wd)
+{
+    apr_status_t rv;
+    
+    if (wd->kp_thread) {
+        apr_thread_mutex_lock(wd->kp_mutex);
+        wd->kp_stop = 1;
+        apr_thread_cond_signal(wd->kp_cond);
+        apr_thread_mutex_unlock(wd->kp_mutex);
+        apr_thread_join(&rv, wd->kp_thread);
+        wd->kp_thread = NULL;
+    }
+}
+
+static void run_jobs_parallel(md_watchdog *wd, apr_array_header_t *jobs, apr_pool_t *ptemp)
+{
+    md_job_t *job;
+    int i, dispatched = 0, ca_max = wd->mc->renew_ca_concurrency;
+    apr_status_t rv;
+    
+    for (i = 0; i < jobs->nelts; ++i) {
+        job = APR_ARRAY_IDX(jobs, i, md_job_t *);
+        job->dispatched = 0;
+    }
+    
+    apr_thread_mutex_lock(wd->mutex);
+    while (dispatched < jobs->nelts || wd->running > 0) {
+        for (i = 0; i < jobs->nelts && wd->running < wd->mc->renew_concurrency; ++i) {
+            job = APR_ARRAY_IDX(jobs, i, md_job_t *);
+            if (job->dispatched || (ca_max > 0 && *job->ca_running >= ca_max)) {
+                continue;
+            }
+            job->dispatched = 1;
+            ++dispatched;
+            if (apr_time_now() < job->next_check) {
+                /* Job needs to wait, no need to bother a worker */
+                continue;
+            }
+            
+            ++wd->running;
+            ++(*job->ca_running);
+            rv = apr_thread_pool_push(wd->workers, renew_worker, job, 
+                                      APR_THREAD_TASK_PRIORITY_NORMAL, wd);
+            if (APR_SUCCESS != rv) {
+                --wd->running;
+                --(*job->ca_running);
+                ap_log_error(APLOG_MARK, APLOG_DEBUG, rv, wd->s, 
+                             "%s: no renewal worker available, checking in watchdog", 
+                             job->md->name);
+                apr_thread_mutex_unlock(wd->mutex);
+                check_job(wd, job, ptemp);
+                apr_thread_mutex_lock(wd->mutex);
+            }
+        }
+        if (dispatched < jobs->nelts || wd->running > 0) {
+            /* wait for a worker to finish */
+            apr_thread_cond_wait(wd->cond, wd->mutex);
+        }
+    }
+    apr_thread_mutex_unlock(wd->mutex);
+}
+
+#endif /* APR_HAS_THREADS */
+
+static apr_status_t hot_activate(md_watchdog *wd, md_job_t *job, apr_pool_t *ptemp)
+{
+    hot_creds_t *creds;
+    apr_pool_t *md_pool;
+    md_t *md;
+    apr_status_t rv;
+    
+    creds = apr_hash_get(hot_act->creds, job->md->name, APR_HASH_KEY_STRING);
+    if (!creds) {
+        return APR_ENOENT;
+    }
+    /* move the staged set into the domains directory, as a restart would do. Nothing
+     * is staged when another server sharing the store renewed and activated it. What
+     * is staged while another server holds the lease is its work in progress. */
+    if (wd->mc->lease_ttl > 0 
+        && APR_STATUS_IS_EBUSY(md_store_lease_check(md_reg_store_get(wd->reg), ptemp, 
+                                                    job->md->name, wd->mc->lease_owner))) {
+        rv = APR_ENOENT;
+    }
+    else {
+        rv = md_reg_load(wd->reg, job->md->name, wd->mc->env, ptemp);
+    }
+    if (APR_STATUS_IS_ENOENT(rv) && job_cert_mtime(wd, job, ptemp) > job->cert_mtime) {
+        rv = APR_SUCCESS;
+    }
+    if (APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, wd->s, APLOGNO(10130) 
+                     "%s: unable to activate renewed certificate, restart needed", 
+                     job->md->name);
+        return rv;
+    }
+    apr_atomic_inc32(&hot_act->generations[creds->idx]);
+    apr_atomic_inc32(hot_act->version);
+    
+    /* OCSP responses for the new certificates are fetched from here */
+    if (wd->mc->ocsp) {
+        prime_ocsp_md(wd->mc->ocsp, md_reg_store_get(wd->reg), job->md, wd->s, ptemp);
+    }
+    /* the job starts over with the new certificate. Each activation loads it into
+     * a pool of its own, dropping the one of the previous, so wd->p does not grow. */
+    if (APR_SUCCESS == apr_pool_create(&md_pool, wd->p)) {
+        apr_pool_tag(md_pool, "md_job");
+        if (NULL != (md = md_reg_get(wd->reg, job->md->name, md_pool))) {
+            job->md = md;
+            if (job->md_pool) apr_pool_destroy(job->md_pool);
+            job->md_pool = md_pool;
+        }
+        else {
+            apr_pool_destroy(md_pool);
+        }
+    }
+    job->renewed = 0;
+    job->renewal_notified = 0;
+    job->restart_at = 0;
+    job->need_restart = 0;
+    job->restart_processed = 0;
+    job->cert_mtime = job_cert_mtime(wd, job, ptemp);
+    save_job_props(wd->reg, job, ptemp);
+    job_flush_later(wd, job);
+    return APR_SUCCESS;
+}
+
+/* How long MDNotifyCmd may run before it is killed */
+#define NOTIFY_TIMEOUT          apr_time_from_sec(5 * 60)
+/* How often the watchdog looks at a running MDNotifyCmd */
+#define NOTIFY_POLL             apr_time_from_sec(1)
+
+static apr_status_t run_watchdog(int state, void *baton, apr_pool_t *ptemp);
+
+static void on_notify_done(void *baton, apr_status_t rv, int exit_code, const char *output)
+{
+    md_watchdog *wd = baton;
+    
+    if (APR_SUCCESS == rv) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, rv, wd->s, APLOGNO(10108) 
+                     "notify command '%s' returned %d", 
+                     wd->mc->notify_cmd, exit_code);
+        wd->notify_ok = 1;
+    }
+    else {
+        if (APR_EINCOMPLETE == rv && exit_code) {
+            rv = 0;
+        }
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, wd->s, APLOGNO(10109) 
+                     "executing MDNotifyCmd %s returned %d", 
+                      wd->mc->notify_cmd, exit_code);
+        wd->notify_ok = 0;
+    }
+    /* its output lines have been logged as they came in */
+    (void)output;
+}
+
+static void server_restart(md_watchdog *wd, const char *names, int n, apr_pool_t *ptemp)
+{
+    const char *action;
+    apr_status_t rv;
+    
+    /* the restarted server reads the state from the store */
+    flush_job_props(wd, ptemp);
+    
+    /* FIXME: the server needs to start gracefully to take the new certificate in.
+     * This poses a variety of problems to solve satisfactory for everyone:
+     * - I myself, have no implementation for Windows 
+     * - on *NIX, child processes run with less privileges, preventing
+     *   the signal based restart trigger to work
+     * - admins want better control of timing windows for restarts, e.g.
+     *   during less busy hours/days.
+     */
+    rv = md_server_graceful(ptemp, wd->s);
+    if (APR_ENOTIMPL == rv) {
+        /* self-graceful restart not supported in this setup */
+        action = " and changes will be activated on next (graceful) server restart.";
+    }
+    else {
+        action = " and server has been asked to restart now.";
+    }
+    ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, wd->s, APLOGNO(10059) 
+                 "The Managed Domain%s %s %s been setup%s",
+                 (n > 1)? "s" : "", names, (n > 1)? "have" : "has", action);
+}
+
+static int notify_start(md_watchdog *wd, const char *names, int restart, apr_pool_t *ptemp);
+
+static void notify_finish(md_watchdog *wd, apr_pool_t *ptemp)
+{
+    md_job_t *job;
+    const char *next;
+    int i;
+    
+    if (wd->notify_restart) {
+        /* Persist that we have notified for these MDs. This process might be reaped 
+         * after n requests or die of another cause. The one taking over the watchdog 
+         * need to notify again. */
+        for (i = 0; i < wd->notify_jobs->nelts; ++i) {
+            job = APR_ARRAY_IDX(wd->notify_jobs, i, md_job_t *);
+            if (wd->notify_ok) {
+                job->restart_processed = 1;
+                save_job_props(wd->reg, job, ptemp);
+                job_flush_later(wd, job);
+            }
+        }
+        if (!wd->notify_ok) {
+            /* try again on the next run */
+            wd->restart_pending = 1;
+        }
+        server_restart(wd, wd->notify_names, wd->notify_jobs->nelts, ptemp);
+    }
+    
+    wd->notify = NULL;
+    wd->notify_names = NULL;
+    wd->notify_jobs = NULL;
+    wd->notify_restart = 0;
+    if (wd->notify_pool) {
+        apr_pool_destroy(wd->notify_pool);
+        wd->notify_pool = NULL;
+    }
+    if (wd->notify_next) {
+        next = apr_array_pstrcat(ptemp, wd->notify_next, ' ');
+        wd->notify_next = NULL;
+        apr_pool_destroy(wd->notify_next_pool);
+        wd->notify_next_pool = NULL;
+        notify_start(wd, next, 0, ptemp);
+    }
+}
+
+/* Run MDNotifyCmd for the names in the background, the watchdog looks for it to finish
+ * while renewals go on. With restart, the MDs waiting for it are marked as processed 
+ * and the server is restarted once it is done. Returns 0 when another one is still 
+ * running. */
+static int notify_start(md_watchdog *wd, const char *names, int restart, apr_pool_t *ptemp)
+{
+    const char * const *argv;
+    const char *cmdline, *name;
+    char *list, *last;
+    md_job_t *job;
+    apr_status_t rv;
+    int i;
+    
+    if (wd->notify) {
+        if (restart) {
+            return 0;
+        }
+        /* MDs activated without restart are notified after this one, each once */
+        if (!wd->notify_next) {
+            if (APR_SUCCESS != apr_pool_create(&wd->notify_next_pool, wd->p)) {
+                wd->notify_next_pool = NULL;
+                return 1;
+            }
+            apr_pool_tag(wd->notify_next_pool, "md_notify_next");
+            wd->notify_next = apr_array_make(wd->notify_next_pool, 5, sizeof(const char*));
+        }
+        list = apr_pstrdup(ptemp, names);
+        for (name = apr_strtok(list, " ", &last); name; name = apr_strtok(NULL, " ", &last)) {
+            if (md_array_str_index(wd->notify_next, name, 0, 1) < 0) {
+                APR_ARRAY_PUSH(wd->notify_next, const char*) = 
+                    apr_pstrdup(wd->notify_next_pool, name);
+            }
+        }
+        return 1;
+    }
+    
+    if (APR_SUCCESS != (rv = apr_pool_create(&wd->notify_pool, wd->p))) {
+        wd->notify_pool = NULL;
+        return 0;
+    }
+    apr_pool_tag(wd->notify_pool, "md_notify");
+    wd->notify_names = apr_pstrdup(wd->notify_pool, names);
+    wd->notify_restart = restart;
+    wd->notify_jobs = apr_array_make(wd->notify_pool, 5, sizeof(md_job_t *));
+    for (i = 0; restart && i < wd->jobs->nelts; ++i) {
+        job = APR_ARRAY_IDX(wd->jobs, i, md_job_t *);
+        if (job->need_restart && !job->restart_processed) {
+            APR_ARRAY_PUSH(wd->notify_jobs, md_job_t *) = job;
+        }
+    }
+    
+    wd->notify_ok = 1;
+    if (wd->mc->notify_cmd) {
+        cmdline = apr_psprintf(wd->notify_pool, "%s %s", wd->mc->notify_cmd, names); 
+        apr_tokenize_to_argv(cmdline, (char***)&argv, wd->notify_pool);
+        rv = md_util_proc_start(&wd->notify, wd->notify_pool, argv[0], argv, 
+                                NOTIFY_TIMEOUT, on_notify_done, wd);
+        if (APR_SUCCESS == rv) {
+            wd_set_interval(wd->watchdog, NOTIFY_POLL, wd, run_watchdog);
+            return 1;
+        }
+        on_notify_done(wd, rv, 0, NULL);
+    }
+    notify_finish(wd, ptemp);
+    return 1;
+}
+
+static void notify_check(md_watchdog *wd, apr_pool_t *ptemp)
+{
+    if (wd->notify && !APR_STATUS_IS_EAGAIN(md_util_proc_poll(wd->notify))) {
+        notify_finish(wd, ptemp);
+    }
+}
+
+static apr_status_t run_watchdog(int state, void *baton, apr_pool_t *ptemp)
+{
+    md_watchdog *wd = baton;
+    md_job_t *job;
+    apr_array_header_t *due;
+    apr_time_t next_run, now;
+    int restart = 0;
+    int i;
+    
+    switch (state) {
+        case AP_WATCHDOG_STATE_STARTING:
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10054)
+                         "md watchdog start, auto drive %d mds", wd->jobs->nelts);
+            assert(wd->reg);
+        
+            /* pick up the state a previous watchdog had, that may change
+             * the order of the queue */
+            apr_array_clear(wd->queue);
+            for (i = 0; i < wd->jobs->nelts; ++i) {
+                job = APR_ARRAY_IDX(wd->jobs, i, md_job_t *);
+                load_job_props(wd->reg, job, ptemp);
+                queue_push(wd, job);
+            }
+#if APR_HAS_THREADS
+            if (wd->mc->renew_concurrency > 1 && wd->jobs->nelts > 1) {
+                start_workers(wd);
+            }
+            if (wd->mc->pkey_pool_size > 0) {
+                start_keypool(wd);
+            }
+#endif
+            break;
+        case AP_WATCHDOG_STATE_RUNNING:
+        
+            /* a notify command ran in the background since the last run */
+            notify_check(wd, ptemp);
+            
+            wd->next_change = 0;
+            now = apr_time_now();
+            due = apr_array_make(ptemp, 10, sizeof(md_job_t *));
+            while (NULL != (job = queue_pop_due(wd, now))) {
+                APR_ARRAY_PUSH(due, md_job_t *) = job;
+            }
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10055)
+                         "md watchdog run, %d of %d auto drive mds due", 
+                         due->nelts, wd->jobs->nelts);
+                         
+            /* normally, we'd like to run at least twice a day */
+            next_run = now + apr_time_from_sec(MD_SECS_PER_DAY / 2);
+
+            /* Check on the jobs that are due */
+#if APR_HAS_THREADS
+            if (wd->workers) {
+                run_jobs_parallel(wd, due, ptemp);
+            }
+            else 
+#endif
+            {
+                for (i = 0; i < due->nelts; ++i) {
+                    job = APR_ARRAY_IDX(due, i, md_job_t *);
+                    check_job(wd, job, ptemp);
+                }
+            }
+            
+            /* Collect the results, so that all renewed MDs get activated together,
+             * and queue the jobs again for their next check. */
+            now = apr_time_now();
+            for (i = 0; i < due->nelts; ++i) {
+                job = APR_ARRAY_IDX(due, i, md_job_t *);
+                
+                if (job->need_restart && !job->restart_processed) {
+                    wd->restart_pending = 1;
+                }
+                job_schedule(job, now);
+                queue_push(wd, job);
+                if (job->slot) {
+                    job_slot_write(job);
+                }
+                job_flush_later(wd, job);
+            }
+            if (wd->flush_at) {
+                if (now >= wd->flush_at) {
+                    flush_job_props(wd, ptemp);
+                }
+                else if (wd->flush_at < next_run) {
+                    next_run = wd->flush_at;
+                }
+            }
+            if (wd->queue->nelts > 0) {
+                job = APR_ARRAY_IDX(wd->queue, 0, md_job_t *);
+                if (job->next_check < next_run) {
+                    next_run = job->next_check;
+                }
+            }
+            restart = wd->restart_pending;
+#if APR_HAS_THREADS
+            /* renewals may have used keys from the pool */
+            wake_keypool(wd);
+#endif
+
+            /* MDs renewed shortly after another one are activated together, in 
+             * the configured daily window, to have only one restart. */
+            if (restart) {
+                now = apr_time_now();
+                if (!wd->activate_at) {
+                    wd->activate_at = md_time_window_next(now + wd->mc->activation_delay, 
+                                                          wd->mc->activation_start, 
+                                                          wd->mc->activation_end);
+                }
+                if (now < wd->activate_at) {
+                    restart = 0;
+                    if (wd->activate_at < next_run) {
+                        next_run = wd->activate_at;
+                    }
+                    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10133)
+                                 "activation of renewed MDs in %s", 
+                                 md_print_duration(ptemp, wd->activate_at - now));
+                }
+                else {
+                    wd->activate_at = 0;
+                }
+            }
+            
+            /* Keep the OCSP responses of our certificates fresh */
+            if (md_ocsp_count(wd->mc->ocsp) > 0) {
+                apr_time_t ocsp_next_run;
+                
+                md_ocsp_renew(wd->mc->ocsp, ptemp, &ocsp_next_run);
+                if (ocsp_next_run < next_run) {
+                    next_run = ocsp_next_run;
+                }
+            }
+
+            now = apr_time_now();
+            if (wd->notify && now + NOTIFY_POLL < next_run) {
+                next_run = now + NOTIFY_POLL;
+            }
+            if (APLOGdebug(wd->s)) {
+                ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10107)
+                             "next run in %s", md_print_duration(ptemp, next_run - now));
+            }
+            wd_set_interval(wd->watchdog, next_run - now, wd, run_watchdog);
+            break;
+            
+        case AP_WATCHDOG_STATE_STOPPING:
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10058)
+                         "md watchdog stopping");
+            flush_job_props(wd, ptemp);
+#if APR_HAS_THREADS
+            stop_keypool(wd);
+            stop_workers(wd);
+#endif
+            break;
+    }
+
+    if (restart && hot_act) {
+        const char *names = "";
+        int n;
+        
+        /* Activate the renewed certificates right here, the ones that fail to
+         * activate still need a restart. */
+        restart = 0;
+        wd->restart_pending = 0;
+        for (i = 0, n = 0; i < wd->jobs->nelts; ++i) {
+            job = APR_ARRAY_IDX(wd->jobs, i, md_job_t *);
+            if (job->need_restart && !job->restart_processed) {
+                if (APR_SUCCESS == hot_activate(wd, job, ptemp)) {
+                    names = apr_psprintf(ptemp, "%s%s%s", names, n? " " : "", job->md->name);
+                    ++n;
+                }
+                else {
+                    restart = 1;
+                }
+            }
+        }
+        if (n > 0) {
+            notify_start(wd, names, 0, ptemp);
+            ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, wd->s, APLOGNO(10127) 
+                         "The Managed Domain%s %s %s been activated without restart",
+                         (n > 1)? "s" : "", names, (n > 1)? "have" : "has");
+        }
+    }
+
+    if (restart) {
+        const char *names = "";
+        int n;
+        
+        wd->restart_pending = 0;
+        for (i = 0, n = 0; i < wd->jobs->nelts; ++i) {
+            job = APR_ARRAY_IDX(wd->jobs, i, md_job_t *);
+            if (job->need_restart && !job->restart_processed) {
+                names = apr_psprintf(ptemp, "%s%s%s", names, n? " " : "", job->md->name);
+                ++n;
+            }
+        }
+
+        /* Run notify command for ready MDs (if configured), the server restarts when
+         * it is done. */
+        if (n > 0 && !notify_start(wd, names, 1, ptemp)) {
+            /* another one is still running, try again later */
+            wd->restart_pending = 1;
+        }
+    }
+    
+    return APR_SUCCESS;
+}
+
+/**************************************************************************************************/
+/* startup timeline */
+
+/* How long the phases of post_config take and which MDs took longest, logged when
+ * it is done. Work on each MD that does not depend on other MDs is done by several
+ * threads, all of them gone again before children are forked. */
+
+#define MD_STARTUP_WORKERS      8
+#define MD_STARTUP_SLOWEST      5
+
+typedef struct {
+    const char *name;
+    apr_interval_time_t duration;
+} md_startup_time_t;
+
+struct md_startup_t {
+    apr_pool_t *p;
+    apr_time_t start;                /* of post_config */
+    apr_time_t phase_start;          /* of the current phase */
+    apr_array_header_t *phases;      /* md_startup_time_t of the phases done */
+    apr_hash_t *md_times;            /* MD name -> apr_interval_time_t spent on it */
+};
+
+static void startup_init(md_startup_t *st, apr_pool_t *p)
+{
+    st->p = p;
+    st->start = st->phase_start = apr_time_now();
+    st->phases = apr_array_make(p, 10, sizeof(md_startup_time_t));
+    st->md_times = apr_hash_make(p);
+}
+
+static void startup_phase_done(md_startup_t *st, const char *phase)
+{
+    md_startup_time_t *t;
+    apr_time_t now = apr_time_now();
+    
+    t = apr_array_push(st->phases);
+    t->name = phase;
+    t->duration = now - st->phase_start;
+    st->phase_start = now;
+}
+
+static void startup_log(md_startup_t *st, server_rec *s)
+{
+    md_startup_time_t slowest[MD_STARTUP_SLOWEST], *t;
+    apr_hash_index_t *hi;
+    const void *name;
+    void *val;
+    apr_interval_time_t d;
+    const char *phases = "", *mds = "";
+    int i, n = 0;
+    
+    for (i = 0; i < st->phases->nelts; ++i) {
+        t = &APR_ARRAY_IDX(st->phases, i, md_startup_time_t);
+        phases = apr_psprintf(st->p, "%s%s%s %ld ms", phases, i? ", " : "", 
+                              t->name, (long)apr_time_as_msec(t->duration));
+    }
+    /* keep the longest, sorted by duration */
+    for (hi = apr_hash_first(st->p, st->md_times); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, &name, NULL, &val);
+        d = *(apr_interval_time_t*)val;
+        for (i = n; i > 0 && slowest[i-1].duration < d; --i) {
+            if (i < MD_STARTUP_SLOWEST) slowest[i] = slowest[i-1];
+        }
+        if (i < MD_STARTUP_SLOWEST) {
+            slowest[i].name = name;
+            slowest[i].duration = d;
+            if (n < MD_STARTUP_SLOWEST) ++n;
+        }
+    }
+    for (i = 0; i < n; ++i) {
+        mds = apr_psprintf(st->p, "%s%s%s %ld ms", mds, i? ", " : "; slowest MDs: ", 
+                           slowest[i].name, (long)apr_time_as_msec(slowest[i].duration));
+    }
+    ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s, APLOGNO(10154)
+                 "startup took %ld ms: %s%s", 
+                 (long)apr_time_as_msec(apr_time_now() - st->start), phases, mds);
+}
+
+typedef void md_startup_fn(void *baton, const char *name, apr_pool_t *ptemp);
+
+typedef struct {
+    md_startup_t *st;
+    apr_array_header_t *names;
+    md_startup_fn *fn;
+    void *baton;
+    int next;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+} md_startup_work_t;
+
+/* Account for the MD done, if any, and get the name of the next one or NULL. */
+static const char *startup_next(md_startup_work_t *w, const char *done, 
+                                apr_interval_time_t duration)
+{
+    apr_interval_time_t *pd;
+    const char *name = NULL;
+    
+#if APR_HAS_THREADS
+    if (w->mutex) apr_thread_mutex_lock(w->mutex);
+#endif
+    if (done) {
+        if (!(pd = apr_hash_get(w->st->md_times, done, APR_HASH_KEY_STRING))) {
+            pd = apr_pcalloc(w->st->p, sizeof(*pd));
+            apr_hash_set(w->st->md_times, done, APR_HASH_KEY_STRING, pd);
+        }
+        *pd += duration;
+    }
+    if (w->next < w->names->nelts) {
+        name = APR_ARRAY_IDX(w->names, w->next++, const char *);
+    }
+#if APR_HAS_THREADS
+    if (w->mutex) apr_thread_mutex_unlock(w->mutex);
+#endif
+    return name;
+}
+
+static void startup_run(md_startup_work_t *w, apr_pool_t *ptemp)
+{
+    const char *name;
+    apr_time_t start;
+    
+    name = startup_next(w, NULL, 0);
+    while (name) {
+        start = apr_time_now();
+        w->fn(w->baton, name, ptemp);
+        apr_pool_clear(ptemp);
+        name = startup_next(w, name, apr_time_now() - start);
+    }
+}
+
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC startup_worker(apr_thread_t *thread, void *data)
+{
+    md_startup_work_t *w = data;
+    apr_allocator_t *allocator;
+    apr_pool_t *ptemp;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS == (rv = apr_allocator_create(&allocator))) {
+        if (APR_SUCCESS == (rv = apr_pool_create_ex(&ptemp, NULL, NULL, allocator))) {
+            apr_allocator_owner_set(allocator, ptemp);
+            apr_pool_tag(ptemp, "md_startup");
+            startup_run(w, ptemp);
+            apr_pool_destroy(ptemp);
+        }
+        else {
+            apr_allocator_destroy(allocator);
+        }
+    }
+    apr_thread_exit(thread, rv);
+    return NULL;
+}
+#endif
+
+/* Call fn for each of the MD names, on several threads where the crypto library 
+ * allows, and return when all are done. fn must only touch the MD it is called for
+ * and allocate from the pool it is given. */
+static void startup_each_md(md_startup_t *st, apr_array_header_t *names, 
+                            md_startup_fn *fn, void *baton, apr_pool_t *p)
+{
+    md_startup_work_t w;
+    apr_pool_t *ptemp;
+#if APR_HAS_THREADS
+    apr_thread_t *threads[MD_STARTUP_WORKERS];
+    apr_status_t trv;
+    int i, n = 0;
+#endif
+    
+    memset(&w, 0, sizeof(w));
+    w.st = st;
+    w.names = names;
+    w.fn = fn;
+    w.baton = baton;
+#if APR_HAS_THREADS
+    if (names->nelts > 1 && md_crypt_is_threadsafe()
+        && APR_SUCCESS == apr_thread_mutex_create(&w.mutex, APR_THREAD_MUTEX_DEFAULT, p)) {
+        for (n = 0; n < MD_STARTUP_WORKERS && n < names->nelts; ++n) {
+            if (APR_SUCCESS != apr_thread_create(&threads[n], NULL, startup_worker, &w, p)) {
+                break;
+            }
+        }
+        for (i = 0; i < n; ++i) {
+            apr_thread_join(&trv, threads[i]);
+        }
+    }
+#endif
+    /* whatever the workers did not do (or if there were none) */
+    if (APR_SUCCESS == apr_pool_create(&ptemp, p)) {
+        startup_run(&w, ptemp);
+        apr_pool_destroy(ptemp);
+    }
+}
+
+/**************************************************************************************************/
+/* watchdog startup */
+
+/* Load the MD, so that its state is in the registry's cache when the watchdog
+ * sets up its jobs. That is the costly part, it parses the credentials. */
+static void warm_md_state(void *baton, const char *name, apr_pool_t *ptemp)
+{
+    md_reg_get(baton, name, ptemp);
+}
+
+static apr_status_t start_watchdog(apr_array_header_t *names, apr_pool_t *p, 
+                                   md_reg_t *reg, server_rec *s, md_mod_conf_t *mc,
+                                   md_startup_t *st)
+{
+    apr_allocator_t *allocator;
+    md_watchdog *wd;
+    apr_pool_t *wdp;
+    apr_status_t rv;
+    const char *name;
+    md_t *md;
+    md_job_t *job;
+    int i, errored, renew;
+    
+    wd_get_instance = APR_RETRIEVE_OPTIONAL_FN(ap_watchdog_get_instance);
+    wd_register_callback = APR_RETRIEVE_OPTIONAL_FN(ap_watchdog_register_callback);
+    wd_set_interval = APR_RETRIEVE_OPTIONAL_FN(ap_watchdog_set_callback_interval);
+    
+    if (!wd_get_instance || !wd_register_callback || !wd_set_interval) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, 0, s, APLOGNO(10061) "mod_watchdog is required");
+        return !OK;
+    }
+    
+    /* We want our own pool with own allocator to keep data across watchdog invocations */
+    apr_allocator_create(&allocator);
+    apr_allocator_max_free_set(allocator, ap_max_mem_free);
+    rv = apr_pool_create_ex(&wdp, p, NULL, allocator);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10062) "md_watchdog: create pool");
+        return rv;
+    }
+    apr_allocator_owner_set(allocator, wdp);
+    apr_pool_tag(wdp, "md_watchdog");
+
+    wd = apr_pcalloc(wdp, sizeof(*wd));
+    wd->p = wdp;
+    wd->reg = reg;
+    wd->s = s;
+    wd->mc = mc;
+    
+    wd->jobs = apr_array_make(wd->p, 10, sizeof(md_job_t *));
+    wd->queue = apr_array_make(wd->p, names->nelts + 1, sizeof(md_job_t *));
+    wd->flush = apr_array_make(wd->p, 10, sizeof(md_job_t *));
+    wd->ca_running = apr_hash_make(wd->p);
+    startup_each_md(st, names, warm_md_state, reg, p);
+    for (i = 0; i < names->nelts; ++i) {
+        name = APR_ARRAY_IDX(names, i, const char *);
+        md = md_reg_get(wd->reg, name, wd->p);
+        if (md) {
+            md_reg_assess(wd->reg, md, &errored, &renew, wd->p);
+            if (errored) {
+                ap_log_error( APLOG_MARK, APLOG_WARNING, 0, wd->s, APLOGNO(10063) 
+                             "md(%s): seems errored. Will not process this any further.", name);
+            }
+            else {
+                const char *ca_url = md->ca_url? md->ca_url : "";
+                
+                job = apr_pcalloc(wd->p, sizeof(*job));
+                
+                job->md = md;
+                job->wd = wd;
+                job->ca_running = apr_hash_get(wd->ca_running, ca_url, APR_HASH_KEY_STRING);
+                if (!job->ca_running) {
+                    job->ca_running = apr_pcalloc(wd->p, sizeof(int));
+                    apr_hash_set(wd->ca_running, ca_url, APR_HASH_KEY_STRING, job->ca_running);
+                }
+                job->slot = job_slot_get(md->name);
+                job->cert_mtime = job_cert_mtime(wd, job, wd->p);
+                APR_ARRAY_PUSH(wd->jobs, md_job_t*) = job;
+
+                ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO(10064) 
+                             "md(%s): state=%d, driving", name, md->state);
+                
+                load_job_props(reg, job, wd->p);
+                queue_push(wd, job);
+                if (job->error_runs) {
+                    /* We are just restarting. If we encounter jobs that had errors
+                     * running the protocol on previous staging runs, we reset
+                     * the staging area for it, in case we persisted something that
+                     * causes a loop. */
+                    md_store_t *store = md_reg_store_get(wd->reg);
+                    
+                    md_store_purge(store, p, MD_SG_STAGING, job->md->name);
+                    md_store_purge(store, p, MD_SG_CHALLENGES, job->md->name);
+                }
+            }
+        }
+    }
+
+    if (!wd->jobs->nelts && !md_ocsp_count(mc->ocsp)) {
+        ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(10065)
+                     "no managed domain in state to drive, no watchdog needed, "
+                     "will check again on next server (graceful) restart");
+        apr_pool_destroy(wd->p);
+        return APR_SUCCESS;
+    }
+    
+    if (APR_SUCCESS != (rv = wd_get_instance(&wd->watchdog, MD_WATCHDOG_NAME, 0, 1, wd->p))) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(10066) 
+                     "create md watchdog(%s)", MD_WATCHDOG_NAME);
+        return rv;
+    }
+    rv = wd_register_callback(wd->watchdog, 0, wd, run_watchdog);
+    ap_log_error(APLOG_MARK, rv? APLOG_CRIT : APLOG_DEBUG, rv, s, APLOGNO(10067) 
+                 "register md watchdog(%s)", MD_WATCHDOG_NAME);
+    return rv;
+}
+ 
+typedef struct {
+    md_reg_t *reg;
+    server_rec *s;
+    md_mod_conf_t *mc;
+} stage_ctx;
+
+static void load_stage_set(void *baton, const char *name, apr_pool_t *ptemp)
+{
+    stage_ctx *ctx = baton;
+    apr_status_t rv;
+    
+    if (ctx->mc->lease_ttl > 0 
+        && APR_STATUS_IS_EBUSY(md_store_lease_check(md_reg_store_get(ctx->reg), ptemp, 
+                                                    name, ctx->mc->lease_owner))) {
+        /* another server renews it and is not done yet */
+        ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, ctx->s, 
+                     "%s: staged set belongs to the holder of the renewal lease", name);
+        return;
+    }
+    if (APR_SUCCESS == (rv = md_reg_load(ctx->reg, name, ctx->mc->env, ptemp))) {
+        ap_log_error( APLOG_MARK, APLOG_INFO, rv, ctx->s, APLOGNO(10068) 
+                     "%s: staged set activated", name);
+    }
+    else if (!APR_STATUS_IS_ENOENT(rv)) {
+        ap_log_error( APLOG_MARK, APLOG_ERR, rv, ctx->s, APLOGNO(10069)
+                     "%s: error loading staged set", name);
+    }
+}
+
+static void load_stage_sets(apr_array_header_t *names, apr_pool_t *p, 
+                            md_reg_t *reg, server_rec *s, md_mod_conf_t *mc, 
+                            md_startup_t *st)
+{
+    stage_ctx ctx;
+    
+    ctx.reg = reg;
+    ctx.s = s;
+    ctx.mc = mc;
+    startup_each_md(st, names, load_stage_set, &ctx, p);
+}
+
+static apr_status_t init_ocsp(md_mod_conf_t *mc, md_reg_t *reg, server_rec *s, apr_pool_t *p)
+{
+    md_store_t *store = md_reg_store_get(reg);
+    apr_status_t rv;
+    int i;
+    
+    rv = md_ocsp_reg_make(&mc->ocsp, p, store, 
+                          apr_psprintf(p, "%s mod_md/%s", AP_SERVER_BASEVERSION, MOD_MD_VERSION), 
+                          mc->proxy_url);
+    if (APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10125) "setup ocsp registry");
+        return rv;
+    }
+    for (i = 0; i < mc->mds->nelts; ++i) {
+        prime_ocsp_md(mc->ocsp, store, APR_ARRAY_IDX(mc->mds, i, const md_t *), s, p);
+    }
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(10126)
+                 "%d managed certificates primed for OCSP stapling", md_ocsp_count(mc->ocsp));
+    return APR_SUCCESS;
+}
+
+static apr_status_t md_post_config(apr_pool_t *p, apr_pool_t *plog,
+                                   apr_pool_t *ptemp, server_rec *s)
+{
+    void *data = NULL;
+    const char *mod_md_init_key = "mod_md_init_counter";
+    md_srv_conf_t *sc;
+    md_mod_conf_t *mc;
+    md_reg_t *reg;
+    const md_t *md;
+    apr_array_header_t *drive_names;
+    md_startup_t st;
+    apr_status_t rv = APR_SUCCESS;
+    int i, dry_run = 0;
+
+    startup_init(&st, ptemp);
+    apr_pool_userdata_get(&data, mod_md_init_key, s->process->pool);
+    if (data == NULL) {
+        /* At the first start, httpd makes a config check dry run. It
+         * runs all config hooks to check if it can. If so, it does
+         * this all again and starts serving requests.
+         * 
+         * This is known.
+         *
+         * On a dry run, we therefore do all the cheap config things we
+         * need to do. Because otherwise mod_ssl fails because it calls
+         * us unprepared.
+         * But synching our configuration with the md store
+         * and determining which domains to drive and start a watchdog
+         * and all that, we do not.
+         */
+        ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(10070)
+                     "initializing post config dry run");
+        apr_pool_userdata_set((const void *)1, mod_md_init_key,
+                              apr_pool_cleanup_null, s->process->pool);
+        dry_run = 1;
+    }
+    else {
+        ap_log_error( APLOG_MARK, APLOG_INFO, 0, s, APLOGNO(10071)
+                     "mod_md (v%s), initializing...", MOD_MD_VERSION);
+    }
+
+    (void)plog;
+    init_setups(p, s);
+    md_log_set(log_is_level, log_print, NULL);
+
+    /* Check uniqueness of MDs, calculate global, configured MD list.
+     * If successful, we have a list of MD definitions that do not overlap. */
+    /* We also need to find out if we can be reached on 80/443 from the outside (e.g. the CA) */
+    if (APR_SUCCESS != (rv =  md_calc_md_list(p, plog, ptemp, s))) {
+        return rv;
+    }
+    startup_phase_done(&st, "md list");
+
+    md_config_post_config(s, p);
+    sc = md_config_get(s);
+    mc = sc->mc;
+    md_trace_init(p, (apr_size_t)mc->trace_records);
+    md_log_ring_init(p, (apr_size_t)mc->trace_log_records, (md_log_level_t)mc->trace_log_level);
+
+    /* Synchronize the definitions we now have with the store via a registry (reg). */
+    if (APR_SUCCESS != (rv = setup_reg(&reg, p, s, mc->can_http, mc->can_https))) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10072)
+                     "setup md registry");
+        goto out;
+    }
+    
+    if (APR_SUCCESS != (rv = md_reg_sync(reg, p, ptemp, mc->mds))) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10073)
+                     "synching %d mds to registry", mc->mds->nelts);
+    }
+    startup_phase_done(&st, "sync");
+    
+    /* Determine the managed domains that are in auto drive_mode. For those,
+     * determine in which state they are:
+     *  - UNKNOWN:            should not happen, report, don't drive
+     *  - ERROR:              something we do not know how to fix, report, don't drive
+     *  - INCOMPLETE/EXPIRED: need to drive them right away
+     *  - COMPLETE:           determine when cert expires, drive when the time comes
+     *
+     * Start the watchdog if we have anything, now or in the future.
+     */
+    drive_names = apr_array_make(ptemp, mc->mds->nelts+1, sizeof(const char *));
+    for (i = 0; i < mc->mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(mc->mds, i, const md_t *);
+        switch (md->drive_mode) {
+            case MD_DRIVE_AUTO:
+                if (md_array_str_index(mc->unused_names, md->name, 0, 0) >= 0) {
+                    break;
+                }
+                /* fall through */
+            case MD_DRIVE_ALWAYS:
+                APR_ARRAY_PUSH(drive_names, const char *) = md->name; 
+                break;
+            default:
+                /* leave out */
+                break;
+        }
+    }
+    
+    init_ssl();
+    
+    if (mc->fallback_shared) {
+        prepare_fallbacks(mc, reg, s, &st, p);
+        startup_phase_done(&st, "fallbacks");
+    }
+    md_acme_rl_configure(mc->ca_limits);
+    
+    if (dry_run) {
+        goto out;
+    }
+    
+    /* Activate newly staged certificates first, so that we fetch OCSP 
+     * responses for the ones we are going to use. */
+    if (drive_names->nelts > 0) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, rv, s, APLOGNO(10074)
+                     "%d out of %d mds are configured for auto-drive", 
+                     drive_names->nelts, mc->mds->nelts);
+        load_stage_sets(drive_names, p, reg, s, mc, &st);
+        startup_phase_done(&st, "staged sets");
+    }
+    if (mc->stapling) {
+        init_ocsp(mc, reg, s, p);
+        startup_phase_done(&st, "ocsp");
+    }
+    init_job_slots(mc, s, p);
+    hot_act = NULL;
+    if (mc->hot_activation) {
+        init_hot_activation(mc, reg, s, p);
+        startup_phase_done(&st, "hot activation");
+    }
+    
+    /* If there are MDs to drive or responses to fetch, start a watchdog 
+     * to check on them regularly */
+    if (drive_names->nelts > 0 || md_ocsp_count(mc->ocsp) > 0) {
+        md_http_use_implementation(md_curl_get_multi_impl(p));
+        rv = start_watchdog(drive_names, p, reg, s, mc, &st);
+        startup_phase_done(&st, "watchdog");
+    }
+    else {
+        ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(10075)
+                     "no mds to auto drive, no watchdog needed");
+    }
+    startup_log(&st, s);
+    
+out:
+    return rv;
+}
+
+/**************************************************************************************************/
+/* Access API to other httpd components */
+
+static int md_is_managed(server_rec *s)
+{
+    md_srv_conf_t *conf = md_config_get(s);
+
+    if (conf && conf->assigned) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(10076) 
+                     "%s: manages server %s", conf->assigned->name, s->server_hostname);
+        return 1;
+    }
+    ap_log_error(APLOG_MARK, APLOG_TRACE1, 0, s,  
+                 "server %s is not managed", s->server_hostname);
+    return 0;
+}
+
+static apr_status_t setup_fallback_cert(md_store_t *store, md_pkey_t *shared_pkey, 
+                                        const md_t *md, server_rec *s, apr_pool_t *p)
+{
+    md_pkey_t *pkey = shared_pkey;
+    md_cert_t *cert;
+    md_pkey_spec_t spec;
+    apr_status_t rv = APR_SUCCESS;
+    MD_CHK_VARS;
+    
+    spec.type = MD_PKEY_TYPE_RSA;
+    spec.params.rsa.bits = MD_PKEY_RSA_BITS_DEF;
+    
+    if (   (!pkey && !MD_OK(md_pkey_pool_gen(&pkey, store, &spec, p)))
+        || !MD_OK(md_store_save(store, p, MD_SG_DOMAINS, md->name, 
+                                MD_FN_FALLBACK_PKEY, MD_SV_PKEY, (void*)pkey, 0))
+        || !MD_OK(md_cert_self_sign(&cert, "Apache Managed Domain Fallback", 
+                                    md->domains, pkey, apr_time_from_sec(14 * MD_SECS_PER_DAY), p))
+        || !MD_OK(md_store_save(store, p, MD_SG_DOMAINS, md->name, 
+                                MD_FN_FALLBACK_CERT, MD_SV_CERT, (void*)cert, 0))) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,  
+                     "%s: setup fallback certificate, call %s", md->name, MD_LAST_CHK);
+    }
+    return rv;
+}
+
+static int fexists(const char *fname, apr_pool_t *p)
+{
+    return (*fname && APR_SUCCESS == md_util_is_file(fname, p));
+}
+
+/* Does the MD have neither credentials nor fallback files? */
+static int needs_fallback(md_reg_t *reg, const md_t *md, apr_pool_t *p)
+{
+    md_store_t *store = md_reg_store_get(reg);
+    const char *keyfile, *certfile;
+    
+    if (APR_SUCCESS == md_reg_get_cred_files(reg, md, p, &keyfile, &certfile)
+        && fexists(keyfile, p) && fexists(certfile, p)) {
+        return 0;
+    }
+    md_store_get_fname(&keyfile, store, MD_SG_DOMAINS, md->name, MD_FN_FALLBACK_PKEY, p);
+    md_store_get_fname(&certfile, store, MD_SG_DOMAINS, md->name, MD_FN_FALLBACK_CERT, p);
+    return !fexists(keyfile, p) || !fexists(certfile, p);
+}
+
+typedef struct {
+    md_store_t *store;
+    md_pkey_t *pkey;
+    server_rec *s;
+    apr_hash_t *mds;                 /* name -> md_t* of the MDs needing a fallback */
+} fallback_ctx;
+
+static void fallback_md(void *baton, const char *name, apr_pool_t *ptemp)
+{
+    fallback_ctx *ctx = baton;
+    
+    setup_fallback_cert(ctx->store, ctx->pkey, 
+                        apr_hash_get(ctx->mds, name, APR_HASH_KEY_STRING), ctx->s, ptemp);
+}
+
+/* With a shared fallback key, creating a fallback certificate costs only a signature.
+ * Do this for all MDs that need one before mod_ssl asks for them, on several threads
+ * where the crypto library allows.  */
+static void prepare_fallbacks(md_mod_conf_t *mc, md_reg_t *reg, server_rec *s, 
+                              md_startup_t *st, apr_pool_t *p)
+{
+    fallback_ctx ctx;
+    apr_array_header_t *names;
+    const md_t *md;
+    apr_status_t rv;
+    int i;
+    
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.store = md_reg_store_get(reg);
+    ctx.s = s;
+    ctx.mds = apr_hash_make(p);
+    names = apr_array_make(p, 10, sizeof(const char *));
+    for (i = 0; i < mc->mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(mc->mds, i, const md_t *);
+        if (md_array_str_index(mc->unused_names, md->name, 0, 0) >= 0
+            || !(md = md_reg_get(reg, md->name, p))) {
+            continue;
+        }
+        if (needs_fallback(reg, md, p)) {
+            apr_hash_set(ctx.mds, md->name, APR_HASH_KEY_STRING, md);
+            APR_ARRAY_PUSH(names, const char *) = md->name;
+        }
+    }
+    if (names->nelts <= 0) {
+        return;
+    }
+    
+    if (APR_SUCCESS != (rv = md_pkey_pool_gen(&mc->fallback_pkey, ctx.store, 
+                                              mc->fallback_pkey_spec, p))) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(10122) 
+                     "unable to create shared fallback key, using individual keys");
+        mc->fallback_pkey = NULL;
+        return;
+    }
+    ctx.pkey = mc->fallback_pkey;
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(10123) 
+                 "creating %d fallback certificates with a shared key", names->nelts);
+    startup_each_md(st, names, fallback_md, &ctx, p);
+}
+
+/* Get the primary key/certificate for server s. When these are the real files of
+ * the MD and not a fallback, *pmd is set to the MD. */
+static apr_status_t get_certificate(server_rec *s, apr_pool_t *p,
+                                    const char **pkeyfile, const char **pcertfile, 
+                                    const md_t **pmd)
+{
+    apr_status_t rv = APR_ENOENT;    
+    md_srv_conf_t *sc;
+    md_reg_t *reg;
+    md_store_t *store;
+    const md_t *md;
+    MD_CHK_VARS;
+    
+    *pkeyfile = NULL;
+    *pcertfile = NULL;
+    *pmd = NULL;
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(10113)
+                 "md_get_certificate called for vhost %s.", s->server_hostname);
+
+    sc = md_config_get(s);
+    if (!sc) {
+        ap_log_error(APLOG_MARK, APLOG_TRACE1, 0, s,  
+                     "asked for certificate of server %s which has no md config", 
+                     s->server_hostname);
+        return APR_ENOENT;
+    }
+    
+    if (!sc->assigned) {
+        /* Hmm, mod_ssl (or someone like it) asks for certificates for a server
+         * where we did not assign a MD to. Either the user forgot to configure
+         * that server with SSL certs, has misspelled a server name or we have
+         * a bug that prevented us from taking responsibility for this server.
+         * Either way, make some polite noise */
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s, APLOGNO(10114)  
+                     "asked for certificate of server %s which has no MD assigned. This "
+                     "could be ok, but most likely it is either a misconfiguration or "
+                     "a bug. Please check server names and MD names carefully and if "
+                     "everything checks open, please open an issue.", 
+                     s->server_hostname);
+        return APR_ENOENT;
+    }
+    
+    assert(sc->mc);
+    reg = sc->mc->reg;
+    assert(reg);
+    
+    md = md_reg_get(reg, sc->assigned->name, p);
+    if (!md) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, APLOGNO(10115) 
+                     "unable to hand out certificates, as registry can no longer "
+                     "find MD '%s'.", sc->assigned->name);
+        return APR_ENOENT;
+    }
+    
+    if (!MD_OK(md_reg_get_cred_files(reg, md, p, pkeyfile, pcertfile))) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10110) 
+                     "retrieving credentials for MD %s", md->name);
+        return rv;
+    }
+    
+    if (!fexists(*pkeyfile, p) || !fexists(*pcertfile, p)) { 
+        /* Provide temporary, self-signed certificate as fallback, so that
+         * clients do not get obscure TLS handshake errors or will see a fallback
+         * virtual host that is not intended to be served here. */
+        store = md_reg_store_get(reg);
+        assert(store);    
+        
+        md_store_get_fname(pkeyfile, store, MD_SG_DOMAINS, 
+                           md->name, MD_FN_FALLBACK_PKEY, p);
+        md_store_get_fname(pcertfile, store, MD_SG_DOMAINS, 
+                           md->name, MD_FN_FALLBACK_CERT, p);
+        if (!fexists(*pkeyfile, p) || !fexists(*pcertfile, p)) { 
+            if (!MD_OK(setup_fallback_cert(store, sc->mc->fallback_pkey, md, s, p))) {
+                return rv;
             }
         }
-    }
-
-    if (!wd->jobs->nelts) {
-        ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(10065)
-                     "no managed domain in state to drive, no watchdog needed, "
-                     "will check again on next server (graceful) restart");
-        apr_pool_destroy(wd->p);
-        return APR_SUCCESS;
+        
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(10116)  
+                     "%s: providing fallback certificate for server %s", 
+                     md->name, s->server_hostname);
+        return APR_EAGAIN;
     }
     
-    if (APR_SUCCESS != (rv = wd_get_instance(&wd->watchdog, MD_WATCHDOG_NAME, 0, 1, wd->p))) {
-        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(10066) 
-                     "create md watchdog(%s)", MD_WATCHDOG_NAME);
-        return rv;
+    /* We have key and cert files, but they might no longer be valid or not
+     * match all domain names. Still use these files for now, but indicate that 
+     * resources should no longer be served until we have a new certificate again. */
+    if (md->state != MD_S_COMPLETE) {
+        rv = APR_EAGAIN;
     }
-    rv = wd_register_callback(wd->watchdog, 0, wd, run_watchdog);
-    ap_log_error(APLOG_MARK, rv? APLOG_CRIT : APLOG_DEBUG, rv, s, APLOGNO(10067) 
-                 "register md watchdog(%s)", MD_WATCHDOG_NAME);
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, rv, s, APLOGNO(10077) 
+                 "%s: providing certificate for server %s", md->name, s->server_hostname);
+    *pmd = md;
     return rv;
 }
- 
-static void load_stage_sets(apr_array_header_t *names, apr_pool_t *p, 
-                            md_reg_t *reg, server_rec *s, apr_table_t *env)
+
+static apr_status_t md_get_certificate(server_rec *s, apr_pool_t *p,
+                                       const char **pkeyfile, const char **pcertfile)
+{
+    const md_t *md;
+    
+    return get_certificate(s, p, pkeyfile, pcertfile, &md);
+}
+
+static apr_status_t md_get_certificates(server_rec *s, apr_pool_t *p,
+                                        apr_array_header_t **pkeyfiles, 
+                                        apr_array_header_t **pcertfiles)
 {
-    const char *name; 
+    const char *keyfile, *certfile;
+    apr_array_header_t *alt_keyfiles, *alt_certfiles;
+    md_srv_conf_t *sc;
+    const md_t *md;
     apr_status_t rv;
     int i;
     
-    for (i = 0; i < names->nelts; ++i) {
-        name = APR_ARRAY_IDX(names, i, const char*);
-        if (APR_SUCCESS == (rv = md_reg_load(reg, name, env, p))) {
-            ap_log_error( APLOG_MARK, APLOG_INFO, rv, s, APLOGNO(10068) 
-                         "%s: staged set activated", name);
-        }
-        else if (!APR_STATUS_IS_ENOENT(rv)) {
-            ap_log_error( APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10069)
-                         "%s: error loading staged set", name);
+    *pkeyfiles = apr_array_make(p, 5, sizeof(const char*));
+    *pcertfiles = apr_array_make(p, 5, sizeof(const char*));
+    
+    rv = get_certificate(s, p, &keyfile, &certfile, &md);
+    if (APR_SUCCESS != rv && !APR_STATUS_IS_EAGAIN(rv)) {
+        return rv;
+    }
+    APR_ARRAY_PUSH(*pkeyfiles, const char*) = keyfile;
+    APR_ARRAY_PUSH(*pcertfiles, const char*) = certfile;
+    
+    /* Additional certificates are only offered next to the real primary one */
+    sc = md_config_get(s);
+    if (md && md->alt_pkey_specs && md->alt_pkey_specs->nelts > 0
+        && APR_SUCCESS == md_reg_get_alt_cred_files(sc->mc->reg, md, p, 
+                                                    &alt_keyfiles, &alt_certfiles)) {
+        for (i = 0; i < alt_keyfiles->nelts; ++i) {
+            keyfile = APR_ARRAY_IDX(alt_keyfiles, i, const char*);
+            certfile = APR_ARRAY_IDX(alt_certfiles, i, const char*);
+            if (fexists(keyfile, p) && fexists(certfile, p)) {
+                APR_ARRAY_PUSH(*pkeyfiles, const char*) = keyfile;
+                APR_ARRAY_PUSH(*pcertfiles, const char*) = certfile;
+            }
         }
     }
-    return;
+    return rv;
 }
 
-static apr_status_t md_post_config(apr_pool_t *p, apr_pool_t *plog,
-                                   apr_pool_t *ptemp, server_rec *s)
+static apr_status_t md_get_certificate_objects(server_rec *s, apr_pool_t *p,
+                                               apr_array_header_t **pcerts,
+                                               apr_array_header_t **pchains,
+                                               apr_array_header_t **ppkeys)
 {
-    void *data = NULL;
-    const char *mod_md_init_key = "mod_md_init_counter";
+    const char *keyfile, *certfile;
+    apr_array_header_t *pkeys, *chains, *chain, *x509s;
     md_srv_conf_t *sc;
-    md_mod_conf_t *mc;
-    md_reg_t *reg;
     const md_t *md;
-    apr_array_header_t *drive_names;
-    apr_status_t rv = APR_SUCCESS;
-    int i, dry_run = 0;
-
-    apr_pool_userdata_get(&data, mod_md_init_key, s->process->pool);
-    if (data == NULL) {
-        /* At the first start, httpd makes a config check dry run. It
-         * runs all config hooks to check if it can. If so, it does
-         * this all again and starts serving requests.
-         * 
-         * This is known.
-         *
-         * On a dry run, we therefore do all the cheap config things we
-         * need to do. Because otherwise mod_ssl fails because it calls
-         * us unprepared.
-         * But synching our configuration with the md store
-         * and determining which domains to drive and start a watchdog
-         * and all that, we do not.
-         */
-        ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(10070)
-                     "initializing post config dry run");
-        apr_pool_userdata_set((const void *)1, mod_md_init_key,
-                              apr_pool_cleanup_null, s->process->pool);
-        dry_run = 1;
+    apr_status_t rv, rv2;
+    int i, j;
+    
+    *pcerts = apr_array_make(p, 5, sizeof(X509*));
+    *pchains = apr_array_make(p, 5, sizeof(apr_array_header_t*));
+    *ppkeys = apr_array_make(p, 5, sizeof(EVP_PKEY*));
+    
+    rv = get_certificate(s, p, &keyfile, &certfile, &md);
+    if (!md) {
+        /* nothing or a fallback certificate, which only exists as files */
+        return (APR_SUCCESS == rv || APR_STATUS_IS_EAGAIN(rv))? APR_ENOENT : rv;
     }
-    else {
-        ap_log_error( APLOG_MARK, APLOG_INFO, 0, s, APLOGNO(10071)
-                     "mod_md (v%s), initializing...", MOD_MD_VERSION);
+    sc = md_config_get(s);
+    if (APR_SUCCESS != (rv2 = md_reg_get_cred_objects(&pkeys, &chains, sc->mc->reg, md, p))) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, rv2, s, APLOGNO(10149) 
+                     "%s: no parsed credentials for server %s", md->name, s->server_hostname);
+        return APR_ENOENT;
     }
-
-    (void)plog;
-    init_setups(p, s);
-    md_log_set(log_is_level, log_print, NULL);
-
-    /* Check uniqueness of MDs, calculate global, configured MD list.
-     * If successful, we have a list of MD definitions that do not overlap. */
-    /* We also need to find out if we can be reached on 80/443 from the outside (e.g. the CA) */
-    if (APR_SUCCESS != (rv =  md_calc_md_list(p, plog, ptemp, s))) {
-        return rv;
+    for (i = 0; i < chains->nelts; ++i) {
+        chain = APR_ARRAY_IDX(chains, i, apr_array_header_t*);
+        x509s = apr_array_make(p, chain->nelts, sizeof(X509*));
+        for (j = 1; j < chain->nelts; ++j) {
+            APR_ARRAY_PUSH(x509s, X509*) = md_cert_get_X509(APR_ARRAY_IDX(chain, j, md_cert_t*));
+        }
+        APR_ARRAY_PUSH(*pcerts, X509*) = md_cert_get_X509(APR_ARRAY_IDX(chain, 0, md_cert_t*));
+        APR_ARRAY_PUSH(*pchains, apr_array_header_t*) = x509s;
+        APR_ARRAY_PUSH(*ppkeys, EVP_PKEY*) = 
+            md_pkey_get_EVP_PKEY(APR_ARRAY_IDX(pkeys, i, md_pkey_t*));
     }
+    return rv;
+}
 
-    md_config_post_config(s, p);
-    sc = md_config_get(s);
-    mc = sc->mc;
-
-    /* Synchronize the definitions we now have with the store via a registry (reg). */
-    if (APR_SUCCESS != (rv = setup_reg(&reg, p, s, mc->can_http, mc->can_https))) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10072)
-                     "setup md registry");
-        goto out;
-    }
+static apr_status_t md_get_hot_credentials(server_rec *s, apr_pool_t *p,
+                                           apr_array_header_t **pcerts,
+                                           apr_array_header_t **pchains,
+                                           apr_array_header_t **ppkeys)
+{
+    md_srv_conf_t *sc;
+    const md_snapshot_t *snap;
+    snap_creds_t *creds;
+    apr_array_header_t *pubcert, *x509s;
+    apr_uint32_t token;
+    md_cert_t *cert;
+    md_pkey_t *pkey;
+    apr_status_t rv = APR_ENOENT;
+    int i, j;
     
-    if (APR_SUCCESS != (rv = md_reg_sync(reg, p, ptemp, mc->mds))) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10073)
-                     "synching %d mds to registry", mc->mds->nelts);
+    *pcerts = apr_array_make(p, 5, sizeof(X509*));
+    *pchains = apr_array_make(p, 5, sizeof(apr_array_header_t*));
+    *ppkeys = apr_array_make(p, 5, sizeof(EVP_PKEY*));
+    sc = md_config_get(s);
+    if (!hot_act || !sc || !sc->assigned || !(snap = snap_acquire(s, &token))) {
+        return APR_ENOENT;
     }
-    
-    /* Determine the managed domains that are in auto drive_mode. For those,
-     * determine in which state they are:
-     *  - UNKNOWN:            should not happen, report, don't drive
-     *  - ERROR:              something we do not know how to fix, report, don't drive
-     *  - INCOMPLETE/EXPIRED: need to drive them right away
-     *  - COMPLETE:           determine when cert expires, drive when the time comes
-     *
-     * Start the watchdog if we have anything, now or in the future.
-     */
-    drive_names = apr_array_make(ptemp, mc->mds->nelts+1, sizeof(const char *));
-    for (i = 0; i < mc->mds->nelts; ++i) {
-        md = APR_ARRAY_IDX(mc->mds, i, const md_t *);
-        switch (md->drive_mode) {
-            case MD_DRIVE_AUTO:
-                if (md_array_str_index(mc->unused_names, md->name, 0, 0) >= 0) {
-                    break;
-                }
-                /* fall through */
-            case MD_DRIVE_ALWAYS:
-                APR_ARRAY_PUSH(drive_names, const char *) = md->name; 
-                break;
-            default:
-                /* leave out */
-                break;
+    /* without credentials activated since server start, the configured ones are current */
+    creds = apr_hash_get(snap->creds, sc->assigned->name, APR_HASH_KEY_STRING);
+    if (creds) {
+        /* hand out references that live as long as the caller's pool */
+        for (i = 0; i < creds->pubcerts->nelts; ++i) {
+            pubcert = APR_ARRAY_IDX(creds->pubcerts, i, apr_array_header_t*);
+            x509s = apr_array_make(p, pubcert->nelts, sizeof(X509*));
+            for (j = 1; j < pubcert->nelts; ++j) {
+                cert = APR_ARRAY_IDX(pubcert, j, md_cert_t*);
+                APR_ARRAY_PUSH(x509s, X509*) = md_cert_get_X509(md_cert_ref(cert, p));
+            }
+            cert = APR_ARRAY_IDX(pubcert, 0, md_cert_t*);
+            pkey = APR_ARRAY_IDX(creds->pkeys, i, md_pkey_t*);
+            APR_ARRAY_PUSH(*pcerts, X509*) = md_cert_get_X509(md_cert_ref(cert, p));
+            APR_ARRAY_PUSH(*pchains, apr_array_header_t*) = x509s;
+            APR_ARRAY_PUSH(*ppkeys, EVP_PKEY*) = md_pkey_get_EVP_PKEY(md_pkey_ref(pkey, p));
         }
+        rv = APR_SUCCESS;
     }
+    snap_release(token);
+    return rv;
+}
+
+/* How often, in seconds, the store is looked at for new OCSP responses when it 
+ * is shared with other servers and the generation of the group does not tell. */
+#define OCSP_RELOAD_INTERVAL    60
+
+/* The generation of the "ocsp" store group the responses in memory are from or,
+ * when it is not shared, the second of the last look into the store. */
+static volatile apr_uint32_t ocsp_seen;
+
+/* The watchdog saves new responses in the store. Each change is picked up once,
+ * by the first request that notices it. Others go on with what is in memory. */
+static void ocsp_reload_check(md_mod_conf_t *mc, apr_pool_t *p)
+{
+    apr_uint32_t seen = apr_atomic_read32(&ocsp_seen), current;
     
-    init_ssl();
-    
-    if (dry_run) {
-        goto out;
-    }
-    
-    /* If there are MDs to drive, start a watchdog to check on them regularly */
-    if (drive_names->nelts > 0) {
-        ap_log_error(APLOG_MARK, APLOG_DEBUG, rv, s, APLOGNO(10074)
-                     "%d out of %d mds are configured for auto-drive", 
-                     drive_names->nelts, mc->mds->nelts);
-    
-        load_stage_sets(drive_names, p, reg, s, mc->env);
-        md_http_use_implementation(md_curl_get_impl(p));
-        rv = start_watchdog(drive_names, p, reg, s, mc);
+    if (store_gen_shared(mc)) {
+        current = store_gen_get(MD_SG_OCSP);
+        if (current == seen) return;
     }
     else {
-        ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(10075)
-                     "no mds to auto drive, no watchdog needed");
+        current = (apr_uint32_t)apr_time_sec(apr_time_now());
+        if (current - seen < OCSP_RELOAD_INTERVAL) return;
     }
+    if (apr_atomic_cas32(&ocsp_seen, current, seen) == seen) {
+        md_ocsp_reload(mc->ocsp, p);
+    }
+}
+
+static apr_status_t md_get_ocsp_response(server_rec *s, X509 *cert, apr_pool_t *p,
+                                         const unsigned char **pder, apr_size_t *pderlen)
+{
+    md_srv_conf_t *sc = md_config_get(s);
     
-out:
-    return rv;
+    *pder = NULL;
+    *pderlen = 0;
+    if (!sc || !sc->mc->ocsp) {
+        return APR_ENOENT;
+    }
+    ocsp_reload_check(sc->mc, p);
+    return md_ocsp_get_resp_der(pder, pderlen, sc->mc->ocsp, cert, p);
+}
+
+static int compat_warned;
+static apr_status_t md_get_credentials(server_rec *s, apr_pool_t *p,
+                                       const char **pkeyfile, 
+                                       const char **pcertfile, 
+                                       const char **pchainfile)
+{
+    *pchainfile = NULL;
+    if (!compat_warned) {
+        compat_warned = 1;
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, /* no APLOGNO */
+                     "You are using mod_md with an old patch to mod_ssl. This will "
+                     " work for now, but support will be dropped in a future release.");
+    }
+    return md_get_certificate(s, p, pkeyfile, pcertfile);
 }
 
 /**************************************************************************************************/
-/* Access API to other httpd components */
+/* challenge cache */
 
-static int md_is_managed(server_rec *s)
+/* Challenge data is kept in memory per child process. The challenge files are 
+ * written by the watchdog, which may run in another process. All entries are 
+ * dropped when the generation of the challenges group changes. If that counter
+ * is shared by all processes, an entry is used without looking at the store.
+ * Otherwise, an entry is used as long as the file in the store has the same 
+ * inode, size and modification time it had when the entry was made. Since the 
+ * store replaces files by renaming, any update is detected by that single stat, 
+ * without reading or parsing the file again. 
+ */
+typedef struct {
+    apr_pool_t *p;
+    const char *data;
+    apr_size_t len;
+    md_cert_t *cert;
+    md_pkey_t *pkey;
+    apr_ino_t inode;
+    apr_off_t size;
+    apr_time_t mtime;
+    apr_uint32_t generation;   /* of the challenges group before loading */
+} cha_cache_entry;
+
+typedef struct {
+    apr_pool_t *p;
+    apr_hash_t *entries;
+    apr_uint32_t generation;
+    int by_generation;         /* entries are valid without a stat */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+} cha_cache_t;
+
+static cha_cache_t *cha_cache;
+
+#define CHA_CACHE_FINFO     (APR_FINFO_INODE|APR_FINFO_SIZE|APR_FINFO_MTIME)
+
+static void cha_cache_init(apr_pool_t *p, server_rec *s)
 {
-    md_srv_conf_t *conf = md_config_get(s);
+    cha_cache_t *cache;
+    apr_status_t rv;
+    
+    cache = apr_pcalloc(p, sizeof(*cache));
+    if (APR_SUCCESS != (rv = apr_pool_create(&cache->p, p))) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(10155) 
+                     "creating challenge cache pool, caching disabled");
+        return;
+    }
+    apr_pool_tag(cache->p, "md_cha_cache");
+    cache->entries = apr_hash_make(cache->p);
+    cache->generation = store_gen_get(MD_SG_CHALLENGES);
+    cache->by_generation = store_gen_shared(md_config_get(s)->mc);
+#if APR_HAS_THREADS
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&cache->mutex, 
+                                                     APR_THREAD_MUTEX_DEFAULT, cache->p))) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(10156) 
+                     "creating challenge cache mutex, caching disabled");
+        return;
+    }
+#endif
+    cha_cache = cache;
+}
 
-    if (conf && conf->assigned) {
-        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(10076) 
-                     "%s: manages server %s", conf->assigned->name, s->server_hostname);
-        return 1;
+static void cha_cache_lock(cha_cache_t *cache)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cache->mutex);
+#else
+    (void)cache;
+#endif
+}
+
+static void cha_cache_unlock(cha_cache_t *cache)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cache->mutex);
+#else
+    (void)cache;
+#endif
+}
+
+static apr_status_t cha_stat(apr_finfo_t *finfo, md_store_t *store, 
+                             const char *name, const char *aspect, apr_pool_t *p)
+{
+    const char *fname;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS == (rv = md_store_get_fname(&fname, store, MD_SG_CHALLENGES, 
+                                                name, aspect, p))) {
+        rv = apr_stat(finfo, fname, CHA_CACHE_FINFO, p);
+        if (APR_INCOMPLETE == rv && (finfo->valid & CHA_CACHE_FINFO) == CHA_CACHE_FINFO) {
+            rv = APR_SUCCESS;
+        }
     }
-    ap_log_error(APLOG_MARK, APLOG_TRACE1, 0, s,  
-                 "server %s is not managed", s->server_hostname);
-    return 0;
+    return rv;
 }
 
-static apr_status_t setup_fallback_cert(md_store_t *store, const md_t *md, 
-                                        server_rec *s, apr_pool_t *p)
+/* Entries get their own allocator, as they are filled outside the cache lock. */
+static apr_status_t cha_entry_create(cha_cache_entry **pe, cha_cache_t *cache, 
+                                     const apr_finfo_t *finfo)
 {
-    md_pkey_t *pkey;
-    md_cert_t *cert;
-    md_pkey_spec_t spec;
+    apr_allocator_t *allocator;
+    apr_pool_t *ep;
+    cha_cache_entry *e;
     apr_status_t rv;
-    MD_CHK_VARS;
     
-    spec.type = MD_PKEY_TYPE_RSA;
-    spec.params.rsa.bits = MD_PKEY_RSA_BITS_DEF;
+    *pe = NULL;
+    if (APR_SUCCESS != (rv = apr_allocator_create(&allocator))) {
+        return rv;
+    }
+    cha_cache_lock(cache);
+    rv = apr_pool_create_ex(&ep, cache->p, NULL, allocator);
+    cha_cache_unlock(cache);
+    if (APR_SUCCESS != rv) {
+        apr_allocator_destroy(allocator);
+        return rv;
+    }
+    apr_allocator_owner_set(allocator, ep);
     
-    if (   !MD_OK(md_pkey_gen(&pkey, p, &spec))
-        || !MD_OK(md_store_save(store, p, MD_SG_DOMAINS, md->name, 
-                                MD_FN_FALLBACK_PKEY, MD_SV_PKEY, (void*)pkey, 0))
-        || !MD_OK(md_cert_self_sign(&cert, "Apache Managed Domain Fallback", 
-                                    md->domains, pkey, apr_time_from_sec(14 * MD_SECS_PER_DAY), p))
-        || !MD_OK(md_store_save(store, p, MD_SG_DOMAINS, md->name, 
-                                MD_FN_FALLBACK_CERT, MD_SV_CERT, (void*)cert, 0))) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,  
-                     "%s: setup fallback certificate, call %s", md->name, MD_LAST_CHK);
+    e = apr_pcalloc(ep, sizeof(*e));
+    e->p = ep;
+    if (finfo) {
+        e->inode = finfo->inode;
+        e->size = finfo->size;
+        e->mtime = finfo->mtime;
     }
-    return rv;
+    e->generation = store_gen_get(MD_SG_CHALLENGES);
+    *pe = e;
+    return APR_SUCCESS;
 }
 
-static int fexists(const char *fname, apr_pool_t *p)
+static void cha_entry_destroy(cha_cache_t *cache, cha_cache_entry *e)
 {
-    return (*fname && APR_SUCCESS == md_util_is_file(fname, p));
+    cha_cache_lock(cache);
+    apr_pool_destroy(e->p);
+    cha_cache_unlock(cache);
 }
 
-static apr_status_t md_get_certificate(server_rec *s, apr_pool_t *p,
-                                       const char **pkeyfile, const char **pcertfile)
+/* Lookup a valid entry, called with the cache locked. */
+static cha_cache_entry *cha_cache_find(cha_cache_t *cache, const char *key, 
+                                       const apr_finfo_t *finfo)
 {
-    apr_status_t rv = APR_ENOENT;    
-    md_srv_conf_t *sc;
-    md_reg_t *reg;
-    md_store_t *store;
-    const md_t *md;
-    MD_CHK_VARS;
+    cha_cache_entry *e;
+    apr_hash_index_t *hi;
+    const void *hkey;
+    void *val;
+    apr_uint32_t generation = store_gen_get(MD_SG_CHALLENGES);
     
-    *pkeyfile = NULL;
-    *pcertfile = NULL;
-
-    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(10113)
-                 "md_get_certificate called for vhost %s.", s->server_hostname);
-
-    sc = md_config_get(s);
-    if (!sc) {
-        ap_log_error(APLOG_MARK, APLOG_TRACE1, 0, s,  
-                     "asked for certificate of server %s which has no md config", 
-                     s->server_hostname);
-        return APR_ENOENT;
+    if (generation != cache->generation) {
+        /* removing the current element is safe during iteration, keys live in 
+         * the entry pools, so remove before destroying those. */
+        for (hi = apr_hash_first(NULL, cache->entries); hi; hi = apr_hash_next(hi)) {
+            apr_hash_this(hi, &hkey, NULL, &val);
+            e = val;
+            apr_hash_set(cache->entries, hkey, APR_HASH_KEY_STRING, NULL);
+            apr_pool_destroy(e->p);
+        }
+        cache->generation = generation;
+        return NULL;
     }
     
-    if (!sc->assigned) {
-        /* Hmm, mod_ssl (or someone like it) asks for certificates for a server
-         * where we did not assign a MD to. Either the user forgot to configure
-         * that server with SSL certs, has misspelled a server name or we have
-         * a bug that prevented us from taking responsibility for this server.
-         * Either way, make some polite noise */
-        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s, APLOGNO(10114)  
-                     "asked for certificate of server %s which has no MD assigned. This "
-                     "could be ok, but most likely it is either a misconfiguration or "
-                     "a bug. Please check server names and MD names carefully and if "
-                     "everything checks open, please open an issue.", 
-                     s->server_hostname);
-        return APR_ENOENT;
+    e = apr_hash_get(cache->entries, key, APR_HASH_KEY_STRING);
+    if (e && !cache->by_generation && (!finfo || e->inode != finfo->inode 
+              || e->size != finfo->size || e->mtime != finfo->mtime)) {
+        apr_hash_set(cache->entries, key, APR_HASH_KEY_STRING, NULL);
+        apr_pool_destroy(e->p);
+        e = NULL;
     }
-    
-    assert(sc->mc);
-    reg = sc->mc->reg;
-    assert(reg);
-    
-    md = md_reg_get(reg, sc->assigned->name, p);
-    if (!md) {
-        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, APLOGNO(10115) 
-                     "unable to hand out certificates, as registry can no longer "
-                     "find MD '%s'.", sc->assigned->name);
-        return APR_ENOENT;
+    return e;
+}
+
+/* Add an entry, unless another thread was faster or the store changed since it 
+ * was loaded. Called with the cache locked. */
+static void cha_cache_add(cha_cache_t *cache, const char *key, cha_cache_entry *e)
+{
+    if (e->generation != cache->generation 
+        || apr_hash_get(cache->entries, key, APR_HASH_KEY_STRING)) {
+        apr_pool_destroy(e->p);
+        return;
     }
+    apr_hash_set(cache->entries, apr_pstrdup(e->p, key), APR_HASH_KEY_STRING, e);
+}
+
+static apr_status_t cha_cache_get_text(const char **pdata, cha_cache_t *cache, 
+                                       md_store_t *store, const char *name, 
+                                       const char *aspect, apr_pool_t *p)
+{
+    cha_cache_entry *e;
+    apr_finfo_t finfo;
+    const char *key, *data;
+    apr_status_t rv;
     
-    if (!MD_OK(md_reg_get_cred_files(reg, md, p, pkeyfile, pcertfile))) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10110) 
-                     "retrieving credentials for MD %s", md->name);
-        return rv;
-    }
+    *pdata = NULL;
+    key = apr_pstrcat(p, aspect, ":", name, NULL);
+    rv = cache->by_generation? APR_SUCCESS : cha_stat(&finfo, store, name, aspect, p);
     
-    if (!fexists(*pkeyfile, p) || !fexists(*pcertfile, p)) { 
-        /* Provide temporary, self-signed certificate as fallback, so that
-         * clients do not get obscure TLS handshake errors or will see a fallback
-         * virtual host that is not intended to be served here. */
-        store = md_reg_store_get(reg);
-        assert(store);    
-        
-        md_store_get_fname(pkeyfile, store, MD_SG_DOMAINS, 
-                           md->name, MD_FN_FALLBACK_PKEY, p);
-        md_store_get_fname(pcertfile, store, MD_SG_DOMAINS, 
-                           md->name, MD_FN_FALLBACK_CERT, p);
-        if (!fexists(*pkeyfile, p) || !fexists(*pcertfile, p)) { 
-            if (!MD_OK(setup_fallback_cert(store, md, s, p))) {
-                return rv;
-            }
-        }
-        
-        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(10116)  
-                     "%s: providing fallback certificate for server %s", 
-                     md->name, s->server_hostname);
-        return APR_EAGAIN;
+    cha_cache_lock(cache);
+    e = cha_cache_find(cache, key, 
+                       (APR_SUCCESS == rv && !cache->by_generation)? &finfo : NULL);
+    if (e) {
+        /* copy, the entry may be replaced once we let go of the lock */
+        *pdata = apr_pstrmemdup(p, e->data, e->len);
+        metrics_cha_count(1);
     }
+    cha_cache_unlock(cache);
+    if (e || APR_SUCCESS != rv) goto out;
     
-    /* We have key and cert files, but they might no longer be valid or not
-     * match all domain names. Still use these files for now, but indicate that 
-     * resources should no longer be served until we have a new certificate again. */
-    if (md->state != MD_S_COMPLETE) {
-        rv = APR_EAGAIN;
+    rv = cha_entry_create(&e, cache, cache->by_generation? NULL : &finfo);
+    if (APR_SUCCESS != rv) goto out;
+    rv = md_store_load(store, MD_SG_CHALLENGES, name, aspect, MD_SV_TEXT, (void**)&data, e->p);
+    if (APR_SUCCESS != rv) {
+        cha_entry_destroy(cache, e);
+        goto out;
     }
-    ap_log_error(APLOG_MARK, APLOG_DEBUG, rv, s, APLOGNO(10077) 
-                 "%s: providing certificate for server %s", md->name, s->server_hostname);
+    e->data = data;
+    e->len = strlen(data);
+    *pdata = apr_pstrmemdup(p, e->data, e->len);
+    metrics_cha_count(0);
+    
+    cha_cache_lock(cache);
+    cha_cache_add(cache, key, e);
+    cha_cache_unlock(cache);
+out:
     return rv;
 }
 
-static int compat_warned;
-static apr_status_t md_get_credentials(server_rec *s, apr_pool_t *p,
-                                       const char **pkeyfile, 
-                                       const char **pcertfile, 
-                                       const char **pchainfile)
+static apr_status_t cha_cache_get_creds(md_cert_t **pcert, md_pkey_t **ppkey, 
+                                        cha_cache_t *cache, md_store_t *store, 
+                                        const char *name, const char *cert_aspect, 
+                                        const char *pkey_aspect, apr_pool_t *p)
 {
-    *pchainfile = NULL;
-    if (!compat_warned) {
-        compat_warned = 1;
-        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, /* no APLOGNO */
-                     "You are using mod_md with an old patch to mod_ssl. This will "
-                     " work for now, but support will be dropped in a future release.");
+    cha_cache_entry *e;
+    apr_finfo_t finfo;
+    const char *key;
+    apr_status_t rv;
+    
+    *pcert = NULL;
+    *ppkey = NULL;
+    key = apr_pstrcat(p, cert_aspect, ":", name, NULL);
+    /* the key is always written before the certificate, checking the latter is enough */
+    rv = cache->by_generation? APR_SUCCESS : cha_stat(&finfo, store, name, cert_aspect, p);
+    
+    cha_cache_lock(cache);
+    e = cha_cache_find(cache, key, 
+                       (APR_SUCCESS == rv && !cache->by_generation)? &finfo : NULL);
+    if (e) {
+        /* references keep cert and key alive when the entry goes away */
+        *pcert = md_cert_ref(e->cert, p);
+        *ppkey = md_pkey_ref(e->pkey, p);
+        metrics_cha_count(1);
     }
-    return md_get_certificate(s, p, pkeyfile, pcertfile);
+    cha_cache_unlock(cache);
+    if (e || APR_SUCCESS != rv) goto out;
+    
+    rv = cha_entry_create(&e, cache, cache->by_generation? NULL : &finfo);
+    if (APR_SUCCESS != rv) goto out;
+    rv = md_store_load(store, MD_SG_CHALLENGES, name, cert_aspect, 
+                       MD_SV_CERT, (void**)&e->cert, e->p);
+    if (APR_SUCCESS == rv) {
+        rv = md_store_load(store, MD_SG_CHALLENGES, name, pkey_aspect, 
+                           MD_SV_PKEY, (void**)&e->pkey, e->p);
+    }
+    if (APR_SUCCESS != rv) {
+        cha_entry_destroy(cache, e);
+        goto out;
+    }
+    *pcert = md_cert_ref(e->cert, p);
+    *ppkey = md_pkey_ref(e->pkey, p);
+    metrics_cha_count(0);
+
+    cha_cache_lock(cache);
+    cha_cache_add(cache, key, e);
+    cha_cache_unlock(cache);
+out:
+    return rv;
 }
 
 static int md_is_challenge(conn_rec *c, const char *servername,
@@ -1397,6 +4153,26 @@ static int md_is_challenge(conn_rec *c, const char *servername,
             
             ap_log_cerror(APLOG_MARK, APLOG_TRACE1, 0, c, "%s: load certs/keys %s/%s",
                           servername, cert_name, pkey_name);
+            if (cha_cache) {
+                rv = cha_cache_get_creds(&mdcert, &mdpkey, cha_cache, store, servername, 
+                                         cert_name, pkey_name, c->pool);
+                if (APR_SUCCESS == rv) {
+                    *pcert = md_cert_get_X509(mdcert);
+                    *pkey = md_pkey_get_EVP_PKEY(mdpkey);
+                    ap_log_cerror(APLOG_MARK, APLOG_INFO, 0, c, APLOGNO(10157)
+                                  "%s: is a %s challenge host", servername, cha_type);
+                    return 1;
+                }
+                else if (APR_STATUS_IS_ENOENT(rv)) {
+                    ap_log_cerror(APLOG_MARK, APLOG_INFO, rv, c, APLOGNO(10158)
+                                  "%s: unknown %s challenge host", servername, cha_type);
+                }
+                else {
+                    ap_log_cerror(APLOG_MARK, APLOG_WARNING, rv, c, APLOGNO(10159)
+                                  "%s: challenge data not complete, key unavailable", servername);
+                }
+                goto out;
+            }
             rv = md_store_load(store, MD_SG_CHALLENGES, servername, cert_name, 
                                MD_SV_CERT, (void**)&mdcert, c->pool);
             if (APR_SUCCESS == rv && (*pcert = md_cert_get_X509(mdcert))) {
@@ -1432,6 +4208,9 @@ static int md_http_challenge_pr(request_rec *r)
 {
     apr_bucket_brigade *bb;
     const md_srv_conf_t *sc;
+    const md_snapshot_t *snap;
+    const md_domain_index_t *index;
+    apr_uint32_t token;
     const char *name, *data;
     md_reg_t *reg;
     int configured;
@@ -1444,15 +4223,27 @@ static int md_http_challenge_pr(request_rec *r)
             ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r, 
                           "access inside /.well-known/acme-challenge for %s%s", 
                           r->hostname, r->parsed_uri.path);
-            configured = (NULL != md_get_by_domain(sc->mc->mds, r->hostname));
+            snap = snap_acquire(r->server, &token);
+            index = snap? snap->index : sc->mc->mds_index;
+            configured = (NULL != (index? md_domain_index_get_by_domain(index, r->hostname)
+                                   : md_get_by_domain(sc->mc->mds, r->hostname)));
+            if (snap) {
+                snap_release(token);
+            }
             name = r->parsed_uri.path + sizeof(ACME_CHALLENGE_PREFIX)-1;
             reg = sc && sc->mc? sc->mc->reg : NULL;
             
             if (strlen(name) && !ap_strchr_c(name, '/') && reg) {
                 md_store_t *store = md_reg_store_get(reg);
                 
-                rv = md_store_load(store, MD_SG_CHALLENGES, r->hostname, 
-                                   MD_FN_HTTP01, MD_SV_TEXT, (void**)&data, r->pool);
+                if (cha_cache) {
+                    rv = cha_cache_get_text(&data, cha_cache, store, r->hostname, 
+                                            MD_FN_HTTP01, r->pool);
+                }
+                else {
+                    rv = md_store_load(store, MD_SG_CHALLENGES, r->hostname, 
+                                       MD_FN_HTTP01, MD_SV_TEXT, (void**)&data, r->pool);
+                }
                 ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv, r, 
                               "loading challenge for %s (%s)", r->hostname, r->uri);
                 if (APR_SUCCESS == rv) {
@@ -1494,13 +4285,329 @@ static int md_http_challenge_pr(request_rec *r)
     return DECLINED;
 }
 
+/**************************************************************************************************/
+/* status handler */
+
+/* "SetHandler md-status" serves the state of the MDs and the counters kept in
+ * shared memory, as JSON or, when the query is "prometheus", in the Prometheus
+ * text format. All of it comes from memory, the store is not read and no lock
+ * is taken. */
+
+#define MD_STATUS_HANDLER   "md-status"
+
+typedef struct {
+    const md_t *md;
+    md_job_slot_t state;       /* state of the renewal job, if loaded */
+    md_state_t md_state;       /* current, from the job if it has run */
+    apr_time_t expires;
+    const char *serial;        /* of the certificate activated hot, or NULL */
+} status_entry;
+
+/* The serial of the primary certificate md_get_hot_credentials() hands out
+ * for md, NULL when the one the server started with is current. */
+static const char *status_serial(const md_t *md, server_rec *s, apr_pool_t *p)
+{
+    const md_snapshot_t *snap;
+    snap_creds_t *creds;
+    apr_array_header_t *chain;
+    apr_uint32_t token;
+    const char *serial = NULL;
+    
+    if (hot_act && NULL != (snap = snap_acquire(s, &token))) {
+        if (NULL != (creds = apr_hash_get(snap->creds, md->name, APR_HASH_KEY_STRING))) {
+            chain = APR_ARRAY_IDX(creds->pubcerts, 0, apr_array_header_t*);
+            md_cert_get_serial_number(&serial, APR_ARRAY_IDX(chain, 0, md_cert_t*), p);
+        }
+        snap_release(token);
+    }
+    return serial;
+}
+
+static apr_array_header_t *status_entries(md_mod_conf_t *mc, server_rec *s, apr_pool_t *p)
+{
+    apr_array_header_t *entries;
+    status_entry *e;
+    md_job_slot_t *slot;
+    int i;
+    
+    entries = apr_array_make(p, mc->mds->nelts, sizeof(status_entry));
+    for (i = 0; i < mc->mds->nelts; ++i) {
+        e = (status_entry*)apr_array_push(entries);
+        memset(e, 0, sizeof(*e));
+        e->md = APR_ARRAY_IDX(mc->mds, i, const md_t *);
+        /* the MD from server start is stale after renewals and hot activations, 
+         * the watchdog keeps its job slot current */
+        if (NULL != (slot = job_slot_get(e->md->name)) && job_slot_read(slot, &e->state)) {
+            e->md_state = e->state.md_state;
+            e->expires = e->state.expires;
+        }
+        else {
+            e->md_state = e->md->state;
+            e->expires = e->md->expires;
+        }
+        e->serial = status_serial(e->md, s, p);
+    }
+    return entries;
+}
+
+static md_json_t *status_hist_json(md_trace_hist_t *hist, apr_pool_t *p)
+{
+    md_json_t *json, *jbucket;
+    apr_uint32_t count = 0, bound;
+    int i;
+    
+    json = md_json_create(p);
+    for (i = 0; i < MD_TRACE_HIST_BUCKETS; ++i) {
+        count += apr_atomic_read32(&hist->counts[i]);
+        jbucket = md_json_create(p);
+        if (0 != (bound = md_trace_hist_bound_ms(i))) {
+            md_json_setl((long)bound, jbucket, MD_KEY_LE, NULL);
+        }
+        md_json_setl((long)count, jbucket, MD_KEY_COUNT, NULL);
+        md_json_addj(jbucket, json, MD_KEY_BUCKETS, NULL);
+    }
+    md_json_setl((long)count, json, MD_KEY_COUNT, NULL);
+    md_json_setl((long)apr_atomic_read32(&hist->sum_ms), json, MD_KEY_MS, NULL);
+    return json;
+}
+
+static md_json_t *status_json(apr_array_header_t *entries, apr_pool_t *p)
+{
+    md_json_t *json, *jmd;
+    const status_entry *e;
+    char ts[APR_RFC822_DATE_LEN];
+    char buffer[256];
+    int i;
+    
+    json = md_json_create(p);
+    md_json_sets(MOD_MD_VERSION, json, MD_KEY_VERSION, NULL);
+    md_json_setsa(apr_array_make(p, 0, sizeof(const char*)), json, MD_KEY_MDS, NULL);
+    for (i = 0; i < entries->nelts; ++i) {
+        e = &APR_ARRAY_IDX(entries, i, status_entry);
+        jmd = md_json_create(p);
+        md_json_sets(e->md->name, jmd, MD_KEY_NAME, NULL);
+        md_json_setl(e->md_state, jmd, MD_KEY_STATE, NULL);
+        if (e->expires > 0) {
+            apr_rfc822_date(ts, e->expires);
+            md_json_sets(ts, jmd, MD_KEY_EXPIRES, NULL);
+        }
+        if (e->serial) {
+            md_json_sets(e->serial, jmd, MD_KEY_CERT, MD_KEY_SERIAL, NULL);
+        }
+        if (e->state.loaded) {
+            if (e->state.next_check > 0) {
+                apr_rfc822_date(ts, e->state.next_check);
+                md_json_sets(ts, jmd, MD_KEY_NEXT_CHECK, NULL);
+            }
+            md_json_setl(e->state.error_runs, jmd, MD_KEY_ERROR_RUNS, NULL);
+            md_json_setl(e->state.last_rv, jmd, MD_KEY_LAST_STATUS, NULL);
+            if (APR_SUCCESS != e->state.last_rv) {
+                md_json_sets(apr_strerror(e->state.last_rv, buffer, sizeof(buffer)), 
+                             jmd, MD_KEY_LAST_ERROR, NULL);
+            }
+            md_json_setl((long)e->state.renewals, jmd, MD_KEY_RENEWALS, MD_KEY_COUNT, NULL);
+            md_json_setl((long)apr_time_as_msec(e->state.renewal_duration), 
+                         jmd, MD_KEY_RENEWALS, MD_KEY_LAST_MS, NULL);
+        }
+        md_json_addj(jmd, json, MD_KEY_MDS, NULL);
+    }
+    if (metrics) {
+        md_json_setl((long)apr_atomic_read32(&metrics->cha_hits), 
+                     json, MD_KEY_CHALLENGES, MD_KEY_HITS, NULL);
+        md_json_setl((long)apr_atomic_read32(&metrics->cha_misses), 
+                     json, MD_KEY_CHALLENGES, MD_KEY_MISSES, NULL);
+        md_json_setj(status_hist_json(&metrics->requests, p), json, MD_KEY_REQUESTS, NULL);
+        md_json_setj(status_hist_json(&metrics->renewals, p), json, MD_KEY_RENEWALS, NULL);
+    }
+    return json;
+}
+
+static void status_prom_hist(request_rec *r, const char *name, const char *help,
+                             md_trace_hist_t *hist)
+{
+    apr_uint32_t count = 0, bound;
+    int i;
+    
+    ap_rprintf(r, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (i = 0; i < MD_TRACE_HIST_BUCKETS; ++i) {
+        count += apr_atomic_read32(&hist->counts[i]);
+        if (0 != (bound = md_trace_hist_bound_ms(i))) {
+            ap_rprintf(r, "%s_bucket{le=\"%.3f\"} %u\n", name, bound / 1000.0, count);
+        }
+        else {
+            ap_rprintf(r, "%s_bucket{le=\"+Inf\"} %u\n", name, count);
+        }
+    }
+    ap_rprintf(r, "%s_sum %.3f\n%s_count %u\n", 
+               name, apr_atomic_read32(&hist->sum_ms) / 1000.0, name, count);
+}
+
+static void status_prom_header(request_rec *r, const char *name, const char *type, 
+                               const char *help)
+{
+    ap_rprintf(r, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void status_prometheus(request_rec *r, apr_array_header_t *entries)
+{
+    const status_entry *e;
+    int i;
+    
+    status_prom_header(r, "md_state", "gauge", "state of the MD, 2 is complete");
+    for (i = 0; i < entries->nelts; ++i) {
+        e = &APR_ARRAY_IDX(entries, i, status_entry);
+        ap_rprintf(r, "md_state{md=\"%s\"} %d\n", e->md->name, (int)e->md_state);
+    }
+    status_prom_header(r, "md_cert_expiry_seconds", "gauge", 
+                       "when the certificate of the MD expires, in unix time");
+    for (i = 0; i < entries->nelts; ++i) {
+        e = &APR_ARRAY_IDX(entries, i, status_entry);
+        if (e->expires > 0) {
+            ap_rprintf(r, "md_cert_expiry_seconds{md=\"%s\"} %" APR_TIME_T_FMT "\n", 
+                       e->md->name, apr_time_sec(e->expires));
+        }
+    }
+    status_prom_header(r, "md_job_next_check_seconds", "gauge", 
+                       "when the renewal job runs next, in unix time, 0 for its schedule");
+    for (i = 0; i < entries->nelts; ++i) {
+        e = &APR_ARRAY_IDX(entries, i, status_entry);
+        if (e->state.loaded) {
+            ap_rprintf(r, "md_job_next_check_seconds{md=\"%s\"} %" APR_TIME_T_FMT "\n", 
+                       e->md->name, apr_time_sec(e->state.next_check));
+        }
+    }
+    status_prom_header(r, "md_job_error_runs", "gauge", 
+                       "number of renewal runs in a row that failed");
+    for (i = 0; i < entries->nelts; ++i) {
+        e = &APR_ARRAY_IDX(entries, i, status_entry);
+        if (e->state.loaded) {
+            ap_rprintf(r, "md_job_error_runs{md=\"%s\"} %d\n", 
+                       e->md->name, e->state.error_runs);
+        }
+    }
+    status_prom_header(r, "md_job_last_status", "gauge", 
+                       "APR status of the last renewal run, 0 for success");
+    for (i = 0; i < entries->nelts; ++i) {
+        e = &APR_ARRAY_IDX(entries, i, status_entry);
+        if (e->state.loaded) {
+            ap_rprintf(r, "md_job_last_status{md=\"%s\"} %d\n", 
+                       e->md->name, e->state.last_rv);
+        }
+    }
+    status_prom_header(r, "md_job_renewals_total", "counter", "number of renewal runs");
+    for (i = 0; i < entries->nelts; ++i) {
+        e = &APR_ARRAY_IDX(entries, i, status_entry);
+        if (e->state.loaded) {
+            ap_rprintf(r, "md_job_renewals_total{md=\"%s\"} %u\n", 
+                       e->md->name, e->state.renewals);
+        }
+    }
+    status_prom_header(r, "md_job_renewal_duration_seconds", "gauge", 
+                       "duration of the last renewal run");
+    for (i = 0; i < entries->nelts; ++i) {
+        e = &APR_ARRAY_IDX(entries, i, status_entry);
+        if (e->state.loaded) {
+            ap_rprintf(r, "md_job_renewal_duration_seconds{md=\"%s\"} %.3f\n", e->md->name, 
+                       (double)apr_time_as_msec(e->state.renewal_duration) / 1000.0);
+        }
+    }
+    if (metrics) {
+        status_prom_header(r, "md_challenge_cache_hits_total", "counter", 
+                           "challenges answered from the cache");
+        ap_rprintf(r, "md_challenge_cache_hits_total %u\n", 
+                   apr_atomic_read32(&metrics->cha_hits));
+        status_prom_header(r, "md_challenge_cache_misses_total", "counter", 
+                           "challenges loaded from the store");
+        ap_rprintf(r, "md_challenge_cache_misses_total %u\n", 
+                   apr_atomic_read32(&metrics->cha_misses));
+        status_prom_hist(r, "md_http_request_duration_seconds", 
+                         "requests to ACME servers and OCSP responders", &metrics->requests);
+        status_prom_hist(r, "md_renewal_duration_seconds", 
+                         "renewal runs of all MDs", &metrics->renewals);
+    }
+}
+
+static int md_status_handler(request_rec *r)
+{
+    const md_srv_conf_t *sc;
+    apr_array_header_t *entries;
+    
+    if (!r->handler || strcmp(MD_STATUS_HANDLER, r->handler)) {
+        return DECLINED;
+    }
+    r->allowed = (AP_METHOD_BIT << M_GET);
+    if (r->method_number != M_GET) {
+        return HTTP_METHOD_NOT_ALLOWED;
+    }
+    sc = ap_get_module_config(r->server->module_config, &md_module);
+    if (!sc || !sc->mc || !sc->mc->mds) {
+        return HTTP_NOT_FOUND;
+    }
+    
+    entries = status_entries(sc->mc, r->server, r->pool);
+    if (r->args && !strcmp("prometheus", r->args)) {
+        ap_set_content_type(r, "text/plain; version=0.0.4");
+        status_prometheus(r, entries);
+    }
+    else {
+        ap_set_content_type(r, "application/json");
+        ap_rputs(md_json_writep(status_json(entries, r->pool), r->pool, MD_JSON_FMT_INDENT), r);
+        ap_rputs("\n", r);
+    }
+    return OK;
+}
+
 /**************************************************************************************************/
 /* Require Https hook */
 
+/* The https: URL of the request, on the default port. Requests with a path, as 
+ * nearly all are, get it in one go from the request line as sent. */
+static const char *https_location(request_rec *r, const md_srv_conf_t *sc)
+{
+    const char *host;
+    apr_uri_t uri;
+    
+    if (r->unparsed_uri && r->unparsed_uri[0] == '/') {
+        host = ap_get_server_name_for_url(r);
+        if (sc->https_prefix && !strcmp(host, sc->https_prefix + sizeof("https://") - 1)) {
+            return apr_pstrcat(r->pool, sc->https_prefix, r->unparsed_uri, NULL);
+        }
+        return apr_pstrcat(r->pool, "https://", host, r->unparsed_uri, NULL);
+    }
+    
+    /* absolute URIs in the request line */
+    if (APR_SUCCESS == apr_uri_parse(r->pool, ap_construct_url(r->pool, r->uri, r), &uri)) {
+        uri.scheme = (char*)"https";
+        uri.port = 443;
+        uri.port_str = (char*)"443";
+        uri.query = r->parsed_uri.query;
+        uri.fragment = r->parsed_uri.fragment;
+        return apr_uri_unparse(r->pool, &uri, APR_URI_UNP_OMITUSERINFO);
+    }
+    return NULL;
+}
+
+/* The https: requirement of the MD as in the current snapshot. */
+static md_require_t require_https_get(server_rec *s, const md_t *assigned)
+{
+    const md_snapshot_t *snap;
+    const md_t *md;
+    apr_uint32_t token;
+    md_require_t require_https = assigned->require_https;
+    
+    if (NULL != (snap = snap_acquire(s, &token))) {
+        if (NULL != (md = md_domain_index_get_by_name(snap->index, assigned->name))) {
+            require_https = md->require_https;
+        }
+        snap_release(token);
+    }
+    return require_https;
+}
+
 static int md_require_https_maybe(request_rec *r)
 {
     const md_srv_conf_t *sc;
-    apr_uri_t uri;
+    md_require_t require_https;
     const char *s;
     int status;
     
@@ -1508,11 +4615,13 @@ static int md_require_https_maybe(request_rec *r)
         && strncmp(WELL_KNOWN_PREFIX, r->parsed_uri.path, sizeof(WELL_KNOWN_PREFIX)-1)) {
         
         sc = ap_get_module_config(r->server->module_config, &md_module);
-        if (sc && sc->assigned && sc->assigned->require_https > MD_REQUIRE_OFF) {
+        require_https = (sc && sc->assigned)? 
+                        require_https_get(r->server, sc->assigned) : MD_REQUIRE_OFF;
+        if (require_https > MD_REQUIRE_OFF) {
             if (opt_ssl_is_https(r->connection)) {
                 /* Using https:
                  * if 'permanent' and no one else set a HSTS header already, do it */
-                if (sc->assigned->require_https == MD_REQUIRE_PERMANENT 
+                if (require_https == MD_REQUIRE_PERMANENT 
                     && sc->mc->hsts_header && !apr_table_get(r->headers_out, MD_HSTS_HEADER)) {
                     apr_table_setn(r->headers_out, MD_HSTS_HEADER, sc->mc->hsts_header);
                 }
@@ -1521,27 +4630,19 @@ static int md_require_https_maybe(request_rec *r)
                 /* Not using https:, but require it. Redirect. */
                 if (r->method_number == M_GET) {
                     /* safe to use the old-fashioned codes */
-                    status = ((MD_REQUIRE_PERMANENT == sc->assigned->require_https)? 
+                    status = ((MD_REQUIRE_PERMANENT == require_https)? 
                               HTTP_MOVED_PERMANENTLY : HTTP_MOVED_TEMPORARILY);
                 }
                 else {
                     /* these should keep the method unchanged on retry */
-                    status = ((MD_REQUIRE_PERMANENT == sc->assigned->require_https)? 
+                    status = ((MD_REQUIRE_PERMANENT == require_https)? 
                               HTTP_PERMANENT_REDIRECT : HTTP_TEMPORARY_REDIRECT);
                 }
                 
-                s = ap_construct_url(r->pool, r->uri, r);
-                if (APR_SUCCESS == apr_uri_parse(r->pool, s, &uri)) {
-                    uri.scheme = (char*)"https";
-                    uri.port = 443;
-                    uri.port_str = (char*)"443";
-                    uri.query = r->parsed_uri.query;
-                    uri.fragment = r->parsed_uri.fragment;
-                    s = apr_uri_unparse(r->pool, &uri, APR_URI_UNP_OMITUSERINFO);
-                    if (s && *s) {
-                        apr_table_setn(r->headers_out, "Location", s);
-                        return status;
-                    }
+                s = https_location(r, sc);
+                if (s && *s) {
+                    apr_table_setn(r->headers_out, "Location", s);
+                    return status;
                 }
             }
         }
@@ -1554,8 +4655,10 @@ static int md_require_https_maybe(request_rec *r)
  */
 static void md_child_init(apr_pool_t *pool, server_rec *s)
 {
-    (void)pool;
-    (void)s;
+    cha_cache_init(pool, s);
+    snap_init(pool, s);
+    /* (re-)establish the ACME directory/account cache, should a restart have cleared it */
+    md_acme_init(pool, AP_SERVER_BASEVERSION, 0);
 }
 
 /* Install this module into the apache2 infrastructure.
@@ -1580,6 +4683,7 @@ static void md_hooks(apr_pool_t *pool)
     /* answer challenges *very* early, before any configured authentication may strike */
     ap_hook_post_read_request(md_require_https_maybe, NULL, NULL, APR_HOOK_FIRST);
     ap_hook_post_read_request(md_http_challenge_pr, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_handler(md_status_handler, NULL, NULL, APR_HOOK_MIDDLE);
 
     ap_hook_protocol_propose(md_protocol_propose, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_protocol_switch(md_protocol_switch, NULL, NULL, APR_HOOK_MIDDLE);
@@ -1587,6 +4691,10 @@ static void md_hooks(apr_pool_t *pool)
 
     APR_REGISTER_OPTIONAL_FN(md_is_managed);
     APR_REGISTER_OPTIONAL_FN(md_get_certificate);
+    APR_REGISTER_OPTIONAL_FN(md_get_certificates);
+    APR_REGISTER_OPTIONAL_FN(md_get_certificate_objects);
+    APR_REGISTER_OPTIONAL_FN(md_get_ocsp_response);
+    APR_REGISTER_OPTIONAL_FN(md_get_hot_credentials);
     APR_REGISTER_OPTIONAL_FN(md_is_challenge);
     APR_REGISTER_OPTIONAL_FN(md_get_credentials);
 }
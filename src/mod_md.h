@@ -21,6 +21,7 @@
 #include <openssl/x509v3.h>
 
 struct server_rec;
+struct apr_array_header_t;
 
 APR_DECLARE_OPTIONAL_FN(int, 
                         md_is_managed, (struct server_rec *));
@@ -35,6 +36,64 @@ APR_DECLARE_OPTIONAL_FN(apr_status_t,
                                              const char **pkeyfile, 
                                              const char **pcertfile));
 
+/**
+ * Get all certificate/key pairs for the managed domain, the primary one first,
+ * followed by those for additional key types (e.g. an ECDSA certificate next to
+ * an RSA one). Arrays are of const char* file names, with matching indices.
+ * 
+ * @return APR_EAGAIN if the real certificates are not available yet
+ */
+APR_DECLARE_OPTIONAL_FN(apr_status_t, 
+                        md_get_certificates, (struct server_rec *, apr_pool_t *,
+                                              struct apr_array_header_t **pkeyfiles, 
+                                              struct apr_array_header_t **pcertfiles));
+
+/**
+ * Get the same certificates and keys as md_get_certificates(), in the same order,
+ * as the objects mod_md has parsed: arrays of X509* for the certificates, of 
+ * apr_array_header_t* of X509* for their chains (without the certificate itself)
+ * and of EVP_PKEY*, all with matching indices. Servers using the same MD share the 
+ * objects, which live as long as the pool and must not be modified.
+ * 
+ * @return APR_EAGAIN if the real certificates are not available yet, APR_ENOENT
+ *         if there are no objects to hand out, e.g. for a fallback certificate.
+ *         md_get_certificates() then gives the files to use.
+ */
+APR_DECLARE_OPTIONAL_FN(apr_status_t, 
+                        md_get_certificate_objects, (struct server_rec *, apr_pool_t *p,
+                                                     struct apr_array_header_t **pcerts,
+                                                     struct apr_array_header_t **pchains,
+                                                     struct apr_array_header_t **ppkeys));
+
+/**
+ * Get the keys and certificates of a managed domain that the watchdog activated
+ * after server start ("MDActivationMode hot"), to be used in place of the ones
+ * configured in the SSL_CTX. To be called on each handshake. As with
+ * md_get_certificate_objects(), there is one entry per key spec, the primary
+ * first: pcerts has X509*, pchains arrays of X509* and ppkeys EVP_PKEY*. All
+ * returned objects live as long as the pool.
+ * 
+ * @return APR_ENOENT if the configured certificates are still the current ones
+ */
+APR_DECLARE_OPTIONAL_FN(apr_status_t, 
+                        md_get_hot_credentials, (struct server_rec *, apr_pool_t *p,
+                                                 struct apr_array_header_t **pcerts,
+                                                 struct apr_array_header_t **pchains,
+                                                 struct apr_array_header_t **ppkeys));
+
+/**
+ * Get the DER encoded OCSP response for a managed certificate, as fetched and
+ * cached by mod_md, to staple it in the TLS handshake. Responses are only 
+ * fetched with "MDStapling on".
+ * 
+ * @return APR_ENOENT if there is no valid response for the certificate (yet)
+ */
+APR_DECLARE_OPTIONAL_FN(apr_status_t, 
+                        md_get_ocsp_response, (struct server_rec *, X509 *cert, 
+                                               apr_pool_t *p,
+                                               const unsigned char **pder, 
+                                               apr_size_t *pderlen));
+
 APR_DECLARE_OPTIONAL_FN(int, 
                         md_is_challenge, (struct conn_rec *, const char *,
                                           X509 **pcert, EVP_PKEY **pkey));
@@ -24,9 +24,14 @@
 #include <http_config.h>
 #include <http_log.h>
 #include <http_vhost.h>
+#include <ap_provider.h>
+#include <ap_socache.h>
 
 #include "md.h"
+#include "md_acme.h"
 #include "md_crypt.h"
+#include "md_log.h"
+#include "md_store.h"
 #include "md_util.h"
 #include "mod_md_private.h"
 #include "mod_md_config.h"
@@ -35,24 +40,42 @@
 #define MD_CMD_OLD_MD         "ManagedDomain"
 #define MD_CMD_MD_SECTION     "<MDomainSet"
 #define MD_CMD_MD_OLD_SECTION "<ManagedDomain"
+#define MD_CMD_ACTIVATION     "MDActivationMode"
+#define MD_CMD_ACTWINDOW      "MDActivationWindow"
 #define MD_CMD_BASE_SERVER    "MDBaseServer"
 #define MD_CMD_CA             "MDCertificateAuthority"
 #define MD_CMD_CAAGREEMENT    "MDCertificateAgreement"
 #define MD_CMD_CACHALLENGES   "MDCAChallenges"
 #define MD_CMD_CAPROTO        "MDCertificateProtocol"
+#define MD_CMD_CARATELIMIT    "MDCARateLimit"
+#define MD_CMD_CONSOLIDATE    "MDConsolidate"
 #define MD_CMD_DRIVEMODE      "MDDriveMode"
+#define MD_CMD_FALLBACKKEY    "MDFallbackKey"
 #define MD_CMD_MEMBER         "MDMember"
 #define MD_CMD_MEMBERS        "MDMembers"
 #define MD_CMD_MUSTSTAPLE     "MDMustStaple"
 #define MD_CMD_NOTIFYCMD      "MDNotifyCmd"
 #define MD_CMD_PORTMAP        "MDPortMap"
 #define MD_CMD_PKEYS          "MDPrivateKeys"
+#define MD_CMD_PKEYPOOL       "MDPrivateKeyPool"
 #define MD_CMD_PROXY          "MDHttpProxy"
+#define MD_CMD_RENEWCONCUR    "MDRenewConcurrency"
+#define MD_CMD_RENEWLEASE     "MDRenewLease"
+#define MD_CMD_RENEWPRESTAGE  "MDRenewPrestage"
+#define MD_CMD_RENEWVIAARI    "MDRenewViaARI"
 #define MD_CMD_RENEWWINDOW    "MDRenewWindow"
 #define MD_CMD_REQUIREHTTPS   "MDRequireHttps"
+#define MD_CMD_STAPLING       "MDStapling"
 #define MD_CMD_STOREDIR       "MDStoreDir"
+#define MD_CMD_STOREDURABLE   "MDStoreDurability"
+#define MD_CMD_STOREFORMAT    "MDStoreFormat"
+#define MD_CMD_STORESOCACHE   "MDStoreSocache"
+#define MD_CMD_TRACE          "MDTrace"
+#define MD_CMD_TRACELOG       "MDTraceLog"
 
 #define MD_CMD_DNS01CMD       "MDChallengeDns01"
+#define MD_CMD_DNS01BATCH     "MDChallengeDns01Batch"
+#define MD_CMD_DNS01CHECK     "MDChallengeDns01Check"
 
 #define DEF_VAL     (-1)
 
@@ -72,6 +95,34 @@ static md_mod_conf_t defmc = {
     NULL,
     NULL,
     NULL,
+    NULL,
+    1,
+    0,
+    0,
+    0,
+    NULL,
+    NULL,
+    0,
+    NULL,
+    0,
+    0,
+    0,
+    0,
+    0,
+    NULL,
+    NULL,
+    NULL,
+    apr_time_from_sec(60),
+    MD_DURABLE_NONE,
+    0,
+    0,
+    0,
+    NULL,
+    1,
+    0,
+    0,
+    MD_CONSOLIDATE_OFF,
+    100,
 };
 
 /* Default server specific setting */
@@ -85,9 +136,11 @@ static md_srv_conf_t defconf = {
     MD_DRIVE_AUTO,
     0,
     NULL, 
+    NULL,
     apr_time_from_sec(90 * MD_SECS_PER_DAY), /* If the cert lifetime were 90 days, renew */
     apr_time_from_sec(30 * MD_SECS_PER_DAY), /* 30 days before. Adjust to actual lifetime */
     MD_ACME_DEF_URL,
+    NULL,
     "ACME",
     NULL,
     NULL,
@@ -132,9 +185,11 @@ static void srv_conf_props_clear(md_srv_conf_t *sc)
     sc->drive_mode = DEF_VAL;
     sc->must_staple = DEF_VAL;
     sc->pkey_spec = NULL;
+    sc->alt_pkey_specs = NULL;
     sc->renew_norm = DEF_VAL;
     sc->renew_window = DEF_VAL;
     sc->ca_url = NULL;
+    sc->ca_urls = NULL;
     sc->ca_proto = NULL;
     sc->ca_agreement = NULL;
     sc->ca_challenges = NULL;
@@ -147,9 +202,11 @@ static void srv_conf_props_copy(md_srv_conf_t *to, const md_srv_conf_t *from)
     to->drive_mode = from->drive_mode;
     to->must_staple = from->must_staple;
     to->pkey_spec = from->pkey_spec;
+    to->alt_pkey_specs = from->alt_pkey_specs;
     to->renew_norm = from->renew_norm;
     to->renew_window = from->renew_window;
     to->ca_url = from->ca_url;
+    to->ca_urls = from->ca_urls;
     to->ca_proto = from->ca_proto;
     to->ca_agreement = from->ca_agreement;
     to->ca_challenges = from->ca_challenges;
@@ -161,11 +218,17 @@ static void srv_conf_props_apply(md_t *md, const md_srv_conf_t *from, apr_pool_t
     if (from->transitive != DEF_VAL) md->transitive = from->transitive;
     if (from->drive_mode != DEF_VAL) md->drive_mode = from->drive_mode;
     if (from->must_staple != DEF_VAL) md->must_staple = from->must_staple;
-    if (from->pkey_spec) md->pkey_spec = from->pkey_spec;
+    if (from->pkey_spec) {
+        md->pkey_spec = from->pkey_spec;
+        md->alt_pkey_specs = from->alt_pkey_specs;
+    }
     if (from->renew_norm != DEF_VAL) md->renew_norm = from->renew_norm;
     if (from->renew_window != DEF_VAL) md->renew_window = from->renew_window;
 
-    if (from->ca_url) md->ca_url = from->ca_url;
+    if (from->ca_url) {
+        md->ca_url = from->ca_url;
+        md->ca_urls = from->ca_urls;
+    }
     if (from->ca_proto) md->ca_proto = from->ca_proto;
     if (from->ca_agreement) md->ca_agreement = from->ca_agreement;
     if (from->ca_challenges) md->ca_challenges = apr_array_copy(p, from->ca_challenges);
@@ -201,16 +264,19 @@ static void *md_config_merge(apr_pool_t *pool, void *basev, void *addv)
     nsc->drive_mode = (add->drive_mode != DEF_VAL)? add->drive_mode : base->drive_mode;
     nsc->must_staple = (add->must_staple != DEF_VAL)? add->must_staple : base->must_staple;
     nsc->pkey_spec = add->pkey_spec? add->pkey_spec : base->pkey_spec;
+    nsc->alt_pkey_specs = add->pkey_spec? add->alt_pkey_specs : base->alt_pkey_specs;
     nsc->renew_window = (add->renew_norm != DEF_VAL)? add->renew_norm : base->renew_norm;
     nsc->renew_window = (add->renew_window != DEF_VAL)? add->renew_window : base->renew_window;
 
     nsc->ca_url = add->ca_url? add->ca_url : base->ca_url;
+    nsc->ca_urls = add->ca_url? add->ca_urls : base->ca_urls;
     nsc->ca_proto = add->ca_proto? add->ca_proto : base->ca_proto;
     nsc->ca_agreement = add->ca_agreement? add->ca_agreement : base->ca_agreement;
     nsc->ca_challenges = (add->ca_challenges? apr_array_copy(pool, add->ca_challenges) 
                     : (base->ca_challenges? apr_array_copy(pool, base->ca_challenges) : NULL));
     nsc->current = NULL;
     nsc->assigned = NULL;
+    nsc->https_prefix = NULL;
     
     return nsc;
 }
@@ -389,16 +455,29 @@ static const char *md_config_set_names(cmd_parms *cmd, void *dc,
     return NULL;
 }
 
-static const char *md_config_set_ca(cmd_parms *cmd, void *dc, const char *value)
+static const char *md_config_set_ca(cmd_parms *cmd, void *dc, 
+                                    int argc, char *const argv[])
 {
     md_srv_conf_t *sc = md_config_get(cmd->server);
     const char *err;
+    int i;
 
     (void)dc;
     if (!inside_md_section(cmd) && (err = ap_check_cmd_context(cmd, GLOBAL_ONLY))) {
         return err;
     }
-    sc->ca_url = value;
+    if (argc < 1) {
+        return "needs at least one url";
+    }
+    sc->ca_url = argv[0];
+    sc->ca_urls = NULL;
+    if (argc > 1) {
+        /* more than one CA: the first is preferred, the others used when it fails */
+        sc->ca_urls = apr_array_make(cmd->pool, argc, sizeof(const char *));
+        for (i = 0; i < argc; ++i) {
+            APR_ARRAY_PUSH(sc->ca_urls, const char *) = argv[i];
+        }
+    }
     return NULL;
 }
 
@@ -499,6 +578,48 @@ static const char *md_config_set_base_server(cmd_parms *cmd, void *dc, const cha
     return err;
 }
 
+static const char *md_config_set_activation(cmd_parms *cmd, void *dc, const char *value)
+{
+    md_srv_conf_t *config = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    (void)dc;
+    if (!err) {
+        if (!apr_strnatcasecmp("restart", value)) {
+            config->mc->hot_activation = 0;
+        }
+        else if (!apr_strnatcasecmp("hot", value)) {
+            config->mc->hot_activation = 1;
+        }
+        else {
+            err = apr_pstrcat(cmd->pool, "unknown '", value, 
+                              "', supported parameter values are 'restart' and 'hot'", NULL);
+        }
+    }
+    return err;
+}
+
+static const char *md_config_set_stapling(cmd_parms *cmd, void *dc, const char *value)
+{
+    md_srv_conf_t *config = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    (void)dc;
+    if (!err) {
+        if (!apr_strnatcasecmp("off", value)) {
+            config->mc->stapling = 0;
+        }
+        else if (!apr_strnatcasecmp("on", value)) {
+            config->mc->stapling = 1;
+        }
+        else {
+            err = apr_pstrcat(cmd->pool, "unknown '", value, 
+                              "', supported parameter values are 'on' and 'off'", NULL);
+        }
+    }
+    return err;
+}
+
 static const char *md_config_set_require_https(cmd_parms *cmd, void *dc, const char *value)
 {
     md_srv_conf_t *config = md_config_get(cmd->server);
@@ -611,6 +732,271 @@ static const char *md_config_set_renew_window(cmd_parms *cmd, void *dc, const ch
     return "MDRenewWindow has unrecognized format";
 }
 
+static const char *daytime_parse(const char *value, const char **pend, 
+                                 apr_interval_time_t *ptime)
+{
+    char *endp;
+    apr_int64_t h, m = 0;
+    
+    h = apr_strtoi64(value, &endp, 10);
+    if (errno || endp == value || h < 0 || h > 24) {
+        return "hour of day must be between 0 and 24";
+    }
+    if (*endp == ':') {
+        value = endp + 1;
+        m = apr_strtoi64(value, &endp, 10);
+        if (errno || endp == value || m < 0 || m > 59 || (h == 24 && m > 0)) {
+            return "minutes must be between 0 and 59";
+        }
+    }
+    *ptime = apr_time_from_sec((h * 60 + m) * 60);
+    *pend = endp;
+    return NULL;
+}
+
+static const char *md_config_set_activation_window(cmd_parms *cmd, void *dc, 
+                                                   const char *v1, const char *v2)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    const char *endp;
+    apr_interval_time_t start, end, delay;
+
+    (void)dc;
+    if (err) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("any", v1)) {
+        start = end = 0;
+    }
+    else if ((err = daytime_parse(v1, &endp, &start))) {
+        return err;
+    }
+    else if (*endp != '-') {
+        return "window must be given as 'HH:MM-HH:MM' or 'any'";
+    }
+    else if ((err = daytime_parse(endp + 1, &endp, &end))) {
+        return err;
+    }
+    else if (*endp) {
+        return "window must be given as 'HH:MM-HH:MM' or 'any'";
+    }
+    sc->mc->activation_start = start;
+    sc->mc->activation_end = end;
+    
+    if (v2) {
+        if (duration_parse(v2, &delay, "s") != APR_SUCCESS || delay < 0) {
+            return "coalescing delay has unrecognized format";
+        }
+        sc->mc->activation_delay = delay;
+    }
+    return NULL;
+}
+
+static const char *md_config_set_store_socache(cmd_parms *cmd, void *dc, 
+                                               const char *v1, const char *v2)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    const ap_socache_provider_t *provider;
+    apr_interval_time_t max_age;
+    char *name, *sep;
+
+    (void)dc;
+    if (err) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("off", v1)) {
+        sc->mc->store_socache = NULL;
+        return NULL;
+    }
+    name = apr_pstrdup(cmd->pool, v1);
+    if (NULL != (sep = strchr(name, ':'))) {
+        *sep++ = '\0';
+    }
+    provider = ap_lookup_provider(AP_SOCACHE_PROVIDER_GROUP, name, AP_SOCACHE_PROVIDER_VERSION);
+    if (!provider) {
+        return apr_psprintf(cmd->pool, "unknown socache provider '%s', maybe you need "
+                            "to load the appropriate socache module (mod_socache_%s?)", 
+                            name, name);
+    }
+    if (provider->flags & AP_SOCACHE_FLAG_NOTMPSAFE) {
+        return apr_psprintf(cmd->pool, "socache provider '%s' cannot be shared by processes "
+                            "without a mutex and is not supported for the store", name);
+    }
+    if (v2) {
+        if (duration_parse(v2, &max_age, "s") != APR_SUCCESS || max_age < 0) {
+            return "maximum age has unrecognized format";
+        }
+        sc->mc->store_max_age = max_age;
+    }
+    sc->mc->store_socache = provider;
+    sc->mc->store_socache_args = sep;
+    return NULL;
+}
+
+static const char *md_config_set_ca_rate_limit(cmd_parms *cmd, void *dc, 
+                                               const char *kind, const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_interval_time_t period;
+    apr_int64_t count;
+    const char *s;
+    char *end;
+    int i;
+
+    (void)dc;
+    if (err) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("requests", kind)) i = MD_ACME_RL_REQUESTS;
+    else if (!apr_strnatcasecmp("orders", kind)) i = MD_ACME_RL_ORDERS;
+    else if (!apr_strnatcasecmp("certs", kind)) i = MD_ACME_RL_CERTS;
+    else if (!apr_strnatcasecmp("failed-validations", kind)) i = MD_ACME_RL_FAILED;
+    else {
+        return apr_pstrcat(cmd->pool, "unknown rate limit '", kind, "', supported are "
+                           "'requests', 'orders', 'certs' and 'failed-validations'", NULL);
+    }
+    if (!sc->mc->ca_limits) {
+        sc->mc->ca_limits = apr_pcalloc(cmd->pool, MD_ACME_RL_COUNT * sizeof(md_acme_rl_t));
+    }
+    if (!apr_strnatcasecmp("off", value)) {
+        sc->mc->ca_limits[i].count = 0;
+        sc->mc->ca_limits[i].period = 0;
+        return NULL;
+    }
+    count = apr_strtoi64(value, &end, 10);
+    s = end;
+    if (s == value || *s != '/' || count <= 0 || count > INT_MAX
+        || duration_parse(s + 1, &period, "s") != APR_SUCCESS || period <= 0) {
+        return "rate limit must be 'off' or <count>/<duration>, e.g. '300/3h'";
+    }
+    sc->mc->ca_limits[i].count = (int)count;
+    sc->mc->ca_limits[i].period = period;
+    return NULL;
+}
+
+static const char *md_config_set_renew_prestage(cmd_parms *cmd, void *dc, const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_interval_time_t ahead;
+
+    (void)dc;
+    if (err) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("off", value)) {
+        sc->mc->renew_prestage = 0;
+        return NULL;
+    }
+    if (duration_parse(value, &ahead, "d") != APR_SUCCESS || ahead <= 0) {
+        return "prestage duration has unrecognized format";
+    }
+    sc->mc->renew_prestage = ahead;
+    return NULL;
+}
+
+static const char *md_config_set_renew_via_ari(cmd_parms *cmd, void *dc, const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    (void)dc;
+    if (err) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("on", value)) {
+        sc->mc->renew_via_ari = 1;
+    }
+    else if (!apr_strnatcasecmp("off", value)) {
+        sc->mc->renew_via_ari = 0;
+    }
+    else {
+        return apr_pstrcat(cmd->pool, "unknown '", value, 
+                           "', supported parameter values are 'on' and 'off'", NULL);
+    }
+    return NULL;
+}
+
+static const char *md_config_set_renew_lease(cmd_parms *cmd, void *dc, 
+                                             const char *v1, const char *v2)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_interval_time_t ttl;
+    char *hostname;
+
+    (void)dc;
+    if (err) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("off", v1)) {
+        sc->mc->lease_ttl = 0;
+        return NULL;
+    }
+    if (duration_parse(v1, &ttl, "s") != APR_SUCCESS || ttl <= 0) {
+        return "lease duration has unrecognized format";
+    }
+    sc->mc->lease_ttl = ttl;
+    if (v2) {
+        sc->mc->lease_owner = v2;
+    }
+    else if (!sc->mc->lease_owner) {
+        hostname = apr_pcalloc(cmd->pool, APRMAXHOSTLEN + 1);
+        if (APR_SUCCESS != apr_gethostname(hostname, APRMAXHOSTLEN + 1, cmd->pool)) {
+            return "unable to determine host name, please name this server in the lease";
+        }
+        sc->mc->lease_owner = hostname;
+    }
+    return NULL;
+}
+
+static const char *md_config_set_renew_concurrency(cmd_parms *cmd, void *arg, 
+                                                   const char *v1, const char *v2)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    int n, n_ca = 0;
+
+    (void)arg;
+    if (err) {
+        return err;
+    }
+    n = (int)apr_atoi64(v1);
+    if (n <= 0) {
+        return "MDRenewConcurrency must be a positive number";
+    }
+    if (v2) {
+        n_ca = (int)apr_atoi64(v2);
+        if (n_ca <= 0) {
+            return "MDRenewConcurrency per CA must be a positive number";
+        }
+    }
+    sc->mc->renew_concurrency = n;
+    sc->mc->renew_ca_concurrency = n_ca;
+    return NULL;
+}
+
+static const char *md_config_set_pkey_pool(cmd_parms *cmd, void *arg, const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_int64_t n;
+
+    (void)arg;
+    if (err) {
+        return err;
+    }
+    n = apr_atoi64(value);
+    if (n < 0 || n > 1000) {
+        return "MDPrivateKeyPool must be a number between 0 and 1000";
+    }
+    sc->mc->pkey_pool_size = (int)n;
+    return NULL;
+}
+
 static const char *md_config_set_proxy(cmd_parms *cmd, void *arg, const char *value)
 {
     md_srv_conf_t *sc = md_config_get(cmd->server);
@@ -641,6 +1027,148 @@ static const char *md_config_set_store_dir(cmd_parms *cmd, void *arg, const char
     return NULL;
 }
 
+static const char *md_config_set_store_durability(cmd_parms *cmd, void *arg, 
+                                                  const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    (void)arg;
+    if (err) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("none", value)) {
+        sc->mc->store_durability = MD_DURABLE_NONE;
+    }
+    else if (!apr_strnatcasecmp("file", value)) {
+        sc->mc->store_durability = MD_DURABLE_FILE;
+    }
+    else if (!apr_strnatcasecmp("dir", value)) {
+        sc->mc->store_durability = MD_DURABLE_DIR;
+    }
+    else {
+        return apr_psprintf(cmd->pool, "unknown '%s', supported are 'none', 'file' "
+                            "and 'dir'", value);
+    }
+    return NULL;
+}
+
+static const char *md_config_set_store_format(cmd_parms *cmd, void *arg, const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    (void)arg;
+    if (err) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("json", value)) {
+        sc->mc->store_binary = 0;
+    }
+    else if (!apr_strnatcasecmp("binary", value)) {
+        sc->mc->store_binary = 1;
+    }
+    else {
+        return apr_psprintf(cmd->pool, "unknown '%s', supported are 'json' and 'binary'", 
+                            value);
+    }
+    return NULL;
+}
+
+static const char *md_config_set_trace(cmd_parms *cmd, void *arg, const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_int64_t n;
+
+    (void)arg;
+    if (err) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("off", value)) {
+        n = 0;
+    }
+    else if (!apr_strnatcasecmp("on", value)) {
+        n = 4096;
+    }
+    else {
+        n = apr_atoi64(value);
+        if (n < 0 || n > 1024*1024) {
+            return "MDTrace must be 'on', 'off' or a number of records between 0 and 1048576";
+        }
+    }
+    sc->mc->trace_records = (int)n;
+    return NULL;
+}
+
+static const char *md_config_set_trace_log(cmd_parms *cmd, void *arg, 
+                                           const char *v1, const char *v2)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_int64_t n = 1024;
+    int level;
+
+    (void)arg;
+    if (err) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("off", v1)) {
+        sc->mc->trace_log_level = 0;
+        sc->mc->trace_log_records = 0;
+        return NULL;
+    }
+    for (level = MD_LOG_TRACE1; level <= MD_LOG_TRACE8; ++level) {
+        if (!apr_strnatcasecmp(md_log_level_name((md_log_level_t)level), v1)) break;
+    }
+    if (level > MD_LOG_TRACE8) {
+        return "MDTraceLog must be 'off' or a level from 'trace1' to 'trace8'";
+    }
+    if (v2) {
+        n = apr_atoi64(v2);
+        if (n <= 0 || n > 1024*1024) {
+            return "MDTraceLog needs a number of records between 1 and 1048576";
+        }
+    }
+    sc->mc->trace_log_level = level;
+    sc->mc->trace_log_records = (int)n;
+    return NULL;
+}
+
+static const char *md_config_set_consolidate(cmd_parms *cmd, void *arg, 
+                                             const char *v1, const char *v2)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_int64_t n = 100;
+
+    (void)arg;
+    if (err) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("off", v1)) {
+        sc->mc->consolidate = MD_CONSOLIDATE_OFF;
+    }
+    else if (!apr_strnatcasecmp("suggest", v1)) {
+        sc->mc->consolidate = MD_CONSOLIDATE_SUGGEST;
+    }
+    else if (!apr_strnatcasecmp("on", v1)) {
+        sc->mc->consolidate = MD_CONSOLIDATE_ON;
+    }
+    else {
+        return apr_psprintf(cmd->pool, "unknown '%s', supported are 'off', 'suggest' "
+                            "and 'on'", v1);
+    }
+    if (v2) {
+        n = apr_atoi64(v2);
+        if (n < 2 || n > 1000) {
+            return "MDConsolidate needs a number of names between 2 and 1000";
+        }
+    }
+    sc->mc->consolidate_max = (int)n;
+    return NULL;
+}
+
 static const char *set_port_map(md_mod_conf_t *mc, const char *value)
 {
     int net_port, local_port;
@@ -721,18 +1249,12 @@ static const char *md_config_set_cha_tyes(cmd_parms *cmd, void *dc,
     return NULL;
 }
 
-static const char *md_config_set_pkeys(cmd_parms *cmd, void *dc, 
-                                       int argc, char *const argv[])
+static const char *parse_pkey_spec(md_pkey_spec_t **pspec, cmd_parms *cmd, 
+                                   int argc, char *const argv[])
 {
-    md_srv_conf_t *config = md_config_get(cmd->server);
-    const char *err, *ptype;
+    const char *ptype, *curve;
     apr_int64_t bits;
     
-    (void)dc;
-    if (!inside_md_section(cmd)
-        && (err = ap_check_cmd_context(cmd, GLOBAL_ONLY))) {
-        return err;
-    }
     if (argc <= 0) {
         return "needs to specify the private key type";
     }
@@ -742,10 +1264,10 @@ static const char *md_config_set_pkeys(cmd_parms *cmd, void *dc,
         if (argc > 1) {
             return "type 'Default' takes no parameter";
         }
-        if (!config->pkey_spec) {
-            config->pkey_spec = apr_pcalloc(cmd->pool, sizeof(*config->pkey_spec));
+        if (!*pspec) {
+            *pspec = apr_pcalloc(cmd->pool, sizeof(**pspec));
         }
-        config->pkey_spec->type = MD_PKEY_TYPE_DEFAULT;
+        (*pspec)->type = MD_PKEY_TYPE_DEFAULT;
         return NULL;
     }
     else if (!apr_strnatcasecmp("RSA", ptype)) {
@@ -765,16 +1287,120 @@ static const char *md_config_set_pkeys(cmd_parms *cmd, void *dc,
             return "key type 'RSA' has only one optional parameter, the number of bits";
         }
 
-        if (!config->pkey_spec) {
-            config->pkey_spec = apr_pcalloc(cmd->pool, sizeof(*config->pkey_spec));
+        if (!*pspec) {
+            *pspec = apr_pcalloc(cmd->pool, sizeof(**pspec));
         }
-        config->pkey_spec->type = MD_PKEY_TYPE_RSA;
-        config->pkey_spec->params.rsa.bits = (unsigned int)bits;
+        (*pspec)->type = MD_PKEY_TYPE_RSA;
+        (*pspec)->params.rsa.bits = (unsigned int)bits;
+        return NULL;
+    }
+    else if (!apr_strnatcasecmp("EC", ptype)) {
+        if (argc == 1) {
+            curve = md_pkey_ec_curve_name(MD_PKEY_EC_CURVE_DEF);
+        }
+        else if (argc == 2) {
+            if (!(curve = md_pkey_ec_curve_name(argv[1]))) {
+                return apr_psprintf(cmd->pool, "unsupported curve '%s', use one of "
+                                    "'P-256' or 'P-384'", argv[1]);
+            }
+        }
+        else {
+            return "key type 'EC' has only one optional parameter, the name of the curve";
+        }
+
+        if (!*pspec) {
+            *pspec = apr_pcalloc(cmd->pool, sizeof(**pspec));
+        }
+        (*pspec)->type = MD_PKEY_TYPE_EC;
+        (*pspec)->params.ec.curve = curve;
         return NULL;
     }
     return apr_pstrcat(cmd->pool, "unsupported private key type \"", ptype, "\"", NULL);
 }
 
+static int is_pkey_type(const char *s)
+{
+    return (!apr_strnatcasecmp("Default", s) 
+            || !apr_strnatcasecmp("RSA", s) 
+            || !apr_strnatcasecmp("EC", s));
+}
+
+static const char *md_config_set_pkeys(cmd_parms *cmd, void *dc, 
+                                       int argc, char *const argv[])
+{
+    md_srv_conf_t *config = md_config_get(cmd->server);
+    md_pkey_spec_t *spec, *other;
+    const char *err, *fname;
+    int i, j, k;
+    
+    (void)dc;
+    if (!inside_md_section(cmd)
+        && (err = ap_check_cmd_context(cmd, GLOBAL_ONLY))) {
+        return err;
+    }
+    
+    /* The first key spec is for the primary certificate, any further one
+     * gets an additional certificate, e.g. "MDPrivateKeys RSA 3072 EC P-256" */
+    for (j = (argc > 0)? 1 : 0; j < argc && !is_pkey_type(argv[j]); ++j);
+    if ((err = parse_pkey_spec(&config->pkey_spec, cmd, j, argv))) {
+        return err;
+    }
+    config->alt_pkey_specs = NULL;
+    for (i = j; i < argc; i = j) {
+        for (j = i + 1; j < argc && !is_pkey_type(argv[j]); ++j);
+        spec = NULL;
+        if ((err = parse_pkey_spec(&spec, cmd, j - i, argv + i))) {
+            return err;
+        }
+        /* key specs that produce the same kind of key would share their files */
+        fname = md_pkey_fname_for(spec, cmd->pool);
+        if (!strcmp(fname, md_pkey_fname_for(config->pkey_spec, cmd->pool))) {
+            return apr_pstrcat(cmd->pool, "private key type \"", argv[i], 
+                               "\" is specified more than once", NULL);
+        }
+        if (!config->alt_pkey_specs) {
+            config->alt_pkey_specs = apr_array_make(cmd->pool, 3, sizeof(md_pkey_spec_t*));
+        }
+        for (k = 0; k < config->alt_pkey_specs->nelts; ++k) {
+            other = APR_ARRAY_IDX(config->alt_pkey_specs, k, md_pkey_spec_t*);
+            if (!strcmp(fname, md_pkey_fname_for(other, cmd->pool))) {
+                return apr_pstrcat(cmd->pool, "private key type \"", argv[i], 
+                                   "\" is specified more than once", NULL);
+            }
+        }
+        APR_ARRAY_PUSH(config->alt_pkey_specs, md_pkey_spec_t*) = spec;
+    }
+    return NULL;
+}
+
+static const char *md_config_set_fallback_key(cmd_parms *cmd, void *dc, 
+                                              int argc, char *const argv[])
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    
+    (void)dc;
+    if (err) {
+        return err;
+    }
+    if (argc <= 0) {
+        return "needs to specify 'individual' or 'shared'";
+    }
+    if (!apr_strnatcasecmp("individual", argv[0])) {
+        if (argc > 1) {
+            return "'individual' takes no further parameter";
+        }
+        sc->mc->fallback_shared = 0;
+        return NULL;
+    }
+    else if (!apr_strnatcasecmp("shared", argv[0])) {
+        sc->mc->fallback_shared = 1;
+        return (argc > 1)? parse_pkey_spec(&sc->mc->fallback_pkey_spec, cmd, argc-1, argv+1) : NULL;
+    }
+    return apr_pstrcat(cmd->pool, "unknown value '", argv[0], 
+                       "', use 'individual' or 'shared'", NULL);
+}
+
 static const char *md_config_set_notify_cmd(cmd_parms *cmd, void *mconfig, const char *arg)
 {
     md_srv_conf_t *sc = md_config_get(cmd->server);
@@ -801,15 +1427,82 @@ static const char *md_config_set_dns01_cmd(cmd_parms *cmd, void *mconfig, const
     return NULL;
 }
 
+static const char *md_config_set_dns01_batch(cmd_parms *cmd, void *mconfig, const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    (void)mconfig;
+    if (err) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("on", value)) {
+        apr_table_set(sc->mc->env, MD_KEY_CMD_DNS01_BATCH, "on");
+    }
+    else if (!apr_strnatcasecmp("off", value)) {
+        apr_table_unset(sc->mc->env, MD_KEY_CMD_DNS01_BATCH);
+    }
+    else {
+        return apr_pstrcat(cmd->pool, "unknown '", value, 
+                           "', supported parameter values are 'on' and 'off'", NULL);
+    }
+    return NULL;
+}
+
+static const char *md_config_set_dns01_check(cmd_parms *cmd, void *mconfig, 
+                                             const char *url, const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_interval_time_t timeout;
+
+    (void)mconfig;
+    if (err) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("off", url)) {
+        apr_table_unset(sc->mc->env, MD_KEY_DNS01_CHECK);
+        apr_table_unset(sc->mc->env, MD_KEY_DNS01_CHECK_TIMEOUT);
+        return NULL;
+    }
+    if (strncmp("https://", url, 8)) {
+        return "the DNS query service needs to be an https: url";
+    }
+    apr_table_set(sc->mc->env, MD_KEY_DNS01_CHECK, url);
+    if (value) {
+        if (duration_parse(value, &timeout, "s") != APR_SUCCESS || timeout <= 0) {
+            return "invalid timeout for checking DNS records";
+        }
+        apr_table_set(sc->mc->env, MD_KEY_DNS01_CHECK_TIMEOUT, 
+                      apr_ltoa(cmd->pool, (long)apr_time_sec(timeout)));
+    }
+    return NULL;
+}
+
 const command_rec md_cmds[] = {
-    AP_INIT_TAKE1(     MD_CMD_CA, md_config_set_ca, NULL, RSRC_CONF, 
-                  "URL of CA issuing the certificates"),
+    AP_INIT_TAKE1(     MD_CMD_ACTIVATION, md_config_set_activation, NULL, RSRC_CONF, 
+                  "'restart' activates renewed certificates by a graceful server restart, "
+                  "'hot' lets running child processes switch to them"),
+    AP_INIT_TAKE12(    MD_CMD_ACTWINDOW, md_config_set_activation_window, NULL, RSRC_CONF, 
+                  "Daily time window 'HH:MM-HH:MM' (or 'any') for activating renewed "
+                  "certificates, optionally followed by the time to wait for further "
+                  "renewals, so that they are activated together."),
+    AP_INIT_TAKE_ARGV( MD_CMD_CA, md_config_set_ca, NULL, RSRC_CONF, 
+                  "URL of CA issuing the certificates, optionally followed by the URLs "
+                  "of CAs to use when it is unavailable or slow"),
     AP_INIT_TAKE1(     MD_CMD_CAAGREEMENT, md_config_set_agreement, NULL, RSRC_CONF, 
                   "either 'accepted' or the URL of CA Terms-of-Service agreement you accept"),
     AP_INIT_TAKE_ARGV( MD_CMD_CACHALLENGES, md_config_set_cha_tyes, NULL, RSRC_CONF, 
                       "A list of challenge types to be used."),
     AP_INIT_TAKE1(     MD_CMD_CAPROTO, md_config_set_ca_proto, NULL, RSRC_CONF, 
                   "Protocol used to obtain/renew certificates"),
+    AP_INIT_TAKE2(     MD_CMD_CARATELIMIT, md_config_set_ca_rate_limit, NULL, RSRC_CONF, 
+                  "Limit the 'requests', 'orders', 'certs' (per registered domain) or "
+                  "'failed-validations' at each CA: 'off' or <count>/<duration>."),
+    AP_INIT_TAKE12(    MD_CMD_CONSOLIDATE, md_config_set_consolidate, NULL, RSRC_CONF, 
+                  "'on' to have MDs configured alike share certificates, 'suggest' to log "
+                  "which could. Optionally followed by the most names in a certificate, "
+                  "100 by default."),
     AP_INIT_TAKE1(     MD_CMD_DRIVEMODE, md_config_set_drive_mode, NULL, RSRC_CONF, 
                   "method of obtaining certificates for the managed domain"),
     AP_INIT_TAKE_ARGV( MD_CMD_MD, md_config_set_names, NULL, RSRC_CONF, 
@@ -829,16 +1522,56 @@ const command_rec md_cmds[] = {
                   "to indicate that the server port 8000 is reachable as port 80 from the "
                   "internet. Use 80:- to indicate that port 80 is not reachable from "
                   "the outside."),
+    AP_INIT_TAKE_ARGV( MD_CMD_FALLBACKKEY, md_config_set_fallback_key, NULL, RSRC_CONF, 
+                  "'individual' generates a key for each fallback certificate, 'shared' "
+                  "uses one key for all of them, optionally followed by its type and "
+                  "parameters as in MDPrivateKeys"),
     AP_INIT_TAKE_ARGV( MD_CMD_PKEYS, md_config_set_pkeys, NULL, RSRC_CONF, 
                   "set the type and parameters for private key generation"),
+    AP_INIT_TAKE1(     MD_CMD_PKEYPOOL, md_config_set_pkey_pool, NULL, RSRC_CONF, 
+                  "number of private keys to generate ahead of time for each key type in "
+                  "use, 0 (the default) disables this"),
     AP_INIT_TAKE1(     MD_CMD_PROXY, md_config_set_proxy, NULL, RSRC_CONF, 
                   "URL of a HTTP(S) proxy to use for outgoing connections"),
     AP_INIT_TAKE1(     MD_CMD_STOREDIR, md_config_set_store_dir, NULL, RSRC_CONF, 
                   "the directory for file system storage of managed domain data."),
+    AP_INIT_TAKE1(     MD_CMD_STOREDURABLE, md_config_set_store_durability, NULL, RSRC_CONF, 
+                  "How files written to the store are synced to disk: 'none' leaves it to "
+                  "the system, 'file' syncs their contents and 'dir' also their directory."),
+    AP_INIT_TAKE1(     MD_CMD_STOREFORMAT, md_config_set_store_format, NULL, RSRC_CONF, 
+                  "How JSON data is written to the store: 'json' as text or 'binary' as "
+                  "CBOR, which is faster to load. Existing files are converted."),
+    AP_INIT_TAKE1(     MD_CMD_TRACE, md_config_set_trace, NULL, RSRC_CONF, 
+                  "Keep the timing of drive phases and ACME requests in memory and log "
+                  "it after each renewal run: 'on', 'off' or the number of records kept."),
+    AP_INIT_TAKE12(    MD_CMD_TRACELOG, md_config_set_trace_log, NULL, RSRC_CONF, 
+                  "Keep md messages up to the given trace level in memory, whatever the "
+                  "LogLevel, and log them when a renewal fails. Optionally "
+                  "followed by the number of messages kept, 1024 by default."),
+    AP_INIT_TAKE12(    MD_CMD_STORESOCACHE, md_config_set_store_socache, NULL, RSRC_CONF, 
+                  "Keep the store in a socache provider, given as 'provider[:args]', with "
+                  "local copies in the store directory. Optionally followed by the time "
+                  "after which changes by other servers are looked for."),
+    AP_INIT_TAKE12(    MD_CMD_RENEWCONCUR, md_config_set_renew_concurrency, NULL, RSRC_CONF, 
+                  "Maximum number of Managed Domains renewed in parallel, optionally followed "
+                  "by the maximum number of parallel renewals against the same CA."),
+    AP_INIT_TAKE12(    MD_CMD_RENEWLEASE, md_config_set_renew_lease, NULL, RSRC_CONF, 
+                  "Renew only while holding a lease on the MD in a store shared with other "
+                  "servers: 'off' or the lease duration, optionally followed by the name of "
+                  "this server (defaults to the host name)."),
+    AP_INIT_TAKE1(     MD_CMD_RENEWPRESTAGE, md_config_set_renew_prestage, NULL, RSRC_CONF, 
+                  "Generate the keys and CSRs for a renewal this long before it is due: "
+                  "'off' or a duration (defaults to days)."),
+    AP_INIT_TAKE1(     MD_CMD_RENEWVIAARI, md_config_set_renew_via_ari, NULL, RSRC_CONF, 
+                  "Renew at a time inside the window the CA suggests in its ACME renewal "
+                  "information, if it offers that: 'on' (default) or 'off'."),
     AP_INIT_TAKE1(     MD_CMD_RENEWWINDOW, md_config_set_renew_window, NULL, RSRC_CONF, 
                   "Time length for renewal before certificate expires (defaults to days)"),
     AP_INIT_TAKE1(     MD_CMD_REQUIREHTTPS, md_config_set_require_https, NULL, RSRC_CONF, 
                   "Redirect non-secure requests to the https: equivalent."),
+    AP_INIT_TAKE1(     MD_CMD_STAPLING, md_config_set_stapling, NULL, RSRC_CONF, 
+                  "Fetch and cache OCSP responses for managed certificates, so that "
+                  "a mod_ssl asking mod_md for them can staple them. Default is off."),
     AP_INIT_RAW_ARGS(MD_CMD_NOTIFYCMD, md_config_set_notify_cmd, NULL, RSRC_CONF, 
                   "set the command and optional arguments to run when signup/renew of domain is complete."),
     AP_INIT_TAKE1(     MD_CMD_BASE_SERVER, md_config_set_base_server, NULL, RSRC_CONF, 
@@ -846,6 +1579,12 @@ const command_rec md_cmds[] = {
 
     AP_INIT_RAW_ARGS(MD_CMD_DNS01CMD, md_config_set_dns01_cmd, NULL, RSRC_CONF, 
                   "set the command for setup/teardown of dns-01 challenges"),
+    AP_INIT_TAKE1(     MD_CMD_DNS01BATCH, md_config_set_dns01_batch, NULL, RSRC_CONF, 
+                  "'on' to set up/tear down all dns-01 challenges of an order in one "
+                  "call of the dns-01 command"),
+    AP_INIT_TAKE12(    MD_CMD_DNS01CHECK, md_config_set_dns01_check, NULL, RSRC_CONF, 
+                  "url of a DNS query (JSON) service and optional timeout. Setup dns-01 "
+                  "records are looked up there before the CA is asked to verify them."),
 
 
     AP_INIT_TAKE1(NULL, NULL, NULL, RSRC_CONF, NULL)
@@ -19,7 +19,12 @@
 
 struct md_store_t;
 struct md_reg_t;
+struct md_pkey_t;
 struct md_pkey_spec_t;
+struct md_domain_index_t;
+struct md_ocsp_reg_t;
+struct ap_socache_provider_t;
+struct md_acme_rl_t;
 
 typedef enum {
     MD_CONFIG_CA_URL,
@@ -38,6 +43,12 @@ typedef enum {
     MD_CONFIG_NOTIFY_CMD,
 } md_config_var_t;
 
+typedef enum {
+    MD_CONSOLIDATE_OFF,                /* each MD gets a certificate of its own */
+    MD_CONSOLIDATE_SUGGEST,            /* log which MDs could share certificates */
+    MD_CONSOLIDATE_ON,                 /* MDs configured alike share certificates */
+} md_consolidate_t;
+
 typedef struct {
     apr_array_header_t *mds;           /* all md_t* defined in the config, shared */
     const char *base_dir;              /* base dir for store */
@@ -55,6 +66,34 @@ typedef struct {
 
     const char *notify_cmd;            /* notification command to execute on signup/renew */
     struct apr_table_t *env;           /* environment for operation */
+    struct md_domain_index_t *mds_index; /* post config, index of mds by name and domain */
+    int renew_concurrency;             /* max number of MDs renewed in parallel */
+    int renew_ca_concurrency;          /* max number of parallel renewals per CA, 0 for no limit */
+    int pkey_pool_size;                /* number of keys to generate ahead, per key spec */
+    int fallback_shared;               /* if all fallback certificates share one key */
+    struct md_pkey_spec_t *fallback_pkey_spec; /* spec of the shared fallback key or NULL */
+    struct md_pkey_t *fallback_pkey;   /* post config, the shared fallback key or NULL */
+    int stapling;                      /* if OCSP responses are fetched for managed certificates */
+    struct md_ocsp_reg_t *ocsp;        /* post config, registry of OCSP responses or NULL */
+    int hot_activation;                /* if renewed certificates are activated without restart */
+    apr_interval_time_t activation_start; /* daily window for activations, offsets from */
+    apr_interval_time_t activation_end;   /* midnight, the whole day if equal */
+    apr_interval_time_t activation_delay; /* wait for more renewals before activating */
+    apr_interval_time_t lease_ttl;     /* if > 0, renew only while holding the MD's lease */
+    const char *lease_owner;           /* name of this server in renewal leases */
+    const struct ap_socache_provider_t *store_socache; /* keeps the store or NULL */
+    const char *store_socache_args;    /* arguments for the socache provider */
+    apr_interval_time_t store_max_age; /* when store indices are fetched again */
+    int store_durability;              /* md_durability_t of files written to the store */
+    int trace_records;                 /* size of the in-memory trace of drives, 0 for off */
+    int store_binary;                  /* JSON in the store is written as CBOR */
+    apr_interval_time_t renew_prestage;/* keys and CSRs are staged this long before renewal */
+    struct md_acme_rl_t *ca_limits;    /* rate limits for CAs by md_acme_rl_kind_t or NULL */
+    int renew_via_ari;                 /* renew when the CA's renewal information says */
+    int trace_log_level;               /* md_log_level_t up to which TRACE messages are kept */
+    int trace_log_records;             /* size of the in-memory ring for them, 0 for off */
+    int consolidate;                   /* md_consolidate_t of the configured MDs */
+    int consolidate_max;               /* most names in a shared certificate */
 } md_mod_conf_t;
 
 typedef struct md_srv_conf_t {
@@ -67,18 +106,21 @@ typedef struct md_srv_conf_t {
     int drive_mode;                    /* mode of obtaining credentials */
     int must_staple;                   /* certificates should set the OCSP Must Staple extension */
     struct md_pkey_spec_t *pkey_spec;  /* specification for generating private keys */
+    struct apr_array_header_t *alt_pkey_specs; /* specs for additional certificates */
     apr_interval_time_t renew_norm;    /* If > 0, use as normalizing value for cert lifetime
                                         * Example: renew_norm=90d renew_win=30d, cert lives
                                         * for 12 days => renewal 4 days before */
     apr_interval_time_t renew_window;  /* time before expiration that starts renewal */
     
     const char *ca_url;                /* url of CA certificate service */
+    struct apr_array_header_t *ca_urls; /* CAs to fail over to, ca_url first, or NULL */
     const char *ca_proto;              /* protocol used vs CA (e.g. ACME) */
     const char *ca_agreement;          /* accepted agreement uri between CA and user */ 
     struct apr_array_header_t *ca_challenges; /* challenge types configured */
 
     md_t *current;                     /* md currently defined in <MDomainSet xxx> section */
     md_t *assigned;                    /* post_config: MD that applies to this server or NULL */
+    const char *https_prefix;          /* post_config: "https://" and the server name */
 } md_srv_conf_t;
 
 void *md_config_create_svr(apr_pool_t *pool, server_rec *s);
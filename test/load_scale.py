@@ -0,0 +1,257 @@
+# load test: many MDs, startup and renewal throughput against an ACMEv2 CA
+#
+# Not part of 'make test'. Run it with 'make test-load', which is, in the test dir:
+#
+#   MD_LOAD_MDS=1000,10000 py.test -s load_scale.py
+#
+# The CA is meant to be pebble (https://github.com/letsencrypt/pebble), e.g.
+#
+#   pebble-challtestsrv -defaultIPv4 127.0.0.1 &
+#   PEBBLE_VA_NOSLEEP=1 pebble -config pebble.json -dnsserver 127.0.0.1:8053
+#
+# with "httpPort" in pebble.json being the test http_port, so that http-01 challenges
+# reach our server, and pebble's root certificate trusted by libcurl. Environment:
+#
+#   MD_LOAD_MDS          comma separated numbers of MDs to run, default "1000"
+#   MD_LOAD_ACME_URL     directory of the CA, default the 'acmev2' url of test.ini
+#   MD_LOAD_LATENCY      milliseconds added to each request to the CA, default 0.
+#                        The requests then go through a delaying CONNECT proxy.
+#   MD_LOAD_CONCURRENCY  if set, used for MDRenewConcurrency
+#   MD_LOAD_TIMEOUT      seconds to wait for all certificates, default 1800
+#
+# Pebble's own delay before validating challenges is not set here, it sleeps up
+# to 15 seconds unless PEBBLE_VA_NOSLEEP is set.
+#
+# Each run prints one line of JSON and also writes it to gen/load-<count>.json:
+# startup seconds, peak RSS of all server processes in KB, certificates obtained
+# per minute and the number of server restarts.
+
+import json
+import os
+import pytest
+import re
+import select
+import socket
+import threading
+import time
+
+from test_base import TestEnv
+from test_base import HttpdConf
+
+
+def load_counts():
+    return [ int(n) for n in os.environ.get('MD_LOAD_MDS', '1000').split(',') if n ]
+
+
+def setup_module(module):
+    print("setup_module    module:%s" % module.__name__)
+    TestEnv.initv2()
+    TestEnv.ACME_URL = os.environ.get('MD_LOAD_ACME_URL', TestEnv.ACME_URL)
+    TestEnv.clear_store()
+    TestEnv.install_test_conf();
+    assert TestEnv.apache_start() == 0
+
+
+def teardown_module(module):
+    print("teardown_module module:%s" % module.__name__)
+    assert TestEnv.apache_stop() == 0
+
+
+class DelayProxy(threading.Thread):
+    # A CONNECT proxy that holds back each chunk the client sends by the latency.
+
+    def __init__(self, latency):
+        threading.Thread.__init__(self)
+        self.daemon = True
+        self.latency = latency
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.sock.bind(('127.0.0.1', 0))
+        self.sock.listen(128)
+        self.url = "http://127.0.0.1:%d" % self.sock.getsockname()[1]
+
+    def run(self):
+        while True:
+            conn, addr = self.sock.accept()
+            t = threading.Thread(target=self._handle, args=(conn,))
+            t.daemon = True
+            t.start()
+
+    def _handle(self, conn):
+        upstream = None
+        try:
+            head = ""
+            while "\r\n\r\n" not in head:
+                data = conn.recv(4096)
+                if not data:
+                    return
+                head += data
+            m = re.match(r'CONNECT ([^: ]+):(\d+) HTTP/1\.[01]\r\n', head)
+            if not m:
+                conn.sendall("HTTP/1.1 405 Method Not Allowed\r\nContent-Length: 0\r\n\r\n")
+                return
+            time.sleep(self.latency)
+            upstream = socket.create_connection((m.group(1), int(m.group(2))))
+            conn.sendall("HTTP/1.1 200 Connection established\r\n\r\n")
+            self._pump(conn, upstream)
+        except socket.error:
+            pass
+        finally:
+            conn.close()
+            if upstream:
+                upstream.close()
+
+    def _pump(self, conn, upstream):
+        while True:
+            readable, _, _ = select.select([conn, upstream], [], [], 60)
+            if not readable:
+                return
+            for s in readable:
+                data = s.recv(65536)
+                if not data:
+                    return
+                if s is conn:
+                    time.sleep(self.latency)
+                    upstream.sendall(data)
+                else:
+                    conn.sendall(data)
+
+
+class ServerStats(threading.Thread):
+    # Samples the RSS of the server's parent and child processes from /proc.
+
+    def __init__(self):
+        threading.Thread.__init__(self)
+        self.daemon = True
+        self.peak_rss_kb = 0
+        self.running = True
+
+    def _rss_kb(self, pid):
+        try:
+            for line in open("/proc/%d/status" % pid):
+                if line.startswith("VmRSS:"):
+                    return int(line.split()[1])
+        except IOError:
+            pass
+        return 0
+
+    def _ppid(self, pid):
+        try:
+            return int(open("/proc/%d/stat" % pid).read().rsplit(')', 1)[1].split()[1])
+        except (IOError, ValueError, IndexError):
+            return 0
+
+    def sample(self):
+        try:
+            parent = int(open(os.path.join(TestEnv.WEBROOT, "logs", "httpd.pid")).read())
+        except (IOError, ValueError):
+            return
+        rss = self._rss_kb(parent)
+        for entry in os.listdir("/proc"):
+            if entry.isdigit() and self._ppid(int(entry)) == parent:
+                rss += self._rss_kb(int(entry))
+        self.peak_rss_kb = max(self.peak_rss_kb, rss)
+
+    def run(self):
+        while self.running:
+            self.sample()
+            time.sleep(1)
+
+
+class TestLoadScale:
+
+    @classmethod
+    def setup_class(cls):
+        time.sleep(1)
+        cls.dns_uniq = "%d.org" % time.time()
+        cls.TMP_CONF = os.path.join(TestEnv.GEN_DIR, "load.conf")
+        cls.proxy = None
+        latency = float(os.environ.get('MD_LOAD_LATENCY', '0')) / 1000.0
+        if latency > 0:
+            cls.proxy = DelayProxy(latency)
+            cls.proxy.start()
+
+    def setup_method(self, method):
+        print("setup_method: %s" % method.__name__)
+        TestEnv.apache_err_reset();
+        TestEnv.clear_store()
+        TestEnv.install_test_conf();
+
+    def teardown_method(self, method):
+        print("teardown_method: %s" % method.__name__)
+
+    def _write_conf(self, domains):
+        # single writes, HttpdConf opens the file for every line
+        conf = HttpdConf( TestLoadScale.TMP_CONF )
+        lines = [ "  ServerAdmin mailto:admin@not-forbidden.org",
+                  "  MDDriveMode auto" ]
+        if TestLoadScale.proxy:
+            lines.append("  MDHttpProxy %s" % TestLoadScale.proxy.url)
+        if 'MD_LOAD_CONCURRENCY' in os.environ:
+            lines.append("  MDRenewConcurrency %s" % os.environ['MD_LOAD_CONCURRENCY'])
+        for domain in domains:
+            lines.append("  MDomain %s www.%s" % (domain, domain))
+        for domain in domains:
+            lines += [ "<VirtualHost *:%s>" % TestEnv.HTTPS_PORT,
+                       "    ServerName %s" % domain,
+                       "    ServerAlias www.%s" % domain,
+                       "    DocumentRoot htdocs",
+                       "    SSLEngine on",
+                       "</VirtualHost>" ]
+        open(conf.path, "a").write("\n".join(lines) + "\n")
+        conf.install()
+
+    def _count_completed(self, domains):
+        done = 0
+        for domain in domains:
+            if os.path.exists(TestEnv.path_domain_pubcert(domain)) \
+                    or os.path.exists(TestEnv.path_domain_pubcert(domain, staging=True)):
+                done += 1
+        return done
+
+    def _count_restarts(self):
+        if not os.path.isfile(TestEnv.ERROR_LOG):
+            return 0
+        inits = 0
+        for line in open(TestEnv.ERROR_LOG):
+            if TestEnv.RE_MD_RESET.match(line):
+                inits += 1
+        # the first one is our own start
+        return max(inits - 1, 0)
+
+    @pytest.mark.parametrize("count", load_counts())
+    def test_load_scale(self, count):
+        domains = [ "load%d-%s" % (i, TestLoadScale.dns_uniq) for i in range(count) ]
+        self._write_conf(domains)
+
+        assert TestEnv.apache_stop() == 0
+        TestEnv.apache_err_reset()
+        start = time.time()
+        assert TestEnv.apache_start() == 0
+        startup = time.time() - start
+
+        stats = ServerStats()
+        stats.start()
+        timeout = float(os.environ.get('MD_LOAD_TIMEOUT', '1800'))
+        done = 0
+        while done < count and time.time() - start < timeout:
+            time.sleep(5)
+            done = self._count_completed(domains)
+        elapsed = time.time() - start
+        stats.running = False
+        stats.sample()
+
+        result = {
+            'mds': count,
+            'latency_ms': float(os.environ.get('MD_LOAD_LATENCY', '0')),
+            'startup_sec': round(startup, 3),
+            'peak_rss_kb': stats.peak_rss_kb,
+            'completed': done,
+            'renewals_per_min': round(done * 60.0 / elapsed, 2),
+            'restarts': self._count_restarts(),
+            'elapsed_sec': round(elapsed, 1),
+        }
+        line = json.dumps(result, sort_keys=True)
+        print(line)
+        open(os.path.join(TestEnv.GEN_DIR, "load-%d.json" % count), "w").write(line + "\n")
+        assert done == count
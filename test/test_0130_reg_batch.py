@@ -0,0 +1,83 @@
+# test a2md batch operations from a manifest
+
+import json
+import pytest
+
+from test_base import TestEnv
+
+def setup_module(module):
+    print("setup_module: %s" % module.__name__)
+    TestEnv.init()
+
+def teardown_module(module):
+    print("teardown_module: %s" % module.__name__)
+
+
+class TestRegBatch :
+
+    def setup_method(self, method):
+        print("setup_method: %s" % method.__name__)
+        TestEnv.clear_store()
+
+    def teardown_method(self, method):
+        print("teardown_method: %s" % method.__name__)
+
+    def _manifest(self, ops):
+        return "\n".join([ json.dumps(op) for op in ops ]) + "\n"
+
+    def test_130_000(self):
+        # test case: add and update managed domains in one run
+        manifest = "# comment\n\n" + self._manifest([
+            { "op": "add", "domains": [ "test130-000.org", "www.test130-000.org" ] },
+            { "op": "add", "domains": [ "test130-000b.org" ], "contacts": [ "admin@test130-000b.org" ] },
+            { "op": "update", "name": "test130-000.org", "ca-url": "http://localhost:9999/directory" },
+        ])
+        r = TestEnv.a2md( [ "batch" ], input=manifest )
+        assert r['rv'] == 0
+        out = r['jout']['output']
+        assert len(out) == 3
+        assert [ o['line'] for o in out ] == [ 3, 4, 5 ]
+        for o in out:
+            assert o['status'] == 0
+        TestEnv.check_json_contains( out[0]['md'], {
+            "name": "test130-000.org",
+            "domains": [ "test130-000.org", "www.test130-000.org" ],
+            "ca": { "url": TestEnv.ACME_URL, "proto": "ACME" },
+            "state": TestEnv.MD_S_INCOMPLETE
+        })
+        assert out[1]['md']['contacts'] == [ "mailto:admin@test130-000b.org" ]
+        assert out[2]['md']['ca']['url'] == "http://localhost:9999/directory"
+        # the store has both
+        assert len(TestEnv.a2md( [ "list" ] )['jout']['output']) == 2
+
+    def test_130_001(self):
+        # test case: failed operations are reported, the others still run
+        manifest = self._manifest([
+            { "op": "add", "domains": [ "test130-001.org" ] },
+            { "op": "add", "domains": [ "www.test130-001.org", "test130-001.org" ] },
+            { "op": "update", "name": "test130-001-unknown.org", "ca-url": "http://localhost/" },
+            { "op": "unknown" },
+        ]) + "{ not json\n"
+        r = TestEnv.a2md( [ "batch" ], input=manifest )
+        assert r['rv'] != 0
+        out = r['jout']['output']
+        assert len(out) == 5
+        assert out[0]['status'] == 0
+        assert out[1]['status'] != 0
+        assert out[2]['status'] != 0
+        assert out[3]['status'] != 0
+        assert out[4]['status'] != 0
+        assert out[4]['line'] == 5
+        assert len(TestEnv.a2md( [ "list" ] )['jout']['output']) == 1
+
+    def test_130_002(self):
+        # test case: drive of an unknown domain fails, without contacting the CA
+        manifest = self._manifest([
+            { "op": "drive", "name": "test130-002.org" },
+        ])
+        r = TestEnv.a2md( [ "batch", "-n", "4" ], input=manifest )
+        assert r['rv'] != 0
+        out = r['jout']['output']
+        assert len(out) == 1
+        assert out[0]['op'] == "drive"
+        assert out[0]['status'] != 0
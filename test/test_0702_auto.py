@@ -1,5 +1,7 @@
 # test auto runs against ACMEv2
 
+import calendar
+import email.utils
 import json
 import os
 import pytest
@@ -644,8 +646,69 @@ class TestAuto:
         assert False == md["proto"]["acme-tls/1"]
         
 
+    #-----------------------------------------------------------------------------------------------
+    # test case: a renewed certificate is activated hot, without a restart
+    def test_702_050(self):
+        domain = "test702-050-" + TestAuto.dns_uniq
+        dns_list = [ domain ]
+
+        conf = HttpdConf( TestAuto.TMP_CONF )
+        conf.add_admin( "admin@" + domain )
+        conf.add_drive_mode( "auto" )
+        conf.add_renew_window( "10d" )
+        conf.add_line( "MDActivationMode hot" )
+        conf.add_line( "<Location /md-status>\n  SetHandler md-status\n</Location>" )
+        conf.add_md( dns_list )
+        conf.add_vhost( TestEnv.HTTPS_PORT, domain, aliasList=[], withSSL=True )
+        conf.install()
+
+        assert TestEnv.apache_restart() == 0
+        assert TestEnv.await_completion( [ domain ] )
+        self._check_md_cert( dns_list )
+        # certificates from server start are not hot activated
+        assert self._get_hot_serial(domain) == None
+
+        # renew a certificate about to expire
+        CertUtil.create_self_signed_cert( [domain], { "notBefore": -120, "notAfter": 2  }, serial=7029)
+        assert TestEnv.apache_restart() == 0
+        assert self._get_hot_serial(domain) == None
+
+        # the children hand out the renewed one without a restart
+        try_until = time.time() + 60
+        while True:
+            cert2 = CertUtil( TestEnv.path_domain_pubcert(domain) )
+            if cert2.get_serial() != 7029 and self._get_hot_serial(domain) == cert2.get_serial():
+                break
+            assert time.time() < try_until
+            time.sleep(1)
+        assert domain in cert2.get_san_list()
+        assert not os.path.exists( TestEnv.path_domain_pubcert(domain, staging=True) )
+
+        # md-status has the state and expiry of the activated certificate, not
+        # the ones from server start
+        expires = calendar.timegm(cert2.get_not_after().utctimetuple())
+        md = self._get_status_md(domain)
+        assert md['state'] == TestEnv.MD_S_COMPLETE
+        assert calendar.timegm(email.utils.parsedate(md['expires'])) == expires
+        metrics = TestEnv.get_plain( TestEnv.HTTPD_URL + "/md-status?prometheus", 5 )
+        assert ('md_state{md="%s"} %d' % (domain, TestEnv.MD_S_COMPLETE)) in metrics
+        assert ('md_cert_expiry_seconds{md="%s"} %d' % (domain, expires)) in metrics
+
     # --------- _utils_ ---------
 
+    def _get_status_md(self, name):
+        status = TestEnv.get_json( TestEnv.HTTPD_URL + "/md-status", 5 )
+        for md in status['mds']:
+            if md['name'] == name:
+                return md
+        return None
+
+    def _get_hot_serial(self, name):
+        md = self._get_status_md(name)
+        if md and 'cert' in md:
+            return int(md['cert']['serial'], 16)
+        return None
+
     def _write_res_file(self, docRoot, name, content):
         if not os.path.exists(docRoot):
             os.makedirs(docRoot)
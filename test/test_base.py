@@ -141,11 +141,11 @@ class TestEnv:
         cls._a2md_args_raw = [] + args
          
     @classmethod
-    def a2md( cls, args, raw=False ) :
+    def a2md( cls, args, raw=False, input=None ) :
         preargs = cls._a2md_args
         if raw :
             preargs = cls._a2md_args_raw
-        return cls.run( preargs + args )
+        return cls.run( preargs + args, input )
 
     @classmethod
     def curl( cls, args ) :
@@ -207,7 +207,7 @@ class TestEnv:
         while time.time() < try_until:
             try:
                 c = HTTPConnection(server.hostname, server.port, timeout=timeout)
-                c.request('GET', server.path)
+                c.request('GET', server.path + ("?" + server.query if server.query else ""))
                 resp = c.getresponse()
                 data = resp.read()
                 c.close()
@@ -0,0 +1,495 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Micro benchmarks of the helpers on the hot paths of libmd.
+ *
+ * Each benchmark repeats one operation until it ran for at least BENCH_MIN_TIME
+ * and prints a line of JSON with its average time per operation:
+ *
+ *   {"bench":"json_readd_md","iterations":65536,"ns_per_op":2841.3}
+ *
+ * Memory of an operation comes from a pool that is cleared after each one, that
+ * cost is part of the result. Arguments limit the run to benchmarks whose names
+ * start with one of them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <apr_general.h>
+#include <apr_file_io.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_time.h>
+
+#include "md.h"
+#include "md_crypt.h"
+#include "md_json.h"
+#include "md_store.h"
+#include "md_store_fs.h"
+#include "md_util.h"
+
+#define BENCH_MIN_TIME      apr_time_from_msec(200)
+#define BENCH_MAX_ITER      (1L << 30)
+
+#define BENCH_SANS          100     /* DNS names in certificates and orders */
+#define BENCH_NAMES         1000    /* DNS names for matching and minimizing */
+#define BENCH_MDS           10000   /* MDs in the domain lookups */
+
+typedef apr_status_t bench_setup_cb(void **pbaton, apr_pool_t *p);
+typedef void bench_run_cb(void *baton, apr_pool_t *p);
+
+typedef struct {
+    const char *name;
+    bench_setup_cb *setup;
+    bench_run_cb *run;
+} bench_t;
+
+/* Keeps results from being optimized away */
+static volatile apr_size_t sink;
+
+/**************************************************************************************************/
+/* test data */
+
+static apr_array_header_t *make_names(apr_pool_t *p, int n, const char *fmt)
+{
+    apr_array_header_t *names = apr_array_make(p, n, sizeof(const char *));
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        APR_ARRAY_PUSH(names, const char *) = apr_psprintf(p, fmt, i);
+    }
+    return names;
+}
+
+static md_t *make_md(apr_pool_t *p, const char *name, int nsans)
+{
+    md_t *md;
+
+    md = md_create(p, make_names(p, nsans, apr_pstrcat(p, "www%d.", name, NULL)));
+    md->name = name;
+    md->ca_url = "https://acme-v02.api.letsencrypt.org/directory";
+    md->ca_proto = "ACME";
+    md->ca_agreement = "https://letsencrypt.org/documents/LE-SA-v1.2-November-15-2017.pdf";
+    APR_ARRAY_PUSH(md->contacts, const char *) = "mailto:admin@example.org";
+    return md;
+}
+
+static const char *make_order(apr_pool_t *p)
+{
+    const char *url = "https://acme-v02.api.letsencrypt.org/acme";
+    apr_array_header_t *parts = apr_array_make(p, 4 * BENCH_SANS, sizeof(const char *));
+    int i;
+
+    APR_ARRAY_PUSH(parts, const char *) = "{\"status\":\"pending\","
+        "\"expires\":\"2020-03-02T14:09:30Z\",\"identifiers\":[";
+    for (i = 0; i < BENCH_SANS; ++i) {
+        APR_ARRAY_PUSH(parts, const char *) = apr_psprintf(p,
+            "%s{\"type\":\"dns\",\"value\":\"www%d.example.org\"}", i? "," : "", i);
+    }
+    APR_ARRAY_PUSH(parts, const char *) = "],\"authorizations\":[";
+    for (i = 0; i < BENCH_SANS; ++i) {
+        APR_ARRAY_PUSH(parts, const char *) = apr_psprintf(p,
+            "%s\"%s/authz-v3/%d\"", i? "," : "", url, 2893457 + i);
+    }
+    APR_ARRAY_PUSH(parts, const char *) = apr_psprintf(p,
+        "],\"finalize\":\"%s/finalize/123456/789012\"}", url);
+    return apr_array_pstrcat(p, parts, 0);
+}
+
+/**************************************************************************************************/
+/* json */
+
+static apr_status_t setup_md_text(void **pbaton, apr_pool_t *p)
+{
+    md_t *md = make_md(p, "example.org", 20);
+
+    *pbaton = (void*)md_json_writep(md_to_json(md, p), p, MD_JSON_FMT_INDENT);
+    return *pbaton? APR_SUCCESS : APR_EINVAL;
+}
+
+static apr_status_t setup_order_text(void **pbaton, apr_pool_t *p)
+{
+    *pbaton = (void*)make_order(p);
+    return APR_SUCCESS;
+}
+
+static void run_json_readd(void *baton, apr_pool_t *p)
+{
+    const char *s = baton;
+    md_json_t *json;
+
+    if (APR_SUCCESS == md_json_readd(&json, p, s, strlen(s))) {
+        sink += (apr_size_t)md_json_getl(json, "version", NULL);
+    }
+}
+
+static apr_status_t setup_md_json(void **pbaton, apr_pool_t *p)
+{
+    *pbaton = md_to_json(make_md(p, "example.org", 20), p);
+    return APR_SUCCESS;
+}
+
+static apr_status_t setup_order_json(void **pbaton, apr_pool_t *p)
+{
+    const char *s = make_order(p);
+
+    return md_json_readd((md_json_t **)pbaton, p, s, strlen(s));
+}
+
+static void run_json_writep(void *baton, apr_pool_t *p)
+{
+    const char *s = md_json_writep(baton, p, MD_JSON_FMT_INDENT);
+
+    sink += s? strlen(s) : 0;
+}
+
+/**************************************************************************************************/
+/* base64url */
+
+#define B64_DATA_LEN    4096
+
+static apr_status_t setup_b64_data(void **pbaton, apr_pool_t *p)
+{
+    char *data = apr_palloc(p, B64_DATA_LEN);
+    int i;
+
+    for (i = 0; i < B64_DATA_LEN; ++i) {
+        data[i] = (char)(i * 31 + 7);
+    }
+    *pbaton = data;
+    return APR_SUCCESS;
+}
+
+static void run_b64_encode(void *baton, apr_pool_t *p)
+{
+    sink += strlen(md_util_base64url_encode(baton, B64_DATA_LEN, p));
+}
+
+static apr_status_t setup_b64_text(void **pbaton, apr_pool_t *p)
+{
+    void *data;
+
+    setup_b64_data(&data, p);
+    *pbaton = (void*)md_util_base64url_encode(data, B64_DATA_LEN, p);
+    return APR_SUCCESS;
+}
+
+static void run_b64_decode(void *baton, apr_pool_t *p)
+{
+    const char *data;
+
+    sink += md_util_base64url_decode(&data, baton, p);
+}
+
+/**************************************************************************************************/
+/* dns names */
+
+static apr_status_t setup_names(void **pbaton, apr_pool_t *p)
+{
+    apr_array_header_t *names = make_names(p, BENCH_NAMES, "www%d.example.org");
+
+    APR_ARRAY_PUSH(names, const char *) = "*.example.org";
+    APR_ARRAY_PUSH(names, const char *) = "www1.example.org";
+    *pbaton = names;
+    return APR_SUCCESS;
+}
+
+static void run_dns_matches(void *baton, apr_pool_t *p)
+{
+    apr_array_header_t *names = baton;
+    int i;
+
+    (void)p;
+    for (i = 0; i < names->nelts; ++i) {
+        sink += (apr_size_t)md_dns_matches("*.example.org", APR_ARRAY_IDX(names, i, const char *));
+    }
+}
+
+static void run_dns_make_minimal(void *baton, apr_pool_t *p)
+{
+    sink += (apr_size_t)md_dns_make_minimal(p, baton)->nelts;
+}
+
+/**************************************************************************************************/
+/* md lookups */
+
+typedef struct {
+    apr_array_header_t *mds;
+    md_domain_index_t *idx;
+    const char *domain;
+} mds_ctx;
+
+static apr_status_t setup_mds(void **pbaton, apr_pool_t *p)
+{
+    mds_ctx *ctx = apr_pcalloc(p, sizeof(*ctx));
+    int i;
+
+    ctx->mds = apr_array_make(p, BENCH_MDS, sizeof(md_t *));
+    for (i = 0; i < BENCH_MDS; ++i) {
+        APR_ARRAY_PUSH(ctx->mds, md_t *) = make_md(p, apr_psprintf(p, "site%d.org", i), 2);
+    }
+    ctx->idx = md_domain_index_make(p, ctx->mds);
+    /* the last domain of the last MD, the worst case for a linear search */
+    ctx->domain = apr_psprintf(p, "www1.site%d.org", BENCH_MDS - 1);
+    *pbaton = ctx;
+    return APR_SUCCESS;
+}
+
+static void run_get_by_domain(void *baton, apr_pool_t *p)
+{
+    mds_ctx *ctx = baton;
+
+    (void)p;
+    sink += md_get_by_domain(ctx->mds, ctx->domain)? 1 : 0;
+}
+
+static void run_domain_index(void *baton, apr_pool_t *p)
+{
+    mds_ctx *ctx = baton;
+
+    (void)p;
+    sink += md_domain_index_get_by_domain(ctx->idx, ctx->domain)? 1 : 0;
+}
+
+/**************************************************************************************************/
+/* certificates */
+
+typedef struct {
+    md_pkey_t *pkey;
+    md_cert_t *cert;
+    md_t *md;
+} cert_ctx;
+
+static apr_status_t make_cert(cert_ctx **pctx, apr_pool_t *p)
+{
+    cert_ctx *ctx = apr_pcalloc(p, sizeof(*ctx));
+    md_pkey_spec_t spec;
+    apr_status_t rv;
+
+    spec.type = MD_PKEY_TYPE_EC;
+    spec.params.ec.curve = "P-256";
+    ctx->md = make_md(p, "example.org", BENCH_SANS);
+    if (APR_SUCCESS == (rv = md_pkey_gen(&ctx->pkey, p, &spec))) {
+        rv = md_cert_self_sign(&ctx->cert, ctx->md->name, ctx->md->domains, ctx->pkey,
+                               apr_time_from_sec(3600), p);
+    }
+    *pctx = ctx;
+    return rv;
+}
+
+static apr_status_t setup_cert(void **pbaton, apr_pool_t *p)
+{
+    return make_cert((cert_ctx **)pbaton, p);
+}
+
+static void run_cert_covers_md(void *baton, apr_pool_t *p)
+{
+    cert_ctx *ctx = baton;
+
+    (void)p;
+    sink += (apr_size_t)md_cert_covers_md(ctx->cert, ctx->md);
+}
+
+/**************************************************************************************************/
+/* store */
+
+typedef struct {
+    md_store_t *store;
+    const char *aspect;
+    md_store_vtype_t vtype;
+} store_ctx;
+
+static const char *store_dir;
+
+static apr_status_t setup_store(void **pbaton, apr_pool_t *p,
+                                const char *aspect, md_store_vtype_t vtype)
+{
+    store_ctx *ctx = apr_pcalloc(p, sizeof(*ctx));
+    cert_ctx *cctx;
+    apr_array_header_t *chain;
+    void *value;
+    apr_status_t rv;
+
+    if (APR_SUCCESS != (rv = md_store_fs_init(&ctx->store, p, store_dir))
+        || APR_SUCCESS != (rv = make_cert(&cctx, p))) {
+        return rv;
+    }
+    switch (vtype) {
+        case MD_SV_TEXT:
+            value = (void*)md_json_writep(md_to_json(cctx->md, p), p, MD_JSON_FMT_INDENT);
+            break;
+        case MD_SV_JSON:
+            value = md_to_json(cctx->md, p);
+            break;
+        case MD_SV_CERT:
+            value = cctx->cert;
+            break;
+        case MD_SV_PKEY:
+            value = cctx->pkey;
+            break;
+        case MD_SV_CHAIN:
+            chain = apr_array_make(p, 3, sizeof(md_cert_t *));
+            APR_ARRAY_PUSH(chain, md_cert_t *) = cctx->cert;
+            APR_ARRAY_PUSH(chain, md_cert_t *) = cctx->cert;
+            APR_ARRAY_PUSH(chain, md_cert_t *) = cctx->cert;
+            value = chain;
+            break;
+        default:
+            return APR_ENOTIMPL;
+    }
+    ctx->aspect = aspect;
+    ctx->vtype = vtype;
+    *pbaton = ctx;
+    return md_store_save(ctx->store, p, MD_SG_DOMAINS, "example.org", aspect, vtype, value, 0);
+}
+
+static apr_status_t setup_store_text(void **pbaton, apr_pool_t *p)
+{
+    return setup_store(pbaton, p, "text.txt", MD_SV_TEXT);
+}
+
+static apr_status_t setup_store_json(void **pbaton, apr_pool_t *p)
+{
+    return setup_store(pbaton, p, MD_FN_MD, MD_SV_JSON);
+}
+
+static apr_status_t setup_store_cert(void **pbaton, apr_pool_t *p)
+{
+    return setup_store(pbaton, p, "cert.pem", MD_SV_CERT);
+}
+
+static apr_status_t setup_store_pkey(void **pbaton, apr_pool_t *p)
+{
+    return setup_store(pbaton, p, MD_FN_PRIVKEY, MD_SV_PKEY);
+}
+
+static apr_status_t setup_store_chain(void **pbaton, apr_pool_t *p)
+{
+    return setup_store(pbaton, p, MD_FN_PUBCERT, MD_SV_CHAIN);
+}
+
+static void run_store_load(void *baton, apr_pool_t *p)
+{
+    store_ctx *ctx = baton;
+    void *value;
+
+    if (APR_SUCCESS == md_store_load(ctx->store, MD_SG_DOMAINS, "example.org",
+                                     ctx->aspect, ctx->vtype, &value, p)) {
+        sink += 1;
+    }
+}
+
+/**************************************************************************************************/
+/* runner */
+
+static const bench_t benchmarks[] = {
+    { "json_readd_md",          setup_md_text,      run_json_readd },
+    { "json_readd_order",       setup_order_text,   run_json_readd },
+    { "json_writep_md",         setup_md_json,      run_json_writep },
+    { "json_writep_order",      setup_order_json,   run_json_writep },
+    { "base64url_encode_4k",    setup_b64_data,     run_b64_encode },
+    { "base64url_decode_4k",    setup_b64_text,     run_b64_decode },
+    { "dns_matches_1k",         setup_names,        run_dns_matches },
+    { "dns_make_minimal_1k",    setup_names,        run_dns_make_minimal },
+    { "md_get_by_domain_10k",   setup_mds,          run_get_by_domain },
+    { "md_domain_index_10k",    setup_mds,          run_domain_index },
+    { "cert_covers_md_100",     setup_cert,         run_cert_covers_md },
+    { "store_load_text",        setup_store_text,   run_store_load },
+    { "store_load_json",        setup_store_json,   run_store_load },
+    { "store_load_cert",        setup_store_cert,   run_store_load },
+    { "store_load_pkey",        setup_store_pkey,   run_store_load },
+    { "store_load_chain",       setup_store_chain,  run_store_load },
+};
+
+static int selected(const char *name, int argc, const char * const argv[])
+{
+    int i;
+
+    if (argc < 2) {
+        return 1;
+    }
+    for (i = 1; i < argc; ++i) {
+        if (!strncmp(name, argv[i], strlen(argv[i]))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static apr_status_t bench_run(const bench_t *bench, apr_pool_t *p)
+{
+    apr_pool_t *ptemp;
+    void *baton = NULL;
+    apr_time_t start, elapsed;
+    long i, n;
+    apr_status_t rv;
+
+    if (bench->setup && APR_SUCCESS != (rv = bench->setup(&baton, p))) {
+        fprintf(stderr, "%s: setup failed (%d)\n", bench->name, rv);
+        return rv;
+    }
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, p))) {
+        return rv;
+    }
+    for (n = 1; ; n *= 2) {
+        start = apr_time_now();
+        for (i = 0; i < n; ++i) {
+            bench->run(baton, ptemp);
+            apr_pool_clear(ptemp);
+        }
+        elapsed = apr_time_now() - start;
+        if (elapsed >= BENCH_MIN_TIME || n >= BENCH_MAX_ITER) {
+            break;
+        }
+    }
+    printf("{\"bench\":\"%s\",\"iterations\":%ld,\"ns_per_op\":%.1f}\n",
+           bench->name, n, (double)elapsed * 1000.0 / (double)n);
+    fflush(stdout);
+    apr_pool_destroy(ptemp);
+    return APR_SUCCESS;
+}
+
+int main(int argc, const char * const argv[])
+{
+    apr_pool_t *pool, *p;
+    const char *tmp;
+    apr_size_t i;
+    int failed = 0;
+
+    apr_app_initialize(&argc, &argv, NULL);
+    if (APR_SUCCESS != apr_pool_create(&pool, NULL)
+        || APR_SUCCESS != apr_temp_dir_get(&tmp, pool)) {
+        return 1;
+    }
+    store_dir = apr_psprintf(pool, "%s/md-bench-%d", tmp, (int)getpid());
+
+    for (i = 0; i < sizeof(benchmarks)/sizeof(benchmarks[0]); ++i) {
+        if (selected(benchmarks[i].name, argc, argv)) {
+            apr_pool_create(&p, pool);
+            if (APR_SUCCESS != bench_run(&benchmarks[i], p)) {
+                failed = 1;
+            }
+            apr_pool_destroy(p);
+        }
+    }
+
+    md_util_rm_recursive(store_dir, pool, 5);
+    apr_pool_destroy(pool);
+    apr_terminate();
+    return failed;
+}
@@ -20,7 +20,15 @@ static Suite *main_test_suite(void)
 {
     Suite *suite = suite_create("main");
 
+    suite_add_tcase(suite, md_acme_test_case());
+    suite_add_tcase(suite, md_core_test_case());
+    suite_add_tcase(suite, md_crypt_test_case());
     suite_add_tcase(suite, md_json_test_case());
+    suite_add_tcase(suite, md_log_test_case());
+    suite_add_tcase(suite, md_reg_test_case());
+    suite_add_tcase(suite, md_snap_test_case());
+    suite_add_tcase(suite, md_store_test_case());
+    suite_add_tcase(suite, md_trace_test_case());
     suite_add_tcase(suite, md_util_test_case());
 
     return suite;
@@ -40,5 +40,13 @@
  * main_test_suite() in main.c.
  */
 
+TCase *md_acme_test_case(void);
+TCase *md_core_test_case(void);
+TCase *md_crypt_test_case(void);
 TCase *md_json_test_case(void);
+TCase *md_log_test_case(void);
+TCase *md_reg_test_case(void);
+TCase *md_snap_test_case(void);
+TCase *md_store_test_case(void);
+TCase *md_trace_test_case(void);
 TCase *md_util_test_case(void);
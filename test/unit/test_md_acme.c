@@ -0,0 +1,574 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <apr_buckets.h>
+#include <apr_file_io.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_time.h>
+
+#include "test_common.h"
+#include "md.h"
+#include "md_acme.h"
+#include "md_acme_acct.h"
+#include "md_acme_authz.h"
+#include "md_crypt.h"
+#include "md_http.h"
+#include "md_json.h"
+#include "md_store.h"
+#include "md_store_fs.h"
+#include "md_util.h"
+
+#define TEST_CA_BASE    "https://ca.example.org"
+#define TEST_CA_URL     TEST_CA_BASE "/directory"
+#define TEST_DOH_URL    "https://dns.example.net/resolve"
+
+/*
+ * Helpers
+ */
+
+static apr_array_header_t *make_domains(apr_pool_t *p, const char *name, ...)
+{
+    apr_array_header_t *domains = apr_array_make(p, 5, sizeof(const char*));
+    va_list ap;
+
+    va_start(ap, name);
+    for (; name; name = va_arg(ap, const char*)) {
+        APR_ARRAY_PUSH(domains, const char*) = name;
+    }
+    va_end(ap);
+    return domains;
+}
+
+static void set_limit(md_acme_rl_kind_t kind, int count, apr_interval_time_t period)
+{
+    md_acme_rl_t limits[MD_ACME_RL_COUNT];
+
+    memset(limits, 0, sizeof(limits));
+    limits[kind].count = count;
+    limits[kind].period = period;
+    md_acme_rl_configure(limits);
+}
+
+static const char *make_store(md_store_t **pstore, apr_pool_t *p)
+{
+    const char *tmp, *dir;
+
+    ck_assert_int_eq(apr_temp_dir_get(&tmp, p), APR_SUCCESS);
+    dir = apr_psprintf(p, "%s/md-acme-%d", tmp, (int)getpid());
+    md_util_rm_recursive(dir, p, 5);
+    ck_assert_int_eq(md_store_fs_init(pstore, p, dir), APR_SUCCESS);
+    return dir;
+}
+
+static const char *types_str(apr_array_header_t *types, apr_pool_t *p)
+{
+    return apr_array_pstrcat(p, types, ' ');
+}
+
+/* An md_http implementation answering as the CA and a DNS query service would,
+ * without going anywhere. */
+#define FAKE_TXT_MAX    4
+
+typedef struct {
+    int nonces;                     /* handed out */
+    int lookups;                    /* DNS queries answered */
+    int notified;                   /* POSTs to challenges */
+    const char *txt[FAKE_TXT_MAX];  /* TXT records visible in DNS */
+    const char *if_none_match;      /* of the last request for an unchanged resource */
+} fake_net_t;
+
+static fake_net_t g_net;
+
+static apr_status_t fake_init(void)
+{
+    return APR_SUCCESS;
+}
+
+static void fake_req_cleanup(md_http_request_t *req)
+{
+    (void)req;
+}
+
+static const char *fake_dns_answer(apr_pool_t *p)
+{
+    const char *body = "{\"Status\":0,\"Answer\":[";
+    int i;
+    
+    for (i = 0; i < FAKE_TXT_MAX && g_net.txt[i]; ++i) {
+        body = apr_psprintf(p, "%s%s{\"type\":16,\"data\":\"\\\"%s\\\"\"}", 
+                            body, i? "," : "", g_net.txt[i]);
+    }
+    return apr_pstrcat(p, body, "]}", NULL);
+}
+
+static apr_status_t fake_perform(md_http_request_t *req)
+{
+    md_http_response_t res;
+    const char *body = NULL, *ctype = "application/json";
+    apr_status_t rv = APR_SUCCESS;
+    
+    memset(&res, 0, sizeof(res));
+    res.req = req;
+    res.status = 200;
+    res.headers = apr_table_make(req->pool, 5);
+    res.body = apr_brigade_create(req->pool, req->bucket_alloc);
+    apr_table_set(res.headers, "Replay-Nonce", apr_psprintf(req->pool, "n%d", ++g_net.nonces));
+    
+    if (!strcmp("HEAD", req->method)) {
+        /* new nonce */
+    }
+    else if (!strcmp(TEST_CA_URL, req->url)) {
+        body = "{\"newAccount\":\"" TEST_CA_BASE "/acct\", "
+               "\"newNonce\":\"" TEST_CA_BASE "/nonce\", "
+               "\"newOrder\":\"" TEST_CA_BASE "/order\", "
+               "\"revokeCert\":\"" TEST_CA_BASE "/revoke\", "
+               "\"keyChange\":\"" TEST_CA_BASE "/key\"}";
+    }
+    else if (!strncmp(TEST_DOH_URL "?", req->url, sizeof(TEST_DOH_URL))) {
+        ++g_net.lookups;
+        body = fake_dns_answer(req->pool);
+        ctype = "application/dns-json";
+    }
+    else if (!strcmp(TEST_CA_BASE "/unchanged", req->url)) {
+        g_net.if_none_match = req->headers? 
+            apr_table_get(req->headers, "If-None-Match") : NULL;
+        res.status = 304;
+    }
+    else if (!strncmp(TEST_CA_BASE "/cha/", req->url, sizeof(TEST_CA_BASE "/cha/") - 1)
+             && !strcmp("POST", req->method)) {
+        ++g_net.notified;
+        body = "{\"type\":\"dns-01\",\"status\":\"pending\"}";
+    }
+    else {
+        res.status = 404;
+    }
+    if (body) {
+        apr_table_set(res.headers, "Content-Type", ctype);
+        apr_brigade_puts(res.body, NULL, NULL, body);
+    }
+    if (req->cb) {
+        rv = req->cb(&res);
+    }
+    md_http_req_destroy(req);
+    return rv;
+}
+
+static md_http_impl_t fake_http = {
+    fake_init,
+    fake_req_cleanup,
+    fake_perform,
+    NULL,
+    NULL,
+    NULL,
+};
+
+/* Read the CA directory and sign requests with an account of our own. */
+static void set_acct(md_acme_t *acme, apr_pool_t *p)
+{
+    md_pkey_spec_t spec;
+    
+    ck_assert_int_eq(md_acme_setup(acme), APR_SUCCESS);
+    spec.type = MD_PKEY_TYPE_EC;
+    spec.params.ec.curve = "P-256";
+    ck_assert_int_eq(md_pkey_gen(&acme->acct_key, p, &spec), APR_SUCCESS);
+    acme->acct = apr_pcalloc(p, sizeof(*acme->acct));
+    acme->acct->url = TEST_CA_BASE "/acct/1";
+}
+
+static md_acme_authz_t *make_authz(const char *domain, apr_pool_t *p)
+{
+    md_acme_authz_t *authz;
+    md_json_t *cha;
+    
+    authz = md_acme_authz_create(p);
+    authz->domain = domain;
+    authz->url = apr_pstrcat(p, TEST_CA_BASE "/authz/", domain, NULL);
+    authz->state = MD_ACME_AUTHZ_S_PENDING;
+    authz->resource = md_json_create(p);
+    cha = md_json_create(p);
+    md_json_sets(MD_AUTHZ_TYPE_DNS01, cha, MD_KEY_TYPE, NULL);
+    md_json_sets(apr_pstrcat(p, TEST_CA_BASE "/cha/", domain, NULL), cha, MD_KEY_URL, NULL);
+    md_json_sets(apr_pstrcat(p, "token-", domain, NULL), cha, MD_KEY_TOKEN, NULL);
+    md_json_addj(cha, authz->resource, MD_KEY_CHALLENGES, NULL);
+    return authz;
+}
+
+/* A dns-01 command that records its arguments, one line per call, in dir/dns01.log */
+static const char *make_dns01_cmd(const char *dir, apr_pool_t *p)
+{
+    const char *path = apr_pstrcat(p, dir, "/dns01.sh", NULL);
+    
+    ck_assert_int_eq(md_text_fcreatex(path, APR_FPROT_UREAD|APR_FPROT_UWRITE, p, 
+                                      apr_psprintf(p, "#!/bin/sh\necho \"$@\" >> %s/dns01.log\n", 
+                                                   dir)), APR_SUCCESS);
+    ck_assert_int_eq(apr_file_perms_set(path, APR_FPROT_UREAD|APR_FPROT_UWRITE
+                                              |APR_FPROT_UEXECUTE), APR_SUCCESS);
+    return path;
+}
+
+static apr_array_header_t *dns01_calls(const char *dir, apr_pool_t *p)
+{
+    apr_array_header_t *calls = apr_array_make(p, 5, sizeof(const char*));
+    char *data, *line, *last;
+    const char *s;
+    
+    if (APR_SUCCESS == md_text_fread8k(&s, p, apr_pstrcat(p, dir, "/dns01.log", NULL))) {
+        data = apr_pstrdup(p, s);
+        for (line = apr_strtok(data, "\n", &last); line; line = apr_strtok(NULL, "\n", &last)) {
+            APR_ARRAY_PUSH(calls, const char*) = line;
+        }
+    }
+    return calls;
+}
+
+/* The nth word of a line, counting from 0. */
+static const char *word(const char *line, int n, apr_pool_t *p)
+{
+    char *data = apr_pstrdup(p, line), *w, *last;
+    
+    for (w = apr_strtok(data, " ", &last); w && n > 0; w = apr_strtok(NULL, " ", &last)) {
+        --n;
+    }
+    return w;
+}
+
+/*
+ * Test Fixture -- runs once per test
+ */
+
+static apr_pool_t *g_pool;
+static md_acme_t *g_acme;
+
+static void md_acme_test_setup(void)
+{
+    memset(&g_net, 0, sizeof(g_net));
+    md_http_use_implementation(&fake_http);
+    if (apr_pool_create(&g_pool, NULL) != APR_SUCCESS
+        || md_acme_init(g_pool, "test", 1) != APR_SUCCESS
+        || md_acme_create(&g_acme, g_pool, TEST_CA_URL, NULL) != APR_SUCCESS) {
+        exit(1);
+    }
+}
+
+static void md_acme_test_teardown(void)
+{
+    md_acme_rl_configure(NULL);
+    apr_pool_destroy(g_pool);
+}
+
+START_TEST(md_acme_rl_bucket)
+{
+    apr_time_t retry_at, now = apr_time_now();
+
+    /* two requests per minute, the third has to wait for the first token back */
+    set_limit(MD_ACME_RL_REQUESTS, 2, apr_time_from_sec(60));
+    ck_assert_int_eq(md_acme_rl_take(g_acme, MD_ACME_RL_REQUESTS, NULL, &retry_at), APR_SUCCESS);
+    ck_assert(retry_at == 0);
+    ck_assert_int_eq(md_acme_rl_take(g_acme, MD_ACME_RL_REQUESTS, NULL, &retry_at), APR_SUCCESS);
+    ck_assert_int_eq(md_acme_rl_take(g_acme, MD_ACME_RL_REQUESTS, NULL, &retry_at), APR_BADARG);
+    ck_assert(retry_at > now);
+    ck_assert(retry_at <= apr_time_now() + apr_time_from_sec(30));
+    /* a refused request takes no token */
+    ck_assert_int_eq(md_acme_rl_take(g_acme, MD_ACME_RL_REQUESTS, NULL, NULL), APR_BADARG);
+    /* other kinds have no limit */
+    ck_assert_int_eq(md_acme_rl_take(g_acme, MD_ACME_RL_ORDERS, NULL, NULL), APR_SUCCESS);
+
+    md_acme_rl_configure(NULL);
+    ck_assert_int_eq(md_acme_rl_take(g_acme, MD_ACME_RL_REQUESTS, NULL, NULL), APR_SUCCESS);
+}
+END_TEST
+
+START_TEST(md_acme_rl_certs_per_domain)
+{
+    apr_pool_t *p = g_pool;
+
+    set_limit(MD_ACME_RL_CERTS, 1, apr_time_from_sec(3600));
+    /* one certificate counts once for each registered domain in it */
+    ck_assert_int_eq(md_acme_rl_take(g_acme, MD_ACME_RL_CERTS,
+                                     make_domains(p, "a.example.org", "b.Example.org",
+                                                  "example.net", NULL), NULL), APR_SUCCESS);
+    /* registered domains are compared without case */
+    ck_assert_int_eq(md_acme_rl_take(g_acme, MD_ACME_RL_CERTS,
+                                     make_domains(p, "EXAMPLE.ORG", NULL), NULL), APR_BADARG);
+    ck_assert_int_eq(md_acme_rl_take(g_acme, MD_ACME_RL_CERTS,
+                                     make_domains(p, "www.example.NET", NULL), NULL), APR_BADARG);
+    ck_assert_int_eq(md_acme_rl_take(g_acme, MD_ACME_RL_CERTS,
+                                     make_domains(p, "example.com", NULL), NULL), APR_SUCCESS);
+}
+END_TEST
+
+START_TEST(md_acme_rl_failed_blocks_orders)
+{
+    ck_assert(md_acme_rl_retry_at(TEST_CA_URL) == 0);
+
+    set_limit(MD_ACME_RL_FAILED, 2, apr_time_from_sec(3600));
+    md_acme_rl_count(g_acme, MD_ACME_RL_FAILED, NULL);
+    ck_assert(md_acme_rl_retry_at(TEST_CA_URL) == 0);
+    ck_assert_int_eq(md_acme_rl_take(g_acme, MD_ACME_RL_ORDERS, NULL, NULL), APR_SUCCESS);
+    md_acme_rl_count(g_acme, MD_ACME_RL_FAILED, NULL);
+    ck_assert(md_acme_rl_retry_at(TEST_CA_URL) > apr_time_now());
+    ck_assert_int_eq(md_acme_rl_take(g_acme, MD_ACME_RL_ORDERS, NULL, NULL), APR_BADARG);
+    /* other CAs are not affected */
+    ck_assert(md_acme_rl_retry_at("https://other.example.org/directory") == 0);
+}
+END_TEST
+
+START_TEST(md_acme_cha_stats)
+{
+    apr_pool_t *p = g_pool;
+    md_store_t *store;
+    md_acme_cha_stats_t *stats;
+    apr_array_header_t *types;
+    const char *dir;
+
+    dir = make_store(&store, p);
+    types = make_domains(p, "http-01", "tls-alpn-01", "dns-01", NULL);
+
+    /* without experience, the configured order is kept */
+    ck_assert_int_eq(md_acme_cha_stats_load(&stats, store, "www.example.org", p), APR_SUCCESS);
+    ck_assert_str_eq(types_str(md_acme_cha_stats_sort(stats, types, p), p),
+                     "http-01 tls-alpn-01 dns-01");
+
+    /* reliable types come first, the fastest of them first, failing ones last */
+    md_acme_cha_stats_add(stats, "http-01", 1, apr_time_from_sec(2));
+    md_acme_cha_stats_add(stats, "tls-alpn-01", 1, apr_time_from_sec(1));
+    md_acme_cha_stats_add(stats, "dns-01", 0, 0);
+    ck_assert_str_eq(types_str(md_acme_cha_stats_sort(stats, types, p), p),
+                     "tls-alpn-01 http-01 dns-01");
+
+    /* a reliable type stays so after one failure, but not after two */
+    types = make_domains(p, "tls-alpn-01", "http-01", NULL);
+    md_acme_cha_stats_add(stats, "tls-alpn-01", 0, 0);
+    ck_assert_str_eq(types_str(md_acme_cha_stats_sort(stats, types, p), p),
+                     "tls-alpn-01 http-01");
+    md_acme_cha_stats_add(stats, "tls-alpn-01", 0, 0);
+    ck_assert_str_eq(types_str(md_acme_cha_stats_sort(stats, types, p), p),
+                     "http-01 tls-alpn-01");
+    ck_assert_int_eq(md_acme_cha_stats_save(stats, p), APR_SUCCESS);
+
+    /* another MD of the suffix starts with what the suffix has seen... */
+    ck_assert_int_eq(md_acme_cha_stats_load(&stats, store, "mail.example.org", p), APR_SUCCESS);
+    ck_assert_str_eq(types_str(md_acme_cha_stats_sort(stats, types, p), p),
+                     "http-01 tls-alpn-01");
+    /* ...until it has records of its own */
+    md_acme_cha_stats_add(stats, "tls-alpn-01", 1, apr_time_from_msec(10));
+    ck_assert_str_eq(types_str(md_acme_cha_stats_sort(stats, types, p), p),
+                     "tls-alpn-01 http-01");
+
+    /* other suffixes have statistics of their own */
+    ck_assert_int_eq(md_acme_cha_stats_load(&stats, store, "www.example.net", p), APR_SUCCESS);
+    ck_assert_str_eq(types_str(md_acme_cha_stats_sort(stats, types, p), p),
+                     "tls-alpn-01 http-01");
+
+    md_util_rm_recursive(dir, p, 5);
+}
+END_TEST
+
+START_TEST(md_acme_dns01_batch)
+{
+    apr_pool_t *p = g_pool;
+    md_store_t *store;
+    md_acme_authz_batch_t *batch;
+    md_acme_authz_t *a, *b;
+    apr_array_header_t *types, *calls, *tokens;
+    apr_table_t *env;
+    const char *dir, *token;
+    int run;
+    
+    dir = make_store(&store, p);
+    env = apr_table_make(p, 5);
+    apr_table_set(env, MD_KEY_CMD_DNS01, make_dns01_cmd(dir, p));
+    apr_table_set(env, MD_KEY_CMD_DNS01_BATCH, "on");
+    apr_table_set(env, MD_KEY_DNS01_CHECK, TEST_DOH_URL);
+    set_acct(g_acme, p);
+    types = make_domains(p, MD_AUTHZ_TYPE_DNS01, NULL);
+    a = make_authz("a.example.org", p);
+    b = make_authz("b.example.org", p);
+    
+    for (run = 0; run < 3; ++run) {
+        batch = md_acme_authz_batch_make(p);
+        ck_assert_int_eq(md_acme_authz_respond(a, g_acme, store, types, NULL, env, batch, p, 
+                                               &token), APR_SUCCESS);
+        ck_assert_str_eq(token, "dns-01:a.example.org");
+        ck_assert_int_eq(md_acme_authz_respond(b, g_acme, store, types, NULL, env, batch, p, 
+                                               &token), APR_SUCCESS);
+        ck_assert_str_eq(token, "dns-01:b.example.org");
+        
+        switch (run) {
+            case 0:
+                /* all set up with one command, the CA is not told before DNS has them */
+                ck_assert_int_eq(md_acme_authz_batch_run(batch, g_acme, env, p), 
+                                 APR_EINPROGRESS);
+                ck_assert_int_eq(g_net.lookups, 2);
+                ck_assert_int_eq(g_net.notified, 0);
+                calls = dns01_calls(dir, p);
+                ck_assert_int_eq(calls->nelts, 1);
+                ck_assert_str_eq(word(APR_ARRAY_IDX(calls, 0, const char*), 0, p), "setup-all");
+                ck_assert_str_eq(word(APR_ARRAY_IDX(calls, 0, const char*), 1, p), 
+                                 "a.example.org");
+                ck_assert_str_eq(word(APR_ARRAY_IDX(calls, 0, const char*), 3, p), 
+                                 "b.example.org");
+                g_net.txt[0] = word(APR_ARRAY_IDX(calls, 0, const char*), 2, p);
+                break;
+            case 1:
+                /* coming back, nothing is set up again, only looked up */
+                ck_assert_int_eq(md_acme_authz_batch_run(batch, g_acme, env, p), 
+                                 APR_EINPROGRESS);
+                ck_assert_int_eq(g_net.lookups, 4);
+                ck_assert_int_eq(g_net.notified, 0);
+                calls = dns01_calls(dir, p);
+                ck_assert_int_eq(calls->nelts, 1);
+                g_net.txt[1] = word(APR_ARRAY_IDX(calls, 0, const char*), 4, p);
+                break;
+            default:
+                /* all visible, the CA gets to verify them */
+                ck_assert_int_eq(md_acme_authz_batch_run(batch, g_acme, env, p), APR_SUCCESS);
+                ck_assert_int_eq(g_net.lookups, 6);
+                ck_assert_int_eq(g_net.notified, 2);
+                ck_assert_int_eq(dns01_calls(dir, p)->nelts, 1);
+                break;
+        }
+    }
+    
+    /* torn down with one command as well, after that they are set up anew */
+    tokens = make_domains(p, "dns-01:a.example.org", "dns-01:b.example.org", NULL);
+    ck_assert_int_eq(md_acme_authz_teardown_all(store, tokens, env, p), APR_SUCCESS);
+    calls = dns01_calls(dir, p);
+    ck_assert_int_eq(calls->nelts, 2);
+    ck_assert_str_eq(APR_ARRAY_IDX(calls, 1, const char*), 
+                     "teardown-all a.example.org b.example.org");
+    batch = md_acme_authz_batch_make(p);
+    ck_assert_int_eq(md_acme_authz_respond(a, g_acme, store, types, NULL, env, batch, p, 
+                                           &token), APR_SUCCESS);
+    ck_assert_int_eq(md_acme_authz_batch_run(batch, g_acme, env, p), APR_SUCCESS);
+    calls = dns01_calls(dir, p);
+    ck_assert_int_eq(calls->nelts, 3);
+    ck_assert_str_eq(word(APR_ARRAY_IDX(calls, 2, const char*), 0, p), "setup-all");
+    ck_assert_int_eq(g_net.notified, 3);
+    
+    md_util_rm_recursive(dir, p, 5);
+}
+END_TEST
+
+START_TEST(md_acme_dns01_check)
+{
+    apr_pool_t *p = g_pool;
+    md_store_t *store;
+    md_acme_authz_t *a;
+    apr_array_header_t *types, *calls;
+    apr_table_t *env;
+    const char *dir, *token;
+    
+    dir = make_store(&store, p);
+    env = apr_table_make(p, 5);
+    apr_table_set(env, MD_KEY_CMD_DNS01, make_dns01_cmd(dir, p));
+    apr_table_set(env, MD_KEY_DNS01_CHECK, TEST_DOH_URL);
+    apr_table_set(env, MD_KEY_DNS01_CHECK_TIMEOUT, "0");
+    set_acct(g_acme, p);
+    types = make_domains(p, MD_AUTHZ_TYPE_DNS01, NULL);
+    a = make_authz("a.example.org", p);
+    
+    /* not visible in time, the next attempt sets it up again */
+    ck_assert_int_eq(md_acme_authz_respond(a, g_acme, store, types, NULL, env, NULL, p, 
+                                           &token), APR_TIMEUP);
+    ck_assert_int_eq(md_acme_authz_respond(a, g_acme, store, types, NULL, env, NULL, p, 
+                                           &token), APR_TIMEUP);
+    calls = dns01_calls(dir, p);
+    ck_assert_int_eq(calls->nelts, 2);
+    ck_assert_str_eq(word(APR_ARRAY_IDX(calls, 0, const char*), 0, p), "setup");
+    ck_assert_str_eq(word(APR_ARRAY_IDX(calls, 0, const char*), 1, p), "a.example.org");
+    ck_assert_int_eq(g_net.lookups, 2);
+    ck_assert_int_eq(g_net.notified, 0);
+    
+    /* with time left, it stays set up while it is looked up */
+    apr_table_set(env, MD_KEY_DNS01_CHECK_TIMEOUT, "300");
+    ck_assert_int_eq(md_acme_authz_respond(a, g_acme, store, types, NULL, env, NULL, p, 
+                                           &token), APR_EINPROGRESS);
+    ck_assert_str_eq(token, "dns-01:a.example.org");
+    ck_assert_int_eq(md_acme_authz_respond(a, g_acme, store, types, NULL, env, NULL, p, 
+                                           &token), APR_EINPROGRESS);
+    calls = dns01_calls(dir, p);
+    ck_assert_int_eq(calls->nelts, 3);
+    ck_assert_int_eq(g_net.lookups, 4);
+    
+    g_net.txt[0] = "other";
+    g_net.txt[1] = word(APR_ARRAY_IDX(calls, 2, const char*), 2, p);
+    ck_assert_int_eq(md_acme_authz_respond(a, g_acme, store, types, NULL, env, NULL, p, 
+                                           &token), APR_SUCCESS);
+    ck_assert_int_eq(dns01_calls(dir, p)->nelts, 3);
+    ck_assert_int_eq(g_net.lookups, 5);
+    ck_assert_int_eq(g_net.notified, 1);
+    
+    md_util_rm_recursive(dir, p, 5);
+}
+END_TEST
+
+static apr_status_t on_init_etag(md_acme_req_t *req, void *baton)
+{
+    (void)baton;
+    apr_table_set(req->req_hdrs, "If-None-Match", "\"v1\"");
+    return APR_SUCCESS;
+}
+
+static apr_status_t on_res_status(md_acme_t *acme, const md_http_response_t *res, void *baton)
+{
+    (void)acme;
+    *(int*)baton = res->status;
+    return APR_SUCCESS;
+}
+
+START_TEST(md_acme_get_not_modified)
+{
+    int status = 0;
+    
+    ck_assert_int_eq(md_acme_setup(g_acme), APR_SUCCESS);
+    
+    /* the answer to a conditional request reaches the callback */
+    ck_assert_int_eq(md_acme_GET(g_acme, TEST_CA_BASE "/unchanged", on_init_etag, NULL, 
+                                 on_res_status, &status), APR_SUCCESS);
+    ck_assert_int_eq(status, 304);
+    ck_assert_str_eq(g_net.if_none_match, "\"v1\"");
+    
+    /* without asking for it, a 304 is not something to work with */
+    status = 0;
+    ck_assert_int_ne(md_acme_GET(g_acme, TEST_CA_BASE "/unchanged", NULL, NULL, 
+                                 on_res_status, &status), APR_SUCCESS);
+    ck_assert_int_eq(status, 0);
+    ck_assert_ptr_eq(g_net.if_none_match, NULL);
+}
+END_TEST
+
+TCase *md_acme_test_case(void)
+{
+    TCase *testcase = tcase_create("md_acme");
+
+    tcase_add_checked_fixture(testcase, md_acme_test_setup, md_acme_test_teardown);
+
+    tcase_add_test(testcase, md_acme_rl_bucket);
+    tcase_add_test(testcase, md_acme_rl_certs_per_domain);
+    tcase_add_test(testcase, md_acme_rl_failed_blocks_orders);
+    tcase_add_test(testcase, md_acme_cha_stats);
+    tcase_add_test(testcase, md_acme_dns01_batch);
+    tcase_add_test(testcase, md_acme_dns01_check);
+    tcase_add_test(testcase, md_acme_get_not_modified);
+
+    return testcase;
+}
@@ -0,0 +1,328 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+
+#include <apr_strings.h>
+#include <apr_tables.h>
+
+#include "test_common.h"
+#include "md.h"
+#include "md_crypt.h"
+#include "md_json.h"
+#include "md_plan.h"
+#include "md_store.h"
+#include "md_util.h"
+
+/*
+ * Helpers
+ */
+
+static md_t *make_md(apr_pool_t *p, const char *name, ...)
+{
+    md_t *md;
+    const char *domain;
+    va_list ap;
+    
+    md = md_create_empty(p);
+    md->name = name;
+    va_start(ap, name);
+    while ((domain = va_arg(ap, const char *))) {
+        APR_ARRAY_PUSH(md->domains, const char *) = domain;
+    }
+    va_end(ap);
+    return md;
+}
+
+/*
+ * Test Fixture -- runs once per test
+ */
+
+static apr_pool_t *g_pool;
+
+static void md_core_setup(void)
+{
+    if (apr_pool_create(&g_pool, NULL) != APR_SUCCESS) {
+        exit(1);
+    }
+}
+
+static void md_core_teardown(void)
+{
+    apr_pool_destroy(g_pool);
+}
+
+/*
+ * Tests
+ */
+START_TEST(md_core_index_lookup)
+{
+    apr_array_header_t *mds;
+    md_domain_index_t *idx;
+    md_t *md1, *md2;
+    
+    mds = apr_array_make(g_pool, 5, sizeof(md_t *));
+    md1 = make_md(g_pool, "example.org", "example.org", "www.example.org", NULL);
+    md2 = make_md(g_pool, "test.org", "test.org", "*.test.org", NULL);
+    APR_ARRAY_PUSH(mds, md_t *) = md1;
+    APR_ARRAY_PUSH(mds, md_t *) = md2;
+    idx = md_domain_index_make(g_pool, mds);
+    
+    ck_assert_ptr_eq(md_domain_index_get_by_name(idx, "example.org"), md1);
+    ck_assert_ptr_eq(md_domain_index_get_by_name(idx, "test.org"), md2);
+    ck_assert_ptr_eq(md_domain_index_get_by_name(idx, "www.example.org"), NULL);
+    
+    ck_assert_ptr_eq(md_domain_index_get_by_domain(idx, "www.example.org"), md1);
+    ck_assert_ptr_eq(md_domain_index_get_by_domain(idx, "WWW.Example.ORG"), md1);
+    ck_assert_ptr_eq(md_domain_index_get_by_domain(idx, "mail.example.org"), NULL);
+    /* exact lookup, as md_get_by_domain(), does not match wildcards */
+    ck_assert_ptr_eq(md_domain_index_get_by_domain(idx, "a.test.org"), NULL);
+    ck_assert_ptr_eq(md_domain_index_get_by_domain(idx, "*.test.org"), md2);
+    
+    ck_assert_ptr_eq(md_domain_index_find_match(idx, "a.test.org"), md2);
+    ck_assert_ptr_eq(md_domain_index_find_match(idx, "A.Test.Org"), md2);
+    ck_assert_ptr_eq(md_domain_index_find_match(idx, "test.org"), md2);
+    /* wildcards match a single label only */
+    ck_assert_ptr_eq(md_domain_index_find_match(idx, "a.b.test.org"), NULL);
+    ck_assert_ptr_eq(md_domain_index_find_match(idx, "a.example.org"), NULL);
+}
+END_TEST
+
+START_TEST(md_core_index_common_name)
+{
+    md_domain_index_t *idx;
+    md_t *md1, *md2, *md3, *other;
+    const char *name;
+    
+    md1 = make_md(g_pool, "a", "a.org", "www.a.org", NULL);
+    md2 = make_md(g_pool, "b", "b.org", "WWW.A.org", NULL);
+    md3 = make_md(g_pool, "c", "c.org", NULL);
+    idx = md_domain_index_make(g_pool, NULL);
+    md_domain_index_add(idx, md1);
+    
+    ck_assert_ptr_eq(md_domain_index_common_name(idx, md1, &other), NULL);
+    name = md_domain_index_common_name(idx, md2, &other);
+    ck_assert_str_eq(name, "WWW.A.org");
+    ck_assert_ptr_eq(other, md1);
+    ck_assert_ptr_eq(md_domain_index_common_name(idx, md3, &other), NULL);
+    ck_assert_ptr_eq(other, NULL);
+}
+END_TEST
+
+START_TEST(md_core_alt_pkeys)
+{
+    md_t *md, *md2;
+    md_pkey_spec_t rsa, ec;
+    
+    rsa.type = MD_PKEY_TYPE_RSA;
+    rsa.params.rsa.bits = 3072;
+    ec.type = MD_PKEY_TYPE_EC;
+    ec.params.ec.curve = "P-256";
+    
+    md = make_md(g_pool, "a", "a.org", NULL);
+    md->pkey_spec = &rsa;
+    md->alt_pkey_specs = apr_array_make(g_pool, 1, sizeof(md_pkey_spec_t*));
+    APR_ARRAY_PUSH(md->alt_pkey_specs, md_pkey_spec_t*) = &ec;
+    
+    md2 = md_from_json(md_to_json(md, g_pool), g_pool);
+    ck_assert(md_pkey_spec_eq(md2->pkey_spec, &rsa));
+    ck_assert(md_pkey_specs_eq(md2->alt_pkey_specs, md->alt_pkey_specs));
+    ck_assert(!md_pkey_specs_eq(md2->alt_pkey_specs, NULL));
+    
+    ck_assert_str_eq(md_pkey_fname_for(NULL, g_pool), MD_FN_PRIVKEY);
+    ck_assert_str_eq(md_pubcert_fname_for(NULL, g_pool), MD_FN_PUBCERT);
+    ck_assert_str_eq(md_pkey_fname_for(&ec, g_pool), "privkey.ec-P-256.pem");
+    ck_assert_str_eq(md_pubcert_fname_for(&rsa, g_pool), "pubcert.rsa-3072.pem");
+    ck_assert_str_eq(md_ocsp_fname_for(NULL, g_pool), MD_FN_OCSP);
+    ck_assert_str_eq(md_ocsp_fname_for(&ec, g_pool), "ocsp.ec-P-256.json");
+}
+END_TEST
+
+START_TEST(md_core_json_roundtrip)
+{
+    md_t *md, *md2;
+    
+    md = make_md(g_pool, "a", "a.org", "www.a.org", NULL);
+    md->ca_url = "https://ca.test/directory";
+    md->ca_proto = "ACME";
+    md->ca_account = "ACME-ca.test-0000";
+    md->ca_challenges = apr_array_make(g_pool, 2, sizeof(const char*));
+    APR_ARRAY_PUSH(md->ca_challenges, const char*) = "dns-01";
+    md->valid_from = apr_time_from_sec(1546300800);
+    md->expires = apr_time_from_sec(1554076800);
+    md->require_https = MD_REQUIRE_PERMANENT;
+    
+    md2 = md_from_json(md_to_json(md, g_pool), g_pool);
+    ck_assert_str_eq(md2->name, "a");
+    ck_assert_int_eq(md2->domains->nelts, 2);
+    ck_assert_str_eq(md2->ca_url, md->ca_url);
+    ck_assert_str_eq(md2->ca_proto, md->ca_proto);
+    ck_assert_str_eq(md2->ca_account, md->ca_account);
+    ck_assert_ptr_eq(md2->ca_agreement, NULL);
+    ck_assert_int_eq(md2->ca_challenges->nelts, 1);
+    ck_assert_str_eq(APR_ARRAY_IDX(md2->ca_challenges, 0, const char*), "dns-01");
+    ck_assert(md2->valid_from == md->valid_from);
+    ck_assert(md2->expires == md->expires);
+    ck_assert_int_eq(md2->require_https, MD_REQUIRE_PERMANENT);
+    
+    /* without ca and cert objects */
+    md2 = md_from_json(md_json_create(g_pool), g_pool);
+    ck_assert_ptr_eq(md2->ca_url, NULL);
+    ck_assert_ptr_eq(md2->ca_challenges, NULL);
+    ck_assert(md2->expires == 0);
+}
+END_TEST
+
+START_TEST(md_core_ca_urls)
+{
+    md_t *md, *md2;
+    
+    md = make_md(g_pool, "a", "a.org", NULL);
+    md->ca_url = "https://ca1.test/directory";
+    ck_assert_str_eq(md_ca_effective(md), md->ca_url);
+    md->ca_urls = apr_array_make(g_pool, 2, sizeof(const char*));
+    APR_ARRAY_PUSH(md->ca_urls, const char*) = md->ca_url;
+    APR_ARRAY_PUSH(md->ca_urls, const char*) = "https://ca2.test/directory";
+    md->ca_effective = "https://ca2.test/directory";
+    
+    md2 = md_from_json(md_to_json(md, g_pool), g_pool);
+    ck_assert_int_eq(md2->ca_urls->nelts, 2);
+    ck_assert_str_eq(APR_ARRAY_IDX(md2->ca_urls, 1, const char*), "https://ca2.test/directory");
+    ck_assert_str_eq(md_ca_effective(md2), "https://ca2.test/directory");
+    
+    /* a single CA is written as before */
+    md->ca_urls = NULL;
+    md->ca_effective = NULL;
+    md2 = md_from_json(md_to_json(md, g_pool), g_pool);
+    ck_assert_ptr_eq(md2->ca_urls, NULL);
+    ck_assert_str_eq(md_ca_effective(md2), "https://ca1.test/directory");
+}
+END_TEST
+
+START_TEST(md_core_clone)
+{
+    md_t *md, *md2;
+    md_pkey_spec_t *spec;
+    apr_pool_t *p;
+    
+    ck_assert(apr_pool_create(&p, g_pool) == APR_SUCCESS);
+    md = make_md(p, "a", "a.org", "www.a.org", NULL);
+    md->pkey_spec = apr_pcalloc(p, sizeof(*md->pkey_spec));
+    md->pkey_spec->type = MD_PKEY_TYPE_RSA;
+    md->pkey_spec->params.rsa.bits = 4096;
+    spec = apr_pcalloc(p, sizeof(*spec));
+    spec->type = MD_PKEY_TYPE_EC;
+    spec->params.ec.curve = "P-384";
+    md->alt_pkey_specs = apr_array_make(p, 1, sizeof(md_pkey_spec_t*));
+    APR_ARRAY_PUSH(md->alt_pkey_specs, md_pkey_spec_t*) = spec;
+    
+    md2 = md_clone(g_pool, md);
+    ck_assert_ptr_ne(md2->pkey_spec, md->pkey_spec);
+    ck_assert_ptr_ne(APR_ARRAY_IDX(md2->alt_pkey_specs, 0, md_pkey_spec_t*), spec);
+    /* the clone must not use anything of the original's pool */
+    apr_pool_destroy(p);
+    ck_assert_str_eq(md2->name, "a");
+    ck_assert_int_eq(md2->domains->nelts, 2);
+    ck_assert_int_eq(md2->pkey_spec->type, MD_PKEY_TYPE_RSA);
+    ck_assert_int_eq(md2->pkey_spec->params.rsa.bits, 4096);
+    spec = APR_ARRAY_IDX(md2->alt_pkey_specs, 0, md_pkey_spec_t*);
+    ck_assert_int_eq(spec->type, MD_PKEY_TYPE_EC);
+    ck_assert_str_eq(spec->params.ec.curve, "P-384");
+}
+END_TEST
+
+START_TEST(md_core_plan_groups)
+{
+    apr_array_header_t *mds, *groups, *group;
+    md_t *md;
+    
+    mds = apr_array_make(g_pool, 5, sizeof(md_t*));
+    APR_ARRAY_PUSH(mds, md_t*) = make_md(g_pool, "a", "a.org", "www.a.org", NULL);
+    APR_ARRAY_PUSH(mds, md_t*) = make_md(g_pool, "b", "b.org", NULL);
+    APR_ARRAY_PUSH(mds, md_t*) = make_md(g_pool, "c", "*.c.org", NULL);
+    APR_ARRAY_PUSH(mds, md_t*) = make_md(g_pool, "d", "x.c.org", NULL);
+    md = make_md(g_pool, "e", "e.org", NULL);
+    md->ca_url = "https://other.test/directory";
+    APR_ARRAY_PUSH(mds, md_t*) = md;
+    
+    /* 'a' and 'b' fill a certificate of 3 names, 'd' goes with the wildcard
+     * of 'c' and 'e' uses another CA */
+    groups = md_plan_groups(g_pool, mds, 3);
+    ck_assert_int_eq(groups->nelts, 3);
+    group = APR_ARRAY_IDX(groups, 0, apr_array_header_t*);
+    ck_assert_int_eq(group->nelts, 2);
+    ck_assert_str_eq(APR_ARRAY_IDX(group, 1, md_t*)->name, "b");
+    group = APR_ARRAY_IDX(groups, 1, apr_array_header_t*);
+    ck_assert_int_eq(group->nelts, 2);
+    ck_assert_str_eq(APR_ARRAY_IDX(group, 1, md_t*)->name, "d");
+    md = md_plan_merge(g_pool, group);
+    ck_assert_str_eq(md->name, "c");
+    ck_assert_int_eq(md->domains->nelts, 2);
+    ck_assert_int_eq(APR_ARRAY_IDX(mds, 2, md_t*)->domains->nelts, 1);
+    group = APR_ARRAY_IDX(groups, 2, apr_array_header_t*);
+    ck_assert_int_eq(group->nelts, 1);
+    
+    /* overlapping MDs are not grouped */
+    md = make_md(g_pool, "f", "b.org", NULL);
+    ck_assert(!md_plan_compatible(APR_ARRAY_IDX(mds, 1, md_t*), md, g_pool));
+}
+END_TEST
+
+START_TEST(md_core_renew_at)
+{
+    md_t *md;
+    apr_time_t now = apr_time_now();
+    apr_interval_time_t diff;
+    
+    md = make_md(g_pool, "a", "a.org", NULL);
+    ck_assert(md_renew_at(md) == 0);
+    ck_assert(md_should_renew(md));
+    
+    /* fixed window of 30 days */
+    md->valid_from = now - apr_time_from_sec(10 * MD_SECS_PER_DAY);
+    md->expires = now + apr_time_from_sec(80 * MD_SECS_PER_DAY);
+    md->renew_norm = 0;
+    md->renew_window = apr_time_from_sec(30 * MD_SECS_PER_DAY);
+    ck_assert(md_renew_at(md) == now + apr_time_from_sec(50 * MD_SECS_PER_DAY));
+    ck_assert(!md_should_renew(md));
+    
+    /* 30 of 90 days, relative to the lifetime */
+    md->renew_norm = apr_time_from_sec(90 * MD_SECS_PER_DAY);
+    md->expires = now + apr_time_from_sec(170 * MD_SECS_PER_DAY);
+    diff = md_renew_at(md) - (now + apr_time_from_sec(110 * MD_SECS_PER_DAY));
+    ck_assert(diff > -apr_time_from_sec(1) && diff < apr_time_from_sec(1));
+    
+    md->expires = now + apr_time_from_sec(20 * MD_SECS_PER_DAY);
+    ck_assert(md_should_renew(md));
+}
+END_TEST
+
+TCase *md_core_test_case(void)
+{
+    TCase *testcase = tcase_create("md_core");
+
+    tcase_add_checked_fixture(testcase, md_core_setup, md_core_teardown);
+
+    tcase_add_test(testcase, md_core_index_lookup);
+    tcase_add_test(testcase, md_core_index_common_name);
+    tcase_add_test(testcase, md_core_alt_pkeys);
+    tcase_add_test(testcase, md_core_json_roundtrip);
+    tcase_add_test(testcase, md_core_ca_urls);
+    tcase_add_test(testcase, md_core_clone);
+    tcase_add_test(testcase, md_core_renew_at);
+    tcase_add_test(testcase, md_core_plan_groups);
+
+    return testcase;
+}
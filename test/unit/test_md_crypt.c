@@ -0,0 +1,270 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <apr_file_info.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+
+#include "test_common.h"
+#include "md.h"
+#include "md_crypt.h"
+#include "md_json.h"
+#include "md_jws.h"
+#include "md_util.h"
+
+/*
+ * Test Fixture -- runs once per test
+ */
+
+static apr_pool_t *g_pool;
+
+static void md_crypt_setup(void)
+{
+    if (apr_pool_create(&g_pool, NULL) != APR_SUCCESS) {
+        exit(1);
+    }
+    md_crypt_init(g_pool);
+}
+
+static void md_crypt_teardown(void)
+{
+    apr_pool_destroy(g_pool);
+}
+
+/*
+ * Tests
+ */
+
+START_TEST(md_crypt_ec_spec_json)
+{
+    md_pkey_spec_t spec, *spec2;
+    md_json_t *json;
+    
+    spec.type = MD_PKEY_TYPE_EC;
+    spec.params.ec.curve = md_pkey_ec_curve_name("secp384r1");
+    ck_assert_str_eq(spec.params.ec.curve, "P-384");
+    
+    json = md_pkey_spec_to_json(&spec, g_pool);
+    ck_assert_str_eq(md_json_gets(json, MD_KEY_TYPE, NULL), "EC");
+    ck_assert_str_eq(md_json_gets(json, MD_KEY_CURVE, NULL), "P-384");
+    spec2 = md_pkey_spec_from_json(json, g_pool);
+    ck_assert(md_pkey_spec_eq(&spec, spec2));
+    
+    /* missing curve selects the default */
+    md_json_del(json, MD_KEY_CURVE, NULL);
+    spec2 = md_pkey_spec_from_json(json, g_pool);
+    ck_assert_int_eq(spec2->type, MD_PKEY_TYPE_EC);
+    ck_assert_str_eq(spec2->params.ec.curve, MD_PKEY_EC_CURVE_DEF);
+    ck_assert(!md_pkey_spec_eq(&spec, spec2));
+    
+    ck_assert_ptr_eq(md_pkey_ec_curve_name("P-521"), NULL);
+}
+END_TEST
+
+START_TEST(md_crypt_ec_jws_sign)
+{
+    md_pkey_spec_t spec;
+    md_pkey_t *pkey;
+    md_json_t *msg, *jprot;
+    const char *sig, *thumb, *prot, *digest;
+    apr_table_t *protected;
+    
+    spec.type = MD_PKEY_TYPE_EC;
+    spec.params.ec.curve = "P-256";
+    ck_assert_int_eq(md_pkey_gen(&pkey, g_pool, &spec), APR_SUCCESS);
+    ck_assert_str_eq(md_pkey_get_ec_curve(pkey), "P-256");
+    ck_assert_ptr_eq(md_pkey_get_rsa_n64(pkey, g_pool), NULL);
+    /* coordinates are always 32 bytes on P-256 */
+    ck_assert_uint_eq(md_util_base64url_decode(&sig, md_pkey_get_ec_x64(pkey, g_pool), g_pool), 32);
+    ck_assert_uint_eq(md_util_base64url_decode(&sig, md_pkey_get_ec_y64(pkey, g_pool), g_pool), 32);
+    
+    protected = apr_table_make(g_pool, 5);
+    apr_table_setn(protected, "nonce", "abc");
+    ck_assert_int_eq(md_jws_sign(&msg, g_pool, "{}", 2, protected, pkey, NULL), APR_SUCCESS);
+    /* R || S, not DER */
+    ck_assert_uint_eq(md_util_base64url_decode(&sig, md_json_gets(msg, "signature", NULL), 
+                                               g_pool), 64);
+    
+    /* the protected header is valid JSON carrying the key's JWK */
+    ck_assert_uint_gt(md_util_base64url_decode(&prot, md_json_gets(msg, "protected", NULL), 
+                                               g_pool), 0);
+    ck_assert_int_eq(md_json_readd(&jprot, g_pool, prot, strlen(prot)), APR_SUCCESS);
+    ck_assert_str_eq(md_json_gets(jprot, "alg", NULL), "ES256");
+    ck_assert_str_eq(md_json_gets(jprot, "nonce", NULL), "abc");
+    ck_assert_str_eq(md_json_gets(jprot, "jwk", "x", NULL), md_pkey_get_ec_x64(pkey, g_pool));
+    
+    ck_assert_int_eq(md_jws_pkey_thumb(&thumb, g_pool, pkey), APR_SUCCESS);
+    ck_assert_ptr_nonnull(thumb);
+    /* computed once per key */
+    ck_assert_ptr_eq(md_pkey_get_jwk(pkey), md_pkey_get_jwk(pkey));
+    ck_assert_int_eq(md_crypt_sha256_digest64(&digest, g_pool, md_pkey_get_jwk(pkey), 
+                                              strlen(md_pkey_get_jwk(pkey))), APR_SUCCESS);
+    ck_assert_str_eq(thumb, digest);
+}
+END_TEST
+
+START_TEST(md_crypt_fload_roundtrip)
+{
+    md_pkey_spec_t spec;
+    md_pkey_t *pkey, *pkey2;
+    md_cert_t *cert, *cert2;
+    const char *tmp, *fkey, *fcert;
+    
+    spec.type = MD_PKEY_TYPE_EC;
+    spec.params.ec.curve = "P-256";
+    ck_assert_int_eq(md_pkey_gen(&pkey, g_pool, &spec), APR_SUCCESS);
+    ck_assert_int_eq(md_cert_self_sign(&cert, "a", apr_array_make(g_pool, 1, sizeof(char*)), 
+                                       pkey, apr_time_from_sec(3600), g_pool), APR_SUCCESS);
+    ck_assert_int_eq(apr_temp_dir_get(&tmp, g_pool), APR_SUCCESS);
+    fkey = apr_psprintf(g_pool, "%s/md-key-%d.pem", tmp, (int)getpid());
+    fcert = apr_psprintf(g_pool, "%s/md-cert-%d.pem", tmp, (int)getpid());
+    
+    ck_assert_int_eq(md_pkey_fsave(pkey, g_pool, "secret", 6, fkey, 
+                                   APR_FPROT_UREAD|APR_FPROT_UWRITE), APR_SUCCESS);
+    ck_assert_int_eq(md_pkey_fload(&pkey2, g_pool, "secret", 6, fkey), APR_SUCCESS);
+    ck_assert_str_eq(md_pkey_get_jwk(pkey2), md_pkey_get_jwk(pkey));
+    ck_assert_int_ne(md_pkey_fload(&pkey2, g_pool, "wrong", 5, fkey), APR_SUCCESS);
+    ck_assert_ptr_eq(pkey2, NULL);
+    
+    ck_assert_int_eq(md_cert_fsave(cert, g_pool, fcert, APR_FPROT_UREAD|APR_FPROT_UWRITE), 
+                     APR_SUCCESS);
+    ck_assert_int_eq(md_cert_fload(&cert2, g_pool, fcert), APR_SUCCESS);
+    ck_assert(md_cert_is_valid_now(cert2));
+    
+    apr_file_remove(fkey, g_pool);
+    apr_file_remove(fcert, g_pool);
+    ck_assert(APR_STATUS_IS_ENOENT(md_cert_fload(&cert2, g_pool, fcert)));
+}
+END_TEST
+
+START_TEST(md_crypt_chain_shared)
+{
+    md_pkey_spec_t spec;
+    md_pkey_t *pkey;
+    md_cert_t *ca, *leaf;
+    apr_array_header_t *chain, *chain_a, *chain_b;
+    const char *tmp, *fa, *fb;
+    
+    spec.type = MD_PKEY_TYPE_EC;
+    spec.params.ec.curve = "P-256";
+    ck_assert_int_eq(md_pkey_gen(&pkey, g_pool, &spec), APR_SUCCESS);
+    ck_assert_int_eq(md_cert_self_sign(&ca, "ca", apr_array_make(g_pool, 1, sizeof(char*)), 
+                                       pkey, apr_time_from_sec(3600), g_pool), APR_SUCCESS);
+    ck_assert_int_eq(apr_temp_dir_get(&tmp, g_pool), APR_SUCCESS);
+    fa = apr_psprintf(g_pool, "%s/md-chain-a-%d.pem", tmp, (int)getpid());
+    fb = apr_psprintf(g_pool, "%s/md-chain-b-%d.pem", tmp, (int)getpid());
+    
+    chain = apr_array_make(g_pool, 2, sizeof(md_cert_t*));
+    ck_assert_int_eq(md_cert_self_sign(&leaf, "a", apr_array_make(g_pool, 1, sizeof(char*)), 
+                                       pkey, apr_time_from_sec(3600), g_pool), APR_SUCCESS);
+    APR_ARRAY_PUSH(chain, md_cert_t*) = leaf;
+    APR_ARRAY_PUSH(chain, md_cert_t*) = ca;
+    ck_assert_int_eq(md_chain_fsave(chain, g_pool, fa, APR_FPROT_UREAD|APR_FPROT_UWRITE), 
+                     APR_SUCCESS);
+    ck_assert_int_eq(md_cert_self_sign(&leaf, "b", apr_array_make(g_pool, 1, sizeof(char*)), 
+                                       pkey, apr_time_from_sec(3600), g_pool), APR_SUCCESS);
+    APR_ARRAY_IDX(chain, 0, md_cert_t*) = leaf;
+    ck_assert_int_eq(md_chain_fsave(chain, g_pool, fb, APR_FPROT_UREAD|APR_FPROT_UWRITE), 
+                     APR_SUCCESS);
+    
+    ck_assert_int_eq(md_chain_fload(&chain_a, g_pool, fa), APR_SUCCESS);
+    ck_assert_int_eq(md_chain_fload(&chain_b, g_pool, fb), APR_SUCCESS);
+    ck_assert_int_eq(chain_a->nelts, 2);
+    ck_assert_int_eq(chain_b->nelts, 2);
+    /* the intermediate is parsed once, the MDs' certificates are their own */
+    ck_assert_ptr_eq(md_cert_get_X509(APR_ARRAY_IDX(chain_a, 1, md_cert_t*)), 
+                     md_cert_get_X509(APR_ARRAY_IDX(chain_b, 1, md_cert_t*)));
+    ck_assert_ptr_ne(md_cert_get_X509(APR_ARRAY_IDX(chain_a, 0, md_cert_t*)), 
+                     md_cert_get_X509(APR_ARRAY_IDX(chain_b, 0, md_cert_t*)));
+    
+    apr_file_remove(fa, g_pool);
+    apr_file_remove(fb, g_pool);
+}
+END_TEST
+
+START_TEST(md_crypt_cert_covers)
+{
+    md_pkey_spec_t spec;
+    md_pkey_t *pkey;
+    md_cert_t *cert;
+    apr_array_header_t *domains;
+    md_t *md;
+    
+    spec.type = MD_PKEY_TYPE_EC;
+    spec.params.ec.curve = "P-256";
+    ck_assert_int_eq(md_pkey_gen(&pkey, g_pool, &spec), APR_SUCCESS);
+    domains = apr_array_make(g_pool, 2, sizeof(const char*));
+    APR_ARRAY_PUSH(domains, const char*) = "Example.org";
+    APR_ARRAY_PUSH(domains, const char*) = "*.example.net";
+    ck_assert_int_eq(md_cert_self_sign(&cert, "test", domains, pkey, 
+                                       apr_time_from_sec(3600), g_pool), APR_SUCCESS);
+    ck_assert(md_cert_get_not_after(cert) > md_cert_get_not_before(cert));
+    
+    ck_assert(md_cert_covers_domain(cert, "example.org"));
+    ck_assert(md_cert_covers_domain(cert, "*.EXAMPLE.net"));
+    ck_assert(!md_cert_covers_domain(cert, "www.example.net"));
+    ck_assert(!md_cert_covers_domain(cert, "example.com"));
+    
+    domains = apr_array_make(g_pool, 2, sizeof(const char*));
+    APR_ARRAY_PUSH(domains, const char*) = "example.org";
+    APR_ARRAY_PUSH(domains, const char*) = "www.example.net";
+    md = md_create(g_pool, domains);
+    ck_assert(md_cert_covers_md(cert, md));
+    APR_ARRAY_PUSH(md->domains, const char*) = "a.b.example.net";
+    ck_assert(!md_cert_covers_md(cert, md));
+}
+END_TEST
+
+/* issued for a.example.org with serial 0x87654321, by a CA with key id b42b73b495...ed97 */
+static const char *ari_cert_der64 =
+    "MIIBdTCCARqgAwIBAgIFAIdlQyEwCgYIKoZIzj0EAwIwDTELMAkGA1UEAwwCY2EwHhcNMjYx"
+    "MDE0MDcwNjE5WhcNMzYxMDExMDcwNjE5WjAYMRYwFAYDVQQDDA1hLmV4YW1wbGUub3JnMFkw"
+    "EwYHKoZIzj0CAQYIKoZIzj0DAQcDQgAEKquFM1NLjW2sE3IvJOnL7iBckcAUIwaogrFVvO8r"
+    "GkC4hLGfiC03mZx9GT3S0-S8hHzKTKwFRmH50hMyQjsyuKNcMFowHwYDVR0jBBgwFoAUtCtz"
+    "tJXdj1lSdjJgJrdqTmRV7ZcwGAYDVR0RBBEwD4INYS5leGFtcGxlLm9yZzAdBgNVHQ4EFgQU"
+    "87Jj1t7JcYHvc2rljl0Xzzo3ycwwCgYIKoZIzj0EAwIDSQAwRgIhAJl2BHjlhxUO_kZc6OD6"
+    "jJ0nqM39OUAzoWo0GpfFzHYOAiEAwajpNJwwfgCsaZ8mCBh_XB_VaEmy-qEc-v472wKY9-0";
+
+START_TEST(md_crypt_cert_ari_id)
+{
+    md_cert_t *cert;
+    const char *id;
+    
+    ck_assert_int_eq(md_cert_from_base64url(&cert, ari_cert_der64, g_pool), APR_SUCCESS);
+    ck_assert_int_eq(md_cert_get_ari_id(&id, cert, g_pool), APR_SUCCESS);
+    /* the serial has its top bit set and gets a leading zero, as in RFC 9773 */
+    ck_assert_str_eq(id, "tCtztJXdj1lSdjJgJrdqTmRV7Zc.AIdlQyE");
+    ck_assert_int_eq(md_cert_get_serial_number(&id, cert, g_pool), APR_SUCCESS);
+    ck_assert_str_eq(id, "87654321");
+}
+END_TEST
+
+TCase *md_crypt_test_case(void)
+{
+    TCase *testcase = tcase_create("md_crypt");
+
+    tcase_add_checked_fixture(testcase, md_crypt_setup, md_crypt_teardown);
+
+    tcase_add_test(testcase, md_crypt_ec_spec_json);
+    tcase_add_test(testcase, md_crypt_ec_jws_sign);
+    tcase_add_test(testcase, md_crypt_fload_roundtrip);
+    tcase_add_test(testcase, md_crypt_chain_shared);
+    tcase_add_test(testcase, md_crypt_cert_covers);
+    tcase_add_test(testcase, md_crypt_cert_ari_id);
+
+    return testcase;
+}
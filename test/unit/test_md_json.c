@@ -13,6 +13,9 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+
+#include <apr_buckets.h>
 
 #include "test_common.h"
 #include "md_json.h"
@@ -40,6 +43,7 @@
 struct md_json_t {
     apr_pool_t *p;
     json_t *j;
+    int borrowed;
 };
 
 /*
@@ -300,6 +304,187 @@ START_TEST(objects)
 }
 END_TEST
 
+static int sum_keys(void *baton, const char *key, md_json_t *json)
+{
+    long *psum = baton;
+    
+    (void)key;
+    *psum += md_json_getl(json, NULL);
+    return 1;
+}
+
+START_TEST(object_keys)
+{
+    md_json_t *json = md_json_create(g_pool);
+    long sum = 0;
+    
+    md_json_setl(1, json, "a", NULL);
+    md_json_setl(2, json, "b", NULL);
+    md_json_setl(4, json, "c", NULL);
+    
+    ck_assert_int_eq( md_json_iterkey(sum_keys, &sum, json, NULL), 1 );
+    ck_assert_int_eq( sum, 7 );
+    ck_assert_int_eq( md_json_iterkey(sum_keys, &sum, json, "a", NULL), 0 );
+}
+END_TEST
+
+START_TEST(views_borrow_values)
+{
+    md_json_t *jv, *json = md_json_create(g_pool);
+    json_t *internal;
+    
+    md_json_sets("text", json, "object", "string", NULL);
+    jv = md_json_viewj(json, "object", NULL);
+    ck_assert_ptr_nonnull( jv );
+    internal = jv->j;
+    ck_assert_int_eq( internal->refcount, 1 );
+    ck_assert_str_eq( md_json_gets(jv, "string", NULL), "text" );
+    ck_assert_ptr_eq( md_json_viewj(json, "missing", NULL), NULL );
+    ck_assert_ptr_eq( md_json_viewj(json, NULL), json );
+    
+    /* destroying a view leaves the value alone */
+    md_json_destroy(jv);
+    ck_assert_int_eq( internal->refcount, 1 );
+    ck_assert_str_eq( md_json_gets(json, "object", "string", NULL), "text" );
+}
+END_TEST
+
+static const md_json_path_t PATH_A_B = MD_JSON_PATH("a", "b");
+
+START_TEST(compiled_paths)
+{
+    md_json_t *json = md_json_create(g_pool);
+    apr_array_header_t *a;
+    
+    ck_assert_int_eq( md_json_has_key_p(json, &PATH_A_B), 0 );
+    ck_assert_int_eq( md_json_sets_p("text", json, &PATH_A_B), 0 );
+    ck_assert_str_eq( md_json_gets(json, "a", "b", NULL), "text" );
+    ck_assert_str_eq( md_json_gets_p(json, &PATH_A_B), "text" );
+    ck_assert_int_eq( md_json_has_key_p(json, &PATH_A_B), 1 );
+    
+    ck_assert_int_eq( md_json_setl_p(42, json, &PATH_A_B), 0 );
+    ck_assert_int_eq( md_json_getl(json, "a", "b", NULL), 42 );
+    ck_assert_int_eq( md_json_getl_p(json, &PATH_A_B), 42 );
+    ck_assert_ptr_eq( md_json_gets_p(json, &PATH_A_B), NULL );
+    
+    ck_assert_int_eq( md_json_setb_p(1, json, &PATH_A_B), 0 );
+    ck_assert_int_eq( md_json_getb_p(json, &PATH_A_B), 1 );
+    
+    a = apr_array_make(g_pool, 2, sizeof(const char*));
+    APR_ARRAY_PUSH(a, const char*) = "x";
+    APR_ARRAY_PUSH(a, const char*) = "y";
+    ck_assert_int_eq( md_json_setsa_p(a, json, &PATH_A_B), 0 );
+    apr_array_clear(a);
+    ck_assert_int_eq( md_json_dupsa_p(a, g_pool, json, &PATH_A_B), 0 );
+    ck_assert_int_eq( a->nelts, 2 );
+    ck_assert_str_eq( APR_ARRAY_IDX(a, 1, const char*), "y" );
+    
+    /* a path through a value that is not an object does not set anything */
+    md_json_sets("text", json, "a", NULL);
+    ck_assert_int_ne( md_json_sets_p("text", json, &PATH_A_B), 0 );
+    ck_assert_str_eq( md_json_gets(json, "a", NULL), "text" );
+}
+END_TEST
+
+typedef struct {
+    const char *name;
+    const char *missing;
+    apr_array_header_t *list;
+    int count;
+    int flag;
+} field_test_t;
+
+static const md_json_field_t test_fields[] = {
+    { MD_JSON_PATH("name"),          MD_JSON_FIELD_STR,  APR_OFFSETOF(field_test_t, name) },
+    { MD_JSON_PATH("sub", "missing"), MD_JSON_FIELD_STR, APR_OFFSETOF(field_test_t, missing) },
+    { MD_JSON_PATH("sub", "list"),   MD_JSON_FIELD_STRA, APR_OFFSETOF(field_test_t, list) },
+    { MD_JSON_PATH("sub", "count"),  MD_JSON_FIELD_INT,  APR_OFFSETOF(field_test_t, count) },
+    { MD_JSON_PATH("flag"),          MD_JSON_FIELD_BOOL, APR_OFFSETOF(field_test_t, flag) },
+};
+
+START_TEST(field_tables)
+{
+    md_json_t *json = md_json_create(g_pool);
+    field_test_t in, out;
+    const char *s;
+    
+    memset(&in, 0, sizeof(in));
+    in.name = "test";
+    in.list = apr_array_make(g_pool, 1, sizeof(const char*));
+    APR_ARRAY_PUSH(in.list, const char*) = "item";
+    in.count = 3;
+    in.flag = -1;
+    ck_assert_int_eq( md_json_fields_set(&in, test_fields, 5, json), 0 );
+    s = md_json_writep(json, g_pool, MD_JSON_FMT_COMPACT);
+    ck_assert_str_eq(s, "{\"name\":\"test\",\"sub\":{\"list\":[\"item\"],\"count\":3},"
+                     "\"flag\":false}");
+
+    memset(&out, 0, sizeof(out));
+    out.missing = "kept";
+    md_json_fields_get(&out, test_fields, 5, json, g_pool);
+    ck_assert_str_eq( out.name, "test" );
+    ck_assert_str_eq( out.missing, "kept" );
+    ck_assert_ptr_nonnull( out.list );
+    ck_assert_int_eq( out.list->nelts, 1 );
+    ck_assert_str_eq( APR_ARRAY_IDX(out.list, 0, const char*), "item" );
+    ck_assert_int_eq( out.count, 3 );
+    ck_assert_int_eq( out.flag, 0 );
+}
+END_TEST
+
+START_TEST(readb_single_and_split_buckets)
+{
+    apr_bucket_alloc_t *ba = apr_bucket_alloc_create(g_pool);
+    apr_bucket_brigade *bb = apr_brigade_create(g_pool, ba);
+    md_json_t *json;
+    
+    /* one bucket, as http responses arrive */
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_immortal_create("{\"a\":[1,2]}", 11, ba));
+    ck_assert_int_eq( md_json_readb(&json, g_pool, bb), APR_SUCCESS );
+    ck_assert_str_eq( md_json_writep(json, g_pool, MD_JSON_FMT_COMPACT), "{\"a\":[1,2]}" );
+    ck_assert( APR_BRIGADE_EMPTY(bb) );
+    
+    /* several buckets */
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_immortal_create("{\"b\":", 5, ba));
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_immortal_create("42}", 3, ba));
+    ck_assert_int_eq( md_json_readb(&json, g_pool, bb), APR_SUCCESS );
+    ck_assert_int_eq( md_json_getl(json, "b", NULL), 42 );
+    
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_immortal_create("{\"b\":", 5, ba));
+    ck_assert_int_eq( md_json_readb(&json, g_pool, bb), APR_EINVAL );
+}
+END_TEST
+
+START_TEST(binary_round_trip)
+{
+    const char *text = "{\"s\":\"short\",\"l\":\"0123456789012345678901234567890123456789\","
+                       "\"i\":[0,23,24,255,256,65536,4294967296,-1,-25,-4294967297],"
+                       "\"r\":-1.5,\"b\":[true,false,null],\"o\":{\"a\":{}},\"e\":[]}";
+    md_json_t *json, *back;
+    const char *data;
+    char *broken;
+    apr_size_t len;
+    
+    ck_assert_int_eq( md_json_readd(&json, g_pool, text, strlen(text)), APR_SUCCESS );
+    ck_assert_int_eq( md_json_writem(&data, &len, json, g_pool, MD_JSON_FMT_BINARY), 
+                      APR_SUCCESS );
+    ck_assert( len > 3 && len < strlen(text) );
+    ck_assert( !memcmp(data, "\xd9\xd9\xf7", 3) );
+    ck_assert_ptr_eq( md_json_writep(json, g_pool, MD_JSON_FMT_BINARY), NULL );
+    
+    ck_assert_int_eq( md_json_readd(&back, g_pool, data, len), APR_SUCCESS );
+    ck_assert( json_equal(json->j, back->j) );
+    
+    /* truncated, trailing bytes and bad length */
+    ck_assert_int_eq( md_json_readd(&back, g_pool, data, len - 1), APR_EINVAL );
+    broken = apr_pcalloc(g_pool, len + 1);
+    memcpy(broken, data, len);
+    ck_assert_int_eq( md_json_readd(&back, g_pool, broken, len + 1), APR_EINVAL );
+    broken[3] = (char)0xbb; /* map with 0xffffffffffffffff entries */
+    ck_assert_int_eq( md_json_readd(&back, g_pool, broken, len), APR_EINVAL );
+}
+END_TEST
+
 START_TEST(json_writep_returns_NULL_for_corrupted_json_struct)
 {
     md_json_t *json = md_json_create(g_pool);
@@ -334,6 +519,12 @@ TCase *md_json_test_case(void)
     tcase_add_test(testcase, string_arrays);
     tcase_add_test(testcase, json_arrays);
     tcase_add_test(testcase, objects);
+    tcase_add_test(testcase, object_keys);
+    tcase_add_test(testcase, views_borrow_values);
+    tcase_add_test(testcase, compiled_paths);
+    tcase_add_test(testcase, field_tables);
+    tcase_add_test(testcase, readb_single_and_split_buckets);
+    tcase_add_test(testcase, binary_round_trip);
 
     tcase_add_test(testcase, json_writep_returns_NULL_for_corrupted_json_struct);
 
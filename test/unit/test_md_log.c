@@ -0,0 +1,153 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+
+#include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_thread_proc.h>
+
+#include "test_common.h"
+#include "md_log.h"
+
+/*
+ * Helpers
+ */
+
+static int printed;
+
+static int log_upto_info(void *baton, apr_pool_t *p, md_log_level_t level)
+{
+    (void)baton;
+    (void)p;
+    return level <= MD_LOG_INFO;
+}
+
+static void log_count(const char *file, int line, md_log_level_t level, apr_status_t rv,
+                      void *baton, apr_pool_t *p, const char *fmt, va_list ap)
+{
+    (void)file; (void)line; (void)level; (void)rv; (void)baton; (void)p; (void)fmt; (void)ap;
+    ++printed;
+}
+
+static void ring_collect(void *baton, const char *file, int line, md_log_level_t level,
+                         apr_status_t rv, apr_time_t at, const char *msg)
+{
+    apr_array_header_t *msgs = baton;
+    
+    (void)file; (void)line; (void)rv; (void)at;
+    APR_ARRAY_PUSH(msgs, const char*) = apr_psprintf(msgs->pool, "%s %s", 
+                                                     md_log_level_name(level), msg);
+}
+
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC log_trace_thread(apr_thread_t *thread, void *data)
+{
+    (void)data;
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, NULL, "other thread");
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+#endif
+
+/*
+ * Test Fixture -- runs once per test
+ */
+
+static apr_pool_t *g_pool;
+
+static void md_log_test_setup(void)
+{
+    if (apr_pool_create(&g_pool, NULL) != APR_SUCCESS) {
+        exit(1);
+    }
+}
+
+static void md_log_test_teardown(void)
+{
+    md_log_ring_init(g_pool, 0, MD_LOG_TRACE2);
+    md_log_set(NULL, NULL, NULL);
+    apr_pool_destroy(g_pool);
+}
+
+/*
+ * Tests
+ */
+
+START_TEST(md_log_levels)
+{
+    apr_array_header_t *msgs;
+    apr_uint32_t mark;
+#if APR_HAS_THREADS
+    apr_thread_t *thread;
+    apr_status_t trv;
+#endif
+    int evaluated = 0;
+    
+    md_log_set(log_upto_info, log_count, NULL);
+    printed = 0;
+    ck_assert(md_log_is_level(g_pool, MD_LOG_INFO));
+    ck_assert(!md_log_is_level(g_pool, MD_LOG_DEBUG));
+    md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, g_pool, "info %d", ++evaluated);
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, g_pool, "debug %d", ++evaluated);
+    ck_assert_int_eq(printed, 1);
+    ck_assert_int_eq(evaluated, 1);
+    
+    /* trace messages up to trace2 are kept in the ring, without being printed */
+    ck_assert_int_eq(md_log_ring_init(g_pool, 2, MD_LOG_TRACE2), APR_SUCCESS);
+    ck_assert(md_log_is_level(g_pool, MD_LOG_TRACE2));
+    ck_assert(!md_log_is_level(g_pool, MD_LOG_TRACE3));
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, g_pool, "t%d", 1);
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, g_pool, "t%d", ++evaluated);
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, g_pool, "not kept");
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, 0, g_pool, "t%d", 2);
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, 0, g_pool, "t%d", 3);
+    ck_assert_int_eq(printed, 1);
+    ck_assert_int_eq(evaluated, 1);
+    
+    msgs = apr_array_make(g_pool, 5, sizeof(const char*));
+    ck_assert_int_eq(md_log_ring_drain(0, ring_collect, msgs), 2);
+    ck_assert_str_eq(APR_ARRAY_IDX(msgs, 0, const char*), "trace2 t2");
+    ck_assert_str_eq(APR_ARRAY_IDX(msgs, 1, const char*), "trace2 t3");
+    mark = md_log_ring_mark();
+    ck_assert_int_eq(md_log_ring_drain(mark, ring_collect, msgs), 0);
+#if APR_HAS_THREADS
+    /* messages of other threads are not drained */
+    ck_assert_int_eq(apr_thread_create(&thread, NULL, log_trace_thread, NULL, g_pool), 
+                     APR_SUCCESS);
+    ck_assert_int_eq(apr_thread_join(&trv, thread), APR_SUCCESS);
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, g_pool, "t%d", 4);
+    apr_array_clear(msgs);
+    ck_assert_int_eq(md_log_ring_drain(mark, ring_collect, msgs), 1);
+    ck_assert_str_eq(APR_ARRAY_IDX(msgs, 0, const char*), "trace1 t4");
+#endif
+    
+    ck_assert_int_eq(md_log_ring_init(g_pool, 0, MD_LOG_TRACE2), APR_SUCCESS);
+    ck_assert(!md_log_is_level(g_pool, MD_LOG_TRACE1));
+    md_log_set(NULL, NULL, NULL);
+    ck_assert(!md_log_is_level(g_pool, MD_LOG_EMERG));
+}
+END_TEST
+
+TCase *md_log_test_case(void)
+{
+    TCase *testcase = tcase_create("md_log");
+
+    tcase_add_checked_fixture(testcase, md_log_test_setup, md_log_test_teardown);
+
+    tcase_add_test(testcase, md_log_levels);
+
+    return testcase;
+}
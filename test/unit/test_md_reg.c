@@ -0,0 +1,307 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <apr_file_info.h>
+#include <apr_file_io.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_thread_proc.h>
+
+#include "test_common.h"
+#include "md.h"
+#include "md_acme.h"
+#include "md_crypt.h"
+#include "md_reg.h"
+#include "md_store.h"
+#include "md_store_fs.h"
+#include "md_util.h"
+
+/*
+ * Test Fixture -- runs once per test
+ */
+
+static apr_pool_t *g_pool;
+static const char *g_dir;
+static md_store_t *g_store;
+static md_reg_t *g_reg;
+
+static void md_reg_test_setup(void)
+{
+    const char *tmp;
+
+    if (apr_pool_create(&g_pool, NULL) != APR_SUCCESS
+        || md_crypt_init(g_pool) != APR_SUCCESS
+        || apr_temp_dir_get(&tmp, g_pool) != APR_SUCCESS) {
+        exit(1);
+    }
+    g_dir = apr_psprintf(g_pool, "%s/md-reg-%d", tmp, (int)getpid());
+    md_util_rm_recursive(g_dir, g_pool, 5);
+    if (md_store_fs_init(&g_store, g_pool, g_dir) != APR_SUCCESS
+        || md_reg_init(&g_reg, g_pool, g_store, NULL) != APR_SUCCESS) {
+        exit(1);
+    }
+}
+
+static void md_reg_test_teardown(void)
+{
+    md_util_rm_recursive(g_dir, g_pool, 5);
+    apr_pool_destroy(g_pool);
+}
+
+/*
+ * Helpers
+ */
+
+static md_t *make_md(const char *name, apr_pool_t *p)
+{
+    apr_array_header_t *domains = apr_array_make(p, 1, sizeof(const char*));
+    md_t *md;
+
+    APR_ARRAY_PUSH(domains, const char*) = name;
+    md = md_create(p, domains);
+    md->name = name;
+    return md;
+}
+
+/* Save a new key and self-signed certificate for the spec of the MD and move the
+ * modification times of the files ahead, so that the change shows on file systems
+ * with a coarse resolution. */
+static md_cert_t *save_creds(const md_t *md, md_pkey_spec_t *spec, int nth, apr_pool_t *p)
+{
+    md_pkey_spec_t ec_spec;
+    md_pkey_t *pkey;
+    md_cert_t *cert;
+    apr_array_header_t *pubcert;
+    const char *fname;
+
+    ec_spec.type = MD_PKEY_TYPE_EC;
+    ec_spec.params.ec.curve = "P-256";
+    ck_assert_int_eq(md_pkey_gen(&pkey, p, spec? spec : &ec_spec), APR_SUCCESS);
+    ck_assert_int_eq(md_cert_self_sign(&cert, md->name, md->domains, pkey,
+                                       apr_time_from_sec(3600), p), APR_SUCCESS);
+    pubcert = apr_array_make(p, 1, sizeof(md_cert_t*));
+    APR_ARRAY_PUSH(pubcert, md_cert_t*) = cert;
+    ck_assert_int_eq(md_pkey_save_for(g_store, p, MD_SG_DOMAINS, md->name, spec, pkey, 1),
+                     APR_SUCCESS);
+    ck_assert_int_eq(md_pubcert_save_for(g_store, p, MD_SG_DOMAINS, md->name, spec,
+                                         pubcert, 1), APR_SUCCESS);
+
+    ck_assert_int_eq(md_store_get_fname(&fname, g_store, MD_SG_DOMAINS, md->name,
+                                        md_pkey_fname_for(spec, p), p), APR_SUCCESS);
+    ck_assert_int_eq(apr_file_mtime_set(fname, apr_time_now() + apr_time_from_sec(nth), p),
+                     APR_SUCCESS);
+    ck_assert_int_eq(md_store_get_fname(&fname, g_store, MD_SG_DOMAINS, md->name,
+                                        md_pubcert_fname_for(spec, p), p), APR_SUCCESS);
+    ck_assert_int_eq(apr_file_mtime_set(fname, apr_time_now() + apr_time_from_sec(nth), p),
+                     APR_SUCCESS);
+    return cert;
+}
+
+static md_cert_t *first_cert(apr_array_header_t *chains)
+{
+    apr_array_header_t *chain = APR_ARRAY_IDX(chains, 0, apr_array_header_t*);
+    return APR_ARRAY_IDX(chain, 0, md_cert_t*);
+}
+
+static void *first_x509(apr_array_header_t *chains)
+{
+    return md_cert_get_X509(first_cert(chains));
+}
+
+static const char *cert64(md_cert_t *cert, apr_pool_t *p)
+{
+    const char *s64;
+
+    ck_assert_int_eq(md_cert_to_base64url(&s64, cert, p), APR_SUCCESS);
+    return s64;
+}
+
+/*
+ * Tests
+ */
+
+START_TEST(md_reg_cred_objects_shared)
+{
+    apr_pool_t *p = g_pool, *p1, *p2;
+    apr_array_header_t *pkeys1, *chains1, *pkeys2, *chains2;
+    md_cert_t *cert;
+    md_t *md;
+
+    md = make_md("example.org", p);
+    ck_assert_int_eq(md_reg_get_cred_objects(&pkeys1, &chains1, g_reg, md, p), APR_ENOENT);
+    ck_assert_int_eq(pkeys1->nelts, 0);
+
+    cert = save_creds(md, NULL, 1, p);
+    apr_pool_create(&p1, p);
+    apr_pool_create(&p2, p);
+    ck_assert_int_eq(md_reg_get_cred_objects(&pkeys1, &chains1, g_reg, md, p1), APR_SUCCESS);
+    ck_assert_int_eq(pkeys1->nelts, 1);
+    ck_assert_int_eq(chains1->nelts, 1);
+    ck_assert_str_eq(cert64(first_cert(chains1), p), cert64(cert, p));
+
+    /* parsed once, all callers get references to the same objects */
+    ck_assert_int_eq(md_reg_get_cred_objects(&pkeys2, &chains2, g_reg, md, p2), APR_SUCCESS);
+    ck_assert_ptr_eq(first_x509(chains1), first_x509(chains2));
+    ck_assert_ptr_eq(md_pkey_get_EVP_PKEY(APR_ARRAY_IDX(pkeys1, 0, md_pkey_t*)),
+                     md_pkey_get_EVP_PKEY(APR_ARRAY_IDX(pkeys2, 0, md_pkey_t*)));
+
+    /* changed files are parsed again, references handed out before stay valid */
+    cert = save_creds(md, NULL, 2, p);
+    ck_assert_int_eq(md_reg_get_cred_objects(&pkeys2, &chains2, g_reg, md, p2), APR_SUCCESS);
+    ck_assert_ptr_ne(first_x509(chains1), first_x509(chains2));
+    ck_assert_str_eq(cert64(first_cert(chains2), p), cert64(cert, p));
+    ck_assert_str_ne(cert64(first_cert(chains1), p), cert64(cert, p));
+    apr_pool_destroy(p2);
+    apr_pool_destroy(p1);
+}
+END_TEST
+
+START_TEST(md_reg_cred_objects_alt_specs)
+{
+    apr_pool_t *p = g_pool;
+    apr_array_header_t *pkeys, *chains;
+    md_pkey_spec_t *spec;
+    md_cert_t *cert;
+    md_t *md;
+
+    md = make_md("example.net", p);
+    spec = apr_pcalloc(p, sizeof(*spec));
+    spec->type = MD_PKEY_TYPE_EC;
+    spec->params.ec.curve = "P-384";
+    md->alt_pkey_specs = apr_array_make(p, 1, sizeof(md_pkey_spec_t*));
+    APR_ARRAY_PUSH(md->alt_pkey_specs, md_pkey_spec_t*) = spec;
+
+    /* an additional spec without files is left out */
+    save_creds(md, NULL, 1, p);
+    ck_assert_int_eq(md_reg_get_cred_objects(&pkeys, &chains, g_reg, md, p), APR_SUCCESS);
+    ck_assert_int_eq(pkeys->nelts, 1);
+
+    /* once it has them, it comes after the primary */
+    cert = save_creds(md, spec, 2, p);
+    ck_assert_int_eq(md_reg_get_cred_objects(&pkeys, &chains, g_reg, md, p), APR_SUCCESS);
+    ck_assert_int_eq(pkeys->nelts, 2);
+    ck_assert_int_eq(chains->nelts, 2);
+    chains = APR_ARRAY_IDX(chains, 1, apr_array_header_t*);
+    ck_assert_str_eq(cert64(APR_ARRAY_IDX(chains, 0, md_cert_t*), p), cert64(cert, p));
+    ck_assert_str_eq(md_pkey_get_ec_curve(APR_ARRAY_IDX(pkeys, 1, md_pkey_t*)), "P-384");
+}
+END_TEST
+
+START_TEST(md_reg_stage_busy)
+{
+    apr_pool_t *p = g_pool;
+    md_store_lock_t *lock;
+    md_t *md;
+
+    md = make_md("busy.example.org", p);
+    md->ca_proto = MD_PROTO_ACME;
+    md->ca_url = "https://ca.example.org/directory";
+
+    /* someone else staging the MD is reported as busy, at once */
+    ck_assert_int_eq(md_store_lock(&lock, g_store, p, MD_SG_STAGING, md->name, 1, 0),
+                     APR_SUCCESS);
+    ck_assert_int_eq(md_reg_stage(g_reg, md, NULL, NULL, 0, NULL, p), APR_EBUSY);
+    ck_assert_int_eq(md_reg_prestage(g_reg, md, p), APR_EBUSY);
+    md_store_unlock(g_store, lock);
+
+    /* other MDs are not held up */
+    ck_assert_int_eq(md_store_lock(&lock, g_store, p, MD_SG_STAGING, "other.example.org", 1, 0),
+                     APR_SUCCESS);
+    ck_assert_int_eq(md_reg_prestage(g_reg, md, p), APR_SUCCESS);
+    md_store_unlock(g_store, lock);
+}
+END_TEST
+
+#if APR_HAS_THREADS
+
+#define CRED_THREADS    8
+
+typedef struct {
+    md_t *md;
+    void *x509;
+    apr_status_t rv;
+} cred_getter_t;
+
+static void * APR_THREAD_FUNC cred_get(apr_thread_t *thread, void *data)
+{
+    cred_getter_t *getter = data;
+    apr_array_header_t *pkeys, *chains;
+    apr_pool_t *p;
+
+    (void)thread;
+    apr_pool_create(&p, NULL);
+    getter->rv = md_reg_get_cred_objects(&pkeys, &chains, g_reg, getter->md, p);
+    getter->x509 = (APR_SUCCESS == getter->rv)? first_x509(chains) : NULL;
+    apr_pool_destroy(p);
+    return NULL;
+}
+
+START_TEST(md_reg_cred_objects_parallel)
+{
+    apr_pool_t *p = g_pool;
+    cred_getter_t getters[CRED_THREADS];
+    apr_thread_t *threads[CRED_THREADS];
+    apr_array_header_t *pkeys, *chains[2];
+    md_t *mds[2];
+    apr_status_t rv;
+    int i;
+
+    mds[0] = make_md("a.example.org", p);
+    mds[1] = make_md("b.example.org", p);
+    save_creds(mds[0], NULL, 1, p);
+    save_creds(mds[1], NULL, 1, p);
+
+    /* threads parsing the same and other MDs at the same time all end up with
+     * the objects that stay in the cache */
+    memset(getters, 0, sizeof(getters));
+    for (i = 0; i < CRED_THREADS; ++i) {
+        getters[i].md = mds[i % 2];
+        ck_assert_int_eq(apr_thread_create(&threads[i], NULL, cred_get, &getters[i], p),
+                         APR_SUCCESS);
+    }
+    for (i = 0; i < CRED_THREADS; ++i) {
+        apr_thread_join(&rv, threads[i]);
+    }
+    ck_assert_int_eq(md_reg_get_cred_objects(&pkeys, &chains[0], g_reg, mds[0], p), APR_SUCCESS);
+    ck_assert_int_eq(md_reg_get_cred_objects(&pkeys, &chains[1], g_reg, mds[1], p), APR_SUCCESS);
+    ck_assert_ptr_ne(first_x509(chains[0]), first_x509(chains[1]));
+    for (i = 0; i < CRED_THREADS; ++i) {
+        ck_assert_int_eq(getters[i].rv, APR_SUCCESS);
+        ck_assert_ptr_eq(getters[i].x509, first_x509(chains[i % 2]));
+    }
+}
+END_TEST
+
+#endif /* APR_HAS_THREADS */
+
+TCase *md_reg_test_case(void)
+{
+    TCase *testcase = tcase_create("md_reg");
+
+    tcase_add_checked_fixture(testcase, md_reg_test_setup, md_reg_test_teardown);
+
+    tcase_add_test(testcase, md_reg_cred_objects_shared);
+    tcase_add_test(testcase, md_reg_cred_objects_alt_specs);
+    tcase_add_test(testcase, md_reg_stage_busy);
+#if APR_HAS_THREADS
+    tcase_add_test(testcase, md_reg_cred_objects_parallel);
+#endif
+
+    return testcase;
+}
@@ -0,0 +1,98 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+
+#include "test_common.h"
+#include "md_snap.h"
+
+/*
+ * Helpers
+ */
+
+static apr_status_t count_destroyed(void *data)
+{
+    ++*(int*)data;
+    return APR_SUCCESS;
+}
+
+/*
+ * Test Fixture -- runs once per test
+ */
+
+static apr_pool_t *g_pool;
+
+static void md_snap_test_setup(void)
+{
+    if (apr_pool_create(&g_pool, NULL) != APR_SUCCESS) {
+        exit(1);
+    }
+}
+
+static void md_snap_test_teardown(void)
+{
+    apr_pool_destroy(g_pool);
+}
+
+/*
+ * Tests
+ */
+
+START_TEST(md_snap_publish)
+{
+    md_snap_slot_t *slot;
+    apr_pool_t *pa, *pb;
+    const char *a = "a", *b = "b";
+    apr_uint32_t token, token2;
+    int destroyed = 0;
+    
+    slot = md_snap_slot_make(g_pool);
+    ck_assert_ptr_eq(md_snap_acquire(slot, &token), NULL);
+    md_snap_release(slot, token);
+    
+    ck_assert_int_eq(apr_pool_create(&pa, g_pool), APR_SUCCESS);
+    apr_pool_cleanup_register(pa, &destroyed, count_destroyed, apr_pool_cleanup_null);
+    md_snap_publish(slot, a, pa);
+    ck_assert_ptr_eq(md_snap_acquire(slot, &token), a);
+    ck_assert_ptr_eq(md_snap_acquire(slot, &token2), a);
+    md_snap_release(slot, token2);
+    md_snap_release(slot, token);
+    ck_assert_int_eq(destroyed, 0);
+    
+    /* nothing holds the first one, it is destroyed on publishing the next */
+    ck_assert_int_eq(apr_pool_create(&pb, g_pool), APR_SUCCESS);
+    apr_pool_cleanup_register(pb, &destroyed, count_destroyed, apr_pool_cleanup_null);
+    md_snap_publish(slot, b, pb);
+    ck_assert_int_eq(destroyed, 1);
+    ck_assert_ptr_eq(md_snap_acquire(slot, &token), b);
+    ck_assert((token & 1) != (token2 & 1));
+    md_snap_release(slot, token);
+    
+    md_snap_publish(slot, NULL, NULL);
+    ck_assert_int_eq(destroyed, 2);
+    ck_assert_ptr_eq(md_snap_acquire(slot, &token), NULL);
+    md_snap_release(slot, token);
+}
+END_TEST
+
+TCase *md_snap_test_case(void)
+{
+    TCase *testcase = tcase_create("md_snap");
+
+    tcase_add_checked_fixture(testcase, md_snap_test_setup, md_snap_test_teardown);
+
+    tcase_add_test(testcase, md_snap_publish);
+
+    return testcase;
+}
@@ -0,0 +1,661 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <apr_file_io.h>
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <apr_thread_proc.h>
+
+#include "test_common.h"
+#include "md.h"
+#include "md_crypt.h"
+#include "md_store.h"
+#include "md_store_fs.h"
+#include "md_store_kv.h"
+#include "md_util.h"
+
+/*
+ * Helpers
+ */
+
+/* A key/value service in memory, values may be limited in size like in a socache */
+typedef struct {
+    md_store_kv_t kv;
+    apr_pool_t *p;
+    apr_hash_t *values;
+    apr_size_t max_len;
+} mem_kv_t;
+
+static apr_status_t mem_get(md_store_kv_t *kv, const char *key,
+                            const char **pvalue, apr_size_t *plen, apr_pool_t *p)
+{
+    mem_kv_t *mem = kv->baton;
+    const char *value = apr_hash_get(mem->values, key, APR_HASH_KEY_STRING);
+
+    if (!value) {
+        return APR_ENOENT;
+    }
+    *plen = strlen(value);
+    *pvalue = apr_pstrmemdup(p, value, *plen);
+    return APR_SUCCESS;
+}
+
+static apr_status_t mem_set(md_store_kv_t *kv, const char *key,
+                            const char *value, apr_size_t len, apr_pool_t *p)
+{
+    mem_kv_t *mem = kv->baton;
+
+    (void)p;
+    if (mem->max_len && len > mem->max_len) {
+        return APR_ENOSPC;
+    }
+    apr_hash_set(mem->values, apr_pstrdup(mem->p, key), APR_HASH_KEY_STRING,
+                 apr_pstrmemdup(mem->p, value, len));
+    return APR_SUCCESS;
+}
+
+static apr_status_t mem_remove(md_store_kv_t *kv, const char *key, apr_pool_t *p)
+{
+    mem_kv_t *mem = kv->baton;
+
+    (void)p;
+    if (!apr_hash_get(mem->values, key, APR_HASH_KEY_STRING)) {
+        return APR_ENOENT;
+    }
+    apr_hash_set(mem->values, key, APR_HASH_KEY_STRING, NULL);
+    return APR_SUCCESS;
+}
+
+static md_store_kv_t *mem_kv_make(apr_pool_t *p, apr_size_t max_len)
+{
+    mem_kv_t *mem = apr_pcalloc(p, sizeof(*mem));
+
+    mem->p = p;
+    mem->values = apr_hash_make(p);
+    mem->max_len = max_len;
+    mem->kv.baton = mem;
+    mem->kv.get = mem_get;
+    mem->kv.set = mem_set;
+    mem->kv.remove = mem_remove;
+    return &mem->kv;
+}
+
+static const char *g_dir;
+
+/* A server using the service, with a cache dir of its own. Indices are fetched every
+ * time, as if the other server changed them a while ago. */
+static md_store_t *make_store(md_store_kv_t *kv, const char *server, apr_pool_t *p)
+{
+    md_store_t *store;
+
+    ck_assert_int_eq(md_store_kv_init(&store, p, kv, apr_pstrcat(p, g_dir, "/", server, NULL),
+                                      0), APR_SUCCESS);
+    return store;
+}
+
+static void save_text(md_store_t *store, md_store_group_t group, const char *name,
+                      const char *aspect, const char *text, apr_pool_t *p)
+{
+    ck_assert_int_eq(md_store_save(store, p, group, name, aspect, MD_SV_TEXT,
+                                   (void*)text, 0), APR_SUCCESS);
+}
+
+static const char *load_text(md_store_t *store, md_store_group_t group, const char *name,
+                             const char *aspect, apr_pool_t *p)
+{
+    void *text;
+
+    if (APR_SUCCESS != md_store_load(store, group, name, aspect, MD_SV_TEXT, &text, p)) {
+        return NULL;
+    }
+    return text;
+}
+
+static int collect(void *baton, const char *name, const char *aspect,
+                   md_store_vtype_t vtype, void *value, apr_pool_t *ptemp)
+{
+    apr_array_header_t *found = baton;
+
+    (void)vtype;
+    (void)ptemp;
+    APR_ARRAY_PUSH(found, const char*) = apr_psprintf(found->pool, "%s/%s=%s",
+                                                      name, aspect, (const char*)value);
+    return 1;
+}
+
+static int found_has(apr_array_header_t *found, const char *entry)
+{
+    int i;
+
+    for (i = 0; i < found->nelts; ++i) {
+        if (!strcmp(entry, APR_ARRAY_IDX(found, i, const char*))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Test Fixture -- runs once per test
+ */
+
+static apr_pool_t *g_pool;
+
+static void md_store_test_setup(void)
+{
+    const char *tmp;
+
+    if (apr_pool_create(&g_pool, NULL) != APR_SUCCESS
+        || md_crypt_init(g_pool) != APR_SUCCESS
+        || apr_temp_dir_get(&tmp, g_pool) != APR_SUCCESS) {
+        exit(1);
+    }
+    g_dir = apr_psprintf(g_pool, "%s/md-store-%d", tmp, (int)getpid());
+    md_util_rm_recursive(g_dir, g_pool, 5);
+}
+
+static void md_store_test_teardown(void)
+{
+    md_util_rm_recursive(g_dir, g_pool, 5);
+    apr_pool_destroy(g_pool);
+}
+
+START_TEST(md_store_kv_shared)
+{
+    apr_pool_t *p = g_pool;
+    md_store_kv_t *kv = mem_kv_make(p, 0);
+    md_store_t *a, *b;
+
+    a = make_store(kv, "a", p);
+    b = make_store(kv, "b", p);
+
+    /* what one server saves, the other loads */
+    save_text(a, MD_SG_DOMAINS, "example.org", "md.json", "a1", p);
+    ck_assert_str_eq(load_text(b, MD_SG_DOMAINS, "example.org", "md.json", p), "a1");
+    save_text(b, MD_SG_DOMAINS, "example.org", "md.json", "b1", p);
+    ck_assert_str_eq(load_text(a, MD_SG_DOMAINS, "example.org", "md.json", p), "b1");
+    ck_assert(md_store_get_modified(a, MD_SG_DOMAINS, "example.org", "md.json", p) > 0);
+
+    /* asking to create an existing value fails, also on the other server */
+    ck_assert_int_eq(md_store_save(a, p, MD_SG_DOMAINS, "example.org", "md.json", MD_SV_TEXT,
+                                   (void*)"a2", 1), APR_EEXIST);
+    ck_assert_ptr_eq(load_text(b, MD_SG_DOMAINS, "example.net", "md.json", p), NULL);
+}
+END_TEST
+
+START_TEST(md_store_kv_no_lost_updates)
+{
+    apr_pool_t *p = g_pool;
+    md_store_kv_t *kv = mem_kv_make(p, 0);
+    md_store_t *a, *b;
+    apr_array_header_t *found;
+
+    a = make_store(kv, "a", p);
+    b = make_store(kv, "b", p);
+
+    /* both servers change the same group and the same name in turn */
+    save_text(a, MD_SG_DOMAINS, "a.example.org", "md.json", "a", p);
+    save_text(b, MD_SG_DOMAINS, "b.example.org", "md.json", "b", p);
+    save_text(a, MD_SG_DOMAINS, "b.example.org", "pubcert.pem", "a-cert", p);
+    save_text(b, MD_SG_DOMAINS, "a.example.org", "pubcert.pem", "b-cert", p);
+
+    found = apr_array_make(p, 5, sizeof(const char*));
+    ck_assert_int_eq(md_store_iter(collect, found, a, p, MD_SG_DOMAINS, "*", "*", MD_SV_TEXT),
+                     APR_SUCCESS);
+    ck_assert_int_eq(found->nelts, 4);
+    ck_assert(found_has(found, "a.example.org/md.json=a"));
+    ck_assert(found_has(found, "a.example.org/pubcert.pem=b-cert"));
+    ck_assert(found_has(found, "b.example.org/md.json=b"));
+    ck_assert(found_has(found, "b.example.org/pubcert.pem=a-cert"));
+
+    /* patterns select names and aspects */
+    found = apr_array_make(p, 5, sizeof(const char*));
+    ck_assert_int_eq(md_store_iter(collect, found, b, p, MD_SG_DOMAINS, "a.*", "md.json",
+                                   MD_SV_TEXT), APR_SUCCESS);
+    ck_assert_int_eq(found->nelts, 1);
+    ck_assert(found_has(found, "a.example.org/md.json=a"));
+}
+END_TEST
+
+START_TEST(md_store_kv_locks)
+{
+    apr_pool_t *p = g_pool;
+    md_store_kv_t *kv = mem_kv_make(p, 0);
+    md_store_t *a, *b;
+    md_store_lock_t *la, *lb;
+
+    a = make_store(kv, "a", p);
+    b = make_store(kv, "b", p);
+
+    /* an exclusive lock keeps the other server out */
+    ck_assert_int_eq(md_store_lock(&la, a, p, MD_SG_STAGING, "example.org", 1, 0), APR_SUCCESS);
+    ck_assert_ptr_nonnull(la);
+    ck_assert_int_eq(md_store_lock(&lb, b, p, MD_SG_STAGING, "example.org", 1, 0), APR_TIMEUP);
+    /* other names are not affected, nor are changes to the group */
+    ck_assert_int_eq(md_store_lock(&lb, b, p, MD_SG_STAGING, "example.net", 1, 0), APR_SUCCESS);
+    md_store_unlock(b, lb);
+    save_text(b, MD_SG_STAGING, "example.org", "md.json", "b", p);
+
+    md_store_unlock(a, la);
+    ck_assert_int_eq(md_store_lock(&lb, b, p, MD_SG_STAGING, "example.org", 1, 0), APR_SUCCESS);
+    ck_assert_int_eq(md_store_lock(&la, a, p, MD_SG_STAGING, "example.org", 1,
+                                   apr_time_from_msec(100)), APR_TIMEUP);
+    md_store_unlock(b, lb);
+
+    /* shared locks are local */
+    ck_assert_int_eq(md_store_lock(&la, a, p, MD_SG_DOMAINS, NULL, 0, 0), APR_SUCCESS);
+    ck_assert_int_eq(md_store_lock(&lb, b, p, MD_SG_DOMAINS, NULL, 1, 0), APR_SUCCESS);
+    md_store_unlock(b, lb);
+    md_store_unlock(a, la);
+}
+END_TEST
+
+START_TEST(md_store_kv_remove_purge_move)
+{
+    apr_pool_t *p = g_pool;
+    md_store_kv_t *kv = mem_kv_make(p, 0);
+    md_store_t *a, *b;
+    apr_array_header_t *found;
+
+    a = make_store(kv, "a", p);
+    b = make_store(kv, "b", p);
+
+    save_text(a, MD_SG_DOMAINS, "example.org", "md.json", "domains", p);
+    save_text(a, MD_SG_DOMAINS, "example.org", "pubcert.pem", "old", p);
+    save_text(a, MD_SG_STAGING, "example.org", "md.json", "staging", p);
+    save_text(a, MD_SG_STAGING, "example.org", "pubcert.pem", "new", p);
+    save_text(a, MD_SG_STAGING, "example.org", "job.json", "job", p);
+
+    /* remove is seen by the other server, a second one fails unless forced */
+    ck_assert_int_eq(md_store_remove(b, MD_SG_STAGING, "example.org", "job.json", p, 0),
+                     APR_SUCCESS);
+    ck_assert_ptr_eq(load_text(a, MD_SG_STAGING, "example.org", "job.json", p), NULL);
+    ck_assert_int_eq(md_store_remove(a, MD_SG_STAGING, "example.org", "job.json", p, 0),
+                     APR_ENOENT);
+    ck_assert_int_eq(md_store_remove(a, MD_SG_STAGING, "example.org", "job.json", p, 1),
+                     APR_SUCCESS);
+
+    /* moving with archive keeps the replaced values */
+    ck_assert_int_eq(md_store_move(b, p, MD_SG_STAGING, MD_SG_DOMAINS, "example.org", 0),
+                     APR_EEXIST);
+    ck_assert_int_eq(md_store_move(b, p, MD_SG_STAGING, MD_SG_DOMAINS, "example.org", 1),
+                     APR_SUCCESS);
+    ck_assert_str_eq(load_text(a, MD_SG_DOMAINS, "example.org", "pubcert.pem", p), "new");
+    ck_assert_str_eq(load_text(a, MD_SG_DOMAINS, "example.org", "md.json", p), "staging");
+    ck_assert_str_eq(load_text(a, MD_SG_ARCHIVE, "example.org.1", "pubcert.pem", p), "old");
+    ck_assert_ptr_eq(load_text(a, MD_SG_STAGING, "example.org", "md.json", p), NULL);
+    ck_assert_int_eq(md_store_move(a, p, MD_SG_STAGING, MD_SG_DOMAINS, "example.org", 1),
+                     APR_ENOENT);
+
+    /* the next archive gets the next number */
+    save_text(a, MD_SG_STAGING, "example.org", "md.json", "again", p);
+    ck_assert_int_eq(md_store_move(a, p, MD_SG_STAGING, MD_SG_DOMAINS, "example.org", 1),
+                     APR_SUCCESS);
+    ck_assert_str_eq(load_text(b, MD_SG_ARCHIVE, "example.org.2", "md.json", p), "staging");
+
+    /* purge takes the name out of its group */
+    ck_assert_int_eq(md_store_purge(a, p, MD_SG_ARCHIVE, "example.org.1"), APR_SUCCESS);
+    found = apr_array_make(p, 5, sizeof(const char*));
+    ck_assert_int_eq(md_store_iter(collect, found, b, p, MD_SG_ARCHIVE, "*", "md.json",
+                                   MD_SV_TEXT), APR_SUCCESS);
+    ck_assert_int_eq(found->nelts, 1);
+    ck_assert(found_has(found, "example.org.2/md.json=staging"));
+}
+END_TEST
+
+START_TEST(md_store_kv_small_values)
+{
+    apr_pool_t *p = g_pool;
+    md_store_kv_t *kv = mem_kv_make(p, 1024);
+    md_store_t *a, *b;
+    apr_array_header_t *found;
+    const char *name;
+    int i, j;
+
+    a = make_store(kv, "a", p);
+    b = make_store(kv, "b", p);
+
+    /* one index for all would not fit into a value, one per name does */
+    for (i = 0; i < 20; ++i) {
+        name = apr_psprintf(p, "www%02d.example.org", i);
+        for (j = 0; j < 5; ++j) {
+            save_text((i % 2)? a : b, MD_SG_DOMAINS, name, apr_psprintf(p, "aspect%d.json", j),
+                      name, p);
+        }
+    }
+    found = apr_array_make(p, 100, sizeof(const char*));
+    ck_assert_int_eq(md_store_iter(collect, found, a, p, MD_SG_DOMAINS, "*", "aspect0.json",
+                                   MD_SV_TEXT), APR_SUCCESS);
+    ck_assert_int_eq(found->nelts, 20);
+    ck_assert(found_has(found, "www07.example.org/aspect0.json=www07.example.org"));
+
+    /* values that do not fit are refused */
+    name = apr_psprintf(p, "%01100d", 0);
+    ck_assert_int_eq(md_store_save(a, p, MD_SG_DOMAINS, "big.example.org", "md.json",
+                                   MD_SV_TEXT, (void*)name, 0), APR_ENOSPC);
+    ck_assert_ptr_eq(load_text(b, MD_SG_DOMAINS, "big.example.org", "md.json", p), NULL);
+}
+END_TEST
+
+static md_store_t *make_fs_store(apr_pool_t *p)
+{
+    md_store_t *store;
+
+    ck_assert_int_eq(md_store_fs_init(&store, p, apr_pstrcat(p, g_dir, "/shared", NULL)),
+                     APR_SUCCESS);
+    return store;
+}
+
+START_TEST(md_store_lease_owners)
+{
+    apr_pool_t *p = g_pool;
+    md_store_t *store = make_fs_store(p);
+    apr_interval_time_t ttl = apr_time_from_sec(60);
+
+    ck_assert_int_eq(md_store_lease_check(store, p, "example.org", "a"), APR_ENOENT);
+    ck_assert_int_eq(md_store_lease_acquire(store, p, "example.org", "a", ttl), APR_SUCCESS);
+    ck_assert_int_eq(md_store_lease_acquire(store, p, "example.org", "b", ttl), APR_EBUSY);
+    ck_assert_int_eq(md_store_lease_check(store, p, "example.org", "a"), APR_SUCCESS);
+    ck_assert_int_eq(md_store_lease_check(store, p, "example.org", "b"), APR_EBUSY);
+    /* the holder extends it, others cannot give it up */
+    ck_assert_int_eq(md_store_lease_acquire(store, p, "example.org", "a", ttl), APR_SUCCESS);
+    ck_assert_int_eq(md_store_lease_release(store, p, "example.org", "b"), APR_SUCCESS);
+    ck_assert_int_eq(md_store_lease_check(store, p, "example.org", "a"), APR_SUCCESS);
+    /* leases are per MD */
+    ck_assert_int_eq(md_store_lease_acquire(store, p, "example.net", "b", ttl), APR_SUCCESS);
+
+    ck_assert_int_eq(md_store_lease_release(store, p, "example.org", "a"), APR_SUCCESS);
+    ck_assert_int_eq(md_store_lease_check(store, p, "example.org", "a"), APR_ENOENT);
+    ck_assert_int_eq(md_store_lease_acquire(store, p, "example.org", "b", ttl), APR_SUCCESS);
+}
+END_TEST
+
+START_TEST(md_store_lease_expiry)
+{
+    apr_pool_t *p = g_pool;
+    md_store_t *store = make_fs_store(p);
+
+    ck_assert_int_eq(md_store_lease_acquire(store, p, "example.org", "a", apr_time_from_sec(1)),
+                     APR_SUCCESS);
+    apr_sleep(apr_time_from_sec(2));
+    /* a holder missing its heartbeats loses the lease */
+    ck_assert_int_eq(md_store_lease_check(store, p, "example.org", "a"), APR_ENOENT);
+    ck_assert_int_eq(md_store_lease_acquire(store, p, "example.org", "b", apr_time_from_sec(60)),
+                     APR_SUCCESS);
+    ck_assert_int_eq(md_store_lease_check(store, p, "example.org", "a"), APR_EBUSY);
+}
+END_TEST
+
+static md_cert_t *make_cert(const char *cn, apr_pool_t *p)
+{
+    md_pkey_spec_t spec;
+    md_pkey_t *pkey;
+    md_cert_t *cert;
+
+    spec.type = MD_PKEY_TYPE_EC;
+    spec.params.ec.curve = "P-256";
+    ck_assert_int_eq(md_pkey_gen(&pkey, p, &spec), APR_SUCCESS);
+    ck_assert_int_eq(md_cert_self_sign(&cert, cn, apr_array_make(p, 1, sizeof(char*)), pkey,
+                                       apr_time_from_sec(3600), p), APR_SUCCESS);
+    return cert;
+}
+
+static const char *cert_str(md_cert_t *cert, apr_pool_t *p)
+{
+    const char *s64;
+
+    ck_assert_int_eq(md_cert_to_base64url(&s64, cert, p), APR_SUCCESS);
+    return s64;
+}
+
+START_TEST(md_store_issuers_chain)
+{
+    apr_pool_t *p = g_pool;
+    md_store_t *store = make_fs_store(p);
+    md_issuer_t issuer, *loaded;
+    md_cert_t *inter;
+    apr_time_t expires = apr_time_from_sec(apr_time_sec(apr_time_now()) + 3600);
+    const char *url;
+    int hops;
+
+    /* an intermediate pointing up to the root, which has no certificates of its own */
+    inter = make_cert("intermediate", p);
+    memset(&issuer, 0, sizeof(issuer));
+    issuer.url = "https://ca.example.org/chain/1";
+    issuer.etag = "\"abc\"";
+    issuer.expires = expires;
+    issuer.up = "https://ca.example.org/chain/root";
+    issuer.certs = apr_array_make(p, 1, sizeof(md_cert_t*));
+    APR_ARRAY_PUSH(issuer.certs, md_cert_t*) = inter;
+    ck_assert_int_eq(md_issuer_save(store, p, &issuer), APR_SUCCESS);
+
+    memset(&issuer, 0, sizeof(issuer));
+    issuer.url = "https://ca.example.org/chain/root";
+    issuer.expires = expires;
+    ck_assert_int_eq(md_issuer_save(store, p, &issuer), APR_SUCCESS);
+
+    ck_assert_int_eq(md_issuer_load(&loaded, store, "https://ca.example.org/chain/1", p),
+                     APR_SUCCESS);
+    ck_assert_str_eq(loaded->url, "https://ca.example.org/chain/1");
+    ck_assert_str_eq(loaded->etag, "\"abc\"");
+    ck_assert_str_eq(loaded->up, "https://ca.example.org/chain/root");
+    ck_assert(loaded->expires == expires);
+    ck_assert_int_eq(loaded->certs->nelts, 1);
+    ck_assert_str_eq(cert_str(APR_ARRAY_IDX(loaded->certs, 0, md_cert_t*), p),
+                     cert_str(inter, p));
+
+    /* following the links ends on the root entry */
+    for (url = "https://ca.example.org/chain/1", hops = 0; url; url = loaded->up, ++hops) {
+        ck_assert_int_eq(md_issuer_load(&loaded, store, url, p), APR_SUCCESS);
+    }
+    ck_assert_int_eq(hops, 2);
+    ck_assert_str_eq(loaded->url, "https://ca.example.org/chain/root");
+    ck_assert_ptr_eq(loaded->etag, NULL);
+    ck_assert_int_eq(loaded->certs->nelts, 0);
+
+    ck_assert_int_eq(md_issuer_load(&loaded, store, "https://ca.example.org/chain/2", p),
+                     APR_ENOENT);
+    ck_assert_ptr_eq(loaded, NULL);
+}
+END_TEST
+
+START_TEST(md_store_csr_for)
+{
+    apr_pool_t *p = g_pool;
+    md_store_t *store = make_fs_store(p);
+    md_pkey_spec_t spec, rsa_spec;
+    md_pkey_t *pkey, *other;
+    apr_array_header_t *domains, *more;
+    const char *csr, *loaded;
+
+    spec.type = MD_PKEY_TYPE_EC;
+    spec.params.ec.curve = "P-256";
+    ck_assert_int_eq(md_pkey_gen(&pkey, p, &spec), APR_SUCCESS);
+    ck_assert_int_eq(md_pkey_gen(&other, p, &spec), APR_SUCCESS);
+    domains = apr_array_make(p, 2, sizeof(const char*));
+    APR_ARRAY_PUSH(domains, const char*) = "example.org";
+    APR_ARRAY_PUSH(domains, const char*) = "www.example.org";
+    more = apr_array_copy(p, domains);
+    APR_ARRAY_PUSH(more, const char*) = "mail.example.org";
+
+    ck_assert_int_eq(md_cert_req_create(&csr, "example.org", domains, 0, pkey, p),
+                     APR_SUCCESS);
+    ck_assert_int_eq(md_csr_save_for(store, p, MD_SG_STAGING, "example.org", &spec, csr,
+                                     domains, 0), APR_SUCCESS);
+
+    ck_assert_int_eq(md_csr_load_for(&loaded, store, MD_SG_STAGING, "example.org", &spec,
+                                     domains, 0, p), APR_SUCCESS);
+    ck_assert_str_eq(loaded, csr);
+    ck_assert(md_cert_req_is_for(loaded, pkey, p));
+    ck_assert(!md_cert_req_is_for(loaded, other, p));
+
+    /* made for something else, it is not found */
+    ck_assert_int_eq(md_csr_load_for(&loaded, store, MD_SG_STAGING, "example.org", &spec,
+                                     more, 0, p), APR_ENOENT);
+    ck_assert_ptr_eq(loaded, NULL);
+    ck_assert_int_eq(md_csr_load_for(&loaded, store, MD_SG_STAGING, "example.org", &spec,
+                                     domains, 1, p), APR_ENOENT);
+    rsa_spec.type = MD_PKEY_TYPE_RSA;
+    rsa_spec.params.rsa.bits = 2048;
+    ck_assert_int_eq(md_csr_load_for(&loaded, store, MD_SG_STAGING, "example.org", &rsa_spec,
+                                     domains, 0, p), APR_ENOENT);
+}
+END_TEST
+
+static const char *ev_str(md_store_fs_ev_t ev, unsigned int group, const char *fname,
+                          apr_pool_t *p)
+{
+    const char *base = strrchr(fname, '/');
+
+    return apr_psprintf(p, "%d:%u:%s", (int)ev, group, base? base + 1 : fname);
+}
+
+static apr_status_t record_ev(void *baton, md_store_t *store, md_store_fs_ev_t ev,
+                              unsigned int group, const char *fname, apr_filetype_e ftype,
+                              apr_pool_t *p)
+{
+    apr_array_header_t *events = baton;
+
+    (void)store;
+    (void)ftype;
+    (void)p;
+    APR_ARRAY_PUSH(events, const char*) = ev_str(ev, group, fname, events->pool);
+    return APR_SUCCESS;
+}
+
+START_TEST(md_store_fs_events)
+{
+    apr_pool_t *p = g_pool;
+    md_store_t *store = make_fs_store(p);
+    apr_array_header_t *events = apr_array_make(p, 10, sizeof(const char*));
+    md_store_txn_t *txn;
+
+    /* holders of copies reload on every change the store reports */
+    ck_assert_int_eq(md_store_fs_set_event_cb(store, record_ev, events), APR_SUCCESS);
+    ck_assert_int_eq(md_store_save(store, p, MD_SG_STAGING, "example.org", "a.txt",
+                                   MD_SV_TEXT, (void*)"1", 1), APR_SUCCESS);
+    ck_assert(found_has(events, ev_str(MD_S_FS_EV_CREATED, MD_SG_STAGING, "a.txt", p)));
+
+    apr_array_clear(events);
+    save_text(store, MD_SG_STAGING, "example.org", "a.txt", "2", p);
+    ck_assert(found_has(events, ev_str(MD_S_FS_EV_CHANGED, MD_SG_STAGING, "a.txt", p)));
+
+    apr_array_clear(events);
+    txn = md_store_txn_begin(store, p, MD_SG_STAGING, "example.org");
+    md_store_txn_save(txn, "a.txt", MD_SV_TEXT, (void*)"3");
+    md_store_txn_save(txn, "b.txt", MD_SV_TEXT, (void*)"3");
+    ck_assert_int_eq(md_store_txn_commit(txn), APR_SUCCESS);
+    ck_assert(found_has(events, ev_str(MD_S_FS_EV_CHANGED, MD_SG_STAGING, "a.txt", p)));
+    ck_assert(found_has(events, ev_str(MD_S_FS_EV_CHANGED, MD_SG_STAGING, "b.txt", p)));
+
+    apr_array_clear(events);
+    ck_assert_int_eq(md_store_remove(store, MD_SG_STAGING, "example.org", "b.txt", p, 0),
+                     APR_SUCCESS);
+    ck_assert_int_eq(events->nelts, 1);
+    ck_assert(found_has(events, ev_str(MD_S_FS_EV_REMOVED, MD_SG_STAGING, "b.txt", p)));
+
+    /* a name moving to another group changes both */
+    save_text(store, MD_SG_DOMAINS, "other.org", "a.txt", "1", p);
+    apr_array_clear(events);
+    ck_assert_int_eq(md_store_move(store, p, MD_SG_STAGING, MD_SG_DOMAINS, "example.org", 0),
+                     APR_SUCCESS);
+    ck_assert(found_has(events, ev_str(MD_S_FS_EV_MOVED, MD_SG_DOMAINS, "example.org", p)));
+    ck_assert(found_has(events, ev_str(MD_S_FS_EV_REMOVED, MD_SG_STAGING, "example.org", p)));
+    ck_assert_str_eq(load_text(store, MD_SG_DOMAINS, "example.org", "a.txt", p), "3");
+}
+END_TEST
+
+#if APR_HAS_THREADS
+
+typedef struct {
+    md_store_t *store;
+    const char *owner;
+    apr_status_t rv;
+} lease_taker_t;
+
+static void * APR_THREAD_FUNC lease_take(apr_thread_t *thread, void *data)
+{
+    lease_taker_t *taker = data;
+    apr_pool_t *p;
+
+    (void)thread;
+    apr_pool_create(&p, NULL);
+    taker->rv = md_store_lease_acquire(taker->store, p, "example.org", taker->owner,
+                                       apr_time_from_sec(60));
+    apr_pool_destroy(p);
+    return NULL;
+}
+
+START_TEST(md_store_lease_race)
+{
+    apr_pool_t *p = g_pool;
+    lease_taker_t takers[2];
+    apr_thread_t *threads[2];
+    apr_status_t rv;
+    int i;
+
+    /* two servers, each with a store of its own on the same files, take the free
+     * lease at the same time: exactly one of them gets it */
+    memset(takers, 0, sizeof(takers));
+    for (i = 0; i < 2; ++i) {
+        takers[i].store = make_fs_store(p);
+        takers[i].owner = i? "b" : "a";
+    }
+    for (i = 0; i < 2; ++i) {
+        ck_assert_int_eq(apr_thread_create(&threads[i], NULL, lease_take, &takers[i], p),
+                         APR_SUCCESS);
+    }
+    for (i = 0; i < 2; ++i) {
+        apr_thread_join(&rv, threads[i]);
+    }
+    ck_assert((APR_SUCCESS == takers[0].rv) != (APR_SUCCESS == takers[1].rv));
+    for (i = 0; i < 2; ++i) {
+        ck_assert(APR_SUCCESS == takers[i].rv || APR_STATUS_IS_EBUSY(takers[i].rv));
+        ck_assert_int_eq(md_store_lease_check(takers[0].store, p, "example.org", takers[i].owner),
+                         takers[i].rv);
+    }
+}
+END_TEST
+
+#endif /* APR_HAS_THREADS */
+
+TCase *md_store_test_case(void)
+{
+    TCase *testcase = tcase_create("md_store");
+
+    tcase_add_checked_fixture(testcase, md_store_test_setup, md_store_test_teardown);
+    /* claims and leases wait for other servers to settle */
+    tcase_set_timeout(testcase, 30);
+
+    tcase_add_test(testcase, md_store_kv_shared);
+    tcase_add_test(testcase, md_store_kv_no_lost_updates);
+    tcase_add_test(testcase, md_store_kv_locks);
+    tcase_add_test(testcase, md_store_kv_remove_purge_move);
+    tcase_add_test(testcase, md_store_kv_small_values);
+    tcase_add_test(testcase, md_store_lease_owners);
+    tcase_add_test(testcase, md_store_lease_expiry);
+    tcase_add_test(testcase, md_store_issuers_chain);
+    tcase_add_test(testcase, md_store_csr_for);
+    tcase_add_test(testcase, md_store_fs_events);
+#if APR_HAS_THREADS
+    tcase_add_test(testcase, md_store_lease_race);
+#endif
+
+    return testcase;
+}
@@ -0,0 +1,184 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <apr_strings.h>
+#include <apr_time.h>
+
+#include "test_common.h"
+#include "md_json.h"
+#include "md_trace.h"
+
+/*
+ * Helpers
+ */
+
+static int count_rec(void *baton, size_t index, md_json_t *json)
+{
+    (void)index;
+    (void)json;
+    ++*(int*)baton;
+    return 1;
+}
+
+static int records(md_json_t *json)
+{
+    int count = 0;
+    
+    md_json_itera(count_rec, &count, json, "records", NULL);
+    return count;
+}
+
+/*
+ * Test Fixture -- runs once per test
+ */
+
+static apr_pool_t *g_pool;
+
+static void md_trace_test_setup(void)
+{
+    if (apr_pool_create(&g_pool, NULL) != APR_SUCCESS) {
+        exit(1);
+    }
+}
+
+static void md_trace_test_teardown(void)
+{
+    md_trace_init(g_pool, 0);
+    md_trace_set_http_hist(NULL);
+    apr_pool_destroy(g_pool);
+}
+
+/*
+ * Tests
+ */
+
+START_TEST(md_trace_ring)
+{
+    const char *phases[] = { "p0", "p1", "p2", "p3", "p4", "p5" };
+    md_json_t *json;
+    apr_time_t t = apr_time_now();
+    int i;
+    
+    ck_assert(!md_trace_on());
+    /* room for 4 records, the first two are overwritten */
+    ck_assert_int_eq(md_trace_init(g_pool, 3), APR_SUCCESS);
+    ck_assert(md_trace_on());
+    for (i = 0; i < 6; ++i) {
+        md_trace_add(MD_TRACE_PHASE, "a.org", phases[i], 0, t, t + apr_time_from_msec(i + 1));
+    }
+    json = md_trace_dump(g_pool, NULL, 0);
+    ck_assert_int_eq(records(json), 4);
+    ck_assert_int_eq(md_json_getl(json, "phases", "p1", NULL), 0);
+    ck_assert_int_eq(md_json_getl(json, "phases", "p2", NULL), 3);
+    ck_assert_int_eq(md_json_getl(json, "phases", "p5", NULL), 6);
+    ck_assert_int_eq(md_json_getl(json, "http", "requests", NULL), 0);
+    
+    md_trace_add(MD_TRACE_HTTP, "b.org", "GET https://ca.example/dir", 200, 
+                 t, t + apr_time_from_msec(10));
+    json = md_trace_dump(g_pool, "b.org", 0);
+    ck_assert_int_eq(records(json), 1);
+    ck_assert_int_eq(md_json_getl(json, "http", "requests", NULL), 1);
+    ck_assert_int_eq(md_json_getl(json, "http", "ms", NULL), 10);
+    ck_assert_int_eq(md_json_getl(json, "phases", "p5", NULL), 0);
+    json = md_trace_dump(g_pool, NULL, 0);
+    ck_assert_int_eq(md_json_getl(json, "phases", "p2", NULL), 0);
+    ck_assert_int_eq(md_json_getl(json, "phases", "p3", NULL), 4);
+    ck_assert_int_eq(md_json_getl(json, "http", "requests", NULL), 1);
+    
+    ck_assert_int_eq(md_trace_init(g_pool, 0), APR_SUCCESS);
+    ck_assert(!md_trace_on());
+    md_trace_add(MD_TRACE_HTTP, "b.org", "GET https://ca.example/dir", 200, t, t); 
+    json = md_trace_dump(g_pool, NULL, 0);
+    ck_assert_int_eq(records(json), 0);
+    ck_assert_int_eq(md_json_getl(json, "http", "requests", NULL), 0);
+}
+END_TEST
+
+START_TEST(md_trace_mark_run)
+{
+    md_json_t *json;
+    apr_time_t t = apr_time_now();
+    apr_uint32_t mark, early;
+    int i;
+    
+    ck_assert_int_eq(md_trace_init(g_pool, 4), APR_SUCCESS);
+    early = md_trace_mark();
+    md_trace_add(MD_TRACE_PHASE, "a.org", "setup", 0, t, t + apr_time_from_msec(1));
+    
+    /* a run sees only what came after its mark */
+    mark = md_trace_mark();
+    ck_assert_int_eq(mark, early + 1);
+    json = md_trace_dump(g_pool, "a.org", mark);
+    ck_assert_int_eq(records(json), 0);
+    md_trace_add(MD_TRACE_PHASE, "a.org", "authz", 0, t, t + apr_time_from_msec(2));
+    md_trace_add(MD_TRACE_HTTP, "a.org", "POST https://ca.example/order", 201, 
+                 t, t + apr_time_from_msec(3));
+    json = md_trace_dump(g_pool, "a.org", mark);
+    ck_assert_int_eq(records(json), 2);
+    ck_assert_int_eq(md_json_getl(json, "phases", "setup", NULL), 0);
+    ck_assert_int_eq(md_json_getl(json, "phases", "authz", NULL), 2);
+    ck_assert_int_eq(md_json_getl(json, "http", "requests", NULL), 1);
+    
+    /* a mark that has been overwritten since starts with the oldest record kept */
+    for (i = 0; i < 8; ++i) {
+        md_trace_add(MD_TRACE_PHASE, "a.org", "poll", 0, t, t + apr_time_from_msec(1));
+    }
+    json = md_trace_dump(g_pool, "a.org", early);
+    ck_assert_int_eq(records(json), 4);
+    ck_assert_int_eq(md_json_getl(json, "phases", "poll", NULL), 4);
+}
+END_TEST
+
+START_TEST(md_trace_hist)
+{
+    md_trace_hist_t hist;
+    
+    memset(&hist, 0, sizeof(hist));
+    ck_assert_int_eq(md_trace_hist_bound_ms(0), 50);
+    ck_assert_int_eq(md_trace_hist_bound_ms(MD_TRACE_HIST_BUCKETS-1), 0);
+    md_trace_hist_add(&hist, apr_time_from_msec(50));
+    md_trace_hist_add(&hist, apr_time_from_msec(51));
+    md_trace_hist_add(&hist, apr_time_from_sec(3600));
+    ck_assert_int_eq(hist.counts[0], 1);
+    ck_assert_int_eq(hist.counts[1], 1);
+    ck_assert_int_eq(hist.counts[MD_TRACE_HIST_BUCKETS-1], 1);
+    ck_assert_int_eq(hist.sum_ms, 50 + 51 + 3600 * 1000);
+    
+    /* requests are counted without records being kept */
+    ck_assert(!md_trace_on());
+    md_trace_set_http_hist(&hist);
+    ck_assert(md_trace_on());
+    md_trace_add(MD_TRACE_HTTP, NULL, "GET https://ca.example/dir", 200, 0, 
+                 apr_time_from_msec(200));
+    md_trace_set_http_hist(NULL);
+    ck_assert(!md_trace_on());
+    ck_assert_int_eq(hist.counts[2], 1);
+}
+END_TEST
+
+TCase *md_trace_test_case(void)
+{
+    TCase *testcase = tcase_create("md_trace");
+
+    tcase_add_checked_fixture(testcase, md_trace_test_setup, md_trace_test_teardown);
+
+    tcase_add_test(testcase, md_trace_ring);
+    tcase_add_test(testcase, md_trace_mark_run);
+    tcase_add_test(testcase, md_trace_hist);
+
+    return testcase;
+}
@@ -12,7 +12,13 @@
  * limitations under the License.
  */
 
+#include <stdarg.h>
 #include <stdlib.h>
+#include <unistd.h>
+
+#include <apr_file_io.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
 
 #include "test_common.h"
 #include "md_util.h"
@@ -21,6 +27,19 @@
  * Helpers
  */
 
+static apr_time_t local_midnight(apr_time_t t)
+{
+    apr_time_exp_t exp;
+    apr_time_t midnight;
+    
+    apr_time_exp_lt(&exp, t);
+    exp.tm_hour = exp.tm_min = exp.tm_sec = exp.tm_usec = 0;
+    ck_assert(apr_time_exp_gmt_get(&midnight, &exp) == APR_SUCCESS);
+    return midnight;
+}
+
+#define HOURS(h)        apr_time_from_sec((h) * MD_SECS_PER_HOUR)
+
 /*
  * Test Fixture -- runs once per test
  */
@@ -97,6 +116,243 @@ START_TEST(base64_md_util_largetrip)
 }
 END_TEST
 
+START_TEST(base64_md_util_encode_to)
+{
+    char buf[16];
+    
+    ck_assert_uint_eq(md_util_base64url_enclen(0), 0);
+    ck_assert_uint_eq(md_util_base64url_enclen(1), 2);
+    ck_assert_uint_eq(md_util_base64url_enclen(2), 3);
+    ck_assert_uint_eq(md_util_base64url_enclen(3), 4);
+    ck_assert_uint_eq(md_util_base64url_enclen(4), 6);
+    
+    ck_assert_uint_eq(md_util_base64url_encode_to(buf, sizeof(buf), "\xfb\xff", 2), 3);
+    ck_assert_str_eq(buf, "-_8");
+    ck_assert_uint_eq(md_util_base64url_encode_to(buf, sizeof(buf), "1234", 4), 6);
+    ck_assert_str_eq(buf, md_util_base64url_encode("1234", 4, g_pool));
+    /* the terminating 0 has to fit */
+    ck_assert_uint_eq(md_util_base64url_encode_to(buf, 6, "1234", 4), 0);
+    ck_assert_uint_eq(md_util_base64url_encode_to(buf, 7, "1234", 4), 6);
+    ck_assert_uint_eq(md_util_base64url_encode_to(buf, 1, "", 0), 0);
+    ck_assert_str_eq(buf, "");
+}
+END_TEST
+
+START_TEST(md_util_time_window)
+{
+    /* mid July, away from daylight saving changes */
+    apr_time_t day = local_midnight(apr_time_from_sec(1500000000));
+    apr_time_t next_day = day + apr_time_from_sec(MD_SECS_PER_DAY);
+    
+    /* whole day */
+    ck_assert(md_time_window_next(day + HOURS(5), HOURS(3), HOURS(3)) == day + HOURS(5));
+    /* window 02:00-04:00 */
+    ck_assert(md_time_window_next(day + HOURS(1), HOURS(2), HOURS(4)) == day + HOURS(2));
+    ck_assert(md_time_window_next(day + HOURS(3), HOURS(2), HOURS(4)) == day + HOURS(3));
+    ck_assert(md_time_window_next(day + HOURS(4), HOURS(2), HOURS(4)) == next_day + HOURS(2));
+    /* window 22:00-02:00 spans midnight */
+    ck_assert(md_time_window_next(day + HOURS(1), HOURS(22), HOURS(2)) == day + HOURS(1));
+    ck_assert(md_time_window_next(day + HOURS(12), HOURS(22), HOURS(2)) == day + HOURS(22));
+    ck_assert(md_time_window_next(day + HOURS(23), HOURS(22), HOURS(2)) == day + HOURS(23));
+}
+END_TEST
+
+static apr_array_header_t *make_domains(const char *name, ...)
+{
+    apr_array_header_t *domains = apr_array_make(g_pool, 5, sizeof(const char*));
+    va_list ap;
+    
+    va_start(ap, name);
+    for (; name; name = va_arg(ap, const char*)) {
+        APR_ARRAY_PUSH(domains, const char*) = name;
+    }
+    va_end(ap);
+    return domains;
+}
+
+START_TEST(md_util_dns_set)
+{
+    md_dns_set_t *set;
+    
+    set = md_dns_set_make(g_pool, make_domains("Example.org", "*.example.net", 
+                                               "example.org", NULL));
+    ck_assert_int_eq(md_dns_set_count(set), 2);
+    ck_assert_str_eq(md_dns_set_get(set, "EXAMPLE.org"), "Example.org");
+    ck_assert(md_dns_set_get(set, "www.example.net") == NULL);
+    ck_assert_str_eq(md_dns_set_match(set, "www.example.net"), "*.example.net");
+    ck_assert(md_dns_set_match(set, "a.b.example.net") == NULL);
+    ck_assert(md_dns_set_match(set, "example.net") == NULL);
+    ck_assert(!md_dns_set_add(set, "*.EXAMPLE.net"));
+    ck_assert(md_dns_set_add(set, "example.net"));
+    ck_assert_str_eq(md_dns_set_match(set, "example.net"), "example.net");
+}
+END_TEST
+
+START_TEST(md_util_dns_minimal)
+{
+    apr_array_header_t *minimal;
+    
+    minimal = md_dns_make_minimal(g_pool, make_domains("a.example.org", "example.org", 
+                                                       "*.example.org", "b.example.org", 
+                                                       "example.org", "a.b.example.org", NULL));
+    ck_assert_int_eq(minimal->nelts, 3);
+    ck_assert_str_eq(APR_ARRAY_IDX(minimal, 0, const char*), "example.org");
+    ck_assert_str_eq(APR_ARRAY_IDX(minimal, 1, const char*), "*.example.org");
+    ck_assert_str_eq(APR_ARRAY_IDX(minimal, 2, const char*), "a.b.example.org");
+}
+END_TEST
+
+START_TEST(md_util_dns_suffix)
+{
+    ck_assert_str_eq(md_dns_suffix("www.example.org"), "example.org");
+    ck_assert_str_eq(md_dns_suffix("a.b.example.org"), "example.org");
+    ck_assert_str_eq(md_dns_suffix("*.example.org"), "example.org");
+    ck_assert_str_eq(md_dns_suffix("example.org"), "example.org");
+    ck_assert_str_eq(md_dns_suffix("localhost"), "localhost");
+}
+END_TEST
+
+typedef struct {
+    int calls;
+    apr_status_t rv;
+    int exit_code;
+    const char *output;
+} proc_result;
+
+static void proc_done(void *baton, apr_status_t rv, int exit_code, const char *output)
+{
+    proc_result *res = baton;
+    
+    ++res->calls;
+    res->rv = rv;
+    res->exit_code = exit_code;
+    res->output = apr_pstrdup(g_pool, output);
+}
+
+START_TEST(md_util_proc_run)
+{
+    const char * const argv[] = { "/bin/sh", "-c", "echo hello; exit 3", NULL };
+    md_util_proc_t *proc;
+    proc_result res;
+    apr_status_t rv;
+    
+    memset(&res, 0, sizeof(res));
+    ck_assert_int_eq(md_util_proc_start(&proc, g_pool, argv[0], argv, apr_time_from_sec(30), 
+                                        proc_done, &res), APR_SUCCESS);
+    while (APR_STATUS_IS_EAGAIN(rv = md_util_proc_poll(proc))) {
+        apr_sleep(apr_time_from_msec(10));
+    }
+    ck_assert_int_eq(rv, APR_SUCCESS);
+    ck_assert_int_eq(res.calls, 1);
+    ck_assert_int_eq(res.rv, APR_SUCCESS);
+    ck_assert_int_eq(res.exit_code, 3);
+    ck_assert_str_eq(res.output, "hello\n");
+    /* done stays done */
+    ck_assert_int_eq(md_util_proc_poll(proc), APR_SUCCESS);
+    ck_assert_int_eq(res.calls, 1);
+}
+END_TEST
+
+START_TEST(md_util_proc_timeout)
+{
+    const char * const argv[] = { "/bin/sh", "-c", "sleep 30", NULL };
+    apr_time_t start = apr_time_now();
+    int exit_code;
+    
+    ck_assert_int_eq(md_util_exec_timeout(g_pool, argv[0], argv, apr_time_from_msec(200),
+                                          &exit_code), APR_TIMEUP);
+    ck_assert(apr_time_now() - start < apr_time_from_sec(10));
+}
+END_TEST
+
+START_TEST(md_util_rfc3339)
+{
+    apr_time_t t = apr_time_from_sec(1546300800); /* 2019-01-01T00:00:00Z */
+    
+    ck_assert(md_util_parse_rfc3339("2019-01-01T00:00:00Z") == t);
+    ck_assert(md_util_parse_rfc3339("2019-01-01t00:00:00.123456z") == t);
+    ck_assert(md_util_parse_rfc3339("2019-01-01T02:30:00+02:30") == t);
+    ck_assert(md_util_parse_rfc3339("2018-12-31T23:00:00-01:00") == t);
+    ck_assert(md_util_parse_rfc3339(NULL) == 0);
+    ck_assert(md_util_parse_rfc3339("") == 0);
+    ck_assert(md_util_parse_rfc3339("2019-01-01") == 0);
+    ck_assert(md_util_parse_rfc3339("2019-01-01T00:00:00") == 0);
+    ck_assert(md_util_parse_rfc3339("2019-01-01T00:00:00Zx") == 0);
+}
+END_TEST
+
+START_TEST(md_util_file_load_all)
+{
+    const char *tmp, *fpath, *data;
+    apr_size_t len;
+    
+    ck_assert_int_eq(apr_temp_dir_get(&tmp, g_pool), APR_SUCCESS);
+    fpath = apr_psprintf(g_pool, "%s/md-load-%d.txt", tmp, (int)getpid());
+    ck_assert_int_eq(md_text_fcreatex(fpath, APR_FPROT_UREAD|APR_FPROT_UWRITE, g_pool, 
+                                      "0123456789"), APR_SUCCESS);
+    
+    ck_assert_int_eq(md_util_file_load(&data, &len, g_pool, fpath, 0), APR_SUCCESS);
+    ck_assert_uint_eq(len, 10);
+    ck_assert_str_eq(data, "0123456789");
+    ck_assert_int_eq(md_util_file_load(&data, &len, g_pool, fpath, 4), APR_SUCCESS);
+    ck_assert_str_eq(data, "0123");
+    ck_assert_int_eq(md_text_fread8k(&data, g_pool, fpath), APR_SUCCESS);
+    ck_assert_str_eq(data, "0123456789");
+    
+    apr_file_remove(fpath, g_pool);
+    ck_assert(APR_STATUS_IS_ENOENT(md_util_file_load(&data, &len, g_pool, fpath, 0)));
+    ck_assert_ptr_eq(data, NULL);
+}
+END_TEST
+
+static apr_status_t write_abc(void *baton, apr_file_t *f, apr_pool_t *p)
+{
+    apr_size_t len = 3;
+    
+    (void)baton;
+    (void)p;
+    return apr_file_write_full(f, "abc", len, &len);
+}
+
+START_TEST(md_util_freplace_staged)
+{
+    const char *tmp, *dir, *fpath, *stale, *staged, *data;
+    
+    ck_assert_int_eq(apr_temp_dir_get(&tmp, g_pool), APR_SUCCESS);
+    dir = apr_psprintf(g_pool, "%s/md-replace-%d", tmp, (int)getpid());
+    ck_assert_int_eq(apr_dir_make(dir, APR_FPROT_OS_DEFAULT, g_pool), APR_SUCCESS);
+    fpath = apr_pstrcat(g_pool, dir, "/text.txt", NULL);
+    
+    /* a left over temp file of the old naming does not hold up replacing */
+    stale = apr_pstrcat(g_pool, fpath, ".tmp", NULL);
+    ck_assert_int_eq(md_text_fcreatex(stale, APR_FPROT_UREAD|APR_FPROT_UWRITE, g_pool, 
+                                      "stale"), APR_SUCCESS);
+    md_util_durability_set(MD_DURABLE_DIR);
+    ck_assert_int_eq(md_text_freplace(fpath, APR_FPROT_UREAD|APR_FPROT_UWRITE, g_pool, 
+                                      "one"), APR_SUCCESS);
+    ck_assert_int_eq(md_text_freplace(fpath, APR_FPROT_UREAD|APR_FPROT_UWRITE, g_pool, 
+                                      "two"), APR_SUCCESS);
+    md_util_durability_set(MD_DURABLE_NONE);
+    ck_assert_int_eq(md_text_fread8k(&data, g_pool, fpath), APR_SUCCESS);
+    ck_assert_str_eq(data, "two");
+    ck_assert_int_eq(md_text_fread8k(&data, g_pool, stale), APR_SUCCESS);
+    ck_assert_str_eq(data, "stale");
+    
+    /* staging leaves the file in place until the new one is renamed */
+    ck_assert_int_eq(md_util_fstage(&staged, fpath, APR_FPROT_UREAD|APR_FPROT_UWRITE, 
+                                    g_pool, write_abc, NULL), APR_SUCCESS);
+    ck_assert_str_ne(staged, fpath);
+    ck_assert_int_eq(md_text_fread8k(&data, g_pool, fpath), APR_SUCCESS);
+    ck_assert_str_eq(data, "two");
+    ck_assert_int_eq(apr_file_rename(staged, fpath, g_pool), APR_SUCCESS);
+    ck_assert_int_eq(md_text_fread8k(&data, g_pool, fpath), APR_SUCCESS);
+    ck_assert_str_eq(data, "abc");
+    ck_assert_int_eq(md_util_fsync_dir(dir, g_pool), APR_SUCCESS);
+    
+    ck_assert_int_eq(md_util_rm_recursive(dir, g_pool, 1), APR_SUCCESS);
+}
+END_TEST
+
 TCase *md_util_test_case(void)
 {
     TCase *testcase = tcase_create("md_util");
@@ -105,6 +361,16 @@ TCase *md_util_test_case(void)
 
     tcase_add_test(testcase, base64_md_util_roundtrip);
     tcase_add_test(testcase, base64_md_util_largetrip);
+    tcase_add_test(testcase, base64_md_util_encode_to);
+    tcase_add_test(testcase, md_util_time_window);
+    tcase_add_test(testcase, md_util_dns_set);
+    tcase_add_test(testcase, md_util_dns_minimal);
+    tcase_add_test(testcase, md_util_dns_suffix);
+    tcase_add_test(testcase, md_util_proc_run);
+    tcase_add_test(testcase, md_util_proc_timeout);
+    tcase_add_test(testcase, md_util_rfc3339);
+    tcase_add_test(testcase, md_util_file_load_all);
+    tcase_add_test(testcase, md_util_freplace_staged);
 
     return testcase;
 }